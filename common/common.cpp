@@ -181,6 +181,16 @@ bool gpt_params_parse_ex(int argc, char ** argv, gpt_params & params) {
                 break;
             }
             params.path_prompt_cache = argv[i];
+        } else if (arg == "--prelude-cache") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            params.path_prelude_cache = argv[i];
+
+            if (params.path_prelude_cache.back() != DIRECTORY_SEPARATOR) {
+                params.path_prelude_cache += DIRECTORY_SEPARATOR;
+            }
         } else if (arg == "--prompt-cache-all") {
             params.prompt_cache_all = true;
         } else if (arg == "--prompt-cache-ro") {
@@ -254,6 +264,18 @@ bool gpt_params_parse_ex(int argc, char ** argv, gpt_params & params) {
             else if (value == "linear") { params.rope_scaling_type = LLAMA_ROPE_SCALING_LINEAR; }
             else if (value == "yarn")   { params.rope_scaling_type = LLAMA_ROPE_SCALING_YARN; }
             else { invalid_param = true; break; }
+        } else if (arg == "--mpi-split") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            std::string value(argv[i]);
+            /**/ if (value == "layer") { params.mpi_split = LLAMA_MPI_SPLIT_LAYER; }
+            else if (value == "row")   { params.mpi_split = LLAMA_MPI_SPLIT_ROW; }
+            else { invalid_param = true; break; }
+#ifndef GGML_USE_MPI
+            fprintf(stderr, "warning: llama.cpp was compiled without MPI. Setting the MPI split mode has no effect.\n");
+#endif
         } else if (arg == "--rope-scale") {
             if (++i >= argc) {
                 invalid_param = true;
@@ -358,6 +380,18 @@ bool gpt_params_parse_ex(int argc, char ** argv, gpt_params & params) {
                 break;
             }
             sparams.penalty_present = std::stof(argv[i]);
+        } else if (arg == "--repetition-stop-period") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            sparams.repetition_stop_period = std::stoi(argv[i]);
+        } else if (arg == "--repetition-stop-count") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            sparams.repetition_stop_count = std::stoi(argv[i]);
         } else if (arg == "--mirostat") {
             if (++i >= argc) {
                 invalid_param = true;
@@ -415,12 +449,24 @@ bool gpt_params_parse_ex(int argc, char ** argv, gpt_params & params) {
                 break;
             }
             params.n_keep = std::stoi(argv[i]);
+        } else if (arg == "--discard") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            params.n_discard = std::stoi(argv[i]);
         } else if (arg == "--draft") {
             if (++i >= argc) {
                 invalid_param = true;
                 break;
             }
             params.n_draft = std::stoi(argv[i]);
+        } else if (arg == "--ngram-pool") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            params.path_ngram_pool = argv[i];
         } else if (arg == "--chunks") {
             if (++i >= argc) {
                 invalid_param = true;
@@ -506,6 +552,30 @@ bool gpt_params_parse_ex(int argc, char ** argv, gpt_params & params) {
                 break;
             }
             params.image = argv[i];
+        } else if (arg == "--embd-input") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            params.embd_input = argv[i];
+        } else if (arg == "--embd-output") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            params.embd_output = argv[i];
+        } else if (arg == "--embd-f16") {
+            params.embd_f16 = true;
+        } else if (arg == "--pooling") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            params.pooling = argv[i];
+            if (params.pooling != "mean" && params.pooling != "cls" && params.pooling != "last") {
+                invalid_param = true;
+                break;
+            }
         } else if (arg == "-i" || arg == "--interactive") {
             params.interactive = true;
         } else if (arg == "--embedding") {
@@ -546,6 +616,17 @@ bool gpt_params_parse_ex(int argc, char ** argv, gpt_params & params) {
 #else
             fprintf(stderr, "warning: not compiled with GPU offload support, --n-gpu-layers option will be ignored\n");
             fprintf(stderr, "warning: see main README.md for information on enabling GPU BLAS support\n");
+#endif
+        } else if (arg == "--fit-vram") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+#ifdef LLAMA_SUPPORTS_GPU_OFFLOAD
+            params.fit_vram = std::stoi(argv[i]);
+#else
+            fprintf(stderr, "warning: not compiled with GPU offload support, --fit-vram option will be ignored\n");
+            fprintf(stderr, "warning: see main README.md for information on enabling GPU BLAS support\n");
 #endif
         } else if (arg == "--gpu-layers-draft" || arg == "-ngld" || arg == "--n-gpu-layers-draft") {
             if (++i >= argc) {
@@ -600,8 +681,20 @@ bool gpt_params_parse_ex(int argc, char ** argv, gpt_params & params) {
 #endif // GGML_USE_CUBLAS
         } else if (arg == "--no-mmap") {
             params.use_mmap = false;
+        } else if (arg == "--repack") {
+            params.repack = true;
+        } else if (arg == "--hugepages") {
+            params.use_hugepages = true;
+        } else if (arg == "--vocab-cache") {
+            params.vocab_cache = true;
         } else if (arg == "--numa") {
             params.numa = true;
+        } else if (arg == "--blas-tune") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            params.blas_tune = argv[i];
         } else if (arg == "--verbose-prompt") {
             params.verbose_prompt = true;
         } else if (arg == "-r" || arg == "--reverse-prompt") {
@@ -620,6 +713,33 @@ bool gpt_params_parse_ex(int argc, char ** argv, gpt_params & params) {
             if (params.logdir.back() != DIRECTORY_SEPARATOR) {
                 params.logdir += DIRECTORY_SEPARATOR;
             }
+        } else if (arg == "--trace") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            params.trace.path = argv[i];
+        } else if (arg == "--trace-format") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            std::string value(argv[i]);
+            /**/ if (value == "jsonl")  { params.trace.format = LLAMA_TRACE_FORMAT_JSONL; }
+            else if (value == "chrome") { params.trace.format = LLAMA_TRACE_FORMAT_CHROME; }
+            else { invalid_param = true; break; }
+        } else if (arg == "--trace-rate") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            params.trace.rate = std::stof(argv[i]);
+        } else if (arg == "--profile") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            params.path_profile = argv[i];
         } else if (arg == "--perplexity" || arg == "--all-logits") {
             params.logits_all = true;
         } else if (arg == "--ppl-stride") {
@@ -700,6 +820,26 @@ bool gpt_params_parse_ex(int argc, char ** argv, gpt_params & params) {
                 break;
             }
             sparams.dynamic_grammar = argv[i];
+        } else if (arg == "--dynamic-grammar-cmd") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            sparams.dynamic_grammar_cmd = argv[i];
+        } else if (arg == "--grammar-prefetch") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            sparams.grammar_prefetch = std::stoi(argv[i]);
+        } else if (arg == "--jump-forward") {
+            sparams.jump_forward = true;
+        } else if (arg == "--grammar-mask-cache") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            sparams.grammar_mask_cache = std::stoi(argv[i]);
         } else if (arg == "--grammar-file") {
             if (++i >= argc) {
                 invalid_param = true;
@@ -837,6 +977,8 @@ void gpt_print_usage(int /*argc*/, char ** argv, const gpt_params & params) {
     printf("  --prompt-cache-all    if specified, saves user input and generations to cache as well.\n");
     printf("                        not supported with --interactive or other interactive options\n");
     printf("  --prompt-cache-ro     if specified, uses the prompt cache but does not update it.\n");
+    printf("  --prelude-cache DIR   directory to cache the eval state of the prelude, shared by the runs with the same\n");
+    printf("                        model and prelude (default: none)\n");
     printf("  --random-prompt       start with a randomized prompt.\n");
     printf("  --in-prefix-bos       prefix BOS to user inputs, preceding the `--in-prefix` string\n");
     printf("  --in-prefix STRING    string to prefix user inputs with (default: empty)\n");
@@ -857,6 +999,10 @@ void gpt_print_usage(int /*argc*/, char ** argv, const gpt_params & params) {
     printf("  --repeat-penalty N    penalize repeat sequence of tokens (default: %.1f, 1.0 = disabled)\n", (double)sparams.penalty_repeat);
     printf("  --presence-penalty N  repeat alpha presence penalty (default: %.1f, 0.0 = disabled)\n", (double)sparams.penalty_present);
     printf("  --frequency-penalty N repeat alpha frequency penalty (default: %.1f, 0.0 = disabled)\n", (double)sparams.penalty_freq);
+    printf("  --repetition-stop-period N\n");
+    printf("                        stop when the output ends with a substring of at most N bytes (default: %d)\n", sparams.repetition_stop_period);
+    printf("  --repetition-stop-count N\n");
+    printf("                        repeated N times in a row, or with 40 spaces or tabs (default: %d, 0 = disabled)\n", sparams.repetition_stop_count);
     printf("  --mirostat N          use Mirostat sampling.\n");
     printf("                        Top K, Nucleus, Tail Free and Locally Typical samplers are ignored if used.\n");
     printf("                        (default: %d, 0 = disabled, 1 = Mirostat, 2 = Mirostat 2.0)\n", sparams.mirostat);
@@ -868,6 +1014,14 @@ void gpt_print_usage(int /*argc*/, char ** argv, const gpt_params & params) {
     printf("                        or `--logit-bias 15043-1` to decrease likelihood of token ' Hello'\n");
     printf("  --grammar GRAMMAR     BNF-like grammar to constrain generations (see samples in grammars/ dir)\n");
     printf("  --grammar-file FNAME  file to read grammar from\n");
+    printf("  --jump-forward        decode the text forced by the grammar as one batch instead of sampling it token by token\n");
+    printf("  --grammar-mask-cache N\n");
+    printf("                        number of grammar states whose allowed tokens are cached (default: %d, 0 = disabled)\n", sparams.grammar_mask_cache);
+    printf("  --dynamic-grammar-cmd CMD\n");
+    printf("                        LSP command that computes the grammar for --dynamic-grammar (default: %s)\n", sparams.dynamic_grammar_cmd.c_str());
+    printf("                        a path ending in .so, .dylib or .dll is loaded in-process as a grammar plugin\n");
+    printf("  --grammar-prefetch N  query the dynamic grammar after each of the N most likely candidates of a token on\n");
+    printf("                        sessions of their own, while the provider is still busy (default: %d, 0 = disabled)\n", sparams.grammar_prefetch);
     printf("  --cfg-negative-prompt PROMPT\n");
     printf("                        negative prompt to use for guidance. (default: empty)\n");
     printf("  --cfg-negative-prompt-file FNAME\n");
@@ -890,7 +1044,9 @@ void gpt_print_usage(int /*argc*/, char ** argv, const gpt_params & params) {
     printf("  --hellaswag           compute HellaSwag score over random tasks from datafile supplied with -f\n");
     printf("  --hellaswag-tasks N   number of tasks to use when computing the HellaSwag score (default: %zu)\n", params.hellaswag_tasks);
     printf("  --keep N              number of tokens to keep from the initial prompt (default: %d, -1 = all)\n", params.n_keep);
+    printf("  --discard N           number of tokens to discard at each context shift, after the kept tokens (default: %d, -1 = half)\n", params.n_discard);
     printf("  --draft N             number of tokens to draft for speculative decoding (default: %d)\n", params.n_draft);
+    printf("  --ngram-pool FNAME    file of the n-grams of lookahead decoding, merged with the ones of this run at exit (default: none)\n");
     printf("  --chunks N            max number of chunks to process (default: %d, -1 = all)\n", params.n_chunks);
     printf("  -np N, --parallel N   number of parallel sequences to decode (default: %d)\n", params.n_parallel);
     printf("  -ns N, --sequences N  number of sequences to decode (default: %d)\n", params.n_sequences);
@@ -899,18 +1055,29 @@ void gpt_print_usage(int /*argc*/, char ** argv, const gpt_params & params) {
     printf("  -cb, --cont-batching  enable continuous batching (a.k.a dynamic batching) (default: disabled)\n");
     printf("  --mmproj MMPROJ_FILE  path to a multimodal projector file for LLaVA. see examples/llava/README.md\n");
     printf("  --image IMAGE_FILE    path to an image file. use with multimodal models\n");
+    printf("  --embd-input FNAME    file of the inputs to embed, one per line (- for stdin). see examples/embedding/README.md\n");
+    printf("  --embd-output FNAME   binary file of the embeddings, a NumPy array if FNAME ends with .npy, raw rows else\n");
+    printf("  --embd-f16            write the embeddings as float16 instead of float32\n");
+    printf("  --pooling {mean,cls,last}\n");
+    printf("                        pooling of the token embeddings of an input (default: %s)\n", params.pooling.c_str());
     if (llama_mlock_supported()) {
         printf("  --mlock               force system to keep model in RAM rather than swapping or compressing\n");
     }
     if (llama_mmap_supported()) {
         printf("  --no-mmap             do not memory-map model (slower load but may reduce pageouts if not using mlock)\n");
+        printf("  --hugepages           advise huge pages for the memory-mapped model (fewer TLB misses, Linux only)\n");
     }
+    printf("  --repack              repack the weights into interleaved layouts for faster matrix multiplications on the CPU (implies --no-mmap)\n");
+    printf("  --vocab-cache         keep the tokenizer index in MODEL.vocab-cache, built on the first load and mapped on the next ones\n");
     printf("  --numa                attempt optimizations that help on some NUMA systems\n");
     printf("                        if run without this previously, it is recommended to drop the system page cache before using this\n");
     printf("                        see https://github.com/ggerganov/llama.cpp/issues/1437\n");
+    printf("  --blas-tune FNAME     measure for which matrix multiplications BLAS is faster, and cache it in FNAME\n");
 #ifdef LLAMA_SUPPORTS_GPU_OFFLOAD
     printf("  -ngl N, --n-gpu-layers N\n");
     printf("                        number of layers to store in VRAM\n");
+    printf("  --fit-vram MiB        store in VRAM as many layers as fit in MiB, then as many of the --parallel sequences, each with\n");
+    printf("                        its share of --ctx-size, overrides --n-gpu-layers\n");
     printf("  -ngld N, --n-gpu-layers-draft N\n");
     printf("                        number of layers to store in VRAM for the draft model\n");
     printf("  -ts SPLIT --tensor-split SPLIT\n");
@@ -941,6 +1108,18 @@ void gpt_print_usage(int /*argc*/, char ** argv, const gpt_params & params) {
     printf("                        draft model for speculative decoding (default: %s)\n", params.model.c_str());
     printf("  -ld LOGDIR, --logdir LOGDIR\n");
     printf("                        path under which to save YAML logs (no logging if unset)\n");
+    printf("  --trace FNAME         write the timings of the sampling phases to FNAME (default: none)\n");
+    printf("  --trace-format {jsonl,chrome}\n");
+    printf("                        format of the trace, chrome can be loaded in chrome://tracing or Perfetto (default: jsonl)\n");
+    printf("  --trace-rate N        fraction of the sampled tokens that are traced (default: %.1f)\n", (double) params.trace.rate);
+    printf("  --profile PREFIX      write the compute times of the graph nodes to PREFIX.json (Chrome trace) and their totals\n");
+    printf("                        per op to PREFIX.csv (default: none)\n");
+#ifdef GGML_USE_MPI
+    printf("  --mpi-split {layer,row}\n");
+    printf("                        how to split the model between the MPI processes (default: layer):\n");
+    printf("                          layer: each process evaluates a slice of the layers, the batches go through them as a pipeline\n");
+    printf("                          row: each process multiplies a slice of the rows of each weight matrix, for a lower latency\n");
+#endif
     printf("  --override-kv KEY=TYPE:VALUE\n");
     printf("                        advanced option to override model metadata by key. may be specified multiple times.\n");
     printf("                        types: int, float, bool. example: --override-kv tokenizer.ggml.add_bos_token=bool:false\n");
@@ -1036,6 +1215,9 @@ struct llama_model_params llama_model_params_from_gpt_params(const gpt_params &
     mparams.tensor_split    = params.tensor_split;
     mparams.use_mmap        = params.use_mmap;
     mparams.use_mlock       = params.use_mlock;
+    mparams.repack          = params.repack;
+    mparams.use_hugepages   = params.use_hugepages;
+    mparams.vocab_cache     = params.vocab_cache;
     if (params.kv_overrides.empty()) {
         mparams.kv_overrides = NULL;
     } else {
@@ -1089,6 +1271,8 @@ struct llama_context_params llama_context_params_from_gpt_params(const gpt_param
     cparams.yarn_beta_slow    = params.yarn_beta_slow;
     cparams.yarn_orig_ctx     = params.yarn_orig_ctx;
     cparams.offload_kqv       = !params.no_kv_offload;
+    cparams.profile           = !params.path_profile.empty();
+    cparams.mpi_split         = params.mpi_split;
 
     cparams.type_k = kv_cache_type_from_str(params.cache_type_k);
     cparams.type_v = kv_cache_type_from_str(params.cache_type_v);
@@ -1118,8 +1302,28 @@ void llama_batch_add(
 }
 
 std::tuple<struct llama_model *, struct llama_context *> llama_init_from_gpt_params(gpt_params & params) {
+    if (!params.blas_tune.empty() && !ggml_blas_tune(params.blas_tune.c_str(), params.n_threads_batch == -1 ? params.n_threads : params.n_threads_batch)) {
+        fprintf(stderr, "%s: warning: llama.cpp was compiled without BLAS, --blas-tune has no effect\n", __func__);
+    }
+
     auto mparams = llama_model_params_from_gpt_params(params);
 
+    if (params.fit_vram > 0) {
+        // the planner takes the context of a single sequence
+        auto cparams = llama_context_params_from_gpt_params(params);
+        cparams.n_ctx = params.n_ctx / std::max(1, params.n_parallel);
+
+        int32_t n_parallel = 1;
+        if (!llama_plan_fit(params.model.c_str(), (size_t) params.fit_vram*1024*1024, params.n_parallel, &mparams, &cparams, &n_parallel)) {
+            fprintf(stderr, "%s: error: failed to plan the memory of model '%s'\n", __func__, params.model.c_str());
+            return std::make_tuple(nullptr, nullptr);
+        }
+
+        params.n_gpu_layers = mparams.n_gpu_layers;
+        params.n_ctx        = cparams.n_ctx;
+        params.n_parallel   = n_parallel;
+    }
+
     llama_model * model  = llama_load_model_from_file(params.model.c_str(), mparams);
     if (model == NULL) {
         fprintf(stderr, "%s: error: failed to load model '%s'\n", __func__, params.model.c_str());
@@ -1201,17 +1405,10 @@ std::vector<llama_token> llama_tokenize(
 }
 
 std::string llama_token_to_piece(const struct llama_context * ctx, llama_token token) {
-    std::vector<char> result(8, 0);
-    const int n_tokens = llama_token_to_piece(llama_get_model(ctx), token, result.data(), result.size());
-    if (n_tokens < 0) {
-        result.resize(-n_tokens);
-        int check = llama_token_to_piece(llama_get_model(ctx), token, result.data(), result.size());
-        GGML_ASSERT(check == -n_tokens);
-    } else {
-        result.resize(n_tokens);
-    }
+    int32_t n_piece;
+    const char * piece = llama_token_get_piece_view(llama_get_model(ctx), token, &n_piece);
 
-    return std::string(result.data(), result.size());
+    return std::string(piece, n_piece);
 }
 
 std::string llama_detokenize_spm(llama_context * ctx, const std::vector<llama_token> & tokens) {
@@ -1454,6 +1651,7 @@ void dump_non_result_info_yaml(FILE * stream, const gpt_params & params, const l
 
     fprintf(stream, "alias: %s # default: unknown\n", params.model_alias.c_str());
     fprintf(stream, "batch_size: %d # default: 512\n", params.n_batch);
+    fprintf(stream, "blas_tune: %s # default: none\n", params.blas_tune.c_str());
     dump_string_yaml_multiline(stream, "cfg_negative_prompt", sparams.cfg_negative_prompt.c_str());
     fprintf(stream, "cfg_scale: %f # default: 1.0\n", sparams.cfg_scale);
     fprintf(stream, "chunks: %d # default: -1 (unlimited)\n", params.n_chunks);
@@ -1461,11 +1659,13 @@ void dump_non_result_info_yaml(FILE * stream, const gpt_params & params, const l
     fprintf(stream, "ctx_size: %d # default: 512\n", params.n_ctx);
     fprintf(stream, "escape: %s # default: false\n", params.escape ? "true" : "false");
     fprintf(stream, "file: # never logged, see prompt instead. Can still be specified for input.\n");
+    fprintf(stream, "fit_vram: %d # default: 0 (disabled)\n", params.fit_vram);
     fprintf(stream, "frequency_penalty: %f # default: 0.0 \n", sparams.penalty_freq);
     dump_string_yaml_multiline(stream, "grammar", sparams.grammar.c_str());
     fprintf(stream, "grammar-file: # never logged, see grammar instead. Can still be specified for input.\n");
     fprintf(stream, "hellaswag: %s # default: false\n", params.hellaswag ? "true" : "false");
     fprintf(stream, "hellaswag_tasks: %zu # default: 400\n", params.hellaswag_tasks);
+    fprintf(stream, "hugepages: %s # default: false\n", params.use_hugepages ? "true" : "false");
 
     const auto logit_bias_eos = sparams.logit_bias.find(llama_token_eos(llama_get_model(lctx)));
     const bool ignore_eos = logit_bias_eos != sparams.logit_bias.end() && logit_bias_eos->second == -INFINITY;
@@ -1478,6 +1678,7 @@ void dump_non_result_info_yaml(FILE * stream, const gpt_params & params, const l
     fprintf(stream, "interactive: %s # default: false\n", params.interactive ? "true" : "false");
     fprintf(stream, "interactive_first: %s # default: false\n", params.interactive_first ? "true" : "false");
     fprintf(stream, "keep: %d # default: 0\n", params.n_keep);
+    fprintf(stream, "discard: %d # default: -1\n", params.n_discard);
     fprintf(stream, "logdir: %s # default: unset (no logging)\n", params.logdir.c_str());
 
     fprintf(stream, "logit_bias:\n");
@@ -1510,8 +1711,10 @@ void dump_non_result_info_yaml(FILE * stream, const gpt_params & params, const l
     fprintf(stream, "mlock: %s # default: false\n", params.use_mlock ? "true" : "false");
     fprintf(stream, "model: %s # default: models/7B/ggml-model.bin\n", params.model.c_str());
     fprintf(stream, "model_draft: %s # default:\n", params.model_draft.c_str());
+    fprintf(stream, "mpi_split: %s # default: layer\n", params.mpi_split == LLAMA_MPI_SPLIT_ROW ? "row" : "layer");
     fprintf(stream, "multiline_input: %s # default: false\n", params.multiline_input ? "true" : "false");
     fprintf(stream, "n_gpu_layers: %d # default: -1\n", params.n_gpu_layers);
+    fprintf(stream, "ngram_pool: %s # default: none\n", params.path_ngram_pool.c_str());
     fprintf(stream, "n_predict: %d # default: -1 (unlimited)\n", params.n_predict);
     fprintf(stream, "n_probs: %d # only used by server binary, default: 0\n", sparams.n_probs);
     fprintf(stream, "no_mmap: %s # default: false\n", !params.use_mmap ? "true" : "false");
@@ -1521,10 +1724,13 @@ void dump_non_result_info_yaml(FILE * stream, const gpt_params & params, const l
     fprintf(stream, "ppl_output_type: %d # default: 0\n", params.ppl_output_type);
     fprintf(stream, "ppl_stride: %d # default: 0\n", params.ppl_stride);
     fprintf(stream, "presence_penalty: %f # default: 0.0\n", sparams.penalty_present);
+    fprintf(stream, "profile: %s # default: none\n", params.path_profile.c_str());
     dump_string_yaml_multiline(stream, "prompt", params.prompt.c_str());
     fprintf(stream, "prompt_cache: %s\n", params.path_prompt_cache.c_str());
     fprintf(stream, "prompt_cache_all: %s # default: false\n", params.prompt_cache_all ? "true" : "false");
     fprintf(stream, "prompt_cache_ro: %s # default: false\n", params.prompt_cache_ro ? "true" : "false");
+    fprintf(stream, "repack: %s # default: false\n", params.repack ? "true" : "false");
+    fprintf(stream, "prelude_cache: %s\n", params.path_prelude_cache.c_str());
     dump_vector_int_yaml(stream, "prompt_tokens", prompt_tokens);
     fprintf(stream, "random_prompt: %s # default: false\n", params.random_prompt ? "true" : "false");
     fprintf(stream, "repeat_penalty: %f # default: 1.1\n", sparams.penalty_repeat);
@@ -1552,11 +1758,14 @@ void dump_non_result_info_yaml(FILE * stream, const gpt_params & params, const l
 
     fprintf(stream, "tfs: %f # default: 1.0\n", sparams.tfs_z);
     fprintf(stream, "threads: %d # default: %d\n", params.n_threads, std::thread::hardware_concurrency());
+    fprintf(stream, "trace: %s\n", params.trace.path.c_str());
+    fprintf(stream, "trace_rate: %f # default: 1.0\n", params.trace.rate);
     fprintf(stream, "top_k: %d # default: 40\n", sparams.top_k);
     fprintf(stream, "top_p: %f # default: 0.95\n", sparams.top_p);
     fprintf(stream, "min_p: %f # default: 0.0\n", sparams.min_p);
     fprintf(stream, "typical_p: %f # default: 1.0\n", sparams.typical_p);
     fprintf(stream, "verbose_prompt: %s # default: false\n", params.verbose_prompt ? "true" : "false");
+    fprintf(stream, "vocab_cache: %s # default: false\n", params.vocab_cache ? "true" : "false");
 }
 
 //
@@ -1632,3 +1841,49 @@ void dump_kv_cache_view_seqs(const llama_kv_cache_view & view, int row_size) {
 
     printf("\n=== Done dumping\n");
 }
+
+// 64-bit FNV-1a
+static uint64_t hash_bytes(uint64_t hash, const void * data, size_t size) {
+    const uint8_t * bytes = (const uint8_t *) data;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static uint64_t hash_str(uint64_t hash, const std::string & str) {
+    return hash_bytes(hash, str.c_str(), str.size() + 1);
+}
+
+std::string llama_prelude_cache_path(const gpt_params & params, const llama_context * ctx, const std::vector<llama_token> & prelude_tokens) {
+    const llama_model * model = llama_get_model(ctx);
+
+    uint64_t hash_model = 0xcbf29ce484222325ULL;
+
+    char buf[256];
+    for (int i = 0; i < llama_model_meta_count(model); i++) {
+        if (llama_model_meta_key_by_index(model, i, buf, sizeof(buf)) >= 0) {
+            hash_model = hash_str(hash_model, buf);
+        }
+        if (llama_model_meta_val_str_by_index(model, i, buf, sizeof(buf)) >= 0) {
+            hash_model = hash_str(hash_model, buf);
+        }
+    }
+
+    const uint64_t model_size     = llama_model_size(model);
+    const uint64_t model_n_params = llama_model_n_params(model);
+    const uint32_t n_ctx          = llama_n_ctx(ctx);
+
+    hash_model = hash_bytes(hash_model, &model_size,     sizeof(model_size));
+    hash_model = hash_bytes(hash_model, &model_n_params, sizeof(model_n_params));
+    hash_model = hash_bytes(hash_model, &n_ctx,          sizeof(n_ctx));
+    hash_model = hash_str(hash_model, params.cache_type_k);
+    hash_model = hash_str(hash_model, params.cache_type_v);
+
+    const uint64_t hash_prelude = hash_bytes(0xcbf29ce484222325ULL, prelude_tokens.data(), prelude_tokens.size()*sizeof(llama_token));
+
+    snprintf(buf, sizeof(buf), "prelude-%016" PRIx64 "-%016" PRIx64 ".bin", hash_model, hash_prelude);
+
+    return params.path_prelude_cache + buf;
+}
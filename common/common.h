@@ -51,7 +51,9 @@ struct gpt_params {
     int32_t n_ctx                           = 512;   // context size
     int32_t n_batch                         = 512;   // batch size for prompt processing (must be >=32 to use BLAS)
     int32_t n_keep                          = 0;     // number of tokens to keep from initial prompt
+    int32_t n_discard                       = -1;    // number of tokens to discard at each context shift (-1 = half of the tokens after n_keep)
     int32_t n_draft                         = 16;    // number of tokens to draft during speculative decoding
+    int32_t n_lookup_ngram                  = 0;     // longest n-grams of the prompt lookup drafts (0 = disabled)
     int32_t n_chunks                        = -1;    // max number of chunks to process (-1 = unlimited)
     int32_t n_parallel                      = 1;     // number of parallel sequences to decode
     int32_t n_sequences                     = 1;     // number of sequences to decode
@@ -59,6 +61,7 @@ struct gpt_params {
     float   p_split                         = 0.1f;  // speculative decoding split probability
     int32_t n_gpu_layers                    = -1;    // number of layers to store in VRAM (-1 - use default)
     int32_t n_gpu_layers_draft              = -1;    // number of layers to store in VRAM for the draft model (-1 - use default)
+    int32_t fit_vram                        = 0;     // MiB of VRAM to fit n_gpu_layers, n_ctx and n_parallel in (0 = disabled)
     int32_t main_gpu                        = 0;     // the GPU that is used for scratch and small tensors
     float   tensor_split[LLAMA_MAX_DEVICES] = {0};   // how split tensors should be distributed across GPUs
     int32_t n_beams                         = 0;     // if non-zero then use beam search of given width.
@@ -71,6 +74,7 @@ struct gpt_params {
     int32_t yarn_orig_ctx                   = 0;     // YaRN original context length
     int8_t  rope_scaling_type               = LLAMA_ROPE_SCALING_UNSPECIFIED; // TODO: better to be int32_t for alignment
                                                                               //       pinging @cebtenzzre
+    int32_t mpi_split                       = LLAMA_MPI_SPLIT_LAYER; // how the evaluation is divided between the MPI processes
 
     // // sampling parameters
     struct llama_sampling_params sparams;
@@ -81,10 +85,16 @@ struct gpt_params {
     std::string prompt            = "";
     std::string prompt_file       = "";  // store the external prompt file name
     std::string path_prompt_cache = "";  // path to file for saving/loading prompt eval state
+    std::string path_prelude_cache = ""; // directory of the saved eval states of the prelude
+    std::string path_ngram_pool   = "";  // file of the n-gram pool of lookahead decoding, loaded and saved
     std::string input_prefix      = "";  // string to prefix user inputs with
     std::string input_suffix      = "";  // string to suffix user inputs with
     std::vector<std::string> antiprompt; // string upon seeing which more user input is prompted
     std::string logdir            = "";  // directory in which to save YAML log files
+    std::string path_profile      = "";  // prefix of the files of the compute times of the graph nodes
+    std::string blas_tune         = "";  // file of the BLAS dispatch tuned for this machine, see ggml_blas_tune
+
+    llama_trace_params trace;            // trace of the sampling phases, disabled if trace.path is empty
 
     std::vector<llama_model_kv_override> kv_overrides;
 
@@ -120,6 +130,9 @@ struct gpt_params {
     bool logits_all        = false; // return logits for all tokens in the batch
     bool use_mmap          = true;  // use mmap for faster loads
     bool use_mlock         = false; // use mlock to keep model in memory
+    bool repack            = false; // repack the weights for faster matrix multiplications on the CPU
+    bool use_hugepages     = false; // use huge pages for the mapping of the model
+    bool vocab_cache       = false; // keep the tokenizer index of the model in a file next to it
     bool numa              = false; // attempt optimizations that help on some NUMA systems
     bool verbose_prompt    = false; // print prompt tokens before generation
     bool infill            = false; // use infill mode
@@ -132,6 +145,12 @@ struct gpt_params {
     // multimodal models (see examples/llava)
     std::string mmproj = ""; // path to multimodal projector
     std::string image  = ""; // path to an image file
+
+    // embedding extraction (see examples/embedding)
+    std::string embd_input  = "";     // file of the inputs to embed, one per line ("-" for stdin)
+    std::string embd_output = "";     // binary file of the embeddings: NumPy array if it ends with .npy, raw rows else
+    std::string pooling     = "last"; // pooling of the token embeddings of an input: mean, cls or last
+    bool        embd_f16    = false;  // write the embeddings as float16 instead of float32
 };
 
 bool gpt_params_parse_ex(int argc, char ** argv, gpt_params & params);
@@ -238,5 +257,9 @@ void dump_non_result_info_yaml(
 // Dump the KV cache view with the number of sequences per cell.
 void dump_kv_cache_view(const llama_kv_cache_view & view, int row_size = 80);
 
+// Path of the session file with the eval state of prelude_tokens in params.path_prelude_cache.
+// The name hashes the model metadata, the context size, the KV cache types and the tokens.
+std::string llama_prelude_cache_path(const gpt_params & params, const llama_context * ctx, const std::vector<llama_token> & prelude_tokens);
+
 // Dump the KV cache view showing individual sequences in each cell (long output).
 void dump_kv_cache_view_seqs(const llama_kv_cache_view & view, int row_size = 40);
@@ -1,6 +1,9 @@
 #include "grammar-parser.h"
+#include <algorithm>
 #include <cstdint>
+#include <cstring>
 #include <cwchar>
+#include <set>
 #include <string>
 #include <utility>
 #include <stdexcept>
@@ -24,15 +27,40 @@ namespace grammar_parser {
         return std::make_pair(value, pos);
     }
 
+    // every id below this is either in symbol_ids or in free_ids
+    static uint32_t get_next_id(const parse_state & state) {
+        return static_cast<uint32_t>(state.symbol_ids.size() + state.free_ids.size());
+    }
+
     static uint32_t get_symbol_id(parse_state & state, const char * src, size_t len) {
-        uint32_t next_id = static_cast<uint32_t>(state.symbol_ids.size());
-        auto result = state.symbol_ids.insert(std::make_pair(std::string(src, len), next_id));
-        return result.first->second;
+        const std::string name(src, len);
+        auto it = state.symbol_ids.find(name);
+        if (it != state.symbol_ids.end()) {
+            return it->second;
+        }
+        uint32_t next_id;
+        if (state.free_ids.empty()) {
+            next_id = get_next_id(state);
+        } else {
+            // reuse the id of a rule that is no longer defined
+            next_id = state.free_ids.back();
+            state.free_ids.pop_back();
+        }
+        state.symbol_ids[name] = next_id;
+        return next_id;
     }
 
     static uint32_t generate_symbol_id(parse_state & state, const std::string & base_name) {
-        uint32_t next_id = static_cast<uint32_t>(state.symbol_ids.size());
+        uint32_t next_id;
+        if (state.free_ids.empty()) {
+            next_id = get_next_id(state);
+        } else {
+            // reuse the id of a rule generated by a previous version of a changed rule, or no longer defined
+            next_id = state.free_ids.back();
+            state.free_ids.pop_back();
+        }
         state.symbol_ids[base_name + '_' + std::to_string(next_id)] = next_id;
+        state.rule_generated[state.symbol_ids.at(base_name)].push_back(next_id);
         return next_id;
     }
 
@@ -247,19 +275,115 @@ namespace grammar_parser {
         return pos;
     }
 
-    static const char * parse_rule(parse_state & state, const char * src) {
+    // release the rules generated by the previous definition of rule_id
+    static void free_generated_rules(parse_state & state, uint32_t rule_id, std::vector<uint32_t> & changed_rules) {
+        auto it = state.rule_generated.find(rule_id);
+        if (it == state.rule_generated.end()) {
+            return;
+        }
+        std::map<uint32_t, std::string> symbol_id_names;
+        for (const auto & kv : state.symbol_ids) {
+            symbol_id_names[kv.second] = kv.first;
+        }
+        for (uint32_t id : it->second) {
+            state.symbol_ids.erase(symbol_id_names.at(id));
+            state.free_ids.push_back(id);
+            // keep the slot valid in case a grammar still points at it
+            state.rules[id] = { {LLAMA_GRETYPE_END, 0} };
+            changed_rules.push_back(id);
+        }
+        state.rule_generated.erase(it);
+    }
+
+    // release the rules defined by a previous version of the grammar but not by the last one, along with the rules
+    // generated for them; a rule that is still referenced keeps its id and becomes empty, as an undefined rule
+    static void free_undefined_rules(parse_state & state, const std::set<uint32_t> & defined_rules, std::vector<uint32_t> & changed_rules) {
+        std::set<uint32_t> generated;
+        for (const auto & kv : state.rule_generated) {
+            generated.insert(kv.second.begin(), kv.second.end());
+        }
+
+        std::vector<std::pair<std::string, uint32_t>> undefined;
+        for (const auto & kv : state.symbol_ids) {
+            if (defined_rules.count(kv.second) == 0 && generated.count(kv.second) == 0) {
+                undefined.push_back(kv);
+            }
+        }
+
+        for (const auto & kv : undefined) {
+            const uint32_t id = kv.second;
+            free_generated_rules(state, id, changed_rules);
+            state.rule_sources.erase(id);
+            if (state.rules.size() <= id) {
+                state.rules.resize(id + 1);
+            }
+            if (state.rules[id].size() != 1 || state.rules[id][0].type != LLAMA_GRETYPE_END) {
+                state.rules[id] = { {LLAMA_GRETYPE_END, 0} };
+                changed_rules.push_back(id);
+            }
+        }
+
+        // the bodies of the released rules are empty, so the references left are the ones of the defined rules
+        std::set<uint32_t> referenced;
+        for (const auto & rule : state.rules) {
+            for (const auto & elem : rule) {
+                if (elem.type == LLAMA_GRETYPE_RULE_REF) {
+                    referenced.insert(elem.value);
+                }
+            }
+        }
+
+        for (const auto & kv : undefined) {
+            if (referenced.count(kv.second) == 0) {
+                state.symbol_ids.erase(kv.first);
+                state.free_ids.push_back(kv.second);
+            }
+        }
+    }
+
+    static const char * parse_rule(
+            parse_state           & state,
+            const char            * src,
+            std::vector<uint32_t> * changed_rules = nullptr,
+            std::set<uint32_t>    * defined_rules = nullptr) {
         const char * name_end = parse_name(src);
         const char * pos      = parse_space(name_end, false);
         size_t       name_len = name_end - src;
         uint32_t     rule_id  = get_symbol_id(state, src, name_len);
         const std::string name(src, name_len);
 
+        if (defined_rules) {
+            defined_rules->insert(rule_id);
+        }
+
         if (!(pos[0] == ':' && pos[1] == ':' && pos[2] == '=')) {
             throw std::runtime_error(std::string("expecting ::= at ") + pos);
         }
         pos = parse_space(pos + 3, true);
 
-        pos = parse_alternates(state, pos, name, rule_id, false);
+        // the source of a rule ends where parse_alternates stopped, at a newline or at the end; the parser
+        // reaches the same point on a text that starts with the same source followed by a newline or the end,
+        // so the definition is unchanged
+        const char * body = pos;
+        if (changed_rules) {
+            auto it = state.rule_sources.find(rule_id);
+            const std::string * prev = it != state.rule_sources.end() ? &it->second : nullptr;
+            if (prev && strncmp(pos, prev->c_str(), prev->size()) == 0 &&
+                (pos[prev->size()] == '\0' || pos[prev->size()] == '\r' || pos[prev->size()] == '\n')) {
+                // unchanged definition, keep the parsed rule
+                pos += prev->size();
+            } else {
+                free_generated_rules(state, rule_id, *changed_rules);
+                size_t n_changed = changed_rules->size();
+                pos = parse_alternates(state, pos, name, rule_id, false);
+                changed_rules->push_back(rule_id);
+                const auto & generated = state.rule_generated[rule_id];
+                changed_rules->insert(changed_rules->begin() + n_changed, generated.begin(), generated.end());
+            }
+        } else {
+            pos = parse_alternates(state, pos, name, rule_id, false);
+        }
+        state.rule_sources[rule_id].assign(body, pos);
 
         if (*pos == '\r') {
             pos += pos[1] == '\n' ? 2 : 1;
@@ -285,6 +409,26 @@ namespace grammar_parser {
         }
     }
 
+    bool parse_update(parse_state & state, const char * src, std::vector<uint32_t> & changed_rules) {
+        changed_rules.clear();
+        try {
+            std::set<uint32_t> defined_rules;
+            const char * pos = parse_space(src, true);
+            while (*pos) {
+                pos = parse_rule(state, pos, &changed_rules, &defined_rules);
+            }
+            free_undefined_rules(state, defined_rules, changed_rules);
+            std::sort(changed_rules.begin(), changed_rules.end());
+            changed_rules.erase(std::unique(changed_rules.begin(), changed_rules.end()), changed_rules.end());
+            return true;
+        } catch (const std::exception & err) {
+            fprintf(stderr, "%s: error parsing grammar: %s\n", __func__, err.what());
+            state = parse_state();
+            changed_rules.clear();
+            return false;
+        }
+    }
+
     static void print_grammar_char(FILE * file, uint32_t c) {
         if (0x20 <= c && c <= 0x7f) {
             fprintf(file, "%c", static_cast<char>(c));
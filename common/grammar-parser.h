@@ -21,9 +21,22 @@ namespace grammar_parser {
         std::map<std::string, uint32_t>                 symbol_ids;
         std::vector<std::vector<llama_grammar_element>> rules;
 
+        // used by parse_update to find the rules that changed:
+        // source text of each defined rule and the ids of the rules generated while parsing it
+        std::map<uint32_t, std::string>                 rule_sources;
+        std::map<uint32_t, std::vector<uint32_t>>       rule_generated;
+        std::vector<uint32_t>                           free_ids;
+
         std::vector<const llama_grammar_element *> c_rules();
     };
 
     parse_state parse(const char * src);
+
+    // update a previously parsed state with a new version of the grammar, only re-parsing the rule
+    // definitions whose text changed; the ids of the changed and added rules (including generated
+    // ones) are stored in changed_rules, along with the ids of the rules that are no longer defined,
+    // which are left empty and reused by the next rules added
+    // returns false on parse errors, in which case the state is cleared
+    bool parse_update(parse_state & state, const char * src, std::vector<uint32_t> & changed_rules);
     void print_grammar(FILE * file, const parse_state & state);
 }
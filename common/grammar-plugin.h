@@ -0,0 +1,84 @@
+// Native grammar provider plugins for --dynamic-grammar
+//
+// A grammar provider compiled as a shared library is loaded in-process when the provider command
+// (--dynamic-grammar-cmd) is the path of a file ending in .so, .dylib or .dll. Instead of printing
+// the grammar as GBNF text that is rewritten and parsed again at every token, the plugin hands out
+// the rules directly in the layout of llama_grammar_init: rules[i] is the definition of rule i, a
+// sequence of alternates separated by LLAMA_GRETYPE_ALT and terminated by LLAMA_GRETYPE_END, and
+// LLAMA_GRETYPE_RULE_REF elements hold indices into rules.
+//
+// The library exports llama_grammar_plugin_get, which returns its table of functions. A state is
+// created per sampling context and is only used by one thread at a time, distinct states may be used
+// concurrently. The same session protocol as the LSP is followed:
+//
+//   reset(program)  the plugin discards its state and loads the program generated so far
+//   next(piece)     the piece of a newly sampled token is appended to the program, the plugin returns
+//                   the grammar that constrains the next token
+//
+// This header only depends on llama.h and can be included from C.
+
+#pragma once
+
+#include "llama.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef _WIN32
+#    define LLAMA_GRAMMAR_PLUGIN_EXPORT __declspec(dllexport)
+#else
+#    define LLAMA_GRAMMAR_PLUGIN_EXPORT __attribute__ ((visibility ("default")))
+#endif
+
+#define LLAMA_GRAMMAR_PLUGIN_VERSION 1
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    // grammar returned by next, the arrays are owned by the plugin and stay valid until the next call
+    // with the same state
+    struct llama_grammar_plugin_rules {
+        const llama_grammar_element ** rules;
+        size_t                         n_rules; // 0: the next token is not constrained
+
+        // null: the rules replace the whole grammar, every rules[i] must be set
+        // otherwise only the listed rules changed since the previous result, the other rules[i] are
+        // not read and may be null; the rules past the previous number of rules are always read
+        // the first result after init, reset or an unconstrained token must replace the whole grammar
+        const uint32_t * changed_rules;
+        size_t           n_changed_rules;
+
+        // rule the grammar is positioned at, as the root of a GBNF grammar
+        // with changed_rules, < 0 keeps the current position of the grammar, see llama_grammar_update_rules
+        int64_t start_rule;
+    };
+
+    struct llama_grammar_plugin {
+        // LLAMA_GRAMMAR_PLUGIN_VERSION the plugin was compiled with
+        uint32_t version;
+
+        // target: the argument passed with --dynamic-grammar
+        // prelude: path of the prelude passed with --dynamic-grammar-prelude
+        // returns null on failure
+        void * (*init)(const char * target, const char * prelude);
+
+        void (*free)(void * state);
+
+        // program: the text generated so far, without the prelude
+        // returns false on failure
+        bool (*reset)(void * state, const char * program, size_t size);
+
+        // returns false on failure, the next token is then not constrained
+        bool (*next)(void * state, const char * piece, size_t size, struct llama_grammar_plugin_rules * result);
+    };
+
+    // the only symbol looked up in the library
+    typedef const struct llama_grammar_plugin * (*llama_grammar_plugin_get_t)(void);
+
+    LLAMA_GRAMMAR_PLUGIN_EXPORT const struct llama_grammar_plugin * llama_grammar_plugin_get(void);
+
+#ifdef __cplusplus
+}
+#endif
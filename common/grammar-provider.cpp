@@ -0,0 +1,545 @@
+#include "grammar-provider.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cctype>
+#include <memory>
+#include <vector>
+
+#if !defined(_WIN32)
+#include <csignal>
+#include <cerrno>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#define GRAMMAR_PROVIDER_SESSION
+#endif
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <dlfcn.h>
+#endif
+
+struct llama_grammar_provider {
+    std::string command;
+    std::string target;
+    std::string prelude;
+
+    // arguments the LSP session is started with, no shell is involved
+    std::vector<std::string> args;
+
+    // session state, pid < 0 when running one-shot
+    int pid = -1;
+    int fd  = -1;
+
+    // native provider, plugin is null for an LSP
+    void                       * library      = nullptr;
+    const llama_grammar_plugin * plugin       = nullptr;
+    void                       * plugin_state = nullptr;
+
+    // number of generated tokens the provider has seen and its last output
+    size_t      n_tokens = 0;
+    bool        synced   = false;
+    std::string last_output;
+
+    llama_grammar_plugin_rules last_rules = {};
+};
+
+// split the provider command into its arguments: words are separated by whitespace and may be quoted with
+// ' or ", a backslash outside of quotes escapes the next character; no other shell syntax is interpreted
+static std::vector<std::string> split_command(const std::string & command) {
+    std::vector<std::string> args;
+    std::string arg;
+    bool in_arg = false;
+    char quote  = 0;
+    for (size_t i = 0; i < command.size(); i++) {
+        const char c = command[i];
+        if (quote != 0) {
+            if (c == quote) {
+                quote = 0;
+            } else {
+                arg += c;
+            }
+        } else if (c == '\'' || c == '"') {
+            quote  = c;
+            in_arg = true;
+        } else if (c == '\\' && i + 1 < command.size()) {
+            arg   += command[++i];
+            in_arg = true;
+        } else if (isspace((unsigned char) c)) {
+            if (in_arg) {
+                args.push_back(arg);
+                arg.clear();
+                in_arg = false;
+            }
+        } else {
+            arg   += c;
+            in_arg = true;
+        }
+    }
+    if (in_arg) {
+        args.push_back(arg);
+    }
+    return args;
+}
+
+#ifdef GRAMMAR_PROVIDER_SESSION
+
+static bool session_write(int fd, const char * data, size_t size) {
+    while (size > 0) {
+#ifdef MSG_NOSIGNAL
+        const ssize_t n = send(fd, data, size, MSG_NOSIGNAL);
+#else
+        const ssize_t n = send(fd, data, size, 0);
+#endif
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        data += n;
+        size -= n;
+    }
+    return true;
+}
+
+static bool session_read(int fd, char * data, size_t size) {
+    while (size > 0) {
+        const ssize_t n = read(fd, data, size);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        data += n;
+        size -= n;
+    }
+    return true;
+}
+
+static bool session_send(int fd, char type, const std::string & payload) {
+    const std::string header = std::to_string(payload.size() + 1) + "\n" + type;
+    return session_write(fd, header.data(), header.size()) && session_write(fd, payload.data(), payload.size());
+}
+
+static bool session_recv(int fd, std::string & payload) {
+    size_t size = 0;
+    char c;
+    do {
+        if (!session_read(fd, &c, 1)) {
+            return false;
+        }
+        if (c != '\n') {
+            if (c < '0' || c > '9') {
+                return false;
+            }
+            size = size*10 + (c - '0');
+        }
+    } while (c != '\n');
+
+    payload.resize(size);
+    return size == 0 || session_read(fd, &payload[0], size);
+}
+
+static void session_close(int & fd, int & pid) {
+    if (fd >= 0) {
+        close(fd);
+        fd = -1;
+    }
+    if (pid > 0) {
+        kill(pid, SIGTERM);
+        waitpid(pid, nullptr, 0);
+        pid = -1;
+    }
+}
+
+static void session_stop(llama_grammar_provider * provider) {
+    session_close(provider->fd, provider->pid);
+}
+
+// start the LSP with execvp, the program is only ever sent through the socket
+static bool session_spawn(const std::vector<std::string> & args, int & fd, int & pid) {
+    if (args.empty()) {
+        return false;
+    }
+
+    // built before fork, the child only calls async-signal-safe functions
+    std::vector<char *> argv;
+    for (const std::string & arg : args) {
+        argv.push_back(const_cast<char *>(arg.c_str()));
+    }
+    argv.push_back(nullptr);
+
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) {
+        return false;
+    }
+#ifdef SO_NOSIGPIPE
+    const int one = 1;
+    setsockopt(sv[0], SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+
+    const pid_t child = fork();
+    if (child < 0) {
+        close(sv[0]);
+        close(sv[1]);
+        return false;
+    }
+
+    if (child == 0) {
+        // child: the session talks through stdin/stdout, stderr is inherited
+        close(sv[0]);
+        dup2(sv[1], STDIN_FILENO);
+        dup2(sv[1], STDOUT_FILENO);
+        close(sv[1]);
+        execvp(argv[0], argv.data());
+        _exit(127);
+    }
+
+    close(sv[1]);
+
+    pid = child;
+    fd  = sv[0];
+
+    return true;
+}
+
+static bool session_start(llama_grammar_provider * provider) {
+    return session_spawn(provider->args, provider->fd, provider->pid);
+}
+
+static bool session_query(llama_grammar_provider * provider, size_t n_tokens, const std::string & new_token, const std::function<std::string()> & get_program, std::string & output) {
+    if (!provider->synced || provider->n_tokens + 1 != n_tokens) {
+        if (!session_send(provider->fd, 'R', get_program())) {
+            return false;
+        }
+    }
+    return session_send(provider->fd, 'T', new_token) && session_recv(provider->fd, output);
+}
+
+#endif // GRAMMAR_PROVIDER_SESSION
+
+//
+// native provider
+//
+
+static bool ends_with(const std::string & str, const std::string & suffix) {
+    return str.size() >= suffix.size() && str.compare(str.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+static bool is_plugin(const std::string & command) {
+    return ends_with(command, ".so") || ends_with(command, ".dylib") || ends_with(command, ".dll");
+}
+
+static void * library_open(const std::string & path) {
+#if defined(_WIN32)
+    return (void *) LoadLibraryA(path.c_str());
+#else
+    return dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+#endif
+}
+
+static void * library_symbol(void * library, const char * name) {
+#if defined(_WIN32)
+    return (void *) GetProcAddress((HMODULE) library, name);
+#else
+    return dlsym(library, name);
+#endif
+}
+
+static void library_close(void * library) {
+#if defined(_WIN32)
+    FreeLibrary((HMODULE) library);
+#else
+    dlclose(library);
+#endif
+}
+
+static std::string library_error() {
+#if defined(_WIN32)
+    return "error " + std::to_string(GetLastError());
+#else
+    const char * err = dlerror();
+    return err ? err : "unknown error";
+#endif
+}
+
+static bool plugin_load(llama_grammar_provider * provider) {
+    provider->library = library_open(provider->command);
+    if (provider->library == nullptr) {
+        fprintf(stderr, "%s: failed to load grammar plugin %s: %s\n", __func__, provider->command.c_str(), library_error().c_str());
+        return false;
+    }
+
+    auto get = (llama_grammar_plugin_get_t) library_symbol(provider->library, "llama_grammar_plugin_get");
+    if (get == nullptr) {
+        fprintf(stderr, "%s: %s does not export llama_grammar_plugin_get\n", __func__, provider->command.c_str());
+        return false;
+    }
+
+    provider->plugin = get();
+    if (provider->plugin == nullptr || provider->plugin->version != LLAMA_GRAMMAR_PLUGIN_VERSION) {
+        fprintf(stderr, "%s: %s was built for version %u of the grammar plugin ABI, expected %u\n", __func__,
+                provider->command.c_str(), provider->plugin ? provider->plugin->version : 0, LLAMA_GRAMMAR_PLUGIN_VERSION);
+        provider->plugin = nullptr;
+        return false;
+    }
+
+    provider->plugin_state = provider->plugin->init(provider->target.c_str(), provider->prelude.c_str());
+    if (provider->plugin_state == nullptr) {
+        fprintf(stderr, "%s: grammar plugin %s failed to initialize\n", __func__, provider->command.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+static void plugin_unload(llama_grammar_provider * provider) {
+    if (provider->plugin_state != nullptr) {
+        provider->plugin->free(provider->plugin_state);
+        provider->plugin_state = nullptr;
+    }
+    provider->plugin = nullptr;
+    if (provider->library != nullptr) {
+        library_close(provider->library);
+        provider->library = nullptr;
+    }
+}
+
+// the references must stay within the rules, llama_grammar_init and llama_grammar_update_rules assert it
+// n_rules_prev is the number of rules of the previous result, the rules past it are read with a delta too
+static bool plugin_check_rules(const llama_grammar_plugin_rules & rules, size_t n_rules_prev) {
+    if (rules.n_rules == 0) {
+        return true;
+    }
+
+    if (rules.rules == nullptr || rules.start_rule >= (int64_t) rules.n_rules ||
+        (rules.changed_rules == nullptr && rules.start_rule < 0)) {
+        return false;
+    }
+
+    auto check_rule = [&](size_t i) {
+        if (rules.rules[i] == nullptr) {
+            return false;
+        }
+        for (const llama_grammar_element * pos = rules.rules[i]; pos->type != LLAMA_GRETYPE_END; pos++) {
+            if (pos->type == LLAMA_GRETYPE_RULE_REF && pos->value >= rules.n_rules) {
+                return false;
+            }
+        }
+        return true;
+    };
+
+    if (rules.changed_rules == nullptr) {
+        for (size_t i = 0; i < rules.n_rules; i++) {
+            if (!check_rule(i)) {
+                return false;
+            }
+        }
+    } else {
+        for (size_t i = 0; i < rules.n_changed_rules; i++) {
+            if (rules.changed_rules[i] >= rules.n_rules || !check_rule(rules.changed_rules[i])) {
+                return false;
+            }
+        }
+        for (size_t i = n_rules_prev; i < rules.n_rules; i++) {
+            if (!check_rule(i)) {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+static bool plugin_query(llama_grammar_provider * provider, size_t n_tokens, const std::string & new_token, const std::function<std::string()> & get_program, llama_grammar_plugin_rules & rules) {
+    size_t n_rules_prev = provider->last_rules.n_rules;
+    if (!provider->synced || provider->n_tokens + 1 != n_tokens) {
+        const std::string program = get_program();
+        if (!provider->plugin->reset(provider->plugin_state, program.data(), program.size())) {
+            return false;
+        }
+        n_rules_prev = 0;
+    }
+
+    rules = {};
+    if (!provider->plugin->next(provider->plugin_state, new_token.data(), new_token.size(), &rules)) {
+        return false;
+    }
+    if (!plugin_check_rules(rules, n_rules_prev)) {
+        fprintf(stderr, "%s: the grammar plugin returned invalid rules\n", __func__);
+        return false;
+    }
+
+    return true;
+}
+
+#ifdef GRAMMAR_PROVIDER_SESSION
+
+// the session could not be started or died: a new session answers this query only
+static bool oneshot_query(llama_grammar_provider * provider, const std::string & new_token, const std::function<std::string()> & get_program, std::string & output) {
+    int fd  = -1;
+    int pid = -1;
+    if (!session_spawn(provider->args, fd, pid)) {
+        return false;
+    }
+
+    const bool ok =
+        session_send(fd, 'R', get_program()) &&
+        session_send(fd, 'T', new_token) &&
+        session_recv(fd, output);
+
+    session_close(fd, pid);
+
+    return ok;
+}
+
+#endif // GRAMMAR_PROVIDER_SESSION
+
+struct llama_grammar_provider * llama_grammar_provider_init(
+        const std::string & command,
+        const std::string & target,
+        const std::string & prelude) {
+    llama_grammar_provider * provider = new llama_grammar_provider();
+
+    provider->command = command;
+    provider->target  = target;
+    provider->prelude = prelude;
+
+    if (is_plugin(command)) {
+        if (!plugin_load(provider)) {
+            llama_grammar_provider_free(provider);
+            return nullptr;
+        }
+        return provider;
+    }
+
+#ifdef GRAMMAR_PROVIDER_SESSION
+    // target and prelude are separate arguments, whatever they hold
+    provider->args = split_command(command);
+    if (provider->args.empty()) {
+        fprintf(stderr, "%s: empty grammar provider command\n", __func__);
+        llama_grammar_provider_free(provider);
+        return nullptr;
+    }
+    provider->args.insert(provider->args.end(), { "SESSION", target, "--prelude", prelude, "--debug" });
+
+    if (!session_start(provider)) {
+        fprintf(stderr, "%s: failed to start grammar provider session, falling back to one process per token\n", __func__);
+    }
+
+    return provider;
+#else
+    fprintf(stderr, "%s: LSP grammar providers are not supported on this platform, use a grammar plugin\n", __func__);
+    llama_grammar_provider_free(provider);
+    return nullptr;
+#endif
+}
+
+void llama_grammar_provider_free(struct llama_grammar_provider * provider) {
+    if (provider == nullptr) {
+        return;
+    }
+
+    plugin_unload(provider);
+
+#ifdef GRAMMAR_PROVIDER_SESSION
+    session_stop(provider);
+#endif
+
+    delete provider;
+}
+
+void llama_grammar_provider_reset(struct llama_grammar_provider * provider) {
+    provider->n_tokens = 0;
+    provider->synced   = false;
+    provider->last_output.clear();
+    provider->last_rules = {};
+}
+
+bool llama_grammar_provider_query(
+        struct llama_grammar_provider * provider,
+                               size_t   n_tokens,
+                    const std::string & new_token,
+    const std::function<std::string()> & get_program,
+                          std::string & output) {
+    // the same step is queried again (e.g. sampling twice without accepting a token)
+    if (provider->synced && provider->n_tokens == n_tokens) {
+        output = provider->last_output;
+        return true;
+    }
+
+    bool ok = false;
+
+#ifdef GRAMMAR_PROVIDER_SESSION
+    if (provider->pid > 0) {
+        ok = session_query(provider, n_tokens, new_token, get_program, output);
+        if (!ok) {
+            fprintf(stderr, "%s: grammar provider session died, falling back to one process per token\n", __func__);
+            session_stop(provider);
+        }
+    }
+#endif
+
+#ifdef GRAMMAR_PROVIDER_SESSION
+    if (!ok) {
+        ok = oneshot_query(provider, new_token, get_program, output);
+    }
+#endif
+
+    provider->synced   = ok;
+    provider->n_tokens = n_tokens;
+    if (ok) {
+        provider->last_output = output;
+    }
+
+    return ok;
+}
+
+bool llama_grammar_provider_is_native(const struct llama_grammar_provider * provider) {
+    return provider->plugin != nullptr;
+}
+
+bool llama_grammar_provider_query_rules(
+        struct llama_grammar_provider * provider,
+                               size_t   n_tokens,
+                    const std::string & new_token,
+    const std::function<std::string()> & get_program,
+    struct llama_grammar_plugin_rules & rules) {
+    // the same step is queried again, the rules are still owned by the plugin
+    if (provider->synced && provider->n_tokens == n_tokens) {
+        rules = provider->last_rules;
+        return true;
+    }
+
+    const bool ok = plugin_query(provider, n_tokens, new_token, get_program, rules);
+
+    provider->synced     = ok;
+    provider->n_tokens   = n_tokens;
+    provider->last_rules = ok ? rules : llama_grammar_plugin_rules{};
+
+    return ok;
+}
+
+std::string llama_grammar_provider_extract(const std::string & output) {
+    const std::string delimiter = "LSP: Grammar:\n";
+
+    size_t pos = output.find(delimiter);
+    if (pos == std::string::npos) {
+        return "";
+    }
+
+    // trim leading whitespace
+    pos = output.find_first_not_of(" \n\r\t\f\v", pos + delimiter.size());
+
+    return pos == std::string::npos ? "" : output.substr(pos);
+}
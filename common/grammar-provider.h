@@ -0,0 +1,71 @@
+// Grammar provider used by --dynamic-grammar
+//
+// The provider computes the grammar that constrains the next sampled token from the program
+// generated so far. Instead of spawning the LSP once per token, a single long-lived session is
+// started per sampling context and fed incrementally over the child's stdin/stdout using a
+// framed protocol:
+//
+//   frame ::= <payload size in bytes, decimal> "\n" <payload>
+//
+//   client -> provider: "R" <program>  reset, the provider discards its state and loads <program>
+//                       "T" <token>    the piece of a newly sampled token is appended to the program
+//   provider -> client: one frame per "T" request, holding the same output as `lsp.js COMPLETIONS`
+//
+// The command is split into arguments and started with execvp, without a shell; the target and the
+// prelude are passed as separate arguments and the program only goes through the session socket.
+// If the session cannot be started or dies, a new session is started for each query. LSP providers
+// are only supported on POSIX systems.
+//
+// A command naming a shared library is loaded in-process instead, see grammar-plugin.h. Such a
+// native provider hands out the grammar rules directly and is queried with
+// llama_grammar_provider_query_rules.
+
+#pragma once
+
+#include "grammar-plugin.h"
+
+#include <functional>
+#include <string>
+
+struct llama_grammar_provider;
+
+// command: the LSP executable and its arguments, e.g. "node ../lsp.js", or the path of a plugin library
+// target:  the argument passed with --dynamic-grammar
+// prelude: path of the prelude the LSP type checks against
+// returns null if the plugin cannot be loaded, or if the command is empty or not supported on this platform
+// an LSP provider is created even if its session cannot be started
+struct llama_grammar_provider * llama_grammar_provider_init(
+        const std::string & command,
+        const std::string & target,
+        const std::string & prelude);
+
+void llama_grammar_provider_free(struct llama_grammar_provider * provider);
+
+// forget the program state, the next query sends the full program again
+void llama_grammar_provider_reset(struct llama_grammar_provider * provider);
+
+// query the provider output after the n_tokens-th generated token, whose piece is new_token
+// get_program returns the text of the first n_tokens - 1 tokens; it is only called when the
+// provider is out of sync, so the program does not have to be rebuilt for every token
+// returns false if the provider could not be reached
+bool llama_grammar_provider_query(
+        struct llama_grammar_provider * provider,
+                               size_t   n_tokens,
+                    const std::string & new_token,
+    const std::function<std::string()> & get_program,
+                          std::string & output);
+
+// true if the provider is a plugin loaded in-process
+bool llama_grammar_provider_is_native(const struct llama_grammar_provider * provider);
+
+// same as llama_grammar_provider_query for a native provider, the rules are owned by the plugin and
+// stay valid until the next query
+bool llama_grammar_provider_query_rules(
+        struct llama_grammar_provider * provider,
+                               size_t   n_tokens,
+                    const std::string & new_token,
+    const std::function<std::string()> & get_program,
+    struct llama_grammar_plugin_rules & rules);
+
+// extract the grammar from the provider output (the text following "LSP: Grammar:\n")
+std::string llama_grammar_provider_extract(const std::string & output);
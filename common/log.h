@@ -1,7 +1,12 @@
 #pragma once
 
+#include <atomic>
 #include <chrono>
+#include <condition_variable>
+#include <cstdarg>
 #include <cstring>
+#include <memory>
+#include <mutex>
 #include <sstream>
 #include <iostream>
 #include <thread>
@@ -41,6 +46,12 @@
 //   log_set_target( FILE* )
 //    allowing to point at stderr, stdout, or any valid FILE* file handler.
 //
+//  Writing to the targets can be moved off the logging threads with:
+//   log_async( true )
+//
+//  LOG_DBG() and LOG_DBGLN() are for the per token details, these and LOG()
+//   can be removed at compile time by defining LOG_MIN_LEVEL.
+//
 // --------
 //
 // End of Basic usage.
@@ -231,26 +242,353 @@ inline std::string log_filename_generator_impl(LogTriState multilog, const std::
     #define LOG_TEE_FLF_VAL ,""
 #endif
 
+// Asynchronous logging.
+//  by default every message is written to its target with fprintf() and fflush() on the logging thread.
+//  After log_async(true), the message is formatted into a ring buffer owned by the logging thread,
+//  and a background thread writes the buffered messages to their targets and flushes them.
+//  The logging thread only waits when its ring buffer is full.
+//
+//  The messages of a thread keep their order, the messages of different threads are written ring by ring,
+//  so they may interleave differently than they were logged.
+//  The buffers are drained before a target is changed, when the asynchronous mode is turned off, and at exit.
+//
+//  The size of the ring buffer of each thread and the flush period can be changed
+//  like so:
+//
+//  #define LOG_ASYNC_BUFFER_SIZE (1024*1024)
+//  #define LOG_ASYNC_FLUSH_MS 100
+//  #include "log.h"
+//
+#ifndef LOG_ASYNC_BUFFER_SIZE
+    #define LOG_ASYNC_BUFFER_SIZE (64*1024)
+#endif
+
+#ifndef LOG_ASYNC_FLUSH_MS
+    #define LOG_ASYNC_FLUSH_MS 50
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+    #define LOG_ATTRIBUTE_FORMAT(fmt, args) __attribute__((format(printf, fmt, args)))
+#else
+    #define LOG_ATTRIBUTE_FORMAT(fmt, args)
+#endif
+
+// INTERNAL, DO NOT USE
+//  single producer (the thread owning the ring), single consumer (the thread holding log_async_state::drain_mutex)
+struct log_async_ring
+{
+    static_assert((LOG_ASYNC_BUFFER_SIZE & (LOG_ASYNC_BUFFER_SIZE - 1)) == 0, "LOG_ASYNC_BUFFER_SIZE must be a power of 2");
+
+    // a record is a header followed by the message, both may wrap around the end of the buffer
+    struct header
+    {
+        FILE   *target;
+        size_t  size;
+    };
+
+    std::atomic<size_t> head{0};    // total bytes written, advanced by the producer
+    std::atomic<size_t> tail{0};    // total bytes read, advanced by the consumer
+    std::atomic<bool>   in_use{false};
+
+    char data[LOG_ASYNC_BUFFER_SIZE];
+
+    void copy_in(size_t pos, const void *src, size_t size)
+    {
+        const size_t off = pos & (LOG_ASYNC_BUFFER_SIZE - 1);
+        const size_t n0  = std::min(size, (size_t) LOG_ASYNC_BUFFER_SIZE - off);
+        memcpy(data + off, src, n0);
+        memcpy(data, (const char *) src + n0, size - n0);
+    }
+
+    void copy_out(size_t pos, void *dst, size_t size) const
+    {
+        const size_t off = pos & (LOG_ASYNC_BUFFER_SIZE - 1);
+        const size_t n0  = std::min(size, (size_t) LOG_ASYNC_BUFFER_SIZE - off);
+        memcpy(dst, data + off, n0);
+        memcpy((char *) dst + n0, data, size - n0);
+    }
+};
+
+// INTERNAL, DO NOT USE
+struct log_async_state
+{
+    std::atomic<bool> enabled{false};
+
+    std::mutex              mutex;          // protects rings, flusher and stop
+    std::mutex              drain_mutex;    // held while the rings are consumed
+    std::condition_variable cv;
+
+    std::vector<std::unique_ptr<log_async_ring>> rings;
+
+    std::thread flusher;
+    bool        stop = false;
+
+    // writes the buffered messages to their targets, returns after all the messages queued before the call are written
+    void drain()
+    {
+        std::lock_guard<std::mutex> lock_drain(drain_mutex);
+
+        std::vector<log_async_ring *> pending;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (auto & ring : rings)
+            {
+                pending.push_back(ring.get());
+            }
+        }
+
+        std::vector<FILE *> targets;
+        for (auto * ring : pending)
+        {
+            size_t       tail = ring->tail.load(std::memory_order_relaxed);
+            const size_t head = ring->head.load(std::memory_order_acquire);
+
+            while (tail != head)
+            {
+                log_async_ring::header hdr;
+                ring->copy_out(tail, &hdr, sizeof(hdr));
+                tail += sizeof(hdr);
+
+                const size_t off = tail & (LOG_ASYNC_BUFFER_SIZE - 1);
+                const size_t n0  = std::min(hdr.size, (size_t) LOG_ASYNC_BUFFER_SIZE - off);
+                fwrite(ring->data + off, 1, n0, hdr.target);
+                fwrite(ring->data, 1, hdr.size - n0, hdr.target);
+                tail += hdr.size;
+
+                if (std::find(targets.begin(), targets.end(), hdr.target) == targets.end())
+                {
+                    targets.push_back(hdr.target);
+                }
+            }
+
+            ring->tail.store(tail, std::memory_order_release);
+        }
+
+        for (auto * target : targets)
+        {
+            fflush(target);
+        }
+    }
+
+    void flusher_loop()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (!stop)
+        {
+            cv.wait_for(lock, std::chrono::milliseconds(LOG_ASYNC_FLUSH_MS));
+
+            lock.unlock();
+            drain();
+            lock.lock();
+        }
+    }
+
+    ~log_async_state()
+    {
+        // the messages logged by the later destructors are written directly
+        enabled.store(false, std::memory_order_relaxed);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+        }
+        cv.notify_one();
+        if (flusher.joinable())
+        {
+            flusher.join();
+        }
+        drain();
+    }
+};
+
+// INTERNAL, DO NOT USE
+inline log_async_state & log_async_get()
+{
+    static log_async_state state;
+    return state;
+}
+
+// INTERNAL, DO NOT USE
+//  returns the ring of the thread to the pool when the thread exits, the next new thread continues it
+struct log_async_ring_holder
+{
+    log_async_ring *ring = nullptr;
+
+    ~log_async_ring_holder()
+    {
+        if (ring)
+        {
+            ring->in_use.store(false, std::memory_order_release);
+        }
+    }
+};
+
+// INTERNAL, DO NOT USE
+inline log_async_ring *log_async_ring_get()
+{
+    static thread_local log_async_ring_holder holder;
+
+    if (!holder.ring)
+    {
+        log_async_state & state = log_async_get();
+        std::lock_guard<std::mutex> lock(state.mutex);
+
+        for (auto & ring : state.rings)
+        {
+            bool expected = false;
+            if (ring->in_use.compare_exchange_strong(expected, true, std::memory_order_acq_rel))
+            {
+                holder.ring = ring.get();
+                break;
+            }
+        }
+
+        if (!holder.ring)
+        {
+            state.rings.emplace_back(new log_async_ring());
+            holder.ring = state.rings.back().get();
+            holder.ring->in_use.store(true, std::memory_order_relaxed);
+        }
+    }
+
+    return holder.ring;
+}
+
+// Whether the messages are written by the background thread.
+inline bool log_async_enabled()
+{
+    return log_async_get().enabled.load(std::memory_order_relaxed);
+}
+
+// Writes the messages buffered so far to their targets.
+inline void log_async_flush()
+{
+    log_async_get().drain();
+}
+
+// Queues a message for the background thread.
+//  the message is copied, a message larger than the ring buffer is written directly after the queued ones.
+inline void log_async_write(FILE *target, const char *msg, size_t size)
+{
+    log_async_state & state = log_async_get();
+    log_async_ring  * ring  = log_async_ring_get();
+
+    const size_t need = sizeof(log_async_ring::header) + size;
+    if (need > LOG_ASYNC_BUFFER_SIZE)
+    {
+        // this thread is the only producer of its ring, so it is empty after the drain
+        state.drain();
+        fwrite(msg, 1, size, target);
+        fflush(target);
+        return;
+    }
+
+    const size_t head = ring->head.load(std::memory_order_relaxed);
+    while (LOG_ASYNC_BUFFER_SIZE - (head - ring->tail.load(std::memory_order_acquire)) < need)
+    {
+        // the ring is full, wait for the background thread
+        state.cv.notify_one();
+        std::this_thread::yield();
+    }
+
+    const log_async_ring::header hdr = { target, size };
+    ring->copy_in(head,               &hdr, sizeof(hdr));
+    ring->copy_in(head + sizeof(hdr),  msg, size);
+    ring->head.store(head + need, std::memory_order_release);
+
+    if (head + need - ring->tail.load(std::memory_order_relaxed) > LOG_ASYNC_BUFFER_SIZE/2)
+    {
+        state.cv.notify_one();
+    }
+}
+
+// INTERNAL, DO NOT USE
+//  USE LOG() INSTEAD
+inline void log_async_printf(FILE *target, const char *fmt, ...) LOG_ATTRIBUTE_FORMAT(2, 3);
+inline void log_async_printf(FILE *target, const char *fmt, ...)
+{
+    static thread_local std::vector<char> buf(512);
+
+    va_list args;
+    va_start(args, fmt);
+    int n = vsnprintf(buf.data(), buf.size(), fmt, args);
+    va_end(args);
+
+    if (n < 0)
+    {
+        return;
+    }
+
+    if ((size_t) n >= buf.size())
+    {
+        buf.resize(n + 1);
+
+        va_start(args, fmt);
+        vsnprintf(buf.data(), buf.size(), fmt, args);
+        va_end(args);
+    }
+
+    log_async_write(target, buf.data(), n);
+}
+
+// Enables or disables the asynchronous writing of the logs.
+//  disabling writes the buffered messages before returning.
+#define log_async(enable) log_async_impl(enable)
+
+// INTERNAL, DO NOT USE
+inline void log_async_impl(bool enable)
+{
+    log_async_state & state = log_async_get();
+
+    if (enable)
+    {
+        std::lock_guard<std::mutex> lock(state.mutex);
+        if (!state.flusher.joinable())
+        {
+            state.flusher = std::thread([&state]() { state.flusher_loop(); });
+        }
+        state.enabled.store(true, std::memory_order_relaxed);
+    }
+    else
+    {
+        state.enabled.store(false, std::memory_order_relaxed);
+        state.drain();
+    }
+}
+
 // INTERNAL, DO NOT USE
 //  USE LOG() INSTEAD
 //
 #ifndef _MSC_VER
-    #define LOG_IMPL(str, ...)                                                                                      \
-    do {                                                                                                            \
-        if (LOG_TARGET != nullptr)                                                                                  \
-        {                                                                                                           \
-            fprintf(LOG_TARGET, LOG_TIMESTAMP_FMT LOG_FLF_FMT str "%s" LOG_TIMESTAMP_VAL LOG_FLF_VAL, __VA_ARGS__); \
-            fflush(LOG_TARGET);                                                                                     \
-        }                                                                                                           \
+    #define LOG_IMPL(str, ...)                                                                                               \
+    do {                                                                                                                     \
+        if (LOG_TARGET != nullptr)                                                                                           \
+        {                                                                                                                    \
+            if (log_async_enabled())                                                                                         \
+            {                                                                                                                \
+                log_async_printf(LOG_TARGET, LOG_TIMESTAMP_FMT LOG_FLF_FMT str "%s" LOG_TIMESTAMP_VAL LOG_FLF_VAL, __VA_ARGS__); \
+            }                                                                                                                \
+            else                                                                                                             \
+            {                                                                                                                \
+                fprintf(LOG_TARGET, LOG_TIMESTAMP_FMT LOG_FLF_FMT str "%s" LOG_TIMESTAMP_VAL LOG_FLF_VAL, __VA_ARGS__);      \
+                fflush(LOG_TARGET);                                                                                          \
+            }                                                                                                                \
+        }                                                                                                                    \
     } while (0)
 #else
-    #define LOG_IMPL(str, ...)                                                                                           \
-    do {                                                                                                                 \
-        if (LOG_TARGET != nullptr)                                                                                       \
-        {                                                                                                                \
-            fprintf(LOG_TARGET, LOG_TIMESTAMP_FMT LOG_FLF_FMT str "%s" LOG_TIMESTAMP_VAL LOG_FLF_VAL "", ##__VA_ARGS__); \
-            fflush(LOG_TARGET);                                                                                          \
-        }                                                                                                                \
+    #define LOG_IMPL(str, ...)                                                                                                    \
+    do {                                                                                                                          \
+        if (LOG_TARGET != nullptr)                                                                                                \
+        {                                                                                                                         \
+            if (log_async_enabled())                                                                                              \
+            {                                                                                                                     \
+                log_async_printf(LOG_TARGET, LOG_TIMESTAMP_FMT LOG_FLF_FMT str "%s" LOG_TIMESTAMP_VAL LOG_FLF_VAL "", ##__VA_ARGS__); \
+            }                                                                                                                     \
+            else                                                                                                                  \
+            {                                                                                                                     \
+                fprintf(LOG_TARGET, LOG_TIMESTAMP_FMT LOG_FLF_FMT str "%s" LOG_TIMESTAMP_VAL LOG_FLF_VAL "", ##__VA_ARGS__);      \
+                fflush(LOG_TARGET);                                                                                               \
+            }                                                                                                                     \
+        }                                                                                                                         \
     } while (0)
 #endif
 
@@ -258,32 +596,62 @@ inline std::string log_filename_generator_impl(LogTriState multilog, const std::
 //  USE LOG_TEE() INSTEAD
 //
 #ifndef _MSC_VER
-    #define LOG_TEE_IMPL(str, ...)                                                                                                      \
-    do {                                                                                                                                \
-        if (LOG_TARGET != nullptr)                                                                                                      \
-        {                                                                                                                               \
-            fprintf(LOG_TARGET, LOG_TIMESTAMP_FMT LOG_FLF_FMT str "%s" LOG_TIMESTAMP_VAL LOG_FLF_VAL, __VA_ARGS__);                     \
-            fflush(LOG_TARGET);                                                                                                         \
-        }                                                                                                                               \
-        if (LOG_TARGET != nullptr && LOG_TARGET != stdout && LOG_TARGET != stderr && LOG_TEE_TARGET != nullptr)                         \
-        {                                                                                                                               \
-            fprintf(LOG_TEE_TARGET, LOG_TEE_TIMESTAMP_FMT LOG_TEE_FLF_FMT str "%s" LOG_TEE_TIMESTAMP_VAL LOG_TEE_FLF_VAL, __VA_ARGS__); \
-            fflush(LOG_TEE_TARGET);                                                                                                     \
-        }                                                                                                                               \
+    #define LOG_TEE_IMPL(str, ...)                                                                                                                   \
+    do {                                                                                                                                             \
+        const bool log_tee_async = log_async_enabled();                                                                                              \
+        if (LOG_TARGET != nullptr)                                                                                                                   \
+        {                                                                                                                                            \
+            if (log_tee_async)                                                                                                                       \
+            {                                                                                                                                        \
+                log_async_printf(LOG_TARGET, LOG_TIMESTAMP_FMT LOG_FLF_FMT str "%s" LOG_TIMESTAMP_VAL LOG_FLF_VAL, __VA_ARGS__);                     \
+            }                                                                                                                                        \
+            else                                                                                                                                     \
+            {                                                                                                                                        \
+                fprintf(LOG_TARGET, LOG_TIMESTAMP_FMT LOG_FLF_FMT str "%s" LOG_TIMESTAMP_VAL LOG_FLF_VAL, __VA_ARGS__);                          \
+                fflush(LOG_TARGET);                                                                                                              \
+            }                                                                                                                                        \
+        }                                                                                                                                            \
+        if (LOG_TARGET != nullptr && LOG_TARGET != stdout && LOG_TARGET != stderr && LOG_TEE_TARGET != nullptr)                                      \
+        {                                                                                                                                            \
+            if (log_tee_async)                                                                                                                       \
+            {                                                                                                                                        \
+                log_async_printf(LOG_TEE_TARGET, LOG_TEE_TIMESTAMP_FMT LOG_TEE_FLF_FMT str "%s" LOG_TEE_TIMESTAMP_VAL LOG_TEE_FLF_VAL, __VA_ARGS__); \
+            }                                                                                                                                        \
+            else                                                                                                                                     \
+            {                                                                                                                                        \
+                fprintf(LOG_TEE_TARGET, LOG_TEE_TIMESTAMP_FMT LOG_TEE_FLF_FMT str "%s" LOG_TEE_TIMESTAMP_VAL LOG_TEE_FLF_VAL, __VA_ARGS__);      \
+                fflush(LOG_TEE_TARGET);                                                                                                          \
+            }                                                                                                                                        \
+        }                                                                                                                                            \
     } while (0)
 #else
-    #define LOG_TEE_IMPL(str, ...)                                                                                                           \
-    do {                                                                                                                                     \
-        if (LOG_TARGET != nullptr)                                                                                                           \
-        {                                                                                                                                    \
-            fprintf(LOG_TARGET, LOG_TIMESTAMP_FMT LOG_FLF_FMT str "%s" LOG_TIMESTAMP_VAL LOG_FLF_VAL "", ##__VA_ARGS__);                     \
-            fflush(LOG_TARGET);                                                                                                              \
-        }                                                                                                                                    \
-        if (LOG_TARGET != nullptr && LOG_TARGET != stdout && LOG_TARGET != stderr && LOG_TEE_TARGET != nullptr)                              \
-        {                                                                                                                                    \
-            fprintf(LOG_TEE_TARGET, LOG_TEE_TIMESTAMP_FMT LOG_TEE_FLF_FMT str "%s" LOG_TEE_TIMESTAMP_VAL LOG_TEE_FLF_VAL "", ##__VA_ARGS__); \
-            fflush(LOG_TEE_TARGET);                                                                                                          \
-        }                                                                                                                                    \
+    #define LOG_TEE_IMPL(str, ...)                                                                                                                        \
+    do {                                                                                                                                                  \
+        const bool log_tee_async = log_async_enabled();                                                                                                   \
+        if (LOG_TARGET != nullptr)                                                                                                                        \
+        {                                                                                                                                                 \
+            if (log_tee_async)                                                                                                                            \
+            {                                                                                                                                             \
+                log_async_printf(LOG_TARGET, LOG_TIMESTAMP_FMT LOG_FLF_FMT str "%s" LOG_TIMESTAMP_VAL LOG_FLF_VAL "", ##__VA_ARGS__);                     \
+            }                                                                                                                                             \
+            else                                                                                                                                          \
+            {                                                                                                                                             \
+                fprintf(LOG_TARGET, LOG_TIMESTAMP_FMT LOG_FLF_FMT str "%s" LOG_TIMESTAMP_VAL LOG_FLF_VAL "", ##__VA_ARGS__);                          \
+                fflush(LOG_TARGET);                                                                                                                   \
+            }                                                                                                                                             \
+        }                                                                                                                                                 \
+        if (LOG_TARGET != nullptr && LOG_TARGET != stdout && LOG_TARGET != stderr && LOG_TEE_TARGET != nullptr)                                           \
+        {                                                                                                                                                 \
+            if (log_tee_async)                                                                                                                            \
+            {                                                                                                                                             \
+                log_async_printf(LOG_TEE_TARGET, LOG_TEE_TIMESTAMP_FMT LOG_TEE_FLF_FMT str "%s" LOG_TEE_TIMESTAMP_VAL LOG_TEE_FLF_VAL "", ##__VA_ARGS__); \
+            }                                                                                                                                             \
+            else                                                                                                                                          \
+            {                                                                                                                                             \
+                fprintf(LOG_TEE_TARGET, LOG_TEE_TIMESTAMP_FMT LOG_TEE_FLF_FMT str "%s" LOG_TEE_TIMESTAMP_VAL LOG_TEE_FLF_VAL "", ##__VA_ARGS__);      \
+                fflush(LOG_TEE_TARGET);                                                                                                               \
+            }                                                                                                                                             \
+        }                                                                                                                                                 \
     } while (0)
 #endif
 
@@ -323,6 +691,47 @@ inline std::string log_filename_generator_impl(LogTriState multilog, const std::
     #define LOG_TEELN(str, ...) LOG_TEE_IMPL("%s" str, "", __VA_ARGS__, "\n")
 #endif
 
+// Debug LOG macros.
+//  same as LOG and LOGLN, for the details logged at every token or step
+//
+#ifndef _MSC_VER
+    #define LOG_DBG(...) LOG_IMPL(__VA_ARGS__, "")
+    #define LOG_DBGLN(...) LOG_IMPL(__VA_ARGS__, "\n")
+#else
+    #define LOG_DBG(str, ...) LOG_IMPL("%s" str, "", __VA_ARGS__, "")
+    #define LOG_DBGLN(str, ...) LOG_IMPL("%s" str, "", __VA_ARGS__, "\n")
+#endif
+
+// Allows removing the less important logs at compile time.
+//  the arguments of the removed macros are not evaluated.
+//  in order to keep only LOG() and LOG_TEE(), define LOG_MIN_LEVEL
+//  like so:
+//
+//  #define LOG_MIN_LEVEL LOG_LEVEL_TRACE
+//  #include "log.h"
+//
+#define LOG_LEVEL_DEBUG 0 // LOG_DBG(), LOG_DBGLN()
+#define LOG_LEVEL_TRACE 1 // LOG(), LOGLN()
+#define LOG_LEVEL_TEE   2 // LOG_TEE(), LOG_TEELN()
+
+#ifndef LOG_MIN_LEVEL
+    #define LOG_MIN_LEVEL LOG_LEVEL_DEBUG
+#endif
+
+#if LOG_MIN_LEVEL > LOG_LEVEL_DEBUG
+    #undef LOG_DBG
+    #define LOG_DBG(...) do {} while (0)
+    #undef LOG_DBGLN
+    #define LOG_DBGLN(...) do {} while (0)
+#endif
+
+#if LOG_MIN_LEVEL > LOG_LEVEL_TRACE
+    #undef LOG
+    #define LOG(...) do {} while (0)
+    #undef LOGLN
+    #define LOGLN(...) do {} while (0)
+#endif
+
 // INTERNAL, DO NOT USE
 inline FILE *log_handler1_impl(bool change = false, LogTriState append = LogTriStateSame, LogTriState disable = LogTriStateSame, const std::string & filename = LOG_DEFAULT_FILE_NAME, FILE *target = nullptr)
 {
@@ -371,6 +780,9 @@ inline FILE *log_handler1_impl(bool change = false, LogTriState append = LogTriS
     }
 
     // do the (re)initialization
+    //  the queued messages may point at the file being closed
+    log_async_flush();
+
     if (target != nullptr)
     {
         if (logfile != nullptr && logfile != stdout && logfile != stderr)
@@ -490,15 +902,19 @@ inline void log_test()
     LOG("13 Hello World this time in yet new file?\n");
     log_set_target(log_filename_generator("llama_autonamed", "log"));
     LOG("14 Hello World in log with generated filename!\n");
+    log_async(true);
+    LOG("15 Hello World from the background thread!\n");
+    LOG_TEE("16 Hello World TEE from the background thread!\n");
+    log_async(false);
 #ifdef _MSC_VER
-    LOG_TEE("15 Hello msvc TEE without arguments\n");
-    LOG_TEE("16 Hello msvc TEE with (%d)(%s) arguments\n", 1, "test");
-    LOG_TEELN("17 Hello msvc TEELN without arguments\n");
-    LOG_TEELN("18 Hello msvc TEELN with (%d)(%s) arguments\n", 1, "test");
-    LOG("19 Hello msvc LOG without arguments\n");
-    LOG("20 Hello msvc LOG with (%d)(%s) arguments\n", 1, "test");
-    LOGLN("21 Hello msvc LOGLN without arguments\n");
-    LOGLN("22 Hello msvc LOGLN with (%d)(%s) arguments\n", 1, "test");
+    LOG_TEE("17 Hello msvc TEE without arguments\n");
+    LOG_TEE("18 Hello msvc TEE with (%d)(%s) arguments\n", 1, "test");
+    LOG_TEELN("19 Hello msvc TEELN without arguments\n");
+    LOG_TEELN("20 Hello msvc TEELN with (%d)(%s) arguments\n", 1, "test");
+    LOG("21 Hello msvc LOG without arguments\n");
+    LOG("22 Hello msvc LOG with (%d)(%s) arguments\n", 1, "test");
+    LOGLN("23 Hello msvc LOGLN without arguments\n");
+    LOGLN("24 Hello msvc LOGLN with (%d)(%s) arguments\n", 1, "test");
 #endif
 }
 
@@ -534,6 +950,12 @@ inline bool log_param_single_parse(const std::string & param)
         return true;
     }
 
+    if (param == "--log-async")
+    {
+        log_async(true);
+        return true;
+    }
+
     return false;
 }
 
@@ -566,6 +988,7 @@ inline void log_print_usage()
     printf("  --log-new             Create a separate new log file on start. "
                                    "Each log file will have unique name: \"<name>.<ID>.log\"\n");
     printf("  --log-append          Don't truncate the old log file.\n");
+    printf("  --log-async           Write the logs from a background thread.\n");
 }
 
 #define log_dump_cmdline(argc, argv) log_dump_cmdline_impl(argc, argv)
@@ -698,6 +1121,10 @@ inline std::string LOG_BATCH_TOSTR_PRETTY(const C & ctx, const B & batch)
 #define LOG(...) // dummy stub
 #undef LOGLN
 #define LOGLN(...) // dummy stub
+#undef LOG_DBG
+#define LOG_DBG(...) // dummy stub
+#undef LOG_DBGLN
+#define LOG_DBGLN(...) // dummy stub
 
 #undef LOG_TEE
 #define LOG_TEE(...) fprintf(stderr, __VA_ARGS__) // convert to normal fprintf
@@ -1,11 +1,331 @@
 #include "sampling.h"
-#include <fstream>
 #include <chrono>
+#include <list>
+#include <mutex>
+#include <numeric>
 #include <regex>
+#include <thread>
+
+//
+// repetition detector
+//
+
+void llama_repetition_detector::init(int32_t max_period) {
+    this->max_period = std::max(max_period, 0);
+    window.assign(this->max_period, 0);
+    runs.assign(this->max_period, 0);
+    n_bytes = 0;
+    n_blank = 0;
+}
 
-static uint64_t prev_sampling_time = 0;
+void llama_repetition_detector::reset() {
+    init(max_period);
+}
 
-struct llama_sampling_context * llama_sampling_init(const struct llama_sampling_params & params) {
+void llama_repetition_detector::append(const char * data, size_t size) {
+    for (size_t i = 0; i < size; ++i) {
+        const char c = data[i];
+        for (int32_t p = 1; p <= max_period; ++p) {
+            if (n_bytes >= (size_t) p && window[(n_bytes - p) % max_period] == c) {
+                runs[p - 1]++;
+            } else {
+                runs[p - 1] = 0;
+            }
+        }
+        if (max_period > 0) {
+            window[n_bytes % max_period] = c;
+        }
+        n_bytes++;
+        n_blank = (c == ' ' || c == '\t') ? n_blank + 1 : 0;
+    }
+}
+
+int32_t llama_repetition_detector::count(int32_t period) const {
+    if (period < 1 || period > max_period || n_bytes < (size_t) period) {
+        return 0;
+    }
+    return 1 + runs[period - 1] / period;
+}
+
+int32_t llama_repetition_detector::find_period(int32_t min_count) const {
+    for (int32_t p = 1; p <= max_period; ++p) {
+        // a repeated run of blanks is indentation, not a loop
+        if (n_blank < (size_t) p && count(p) >= min_count) {
+            return p;
+        }
+    }
+    return 0;
+}
+
+//
+// token history
+//
+
+void llama_token_history::init(size_t capacity, size_t n_window) {
+    this->capacity = capacity;
+    this->n_window = std::min(n_window, capacity);
+    reset();
+}
+
+void llama_token_history::reset() {
+    head = 0;
+    buf.assign(2*capacity, 0);
+
+    for (const llama_token id : window_tokens) {
+        window_pos[id] = -1;
+    }
+    window_tokens.clear();
+    window_counts.clear();
+
+    if (n_window > 0) {
+        count(0, n_window);
+    }
+}
+
+void llama_token_history::push(llama_token id) {
+    if (capacity == 0) {
+        return;
+    }
+
+    // the token leaving the window is n_window tokens back
+    if (n_window > 0) {
+        count(buf[head + capacity - n_window], -1);
+        count(id, 1);
+    }
+
+    buf[head] = id;
+    buf[head + capacity] = id;
+    head = head + 1 == capacity ? 0 : head + 1;
+}
+
+void llama_token_history::count(llama_token id, int32_t delta) {
+    if ((size_t) id >= window_pos.size()) {
+        window_pos.resize(id + 1, -1);
+    }
+
+    int32_t & pos = window_pos[id];
+    if (pos < 0) {
+        pos = window_tokens.size();
+        window_tokens.push_back(id);
+        window_counts.push_back(0);
+    }
+
+    window_counts[pos] += delta;
+    if (window_counts[pos] == 0) {
+        // swap with the last distinct token
+        const llama_token last = window_tokens.back();
+        window_tokens[pos] = last;
+        window_counts[pos] = window_counts.back();
+        window_pos[last]   = pos;
+        window_tokens.pop_back();
+        window_counts.pop_back();
+        window_pos[id] = -1;
+    }
+}
+
+//
+// grammar cache
+//
+
+// compiled grammars keyed by the hash of their text, shared by all sampling contexts so that
+// identical grammars (consecutive dynamic grammars, repeated server requests) are parsed once
+#define LLAMA_SAMPLING_GRAMMAR_CACHE_SIZE 32
+
+struct llama_grammar_cache_entry {
+    std::string                 text;
+    grammar_parser::parse_state parsed;
+    llama_grammar             * grammar; // initial state, never advanced
+};
+
+struct llama_grammar_cache {
+    std::list<llama_grammar_cache_entry> entries; // most recently used first
+    std::unordered_map<size_t, std::list<llama_grammar_cache_entry>::iterator> index;
+    std::mutex mutex;
+
+    ~llama_grammar_cache() {
+        for (auto & entry : entries) {
+            llama_grammar_free(entry.grammar);
+        }
+    }
+};
+
+static llama_grammar_cache g_grammar_cache;
+
+// on a hit, returns a copy of the cached parse state and initial grammar, without a partial UTF-8 sequence
+static bool grammar_cache_get(const std::string & text, grammar_parser::parse_state & parsed, llama_grammar ** grammar) {
+    std::lock_guard<std::mutex> lock(g_grammar_cache.mutex);
+
+    auto it = g_grammar_cache.index.find(std::hash<std::string>{}(text));
+    if (it == g_grammar_cache.index.end() || it->second->text != text) {
+        return false;
+    }
+
+    g_grammar_cache.entries.splice(g_grammar_cache.entries.begin(), g_grammar_cache.entries, it->second);
+
+    parsed   = it->second->parsed;
+    *grammar = llama_grammar_copy(it->second->grammar);
+
+    return true;
+}
+
+static void grammar_cache_put(const std::string & text, const grammar_parser::parse_state & parsed, const llama_grammar * grammar) {
+    std::lock_guard<std::mutex> lock(g_grammar_cache.mutex);
+
+    const size_t hash = std::hash<std::string>{}(text);
+
+    auto it = g_grammar_cache.index.find(hash);
+    if (it != g_grammar_cache.index.end()) {
+        // hash collision or concurrent insert, keep the newest
+        llama_grammar_free(it->second->grammar);
+        g_grammar_cache.entries.erase(it->second);
+        g_grammar_cache.index.erase(it);
+    }
+
+    if (g_grammar_cache.entries.size() >= LLAMA_SAMPLING_GRAMMAR_CACHE_SIZE) {
+        auto & lru = g_grammar_cache.entries.back();
+        g_grammar_cache.index.erase(std::hash<std::string>{}(lru.text));
+        llama_grammar_free(lru.grammar);
+        g_grammar_cache.entries.pop_back();
+    }
+
+    // the partial UTF-8 sequence is the one of the token before the grammar, not part of it
+    llama_grammar * initial = llama_grammar_copy(grammar);
+    llama_grammar_copy_partial_utf8(initial, NULL);
+
+    g_grammar_cache.entries.push_front({ text, parsed, initial });
+    g_grammar_cache.index[hash] = g_grammar_cache.entries.begin();
+}
+
+// set the grammar of the sampling context from its text, positioned at the root rule
+// on a cache miss, the current parse state and grammar of the context are updated incrementally
+static bool sampling_set_grammar(struct llama_sampling_context * ctx, const std::string & text) {
+    auto & parsed_grammar = ctx->parsed_grammar;
+
+    llama_grammar * cached = nullptr;
+    if (grammar_cache_get(text, parsed_grammar, &cached)) {
+        if (ctx->grammar != NULL) {
+            // as on a miss, the next token completes the partial UTF-8 sequence of the last one
+            llama_grammar_copy_partial_utf8(cached, ctx->grammar);
+            llama_grammar_free(ctx->grammar);
+        }
+        ctx->grammar = cached;
+        llama_grammar_set_mask_cache(ctx->grammar, ctx->params.grammar_mask_cache);
+        return true;
+    }
+
+    // only the rules whose definition changed since the previous grammar are parsed and copied again
+    std::vector<uint32_t> changed_rules;
+    if (!grammar_parser::parse_update(parsed_grammar, text.c_str(), changed_rules) ||
+         parsed_grammar.symbol_ids.find("root") == parsed_grammar.symbol_ids.end()) {
+        return false;
+    }
+
+    std::vector<const llama_grammar_element *> grammar_rules(parsed_grammar.c_rules());
+    const uint32_t root_id = parsed_grammar.symbol_ids.at("root");
+
+    if (ctx->grammar == NULL) {
+        ctx->grammar = llama_grammar_init(grammar_rules.data(), grammar_rules.size(), root_id);
+    } else {
+        llama_grammar_update_rules(ctx->grammar,
+                grammar_rules.data(), grammar_rules.size(),
+                changed_rules.data(), changed_rules.size(), root_id);
+    }
+
+    llama_grammar_set_mask_cache(ctx->grammar, ctx->params.grammar_mask_cache);
+
+    grammar_cache_put(text, parsed_grammar, ctx->grammar);
+
+    return true;
+}
+
+// set the grammar of the sampling context from the rules of a native provider
+static bool sampling_set_grammar_rules(struct llama_sampling_context * ctx, const llama_grammar_plugin_rules & rules) {
+    if (rules.changed_rules == nullptr) {
+        if (ctx->grammar == NULL) {
+            ctx->grammar = llama_grammar_init(rules.rules, rules.n_rules, rules.start_rule);
+        } else {
+            // every rule changed, the partial UTF-8 sequence of the last token is kept
+            std::vector<uint32_t> changed_rules(rules.n_rules);
+            std::iota(changed_rules.begin(), changed_rules.end(), 0);
+            llama_grammar_update_rules(ctx->grammar,
+                    rules.rules, rules.n_rules,
+                    changed_rules.data(), changed_rules.size(), rules.start_rule);
+        }
+    } else {
+        // a delta is relative to the previous rules of the provider
+        if (ctx->grammar == NULL) {
+            return false;
+        }
+        llama_grammar_update_rules(ctx->grammar,
+                rules.rules, rules.n_rules,
+                rules.changed_rules, rules.n_changed_rules, rules.start_rule);
+    }
+
+    llama_grammar_set_mask_cache(ctx->grammar, ctx->params.grammar_mask_cache);
+
+    return true;
+}
+
+// waits for the queries of the providers running in the background, if any
+static void sampling_wait_grammar_query(struct llama_sampling_context * ctx) {
+    if (ctx->grammar_query.valid()) {
+        ctx->grammar_query.wait();
+        ctx->grammar_query = {};
+    }
+
+    for (auto & prefetch : ctx->grammar_prefetch) {
+        prefetch.query.wait();
+    }
+    ctx->grammar_prefetch.clear();
+}
+
+// starts querying the provider for the grammar that follows the last accepted token
+// a single query runs at a time, as the provider session is not thread-safe; the tokens accepted
+// meanwhile are sent with the next query
+// a native provider is queried in llama_sampling_sample instead, it is cheaper than starting a thread
+static void sampling_start_grammar_query(struct llama_sampling_context * ctx) {
+    if (ctx->grammar_provider == nullptr || ctx->prev_all.empty() || ctx->grammar_query.valid() ||
+        llama_grammar_provider_is_native(ctx->grammar_provider)) {
+        return;
+    }
+
+    // the grammar may already be on its way from the session of a candidate, which becomes the main one
+    for (size_t i = 0; i < ctx->grammar_prefetch.size(); ++i) {
+        auto & prefetch = ctx->grammar_prefetch[i];
+        if (prefetch.n_tokens == ctx->prev_all.size() && prefetch.token == ctx->prev_all.back()) {
+            std::swap(ctx->grammar_provider, ctx->prefetch_providers[prefetch.i_provider]);
+            ctx->grammar_query = std::move(prefetch.query);
+            ctx->grammar_query_prefetched = true;
+            ctx->grammar_prefetch.erase(ctx->grammar_prefetch.begin() + i);
+            return;
+        }
+    }
+
+    // tokens keep being accepted while the query runs, the text is append-only so the first
+    // n_tokens pieces stay the same
+    const size_t n_tokens = ctx->prev_all.size();
+    const size_t begin    = ctx->prev_all_offsets[std::min(ctx->prelude_len, n_tokens - 1)];
+    const size_t last     = ctx->prev_all_offsets[n_tokens - 1];
+
+    std::string new_token = ctx->prev_all_text.substr(last);
+
+    ctx->grammar_query_prefetched = false;
+    ctx->grammar_query = std::async(std::launch::async, [ctx, n_tokens, begin, last, new_token]() {
+        llama_grammar_provider_result result;
+        result.n_tokens = n_tokens;
+
+        auto get_program = [&]() {
+            std::lock_guard<std::mutex> lock(ctx->prev_all_mutex);
+            return ctx->prev_all_text.substr(begin, last - begin);
+        };
+
+        result.ok = llama_grammar_provider_query(ctx->grammar_provider, n_tokens, new_token, get_program, result.output);
+        return result;
+    });
+}
+
+// a new provider is started if grammar_provider is null and the parameters have a dynamic grammar
+static struct llama_sampling_context * sampling_init(const struct llama_sampling_params & params, llama_grammar_provider * grammar_provider) {
     struct llama_sampling_context * result = new llama_sampling_context();
 
     result->params  = params;
@@ -13,35 +333,94 @@ struct llama_sampling_context * llama_sampling_init(const struct llama_sampling_
 
     // if there is a grammar, parse it
     if (!params.grammar.empty()) {
-        result->parsed_grammar = grammar_parser::parse(params.grammar.c_str());
-
-        // will be empty (default) if there are parse errors
-        if (result->parsed_grammar.rules.empty()) {
+        if (!sampling_set_grammar(result, params.grammar)) {
             fprintf(stderr, "%s: failed to parse grammar\n", __func__);
+            llama_grammar_provider_free(grammar_provider);
+            delete result;
+            return nullptr;
+        }
+    }
+
+    result->grammar_provider = grammar_provider;
+    if (result->grammar_provider == nullptr && !params.dynamic_grammar.empty()) {
+        result->grammar_provider = llama_grammar_provider_init(params.dynamic_grammar_cmd, params.dynamic_grammar, params.dynamic_grammar_prelude);
+        if (result->grammar_provider == nullptr) {
+            if (result->grammar != NULL) {
+                llama_grammar_free(result->grammar);
+            }
+            delete result;
             return nullptr;
         }
+    }
 
-        std::vector<const llama_grammar_element *> grammar_rules(result->parsed_grammar.c_rules());
+    result->prev.init(params.n_prev, params.penalty_last_n < 0 ? params.n_prev : params.penalty_last_n);
 
-        result->grammar = llama_grammar_init(
-                grammar_rules.data(),
-                grammar_rules.size(), result->parsed_grammar.symbol_ids.at("root"));
+    result->trace_seq = llama_trace_new_seq();
+
+    result->repetition.init(params.repetition_stop_count > 0 ? params.repetition_stop_period : 0);
+
+    return result;
+}
+
+struct llama_sampling_context * llama_sampling_init(const struct llama_sampling_params & params) {
+    return sampling_init(params, nullptr);
+}
+
+struct llama_sampling_context * llama_sampling_reinit(struct llama_sampling_context * ctx, const struct llama_sampling_params & params) {
+    if (ctx == nullptr) {
+        return sampling_init(params, nullptr);
+    }
+
+    sampling_wait_grammar_query(ctx);
+
+    llama_grammar_provider * grammar_provider = nullptr;
+    std::vector<llama_grammar_provider *> prefetch_providers;
+    if (ctx->grammar_provider != nullptr &&
+        ctx->params.dynamic_grammar         == params.dynamic_grammar &&
+        ctx->params.dynamic_grammar_cmd     == params.dynamic_grammar_cmd &&
+        ctx->params.dynamic_grammar_prelude == params.dynamic_grammar_prelude) {
+        grammar_provider = ctx->grammar_provider;
+        ctx->grammar_provider = nullptr;
+
+        // the session is kept, the program of the next query is sent in full
+        llama_grammar_provider_reset(grammar_provider);
+
+        prefetch_providers.swap(ctx->prefetch_providers);
+    }
+
+    llama_sampling_free(ctx);
+
+    struct llama_sampling_context * result = sampling_init(params, grammar_provider);
+    if (result == nullptr) {
+        for (auto * provider : prefetch_providers) {
+            llama_grammar_provider_free(provider);
+        }
+        return nullptr;
     }
 
-    result->prev.resize(params.n_prev);
+    result->prefetch_providers = std::move(prefetch_providers);
 
     return result;
 }
 
 void llama_sampling_free(struct llama_sampling_context * ctx) {
+    sampling_wait_grammar_query(ctx);
+
     if (ctx->grammar != NULL) {
         llama_grammar_free(ctx->grammar);
     }
 
+    llama_grammar_provider_free(ctx->grammar_provider);
+    for (auto * provider : ctx->prefetch_providers) {
+        llama_grammar_provider_free(provider);
+    }
+
     delete ctx;
 }
 
 void llama_sampling_reset(llama_sampling_context * ctx) {
+    sampling_wait_grammar_query(ctx);
+
     if (ctx->grammar != NULL) {
         llama_grammar_free(ctx->grammar);
         ctx->grammar = NULL;
@@ -53,12 +432,21 @@ void llama_sampling_reset(llama_sampling_context * ctx) {
         ctx->grammar = llama_grammar_init(
                 grammar_rules.data(),
                 grammar_rules.size(), ctx->parsed_grammar.symbol_ids.at("root"));
+        llama_grammar_set_mask_cache(ctx->grammar, ctx->params.grammar_mask_cache);
     }
 
-    std::fill(ctx->prev.begin(), ctx->prev.end(), 0);
+    if (ctx->grammar_provider) {
+        llama_grammar_provider_reset(ctx->grammar_provider);
+    }
+
+    ctx->prev.reset();
     ctx->cur.clear();
     ctx->prev_all.clear();
+    ctx->prev_all_text.clear();
+    ctx->prev_all_offsets.assign(1, 0);
     ctx->prelude_len = 0;
+    ctx->repetition.reset();
+    ctx->stop_reason = LLAMA_SAMPLING_STOP_NONE;
 }
 
 void llama_sampling_cp(llama_sampling_context * src, llama_sampling_context * dst) {
@@ -71,9 +459,42 @@ void llama_sampling_cp(llama_sampling_context * src, llama_sampling_context * ds
         dst->grammar = llama_grammar_copy(src->grammar);
     }
 
+    // keep the parse state in sync with the grammar rules, dynamic grammars are updated from it
+    dst->parsed_grammar = src->parsed_grammar;
+
+    // the provider session cannot be shared, the destination resyncs it on the next query
+    sampling_wait_grammar_query(dst);
+    if (dst->grammar_provider) {
+        llama_grammar_provider_reset(dst->grammar_provider);
+    }
+
     dst->prev = src->prev;
     dst->prev_all = src->prev_all;
+    dst->prev_all_text = src->prev_all_text;
+    dst->prev_all_offsets = src->prev_all_offsets;
     dst->prelude_len = src->prelude_len;
+    dst->repetition = src->repetition;
+    dst->stop_reason = src->stop_reason;
+}
+
+std::vector<struct llama_sampling_context *> llama_sampling_fork(struct llama_sampling_context * src, int n) {
+    std::vector<struct llama_sampling_context *> result;
+    result.reserve(n);
+
+    for (int i = 0; i < n; ++i) {
+        struct llama_sampling_context * dst = llama_sampling_init(src->params);
+        if (dst == nullptr) {
+            for (auto * ctx : result) {
+                llama_sampling_free(ctx);
+            }
+            return {};
+        }
+
+        llama_sampling_cp(src, dst);
+        result.push_back(dst);
+    }
+
+    return result;
 }
 
 llama_token llama_sampling_last(llama_sampling_context * ctx) {
@@ -88,7 +509,9 @@ std::string llama_sampling_prev_str(llama_sampling_context * ctx_sampling, llama
     std::string result;
 
     for (int i = size - n; i < size; i++) {
-        result += llama_token_to_piece(ctx_main, ctx_sampling->prev[i]);
+        int32_t n_piece;
+        const char * piece = llama_token_get_piece_view(llama_get_model(ctx_main), ctx_sampling->prev[i], &n_piece);
+        result.append(piece, n_piece);
     }
 
     return result;
@@ -96,18 +519,46 @@ std::string llama_sampling_prev_str(llama_sampling_context * ctx_sampling, llama
 
 void llama_sampling_set_prelude_len(llama_sampling_context * ctx, size_t prelude_len) {
     ctx->prelude_len = prelude_len;
+
+    // only the text after the prelude is checked for repetitions
+    const size_t begin = ctx->prev_all_offsets[std::min(prelude_len, ctx->prev_all.size())];
+    ctx->repetition.reset();
+    ctx->repetition.append(ctx->prev_all_text.data() + begin, ctx->prev_all_text.size() - begin);
 }
 
 std::string llama_sampling_prev_all_str(llama_sampling_context * ctx_sampling, llama_context * ctx_main, int start_skip_tokens, int end_skip_tokens) {
-    std::string result;
+    (void) ctx_main; // the pieces are detokenized once, in llama_sampling_accept
 
-    auto total_tokens = ctx_sampling->prev_all.size();
-    for (auto i = start_skip_tokens; i < total_tokens - end_skip_tokens; ++i) {
-        auto token = ctx_sampling->prev_all[i];
-        result += llama_token_to_piece(ctx_main, token);
+    const auto & offsets = ctx_sampling->prev_all_offsets;
+
+    const int n_tokens = ctx_sampling->prev_all.size();
+    const int begin    = std::max(0, std::min(start_skip_tokens, n_tokens));
+    const int end      = std::max(begin, n_tokens - std::max(0, end_skip_tokens));
+
+    return ctx_sampling->prev_all_text.substr(offsets[begin], offsets[end] - offsets[begin]);
+}
+
+// output of the provider after the last accepted token, from the query started in the background
+// if it is still current
+static bool sampling_query_grammar(struct llama_sampling_context * ctx, struct llama_context * ctx_main, std::string & output) {
+    const size_t n_tokens = ctx->prev_all.size();
+
+    if (ctx->grammar_query.valid()) {
+        llama_grammar_provider_result result = ctx->grammar_query.get();
+        ctx->grammar_query = {};
+        if (result.n_tokens == n_tokens) {
+            output = std::move(result.output);
+            return result.ok;
+        }
     }
 
-    return result;
+    // the last token just sampled will be the new token
+    auto new_token = ctx->prev_all_text.substr(ctx->prev_all_offsets[n_tokens - 1]);
+    auto get_program = [&]() {
+        return llama_sampling_prev_all_str(ctx, ctx_main, ctx->prelude_len, 1);
+    };
+
+    return llama_grammar_provider_query(ctx->grammar_provider, n_tokens, new_token, get_program, output);
 }
 
 std::string llama_sampling_print(const llama_sampling_params & params) {
@@ -124,33 +575,13 @@ std::string llama_sampling_print(const llama_sampling_params & params) {
     return std::string(result);
 }
 
-std::string exec(const char* cmd) {
-    std::array<char, 128> buffer;
-    std::string result;
-    std::unique_ptr<FILE, decltype(&pclose)> pipe(popen(cmd, "r"), pclose);
-    if (!pipe) {
-        throw std::runtime_error("popen() failed!");
-    }
-    while (fgets(buffer.data(), buffer.size(), pipe.get()) != nullptr) {
-        result += buffer.data();
+const char * llama_sampling_stop_reason_str(llama_sampling_stop_reason reason) {
+    switch (reason) {
+        case LLAMA_SAMPLING_STOP_NONE:         return "none";
+        case LLAMA_SAMPLING_STOP_FUNCTION_END: return "function_end";
+        case LLAMA_SAMPLING_STOP_REPETITION:   return "repetition";
     }
-    return result;
-}
-
-std::string extract_substring_after_delimiter(const std::string& str, const std::string& delimiter) {
-    size_t pos = str.find(delimiter);
-    if (pos != std::string::npos) {
-        // Add the length of the delimiter to 'pos' to start after the delimiter
-        pos += delimiter.length();
-
-        // Extract the substring from 'pos' to the end of the string
-        std::string extracted = str.substr(pos);
-
-        // Optional: trim leading whitespace if needed
-        size_t start = extracted.find_first_not_of(" \n\r\t\f\v");
-        return (start == std::string::npos) ? "" : extracted.substr(start);
-    }
-    return ""; // Return empty string if delimiter is not found
+    return "unknown";
 }
 
 std::string fix_grammar(const std::string& grammar) {
@@ -211,85 +642,209 @@ static void sampler_queue(
     }
 }
 
-std::string escape_string(const std::string& input) {
-    std::string output;
-    for (char c : input) {
-        switch (c) {
-            case '\\': output += "\\\\"; break;
-            case '\"': output += "\\\""; break;
-            default: output += c; break;
+// https://stackoverflow.com/a/2072890/6798201
+// only the part of value starting at begin is considered
+inline bool ends_with(std::string const &value, size_t begin, std::string const &ending) {
+    if (begin > value.size() || ending.size() > value.size() - begin)
+        return false;
+    return std::equal(ending.rbegin(), ending.rend(), value.rbegin());
+}
+
+// number of candidates with the largest logits that the token is drawn from, 0 if the token can depend on all
+// the candidates: with guidance, the mirostat samplers, or samplers that look at the whole distribution before top_k
+static size_t sampling_n_keep(const llama_sampling_params & params, bool has_cfg, int n_vocab) {
+    if (has_cfg || params.mirostat != 0 || params.temp < 0.0) {
+        return 0;
+    }
+
+    size_t n_keep = 0;
+    if (params.temp == 0.0) {
+        // the probabilities of the greedy token are computed over all the candidates
+        n_keep = params.n_probs > 0 ? 0 : 1;
+    } else if (params.top_k > 0) {
+        // the temperature keeps the order of the candidates, all the other samplers must come after top_k
+        const size_t first = params.samplers_sequence.find_first_not_of('t');
+        if (first != std::string::npos && params.samplers_sequence[first] == 'k') {
+            n_keep = std::max(params.top_k, std::max(1, params.n_probs));
         }
     }
-    return output;
+
+    // selecting the candidates is not worth it when they are a large part of the vocabulary
+    return 4*n_keep < (size_t) n_vocab ? n_keep : 0;
 }
 
-// Function to check if the string ends with a substring repeating 5 or more times
-bool ends_with_repeated_substring(const std::string& str, int max_length, int min_repetitions) {
-    // Check for excessively repeated spaces (>= 40 times)
-    if (str.length() >= 40) {
-        std::string last_sub = str.substr(str.length() - 40);
-        if (std::all_of(last_sub.begin(), last_sub.end(), [](char c) { return c == ' ' || c == '\t'; })) {
-            return true;
+// fills cur with the n candidates with the largest logits, and returns the largest logit of the other candidates
+// cur is used as a min-heap of the n + 1 largest logits seen, the logits are compared against its minimum a block
+// at a time with a loop that the compiler vectorizes, so the blocks without a larger logit skip the heap
+static float sampling_select_top(const float * logits, int n_vocab, size_t n, std::vector<llama_token_data> & cur) {
+    GGML_ASSERT(n < (size_t) n_vocab);
+
+    const auto cmp = [](const llama_token_data & a, const llama_token_data & b) { return a.logit > b.logit; };
+
+    const int n_block = 32;
+
+    cur.clear();
+
+    float threshold = -INFINITY;
+
+    for (int i0 = 0; i0 < n_vocab; i0 += n_block) {
+        const int i1 = std::min(i0 + n_block, n_vocab);
+
+        if (cur.size() > n) {
+            int n_above = 0;
+            for (int i = i0; i < i1; ++i) {
+                n_above += logits[i] > threshold;
+            }
+            if (n_above == 0) {
+                continue;
+            }
         }
+
+        for (int i = i0; i < i1; ++i) {
+            if (cur.size() <= n) {
+                cur.push_back(llama_token_data{i, logits[i], 0.0f});
+                std::push_heap(cur.begin(), cur.end(), cmp);
+            } else if (logits[i] > threshold) {
+                std::pop_heap(cur.begin(), cur.end(), cmp);
+                cur.back() = llama_token_data{i, logits[i], 0.0f};
+                std::push_heap(cur.begin(), cur.end(), cmp);
+            } else {
+                continue;
+            }
+            threshold = cur.front().logit;
+        }
+    }
+
+    std::pop_heap(cur.begin(), cur.end(), cmp);
+    threshold = cur.back().logit;
+    cur.pop_back();
+
+    return threshold;
+}
+
+// with params.grammar_prefetch, starts querying the grammars that follow the candidates with the largest
+// logits, each on a session of its own, while the grammar of the token being sampled is still awaited
+// the grammar is not known yet so the candidates are taken before it; the prefetch is skipped when the
+// grammar queried after the last token is already there, as the provider is then not the bottleneck
+// the queries of the previous token that were not taken may still run, their sessions are left alone
+// and up to twice as many sessions as candidates are started so that the pipeline does not wait for them,
+// never more than LLAMA_SAMPLING_GRAMMAR_PREFETCH_MAX as each session is a process of its own
+#define LLAMA_SAMPLING_GRAMMAR_PREFETCH_MAX 16
+
+static void sampling_start_grammar_prefetch(struct llama_sampling_context * ctx, struct llama_context * ctx_main, const float * logits) {
+    const auto & params = ctx->params;
+
+    auto & prefetches = ctx->grammar_prefetch;
+    prefetches.erase(std::remove_if(prefetches.begin(), prefetches.end(), [](const llama_grammar_prefetch & prefetch) {
+        return prefetch.query.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+    }), prefetches.end());
+
+    if (params.grammar_prefetch <= 0 || ctx->grammar_provider == nullptr || ctx->prev_all.empty() ||
+        !ctx->grammar_query.valid() ||
+        (!ctx->grammar_query_prefetched && ctx->grammar_query.wait_for(std::chrono::seconds(0)) == std::future_status::ready)) {
+        return;
+    }
+
+    const llama_model * model = llama_get_model(ctx_main);
+    const int n_vocab = llama_n_vocab(model);
+
+    const size_t n_prefetch = std::min<size_t>(std::min(params.grammar_prefetch, LLAMA_SAMPLING_GRAMMAR_PREFETCH_MAX), n_vocab - 1);
+
+    std::vector<llama_token_data> top;
+    sampling_select_top(logits, n_vocab, n_prefetch, top);
+    std::sort(top.begin(), top.end(), [](const llama_token_data & a, const llama_token_data & b) { return a.logit > b.logit; });
+
+    std::vector<bool> busy(ctx->prefetch_providers.size(), false);
+    for (const auto & prefetch : prefetches) {
+        busy[prefetch.i_provider] = true;
     }
-    
-    for (int len = 1; len <= max_length; ++len) { // Length of the substring
-        if (str.length() < min_repetitions * len) continue; // Ensure there's enough length for the minimum repetitions
 
-        bool is_repeating = true;
-        std::string last_sub = str.substr(str.length() - len); // Last substring of length 'len'
+    // the candidate is the token after the last accepted one
+    const size_t n_tokens = ctx->prev_all.size() + 1;
+    const size_t begin    = ctx->prev_all_offsets[std::min(ctx->prelude_len, n_tokens - 1)];
+    const size_t last     = ctx->prev_all_offsets[n_tokens - 1];
+
+    size_t i_provider = 0;
 
-        // Check if the substring is a continuous stretch of spaces or tabs
-        if (std::all_of(last_sub.begin(), last_sub.end(), [](char c) { return c == ' ' || c == '\t'; })) {
+    for (const auto & candidate : top) {
+        const llama_token token = candidate.id;
+        if (token == llama_token_eos(model)) {
             continue;
         }
 
-        // Check for the minimum number of consecutive repetitions
-        for (int rep = 1; rep < min_repetitions; ++rep) {
-            std::string test_sub = str.substr(str.length() - (rep + 1) * len, len);
-            if (last_sub != test_sub) {
-                is_repeating = false;
-                break; // No need to check further if any preceding substring doesn't match
+        while (i_provider < busy.size() && busy[i_provider]) {
+            i_provider++;
+        }
+        if (i_provider == busy.size()) {
+            if (busy.size() >= std::min<size_t>(2*n_prefetch, LLAMA_SAMPLING_GRAMMAR_PREFETCH_MAX)) {
+                break;
             }
+            llama_grammar_provider * provider = llama_grammar_provider_init(params.dynamic_grammar_cmd, params.dynamic_grammar, params.dynamic_grammar_prelude);
+            if (provider == nullptr) {
+                break;
+            }
+            ctx->prefetch_providers.push_back(provider);
+            busy.push_back(false);
         }
+        busy[i_provider] = true;
 
-        if (is_repeating) {
-            return true; // Found a substring that repeats the minimum number of times
-        }
-    }
-    return false; // No such repetition found
-}
+        int32_t n_piece;
+        const char * piece = llama_token_get_piece_view(model, token, &n_piece);
+        std::string new_token(piece, n_piece);
 
-// https://stackoverflow.com/a/2072890/6798201
-inline bool ends_with(std::string const &value, std::string const &ending) {
-    if (ending.size() > value.size())
-        return false;
-    return std::equal(ending.rbegin(), ending.rend(), value.rbegin());
+        // the session has seen another token, the program is sent in full
+        llama_grammar_provider * provider = ctx->prefetch_providers[i_provider];
+        llama_grammar_provider_reset(provider);
+
+        auto query = std::async(std::launch::async, [ctx, provider, n_tokens, begin, last, new_token]() {
+            llama_grammar_provider_result result;
+            result.n_tokens = n_tokens;
+
+            auto get_program = [&]() {
+                std::lock_guard<std::mutex> lock(ctx->prev_all_mutex);
+                return ctx->prev_all_text.substr(begin, last - begin);
+            };
+
+            result.ok = llama_grammar_provider_query(provider, n_tokens, new_token, get_program, result.output);
+            return result;
+        });
+
+        prefetches.push_back({ token, n_tokens, i_provider, std::move(query) });
+    }
 }
 
-llama_token llama_sampling_sample(
+// applies to the candidates everything that does not draw from the RNG of ctx_main: the logits of each
+// sequence are processed independently, which lets llama_sampling_sample_batch run them in parallel
+// returns true if the token is already known, on a stop condition and with greedy sampling
+static bool sampling_prepare(
                   struct llama_sampling_context * ctx_sampling,
                   struct llama_context * ctx_main,
-                  struct llama_context * ctx_cfg,
-                  const int idx) {
+                  float * logits_cfg,
+                  const int idx,
+                  llama_token_data_array & cur_p,
+                  llama_token & id) {
     const llama_sampling_params & params = ctx_sampling->params;
 
-    const int n_vocab = llama_n_vocab(llama_get_model(ctx_main));
+    const llama_model * model = llama_get_model(ctx_main);
+
+    const int n_vocab = llama_n_vocab(model);
 
     const float   temp            = params.temp;
-    const int32_t penalty_last_n  = params.penalty_last_n < 0 ? params.n_prev : params.penalty_last_n;
     const float   penalty_repeat  = params.penalty_repeat;
     const float   penalty_freq    = params.penalty_freq;
     const float   penalty_present = params.penalty_present;
     const int     mirostat        = params.mirostat;
-    const float   mirostat_tau    = params.mirostat_tau;
-    const float   mirostat_eta    = params.mirostat_eta;
     const bool    penalize_nl     = params.penalize_nl;
 
     auto & prev = ctx_sampling->prev;
     auto & cur  = ctx_sampling->cur;
 
-    llama_token id = 0;
+    // the phases of a token are traced together, the decision holds until the token is accepted
+    ctx_sampling->trace_token = llama_trace_sample();
+
+    const bool    trace       = ctx_sampling->trace_token;
+    const int32_t trace_seq   = ctx_sampling->trace_seq;
+    const int32_t trace_token = ctx_sampling->prev_all.size();
 
     float * logits = llama_get_logits_ith(ctx_main, idx);
 
@@ -298,188 +853,380 @@ llama_token llama_sampling_sample(
         logits[it->first] += it->second;
     }
 
-    cur.clear();
+    const auto & prev_all_text    = ctx_sampling->prev_all_text;
+    const auto & prev_all_offsets = ctx_sampling->prev_all_offsets;
+    const size_t n_prev_all       = ctx_sampling->prev_all.size();
+
+    const auto & repetition = ctx_sampling->repetition;
 
-    for (llama_token token_id = 0; token_id < n_vocab; token_id++) {
-        cur.emplace_back(llama_token_data{token_id, logits[token_id], 0.0f});
+    // Early exit when a function is finished, within the last few tokens, when the output is stuck in a loop,
+    // or with excessively repeated spaces (>= 40 times)
+    llama_sampling_stop_reason stop_reason = LLAMA_SAMPLING_STOP_NONE;
+    if (ends_with(prev_all_text, prev_all_offsets[n_prev_all - std::min<size_t>(3, n_prev_all)], "in\n\n")) {
+        stop_reason = LLAMA_SAMPLING_STOP_FUNCTION_END;
+    } else if (params.repetition_stop_count > 0 && (repetition.n_blank >= 40 || repetition.find_period(params.repetition_stop_count) > 0)) {
+        stop_reason = LLAMA_SAMPLING_STOP_REPETITION;
+    }
+    if (stop_reason != LLAMA_SAMPLING_STOP_NONE) {
+        ctx_sampling->stop_reason = stop_reason;
+        cur.clear();
+        cur_p = { cur.data(), 0, false };
+        id = llama_token_eos(model);
+        return true;
     }
 
-    llama_token_data_array cur_p = { cur.data(), cur.size(), false };
+    bool apply_grammar = ctx_sampling->grammar != NULL;
 
-    if (ctx_cfg) {
-        llama_sample_classifier_free_guidance(ctx_main, &cur_p, ctx_cfg, params.cfg_scale);
-    }
+    if (!params.dynamic_grammar.empty() && llama_grammar_provider_is_native(ctx_sampling->grammar_provider)) {
+        llama_trace_scope span(trace, "grammar_fetch", trace_seq, trace_token);
 
-    // apply penalties
-    if (!prev.empty()) {
-        const float nl_logit = logits[llama_token_nl(llama_get_model(ctx_main))];
+        const size_t n_tokens = ctx_sampling->prev_all.size();
 
-        llama_sample_repetition_penalties(ctx_main, &cur_p,
-                prev.data() + prev.size() - penalty_last_n,
-                penalty_last_n, penalty_repeat, penalty_freq, penalty_present);
+        auto new_token = prev_all_text.substr(prev_all_offsets[n_tokens - 1]);
+        auto get_program = [&]() {
+            return llama_sampling_prev_all_str(ctx_sampling, ctx_main, ctx_sampling->prelude_len, 1);
+        };
 
-        if (!penalize_nl) {
-            for (size_t idx = 0; idx < cur_p.size; idx++) {
-                if (cur_p.data[idx].id == llama_token_nl(llama_get_model(ctx_main))) {
-                    cur_p.data[idx].logit = nl_logit;
-                    break;
-                }
+        llama_grammar_plugin_rules rules;
+        const bool ok = llama_grammar_provider_query_rules(ctx_sampling->grammar_provider, n_tokens, new_token, get_program, rules);
+        if (!ok) {
+            fprintf(stderr, "%s: failed to query the grammar provider\n", __func__);
+        }
+        if (!ok || rules.n_rules == 0) {
+            // the token is not constrained and the next result replaces the whole grammar: the grammar of the
+            // previous token must not accept it
+            if (ctx_sampling->grammar != NULL) {
+                llama_grammar_free(ctx_sampling->grammar);
+                ctx_sampling->grammar = NULL;
+            }
+            apply_grammar = false;
+        } else {
+            apply_grammar = sampling_set_grammar_rules(ctx_sampling, rules);
+            if (!apply_grammar) {
+                fprintf(stderr, "%s: the grammar provider returned a delta without a grammar\n", __func__);
             }
         }
-    }
+    } else if (!params.dynamic_grammar.empty()) {
+        sampling_start_grammar_prefetch(ctx_sampling, ctx_main, logits);
 
-    // Early exit when a function is finished
-    std::string last_few_tokens_str = "";
-    for (int i = 3; i > 0; i--) {
-        last_few_tokens_str += llama_token_to_piece(ctx_main, ctx_sampling->prev_all[ctx_sampling->prev_all.size() - i]);
-    }
+        std::string output;
+        {
+            llama_trace_scope span(trace, "grammar_fetch", trace_seq, trace_token);
 
-    if (ends_with(last_few_tokens_str, "in\n\n")) {
-        exit(0);
-    }
+            if (!sampling_query_grammar(ctx_sampling, ctx_main, output)) {
+                fprintf(stderr, "%s: failed to query the grammar provider\n", __func__);
+            }
+        }
 
-    auto prev_all_str = llama_sampling_prev_all_str(ctx_sampling, ctx_main, ctx_sampling->prelude_len, 0);
-    int max_length = 30; // Maximum length of substrings to check for repetitions
-    int min_repetitions = 5; // Minimum number of times a substring must repeat to count
-    if (ends_with_repeated_substring(prev_all_str, max_length, min_repetitions))
-    {
-        exit(0);
-    }
-
-    if (!params.dynamic_grammar.empty()) {
-        // The last token just sampled will be the new token
-        auto new_token = llama_token_to_piece(ctx_main, ctx_sampling->prev_all[ctx_sampling->prev_all.size() - 1]);
-        std::string command = "node ../lsp.js COMPLETIONS " + params.dynamic_grammar + " --prelude ../autoregressive.prelude --debug --new-token \"" + escape_string(new_token) + "\" ";
-        command += "\"" + escape_string(llama_sampling_prev_all_str(ctx_sampling, ctx_main, ctx_sampling->prelude_len, 1)) + "\"";
-
-        std::string output = exec(command.c_str());
-        std::string grammar_str = fix_grammar(extract_substring_after_delimiter(output, "LSP: Grammar:\n"));
-        
-        std::ofstream log_file;
-        // Open the log file in append mode
-        log_file.open("log.txt", std::ios::app);
-
-        if (log_file.is_open()) {
-            // Write the log message to the file
-            log_file << std::endl << "================" << std::endl << llama_sampling_prev_all_str(ctx_sampling, ctx_main, ctx_sampling->prelude_len, 0) << std::endl << std::endl;
-            // log_file << "\nCommand:" << std::endl;
-            // log_file << command << std::endl;
-            log_file << output << std::endl;
-
-            // Close the file
-            log_file.close();
-        } else {
-            // Handle the error if the file couldn't be opened
-            std::cerr << "Unable to open the log file." << std::endl;
+        llama_trace_scope span(trace, "parse", trace_seq, trace_token);
+
+        // byte-identical grammars are common on consecutive tokens, skip the rewrite for those
+        std::string grammar_src = llama_grammar_provider_extract(output);
+        if (grammar_src != ctx_sampling->dynamic_grammar_src) {
+            ctx_sampling->dynamic_grammar_fixed = fix_grammar(grammar_src);
+            ctx_sampling->dynamic_grammar_src   = std::move(grammar_src);
         }
-        
-        ctx_sampling->parsed_grammar = grammar_parser::parse(grammar_str.c_str());
+        const std::string & grammar_str = ctx_sampling->dynamic_grammar_fixed;
 
-        // will be empty (default) if there are parse errors
-        if (ctx_sampling->parsed_grammar.rules.empty()) {
+        apply_grammar = !grammar_str.empty() && sampling_set_grammar(ctx_sampling, grammar_str);
+        if (!apply_grammar) {
             fprintf(stderr, "%s: failed to parse grammar\n", __func__);
-        } else {
-            std::vector<const llama_grammar_element *> grammar_rules(ctx_sampling->parsed_grammar.c_rules());
+            // as with a native provider, the next grammar is built in full rather than advanced by the token
             if (ctx_sampling->grammar != NULL) {
                 llama_grammar_free(ctx_sampling->grammar);
+                ctx_sampling->grammar = NULL;
             }
-            ctx_sampling->grammar = llama_grammar_init(
-                    grammar_rules.data(),
-                    grammar_rules.size(), ctx_sampling->parsed_grammar.symbol_ids.at("root"));
+        }
+    }
+
+    // When the token is drawn from the n_keep candidates with the largest logits, only a window of the candidates
+    // is built: the n_window largest logits, the penalized tokens, and with a grammar all the prefixes of these,
+    // which the rejected candidates give their logit to. The other candidates keep a logit <= threshold, so the
+    // result is exact when n_keep candidates are still above threshold after the penalties and the grammar,
+    // otherwise the window is widened.
+    const size_t n_keep   = sampling_n_keep(params, logits_cfg != NULL, n_vocab);
+    size_t       n_window = n_keep;
+
+    for (;;) {
+        float threshold = -INFINITY;
+
+        {
+            llama_trace_scope span(trace, "logits", trace_seq, trace_token);
+
+            if (n_window == 0 || 4*n_window >= (size_t) n_vocab) {
+                n_window = 0;
+
+                cur.clear();
+
+                for (llama_token token_id = 0; token_id < n_vocab; token_id++) {
+                    cur.emplace_back(llama_token_data{token_id, logits[token_id], 0.0f});
+                }
+            } else {
+                threshold = sampling_select_top(logits, n_vocab, n_window, cur);
+
+                for (const llama_token token_id : prev.window_tokens) {
+                    cur.emplace_back(llama_token_data{token_id, logits[token_id], 0.0f});
+                }
+
+                if (apply_grammar) {
+                    auto & prefixes = ctx_sampling->prefixes;
+                    const size_t n_cur = cur.size();
+                    for (size_t i = 0; i < n_cur; ++i) {
+                        int32_t n = llama_token_prefixes(model, cur[i].id, prefixes.data(), prefixes.size());
+                        if (n < 0) {
+                            prefixes.resize(-n);
+                            n = llama_token_prefixes(model, cur[i].id, prefixes.data(), prefixes.size());
+                        }
+                        for (int32_t j = 0; j < n; ++j) {
+                            cur.emplace_back(llama_token_data{prefixes[j], logits[prefixes[j]], 0.0f});
+                        }
+                    }
+                }
+
+                // in the order of the ids like the full candidates, each once
+                std::sort(cur.begin(), cur.end(), [](const llama_token_data & a, const llama_token_data & b) { return a.id < b.id; });
+                cur.erase(std::unique(cur.begin(), cur.end(), [](const llama_token_data & a, const llama_token_data & b) { return a.id == b.id; }), cur.end());
+            }
+
+            cur_p = { cur.data(), cur.size(), false };
+        }
+
+        if (logits_cfg) {
+            llama_trace_scope span(trace, "cfg", trace_seq, trace_token);
+
+            llama_sample_classifier_free_guidance_logits(ctx_main, &cur_p, logits_cfg, params.cfg_scale);
+        }
+
+        // apply penalties
+        if (!prev.empty()) {
+            llama_trace_scope span(trace, "penalties", trace_seq, trace_token);
+
+            const float nl_logit = logits[llama_token_nl(model)];
+
+            llama_sample_repetition_penalties_counted(ctx_main, &cur_p,
+                    prev.window_tokens.data(), prev.window_counts.data(),
+                    prev.window_tokens.size(), penalty_repeat, penalty_freq, penalty_present);
+
+            if (!penalize_nl) {
+                for (size_t idx = 0; idx < cur_p.size; idx++) {
+                    if (cur_p.data[idx].id == llama_token_nl(model)) {
+                        cur_p.data[idx].logit = nl_logit;
+                        break;
+                    }
+                }
+            }
+        }
+
+        if (apply_grammar) {
+            llama_trace_scope span(trace, "mask", trace_seq, trace_token);
+
             llama_sample_grammar(ctx_main, &cur_p, ctx_sampling->grammar);
         }
-    } else if (ctx_sampling->grammar != NULL) {
-        // std::ofstream log_file;
-        // // Open the log file in append mode
-        // log_file.open("log_grammar.txt", std::ios::app);
-
-        // if (log_file.is_open()) {
-        //     // Write the log message to the file
-        //     time_t elapsed;
-        //     time_t current_sampling_time = std::chrono::system_clock::now().time_since_epoch().count();
-        //     if (prev_sampling_time > 0) {
-        //         elapsed = current_sampling_time - prev_sampling_time;
-        //     } else {
-        //         elapsed = 0;
-        //     }
-        //     prev_sampling_time = current_sampling_time;
-        //     log_file << llama_grammar_get_stack_size(ctx_sampling->grammar) << "," << elapsed << std::endl;
-
-        //     // Close the file
-        //     log_file.close();
-        // } else {
-        //     // Handle the error if the file couldn't be opened
-        //     std::cerr << "Unable to open the log_grammar.txt" << std::endl;
-        // }
-        llama_sample_grammar(ctx_main, &cur_p, ctx_sampling->grammar);
-    } else {
-        std::ofstream log_file;
-        // Open the log file in append mode
-        log_file.open("log.txt", std::ios::app);
 
-        if (log_file.is_open()) {
-            // Write the log message to the file
-            log_file << std::endl << "================" << std::endl << llama_sampling_prev_all_str(ctx_sampling, ctx_main, ctx_sampling->prelude_len, 0) << std::endl << std::endl;
+        if (n_window == 0) {
+            break;
+        }
 
-            // Close the file
-            log_file.close();
-        } else {
-            // Handle the error if the file couldn't be opened
-            std::cerr << "Unable to open the log file." << std::endl;
+        size_t n_above = 0;
+        for (size_t i = 0; i < cur_p.size; ++i) {
+            n_above += cur_p.data[i].logit > threshold;
+        }
+        if (n_above >= n_keep) {
+            break;
         }
+
+        n_window *= 8;
     }
 
+    llama_trace_scope span(trace, "samplers", trace_seq, trace_token);
+
     if (temp < 0.0) {
         // greedy sampling, with probs
         llama_sample_softmax(ctx_main, &cur_p);
         id = cur_p.data[0].id;
-    } else if (temp == 0.0) {
+        return true;
+    }
+    if (temp == 0.0) {
         // greedy sampling, no probs
         id = llama_sample_token_greedy(ctx_main, &cur_p);
+        return true;
+    }
+
+    if (mirostat == 1 || mirostat == 2) {
+        llama_sample_temp(ctx_main, &cur_p, temp);
     } else {
-        if (mirostat == 1) {
-            const int mirostat_m = 100;
-            llama_sample_temp(ctx_main, &cur_p, temp);
-            id = llama_sample_token_mirostat(ctx_main, &cur_p, mirostat_tau, mirostat_eta, mirostat_m, &ctx_sampling->mirostat_mu);
-        } else if (mirostat == 2) {
-            llama_sample_temp(ctx_main, &cur_p, temp);
-            id = llama_sample_token_mirostat_v2(ctx_main, &cur_p, mirostat_tau, mirostat_eta, &ctx_sampling->mirostat_mu);
-        } else {
-            // temperature sampling
-            size_t min_keep = std::max(1, params.n_probs);
+        // temperature sampling
+        size_t min_keep = std::max(1, params.n_probs);
+
+        sampler_queue(ctx_main, params, cur_p, min_keep);
+    }
 
-            sampler_queue(ctx_main, params, cur_p, min_keep);
+    return false;
+}
 
-            id = llama_sample_token(ctx_main, &cur_p);
+// draws the token from the candidates left by sampling_prepare
+static llama_token sampling_draw(
+                  struct llama_sampling_context * ctx_sampling,
+                  struct llama_context * ctx_main,
+                  llama_token_data_array & cur_p) {
+    const llama_sampling_params & params = ctx_sampling->params;
 
-            //{
-            //    const int n_top = 10;
-            //    LOG("top %d candidates:\n", n_top);
+    const int     mirostat     = params.mirostat;
+    const float   mirostat_tau = params.mirostat_tau;
+    const float   mirostat_eta = params.mirostat_eta;
 
-            //    for (int i = 0; i < n_top; i++) {
-            //        const llama_token id = cur_p.data[i].id;
-            //        (void)id; // To avoid a warning that id is unused when logging is disabled.
-            //        LOG(" - %5d: '%12s' (%.3f)\n", id, llama_token_to_piece(ctx_main, id).c_str(), cur_p.data[i].p);
-            //    }
-            //}
+    llama_trace_scope span(ctx_sampling->trace_token, "draw", ctx_sampling->trace_seq, ctx_sampling->prev_all.size());
 
-            LOG("sampled token: %5d: '%s'\n", id, llama_token_to_piece(ctx_main, id).c_str());
-        }
+    llama_token id = 0;
+
+    if (mirostat == 1) {
+        const int mirostat_m = 100;
+        id = llama_sample_token_mirostat(ctx_main, &cur_p, mirostat_tau, mirostat_eta, mirostat_m, &ctx_sampling->mirostat_mu);
+    } else if (mirostat == 2) {
+        id = llama_sample_token_mirostat_v2(ctx_main, &cur_p, mirostat_tau, mirostat_eta, &ctx_sampling->mirostat_mu);
+    } else {
+        id = llama_sample_token(ctx_main, &cur_p);
+
+        //{
+        //    const int n_top = 10;
+        //    LOG("top %d candidates:\n", n_top);
+
+        //    for (int i = 0; i < n_top; i++) {
+        //        const llama_token id = cur_p.data[i].id;
+        //        (void)id; // To avoid a warning that id is unused when logging is disabled.
+        //        LOG(" - %5d: '%12s' (%.3f)\n", id, llama_token_to_piece(ctx_main, id).c_str(), cur_p.data[i].p);
+        //    }
+        //}
+
+        LOG_DBG("sampled token: %5d: '%s'\n", id, llama_token_to_piece(ctx_main, id).c_str());
     }
 
     return id;
 }
 
+llama_token llama_sampling_sample(
+                  struct llama_sampling_context * ctx_sampling,
+                  struct llama_context * ctx_main,
+                  struct llama_context * ctx_cfg,
+                  const int idx,
+                  const int idx_cfg) {
+    llama_token_data_array cur_p;
+    llama_token id = 0;
+
+    float * logits_cfg = NULL;
+    if (ctx_cfg) {
+        logits_cfg = llama_get_logits(ctx_cfg);
+    } else if (idx_cfg >= 0) {
+        logits_cfg = llama_get_logits_ith(ctx_main, idx_cfg);
+    }
+
+    if (sampling_prepare(ctx_sampling, ctx_main, logits_cfg, idx, cur_p, id)) {
+        return id;
+    }
+
+    return sampling_draw(ctx_sampling, ctx_main, cur_p);
+}
+
+std::vector<llama_token> llama_sampling_sample_batch(
+        const std::vector<struct llama_sampling_context *> & ctx_samplings,
+        struct llama_context * ctx_main,
+        const std::vector<int> & idxs,
+        int n_threads) {
+    GGML_ASSERT(ctx_samplings.size() == idxs.size());
+
+    const int n_seqs = ctx_samplings.size();
+
+    std::vector<llama_token_data_array> cur_p(n_seqs);
+    std::vector<llama_token>            ids(n_seqs, 0);
+    std::vector<char>                   known(n_seqs, 0);
+
+    // sequence i is prepared by the thread i % n_threads
+    auto prepare = [&](int ith, int nth) {
+        for (int i = ith; i < n_seqs; i += nth) {
+            known[i] = sampling_prepare(ctx_samplings[i], ctx_main, NULL, idxs[i], cur_p[i], ids[i]);
+        }
+    };
+
+    n_threads = std::max(1, std::min(n_threads, n_seqs));
+    if (n_threads == 1) {
+        prepare(0, 1);
+    } else {
+        std::vector<std::thread> workers;
+        workers.reserve(n_threads - 1);
+        for (int ith = 1; ith < n_threads; ++ith) {
+            workers.emplace_back(prepare, ith, n_threads);
+        }
+        prepare(0, n_threads);
+        for (auto & worker : workers) {
+            worker.join();
+        }
+    }
+
+    // the draws share the RNG of ctx_main, they are done in order to give the same tokens as
+    // llama_sampling_sample called for each sequence
+    for (int i = 0; i < n_seqs; ++i) {
+        if (!known[i]) {
+            ids[i] = sampling_draw(ctx_samplings[i], ctx_main, cur_p[i]);
+        }
+    }
+
+    return ids;
+}
+
 void llama_sampling_accept(
         struct llama_sampling_context * ctx_sampling,
         struct llama_context * ctx_main,
         llama_token id,
         bool apply_grammar) {
-    ctx_sampling->prev.erase(ctx_sampling->prev.begin());
-    ctx_sampling->prev.push_back(id);
+    llama_trace_scope span(apply_grammar && ctx_sampling->trace_token, "accept", ctx_sampling->trace_seq, ctx_sampling->prev_all.size());
+    ctx_sampling->trace_token = false;
+
+    ctx_sampling->prev.push(id);
     ctx_sampling->prev_all.push_back(id);
 
-    if (ctx_sampling->grammar != NULL && apply_grammar) {
+    {
+        int32_t n_piece;
+        const char * piece = llama_token_get_piece_view(llama_get_model(ctx_main), id, &n_piece);
+
+        std::lock_guard<std::mutex> lock(ctx_sampling->prev_all_mutex);
+        ctx_sampling->prev_all_text.append(piece, n_piece);
+        ctx_sampling->prev_all_offsets.push_back(ctx_sampling->prev_all_text.size());
+    }
+
+    // the end of sequence returned for a stop condition may not be allowed by the grammar
+    const bool stopped = ctx_sampling->stop_reason != LLAMA_SAMPLING_STOP_NONE && id == llama_token_eos(llama_get_model(ctx_main));
+
+    if (ctx_sampling->grammar != NULL && apply_grammar && !stopped) {
         llama_grammar_accept_token(ctx_main, ctx_sampling->grammar, id);
     }
+
+    if (ctx_sampling->prev_all.size() > ctx_sampling->prelude_len) {
+        const size_t begin = ctx_sampling->prev_all_offsets[ctx_sampling->prev_all.size() - 1];
+        ctx_sampling->repetition.append(ctx_sampling->prev_all_text.data() + begin, ctx_sampling->prev_all_text.size() - begin);
+    }
+
+    if (apply_grammar) {
+        sampling_start_grammar_query(ctx_sampling);
+    }
+}
+
+std::vector<llama_token> llama_sampling_jump_forward(
+        struct llama_sampling_context * ctx_sampling,
+        struct llama_context * ctx_main,
+        int n_max) {
+    std::vector<llama_token> result;
+
+    if (!ctx_sampling->params.jump_forward || ctx_sampling->grammar == NULL || n_max <= 0) {
+        return result;
+    }
+
+    result.resize(n_max);
+    result.resize(llama_grammar_forced_tokens(ctx_main, ctx_sampling->grammar, result.data(), n_max));
+
+    // a dynamic grammar is recomputed on the next sample, the provider resyncs from the full program
+    for (const llama_token id : result) {
+        llama_sampling_accept(ctx_sampling, ctx_main, id, true);
+    }
+
+    return result;
 }
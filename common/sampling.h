@@ -3,7 +3,11 @@
 #include "llama.h"
 
 #include "grammar-parser.h"
+#include "grammar-provider.h"
+#include "trace.h"
 
+#include <future>
+#include <mutex>
 #include <string>
 #include <vector>
 #include <unordered_map>
@@ -26,10 +30,17 @@ typedef struct llama_sampling_params {
     float       mirostat_tau          = 5.00f;    // target entropy
     float       mirostat_eta          = 0.10f;    // learning rate
     bool        penalize_nl           = true;     // consider newlines as a repeatable token
+    int32_t     repetition_stop_period = 30;      // stop when the output ends with a substring of at most this many bytes
+    int32_t     repetition_stop_count  = 5;       // repeated this many times in a row (0 = disabled)
     std::string samplers_sequence     = "kfypmt"; // top_k, tail_free, typical_p, top_p, min_p, temp
 
     std::string grammar;  // optional BNF-like grammar to constrain sampling
-    std::string dynamic_grammar      = "";
+    int32_t     grammar_mask_cache      = 0;  // number of grammar token masks to cache (0 = disabled)
+    bool        jump_forward            = false; // decode the tokens forced by the grammar without sampling them
+    std::string dynamic_grammar         = "";
+    std::string dynamic_grammar_cmd     = "node ../lsp.js";            // LSP that computes the dynamic grammar
+    std::string dynamic_grammar_prelude = "../autoregressive.prelude"; // prelude the LSP type checks against
+    int32_t     grammar_prefetch        = 0;  // candidates of a token whose dynamic grammar is queried ahead (0 = disabled)
     std::string prelude;
 
     // Classifier-Free Guidance
@@ -40,6 +51,84 @@ typedef struct llama_sampling_params {
     std::unordered_map<llama_token, float> logit_bias; // logit bias for specific tokens
 } llama_sampling_params;
 
+// streaming detector of the repetitions at the end of a text, which is appended one piece at a time
+// for each period p, runs[p - 1] is the length of the longest suffix equal to the text shifted by p
+// bytes, so that the last p bytes are repeated 1 + runs[p - 1] / p times
+// appending a byte costs O(max_period) and does not allocate
+struct llama_repetition_detector {
+    int32_t               max_period = 0;
+    size_t                n_bytes    = 0;
+    size_t                n_blank    = 0; // length of the run of spaces and tabs at the end of the text
+    std::vector<char>     window;         // last max_period bytes, indexed by position % max_period
+    std::vector<uint32_t> runs;
+
+    void init(int32_t max_period);
+    void reset();
+    void append(const char * data, size_t size);
+
+    // number of times in a row the last period bytes of the text are repeated at its end
+    int32_t count(int32_t period) const;
+
+    // smallest period whose last bytes are repeated at least min_count times and are not only
+    // spaces and tabs, 0 if none
+    int32_t find_period(int32_t min_count) const;
+};
+
+// fixed-capacity history of the last tokens, oldest first, initially filled with token 0
+// every token is stored twice, at i and i + capacity, so that the last tokens are contiguous from data()
+// the occurrences of the last n_window tokens are counted as tokens are pushed and evicted, the penalties
+// read the distinct tokens of the window and their counts instead of counting them again
+// pushing a token costs O(1) and only allocates when a larger token id is seen
+struct llama_token_history {
+    size_t                   capacity = 0;
+    size_t                   n_window = 0;
+    size_t                   head     = 0;  // the tokens are buf[head, head + capacity)
+    std::vector<llama_token> buf;
+
+    std::vector<llama_token> window_tokens; // distinct tokens of the window
+    std::vector<int32_t>     window_counts; // occurrences of window_tokens[i] in the window
+    std::vector<int32_t>     window_pos;    // index of each token id in window_tokens, -1 if not in the window
+
+    void init(size_t capacity, size_t n_window);
+    void reset();
+    void push(llama_token id);
+
+    bool   empty() const { return capacity == 0; }
+    size_t size()  const { return capacity; }
+
+    const llama_token * data()  const { return buf.data() + head; }
+    const llama_token * begin() const { return data(); }
+    const llama_token * end()   const { return data() + capacity; }
+
+    llama_token operator[](size_t i) const { return buf[head + i]; }
+    llama_token back()               const { return buf[head + capacity - 1]; }
+
+private:
+    void count(llama_token id, int32_t delta);
+};
+
+// why llama_sampling_sample ended the generation instead of sampling a token
+enum llama_sampling_stop_reason {
+    LLAMA_SAMPLING_STOP_NONE = 0,
+    LLAMA_SAMPLING_STOP_FUNCTION_END, // the output ends a function definition with "in\n\n"
+    LLAMA_SAMPLING_STOP_REPETITION,   // the output is stuck in a loop, see llama_repetition_detector
+};
+
+// output of the grammar provider after the n_tokens-th generated token
+struct llama_grammar_provider_result {
+    size_t      n_tokens = 0;
+    bool        ok       = false;
+    std::string output;
+};
+
+// query of the grammar that follows a candidate of the token being sampled, on a session of its own
+struct llama_grammar_prefetch {
+    llama_token token;
+    size_t      n_tokens;   // number of generated tokens with the candidate
+    size_t      i_provider; // index in llama_sampling_context::prefetch_providers
+    std::future<llama_grammar_provider_result> query;
+};
+
 // general sampler context
 // TODO: move to llama.h
 struct llama_sampling_context {
@@ -54,11 +143,46 @@ struct llama_sampling_context {
     // internal
     grammar_parser::parse_state parsed_grammar;
 
-    // TODO: replace with ring-buffer
-    std::vector<llama_token>      prev;
-    std::vector<llama_token_data> cur;
+    // long-lived LSP session for params.dynamic_grammar
+    llama_grammar_provider * grammar_provider;
+
+    // query of the provider started by llama_sampling_accept, it runs while the next token is
+    // decoded and is awaited by llama_sampling_sample; the provider must not be used while it is valid
+    std::future<llama_grammar_provider_result> grammar_query;
+    bool                                       grammar_query_prefetched = false; // started by llama_sampling_sample
+
+    // with params.grammar_prefetch, sessions queried for the grammars that follow the likely candidates of
+    // the token being sampled, see llama_sampling_sample; the query of the accepted token becomes grammar_query
+    std::vector<llama_grammar_provider *> prefetch_providers;
+    std::vector<llama_grammar_prefetch>   grammar_prefetch;
+
+    // last grammar received from the provider, before and after fix_grammar
+    std::string dynamic_grammar_src;
+    std::string dynamic_grammar_fixed;
+
+    llama_token_history           prev;
+    std::vector<llama_token_data> cur;         // candidates of the last token, only a window of the largest logits if
+                                               // the samplers allow it, see llama_sampling_sample
+    std::vector<llama_token>      prefixes;    // buffer for llama_token_prefixes
     std::vector<llama_token>      prev_all;
     size_t                        prelude_len;
+
+    // text of prev_all, appended as the tokens are accepted; the piece of prev_all[i] starts at
+    // prev_all_offsets[i] and prev_all_offsets.back() is the size of the text
+    // the pending grammar query reads it under prev_all_mutex
+    std::string                   prev_all_text;
+    std::vector<size_t>           prev_all_offsets = { 0 };
+    std::mutex                    prev_all_mutex;
+
+    // repetitions at the end of the text of prev_all after the prelude
+    llama_repetition_detector     repetition;
+
+    // set by llama_sampling_sample when a stop condition is met, cleared by llama_sampling_reset
+    llama_sampling_stop_reason    stop_reason = LLAMA_SAMPLING_STOP_NONE;
+
+    // the phases of the token being sampled are recorded in the trace, see trace.h
+    bool                          trace_token = false;
+    int32_t                       trace_seq   = 0;
 };
 
 #include "common.h"
@@ -66,6 +190,10 @@ struct llama_sampling_context {
 // Create a new sampling context instance.
 struct llama_sampling_context * llama_sampling_init(const struct llama_sampling_params & params);
 
+// Free ctx (if not null) and create a new instance with params. The session of the grammar provider
+// is kept if the dynamic grammar parameters are unchanged, instead of starting the LSP again.
+struct llama_sampling_context * llama_sampling_reinit(struct llama_sampling_context * ctx, const struct llama_sampling_params & params);
+
 void llama_sampling_free(struct llama_sampling_context * ctx);
 
 // Reset the sampler context
@@ -76,19 +204,28 @@ void llama_sampling_reset(llama_sampling_context * ctx);
 // Copy the sampler context
 void llama_sampling_cp(llama_sampling_context * src, llama_sampling_context * dst);
 
+// Create n sampler contexts that continue from src, for n sequences forked from the one of src with
+// llama_kv_cache_seq_cp. Each one has its own grammar state and, with params.dynamic_grammar, its own
+// provider session. Returns an empty vector if one of them could not be created
+std::vector<struct llama_sampling_context *> llama_sampling_fork(struct llama_sampling_context * src, int n);
+
 // Get the last sampled token
 llama_token llama_sampling_last(llama_sampling_context * ctx);
 
 // Get a string representation of the last sampled tokens
 std::string llama_sampling_prev_str(llama_sampling_context * ctx_sampling, llama_context * ctx_main, int n);
 
-std::string llama_sampling_prev_all_str(llama_sampling_context * ctx_sampling, llama_context * ctx_main, int skip_tokens);
+// Get the text of the tokens accepted so far, without the first start_skip_tokens and the last end_skip_tokens
+std::string llama_sampling_prev_all_str(llama_sampling_context * ctx_sampling, llama_context * ctx_main, int start_skip_tokens, int end_skip_tokens);
 
 void llama_sampling_set_prelude_len(llama_sampling_context * ctx, size_t prelude_len);
 
 // Print sampling parameters into a string
 std::string llama_sampling_print(const llama_sampling_params & params);
 
+// Name of a stop reason, e.g. "repetition"
+const char * llama_sampling_stop_reason_str(llama_sampling_stop_reason reason);
+
 // Print sampling order into a string
 std::string llama_sampling_order_print(const llama_sampling_params & params);
 
@@ -104,19 +241,45 @@ std::string llama_sampling_order_print(const llama_sampling_params & params);
 // optional:
 //  - ctx_cfg:      context to use for classifier-free guidance
 //  - idx:          sample from llama_get_logits_ith(ctx, idx)
+//  - idx_cfg:      without ctx_cfg, classifier-free guidance from llama_get_logits_ith(ctx, idx_cfg), the row of
+//                  the negative prompt evaluated as another sequence of ctx_main; the row is overwritten
 //
 // returns:
-//  - token:      sampled token
-//  - candidates: vector of candidate tokens
+//  - token:      sampled token, or the end of sequence token if ctx_sampling->stop_reason was set
+//  - candidates: vector of candidate tokens, in ctx_sampling->cur
+//
+// when the token is drawn among the top_k largest logits, the candidates are built only for a window of the
+// largest logits instead of the whole vocabulary; the window is widened until it gives the same result
 //
 llama_token llama_sampling_sample(
         struct llama_sampling_context * ctx_sampling,
         struct llama_context * ctx_main,
         struct llama_context * ctx_cfg,
-        int idx = 0);
+        int idx = 0,
+        int idx_cfg = -1);
 
+// samples the next token of each sequence, ctx_samplings[i] from llama_get_logits_ith(ctx_main, idxs[i])
+// the penalties, grammar and samplers of the sequences run on n_threads threads, then the tokens are drawn
+// in order, so the result is the same as calling llama_sampling_sample for each sequence in turn
+// classifier-free guidance is not supported
+std::vector<llama_token> llama_sampling_sample_batch(
+        const std::vector<struct llama_sampling_context *> & ctx_samplings,
+        struct llama_context * ctx_main,
+        const std::vector<int> & idxs,
+        int n_threads);
+
+// with params.dynamic_grammar, the provider is queried in the background for the grammar that
+// follows id, the result is used by the next call to llama_sampling_sample
 void llama_sampling_accept(
         struct llama_sampling_context * ctx_sampling,
         struct llama_context * ctx_main,
         llama_token id,
         bool apply_grammar);
+
+// with params.jump_forward, returns the tokens forced by the grammar after the last accepted token,
+// at most n_max, and accepts them as if they had been sampled; the caller decodes them in one batch
+// returns an empty vector when the grammar leaves a choice
+std::vector<llama_token> llama_sampling_jump_forward(
+        struct llama_sampling_context * ctx_sampling,
+        struct llama_context * ctx_main,
+        int n_max);
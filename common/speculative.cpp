@@ -0,0 +1,513 @@
+#include "speculative.h"
+
+#include "common.h"
+
+#include <algorithm>
+#include <cstdio>
+
+struct llama_speculative_context * llama_speculative_init(
+        const struct llama_speculative_params & params,
+              struct llama_sampling_params    sparams,
+                                    int32_t   n_ctx,
+                                    int32_t   n_past) {
+    struct llama_speculative_context * spec = new llama_speculative_context();
+
+    spec->params     = params;
+    spec->n_past_tgt = n_past;
+    spec->n_past_dft = n_past;
+
+    sparams.grammar.clear(); // the branches copy the grammar of the target sampler
+    sparams.temp = -1.0f;    // greedy sampling, with the probabilities of the candidates
+
+    spec->branches.resize(params.n_seq);
+    for (auto & branch : spec->branches) {
+        branch.ctx_sampling = llama_sampling_init(sparams);
+    }
+
+    spec->batch_dft = llama_batch_init(n_ctx, 0, 1);
+    spec->batch_tgt = llama_batch_init(n_ctx, 0, params.n_seq);
+
+    // the first token is sampled from the last token of the prompt
+    spec->branches[0].i_batch_tgt.push_back(0);
+
+    return spec;
+}
+
+void llama_speculative_free(struct llama_speculative_context * spec) {
+    if (spec == nullptr) {
+        return;
+    }
+
+    for (auto & branch : spec->branches) {
+        llama_sampling_free(branch.ctx_sampling);
+    }
+
+    llama_batch_free(spec->batch_dft);
+    llama_batch_free(spec->batch_tgt);
+
+    delete spec;
+}
+
+static const uint32_t LLAMA_NGRAM_POOL_MAGIC   = 0x67676e70; // 'ggnp'
+static const uint32_t LLAMA_NGRAM_POOL_VERSION = 1;
+
+void llama_ngram_pool::init(int32_t n_vocab, int32_t N, int32_t G) {
+    this->n_vocab = n_vocab;
+    this->N       = N;
+    this->G       = G;
+
+    cnt   .reset(new std::atomic<int32_t>[n_vocab]);
+    head  .reset(new std::atomic<int32_t>[n_vocab]);
+    tokens.reset(new std::atomic<llama_token>[(size_t) n_vocab*G*(N - 1)]);
+
+    for (int32_t i = 0; i < n_vocab; ++i) {
+        cnt [i] = 0;
+        head[i] = 0;
+    }
+    n_total = 0;
+}
+
+void llama_ngram_pool::get(llama_token first, int32_t g, llama_token * out) const {
+    const int32_t h   = (head[first].load(std::memory_order_acquire) - 1 - g + 2*G) % G;
+    const size_t  idx = ((size_t) first*G + h)*(N - 1);
+
+    for (int32_t j = 0; j < N - 1; ++j) {
+        out[j] = tokens[idx + j].load(std::memory_order_relaxed);
+    }
+}
+
+bool llama_ngram_pool::insert(llama_token first, const llama_token * ngram) {
+    if (first < 0 || first >= n_vocab) {
+        return false;
+    }
+
+    // filter-out repeating n-grams
+    const int32_t n = count(first);
+    for (int32_t k = 0; k < n; ++k) {
+        const size_t idx = ((size_t) first*G + k)*(N - 1);
+
+        int32_t j = 0;
+        while (j < N - 1 && tokens[idx + j].load(std::memory_order_relaxed) == ngram[j]) {
+            j++;
+        }
+        if (j == N - 1) {
+            return false;
+        }
+    }
+
+    // take the slot of the insert, the concurrent inserts take the next ones
+    int32_t h = head[first].load(std::memory_order_relaxed);
+    while (!head[first].compare_exchange_weak(h, (h + 1) % G, std::memory_order_acq_rel)) {
+    }
+
+    const size_t idx = ((size_t) first*G + h)*(N - 1);
+    for (int32_t j = 0; j < N - 1; ++j) {
+        tokens[idx + j].store(ngram[j], std::memory_order_relaxed);
+    }
+
+    int32_t c = cnt[first].load(std::memory_order_relaxed);
+    while (c < G && !cnt[first].compare_exchange_weak(c, c + 1, std::memory_order_release)) {
+    }
+    n_total++;
+
+    return true;
+}
+
+bool llama_ngram_pool::save(const std::string & path) const {
+    FILE * fp = std::fopen(path.c_str(), "wb");
+    if (fp == NULL) {
+        fprintf(stderr, "%s: failed to open '%s' for writing\n", __func__, path.c_str());
+        return false;
+    }
+
+    const uint32_t header[5] = { LLAMA_NGRAM_POOL_MAGIC, LLAMA_NGRAM_POOL_VERSION, (uint32_t) n_vocab, (uint32_t) N, (uint32_t) G };
+    bool ok = std::fwrite(header, sizeof(header), 1, fp) == 1;
+
+    std::vector<llama_token> ngrams;
+    for (llama_token first = 0; ok && first < n_vocab; ++first) {
+        const int32_t n = count(first);
+        if (n == 0) {
+            continue;
+        }
+
+        ngrams.resize((size_t) n*(N - 1));
+        for (int32_t g = 0; g < n; ++g) {
+            get(first, n - 1 - g, ngrams.data() + (size_t) g*(N - 1));
+        }
+
+        const int32_t entry[2] = { first, n };
+        ok = std::fwrite(entry, sizeof(entry), 1, fp) == 1 &&
+             std::fwrite(ngrams.data(), sizeof(llama_token), ngrams.size(), fp) == ngrams.size();
+    }
+
+    if (std::fclose(fp) != 0 || !ok) {
+        fprintf(stderr, "%s: failed to write '%s'\n", __func__, path.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+bool llama_ngram_pool::load(const std::string & path) {
+    FILE * fp = std::fopen(path.c_str(), "rb");
+    if (fp == NULL) {
+        fprintf(stderr, "%s: failed to open '%s'\n", __func__, path.c_str());
+        return false;
+    }
+
+    uint32_t header[5];
+    if (std::fread(header, sizeof(header), 1, fp) != 1 || header[0] != LLAMA_NGRAM_POOL_MAGIC || header[1] != LLAMA_NGRAM_POOL_VERSION ||
+        header[2] == 0 || header[3] < 2 || header[4] == 0) {
+        fprintf(stderr, "%s: '%s' is not an n-gram pool\n", __func__, path.c_str());
+        std::fclose(fp);
+        return false;
+    }
+
+    if (n_vocab == 0) {
+        init(header[2], header[3], header[4]);
+    } else if ((int32_t) header[2] != n_vocab || (int32_t) header[3] != N) {
+        fprintf(stderr, "%s: the pool of '%s' has n_vocab = %u, N = %u instead of %d, %d\n", __func__, path.c_str(),
+                header[2], header[3], n_vocab, N);
+        std::fclose(fp);
+        return false;
+    }
+
+    bool ok = true;
+
+    std::vector<llama_token> ngrams;
+    int32_t entry[2];
+    while (std::fread(entry, sizeof(entry), 1, fp) == 1) {
+        const llama_token first = entry[0];
+        const int32_t     n     = entry[1];
+        if (first < 0 || first >= n_vocab || n <= 0 || n > (int32_t) header[4]) {
+            ok = false;
+            break;
+        }
+
+        ngrams.resize((size_t) n*(N - 1));
+        if (std::fread(ngrams.data(), sizeof(llama_token), ngrams.size(), fp) != ngrams.size()) {
+            ok = false;
+            break;
+        }
+
+        // from the oldest one, so that the most recent ones are kept by a smaller G
+        for (int32_t g = 0; g < n; ++g) {
+            insert(first, ngrams.data() + (size_t) g*(N - 1));
+        }
+    }
+
+    std::fclose(fp);
+
+    if (!ok) {
+        fprintf(stderr, "%s: '%s' is truncated or corrupted\n", __func__, path.c_str());
+    }
+
+    return ok;
+}
+
+static uint64_t llama_ngram_hash(const llama_token * tokens, int32_t n) {
+    uint64_t h = 0xcbf29ce484222325ULL ^ (uint64_t) n;
+    for (int32_t i = 0; i < n; ++i) {
+        h = (h ^ (uint32_t) tokens[i]) * 0x100000001b3ULL;
+    }
+    return h;
+}
+
+void llama_ngram_index::init(int32_t n_min, int32_t n_max) {
+    this->n_min = n_min;
+    this->n_max = n_max;
+    reset();
+}
+
+void llama_ngram_index::reset() {
+    tokens.clear();
+    n_indexed = 0;
+    ends.clear();
+}
+
+void llama_ngram_index::update(const llama_token * data, size_t n, llama_ngram_pool * pool) {
+    size_t n_same = 0;
+    while (n_same < tokens.size() && n_same < n && tokens[n_same] == data[n_same]) {
+        n_same++;
+    }
+    if (n_same < tokens.size()) {
+        reset();
+        n_same = 0;
+    }
+    tokens.insert(tokens.end(), data + n_same, data + n);
+
+    // an n-gram is indexed once a token follows it
+    for (; n_indexed + 1 < tokens.size(); ++n_indexed) {
+        const size_t end = n_indexed + 1;
+        for (int32_t k = n_min; k <= n_max && (size_t) k <= end; ++k) {
+            ends[llama_ngram_hash(tokens.data() + end - k, k)] = end;
+        }
+        if (pool != nullptr && (size_t) pool->N <= end) {
+            pool->insert(tokens[end - pool->N], tokens.data() + end - pool->N + 1);
+        }
+    }
+}
+
+void llama_ngram_index::draft(std::vector<llama_token> & out, int32_t n_draft) const {
+    out.clear();
+
+    const int32_t n = tokens.size();
+    for (int32_t k = n_max; k >= n_min; --k) {
+        if (k > n - 1) {
+            continue;
+        }
+
+        const auto it = ends.find(llama_ngram_hash(tokens.data() + n - k, k));
+        if (it == ends.end() || !std::equal(tokens.begin() + it->second - k, tokens.begin() + it->second, tokens.end() - k)) {
+            continue;
+        }
+
+        for (int32_t i = it->second; i < n && (int32_t) out.size() < n_draft; ++i) {
+            out.push_back(tokens[i]);
+        }
+        return;
+    }
+}
+
+void llama_speculative_keep_branch(struct llama_context * ctx, llama_seq_id seq_id, llama_pos p0) {
+    if (p0 >= 0) {
+        llama_kv_cache_seq_rm(ctx, seq_id, p0, -1);
+    }
+    llama_kv_cache_seq_keep(ctx, seq_id);
+    llama_kv_cache_seq_cp  (ctx, seq_id, 0, -1, -1);
+    llama_kv_cache_seq_keep(ctx, 0);
+}
+
+std::vector<llama_token> llama_speculative_sample(
+        struct llama_speculative_context * spec,
+        struct llama_sampling_context    * ctx_sampling,
+        struct llama_context             * ctx_tgt,
+        struct llama_context             * ctx_dft) {
+    auto & branches = spec->branches;
+
+    std::vector<llama_token> result;
+
+    int i_dft = 0;
+
+    spec->s_keep = 0;
+
+    while (true) {
+        LOG("sampling target: s_keep = %3d, i_dft = %3d, i_batch_tgt = %3d\n", spec->s_keep, i_dft, branches[spec->s_keep].i_batch_tgt[i_dft]);
+
+        const llama_token id = llama_sampling_sample(ctx_sampling, ctx_tgt, NULL, branches[spec->s_keep].i_batch_tgt[i_dft]);
+
+        llama_sampling_accept(ctx_sampling, ctx_tgt, id, true);
+
+        result.push_back(id);
+
+        // check if the target token matches any of the drafts
+        bool matches = false;
+
+        for (int s = 0; s < spec->params.n_seq; ++s) {
+            if (!branches[s].active) {
+                continue;
+            }
+
+            if (i_dft < (int) branches[s].tokens.size() && id == branches[s].tokens[i_dft]) {
+                LOG("the sampled target token matches the %dth drafted token of sequence %d (%d) - accepted\n", i_dft, s, id);
+
+                spec->s_keep = s;
+                matches = true;
+            } else {
+                branches[s].active = false;
+            }
+        }
+
+        if (matches) {
+            ++spec->n_accept;
+            ++spec->n_past_tgt;
+            ++spec->n_past_dft;
+            ++i_dft;
+            continue;
+        }
+
+        LOG("the sampled target token (%d) did not match, or we ran out of drafted tokens\n", id);
+        LOG("keeping sequence %d, n_past_tgt = %d, n_past_dft = %d\n", spec->s_keep, spec->n_past_tgt, spec->n_past_dft);
+
+        llama_speculative_keep_branch(ctx_dft, spec->s_keep, -1);
+        llama_speculative_keep_branch(ctx_tgt, spec->s_keep, spec->n_past_tgt);
+
+        for (auto & branch : branches) {
+            branch.active = false;
+            branch.tokens.clear();
+            branch.i_batch_tgt.clear();
+        }
+        // note: erased by llama_speculative_eval
+        branches[0].tokens.push_back(id);
+        branches[0].i_batch_tgt.push_back(0);
+
+        llama_batch_clear(spec->batch_dft);
+        llama_batch_add  (spec->batch_dft, id, spec->n_past_dft, { 0 }, true);
+
+        llama_kv_cache_seq_rm(ctx_dft, 0, spec->n_past_dft, -1);
+        llama_decode         (ctx_dft, spec->batch_dft);
+
+        ++spec->n_past_dft;
+
+        break;
+    }
+
+    return result;
+}
+
+void llama_speculative_draft(
+        struct llama_speculative_context * spec,
+        struct llama_sampling_context    * ctx_sampling,
+        struct llama_context             * ctx_dft) {
+    auto & branches  = spec->branches;
+    auto & batch_dft = spec->batch_dft;
+    auto & batch_tgt = spec->batch_tgt;
+
+    const int   n_seq_dft = spec->params.n_seq;
+    const int   n_draft   = spec->params.n_draft;
+    const float p_accept  = spec->params.p_accept;
+    const float p_split   = spec->params.p_split;
+
+    llama_sampling_cp(ctx_sampling, branches[0].ctx_sampling);
+
+    int n_seq_cur  = 1;
+    int n_past_cur = spec->n_past_dft;
+
+    for (auto & branch : branches) {
+        branch.active   = false;
+        branch.drafting = false;
+    }
+    branches[0].active      = true;
+    branches[0].drafting    = true;
+    branches[0].i_batch_dft = 0;
+
+    llama_batch_clear(batch_tgt);
+    llama_batch_add  (batch_tgt, branches[0].tokens[0], spec->n_past_tgt, { 0 }, true);
+
+    // sample n_draft tokens from the draft model using tree-based sampling
+    for (int i = 0; i < n_draft; ++i) {
+        batch_dft.n_tokens = 0;
+
+        for (auto & branch : branches) {
+            branch.skip = false;
+        }
+
+        for (int s = 0; s < n_seq_dft; ++s) {
+            if (!branches[s].drafting || branches[s].skip) {
+                continue;
+            }
+
+            llama_sampling_sample(branches[s].ctx_sampling, ctx_dft, NULL, branches[s].i_batch_dft);
+
+            const auto & cur_p = branches[s].ctx_sampling->cur;
+
+            if (cur_p[0].p < p_accept) {
+                LOG("stopping drafting for seq %3d, probability too low: %.3f < %.3f\n", s, cur_p[0].p, p_accept);
+                branches[s].drafting = false;
+                continue;
+            }
+
+            std::vector<int> sa(1, s);
+
+            // attempt to split the branch if the probability is high enough
+            for (int f = 1; f < std::min(8, (int) cur_p.size()); ++f) {
+                if (n_seq_cur < n_seq_dft && cur_p[f].p > p_split) {
+                    LOG("splitting seq %3d into %3d\n", s, n_seq_cur);
+
+                    llama_kv_cache_seq_rm(ctx_dft,    n_seq_cur, -1, -1);
+                    llama_kv_cache_seq_cp(ctx_dft, s, n_seq_cur, -1, -1);
+
+                    // all previous tokens from this branch are now also part of the new branch
+                    for (int t = 0; t < batch_tgt.n_tokens; ++t) {
+                        for (int p = 0; p < batch_tgt.n_seq_id[t]; ++p) {
+                            if (batch_tgt.seq_id[t][p] == s) {
+                                batch_tgt.seq_id[t][batch_tgt.n_seq_id[t]] = n_seq_cur;
+                                batch_tgt.n_seq_id[t]++;
+                                break;
+                            }
+                        }
+                    }
+
+                    // copy the draft state
+                    branches[n_seq_cur].active   = true;
+                    branches[n_seq_cur].drafting = true;
+                    branches[n_seq_cur].skip     = true;
+
+                    branches[n_seq_cur].tokens      = branches[s].tokens;
+                    branches[n_seq_cur].i_batch_dft = branches[s].i_batch_dft;
+                    branches[n_seq_cur].i_batch_tgt = branches[s].i_batch_tgt;
+
+                    llama_sampling_cp(branches[s].ctx_sampling, branches[n_seq_cur].ctx_sampling);
+
+                    sa.push_back(n_seq_cur);
+
+                    n_seq_cur++;
+                } else {
+                    break;
+                }
+            }
+
+            // add drafted token for each sequence
+            for (int is = 0; is < (int) sa.size(); ++is) {
+                const llama_token id = cur_p[is].id;
+
+                const int s = sa[is];
+
+                llama_sampling_accept(branches[s].ctx_sampling, ctx_dft, id, true);
+
+                branches[s].tokens.push_back(id);
+
+                // add unique drafted tokens to the target batch
+                branches[s].i_batch_tgt.push_back(batch_tgt.n_tokens);
+
+                llama_batch_add(batch_tgt, id, spec->n_past_tgt + i + 1, { s }, true);
+
+                // add the token to the batch for batched decoding with the draft model
+                branches[s].i_batch_dft = batch_dft.n_tokens;
+
+                llama_batch_add(batch_dft, id, n_past_cur, { s }, true);
+
+                if (batch_tgt.n_tokens > n_draft) {
+                    branches[s].drafting = false;
+                }
+            }
+        }
+
+        // no sequence is drafting anymore
+        if (batch_dft.n_tokens == 0) {
+            break;
+        }
+
+        // evaluate the drafted tokens on the draft model
+        llama_decode(ctx_dft, batch_dft);
+        ++n_past_cur;
+        ++spec->n_drafted;
+
+        if (batch_tgt.n_tokens > n_draft) {
+            break;
+        }
+    }
+}
+
+int llama_speculative_eval(
+        struct llama_speculative_context * spec,
+        struct llama_context             * ctx_tgt) {
+    llama_kv_cache_seq_keep(ctx_tgt, 0);
+    for (int s = 1; s < spec->params.n_seq; ++s) {
+        llama_kv_cache_seq_cp(ctx_tgt, 0, s, -1, -1);
+    }
+
+    const int ret = llama_decode(ctx_tgt, spec->batch_tgt);
+    ++spec->n_past_tgt;
+
+    // the first token is always proposed by the target model before the speculation loop so we erase it here
+    for (auto & branch : spec->branches) {
+        if (!branch.active) {
+            continue;
+        }
+
+        branch.tokens.erase(branch.tokens.begin());
+    }
+
+    return ret;
+}
@@ -0,0 +1,165 @@
+#pragma once
+
+#include "llama.h"
+
+#include "sampling.h"
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// speculative decoding with a tree of drafts
+//
+// the draft model proposes the next tokens greedily, and opens a new branch where it hesitates between its
+// best tokens. The target model evaluates all the branches in one batch: each branch is a sequence of both
+// KV caches, and the tokens shared by several branches are evaluated once with all their sequence ids.
+// The target model then samples along the tree while its tokens match the drafted ones, the matched branch is
+// moved to the sequence 0 and the other ones are dropped
+//
+// a step of the generation:
+//
+//   tokens = llama_speculative_sample(spec, ctx_sampling, ctx_tgt, ctx_dft);
+//   // ... use the tokens, stop the generation ...
+//   llama_speculative_draft(spec, ctx_sampling, ctx_dft);
+//   llama_speculative_eval (spec, ctx_tgt);
+//
+
+struct llama_speculative_params {
+    int32_t n_seq    = 1;    // max number of branches, the sequences [0, n_seq) of both KV caches
+    int32_t n_draft  = 16;   // max number of tokens drafted per step, in all the branches
+    float   p_accept = 0.5f; // min probability of the best token of the draft model to go on drafting
+    float   p_split  = 0.1f; // min probability of the next best tokens to open a branch each
+};
+
+// a branch of the tree, the tokens drafted after the last sampled one
+struct llama_draft_branch {
+    bool active   = false; // still a candidate for the tokens sampled by the target model
+    bool drafting = false; // the draft model proposes more tokens for it
+    bool skip     = false; // opened in this round of drafting, drafts from the next one
+
+    int32_t              i_batch_dft = 0; // index of its last token in the batch of the draft model
+    std::vector<int32_t> i_batch_tgt;     // index of each of its tokens in the batch of the target model
+
+    std::vector<llama_token> tokens;
+
+    struct llama_sampling_context * ctx_sampling = nullptr;
+};
+
+struct llama_speculative_context {
+    llama_speculative_params params;
+
+    std::vector<llama_draft_branch> branches;
+
+    llama_batch batch_dft;
+    llama_batch batch_tgt;
+
+    // positions of the next tokens in the KV caches
+    int32_t n_past_tgt = 0;
+    int32_t n_past_dft = 0;
+
+    // branch of the tokens accepted by the last llama_speculative_sample
+    llama_seq_id s_keep = 0;
+
+    int32_t n_drafted = 0; // evaluations of the draft model while drafting
+    int32_t n_accept  = 0; // drafted tokens accepted by the target model
+};
+
+// Create the context of a generation whose prompt is in the sequence 0 of both KV caches, the first n_past
+// tokens of it, with its last token evaluated alone by the target model, so that its logits are at index 0.
+// The drafts are sampled greedily with sparams, the branches copy the grammar of the target sampler.
+struct llama_speculative_context * llama_speculative_init(
+        const struct llama_speculative_params & params,
+              struct llama_sampling_params    sparams,
+                                    int32_t   n_ctx,
+                                    int32_t   n_past);
+
+void llama_speculative_free(struct llama_speculative_context * spec);
+
+// Sample tokens with the target model and ctx_sampling along the tree, while they match the drafted tokens of
+// a branch. Returns them followed by the first sampled token that does not match, which the draft model then
+// evaluates. Only the matched branch is left in the KV caches, in the sequence 0.
+std::vector<llama_token> llama_speculative_sample(
+        struct llama_speculative_context * spec,
+        struct llama_sampling_context    * ctx_sampling,
+        struct llama_context             * ctx_tgt,
+        struct llama_context             * ctx_dft);
+
+// Draft the tree after the last sampled token, with the draft model, and put its tokens in spec->batch_tgt.
+void llama_speculative_draft(
+        struct llama_speculative_context * spec,
+        struct llama_sampling_context    * ctx_sampling,
+        struct llama_context             * ctx_dft);
+
+// Evaluate the last sampled token and the tree with the target model. Returns the result of llama_decode.
+int llama_speculative_eval(
+        struct llama_speculative_context * spec,
+        struct llama_context             * ctx_tgt);
+
+// pool of the n-grams seen in the previous generations, for the drafts of lookahead decoding: for each token of the
+// vocab, a ring buffer of the last G distinct n-grams of N tokens that start with it, of which the N - 1 tokens after
+// the first one are stored. The pool can be saved to a file and merged into another pool, also of another G, so
+// that the next runs on the same kind of text start with the n-grams of the previous ones
+// the inserts and the reads are lock-free, so that several threads can share a pool: a read that races with an
+// insert in the same ring buffer may see a mix of two n-grams, which is harmless for the drafts that are verified
+struct llama_ngram_pool {
+    int32_t n_vocab = 0;
+    int32_t N       = 0; // size of the n-grams, with their first token
+    int32_t G       = 0; // max number of n-grams per first token
+
+    std::unique_ptr<std::atomic<int32_t>[]>     cnt;    // [n_vocab] number of n-grams, at most G
+    std::unique_ptr<std::atomic<int32_t>[]>     head;   // [n_vocab] slot of the next insert in the ring buffer
+    std::unique_ptr<std::atomic<llama_token>[]> tokens; // [n_vocab][G][N - 1]
+
+    std::atomic<int64_t> n_total{0}; // n-grams inserted
+
+    void init(int32_t n_vocab, int32_t N, int32_t G);
+
+    // number of n-grams that start with the token first
+    int32_t count(llama_token first) const {
+        return first >= 0 && first < n_vocab ? cnt[first].load(std::memory_order_acquire) : 0;
+    }
+
+    // copy the N - 1 tokens after first of its n-gram g in out, from the most recent one, g = 0, to the oldest one
+    void get(llama_token first, int32_t g, llama_token * out) const;
+
+    // insert the n-gram of first and the N - 1 tokens of ngram, unless the pool has it already. Returns whether it
+    // was inserted
+    bool insert(llama_token first, const llama_token * ngram);
+
+    // save the pool to path, the n-grams of each token from the oldest to the most recent
+    bool save(const std::string & path) const;
+
+    // merge the n-grams of the pool saved in path, the pool takes its sizes if it is not initialized yet. The saved
+    // pool must be of the same vocab and of the same N
+    bool load(const std::string & path);
+};
+
+// index of the n-grams of a token history, for the drafts of prompt lookup decoding: the tokens that followed the
+// last earlier occurrence of the n-gram at the end of the history are proposed as its continuation, which needs no
+// draft model. Suited to the outputs that copy from their prompt, e.g. code edits
+// the history usually grows by a few tokens between two updates, which index only the new n-grams
+struct llama_ngram_index {
+    int32_t n_min = 0; // sizes of the n-grams, the longest one that matches is used
+    int32_t n_max = 0;
+
+    std::vector<llama_token>              tokens;        // history indexed so far
+    size_t                                n_indexed = 0; // the n-grams that end at [1, n_indexed] are indexed
+    std::unordered_map<uint64_t, int32_t> ends;          // hash of an n-gram -> end of its last occurrence
+
+    void init(int32_t n_min, int32_t n_max);
+    void reset();
+
+    // index the history data[0, n), again from scratch if it does not extend the previous one. The n-grams of
+    // pool->N tokens of the history are inserted in the pool as well, if given
+    void update(const llama_token * data, size_t n, llama_ngram_pool * pool = nullptr);
+
+    // put in out at most n_draft tokens that may follow the history, none if its end was not seen before
+    void draft(std::vector<llama_token> & out, int32_t n_draft) const;
+};
+
+// Move the sequence seq_id of a tree to the sequence 0 and drop the other sequences, and the cells of seq_id
+// from p0 on, if p0 >= 0.
+void llama_speculative_keep_branch(struct llama_context * ctx, llama_seq_id seq_id, llama_pos p0);
@@ -0,0 +1,213 @@
+#include "trace.h"
+
+#include "ggml.h"
+
+#include <atomic>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <thread>
+#include <vector>
+
+struct llama_trace_record {
+    const char * name;
+    int32_t      seq;
+    int32_t      token;
+    int64_t      t_start_us;
+    int64_t      t_end_us;
+};
+
+// bounded multi-producer single-consumer queue, after Dmitry Vyukov's bounded MPMC queue
+// slot i is free for the push at position pos when its sequence is pos, and holds the record
+// pushed at pos when its sequence is pos + 1
+struct llama_trace_ring {
+    struct slot {
+        std::atomic<size_t> seq;
+        llama_trace_record  record;
+    };
+
+    std::vector<slot> slots;
+    size_t            mask;
+
+    std::atomic<size_t> head{0}; // next push
+    size_t              tail = 0; // next pop, consumer only
+
+    explicit llama_trace_ring(size_t capacity) : slots(capacity), mask(capacity - 1) {
+        for (size_t i = 0; i < capacity; ++i) {
+            slots[i].seq.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    bool push(const llama_trace_record & record) {
+        size_t pos = head.load(std::memory_order_relaxed);
+        for (;;) {
+            slot & s = slots[pos & mask];
+            const size_t   seq  = s.seq.load(std::memory_order_acquire);
+            const intptr_t diff = (intptr_t) seq - (intptr_t) pos;
+            if (diff == 0) {
+                if (head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    s.record = record;
+                    s.seq.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false; // full
+            } else {
+                pos = head.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    bool pop(llama_trace_record & record) {
+        slot & s = slots[tail & mask];
+        if (s.seq.load(std::memory_order_acquire) != tail + 1) {
+            return false;
+        }
+        record = s.record;
+        s.seq.store(tail + mask + 1, std::memory_order_release);
+        tail++;
+        return true;
+    }
+};
+
+struct llama_trace {
+    llama_trace_params params;
+
+    FILE * file = nullptr;
+
+    llama_trace_ring ring;
+
+    std::atomic<bool>     running{true};
+    std::atomic<uint64_t> n_dropped{0};
+    std::atomic<uint64_t> n_calls{0}; // of llama_trace_sample
+    std::atomic<int32_t>  n_seqs{0};
+
+    uint64_t n_written = 0;
+
+    std::thread writer;
+
+    llama_trace(const llama_trace_params & params, FILE * file, size_t capacity) : params(params), file(file), ring(capacity) {}
+};
+
+static llama_trace * g_trace = nullptr;
+
+static void trace_write(llama_trace * trace, const llama_trace_record & r) {
+    if (trace->params.format == LLAMA_TRACE_FORMAT_CHROME) {
+        fprintf(trace->file, "%s{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 0, \"tid\": %d, \"ts\": %" PRId64 ", \"dur\": %" PRId64 ", \"args\": {\"token\": %d}}",
+                trace->n_written == 0 ? "\n" : ",\n", r.name, r.seq, r.t_start_us, r.t_end_us - r.t_start_us, r.token);
+    } else {
+        fprintf(trace->file, "{\"name\": \"%s\", \"seq\": %d, \"token\": %d, \"ts\": %" PRId64 ", \"dur\": %" PRId64 "}\n",
+                r.name, r.seq, r.token, r.t_start_us, r.t_end_us - r.t_start_us);
+    }
+    trace->n_written++;
+}
+
+static void trace_drain(llama_trace * trace) {
+    llama_trace_record record;
+    while (trace->ring.pop(record)) {
+        trace_write(trace, record);
+    }
+}
+
+bool llama_trace_start(const llama_trace_params & params) {
+    llama_trace_stop();
+
+    if (params.path.empty()) {
+        return true;
+    }
+
+    FILE * file = fopen(params.path.c_str(), "w");
+    if (file == nullptr) {
+        fprintf(stderr, "%s: failed to create trace '%s'\n", __func__, params.path.c_str());
+        return false;
+    }
+
+    size_t capacity = 2;
+    while (capacity < params.capacity) {
+        capacity *= 2;
+    }
+
+    g_trace = new llama_trace(params, file, capacity);
+
+    if (params.format == LLAMA_TRACE_FORMAT_CHROME) {
+        fprintf(file, "[");
+    }
+
+    llama_trace * trace = g_trace;
+    trace->writer = std::thread([trace]() {
+        while (trace->running.load(std::memory_order_acquire)) {
+            trace_drain(trace);
+            fflush(trace->file);
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        }
+    });
+
+    return true;
+}
+
+void llama_trace_stop() {
+    if (g_trace == nullptr) {
+        return;
+    }
+
+    llama_trace * trace = g_trace;
+    g_trace = nullptr;
+
+    trace->running.store(false, std::memory_order_release);
+    trace->writer.join();
+
+    trace_drain(trace);
+
+    if (trace->params.format == LLAMA_TRACE_FORMAT_CHROME) {
+        fprintf(trace->file, "\n]\n");
+    }
+    fclose(trace->file);
+
+    if (trace->n_dropped > 0) {
+        fprintf(stderr, "%s: %" PRIu64 " spans were dropped, increase the capacity of the trace buffer\n", __func__, trace->n_dropped.load());
+    }
+
+    delete trace;
+}
+
+bool llama_trace_enabled() {
+    return g_trace != nullptr;
+}
+
+bool llama_trace_sample() {
+    llama_trace * trace = g_trace;
+    if (trace == nullptr || trace->params.rate <= 0.0f) {
+        return false;
+    }
+
+    // the n-th call is traced when n*rate crosses an integer, which spreads the traced tokens evenly
+    const uint64_t n    = trace->n_calls.fetch_add(1, std::memory_order_relaxed);
+    const double   rate = trace->params.rate;
+
+    return (uint64_t) ((n + 1)*rate) > (uint64_t) (n*rate);
+}
+
+int32_t llama_trace_new_seq() {
+    llama_trace * trace = g_trace;
+    return trace == nullptr ? 0 : trace->n_seqs.fetch_add(1, std::memory_order_relaxed);
+}
+
+void llama_trace_span(const char * name, int32_t seq, int32_t token, int64_t t_start_us, int64_t t_end_us) {
+    llama_trace * trace = g_trace;
+    if (trace == nullptr) {
+        return;
+    }
+
+    if (!trace->ring.push({ name, seq, token, t_start_us, t_end_us })) {
+        trace->n_dropped.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+llama_trace_scope::llama_trace_scope(bool active, const char * name, int32_t seq, int32_t token)
+    : name(name), seq(seq), token(token), t_start_us(active ? ggml_time_us() : -1) {}
+
+llama_trace_scope::~llama_trace_scope() {
+    if (t_start_us >= 0) {
+        llama_trace_span(name, seq, token, t_start_us, ggml_time_us());
+    }
+}
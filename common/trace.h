@@ -0,0 +1,56 @@
+// Sampling trace sink
+//
+// The phases of the sampling pipeline are recorded as spans of time. Recording a span pushes it into a
+// bounded lock-free ring buffer, so that the sampling threads never wait on the file; a background thread
+// drains the buffer and writes the spans as JSON lines or in the Chrome trace event format (chrome://tracing,
+// https://ui.perfetto.dev). The spans recorded while the buffer is full are dropped and counted.
+//
+//   jsonl:  {"name": "mask", "seq": 0, "token": 12, "ts": 1700000000, "dur": 250}
+//   chrome: [{"name": "mask", "ph": "X", "pid": 0, "tid": 0, "ts": 1700000000, "dur": 250, "args": {"token": 12}}, ...]
+//
+// seq identifies the sampling context and token is the number of tokens it accepted before the span.
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+enum llama_trace_format {
+    LLAMA_TRACE_FORMAT_JSONL,
+    LLAMA_TRACE_FORMAT_CHROME,
+};
+
+struct llama_trace_params {
+    std::string        path;                              // empty = tracing disabled
+    llama_trace_format format   = LLAMA_TRACE_FORMAT_JSONL;
+    float              rate     = 1.0f;                   // fraction of the tokens that are traced
+    size_t             capacity = 1 << 16;                // spans in the ring buffer, rounded up to a power of 2
+};
+
+// starts the background writer, returns false if the file cannot be created
+bool llama_trace_start(const llama_trace_params & params);
+
+// writes the pending spans and stops the background writer
+void llama_trace_stop();
+
+bool llama_trace_enabled();
+
+// decides whether the next token is traced, params.rate of the calls return true
+bool llama_trace_sample();
+
+// identifier of a new traced sequence
+int32_t llama_trace_new_seq();
+
+// name must be a string literal, or outlive the trace
+void llama_trace_span(const char * name, int32_t seq, int32_t token, int64_t t_start_us, int64_t t_end_us);
+
+// records the span of its lifetime if active
+struct llama_trace_scope {
+    const char * name;
+    int32_t      seq;
+    int32_t      token;
+    int64_t      t_start_us; // < 0 if not active
+
+    llama_trace_scope(bool active, const char * name, int32_t seq, int32_t token);
+    ~llama_trace_scope();
+};
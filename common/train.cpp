@@ -5,6 +5,20 @@
 #include <sstream>
 #include <functional>
 
+#include <sys/stat.h>
+
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#include <io.h>
+#else
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
 struct random_normal_distribution {
     std::mt19937 gen;
     std::normal_distribution<float> rd;
@@ -1024,6 +1038,275 @@ size_t tokenize_file(
     return out_tokens.size();
 }
 
+// token cache: the output of tokenize_file, written once and memory-mapped by the next runs
+//
+//   header                                            (padded to 64 bytes)
+//   llama_token tokens       [n_tokens]               (padded to 8 bytes)
+//   uint64_t    samples_begin[n_samples]
+//   uint64_t    samples_size [n_samples]
+//
+// the header records what the tokens depend on, a cache that does not match is tokenized and written again
+#define TRAIN_TOKEN_CACHE_MAGIC   0x67677463 // 'ggtc'
+#define TRAIN_TOKEN_CACHE_VERSION 1
+
+struct train_token_cache_header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t n_vocab;
+    uint64_t vocab_hash;        // hash of the texts of the tokens
+    uint64_t context_length;
+    uint64_t sample_start_hash;
+    uint64_t flags;             // 1: include_sample_start, 2: overlapping_samples
+    uint64_t data_size;         // size and modification time of the training data file
+    uint64_t data_mtime;
+    uint64_t n_tokens;
+    uint64_t n_samples;
+};
+
+static size_t train_token_cache_offs_tokens() {
+    return GGML_PAD(sizeof(struct train_token_cache_header), 64);
+}
+
+static size_t train_token_cache_offs_samples(uint64_t n_tokens) {
+    return GGML_PAD(train_token_cache_offs_tokens() + n_tokens*sizeof(llama_token), 8);
+}
+
+static struct train_token_cache_header train_token_cache_expected_header(
+        struct llama_context * lctx,
+        const char           * fn_train_data,
+        const std::string    & sample_start,
+        bool                   include_sample_start,
+        bool                   overlapping_samples,
+        unsigned               context_length) {
+    const struct llama_model * model = llama_get_model(lctx);
+
+    size_t vocab_hash = 0;
+    const int n_vocab = llama_n_vocab(model);
+    for (llama_token token = 0; token < n_vocab; ++token) {
+        vocab_hash = hash_combine(vocab_hash, std::hash<std::string>{}(llama_token_get_text(model, token)));
+    }
+
+    struct train_token_cache_header header = {};
+    header.magic             = TRAIN_TOKEN_CACHE_MAGIC;
+    header.version           = TRAIN_TOKEN_CACHE_VERSION;
+    header.n_vocab           = n_vocab;
+    header.vocab_hash        = vocab_hash;
+    header.context_length    = context_length;
+    header.sample_start_hash = std::hash<std::string>{}(sample_start);
+    header.flags             = (include_sample_start ? 1 : 0) | (overlapping_samples ? 2 : 0);
+
+    struct stat st;
+    if (stat(fn_train_data, &st) == 0) {
+        header.data_size  = (uint64_t) st.st_size;
+        header.data_mtime = (uint64_t) st.st_mtime;
+    }
+
+    return header;
+}
+
+struct train_tokens_mapping {
+    void * addr = NULL;
+    size_t size = 0;
+
+#if defined(_WIN32)
+    train_tokens_mapping(FILE * fp, size_t size) {
+        HANDLE hFile = (HANDLE) _get_osfhandle(_fileno(fp));
+        HANDLE hMapping = CreateFileMappingA(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (hMapping == NULL) {
+            return;
+        }
+        addr = MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0);
+        CloseHandle(hMapping);
+        if (addr != NULL) {
+            this->size = size;
+        }
+    }
+
+    ~train_tokens_mapping() {
+        if (addr != NULL) {
+            UnmapViewOfFile(addr);
+        }
+    }
+#else
+    train_tokens_mapping(FILE * fp, size_t size) {
+        void * p = mmap(NULL, size, PROT_READ, MAP_SHARED, fileno(fp), 0);
+        if (p == MAP_FAILED) {
+            return;
+        }
+#ifdef POSIX_MADV_RANDOM
+        // the samples are read in a random order
+        posix_madvise(p, size, POSIX_MADV_RANDOM);
+#endif
+        addr = p;
+        this->size = size;
+    }
+
+    ~train_tokens_mapping() {
+        if (addr != NULL) {
+            munmap(addr, size);
+        }
+    }
+#endif
+};
+
+train_tokens::~train_tokens() {
+    delete mapping;
+}
+
+// maps the token cache if it matches the expected header
+static bool load_train_token_cache(const char * fn_token_cache, const struct train_token_cache_header & expected, struct train_tokens * out) {
+    struct llama_file f(fn_token_cache, "rb");
+    if (f.size < sizeof(struct train_token_cache_header)) {
+        return false;
+    }
+
+    struct train_token_cache_header header;
+    f.read_raw(&header, sizeof(header));
+
+    if (header.magic != expected.magic || header.version != expected.version) {
+        printf("%s: '%s' is not a token cache of this version, ignoring it\n", __func__, fn_token_cache);
+        return false;
+    }
+    if (header.n_vocab != expected.n_vocab || header.vocab_hash != expected.vocab_hash) {
+        printf("%s: token cache '%s' was written with another vocabulary, ignoring it\n", __func__, fn_token_cache);
+        return false;
+    }
+    if (header.context_length != expected.context_length || header.sample_start_hash != expected.sample_start_hash || header.flags != expected.flags) {
+        printf("%s: token cache '%s' was written with other sample options, ignoring it\n", __func__, fn_token_cache);
+        return false;
+    }
+    // without the training data, the cache is used as it is
+    if ((expected.data_size != 0 || expected.data_mtime != 0) &&
+        (header.data_size != expected.data_size || header.data_mtime != expected.data_mtime)) {
+        printf("%s: training data changed since the token cache '%s' was written, ignoring it\n", __func__, fn_token_cache);
+        return false;
+    }
+
+    const size_t offs_samples = train_token_cache_offs_samples(header.n_tokens);
+    if (f.size != offs_samples + 2*header.n_samples*sizeof(uint64_t)) {
+        printf("%s: token cache '%s' is truncated, ignoring it\n", __func__, fn_token_cache);
+        return false;
+    }
+
+    struct train_tokens_mapping * mapping = new train_tokens_mapping(f.fp, f.size);
+    if (mapping->addr == NULL) {
+        printf("%s: failed to map the token cache '%s'\n", __func__, fn_token_cache);
+        delete mapping;
+        return false;
+    }
+
+    const uint8_t * base = (const uint8_t *) mapping->addr;
+
+    delete out->mapping;
+    out->buf_tokens.clear();
+    out->buf_samples_begin.clear();
+    out->buf_samples_size.clear();
+
+    out->mapping       = mapping;
+    out->tokens        = (const llama_token *) (base + train_token_cache_offs_tokens());
+    out->n_tokens      = header.n_tokens;
+    out->samples_begin = (const size_t *) (base + offs_samples);
+    out->samples_size  = (const size_t *) (base + offs_samples) + header.n_samples;
+    out->n_samples     = header.n_samples;
+
+    return true;
+}
+
+// writes the token cache to a temporary file renamed at the end, so that an interrupted write does not leave a cache
+static bool save_train_token_cache(const char * fn_token_cache, struct train_token_cache_header header, const struct train_tokens * data) {
+    const std::string fn_tmp = std::string(fn_token_cache) + ".tmp";
+
+    FILE * fp = std::fopen(fn_tmp.c_str(), "wb");
+    if (fp == NULL) {
+        return false;
+    }
+
+    header.n_tokens  = data->n_tokens;
+    header.n_samples = data->n_samples;
+
+    const size_t offs_tokens  = train_token_cache_offs_tokens();
+    const size_t offs_samples = train_token_cache_offs_samples(header.n_tokens);
+    const char   zeros[64]    = {0};
+
+    bool ok = true;
+    ok = ok && std::fwrite(&header, sizeof(header), 1, fp) == 1;
+    ok = ok && std::fwrite(zeros, 1, offs_tokens - sizeof(header), fp) == offs_tokens - sizeof(header);
+    ok = ok && std::fwrite(data->tokens, sizeof(llama_token), data->n_tokens, fp) == data->n_tokens;
+    ok = ok && std::fwrite(zeros, 1, offs_samples - offs_tokens - data->n_tokens*sizeof(llama_token), fp) == offs_samples - offs_tokens - data->n_tokens*sizeof(llama_token);
+    for (size_t i = 0; ok && i < data->n_samples; ++i) {
+        const uint64_t v = data->samples_begin[i];
+        ok = std::fwrite(&v, sizeof(v), 1, fp) == 1;
+    }
+    for (size_t i = 0; ok && i < data->n_samples; ++i) {
+        const uint64_t v = data->samples_size[i];
+        ok = std::fwrite(&v, sizeof(v), 1, fp) == 1;
+    }
+    ok = (std::fclose(fp) == 0) && ok;
+
+    if (ok) {
+        // rename does not replace an existing file on Windows
+        std::remove(fn_token_cache);
+        ok = std::rename(fn_tmp.c_str(), fn_token_cache) == 0;
+    }
+    if (!ok) {
+        std::remove(fn_tmp.c_str());
+    }
+    return ok;
+}
+
+size_t load_train_tokens(
+        struct llama_context * lctx,
+        const char           * fn_train_data,
+        const char           * fn_token_cache,
+        const std::string    & sample_start,
+        bool                   include_sample_start,
+        bool                   overlapping_samples,
+        unsigned               context_length,
+        struct train_tokens  * out) {
+    // the samples of the cache are mapped as size_t
+    const bool use_cache = fn_token_cache != NULL && fn_token_cache[0] != '\0' && sizeof(size_t) == sizeof(uint64_t);
+
+    struct train_token_cache_header header = {};
+    if (use_cache) {
+        header = train_token_cache_expected_header(lctx, fn_train_data, sample_start, include_sample_start, overlapping_samples, context_length);
+        if (load_train_token_cache(fn_token_cache, header, out)) {
+            printf("%s: mapped %zu tokens and %zu samples from the token cache '%s'\n",
+                __func__, out->n_tokens, out->n_samples, fn_token_cache);
+            return out->n_tokens;
+        }
+    }
+
+    delete out->mapping;
+    out->mapping = nullptr;
+
+    tokenize_file(lctx,
+            fn_train_data,
+            sample_start,
+            include_sample_start,
+            overlapping_samples,
+            context_length,
+            out->buf_tokens,
+            out->buf_samples_begin,
+            out->buf_samples_size);
+    GGML_ASSERT(out->buf_samples_begin.size() == out->buf_samples_size.size());
+
+    out->tokens        = out->buf_tokens.data();
+    out->n_tokens      = out->buf_tokens.size();
+    out->samples_begin = out->buf_samples_begin.data();
+    out->samples_size  = out->buf_samples_size.data();
+    out->n_samples     = out->buf_samples_begin.size();
+
+    if (use_cache && out->n_tokens > 0) {
+        if (save_train_token_cache(fn_token_cache, header, out)) {
+            printf("%s: wrote the token cache '%s'\n", __func__, fn_token_cache);
+        } else {
+            printf("%s: warning: failed to write the token cache '%s'\n", __func__, fn_token_cache);
+        }
+    }
+
+    return out->n_tokens;
+}
+
 std::string get_train_filename(const char * filename, const char * pattern_it, const char * latest, int64_t iteration) {
     std::string sit = (iteration >= 0) ? std::to_string(iteration) : std::string(latest);
     return replace_str(filename, pattern_it, sit.c_str());
@@ -1032,6 +1315,7 @@ std::string get_train_filename(const char * filename, const char * pattern_it, c
 struct train_params_common get_default_train_params_common() {
     struct train_params_common params;
     params.fn_train_data     = "shakespeare.txt";
+    params.fn_token_cache    = "";
     params.fn_checkpoint_in  = "checkpoint.gguf";
     params.fn_checkpoint_out = "checkpoint-ITERATION.gguf";
     params.pattern_fn_it     = "ITERATION";
@@ -1094,6 +1378,7 @@ void print_common_train_usage(int /*argc*/, char ** /*argv*/, const struct train
     // fprintf(stderr, "options:\n");
     // fprintf(stderr, "  -h, --help                 show this help message and exit\n");
     fprintf(stderr, "  --train-data FNAME         path from which to load training data (default '%s')\n", params->fn_train_data);
+    fprintf(stderr, "  --token-cache FNAME        path of the tokenized training data, memory-mapped when it matches the training data and the sample options, written otherwise (default '%s')\n", params->fn_token_cache);
     fprintf(stderr, "  --checkpoint-in FNAME      path from which to load training checkpoint (default '%s')\n", params->fn_checkpoint_in);
     fprintf(stderr, "  --checkpoint-out FNAME     path to save training checkpoint (default '%s')\n", params->fn_checkpoint_out);
     fprintf(stderr, "  --pattern-fn-it STR        pattern in output filenames to be replaced by iteration number (default '%s')\n", params->pattern_fn_it);
@@ -1157,6 +1442,12 @@ bool consume_common_train_arg(
             return true;
         }
         params->fn_train_data = argv[i];
+    } else if (arg == "--token-cache") {
+        if (++i >= argc) {
+            *invalid_param = true;
+            return true;
+        }
+        params->fn_token_cache = argv[i];
     } else if (arg == "--checkpoint-in") {
         if (++i >= argc) {
             *invalid_param = true;
@@ -30,6 +30,7 @@ struct train_state {
 
 struct train_params_common {
     const char * fn_train_data;
+    const char * fn_token_cache;
     const char * fn_checkpoint_in;
     const char * fn_checkpoint_out;
     const char * pattern_fn_it;
@@ -94,10 +95,10 @@ struct train_opt_callback_data {
     void                       * save_data;
     struct llama_context       * lctx;
     int                          last_save_iter;
-    llama_token                * tokens_data;
+    const llama_token          * tokens_data;
     size_t                       tokens_size;
-    size_t                     * samples_begin;
-    size_t                     * samples_size;
+    const size_t               * samples_begin;
+    const size_t               * samples_size;
     size_t                     * shuffled_samples_offs;
     size_t                     * shuffled_samples_begin;
     size_t                     * shuffled_samples_size;
@@ -156,6 +157,43 @@ size_t tokenize_file(
         std::vector<size_t>      & out_samples_begin,
         std::vector<size_t>      & out_samples_size);
 
+// the tokens of the training data and the begin and size of its samples in the tokens,
+// tokenized by tokenize_file or memory-mapped from a token cache
+struct train_tokens_mapping;
+
+struct train_tokens {
+    const llama_token * tokens        = nullptr;
+    size_t              n_tokens      = 0;
+    const size_t      * samples_begin = nullptr;
+    const size_t      * samples_size  = nullptr;
+    size_t              n_samples     = 0;
+
+    // the tokenized data, empty when it is mapped
+    std::vector<llama_token> buf_tokens;
+    std::vector<size_t>      buf_samples_begin;
+    std::vector<size_t>      buf_samples_size;
+
+    struct train_tokens_mapping * mapping = nullptr;
+
+    train_tokens() = default;
+    train_tokens(const train_tokens &) = delete;
+    ~train_tokens();
+};
+
+// maps the tokens of the training data from the token cache fn_token_cache, if it was written from the same data with
+// the same vocabulary and sample options, otherwise tokenizes the data and writes the cache for the next runs
+// without token cache (NULL or empty), only tokenizes the data
+// returns the number of tokens
+size_t load_train_tokens(
+        struct llama_context * lctx,
+        const char           * fn_train_data,
+        const char           * fn_token_cache,
+        const std::string    & sample_start,
+        bool                   include_sample_start,
+        bool                   overlapping_samples,
+        unsigned               context_length,
+        struct train_tokens  * out);
+
 int64_t get_example_targets_batch(
         struct llama_context * lctx,
         struct ggml_tensor   * tokens_input,
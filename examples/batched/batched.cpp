@@ -1,5 +1,6 @@
 #include "common.h"
 #include "llama.h"
+#include "sampling.h"
 
 #include <algorithm>
 #include <cmath>
@@ -7,11 +8,204 @@
 #include <string>
 #include <vector>
 
+// n candidates of the same prompt, e.g. for pass@k: the prompt is evaluated once in the sequence 0 and forked
+// into the sequences [1, n_parallel), each candidate has its own sampling context, and grammar or dynamic grammar
+// state, and all the candidates are decoded in one batch. A candidate that ends leaves the batch and its cells
+// of the KV cache are given back
+static int sample_candidates(gpt_params & params) {
+    const int n_parallel = params.n_parallel;
+    const int n_predict  = params.n_predict < 0 ? 128 : params.n_predict;
+
+    llama_sampling_params & sparams = params.sparams;
+
+    llama_backend_init(params.numa);
+
+    llama_model * model = NULL;
+    llama_context * ctx = NULL;
+
+    std::tie(model, ctx) = llama_init_from_gpt_params(params);
+
+    if (model == NULL) {
+        fprintf(stderr, "%s: error: unable to load model\n", __func__);
+        return 1;
+    }
+
+    const bool add_bos = llama_should_add_bos_token(model);
+
+    // the prompt starts with the prelude, the dynamic grammar checks the text after it
+    const std::vector<llama_token> tokens_list  = ::llama_tokenize(ctx, params.prompt, add_bos, true);
+    const size_t                   prelude_len  = ::llama_tokenize(ctx, sparams.prelude, add_bos, true).size();
+
+    const int n_ctx    = llama_n_ctx(ctx);
+    const int n_kv_req = tokens_list.size() + n_predict*n_parallel;
+
+    LOG_TEE("\n%s: n_predict = %d, n_ctx = %d, n_parallel = %d, n_kv_req = %d\n", __func__, n_predict, n_ctx, n_parallel, n_kv_req);
+
+    if (tokens_list.empty() || n_kv_req > n_ctx) {
+        LOG_TEE("%s: error: n_kv_req (%d) > n_ctx, the required KV cache size is not big enough\n", __func__, n_kv_req);
+        LOG_TEE("%s:        either reduce n_parallel or n_predict, or increase n_ctx\n", __func__);
+        return 1;
+    }
+
+    llama_batch batch = llama_batch_init(std::max(params.n_batch, n_parallel), 0, 1);
+
+    // evaluate the prompt once, in the sequence 0
+    const auto t_prompt_start = ggml_time_us();
+
+    for (size_t i = 0; i < tokens_list.size(); i += params.n_batch) {
+        llama_batch_clear(batch);
+        for (size_t j = i; j < std::min(tokens_list.size(), i + params.n_batch); ++j) {
+            llama_batch_add(batch, tokens_list[j], j, { 0 }, j == tokens_list.size() - 1);
+        }
+
+        if (llama_decode(ctx, batch) != 0) {
+            LOG_TEE("%s: llama_decode() failed\n", __func__);
+            return 1;
+        }
+    }
+
+    const auto t_prompt_end = ggml_time_us();
+
+    struct llama_sampling_context * ctx_sampling = llama_sampling_init(sparams);
+    if (ctx_sampling == NULL) {
+        return 1;
+    }
+    llama_sampling_set_prelude_len(ctx_sampling, prelude_len);
+    for (const llama_token id : tokens_list) {
+        llama_sampling_accept(ctx_sampling, ctx, id, false);
+    }
+
+    // the sequences of the candidates share the cells of the prompt
+    std::vector<struct llama_sampling_context *> ctx_samplings = llama_sampling_fork(ctx_sampling, n_parallel);
+    llama_sampling_free(ctx_sampling);
+    if (ctx_samplings.empty()) {
+        return 1;
+    }
+    for (int32_t i = 1; i < n_parallel; ++i) {
+        llama_kv_cache_seq_cp(ctx, 0, i, -1, -1);
+    }
+
+    LOG_TEE("\n%s: generating %d candidates ...\n", __func__, n_parallel);
+
+    std::vector<std::string> streams(n_parallel);
+
+    // index of the logits of each candidate in the last batch, -1 once the candidate has ended
+    std::vector<int32_t> i_batch(n_parallel, batch.n_tokens - 1);
+
+    // the candidates still generating, and their logits
+    std::vector<struct llama_sampling_context *> batch_ctx_samplings;
+    std::vector<int>                             batch_idxs;
+    std::vector<int32_t>                         batch_seqs;
+
+    int n_cur    = tokens_list.size();
+    int n_decode = 0;
+
+    const auto t_main_start = ggml_time_us();
+
+    while (true) {
+        batch_ctx_samplings.clear();
+        batch_idxs.clear();
+        batch_seqs.clear();
+        for (int32_t i = 0; i < n_parallel; ++i) {
+            if (i_batch[i] >= 0) {
+                batch_ctx_samplings.push_back(ctx_samplings[i]);
+                batch_idxs.push_back(i_batch[i]);
+                batch_seqs.push_back(i);
+            }
+        }
+
+        // all the candidates have ended
+        if (batch_seqs.empty()) {
+            break;
+        }
+
+        const std::vector<llama_token> ids = llama_sampling_sample_batch(batch_ctx_samplings, ctx, batch_idxs, params.n_threads);
+
+        llama_batch_clear(batch);
+
+        for (size_t k = 0; k < batch_seqs.size(); ++k) {
+            const int32_t     i  = batch_seqs[k];
+            const llama_token id = ids[k];
+
+            if (id == llama_token_eos(model) || n_cur - (int) tokens_list.size() == n_predict) {
+                const llama_sampling_stop_reason reason = ctx_samplings[i]->stop_reason;
+                LOG_TEE("%s: candidate %d ended after %d tokens%s%s\n", __func__, i, n_cur - (int) tokens_list.size(),
+                        reason != LLAMA_SAMPLING_STOP_NONE ? ", " : "",
+                        reason != LLAMA_SAMPLING_STOP_NONE ? llama_sampling_stop_reason_str(reason) : "");
+
+                i_batch[i] = -1;
+                llama_kv_cache_seq_rm(ctx, i, -1, -1);
+                continue;
+            }
+
+            llama_sampling_accept(ctx_samplings[i], ctx, id, true);
+
+            streams[i] += llama_token_to_piece(ctx, id);
+
+            i_batch[i] = batch.n_tokens;
+
+            llama_batch_add(batch, id, n_cur, { i }, true);
+
+            n_decode += 1;
+        }
+
+        if (batch.n_tokens == 0) {
+            break;
+        }
+
+        n_cur += 1;
+
+        if (llama_decode(ctx, batch)) {
+            fprintf(stderr, "%s : failed to eval, return code %d\n", __func__, 1);
+            return 1;
+        }
+    }
+
+    const auto t_main_end = ggml_time_us();
+
+    LOG_TEE("\n");
+
+    for (int32_t i = 0; i < n_parallel; ++i) {
+        LOG_TEE("candidate %d:\n\n%s\n\n", i, streams[i].c_str());
+    }
+
+    LOG_TEE("%s: evaluated the prompt (%zu tokens) once in %.2f s\n",
+            __func__, tokens_list.size(), (t_prompt_end - t_prompt_start) / 1000000.0f);
+    LOG_TEE("%s: decoded %d tokens in %.2f s, speed: %.2f t/s\n",
+            __func__, n_decode, (t_main_end - t_main_start) / 1000000.0f, n_decode / ((t_main_end - t_main_start) / 1000000.0f));
+
+    llama_print_timings(ctx);
+
+    fprintf(stderr, "\n");
+
+    for (auto * ctx_sampling_i : ctx_samplings) {
+        llama_sampling_free(ctx_sampling_i);
+    }
+
+    llama_batch_free(batch);
+
+    llama_free(ctx);
+    llama_free_model(model);
+
+    llama_backend_free();
+
+    return 0;
+}
+
 int main(int argc, char ** argv) {
     gpt_params params;
 
-    if (argc == 1 || argv[1][0] == '-') {
+    // with options, n candidates of the prompt with the sampling and grammar options of main
+    if (argc > 1 && argv[1][0] == '-') {
+        if (!gpt_params_parse(argc, argv, params)) {
+            return 1;
+        }
+        return sample_candidates(params);
+    }
+
+    if (argc == 1) {
         printf("usage: %s MODEL_PATH [PROMPT] [PARALLEL] [LEN] [NGL]\n" , argv[0]);
+        printf("       %s -m MODEL_PATH -p PROMPT -np N -n N_PREDICT [sampling and grammar options]\n" , argv[0]);
         return 1 ;
     }
 
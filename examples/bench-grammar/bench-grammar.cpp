@@ -0,0 +1,343 @@
+// Times the grammar engine on a recorded or synthetic sequence of grammars and accepted tokens.
+//
+// Only the vocabulary of the model is loaded, the logits are random. See README.md for the trace format.
+
+#include "common.h"
+#include "grammar-parser.h"
+#include "llama.h"
+
+#include <algorithm>
+#include <cinttypes>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <random>
+#include <string>
+#include <vector>
+
+#if defined(_MSC_VER)
+#pragma warning(disable: 4244 4267) // possible loss of data
+#endif
+
+struct trace_step {
+    bool        is_grammar;
+    std::string grammar; // is_grammar
+    llama_token token;   // !is_grammar
+};
+
+static bool trace_read(const std::string & path, std::vector<trace_step> & steps) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+        fprintf(stderr, "error: failed to open trace '%s'\n", path.c_str());
+        return false;
+    }
+
+    std::string kind;
+    while (file >> kind) {
+        trace_step step;
+        if (kind == "grammar") {
+            size_t size = 0;
+            file >> size;
+            file.get(); // "\n"
+            step.is_grammar = true;
+            step.grammar.resize(size);
+            file.read(&step.grammar[0], size);
+        } else if (kind == "token") {
+            step.is_grammar = false;
+            file >> step.token;
+        } else {
+            fprintf(stderr, "error: unknown record '%s' in trace '%s'\n", kind.c_str(), path.c_str());
+            return false;
+        }
+        if (!file) {
+            fprintf(stderr, "error: truncated trace '%s'\n", path.c_str());
+            return false;
+        }
+        steps.push_back(std::move(step));
+    }
+
+    return true;
+}
+
+static bool trace_write(const std::string & path, const std::vector<trace_step> & steps) {
+    std::ofstream file(path, std::ios::binary);
+    if (!file) {
+        fprintf(stderr, "error: failed to create trace '%s'\n", path.c_str());
+        return false;
+    }
+
+    for (const auto & step : steps) {
+        if (step.is_grammar) {
+            file << "grammar " << step.grammar.size() << "\n" << step.grammar << "\n";
+        } else {
+            file << "token " << step.token << "\n";
+        }
+    }
+
+    return true;
+}
+
+struct bench_timer {
+    const char * name;
+    int64_t      n     = 0;
+    int64_t      t_us  = 0;
+    int64_t      t_min = INT64_MAX;
+    int64_t      t_max = 0;
+
+    explicit bench_timer(const char * name) : name(name) {}
+
+    void add(int64_t t) {
+        n++;
+        t_us += t;
+        t_min = std::min(t_min, t);
+        t_max = std::max(t_max, t);
+    }
+
+    void print() const {
+        if (n == 0) {
+            printf("| %-14s | %8d | %10s | %10s | %10s | %10s |\n", name, 0, "-", "-", "-", "-");
+            return;
+        }
+        printf("| %-14s | %8" PRId64 " | %10.2f | %10.2f | %10" PRId64 " | %10" PRId64 " |\n",
+                name, n, t_us / 1000.0, (double) t_us / n, t_min, t_max);
+    }
+};
+
+static void print_usage(const char * argv0) {
+    fprintf(stderr, "usage: %s -m VOCAB_MODEL (--trace FILE | --grammar-file FILE) [options]\n", argv0);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "options:\n");
+    fprintf(stderr, "  -m FNAME                model whose vocabulary is used, the weights are not loaded\n");
+    fprintf(stderr, "  --trace FILE            replay the grammars and tokens recorded in FILE\n");
+    fprintf(stderr, "  --grammar-file FILE     walk the grammar in FILE with random logits instead of a trace\n");
+    fprintf(stderr, "  -n N                    number of tokens of the walk (default: 256)\n");
+    fprintf(stderr, "  --dump-trace FILE       write the walk to FILE, to replay it with --trace\n");
+    fprintf(stderr, "  -r N                    number of repetitions (default: 5)\n");
+    fprintf(stderr, "  -s SEED                 seed of the random logits (default: 42)\n");
+    fprintf(stderr, "  --mask-cache N          number of grammar token masks to cache (default: 0)\n");
+    fprintf(stderr, "\n");
+}
+
+int main(int argc, char ** argv) {
+    std::string path_model;
+    std::string path_trace;
+    std::string path_grammar;
+    std::string path_dump;
+    int         n_tokens   = 256;
+    int         n_reps     = 5;
+    uint32_t    seed       = 42;
+    int         mask_cache = 0;
+
+    for (int i = 1; i < argc; i++) {
+        const std::string arg = argv[i];
+        if (i + 1 >= argc) {
+            print_usage(argv[0]);
+            return 1;
+        }
+        if (arg == "-m") {
+            path_model = argv[++i];
+        } else if (arg == "--trace") {
+            path_trace = argv[++i];
+        } else if (arg == "--grammar-file") {
+            path_grammar = argv[++i];
+        } else if (arg == "--dump-trace") {
+            path_dump = argv[++i];
+        } else if (arg == "-n") {
+            n_tokens = std::stoi(argv[++i]);
+        } else if (arg == "-r") {
+            n_reps = std::stoi(argv[++i]);
+        } else if (arg == "-s") {
+            seed = std::stoul(argv[++i]);
+        } else if (arg == "--mask-cache") {
+            mask_cache = std::stoi(argv[++i]);
+        } else {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (path_model.empty() || path_trace.empty() == path_grammar.empty()) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    llama_backend_init(false);
+
+    auto mparams = llama_model_default_params();
+    mparams.vocab_only = true;
+
+    llama_model * model = llama_load_model_from_file(path_model.c_str(), mparams);
+    if (model == NULL) {
+        fprintf(stderr, "%s: error: failed to load vocab '%s'\n", __func__, path_model.c_str());
+        return 1;
+    }
+
+    llama_context * ctx = llama_new_context_with_model(model, llama_context_default_params());
+    if (ctx == NULL) {
+        fprintf(stderr, "%s: error: failed to create the context\n", __func__);
+        llama_free_model(model);
+        return 1;
+    }
+
+    const int         n_vocab = llama_n_vocab(model);
+    const llama_token eos     = llama_token_eos(model);
+
+    std::vector<trace_step> steps;
+
+    if (!path_trace.empty()) {
+        if (!trace_read(path_trace, steps)) {
+            return 1;
+        }
+    } else {
+        std::ifstream file(path_grammar);
+        if (!file) {
+            fprintf(stderr, "error: failed to open grammar '%s'\n", path_grammar.c_str());
+            return 1;
+        }
+        trace_step step;
+        step.is_grammar = true;
+        step.grammar.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+        steps.push_back(step);
+    }
+
+    // without a trace, the tokens are chosen by walking the grammar, which restarts when it is complete
+    const bool walk = path_trace.empty();
+
+    bench_timer t_parse ("parse");
+    bench_timer t_init  ("init");
+    bench_timer t_sample("sample_grammar");
+    bench_timer t_accept("accept_token");
+
+    std::vector<llama_token_data> cur(n_vocab);
+
+    int n_rejected = 0;
+
+    for (int rep = 0; rep < n_reps; rep++) {
+        std::mt19937 rng(seed + rep);
+        std::uniform_real_distribution<float> dist(-10.0f, 10.0f);
+
+        grammar_parser::parse_state parsed;
+        llama_grammar * grammar = NULL;
+
+        auto start_grammar = [&](const std::string & text) {
+            if (grammar != NULL) {
+                llama_grammar_free(grammar);
+                grammar = NULL;
+            }
+
+            int64_t t_start = ggml_time_us();
+            parsed = grammar_parser::parse(text.c_str());
+            t_parse.add(ggml_time_us() - t_start);
+
+            if (parsed.rules.empty() || parsed.symbol_ids.find("root") == parsed.symbol_ids.end()) {
+                return false;
+            }
+
+            std::vector<const llama_grammar_element *> rules(parsed.c_rules());
+
+            t_start = ggml_time_us();
+            grammar = llama_grammar_init(rules.data(), rules.size(), parsed.symbol_ids.at("root"));
+            t_init.add(ggml_time_us() - t_start);
+
+            llama_grammar_set_mask_cache(grammar, mask_cache);
+
+            return true;
+        };
+
+        // samples with random logits, returns the first allowed token (greedy), or -1 if none
+        auto sample = [&]() {
+            for (llama_token id = 0; id < n_vocab; id++) {
+                cur[id] = llama_token_data{ id, dist(rng), 0.0f };
+            }
+            llama_token_data_array cur_p = { cur.data(), cur.size(), false };
+
+            const int64_t t_start = ggml_time_us();
+            llama_sample_grammar(ctx, &cur_p, grammar);
+            t_sample.add(ggml_time_us() - t_start);
+
+            llama_token best = -1;
+            for (llama_token id = 0; id < n_vocab; id++) {
+                if (cur[id].logit != -INFINITY && (best < 0 || cur[id].logit > cur[best].logit)) {
+                    best = id;
+                }
+            }
+            return best;
+        };
+
+        auto accept = [&](llama_token id) {
+            const int64_t t_start = ggml_time_us();
+            llama_grammar_accept_token(ctx, grammar, id);
+            t_accept.add(ggml_time_us() - t_start);
+        };
+
+        if (walk) {
+            std::vector<trace_step> walked = { steps[0] };
+
+            if (!start_grammar(steps[0].grammar)) {
+                fprintf(stderr, "error: failed to parse grammar '%s'\n", path_grammar.c_str());
+                return 1;
+            }
+            for (int i = 0; i < n_tokens; i++) {
+                const llama_token id = sample();
+                if (id < 0 || id == eos) {
+                    // the grammar is complete, start over
+                    start_grammar(steps[0].grammar);
+                    walked.push_back(steps[0]);
+                    continue;
+                }
+                accept(id);
+                walked.push_back({ false, "", id });
+            }
+
+            if (rep == 0 && !path_dump.empty() && !trace_write(path_dump, walked)) {
+                return 1;
+            }
+        } else {
+            bool ok = false;
+            for (const auto & step : steps) {
+                if (step.is_grammar) {
+                    ok = start_grammar(step.grammar);
+                    continue;
+                }
+                if (!ok) {
+                    continue;
+                }
+                // the recorded token is accepted as long as the grammar allows it
+                sample();
+                if (step.token < 0 || step.token >= n_vocab || cur[step.token].logit == -INFINITY) {
+                    n_rejected += rep == 0;
+                    ok = false;
+                    continue;
+                }
+                if (step.token != eos) {
+                    accept(step.token);
+                }
+            }
+        }
+
+        if (grammar != NULL) {
+            llama_grammar_free(grammar);
+        }
+    }
+
+    printf("\n");
+    printf("| %-14s | %8s | %10s | %10s | %10s | %10s |\n", "step", "calls", "total ms", "us/call", "min us", "max us");
+    printf("| %-14s | %8s | %10s | %10s | %10s | %10s |\n", "--------------", "-------:", "---------:", "---------:", "---------:", "---------:");
+    t_parse.print();
+    t_init.print();
+    t_sample.print();
+    t_accept.print();
+    printf("\n");
+
+    if (n_rejected > 0) {
+        printf("%d recorded tokens were rejected by their grammar, the steps until the next grammar were skipped\n", n_rejected);
+    }
+
+    llama_free(ctx);
+    llama_free_model(model);
+
+    llama_backend_free();
+
+    return 0;
+}
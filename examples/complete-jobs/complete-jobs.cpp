@@ -0,0 +1,272 @@
+// Completes a stream of programs with a resident model.
+//
+// Each line of stdin is a job, either "PROGRAM_FILE" or "PRELUDE_FILE<TAB>PROGRAM_FILE". The model continues the text
+// of the prelude followed by the program, and one JSON object per job is written to stdout. The prelude is evaluated
+// in sequence 0 of the KV cache once, and the jobs sharing it are forked from it into sequence 1. The default prelude
+// is the one given with --prelude.
+
+#include "common.h"
+#include "llama.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <ctime>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+static bool read_file(const std::string & path, std::string & text) {
+    std::ifstream file(path);
+    if (!file) {
+        return false;
+    }
+    text.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    return true;
+}
+
+static std::string json_escape(const std::string & text) {
+    std::string result;
+    for (const char c : text) {
+        switch (c) {
+            case '"':  result += "\\\""; break;
+            case '\\': result += "\\\\"; break;
+            case '\n': result += "\\n";  break;
+            case '\r': result += "\\r";  break;
+            case '\t': result += "\\t";  break;
+            default:
+                if ((unsigned char) c < 0x20) {
+                    char buf[8];
+                    snprintf(buf, sizeof(buf), "\\u%04x", c);
+                    result += buf;
+                } else {
+                    result += c;
+                }
+        }
+    }
+    return result;
+}
+
+// evaluates tokens[n_past:] in sequence seq_id, with the logits of the last token
+static bool decode_tokens(llama_context * ctx, llama_batch & batch, const std::vector<llama_token> & tokens, int n_past, llama_seq_id seq_id, int n_batch) {
+    for (int i = n_past; i < (int) tokens.size(); i += n_batch) {
+        const int n_eval = std::min(n_batch, (int) tokens.size() - i);
+
+        llama_batch_clear(batch);
+        for (int j = 0; j < n_eval; j++) {
+            llama_batch_add(batch, tokens[i + j], i + j, { seq_id }, i + j == (int) tokens.size() - 1);
+        }
+
+        if (llama_decode(ctx, batch)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static size_t common_prefix(const std::vector<llama_token> & a, const std::vector<llama_token> & b) {
+    size_t n = 0;
+    while (n < a.size() && n < b.size() && a[n] == b[n]) {
+        n++;
+    }
+    return n;
+}
+
+int main(int argc, char ** argv) {
+    gpt_params params;
+
+    if (!gpt_params_parse(argc, argv, params)) {
+        return 1;
+    }
+
+    llama_sampling_params & sparams = params.sparams;
+
+    if (params.seed == LLAMA_DEFAULT_SEED) {
+        params.seed = time(NULL);
+    }
+
+    if (!llama_trace_start(params.trace)) {
+        return 1;
+    }
+
+    llama_backend_init(params.numa);
+
+    llama_model * model;
+    llama_context * ctx;
+
+    std::tie(model, ctx) = llama_init_from_gpt_params(params);
+    if (model == NULL) {
+        fprintf(stderr, "%s: error: unable to load model\n", __func__);
+        return 1;
+    }
+
+    const int  n_ctx   = llama_n_ctx(ctx);
+    const bool add_bos = llama_should_add_bos_token(model);
+
+    const llama_seq_id seq_prelude = 0;
+    const llama_seq_id seq_job     = 1;
+
+    llama_batch batch = llama_batch_init(std::max(params.n_batch, 1), 0, 1);
+
+    // prelude resident in seq_prelude
+    std::string              prelude_path;
+    std::vector<llama_token> prelude_tokens;
+
+    struct llama_sampling_context * ctx_sampling = llama_sampling_init(sparams);
+    if (ctx_sampling == NULL) {
+        return 1;
+    }
+
+    int n_jobs = 0;
+
+    std::string line;
+    while (std::getline(std::cin, line)) {
+        if (line.empty()) {
+            continue;
+        }
+
+        const size_t tab = line.find('\t');
+        const std::string job_prelude_path = tab == std::string::npos ? "" : line.substr(0, tab);
+        const std::string program_path     = tab == std::string::npos ? line : line.substr(tab + 1);
+
+        const int64_t t_start_us = ggml_time_us();
+
+        std::string prelude = sparams.prelude;
+        std::string program;
+        if ((!job_prelude_path.empty() && !read_file(job_prelude_path, prelude)) || !read_file(program_path, program)) {
+            fprintf(stderr, "%s: error: failed to read job '%s'\n", __func__, line.c_str());
+            printf("{\"job\": %d, \"program\": \"%s\", \"error\": \"failed to read the job\"}\n", n_jobs++, json_escape(program_path).c_str());
+            fflush(stdout);
+            continue;
+        }
+
+        // the provider type checks against the prelude of the job
+        if (job_prelude_path != prelude_path) {
+            llama_sampling_params job_sparams = sparams;
+            if (!job_prelude_path.empty()) {
+                job_sparams.prelude                 = prelude;
+                job_sparams.dynamic_grammar_prelude = job_prelude_path;
+            }
+
+            llama_sampling_free(ctx_sampling);
+            ctx_sampling = llama_sampling_init(job_sparams);
+            if (ctx_sampling == NULL) {
+                return 1;
+            }
+        } else {
+            llama_sampling_reset(ctx_sampling);
+        }
+        prelude_path = job_prelude_path;
+
+        // only the part of the prelude that changed is evaluated again
+        const std::vector<llama_token> job_prelude_tokens = ::llama_tokenize(ctx, prelude, add_bos, true);
+        const size_t n_prelude_kept = common_prefix(prelude_tokens, job_prelude_tokens);
+        const int    n_prelude_eval = job_prelude_tokens.size() - n_prelude_kept;
+
+        llama_kv_cache_seq_rm(ctx, seq_prelude, n_prelude_kept, -1);
+        if (!decode_tokens(ctx, batch, job_prelude_tokens, n_prelude_kept, seq_prelude, params.n_batch)) {
+            fprintf(stderr, "%s: error: failed to eval the prelude\n", __func__);
+            return 1;
+        }
+        prelude_tokens = job_prelude_tokens;
+
+        std::vector<llama_token> tokens = ::llama_tokenize(ctx, prelude + program, add_bos, true);
+        if ((int) tokens.size() > n_ctx - 4) {
+            fprintf(stderr, "%s: error: prompt of job '%s' is too long (%d tokens, max %d)\n", __func__, line.c_str(), (int) tokens.size(), n_ctx - 4);
+            printf("{\"job\": %d, \"program\": \"%s\", \"error\": \"prompt too long\"}\n", n_jobs++, json_escape(program_path).c_str());
+            fflush(stdout);
+            continue;
+        }
+
+        // fork the job from the prelude, the tokens may merge across the end of the prelude, and the logits of the
+        // last prompt token are needed
+        const size_t n_shared = std::min(common_prefix(prelude_tokens, tokens), tokens.size() - 1);
+
+        llama_kv_cache_seq_rm(ctx, seq_job, -1, -1);
+        llama_kv_cache_seq_cp(ctx, seq_prelude, seq_job, 0, n_shared);
+        if (!decode_tokens(ctx, batch, tokens, n_shared, seq_job, params.n_batch)) {
+            fprintf(stderr, "%s: error: failed to eval the prompt\n", __func__);
+            return 1;
+        }
+
+        for (const llama_token id : tokens) {
+            llama_sampling_accept(ctx_sampling, ctx, id, false);
+        }
+        llama_sampling_set_prelude_len(ctx_sampling, prelude_tokens.size());
+
+        const int64_t t_prompt_us = ggml_time_us();
+
+        int         n_past    = tokens.size();
+        int         n_decoded = 0;
+        int         i_logits  = batch.n_tokens - 1;
+        std::string completion;
+        const char * stop = "length";
+
+        while (params.n_predict < 0 || n_decoded < params.n_predict) {
+            const llama_token id = llama_sampling_sample(ctx_sampling, ctx, NULL, i_logits);
+
+            if (ctx_sampling->stop_reason != LLAMA_SAMPLING_STOP_NONE) {
+                stop = llama_sampling_stop_reason_str(ctx_sampling->stop_reason);
+                break;
+            }
+            if (id == llama_token_eos(model)) {
+                stop = "eos";
+                break;
+            }
+            if (n_past + 1 > n_ctx) {
+                stop = "context";
+                break;
+            }
+
+            llama_sampling_accept(ctx_sampling, ctx, id, true);
+
+            std::vector<llama_token> embd = { id };
+
+            // the tokens forced by the grammar are decoded in the same batch as the sampled one
+            const int n_left = params.n_predict < 0 ? params.n_batch : params.n_predict - n_decoded - 1;
+            const int n_max  = std::min({ n_left, params.n_batch - 1, n_ctx - n_past - 1 });
+            for (const llama_token id_forced : llama_sampling_jump_forward(ctx_sampling, ctx, n_max)) {
+                embd.push_back(id_forced);
+            }
+
+            llama_batch_clear(batch);
+            for (size_t i = 0; i < embd.size(); i++) {
+                llama_batch_add(batch, embd[i], n_past + i, { seq_job }, i == embd.size() - 1);
+                completion += llama_token_to_piece(ctx, embd[i]);
+            }
+
+            n_past    += embd.size();
+            n_decoded += embd.size();
+            i_logits   = batch.n_tokens - 1;
+
+            if (llama_decode(ctx, batch)) {
+                fprintf(stderr, "%s: error: failed to eval\n", __func__);
+                return 1;
+            }
+        }
+
+        llama_kv_cache_seq_rm(ctx, seq_job, -1, -1);
+
+        const int64_t t_end_us = ggml_time_us();
+
+        printf("{\"job\": %d, \"program\": \"%s\", \"stop\": \"%s\", \"n_prelude_eval\": %d, \"n_prompt_eval\": %d, \"n_decoded\": %d, "
+               "\"t_prompt_ms\": %.2f, \"t_gen_ms\": %.2f, \"completion\": \"%s\"}\n",
+                n_jobs++, json_escape(program_path).c_str(), stop, n_prelude_eval, (int) (tokens.size() - n_shared), n_decoded,
+                (t_prompt_us - t_start_us) / 1000.0, (t_end_us - t_prompt_us) / 1000.0, json_escape(completion).c_str());
+        fflush(stdout);
+    }
+
+    llama_print_timings(ctx);
+
+    llama_sampling_free(ctx_sampling);
+    llama_batch_free(batch);
+
+    llama_free(ctx);
+    llama_free_model(model);
+
+    llama_backend_free();
+
+    llama_trace_stop();
+
+    return 0;
+}
@@ -1,12 +1,103 @@
 #include "common.h"
 #include "llama.h"
 
+#include <algorithm>
+#include <condition_variable>
+#include <cstdio>
 #include <ctime>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
 
 #if defined(_MSC_VER)
 #pragma warning(disable: 4244 4267) // possible loss of data
 #endif
 
+// bounded queue between the main thread and the reader and writer threads
+template <typename T>
+struct embd_queue {
+    explicit embd_queue(size_t max_size) : max_size(max_size) {}
+
+    void push(T && item) {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [&] { return items.size() < max_size; });
+        items.push_back(std::move(item));
+        cv.notify_all();
+    }
+
+    // returns false if the queue is empty and wait is false
+    bool pop(T & item, bool wait) {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (wait) {
+            cv.wait(lock, [&] { return !items.empty(); });
+        } else if (items.empty()) {
+            return false;
+        }
+        item = std::move(items.front());
+        items.pop_front();
+        cv.notify_all();
+        return true;
+    }
+
+    std::mutex              mutex;
+    std::condition_variable cv;
+    std::deque<T>           items;
+    const size_t            max_size;
+};
+
+// an input line, or the end of the inputs with index < 0
+struct embd_input {
+    int64_t                  index = -1;
+    std::vector<llama_token> tokens;
+};
+
+// the pooled embedding of an input, or the end of the outputs with index < 0
+struct embd_output {
+    int64_t            index = -1;
+    std::vector<float> embd;
+};
+
+enum embd_pooling {
+    EMBD_POOLING_MEAN,
+    EMBD_POOLING_CLS,
+    EMBD_POOLING_LAST,
+};
+
+// the input decoded in the sequence of the same id
+struct embd_slot {
+    enum { FREE, ACTIVE, DONE } state = FREE;
+
+    int64_t                  index  = -1;
+    std::vector<llama_token> tokens;
+    int32_t                  n_past = 0; // number of tokens added to the batches
+    std::vector<float>       embd;       // pooled embedding
+};
+
+// NumPy .npy header of a 2-dimensional array, always of 128 bytes so that it can be rewritten with the final number of rows
+static std::string npy_header(bool f16, uint64_t n_rows, int n_embd) {
+    char dict[128];
+    snprintf(dict, sizeof(dict), "{'descr': '%s', 'fortran_order': False, 'shape': (%llu, %d), }",
+            f16 ? "<f2" : "<f4", (unsigned long long) n_rows, n_embd);
+
+    std::string header("\x93NUMPY\x01\x00", 8);
+    const size_t n_dict = 128 - header.size() - 2;
+    header += (char) (n_dict & 0xff);
+    header += (char) (n_dict >> 8);
+    header += dict;
+    header.resize(127, ' ');
+    header += '\n';
+    return header;
+}
+
+static bool ends_with(const std::string & str, const std::string & suffix) {
+    return str.size() >= suffix.size() && str.compare(str.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
 int main(int argc, char ** argv) {
     gpt_params params;
 
@@ -55,50 +146,273 @@ int main(int argc, char ** argv) {
         fprintf(stderr, "%s\n", get_system_info(params).c_str());
     }
 
-    int n_past = 0;
+    const int n_embd     = llama_n_embd(model);
+    const int n_batch    = std::min(params.n_batch, n_ctx);
+    const int n_parallel = std::max(params.n_parallel, 1);
 
-    // tokenize the prompt
-    auto embd_inp = ::llama_tokenize(ctx, params.prompt, true);
+    const embd_pooling pooling =
+        params.pooling == "mean" ? EMBD_POOLING_MEAN :
+        params.pooling == "cls"  ? EMBD_POOLING_CLS  : EMBD_POOLING_LAST;
 
-    if (params.verbose_prompt) {
-        fprintf(stderr, "\n");
-        fprintf(stderr, "%s: prompt: '%s'\n", __func__, params.prompt.c_str());
-        fprintf(stderr, "%s: number of tokens in prompt = %zu\n", __func__, embd_inp.size());
-        for (int i = 0; i < (int) embd_inp.size(); i++) {
-            fprintf(stderr, "%6d -> '%s'\n", embd_inp[i], llama_token_to_piece(ctx, embd_inp[i]).c_str());
+    std::ifstream input_file;
+    if (!params.embd_input.empty() && params.embd_input != "-") {
+        input_file.open(params.embd_input);
+        if (!input_file) {
+            fprintf(stderr, "%s: error: failed to open input file '%s'\n", __func__, params.embd_input.c_str());
+            return 1;
         }
-        fprintf(stderr, "\n");
     }
 
-    if (embd_inp.size() > (size_t)n_ctx) {
-        fprintf(stderr, "%s: error: prompt is longer than the context window (%zu tokens, n_ctx = %d)\n",
-                __func__, embd_inp.size(), n_ctx);
-        return 1;
+    FILE * fout = NULL;
+    const bool npy = ends_with(params.embd_output, ".npy");
+    if (!params.embd_output.empty()) {
+        fout = fopen(params.embd_output.c_str(), "wb");
+        if (fout == NULL) {
+            fprintf(stderr, "%s: error: failed to open output file '%s'\n", __func__, params.embd_output.c_str());
+            return 1;
+        }
     }
 
-    while (!embd_inp.empty()) {
-        int n_tokens = std::min(params.n_batch, (int) embd_inp.size());
-        if (llama_decode(ctx, llama_batch_get_one(embd_inp.data(), n_tokens, n_past, 0))) {
+    embd_queue<embd_input>  inputs (4*n_parallel);
+    embd_queue<embd_output> outputs(4*n_parallel);
+
+    // read and tokenize the inputs, one per line, or the prompt without an input file
+    std::thread reader([&]() {
+        std::istream & in = params.embd_input == "-" ? std::cin : input_file;
+
+        int64_t n_inputs = 0;
+        std::string line;
+        while (params.embd_input.empty() ? n_inputs == 0 : (bool) std::getline(in, line)) {
+            if (params.embd_input.empty()) {
+                line = params.prompt;
+            } else if (!line.empty() && line.back() == '\r') {
+                line.pop_back();
+            }
+
+            embd_input item;
+            item.index  = n_inputs++;
+            item.tokens = ::llama_tokenize(model, line, true);
+
+            if (params.verbose_prompt) {
+                fprintf(stderr, "main: input %lld: '%s' (%zu tokens)\n", (long long) item.index, line.c_str(), item.tokens.size());
+            }
+
+            if ((int) item.tokens.size() > n_ctx) {
+                fprintf(stderr, "main: warning: input %lld is longer than the context window (%zu tokens, n_ctx = %d), truncated\n",
+                        (long long) item.index, item.tokens.size(), n_ctx);
+                item.tokens.resize(n_ctx);
+            }
+
+            inputs.push(std::move(item));
+        }
+
+        inputs.push(embd_input());
+    });
+
+    // write the embeddings in the order of the inputs, converted to float16 if requested
+    uint64_t n_rows = 0;
+    bool     write_ok = true;
+
+    std::thread writer([&]() {
+        std::map<int64_t, std::vector<float>> pending;
+        std::vector<ggml_fp16_t> buf_f16(n_embd);
+
+        if (fout != NULL && npy) {
+            const std::string header = npy_header(params.embd_f16, 0, n_embd);
+            write_ok = write_ok && fwrite(header.data(), 1, header.size(), fout) == header.size();
+        }
+
+        embd_output item;
+        while (outputs.pop(item, true) && item.index >= 0) {
+            pending[item.index] = std::move(item.embd);
+
+            for (auto it = pending.begin(); it != pending.end() && it->first == (int64_t) n_rows; it = pending.erase(it)) {
+                const std::vector<float> & embd = it->second;
+
+                if (fout == NULL) {
+                    for (int i = 0; i < n_embd; i++) {
+                        printf("%f ", embd[i]);
+                    }
+                    printf("\n");
+                } else if (params.embd_f16) {
+                    ggml_fp32_to_fp16_row(embd.data(), buf_f16.data(), n_embd);
+                    write_ok = write_ok && fwrite(buf_f16.data(), sizeof(ggml_fp16_t), n_embd, fout) == (size_t) n_embd;
+                } else {
+                    write_ok = write_ok && fwrite(embd.data(), sizeof(float), n_embd, fout) == (size_t) n_embd;
+                }
+                n_rows++;
+            }
+        }
+
+        if (fout != NULL && npy) {
+            const std::string header = npy_header(params.embd_f16, n_rows, n_embd);
+            write_ok = write_ok && fseek(fout, 0, SEEK_SET) == 0 && fwrite(header.data(), 1, header.size(), fout) == header.size();
+        }
+    });
+
+    // each input is decoded in the sequence of the id of its slot, and the batches pack the tokens of all the active
+    // slots. a batch is evaluated asynchronously while the embeddings of the previous one are pooled
+    std::vector<embd_slot> slots(n_parallel);
+
+    llama_batch batch      = llama_batch_init(n_batch, 0, 1);
+    llama_batch batch_prev = llama_batch_init(n_batch, 0, 1);
+
+    int32_t  n_cells  = 0; // KV cells used by the sequences of the slots, including the ones of the batch in progress
+    int64_t  n_tokens = 0;
+    bool     eof      = false;
+    bool     ok       = true;
+
+    embd_input next;
+    bool has_next = false;
+
+    const int64_t t_start_us = ggml_time_us();
+
+    while (ok) {
+        // admit the next inputs while there is a free slot and room for all of their tokens in the KV cache
+        while (!eof) {
+            if (!has_next) {
+                const bool idle = batch_prev.n_tokens == 0 &&
+                    std::none_of(slots.begin(), slots.end(), [](const embd_slot & slot) { return slot.state != embd_slot::FREE; });
+                if (!inputs.pop(next, idle)) {
+                    break;
+                }
+                has_next = true;
+            }
+            if (next.index < 0) {
+                eof      = true;
+                has_next = false;
+                break;
+            }
+
+            auto slot = std::find_if(slots.begin(), slots.end(), [](const embd_slot & slot) { return slot.state == embd_slot::FREE; });
+            if (slot == slots.end() || n_cells + (int32_t) next.tokens.size() > n_ctx) {
+                break;
+            }
+
+            slot->state  = embd_slot::ACTIVE;
+            slot->index  = next.index;
+            slot->tokens = std::move(next.tokens);
+            slot->n_past = 0;
+            slot->embd.assign(n_embd, 0.0f);
+
+            n_cells += slot->tokens.size();
+            has_next = false;
+        }
+
+        // fill the batch with the remaining tokens of the slots, the oldest inputs first
+        std::vector<int> order;
+        for (int s = 0; s < n_parallel; s++) {
+            if (slots[s].state == embd_slot::ACTIVE && slots[s].n_past < (int32_t) slots[s].tokens.size()) {
+                order.push_back(s);
+            }
+        }
+        std::sort(order.begin(), order.end(), [&](int a, int b) { return slots[a].index < slots[b].index; });
+
+        llama_batch_clear(batch);
+        for (int s : order) {
+            embd_slot & slot = slots[s];
+            while (batch.n_tokens < n_batch && slot.n_past < (int32_t) slot.tokens.size()) {
+                llama_batch_add(batch, slot.tokens[slot.n_past], slot.n_past, { s }, true);
+                slot.n_past++;
+            }
+        }
+
+        if (batch.n_tokens == 0 && batch_prev.n_tokens == 0) {
+            break;
+        }
+
+        if (batch.n_tokens > 0 && llama_decode_async(ctx, batch) != 0) {
             fprintf(stderr, "%s : failed to eval\n", __func__);
-            return 1;
+            ok = false;
+            break;
         }
-        n_past += n_tokens;
-        embd_inp.erase(embd_inp.begin(), embd_inp.begin() + n_tokens);
+
+        // pool the embeddings of the previous batch, which are the outputs of the context until llama_synchronize
+        for (int i = 0; i < batch_prev.n_tokens; i++) {
+            embd_slot & slot = slots[batch_prev.seq_id[i][0]];
+            const llama_pos pos = batch_prev.pos[i];
+            const int32_t   n   = slot.tokens.size();
+
+            if (pooling == EMBD_POOLING_MEAN) {
+                const float * embd = llama_get_embeddings_ith(ctx, i);
+                for (int j = 0; j < n_embd; j++) {
+                    slot.embd[j] += embd[j];
+                }
+            } else if ((pooling == EMBD_POOLING_CLS && pos == 0) || (pooling == EMBD_POOLING_LAST && pos == n - 1)) {
+                const float * embd = llama_get_embeddings_ith(ctx, i);
+                std::copy(embd, embd + n_embd, slot.embd.begin());
+            }
+
+            if (pos == n - 1) {
+                if (pooling == EMBD_POOLING_MEAN) {
+                    for (int j = 0; j < n_embd; j++) {
+                        slot.embd[j] /= n;
+                    }
+                }
+
+                embd_output item;
+                item.index = slot.index;
+                item.embd  = std::move(slot.embd);
+                outputs.push(std::move(item));
+
+                slot.state = embd_slot::DONE;
+            }
+        }
+        n_tokens += batch_prev.n_tokens;
+
+        if (batch.n_tokens > 0 && llama_synchronize(ctx) != 0) {
+            fprintf(stderr, "%s : failed to eval\n", __func__);
+            ok = false;
+            break;
+        }
+
+        // the sequences of the pooled inputs can be removed once no batch is in progress
+        for (int s = 0; s < n_parallel; s++) {
+            embd_slot & slot = slots[s];
+            if (slot.state == embd_slot::DONE) {
+                llama_kv_cache_seq_rm(ctx, s, -1, -1);
+                n_cells -= slot.tokens.size();
+                slot.state = embd_slot::FREE;
+                slot.tokens.clear();
+            }
+        }
+
+        std::swap(batch, batch_prev);
     }
 
-    const int n_embd = llama_n_embd(model);
-    const auto * embeddings = llama_get_embeddings(ctx);
+    const int64_t t_end_us = ggml_time_us();
+
+    outputs.push(embd_output());
+    writer.join();
 
-    for (int i = 0; i < n_embd; i++) {
-        printf("%f ", embeddings[i]);
+    if (!ok) {
+        // unblock the reader, which may wait for room in the queue
+        embd_input item;
+        while (!eof && inputs.pop(item, true) && item.index >= 0) {}
     }
-    printf("\n");
+    reader.join();
+
+    if (fout != NULL) {
+        write_ok = fclose(fout) == 0 && write_ok;
+        if (!write_ok) {
+            fprintf(stderr, "%s: error: failed to write the embeddings to '%s'\n", __func__, params.embd_output.c_str());
+            ok = false;
+        }
+    }
+
+    const double t_s = (t_end_us - t_start_us) / 1e6;
+    fprintf(stderr, "\n%s: %llu embeddings of %lld tokens in %.2f s, %.2f embeddings/s, %.2f tokens/s\n", __func__,
+            (unsigned long long) n_rows, (long long) n_tokens, t_s, n_rows / t_s, n_tokens / t_s);
 
     llama_print_timings(ctx);
+
+    llama_batch_free(batch);
+    llama_batch_free(batch_prev);
+
     llama_free(ctx);
     llama_free_model(model);
 
     llama_backend_free();
 
-    return 0;
+    return ok ? 0 : 1;
 }
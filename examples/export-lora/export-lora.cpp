@@ -3,12 +3,17 @@
 #include "ggml.h"
 #include "ggml-alloc.h"
 
+#include <future>
 #include <vector>
 #include <string>
 #include <thread>
 
 static const size_t tensor_alignment = 32;
 
+// the base tensors are merged in chunks of rows of at most this many elements, so that the buffers do not grow with
+// the size of the tensors
+static const int64_t chunk_elements = 8*1024*1024;
+
 struct lora_info {
     std::string filename;
     float scale;
@@ -21,6 +26,13 @@ struct export_lora_params {
     int n_threads;
 };
 
+// the lora tensors of a base tensor
+struct lora_tensors {
+    struct ggml_tensor * a;
+    struct ggml_tensor * b;
+    float scaling;
+};
+
 struct lora_data {
     struct lora_info     info;
     std::vector<uint8_t> data;
@@ -303,38 +315,51 @@ static struct lora_data * load_lora(struct lora_info * info) {
 static struct ggml_cgraph * build_graph_lora(
     struct ggml_context * ctx,
     struct ggml_tensor * tensor,
-    struct ggml_tensor * lora_a,
-    struct ggml_tensor * lora_b,
-    float scaling
+    const std::vector<struct lora_tensors> & lora,
+    int64_t row0
 ) {
-    struct ggml_tensor * ab = ggml_mul_mat(ctx, lora_a, lora_b);
-    if (scaling != 1.0f) {
-        ab = ggml_scale(ctx, ab, ggml_new_f32(ctx, scaling));
+    struct ggml_tensor * res = tensor;
+    for (size_t k = 0; k < lora.size(); ++k) {
+        // the rows of the chunk of the product are the ones of B
+        struct ggml_tensor * b  = ggml_view_2d(ctx, lora[k].b, lora[k].b->ne[0], tensor->ne[1], lora[k].b->nb[1], row0*lora[k].b->nb[1]);
+        struct ggml_tensor * ab = ggml_mul_mat(ctx, lora[k].a, b);
+        if (lora[k].scaling != 1.0f) {
+            ab = ggml_scale(ctx, ab, ggml_new_f32(ctx, lora[k].scaling));
+        }
+        res = ggml_add_inplace(ctx, res, ab);
     }
-    struct ggml_tensor * res = ggml_add_inplace(ctx, tensor, ab);
 
     struct ggml_cgraph * gf = ggml_new_graph(ctx);
     ggml_build_forward_expand (gf, res);
     return gf;
 }
 
-static bool apply_lora(struct ggml_tensor * tensor, struct lora_data * lora, int n_threads) {
-    if (lora->ctx == NULL) {
-        return false;
-    }
-    std::string name = ggml_get_name(tensor);
-    std::string name_a = name + std::string(".loraA");
-    std::string name_b = name + std::string(".loraB");
-    struct ggml_tensor * lora_a = ggml_get_tensor(lora->ctx, name_a.c_str());
-    struct ggml_tensor * lora_b = ggml_get_tensor(lora->ctx, name_b.c_str());
-    if (lora_a == NULL || lora_b == NULL) {
-        return false;
-    }
+static std::vector<struct lora_tensors> get_lora_tensors(const char * name, const std::vector<struct lora_data *> & loras) {
+    std::vector<struct lora_tensors> result;
+    for (size_t k = 0; k < loras.size(); ++k) {
+        struct lora_data * lora = loras[k];
+        if (lora->ctx == NULL) {
+            continue;
+        }
+        std::string name_a = name + std::string(".loraA");
+        std::string name_b = name + std::string(".loraB");
+        struct ggml_tensor * lora_a = ggml_get_tensor(lora->ctx, name_a.c_str());
+        struct ggml_tensor * lora_b = ggml_get_tensor(lora->ctx, name_b.c_str());
+        if (lora_a == NULL || lora_b == NULL) {
+            continue;
+        }
 
-    float scaling = lora->info.scale * (float)lora->lora_alpha / (float)lora->lora_r;
+        float scaling = lora->info.scale * (float)lora->lora_alpha / (float)lora->lora_r;
 
+        result.push_back({ lora_a, lora_b, scaling });
+    }
+    return result;
+}
+
+// add the products of the loras to the rows [row0, row0 + tensor->ne[1]) of a base tensor, in place
+static void apply_lora(struct ggml_tensor * tensor, const std::vector<struct lora_tensors> & lora, int64_t row0, int n_threads) {
     struct ggml_init_params params;
-    params.mem_size   = GGML_OBJECT_SIZE + ggml_graph_overhead() + ggml_tensor_overhead()*4 + GGML_MEM_ALIGN*5;
+    params.mem_size   = GGML_OBJECT_SIZE + ggml_graph_overhead() + ggml_tensor_overhead()*5*lora.size() + GGML_MEM_ALIGN*(5*lora.size() + 1);
     params.mem_buffer = NULL;
     params.no_alloc   = true;
     struct ggml_context * ctx = NULL;
@@ -343,7 +368,7 @@ static bool apply_lora(struct ggml_tensor * tensor, struct lora_data * lora, int
 
     ctx   = ggml_init(params);
     alloc = ggml_allocr_new_measure(tensor_alignment);
-    gf    = build_graph_lora(ctx, tensor, lora_a, lora_b, scaling);
+    gf    = build_graph_lora(ctx, tensor, lora, row0);
     size_t alloc_size = ggml_allocr_alloc_graph(alloc, gf);
     ggml_allocr_free(alloc);
     ggml_free(ctx);
@@ -353,7 +378,7 @@ static bool apply_lora(struct ggml_tensor * tensor, struct lora_data * lora, int
 
     ctx   = ggml_init(params);
     alloc = ggml_allocr_new(data_compute.data(), data_compute.size(), tensor_alignment);
-    gf    = build_graph_lora(ctx, tensor, lora_a, lora_b, scaling);
+    gf    = build_graph_lora(ctx, tensor, lora, row0);
     ggml_allocr_alloc_graph(alloc, gf);
     ggml_allocr_free(alloc);
 
@@ -365,7 +390,6 @@ static bool apply_lora(struct ggml_tensor * tensor, struct lora_data * lora, int
     ggml_graph_compute(gf, &cplan);
 
     ggml_free(ctx);
-    return true;
 }
 
 static void export_lora(struct export_lora_params * params) {
@@ -418,37 +442,100 @@ static void export_lora(struct export_lora_params * params) {
     gguf_get_meta_data(gguf_out, meta.data());
     fout.write_raw(meta.data(), meta.size());
 
-    std::vector<uint8_t> data;
-    std::vector<uint8_t> padding;
-    for (int i=0; i < n_tensors; ++i) {
-        const char * name = gguf_get_tensor_name(gguf_in, i);
-        struct ggml_tensor * tensor = ggml_get_tensor(ctx_in, name);
+    // the tensors are merged in chunks of rows: the chunk k is merged while the chunk k + 1 is read and the chunk k - 1
+    // is written, each one in its buffer
+    struct merge_chunk {
+        int     itensor;
+        int64_t row0;
+        int64_t nrows;
+    };
+
+    std::vector<merge_chunk> chunks;
+    for (int i = 0; i < n_tensors; ++i) {
+        struct ggml_tensor * tensor = ggml_get_tensor(ctx_in, gguf_get_tensor_name(gguf_in, i));
 
-        // read tensor data
-        data.resize(ggml_nbytes(tensor));
-        tensor->data = data.data();
-        size_t offset = gguf_get_tensor_offset(gguf_in, i);
-        fin.seek(offset + meta.size(), SEEK_SET);
-        fin.read_raw(data.data(), data.size());
+        const int64_t nrows      = ggml_nrows(tensor);
+        const int64_t chunk_rows = std::max<int64_t>(1, chunk_elements/std::max<int64_t>(1, tensor->ne[0]));
 
-        // apply all loras
-        for (size_t k = 0; k < loras.size(); ++k) {
-            apply_lora(tensor, loras[k], params->n_threads);
+        for (int64_t row0 = 0; row0 < nrows; row0 += chunk_rows) {
+            chunks.push_back({ i, row0, std::min(chunk_rows, nrows - row0) });
         }
+    }
+
+    std::vector<uint8_t> data[3];
+
+    auto read_chunk = [&](size_t k) {
+        const merge_chunk & chunk = chunks[k];
+        struct ggml_tensor * tensor = ggml_get_tensor(ctx_in, gguf_get_tensor_name(gguf_in, chunk.itensor));
 
-        // write tensor data + padding
-        padding.clear();
-        padding.resize(GGML_PAD(data.size(), gguf_get_alignment(gguf_out)) - data.size(), 0);
+        const size_t row_size = ggml_row_size(tensor->type, tensor->ne[0]);
 
-        GGML_ASSERT(fout.tell() == offset + meta.size());
-        // fout.seek(offset + meta.size(), SEEK_SET);
-        fout.write_raw(data.data(), data.size());
-        fout.write_raw(padding.data(), padding.size());
+        data[k % 3].resize(chunk.nrows*row_size);
+        fin.seek(gguf_get_data_offset(gguf_in) + gguf_get_tensor_offset(gguf_in, chunk.itensor) + chunk.row0*row_size, SEEK_SET);
+        fin.read_raw(data[k % 3].data(), data[k % 3].size());
+    };
 
-        if (i % 2 == 0) {
+    auto write_chunk = [&](size_t k) {
+        const merge_chunk & chunk = chunks[k];
+        struct ggml_tensor * tensor = ggml_get_tensor(ctx_in, gguf_get_tensor_name(gguf_in, chunk.itensor));
+
+        const size_t row_size = ggml_row_size(tensor->type, tensor->ne[0]);
+
+        GGML_ASSERT(fout.tell() == meta.size() + gguf_get_tensor_offset(gguf_out, chunk.itensor) + chunk.row0*row_size);
+        fout.write_raw(data[k % 3].data(), data[k % 3].size());
+
+        // padding after the last chunk of the tensor
+        if (chunk.row0 + chunk.nrows == ggml_nrows(tensor)) {
+            std::vector<uint8_t> padding(GGML_PAD(ggml_nbytes(tensor), gguf_get_alignment(gguf_out)) - ggml_nbytes(tensor), 0);
+            fout.write_raw(padding.data(), padding.size());
+        }
+    };
+
+    std::future<void> read_next;
+    std::future<void> write_prev;
+
+    if (!chunks.empty()) {
+        read_next = std::async(std::launch::async, read_chunk, 0);
+    }
+
+    std::vector<struct lora_tensors> lora;
+    for (size_t k = 0; k < chunks.size(); ++k) {
+        const merge_chunk & chunk = chunks[k];
+        struct ggml_tensor * tensor = ggml_get_tensor(ctx_in, gguf_get_tensor_name(gguf_in, chunk.itensor));
+
+        read_next.get();
+        if (k + 1 < chunks.size()) {
+            read_next = std::async(std::launch::async, read_chunk, k + 1);
+        }
+
+        if (chunk.row0 == 0) {
+            lora = get_lora_tensors(ggml_get_name(tensor), loras);
+        }
+
+        // apply all loras to the rows of the chunk
+        if (!lora.empty()) {
+            struct ggml_tensor rows = *tensor;
+            rows.ne[1] = chunk.nrows;
+            rows.ne[2] = rows.ne[3] = 1;
+            rows.nb[2] = rows.nb[3] = chunk.nrows*rows.nb[1];
+            rows.data  = data[k % 3].data();
+
+            apply_lora(&rows, lora, chunk.row0, params->n_threads);
+        }
+
+        if (write_prev.valid()) {
+            write_prev.get();
+        }
+        write_prev = std::async(std::launch::async, write_chunk, k);
+
+        if (chunk.row0 + chunk.nrows == ggml_nrows(tensor) && chunk.itensor % 2 == 0) {
             printf(".");
         }
     }
+
+    if (write_prev.valid()) {
+        write_prev.get();
+    }
     printf("\n");
 
     // close gguf
@@ -143,6 +143,7 @@ struct cmd_params {
     int reps;
     bool verbose;
     output_formats output_format;
+    std::string profile;
 };
 
 static const cmd_params cmd_params_defaults = {
@@ -159,7 +160,8 @@ static const cmd_params cmd_params_defaults = {
     /* tensor_split  */ {{}},
     /* reps          */ 5,
     /* verbose       */ false,
-    /* output_format */ MARKDOWN
+    /* output_format */ MARKDOWN,
+    /* profile       */ ""
 };
 
 static void print_usage(int /* argc */, char ** argv) {
@@ -181,6 +183,8 @@ static void print_usage(int /* argc */, char ** argv) {
     printf("  -r, --repetitions <n>             (default: %d)\n", cmd_params_defaults.reps);
     printf("  -o, --output <csv|json|md|sql>    (default: %s)\n", cmd_params_defaults.output_format == CSV ? "csv" : cmd_params_defaults.output_format == JSON ? "json" : cmd_params_defaults.output_format == MARKDOWN ? "md" : "sql");
     printf("  -v, --verbose                     (default: %s)\n", cmd_params_defaults.verbose ? "1" : "0");
+    printf("  --profile <prefix>                write the compute times of the graph nodes of test i to <prefix>-i.json\n");
+    printf("                                    (Chrome trace) and their totals per op to <prefix>-i.csv (default: none)\n");
     printf("\n");
     printf("Multiple values can be given for each parameter by separating them with ',' or by specifying the parameter multiple times.\n");
 }
@@ -363,6 +367,12 @@ static cmd_params parse_cmd_params(int argc, char ** argv) {
             }
         } else if (arg == "-v" || arg == "--verbose") {
             params.verbose = true;
+        } else if (arg == "--profile") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            params.profile = argv[i];
         } else {
             invalid_param = true;
             break;
@@ -1083,7 +1093,9 @@ int main(int argc, char ** argv) {
     llama_model * lmodel = nullptr;
     const cmd_params_instance * prev_inst = nullptr;
 
-    for (const auto & inst : params_instances) {
+    for (size_t i_inst = 0; i_inst < params_instances.size(); i_inst++) {
+        const auto & inst = params_instances[i_inst];
+
         // keep the same model between tests when possible
         if (!lmodel || !prev_inst || !inst.equal_mparams(*prev_inst)) {
             if (lmodel) {
@@ -1098,7 +1110,10 @@ int main(int argc, char ** argv) {
             prev_inst = &inst;
         }
 
-        llama_context * ctx = llama_new_context_with_model(lmodel, inst.to_llama_cparams());
+        llama_context_params cparams = inst.to_llama_cparams();
+        cparams.profile = !params.profile.empty();
+
+        llama_context * ctx = llama_new_context_with_model(lmodel, cparams);
         if (ctx == NULL) {
             fprintf(stderr, "%s: error: failed to create context with model '%s'\n", __func__, inst.model.c_str());
             llama_free_model(lmodel);
@@ -1117,6 +1132,9 @@ int main(int argc, char ** argv) {
             test_gen(ctx, 1, 0, t.n_threads);
         }
 
+        // the warmup is not profiled
+        llama_reset_timings(ctx);
+
         for (int i = 0; i < params.reps; i++) {
             llama_kv_cache_clear(ctx);
 
@@ -1135,6 +1153,14 @@ int main(int argc, char ** argv) {
 
         llama_print_timings(ctx);
 
+        if (!params.profile.empty()) {
+            const std::string prefix = params.profile + "-" + std::to_string(i_inst);
+            if (!llama_profile_write_trace(ctx, (prefix + ".json").c_str()) ||
+                !llama_profile_write_ops  (ctx, (prefix + ".csv").c_str())) {
+                fprintf(stderr, "%s: error: failed to write the profile %s\n", __func__, prefix.c_str());
+            }
+        }
+
         llama_free(ctx);
     }
 
@@ -2,6 +2,7 @@
 // so there might be still unnecessary artifacts hanging around
 // I'll gradually clean and extend it
 
+#include <algorithm>
 #include <cassert>
 #include <cmath>
 #include <cstdlib>
@@ -11,11 +12,21 @@
 #include <map>
 #include <regex>
 #include <stdexcept>
+#include <thread>
 #include <vector>
 
 #include "clip.h"
 #include "ggml.h"
 #include "ggml-alloc.h"
+#include "ggml-backend.h"
+
+#ifdef GGML_USE_CUBLAS
+#include "ggml-cuda.h"
+#endif
+
+#ifdef GGML_USE_METAL
+#include "ggml-metal.h"
+#endif
 
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
@@ -222,10 +233,15 @@ struct clip_ctx {
     struct ggml_context * ctx;
     struct gguf_context * ctx_gguf;
 
+    // the weights are in a buffer of the backend, on the GPU when built with one
+    ggml_backend_t backend = NULL;
+    ggml_backend_buffer_t params_buffer = NULL;
+
     // memory buffers to evaluate the model
     clip_buffer buf_compute;
-    clip_buffer buf_alloc;
-    ggml_allocr * alloc = NULL;
+    ggml_backend_buffer_t compute_buffer = NULL;
+    ggml_allocr * compute_alloc = NULL;
+    int n_batch_alloc = 0; // largest batch of images that fits in compute_buffer
 };
 
 static ggml_cgraph * clip_image_build_graph(const clip_ctx * ctx, const clip_image_f32_batch * imgs) {
@@ -248,10 +264,7 @@ static ggml_cgraph * clip_image_build_graph(const clip_ctx * ctx, const clip_ima
     //const int n_intermediate = hparams.n_intermediate;
     //const int projection_dim = hparams.projection_dim;
     const float eps = hparams.eps;
-    int batch_size = imgs->size;
-    if(ctx->has_llava_projector) {
-        GGML_ASSERT(batch_size == 1);
-    }
+    const int batch_size = imgs->size;
 
     const auto & buf_compute = ctx->buf_compute;
 
@@ -267,28 +280,28 @@ static ggml_cgraph * clip_image_build_graph(const clip_ctx * ctx, const clip_ima
     struct ggml_cgraph * gf = ggml_new_graph(ctx0);
 
     struct ggml_tensor * inp_raw = ggml_new_tensor_4d(ctx0, GGML_TYPE_F32, image_size, image_size, 3, batch_size);
-    ggml_allocr_alloc(ctx->alloc, inp_raw);
+    ggml_allocr_alloc(ctx->compute_alloc, inp_raw);
 
-    if (!ggml_allocr_is_measure(ctx->alloc)) {
-        float * data = (float *)ggml_get_data(inp_raw);
+    if (!ggml_allocr_is_measure(ctx->compute_alloc)) {
+        std::vector<float> data(ggml_nelements(inp_raw));
 
-        for (size_t i = 0; i < imgs->size; i++) {
-            const int nx = imgs->data[i].nx;
-            const int ny = imgs->data[i].ny;
+        for (int b = 0; b < batch_size; b++) {
+            const int nx = imgs->data[b].nx;
+            const int ny = imgs->data[b].ny;
             GGML_ASSERT(nx == image_size && ny == image_size);
 
             const int n = nx * ny;
 
-            for (int b = 0; b < batch_size; b++) {
-                for (int k = 0; k < 3; k++) {
-                    for (int y = 0; y < ny; y++) {
-                        for (int x = 0; x < nx; x++) {
-                            data[(b * 3 * n) + k * n + y * nx + x] = imgs->data[b].data[3 * (y * nx + x) + k];
-                        }
+            for (int k = 0; k < 3; k++) {
+                for (int y = 0; y < ny; y++) {
+                    for (int x = 0; x < nx; x++) {
+                        data[(b * 3 * n) + k * n + y * nx + x] = imgs->data[b].data[3 * (y * nx + x) + k];
                     }
                 }
             }
         }
+
+        ggml_backend_tensor_set(inp_raw, data.data(), 0, ggml_nbytes(inp_raw));
     }
 
     struct ggml_tensor * inp = ggml_conv_2d(ctx0, model.patch_embeddings, inp_raw, patch_size, patch_size, 0, 0, 1, 1);
@@ -298,13 +311,14 @@ static ggml_cgraph * clip_image_build_graph(const clip_ctx * ctx, const clip_ima
 
     // concat class_embeddings and patch_embeddings
     struct ggml_tensor * embeddings = ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, hidden_size, num_positions, batch_size);
-    ggml_allocr_alloc(ctx->alloc, embeddings);
-    if (!ggml_allocr_is_measure(ctx->alloc)) {
-        ggml_set_zero(embeddings);
+    ggml_allocr_alloc(ctx->compute_alloc, embeddings);
+    if (!ggml_allocr_is_measure(ctx->compute_alloc)) {
+        std::vector<uint8_t> zeros(ggml_nbytes(embeddings), 0);
+        ggml_backend_tensor_set(embeddings, zeros.data(), 0, zeros.size());
     }
 
     struct ggml_tensor * temp = ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, hidden_size, 1, batch_size);
-    ggml_allocr_alloc(ctx->alloc, temp);
+    ggml_allocr_alloc(ctx->compute_alloc, temp);
 
     embeddings = ggml_acc(ctx0, embeddings, ggml_repeat(ctx0, model.class_embedding, temp), embeddings->nb[1],
                           embeddings->nb[2], embeddings->nb[3], 0);
@@ -312,11 +326,13 @@ static ggml_cgraph * clip_image_build_graph(const clip_ctx * ctx, const clip_ima
         ggml_acc(ctx0, embeddings, inp, embeddings->nb[1], embeddings->nb[2], embeddings->nb[3], model.class_embedding->nb[1]);
 
     struct ggml_tensor * positions = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, num_positions);
-    ggml_allocr_alloc(ctx->alloc, positions);
-    if (!ggml_allocr_is_measure(ctx->alloc)) {
+    ggml_allocr_alloc(ctx->compute_alloc, positions);
+    if (!ggml_allocr_is_measure(ctx->compute_alloc)) {
+        std::vector<int32_t> positions_data(num_positions);
         for (int i = 0; i < num_positions; i++) {
-            ggml_set_i32_1d(positions, i, i);
+            positions_data[i] = i;
         }
+        ggml_backend_tensor_set(positions, positions_data.data(), 0, ggml_nbytes(positions));
     }
 
     embeddings =
@@ -331,9 +347,10 @@ static ggml_cgraph * clip_image_build_graph(const clip_ctx * ctx, const clip_ima
     }
 
     struct ggml_tensor * KQ_scale = ggml_new_tensor_1d(ctx0, GGML_TYPE_F32, 1);
-    ggml_allocr_alloc(ctx->alloc, KQ_scale);
-    if (!ggml_allocr_is_measure(ctx->alloc)) {
-        ggml_set_f32(KQ_scale, 1.0f / sqrt((float)d_head));
+    ggml_allocr_alloc(ctx->compute_alloc, KQ_scale);
+    if (!ggml_allocr_is_measure(ctx->compute_alloc)) {
+        const float scale = 1.0f / sqrt((float)d_head);
+        ggml_backend_tensor_set(KQ_scale, &scale, 0, ggml_nbytes(KQ_scale));
     }
 
     // loop over layers
@@ -420,17 +437,10 @@ static ggml_cgraph * clip_image_build_graph(const clip_ctx * ctx, const clip_ima
 
     // llava projector
     {
-        embeddings = ggml_reshape_2d(ctx0, embeddings, embeddings->ne[0], embeddings->ne[1]);
-
-        struct ggml_tensor * patches = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, num_patches);
-        ggml_allocr_alloc(ctx->alloc, patches);
-        if (!ggml_allocr_is_measure(ctx->alloc)) {
-            for (int i = 0; i < num_patches; ++i) {
-                ggml_set_i32_1d(patches, i, i+1);
-            }
-        }
-
-        embeddings = ggml_get_rows(ctx0, embeddings, patches);
+        // the patches of each image, without the class embedding
+        embeddings = ggml_view_3d(ctx0, embeddings, embeddings->ne[0], num_patches, batch_size,
+                                  embeddings->nb[1], embeddings->nb[2], embeddings->nb[1]);
+        embeddings = ggml_cont(ctx0, embeddings);
 
         // mm projection 0
         embeddings = ggml_mul_mat(ctx0, model.mm_0_w, embeddings);
@@ -450,8 +460,44 @@ static ggml_cgraph * clip_image_build_graph(const clip_ctx * ctx, const clip_ima
     return gf;
 }
 
+// allocate the compute buffer for batches of up to n_batch images
+static bool clip_alloc_compute(clip_ctx * ctx, int n_batch) {
+    if (ctx->compute_alloc) {
+        ggml_allocr_free(ctx->compute_alloc);
+        ctx->compute_alloc = NULL;
+    }
+    if (ctx->compute_buffer) {
+        ggml_backend_buffer_free(ctx->compute_buffer);
+        ctx->compute_buffer = NULL;
+    }
+    ctx->n_batch_alloc = 0;
+
+    // the images are not read by the measure allocator, only their number
+    std::vector<clip_image_f32> imgs(n_batch);
+    clip_image_f32_batch batch;
+    batch.data = imgs.data();
+    batch.size = n_batch;
+
+    ctx->compute_alloc = ggml_allocr_new_measure_from_backend(ctx->backend);
+    ggml_cgraph * gf = clip_image_build_graph(ctx, &batch);
+    const size_t alloc_size = ggml_allocr_alloc_graph(ctx->compute_alloc, gf);
+    ggml_allocr_free(ctx->compute_alloc);
+
+    ctx->compute_buffer = ggml_backend_alloc_buffer(ctx->backend, alloc_size);
+    if (!ctx->compute_buffer) {
+        ctx->compute_alloc = NULL;
+        fprintf(stderr, "%s: failed to allocate %.2f MB for a batch of %d images\n", __func__, alloc_size/1024.0/1024.0, n_batch);
+        return false;
+    }
+    ctx->compute_alloc = ggml_allocr_new_from_buffer(ctx->compute_buffer);
+    ctx->n_batch_alloc = n_batch;
+
+    return true;
+}
+
 // read and create ggml_context containing the tensors and their data
-struct clip_ctx * clip_model_load(const char * fname, const int verbosity = 1) {
+// offload: keep the weights and compute the graph on the GPU backend, if there is one
+static struct clip_ctx * clip_model_load_internal(const char * fname, const int verbosity, bool offload) {
 
     struct ggml_context * meta = NULL;
 
@@ -550,17 +596,66 @@ struct clip_ctx * clip_model_load(const char * fname, const int verbosity = 1) {
         }
     }
 
+    new_clip->ctx_gguf = ctx;
+
+    // backend
+#ifdef GGML_USE_CUBLAS
+    if (offload) {
+        new_clip->backend = ggml_backend_cuda_init(0);
+        if (!new_clip->backend) {
+            fprintf(stderr, "%s: ggml_backend_cuda_init() failed, using the CPU\n", __func__);
+        }
+    }
+#endif
+
+#ifdef GGML_USE_METAL
+    if (offload) {
+        new_clip->backend = ggml_backend_metal_init();
+        if (!new_clip->backend) {
+            fprintf(stderr, "%s: ggml_backend_metal_init() failed, using the CPU\n", __func__);
+        }
+    }
+#endif
+
+    if (!new_clip->backend) {
+        new_clip->backend = ggml_backend_cpu_init();
+    }
+
+    (void) offload;
+
+    if (verbosity >= 1) {
+        printf("%s: backend:        %s\n", __func__, ggml_backend_name(new_clip->backend));
+    }
+
     // load tensors
     {
+        const int n_tensors = gguf_get_n_tensors(ctx);
+
         struct ggml_init_params params = {
-            /*.mem_size =*/ ctx_size,
+            /*.mem_size =*/ (n_tensors + 1)*ggml_tensor_overhead(),
             /*.mem_buffer =*/ NULL,
-            /*.no_alloc =*/ false,
+            /*.no_alloc =*/ true,
         };
 
         new_clip->ctx = ggml_init(params);
         if (!new_clip->ctx) {
             fprintf(stderr, "%s: ggml_init() failed\n", __func__);
+            ggml_free(meta);
+            clip_free(new_clip);
+            return nullptr;
+        }
+
+        for (int i = 0; i < n_tensors; ++i) {
+            const char * name = gguf_get_tensor_name(ctx, i);
+            struct ggml_tensor * t = ggml_get_tensor(meta, name);
+            struct ggml_tensor * cur = ggml_dup_tensor(new_clip->ctx, t);
+            ggml_set_name(cur, name);
+        }
+
+        new_clip->params_buffer = ggml_backend_alloc_ctx_tensors(new_clip->ctx, new_clip->backend);
+        if (!new_clip->params_buffer) {
+            fprintf(stderr, "%s: failed to allocate the buffer of the weights\n", __func__);
+            ggml_free(meta);
             clip_free(new_clip);
             return nullptr;
         }
@@ -568,26 +663,36 @@ struct clip_ctx * clip_model_load(const char * fname, const int verbosity = 1) {
         auto fin = std::ifstream(fname, std::ios::binary);
         if (!fin) {
             printf("cannot open model file for loading tensors\n");
+            ggml_free(meta);
             clip_free(new_clip);
             return nullptr;
         }
 
-        const int n_tensors = gguf_get_n_tensors(ctx);
+        // the weights in host memory are read in place, the others through a staging buffer
+        const bool host = ggml_backend_is_cpu(new_clip->backend);
+        std::vector<char> read_buf;
+
         for (int i = 0; i < n_tensors; ++i) {
             const char * name = gguf_get_tensor_name(ctx, i);
-            struct ggml_tensor * t = ggml_get_tensor(meta, name);
-            struct ggml_tensor * cur = ggml_dup_tensor(new_clip->ctx, t);
-            ggml_set_name(cur, name);
+            struct ggml_tensor * cur = ggml_get_tensor(new_clip->ctx, name);
 
             const size_t offset = gguf_get_data_offset(ctx) + gguf_get_tensor_offset(ctx, i);
             fin.seekg(offset, std::ios::beg);
             if (!fin) {
                 printf("%s: failed to seek for tensor %s\n", __func__, name);
+                ggml_free(meta);
                 clip_free(new_clip);
                 return nullptr;
             }
 
-            fin.read(reinterpret_cast<char *>(cur->data), ggml_nbytes(t));
+            const size_t nbytes = ggml_nbytes(cur);
+            if (host) {
+                fin.read(reinterpret_cast<char *>(cur->data), nbytes);
+            } else {
+                read_buf.resize(nbytes);
+                fin.read(read_buf.data(), nbytes);
+                ggml_backend_tensor_set(cur, read_buf.data(), 0, nbytes);
+            }
         }
 
         fin.close();
@@ -659,27 +764,28 @@ struct clip_ctx * clip_model_load(const char * fname, const int verbosity = 1) {
 
     ggml_free(meta);
 
-    new_clip->ctx_gguf = ctx;
-
 // measure mem requirement and allocate
     {
-        static const size_t tensor_alignment = 32;
         new_clip->buf_compute.resize(ggml_tensor_overhead()*GGML_DEFAULT_GRAPH_SIZE + ggml_graph_overhead());
-        new_clip->alloc = ggml_allocr_new_measure(tensor_alignment);
-        clip_image_f32_batch batch;
-        batch.size = 1;
-        ggml_cgraph * gf = clip_image_build_graph(new_clip, &batch);
-        size_t alloc_size = ggml_allocr_alloc_graph(new_clip->alloc, gf) + tensor_alignment;
-        ggml_allocr_free(new_clip->alloc);
-        new_clip->buf_alloc.resize(alloc_size);
-        new_clip->alloc = ggml_allocr_new(new_clip->buf_alloc.data, new_clip->buf_alloc.size, tensor_alignment);
-
-        printf("%s: total allocated memory: %.2f MB\n", __func__, (new_clip->buf_compute.size + alloc_size)/1024.0/1024.0);
+        if (!clip_alloc_compute(new_clip, 1)) {
+            clip_free(new_clip);
+            return nullptr;
+        }
+
+        const size_t params_size  = ggml_backend_buffer_get_size(new_clip->params_buffer);
+        const size_t compute_size = ggml_backend_buffer_get_size(new_clip->compute_buffer);
+        printf("%s: params backend buffer size = %.2f MB\n", __func__, params_size/1024.0/1024.0);
+        printf("%s: compute allocated memory: %.2f MB\n", __func__, compute_size/1024.0/1024.0);
+        printf("%s: total allocated memory: %.2f MB\n", __func__, (new_clip->buf_compute.size + params_size + compute_size)/1024.0/1024.0);
     }
 
     return new_clip;
 }
 
+struct clip_ctx * clip_model_load(const char * fname, const int verbosity = 1) {
+    return clip_model_load_internal(fname, verbosity, true);
+}
+
 clip_image_u8 * make_clip_image_u8() {
     auto img = new clip_image_u8();
     return img;
@@ -732,8 +838,9 @@ bool clip_image_preprocess(const clip_ctx * ctx, const clip_image_u8 * img, clip
     // the logic below is to pad the shorter side to the longer side with a background color: rgb(122, 116, 104)
     // see https://github.com/haotian-liu/LLaVA/blob/e854a2bf85118c504f6f16bf5c3c7c92f8fa8c6b/llava/conversation.py#L113-L156
 
-    clip_image_u8 * temp = make_clip_image_u8(); // we will keep the input image data here temporarily
+    clip_image_u8 * temp = NULL; // the padded input image, if any
     if (pad2square && img->nx != img->ny) {
+        temp = make_clip_image_u8();
         int longer_side = std::max(img->nx, img->ny);
         temp->nx = longer_side;
         temp->ny = longer_side;
@@ -748,24 +855,15 @@ bool clip_image_preprocess(const clip_ctx * ctx, const clip_image_u8 * img, clip
 
         // copy from the input image
         for (int y = 0; y < img->ny; y++) {
-            for (int x = 0; x < img->nx; x++) {
-                const int i = 3 * (y * img->nx + x);
-                const int j = 3 * (y * temp->nx + x);
-                temp->data[j] = img->data[i];
-                temp->data[j+1] = img->data[i+1];
-                temp->data[j+2] = img->data[i+2];
-            }
+            memcpy(&temp->data[3 * y * temp->nx], &img->data[3 * y * img->nx], 3 * img->nx);
         }
-    } else {
-        temp->nx   = img->nx;
-        temp->ny   = img->ny;
-        temp->size = img->size;
-        temp->data = new uint8_t[temp->size]();
-        memcpy(&temp->data[0], &img->data[0], temp->size); // copy
     }
 
-    const int nx = temp->nx;
-    const int ny = temp->ny;
+    // the input image is read in place when it is not padded
+    const clip_image_u8 * src = temp ? temp : img;
+
+    const int nx = src->nx;
+    const int ny = src->ny;
 
     const int nx2 = ctx->vision_model.hparams.image_size;
     const int ny2 = ctx->vision_model.hparams.image_size;
@@ -783,57 +881,114 @@ bool clip_image_preprocess(const clip_ctx * ctx, const clip_image_u8 * img, clip
     const auto & m3 = ctx->image_mean; // {0.48145466f, 0.4578275f, 0.40821073f};
     const auto & s3 = ctx->image_std;  // {0.26862954f, 0.26130258f, 0.27577711f};
 
+    // the source columns and rows of the linear interpolation are the same for all the rows and columns, resp.
+    std::vector<int>   xs0(nx3), xs1(nx3);
+    std::vector<float> dxs(nx3);
+    for (int x = 0; x < nx3; x++) {
+        const float sx = (x + 0.5f) * scale - 0.5f;
+        xs0[x] = std::max(0, (int)std::floor(sx));
+        xs1[x] = std::min(xs0[x] + 1, nx - 1);
+        dxs[x] = sx - xs0[x];
+    }
+
+    std::vector<int>   ys0(ny3), ys1(ny3);
+    std::vector<float> dys(ny3);
     for (int y = 0; y < ny3; y++) {
-        for (int x = 0; x < nx3; x++) {
-            for (int c = 0; c < 3; c++) {
-                // linear interpolation
-                const float sx = (x + 0.5f) * scale - 0.5f;
-                const float sy = (y + 0.5f) * scale - 0.5f;
+        const float sy = (y + 0.5f) * scale - 0.5f;
+        ys0[y] = std::max(0, (int)std::floor(sy));
+        ys1[y] = std::min(ys0[y] + 1, ny - 1);
+        dys[y] = sy - ys0[y];
+    }
 
-                const int x0 = std::max(0, (int)std::floor(sx));
-                const int y0 = std::max(0, (int)std::floor(sy));
+    // normalize: x = (x - mean) / std, for the 256 values of each channel
+    float norm[3][256];
+    for (int c = 0; c < 3; c++) {
+        for (int v = 0; v < 256; v++) {
+            norm[c][v] = ((float(v) / 255.0f) - m3[c]) / s3[c];
+        }
+    }
+
+    auto resize_rows = [&](int y_start, int y_end) {
+        for (int y = y_start; y < y_end; y++) {
+            const float dy = dys[y];
 
-                const int x1 = std::min(x0 + 1, nx - 1);
-                const int y1 = std::min(y0 + 1, ny - 1);
+            const uint8_t * row0 = src->data + 3 * ys0[y] * nx;
+            const uint8_t * row1 = src->data + 3 * ys1[y] * nx;
 
-                const float dx = sx - x0;
-                const float dy = sy - y0;
+            float * dst = res->data + 3 * y * nx3;
 
-                const int j00 = 3 * (y0 * nx + x0) + c;
-                const int j01 = 3 * (y0 * nx + x1) + c;
-                const int j10 = 3 * (y1 * nx + x0) + c;
-                const int j11 = 3 * (y1 * nx + x1) + c;
+            for (int x = 0; x < nx3; x++) {
+                const float dx = dxs[x];
 
-                const float v00 = temp->data[j00];
-                const float v01 = temp->data[j01];
-                const float v10 = temp->data[j10];
-                const float v11 = temp->data[j11];
+                const int j0 = 3 * xs0[x];
+                const int j1 = 3 * xs1[x];
 
-                const float v0 = v00 * (1.0f - dx) + v01 * dx;
-                const float v1 = v10 * (1.0f - dx) + v11 * dx;
+                for (int c = 0; c < 3; c++) {
+                    // linear interpolation
+                    const float v00 = row0[j0 + c];
+                    const float v01 = row0[j1 + c];
+                    const float v10 = row1[j0 + c];
+                    const float v11 = row1[j1 + c];
 
-                const float v = v0 * (1.0f - dy) + v1 * dy;
+                    const float v0 = v00 * (1.0f - dx) + v01 * dx;
+                    const float v1 = v10 * (1.0f - dx) + v11 * dx;
 
-                const uint8_t v2 = std::min(std::max(std::round(v), 0.0f), 255.0f);
+                    const float v = v0 * (1.0f - dy) + v1 * dy;
 
-                const int i = 3 * (y * nx3 + x) + c;
+                    const uint8_t v2 = std::min(std::max(std::round(v), 0.0f), 255.0f);
 
-                res->data[i] = ((float(v2) / 255.0f) - m3[c]) / s3[c];
+                    dst[3 * x + c] = norm[c][v2];
+                }
             }
         }
+    };
+
+    // the rows are split between the threads, the small images are resized by this thread only
+    static const int min_rows_per_thread = 32;
+    const int n_threads = std::max(1, std::min({ (int) std::thread::hardware_concurrency(), 8, ny3 / min_rows_per_thread }));
+
+    std::vector<std::thread> workers;
+    const int rows_per_thread = (ny3 + n_threads - 1) / n_threads;
+    for (int t = 1; t < n_threads; t++) {
+        const int y_start = t * rows_per_thread;
+        const int y_end   = std::min(ny3, y_start + rows_per_thread);
+        if (y_start < y_end) {
+            workers.emplace_back(resize_rows, y_start, y_end);
+        }
+    }
+    resize_rows(0, std::min(ny3, rows_per_thread));
+    for (auto & w : workers) {
+        w.join();
+    }
+
+    if (temp) {
+        clip_image_u8_free(temp);
     }
-    clip_image_u8_free(temp);
 
     return true;
 }
 
 void clip_free(clip_ctx * ctx) {
-    ggml_free(ctx->ctx);
+    if (ctx->compute_alloc) {
+        ggml_allocr_free(ctx->compute_alloc);
+    }
+    if (ctx->compute_buffer) {
+        ggml_backend_buffer_free(ctx->compute_buffer);
+    }
+    if (ctx->params_buffer) {
+        ggml_backend_buffer_free(ctx->params_buffer);
+    }
+    if (ctx->backend) {
+        ggml_backend_free(ctx->backend);
+    }
+    if (ctx->ctx) {
+        ggml_free(ctx->ctx);
+    }
     gguf_free(ctx->ctx_gguf);
     delete ctx;
 }
 
-bool clip_image_encode(const clip_ctx * ctx, const int n_threads, clip_image_f32 * img, float * vec) {
+bool clip_image_encode(struct clip_ctx * ctx, const int n_threads, clip_image_f32 * img, float * vec) {
     if (!ctx->has_vision_encoder) {
         printf("This gguf file seems to have no vision encoder\n");
         return false;
@@ -845,41 +1000,47 @@ bool clip_image_encode(const clip_ctx * ctx, const int n_threads, clip_image_f32
     return clip_image_batch_encode(ctx, n_threads, &imgs, vec);
 }
 
-bool clip_image_batch_encode(const clip_ctx * ctx, const int n_threads, const clip_image_f32_batch * imgs, float * vec) {
+bool clip_image_batch_encode(struct clip_ctx * ctx, const int n_threads, const clip_image_f32_batch * imgs, float * vec) {
 
     if (!ctx->has_vision_encoder) {
         printf("This gguf file seems to have no vision encoder\n");
         return false;
     }
 
-    int batch_size = imgs->size;
-    if(ctx->has_llava_projector) {
-        GGML_ASSERT(batch_size == 1); // TODO: support multiple images
+    const int batch_size = imgs->size;
+    if (batch_size <= 0) {
+        return true;
+    }
+
+    // the compute buffer grows to the largest batch seen so far
+    if (batch_size > ctx->n_batch_alloc && !clip_alloc_compute(ctx, batch_size)) {
+        return false;
     }
 
     // reset alloc buffer to clean the memory from previous invocations
-    ggml_allocr_reset(ctx->alloc);
+    ggml_allocr_reset(ctx->compute_alloc);
 
     // build the inference graph
     ggml_cgraph * gf = clip_image_build_graph(ctx, imgs);
-    ggml_allocr_alloc_graph(ctx->alloc, gf);
+    ggml_allocr_alloc_graph(ctx->compute_alloc, gf);
 
-    struct ggml_cplan plan = ggml_graph_plan(gf, n_threads);
-    if (plan.work_size > 0) {
-        plan.work_data = (uint8_t *)malloc(plan.work_size);
+    if (ggml_backend_is_cpu(ctx->backend)) {
+        ggml_backend_cpu_set_n_threads(ctx->backend, n_threads);
     }
 
-    ggml_graph_compute(gf, &plan);
+#ifdef GGML_USE_METAL
+    if (ggml_backend_is_metal(ctx->backend)) {
+        ggml_backend_metal_set_n_cb(ctx->backend, n_threads);
+    }
+#endif
 
-    // the last node is the embedding tensor
-struct ggml_tensor * embeddings = gf->nodes[gf->n_nodes - 1];
+    ggml_backend_graph_compute(ctx->backend, gf);
 
-    // copy the embeddings to the location passed by the user
-    memcpy(vec, ggml_get_data_f32(embeddings), ggml_nbytes(embeddings));
+    // the last node is the embedding tensor, the embeddings of the images one after the other
+    struct ggml_tensor * embeddings = gf->nodes[gf->n_nodes - 1];
 
-    if (plan.work_size > 0) {
-        free(plan.work_data);
-    }
+    // copy the embeddings to the location passed by the user
+    ggml_backend_tensor_get(embeddings, vec, 0, ggml_nbytes(embeddings));
 
     return true;
 }
@@ -909,7 +1070,8 @@ bool clip_model_quantize(const char * fname_inp, const char * fname_out, const i
         return false;
     };
 
-    auto ctx_clip = clip_model_load(fname_inp, 2);
+    // the weights are read from host memory
+    auto ctx_clip = clip_model_load_internal(fname_inp, 2, false);
     const auto & ctx_src = ctx_clip->ctx_gguf;
     const auto & ctx_data = ctx_clip->ctx;
 
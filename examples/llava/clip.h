@@ -80,9 +80,10 @@ CLIP_API bool clip_image_load_from_file(const char * fname, struct clip_image_u8
 CLIP_API bool clip_image_load_from_bytes(const unsigned char * bytes, size_t bytes_length, struct clip_image_u8 * img);
 
 bool clip_image_preprocess(const struct clip_ctx * ctx, const struct clip_image_u8 * img, struct clip_image_f32 * res, const bool pad2square);
-bool clip_image_encode(const struct clip_ctx * ctx, const int n_threads, struct clip_image_f32 * img, float * vec);
+bool clip_image_encode(struct clip_ctx * ctx, const int n_threads, struct clip_image_f32 * img, float * vec);
 
-bool clip_image_batch_encode(const struct clip_ctx * ctx, const int n_threads, const struct clip_image_f32_batch * imgs,
+/** encode imgs->size images in a single graph, vec receives the embeddings of the images one after the other */
+bool clip_image_batch_encode(struct clip_ctx * ctx, const int n_threads, const struct clip_image_f32_batch * imgs,
                              float * vec);
 
 bool clip_model_quantize(const char * fname_inp, const char * fname_out, const int itype);
@@ -1,4 +1,5 @@
 #include "common.h"
+#include "speculative.h"
 #include "llama.h"
 
 #include <cmath>
@@ -16,24 +17,6 @@ struct ngram_data {
     std::vector<llama_token> tokens;
 };
 
-// n-gram container
-struct ngram_container {
-    ngram_container(int n_vocab, int N, int G) {
-        cnt.resize(n_vocab);
-        head.resize(n_vocab);
-        tokens.resize(n_vocab * G * (N - 1));
-    }
-
-    int n_total = 0;
-
-    std::vector<int> cnt;
-    std::vector<int> head;
-
-    // [n_vocab][G][N - 1]
-    // for each token of the vocab, keep a ring-buffer of capacity G of n-grams of size N - 1
-    std::vector<llama_token> tokens;
-};
-
 int main(int argc, char ** argv) {
     gpt_params params;
 
@@ -150,8 +133,26 @@ int main(int argc, char ** argv) {
         seq_id_all[i] = i;
     }
 
-    // here we keep adding new n-grams as we go
-    ngram_container ngrams_observed(llama_n_vocab(model), N, G);
+    // here we keep adding new n-grams as we go, after the ones of the previous runs
+    llama_ngram_pool ngrams_observed;
+    ngrams_observed.init(llama_n_vocab(model), N, G);
+
+    if (!params.path_ngram_pool.empty()) {
+        // fopen to check for an existing pool
+        FILE * fp = std::fopen(params.path_ngram_pool.c_str(), "rb");
+        if (fp != NULL) {
+            std::fclose(fp);
+
+            if (!ngrams_observed.load(params.path_ngram_pool)) {
+                LOG_TEE("%s: error: failed to load the n-gram pool '%s'\n", __func__, params.path_ngram_pool.c_str());
+                return 1;
+            }
+
+            LOG_TEE("%s: loaded %lld n-grams from '%s'\n", __func__, (long long) ngrams_observed.n_total.load(), params.path_ngram_pool.c_str());
+        } else {
+            LOG_TEE("%s: n-gram pool file does not exist, will create\n", __func__);
+        }
+    }
 
     // debug
     struct llama_kv_cache_view kvc_view = llama_kv_cache_view_init(ctx, W + G + 1);
@@ -212,7 +213,7 @@ int main(int argc, char ** argv) {
 
             // verification n-grams - queue this before the lookahead tokens for less KV cache fragmentation
             {
-                const int g_cur = ngrams_observed.cnt[id];
+                const int g_cur = ngrams_observed.count(id);
 
                 ngrams_cur.resize(g_cur);
                 for (int g = 0; g < g_cur; g++) {
@@ -222,15 +223,14 @@ int main(int argc, char ** argv) {
                     ngrams_cur[g].seq_id = W + 1 + g;
                     ngrams_cur[g].i_batch[0] = 0;
                     ngrams_cur[g].tokens [0] = id;
+
+                    ngrams_observed.get(id, g, ngrams_cur[g].tokens.data() + 1);
                 }
 
                 for (int j = 0; j < N - 1; j++) {
                     for (int g = 0; g < g_cur; g++) {
-                        const int idx = id*(N - 1)*G + g*(N - 1);
+                        const llama_token t = ngrams_cur[g].tokens[j + 1];
 
-                        const llama_token t = ngrams_observed.tokens[idx + j];
-
-                        ngrams_cur[g].tokens [j + 1] = t;
                         ngrams_cur[g].i_batch[j + 1] = batch.n_tokens;
 
                         llama_batch_add(batch, t, n_past + j + 1, { W + 1 + g }, true);
@@ -330,17 +330,18 @@ int main(int argc, char ** argv) {
 
             // print known n-grams starting with token id (debug)
             if (0 && v == 0) {
-                if (ngrams_observed.cnt[id] > 0) {
-                    printf("\n - %d n-grams starting with '%s'\n", ngrams_observed.cnt[id], llama_token_to_piece(ctx, id).c_str());
+                if (ngrams_observed.count(id) > 0) {
+                    printf("\n - %d n-grams starting with '%s'\n", ngrams_observed.count(id), llama_token_to_piece(ctx, id).c_str());
                 }
 
-                for (int i = 0; i < ngrams_observed.cnt[id]; i++) {
+                std::vector<llama_token> ngram(N - 1);
+                for (int i = 0; i < ngrams_observed.count(id); i++) {
                     printf("   - ngram %2d: ", i);
 
-                    const int idx = id*(N - 1)*G + i*(N - 1);
+                    ngrams_observed.get(id, i, ngram.data());
 
                     for (int j = 0; j < N - 1; j++) {
-                        const std::string token_str = llama_token_to_piece(ctx, ngrams_observed.tokens[idx + j]);
+                        const std::string token_str = llama_token_to_piece(ctx, ngram[j]);
 
                         printf("%s", token_str.c_str());
                     }
@@ -392,43 +393,8 @@ int main(int argc, char ** argv) {
                         ngram[j] = tokens_j[j][f];
                     }
 
-                    // filter-out repeating n-grams
-                    {
-                        bool is_unique = true;
-
-                        for (int k = 0; k < ngrams_observed.cnt[ft]; ++k) {
-                            const int idx = ft*(N - 1)*G + k*(N - 1);
-
-                            bool is_match = true;
-                            for (int j = 0; j < N - 1; ++j) {
-                                if (ngrams_observed.tokens[idx + j] != ngram[j]) {
-                                    is_match = false;
-                                    break;
-                                }
-                            }
-
-                            if (is_match) {
-                                is_unique = false;
-                                break;
-                            }
-                        }
-
-                        if (!is_unique) {
-                            continue;
-                        }
-                    }
-
-                    const int head = ngrams_observed.head[ft];
-                    const int idx  = ft*(N - 1)*G + head*(N - 1);
-
-                    for (int i = 0; i < N - 1; i++) {
-                        ngrams_observed.tokens[idx + i] = ngram[i];
-                    }
-
-                    ngrams_observed.cnt[ft]  = std::min(G, ngrams_observed.cnt[ft] + 1);
-                    ngrams_observed.head[ft] = (head + 1) % G;
-
-                    ngrams_observed.n_total++;
+                    // repeating n-grams are filtered-out
+                    ngrams_observed.insert(ft, ngram.data());
                 }
             }
         }
@@ -456,6 +422,12 @@ int main(int argc, char ** argv) {
 
     auto t_dec_end = ggml_time_us();
 
+    if (!params.path_ngram_pool.empty()) {
+        if (!ngrams_observed.save(params.path_ngram_pool)) {
+            LOG_TEE("%s: error: failed to save the n-gram pool '%s'\n", __func__, params.path_ngram_pool.c_str());
+        }
+    }
+
     LOG_TEE("\n\n");
 
     LOG_TEE("encoded %4d tokens in %8.3f seconds, speed: %8.3f t/s\n", n_input,   (t_enc_end - t_enc_start) / 1e6f, inp.size() / ((t_enc_end - t_enc_start) / 1e6f));
@@ -6,6 +6,7 @@
 #include <cassert>
 #include <cinttypes>
 #include <cmath>
+#include <csignal>
 #include <cstdio>
 #include <cstring>
 #include <ctime>
@@ -31,14 +32,11 @@
 #pragma warning(disable: 4244 4267) // possible loss of data
 #endif
 
-static llama_context           ** g_ctx;
-static llama_model             ** g_model;
-static gpt_params               * g_params;
-static std::vector<llama_token> * g_input_tokens;
-static std::ostringstream       * g_output_ss;
-static std::vector<llama_token> * g_output_tokens;
 static bool is_interacting = false;
 
+// set by the second Ctrl+C, the main loop then stops and the program exits with the code 130
+static volatile sig_atomic_t is_terminated = 0;
+
 
 static void write_logfile(
     const llama_context * ctx, const gpt_params & params, const llama_model * model,
@@ -84,17 +82,27 @@ static void write_logfile(
     fclose(logfile);
 }
 
+static void write_profile(llama_context * ctx, const gpt_params & params) {
+    if (params.path_profile.empty()) {
+        return;
+    }
+
+    const std::string path_trace = params.path_profile + ".json";
+    const std::string path_ops   = params.path_profile + ".csv";
+
+    if (llama_profile_write_trace(ctx, path_trace.c_str()) && llama_profile_write_ops(ctx, path_ops.c_str())) {
+        fprintf(stderr, "%s: wrote the profile to %s and %s\n", __func__, path_trace.c_str(), path_ops.c_str());
+    }
+}
+
 #if defined (__unix__) || (defined (__APPLE__) && defined (__MACH__)) || defined (_WIN32)
 static void sigint_handler(int signo) {
     if (signo == SIGINT) {
         if (!is_interacting) {
             is_interacting = true;
         } else {
-            console::cleanup();
-            printf("\n");
-            llama_print_timings(*g_ctx);
-            write_logfile(*g_ctx, *g_params, *g_model, *g_input_tokens, g_output_ss->str(), *g_output_tokens);
-            _exit(130);
+            // the trace writer is joined and the files are written by the main thread, which may hold their locks
+            is_terminated = 1;
         }
     }
 }
@@ -108,7 +116,6 @@ static void llama_log_callback_logTee(ggml_log_level level, const char * text, v
 
 int main(int argc, char ** argv) {
     gpt_params params;
-    g_params = &params;
 
     if (!gpt_params_parse(argc, argv, params)) {
         return 1;
@@ -173,22 +180,27 @@ int main(int argc, char ** argv) {
         params.prompt = gpt_random_prompt(rng);
     }
 
+    if (!llama_trace_start(params.trace)) {
+        return 1;
+    }
+
     LOG("%s: llama backend init\n", __func__);
     llama_backend_init(params.numa);
 
     llama_model * model;
     llama_context * ctx;
-    llama_context * ctx_guidance = NULL;
-    g_model = &model;
-    g_ctx = &ctx;
+
+    // with classifier-free guidance, the negative prompt is evaluated as sequence 1 of the context, in the same
+    // batches as the prompt and the generated tokens; the KV cache holds n_ctx cells for each sequence
+    const bool use_guidance = sparams.cfg_scale > 1.f;
+    if (use_guidance) {
+        params.n_ctx  *= 2;
+        params.n_batch = std::max(params.n_batch, 2);
+    }
 
     // load the model and apply lora adapter, if any
     LOG("%s: load the model and apply lora adapter, if any\n", __func__);
     std::tie(model, ctx) = llama_init_from_gpt_params(params);
-    if (sparams.cfg_scale > 1.f) {
-        struct llama_context_params lparams = llama_context_params_from_gpt_params(params);
-        ctx_guidance = llama_new_context_with_model(model, lparams);
-    }
 
     if (model == NULL) {
         LOG_TEE("%s: error: unable to load model\n", __func__);
@@ -196,7 +208,7 @@ int main(int argc, char ** argv) {
     }
 
     const int n_ctx_train = llama_n_ctx_train(model);
-    const int n_ctx = llama_n_ctx(ctx);
+    const int n_ctx = llama_n_ctx(ctx) / (use_guidance ? 2 : 1);
     LOG("n_ctx: %d\n", n_ctx);
 
     if (n_ctx > n_ctx_train) {
@@ -255,7 +267,8 @@ int main(int argc, char ** argv) {
     if (params.chatml) {
         sparams.prelude = "<|im_start|>system\n" + params.prompt;
     }
-    size_t prelude_len = ::llama_tokenize(ctx, sparams.prelude, add_bos, true).size();
+    const std::vector<llama_token> prelude_tokens = ::llama_tokenize(ctx, sparams.prelude, add_bos, true);
+    size_t prelude_len = prelude_tokens.size();
 
     LOG("prompt: \"%s\"\n", log_tostr(params.prompt));
     LOG("tokens: %s\n", LOG_TOKENS_TOSTR_PRETTY(ctx, embd_inp).c_str());
@@ -270,11 +283,11 @@ int main(int argc, char ** argv) {
     std::vector<llama_token> guidance_inp;
     int guidance_offset = 0;
     int original_prompt_len = 0;
-    if (ctx_guidance) {
+    if (use_guidance) {
         LOG("cfg_negative_prompt: \"%s\"\n", log_tostr(sparams.cfg_negative_prompt));
 
-        guidance_inp = ::llama_tokenize(ctx_guidance, sparams.cfg_negative_prompt, add_bos, true);
-        LOG("guidance_inp tokenized: %s\n", LOG_TOKENS_TOSTR_PRETTY(ctx_guidance, guidance_inp).c_str());
+        guidance_inp = ::llama_tokenize(ctx, sparams.cfg_negative_prompt, add_bos, true);
+        LOG("guidance_inp tokenized: %s\n", LOG_TOKENS_TOSTR_PRETTY(ctx, guidance_inp).c_str());
 
         std::vector<llama_token> original_inp = ::llama_tokenize(ctx, params.prompt, add_bos, true);
         LOG("original_inp tokenized: %s\n", LOG_TOKENS_TOSTR_PRETTY(ctx, original_inp).c_str());
@@ -290,6 +303,51 @@ int main(int argc, char ** argv) {
         return 1;
     }
 
+    // the eval state of the prelude is shared by the runs with a different program, it is loaded when no prompt
+    // cache was, and saved as soon as the prelude is evaluated otherwise
+    std::string path_prelude;
+    size_t      n_prelude_cached = 0;
+
+    if (!params.path_prelude_cache.empty() && session_tokens.empty()) {
+        // the tokens of the prelude may merge with the ones of the program
+        while (n_prelude_cached < prelude_len && n_prelude_cached < embd_inp.size() &&
+               prelude_tokens[n_prelude_cached] == embd_inp[n_prelude_cached]) {
+            n_prelude_cached++;
+        }
+
+        if (n_prelude_cached > 0) {
+            const std::vector<llama_token> cached_tokens(embd_inp.begin(), embd_inp.begin() + n_prelude_cached);
+            path_prelude = llama_prelude_cache_path(params, ctx, cached_tokens);
+
+            FILE * fp = std::fopen(path_prelude.c_str(), "rb");
+            if (fp != NULL) {
+                std::fclose(fp);
+
+                session_tokens.resize(n_ctx);
+                size_t n_token_count_out = 0;
+                if (!llama_load_session_file(ctx, path_prelude.c_str(), session_tokens.data(), session_tokens.capacity(), &n_token_count_out)) {
+                    LOG_TEE("%s: error: failed to load prelude cache '%s'\n", __func__, path_prelude.c_str());
+                    return 1;
+                }
+                session_tokens.resize(n_token_count_out);
+                llama_set_rng_seed(ctx, params.seed);
+
+                LOG_TEE("%s: loaded the prelude (%zu tokens) from '%s'\n", __func__, session_tokens.size(), path_prelude.c_str());
+
+                path_prelude.clear();
+            } else if (params.prompt_cache_ro || !create_directory_with_parents(params.path_prelude_cache)) {
+                path_prelude.clear();
+            } else {
+                LOG_TEE("%s: prelude cache '%s' does not exist, will create\n", __func__, path_prelude.c_str());
+            }
+        }
+    }
+
+    // the guidance sequence is evaluated again from the negative prompt
+    if (use_guidance && !session_tokens.empty()) {
+        llama_kv_cache_seq_rm(ctx, 1, -1, -1);
+    }
+
     // debug message about similarity of saved session, if applicable
     size_t n_matching_session_tokens = 0;
     if (!session_tokens.empty()) {
@@ -370,7 +428,7 @@ int main(int argc, char ** argv) {
             LOG_TEE("%6d -> '%s'\n", embd_inp[i], llama_token_to_piece(ctx, embd_inp[i]).c_str());
         }
 
-        if (ctx_guidance) {
+        if (use_guidance) {
             LOG_TEE("\n");
             LOG_TEE("%s: negative prompt: '%s'\n", __func__, sparams.cfg_negative_prompt.c_str());
             LOG_TEE("%s: number of tokens in negative prompt = %zu\n", __func__, guidance_inp.size());
@@ -475,9 +533,18 @@ int main(int argc, char ** argv) {
     int n_session_consumed = 0;
     int n_past_guidance    = 0;
 
-    std::vector<int>   input_tokens;  g_input_tokens  = &input_tokens;
-    std::vector<int>   output_tokens; g_output_tokens = &output_tokens;
-    std::ostringstream output_ss;     g_output_ss     = &output_ss;
+    // with guidance, the rows of the logits of both sequences in the last batch
+    int i_logits          = 0;
+    int i_logits_guidance = -1;
+
+    llama_batch batch = {};
+    if (use_guidance) {
+        batch = llama_batch_init(params.n_batch, 0, 1);
+    }
+
+    std::vector<int>   input_tokens;
+    std::vector<int>   output_tokens;
+    std::ostringstream output_ss;
 
     // the first thing we will do is to output the prompt, so set color accordingly
     console::set_display(console::prompt);
@@ -486,10 +553,14 @@ int main(int argc, char ** argv) {
     std::vector<llama_token> embd_guidance;
 
     struct llama_sampling_context * ctx_sampling = llama_sampling_init(sparams);
+    if (ctx_sampling == NULL) {
+        LOG_TEE("%s: error: failed to initialize the sampling context\n", __func__);
+        return 1;
+    }
 
     llama_sampling_set_prelude_len(ctx_sampling, prelude_len);
 
-    while ((n_remain != 0 && !is_antiprompt) || params.interactive) {
+    while (((n_remain != 0 && !is_antiprompt) || params.interactive) && !is_terminated) {
         // predict
         if (!embd.empty()) {
             // Note: n_ctx - 4 here is to match the logic for commandline prompt handling via
@@ -510,7 +581,8 @@ int main(int argc, char ** argv) {
             // infinite text generation via context swapping
             // if we run out of context:
             // - take the n_keep first tokens from the original prompt (via n_past)
-            // - take half of the last (n_ctx - n_keep) tokens and recompute the logits in batches
+            // - discard n_discard tokens after them (half of the last (n_ctx - n_keep) tokens by default) and shift the rest
+            //   small values of n_discard give a rolling window, which shifts often but only a few cells at a time
             if (n_past + (int) embd.size() + std::max<int>(0, guidance_offset) > n_ctx) {
                 if (params.n_predict == -2) {
                     LOG_TEE("\n\n%s: context full and n_predict == -%d => stopping\n", __func__, params.n_predict);
@@ -518,7 +590,8 @@ int main(int argc, char ** argv) {
                 }
 
                 const int n_left    = n_past - params.n_keep - 1;
-                const int n_discard = n_left/2;
+                const int n_needed  = n_past + (int) embd.size() + std::max<int>(0, guidance_offset) - n_ctx;
+                const int n_discard = params.n_discard < 0 ? n_left/2 : std::min(n_left, std::max(n_needed, params.n_discard));
 
                 LOG("context full, swapping: n_past = %d, n_left = %d, n_ctx = %d, n_keep = %d, n_discard = %d\n",
                     n_past, n_left, n_ctx, params.n_keep, n_discard);
@@ -528,8 +601,15 @@ int main(int argc, char ** argv) {
 
                 n_past -= n_discard;
 
-                if (ctx_guidance) {
-                    n_past_guidance -= n_discard;
+                if (use_guidance) {
+                    // the tokens after the prompt are shifted by guidance_offset in the guidance sequence
+                    const int n_keep_guidance    = params.n_keep + 1 + (params.n_keep + 1 >= original_prompt_len ? guidance_offset : 0);
+                    const int n_discard_guidance = std::max(0, std::min(n_discard, n_past_guidance - n_keep_guidance));
+
+                    llama_kv_cache_seq_rm   (ctx, 1, n_keep_guidance                     , n_keep_guidance + n_discard_guidance);
+                    llama_kv_cache_seq_shift(ctx, 1, n_keep_guidance + n_discard_guidance, n_past_guidance, -n_discard_guidance);
+
+                    n_past_guidance -= n_discard_guidance;
                 }
 
                 LOG("after swap: n_past = %d, n_past_guidance = %d\n", n_past, n_past_guidance);
@@ -564,51 +644,85 @@ int main(int argc, char ** argv) {
 
             // evaluate tokens in batches
             // embd is typically prepared beforehand to fit within a batch, but not always
-            if (ctx_guidance) {
-                int input_size = 0;
-                llama_token * input_buf = NULL;
-
+            if (use_guidance) {
                 if (n_past_guidance < (int) guidance_inp.size()) {
-                    // Guidance context should have the same data with these modifications:
+                    // Guidance sequence should have the same data with these modifications:
                     //
                     // * Replace the initial prompt
                     // * Shift everything by guidance_offset
-                    embd_guidance = guidance_inp;
-                    if (embd.begin() + original_prompt_len < embd.end()) {
-                        embd_guidance.insert(
-                            embd_guidance.end(),
-                            embd.begin() + original_prompt_len,
-                            embd.end()
-                        );
-                    }
+                    //
+                    // the prompt may span several batches, the guidance sequence starts with the one that ends it
+                    const int n_prompt_left = std::max(0, original_prompt_len - n_past);
 
-                    input_buf  = embd_guidance.data();
-                    input_size = embd_guidance.size();
+                    embd_guidance.clear();
+                    if (n_prompt_left <= (int) embd.size()) {
+                        embd_guidance = guidance_inp;
+                        embd_guidance.insert(embd_guidance.end(), embd.begin() + n_prompt_left, embd.end());
 
-                    LOG("guidance context: %s\n", LOG_TOKENS_TOSTR_PRETTY(ctx, embd_guidance).c_str());
+                        LOG("guidance sequence: %s\n", LOG_TOKENS_TOSTR_PRETTY(ctx, embd_guidance).c_str());
+                    }
                 } else {
-                    input_buf  = embd.data();
-                    input_size = embd.size();
+                    embd_guidance = embd;
                 }
 
-                for (int i = 0; i < input_size; i += params.n_batch) {
-                    int n_eval = std::min(input_size - i, params.n_batch);
-                    if (llama_decode(ctx_guidance, llama_batch_get_one(input_buf + i, n_eval, n_past_guidance, 0))) {
+                // the tokens of both sequences fill the batches, the last token of each is held back for the last
+                // batch, which gives the logits of both
+                const int n_main  = (int) embd.size();
+                const int n_guide = (int) embd_guidance.size();
+                const int n_total = n_main + n_guide;
+                const int n_held  = n_guide > 0 ? 2 : 1;
+
+                i_logits_guidance = -1;
+
+                auto add_token = [&](int k) {
+                    if (k < n_main - 1) {
+                        llama_batch_add(batch, embd[k], n_past + k, { 0 }, false);
+                    } else if (k < n_total - n_held) {
+                        const int j = k - (n_main - 1);
+                        llama_batch_add(batch, embd_guidance[j], n_past_guidance + j, { 1 }, false);
+                    } else if (k == n_total - n_held) {
+                        i_logits = batch.n_tokens;
+                        llama_batch_add(batch, embd.back(), n_past + n_main - 1, { 0 }, true);
+                    } else {
+                        i_logits_guidance = batch.n_tokens;
+                        llama_batch_add(batch, embd_guidance.back(), n_past_guidance + n_guide - 1, { 1 }, true);
+                    }
+                };
+
+                LOG_DBG("eval: %s\n", LOG_TOKENS_TOSTR_PRETTY(ctx, embd).c_str());
+
+                for (int i = 0; i < n_total; ) {
+                    int n_eval = std::min(n_total - i, params.n_batch);
+                    if (n_held == 2 && n_total - (i + n_eval) == 1) {
+                        n_eval--;
+                    }
+
+                    llama_batch_clear(batch);
+                    for (int k = i; k < i + n_eval; ++k) {
+                        add_token(k);
+                    }
+
+                    if (llama_decode(ctx, batch)) {
                         LOG_TEE("%s : failed to eval\n", __func__);
                         return 1;
                     }
 
-                    n_past_guidance += n_eval;
+                    i += n_eval;
                 }
+
+                n_past          += n_main;
+                n_past_guidance += n_guide;
+
+                LOG_DBG("n_past = %d, n_past_guidance = %d\n", n_past, n_past_guidance);
             }
 
-            for (int i = 0; i < (int) embd.size(); i += params.n_batch) {
+            for (int i = 0; i < (int) embd.size() && !use_guidance; i += params.n_batch) {
                 int n_eval = (int) embd.size() - i;
                 if (n_eval > params.n_batch) {
                     n_eval = params.n_batch;
                 }
 
-                LOG("eval: %s\n", LOG_TOKENS_TOSTR_PRETTY(ctx, embd).c_str());
+                LOG_DBG("eval: %s\n", LOG_TOKENS_TOSTR_PRETTY(ctx, embd).c_str());
 
                 if (llama_decode(ctx, llama_batch_get_one(&embd[i], n_eval, n_past, 0))) {
                     LOG_TEE("%s : failed to eval\n", __func__);
@@ -617,18 +731,28 @@ int main(int argc, char ** argv) {
 
                 n_past += n_eval;
 
-                LOG("n_past = %d\n", n_past);
+                LOG_DBG("n_past = %d\n", n_past);
             }
 
             if (!embd.empty() && !path_session.empty()) {
                 session_tokens.insert(session_tokens.end(), embd.begin(), embd.end());
                 n_session_consumed = session_tokens.size();
             }
+
+            if (!path_prelude.empty() && n_past == (int) n_prelude_cached) {
+                llama_save_session_file(ctx, path_prelude.c_str(), embd_inp.data(), n_prelude_cached);
+
+                LOG("saved the prelude to %s\n", path_prelude.c_str());
+                path_prelude.clear();
+            }
         }
 
         embd.clear();
         embd_guidance.clear();
 
+        // number of tokens forced by the grammar after the sampled one
+        int n_forced = 0;
+
         if ((int) embd_inp.size() <= n_consumed && !is_interacting) {
             // optionally save the session on first sample (for faster prompt loading next time)
             if (!path_session.empty() && need_to_save_session && !params.prompt_cache_ro) {
@@ -638,11 +762,16 @@ int main(int argc, char ** argv) {
                 LOG("saved session to %s\n", path_session.c_str());
             }
 
-            const llama_token id = llama_sampling_sample(ctx_sampling, ctx, ctx_guidance);
+            const llama_token id = llama_sampling_sample(ctx_sampling, ctx, NULL, i_logits, i_logits_guidance);
+
+            if (ctx_sampling->stop_reason != LLAMA_SAMPLING_STOP_NONE) {
+                LOG("stopped: %s\n", llama_sampling_stop_reason_str(ctx_sampling->stop_reason));
+                break;
+            }
 
             llama_sampling_accept(ctx_sampling, ctx, id, true);
 
-            LOG("last: %s\n", LOG_TOKENS_TOSTR_PRETTY(ctx, ctx_sampling->prev).c_str());
+            LOG_DBG("last: %s\n", LOG_TOKENS_TOSTR_PRETTY(ctx, ctx_sampling->prev).c_str());
 
             embd.push_back(id);
 
@@ -652,10 +781,23 @@ int main(int argc, char ** argv) {
             // decrement remaining sampling budget
             --n_remain;
 
-            LOG("n_remain: %d\n", n_remain);
+            // the tokens forced by the grammar are decoded in the same batch as the sampled one
+            if (n_remain != 0) {
+                const int n_max = n_remain < 0 ? params.n_batch - 1 : std::min(n_remain, params.n_batch - 1);
+                for (const llama_token id_forced : llama_sampling_jump_forward(ctx_sampling, ctx, n_max)) {
+                    embd.push_back(id_forced);
+                    ++n_forced;
+                    --n_remain;
+                }
+                if (n_forced > 0) {
+                    LOG_DBG("jump forward: %s\n", LOG_TOKENS_TOSTR_PRETTY(ctx, embd).c_str());
+                }
+            }
+
+            LOG_DBG("n_remain: %d\n", n_remain);
         } else {
             // some user input remains from prompt or interaction, forward it to processing
-            LOG("embd_inp.size(): %d, n_consumed: %d\n", (int) embd_inp.size(), n_consumed);
+            LOG_DBG("embd_inp.size(): %d, n_consumed: %d\n", (int) embd_inp.size(), n_consumed);
             while ((int) embd_inp.size() > n_consumed) {
                 embd.push_back(embd_inp[n_consumed]);
 
@@ -667,6 +809,11 @@ int main(int argc, char ** argv) {
                 if ((int) embd.size() >= params.n_batch) {
                     break;
                 }
+
+                // the prelude is evaluated in a batch of its own to save its state alone
+                if (!path_prelude.empty() && n_consumed == (int) n_prelude_cached) {
+                    break;
+                }
             }
         }
 
@@ -676,7 +823,7 @@ int main(int argc, char ** argv) {
                 const std::string token_str = llama_token_to_piece(ctx, id);
                 printf("%s", token_str.c_str());
 
-                if (embd.size() > 1) {
+                if ((int) embd.size() > 1 + n_forced) {
                     input_tokens.push_back(id);
                 } else {
                     output_tokens.push_back(id);
@@ -766,11 +913,15 @@ int main(int argc, char ** argv) {
                 do {
                     another_line = console::readline(line, params.multiline_input);
                     buffer += line;
-                } while (another_line);
+                } while (another_line && !is_terminated);
 
                 // done taking input, reset color
                 console::set_display(console::reset);
 
+                if (is_terminated) {
+                    break;
+                }
+
                 // Add tokens to embd only if the input buffer is non-empty
                 // Entering a empty line lets the user pass control back
                 if (buffer.length() > 1) {
@@ -857,21 +1008,39 @@ int main(int argc, char ** argv) {
         }
     }
 
+    if (is_terminated) {
+        console::cleanup();
+        printf("\n");
+        llama_print_timings(ctx);
+        write_logfile(ctx, params, model, input_tokens, output_ss.str(), output_tokens);
+        write_profile(ctx, params);
+        llama_trace_stop();
+        _exit(130);
+    }
+
     if (!path_session.empty() && params.prompt_cache_all && !params.prompt_cache_ro) {
         LOG_TEE("\n%s: saving final output to session file '%s'\n", __func__, path_session.c_str());
         llama_save_session_file(ctx, path_session.c_str(), session_tokens.data(), session_tokens.size());
     }
 
     llama_print_timings(ctx);
+    if (ctx_sampling->grammar != NULL && sparams.grammar_mask_cache > 0) {
+        const auto stats = llama_grammar_get_mask_cache_stats(ctx_sampling->grammar);
+        LOG_TEE("%s: grammar mask cache: %" PRIu64 " hits, %" PRIu64 " misses, %zu masks (%.2f MiB)\n", __func__,
+                stats.n_hit, stats.n_miss, stats.n_masks, stats.n_bytes/1024.0/1024.0);
+    }
     write_logfile(ctx, params, model, input_tokens, output_ss.str(), output_tokens);
+    write_profile(ctx, params);
 
-    if (ctx_guidance) { llama_free(ctx_guidance); }
+    llama_batch_free(batch);
     llama_free(ctx);
     llama_free_model(model);
 
     llama_sampling_free(ctx_sampling);
     llama_backend_free();
 
+    llama_trace_stop();
+
 #ifndef LOG_DISABLE_LOGS
     LOG_TEE("Log end\n");
 #endif // LOG_DISABLE_LOGS
@@ -121,6 +121,10 @@ int main(int argc, char ** argv) {
     log_dump_cmdline(argc, argv);
 #endif // LOG_DISABLE_LOGS
 
+    if (!llama_trace_start(params.trace)) {
+        return 1;
+    }
+
     // init llama.cpp
     llama_backend_init(params.numa);
 
@@ -327,6 +331,11 @@ int main(int argc, char ** argv) {
 
             LOG("%s : decoded batch of %d tokens\n", __func__, n_tokens);
 
+            // sample the clients of this batch together, their grammars and samplers run in parallel
+            std::vector<client *>                 batch_clients;
+            std::vector<llama_sampling_context *> batch_ctx_samplings;
+            std::vector<int>                      batch_idxs;
+
             for (auto & client : clients) {
                 if (client.i_batch < (int) i || client.i_batch >= (int) (i + n_tokens)) {
                     continue;
@@ -335,7 +344,17 @@ int main(int argc, char ** argv) {
                 //printf("client %d, seq %d, token %d, pos %d, batch %d\n",
                 //        client.id, client.seq_id, client.sampled, client.n_decoded, client.i_batch);
 
-                const llama_token id = llama_sampling_sample(client.ctx_sampling, ctx, NULL, client.i_batch - i);
+                batch_clients.push_back(&client);
+                batch_ctx_samplings.push_back(client.ctx_sampling);
+                batch_idxs.push_back(client.i_batch - i);
+            }
+
+            const std::vector<llama_token> batch_ids = llama_sampling_sample_batch(batch_ctx_samplings, ctx, batch_idxs, params.n_threads);
+
+            for (size_t k = 0; k < batch_clients.size(); ++k) {
+                auto & client = *batch_clients[k];
+
+                const llama_token id = batch_ids[k];
 
                 llama_sampling_accept(client.ctx_sampling, ctx, id, true);
 
@@ -415,6 +434,8 @@ int main(int argc, char ** argv) {
 
     llama_backend_free();
 
+    llama_trace_stop();
+
     fprintf(stderr, "\n\n");
 
     return 0;
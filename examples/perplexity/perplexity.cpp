@@ -277,6 +277,56 @@ static results_perplexity perplexity_v2(llama_context * ctx, const gpt_params &
     return {tokens, std::exp(nll / count), logit_history, prob_history};
 }
 
+// evaluate the batch in slices of n_batch tokens and append the logits of the tokens with logits enabled to
+// batch_logits, in the order of the batch. The logits of a slice are copied while the next slice is evaluated
+static bool decode_helper(
+    llama_context * ctx, const llama_batch & batch, std::vector<float> & batch_logits, int32_t n_batch, int32_t n_vocab
+) {
+    auto append_logits = [&](int32_t i0, int32_t n_tokens) {
+        for (int32_t k = 0; k < n_tokens; ++k) {
+            if (batch.logits[i0 + k]) {
+                const float * logits = llama_get_logits_ith(ctx, k);
+                batch_logits.insert(batch_logits.end(), logits, logits + n_vocab);
+            }
+        }
+    };
+
+    int32_t n_prev = 0; // tokens of the slice evaluated before the current one
+
+    for (int32_t i = 0; i < batch.n_tokens; i += n_batch) {
+        const int32_t n_tokens = std::min(n_batch, batch.n_tokens - i);
+
+        llama_batch batch_view = {
+            n_tokens,
+            batch.token    + i,
+            nullptr,
+            batch.pos      + i,
+            batch.n_seq_id + i,
+            batch.seq_id   + i,
+            batch.logits   + i,
+            0, 0, 0, // unused
+        };
+
+        if (llama_decode_async(ctx, batch_view)) {
+            fprintf(stderr, "%s : failed to eval\n", __func__);
+            return false;
+        }
+
+        append_logits(i - n_prev, n_prev);
+
+        if (llama_synchronize(ctx)) {
+            fprintf(stderr, "%s : failed to eval\n", __func__);
+            return false;
+        }
+
+        n_prev = n_tokens;
+    }
+
+    append_logits(batch.n_tokens - n_prev, n_prev);
+
+    return true;
+}
+
 static results_perplexity perplexity(llama_context * ctx, const gpt_params & params) {
     if (params.ppl_stride > 0) {
         return perplexity_v2(ctx, params);
@@ -287,8 +337,11 @@ static results_perplexity perplexity(llama_context * ctx, const gpt_params & par
     // Output: `perplexity: 13.5106 [114/114]`
     // BOS tokens will be added for each chunk before eval
 
+    // the chunks are evaluated n_seq at a time, each in a sequence of its own
+    const int n_seq = std::max(1, params.n_parallel);
+
     const bool add_bos = llama_should_add_bos_token(llama_get_model(ctx));
-    const int n_ctx = llama_n_ctx(ctx);
+    const int n_ctx = llama_n_ctx(ctx) / n_seq;
 
     auto tim1 = std::chrono::high_resolution_clock::now();
     fprintf(stderr, "%s: tokenizing the input ..\n", __func__);
@@ -321,45 +374,56 @@ static results_perplexity perplexity(llama_context * ctx, const gpt_params & par
     double nll = 0.0;
     double nll2 = 0.0;
 
-    fprintf(stderr, "%s: calculating perplexity over %d chunks, batch_size=%d\n", __func__, n_chunk, n_batch);
+    fprintf(stderr, "%s: calculating perplexity over %d chunks, n_seq=%d, batch_size=%d\n", __func__, n_chunk, n_seq, n_batch);
 
     std::vector<std::thread> workers(std::thread::hardware_concurrency() - 1);
 
-    for (int i = 0; i < n_chunk; ++i) {
-        const int start =     i * n_ctx;
-        const int end   = start + n_ctx;
+    // We get the logits of the tokens in the context window (params.n_ctx) from llama_decode below. Now, based on
+    // https://huggingface.co/docs/transformers/perplexity, calculate the perplexity over the last half of the window
+    // (so the model always has some context to predict the token).
+    //
+    // We rely on the fact that attention in the forward pass only looks at previous
+    // tokens here, so the logits returned for each token are an accurate representation
+    // of what the model would have predicted at that point.
+    //
+    // Example, we have a context window of 512, we will compute perplexity for each of the
+    // last 256 tokens.  Then, we split the input up into context window size chunks to
+    // process the entire prompt. Only the tokens of the last half of each chunk output logits.
+    const int first = n_ctx/2;
+    const int n_out = n_ctx - 1 - first;
 
-        const int num_batches = (n_ctx + n_batch - 1) / n_batch;
+    llama_batch batch = llama_batch_init(n_seq*n_ctx, 0, 1);
 
-        std::vector<float> logits;
+    std::vector<float> logits;
+
+    for (int i = 0; i < n_chunk; i += n_seq) {
+        const int n_seq_batch = std::min(n_seq, n_chunk - i);
 
         const auto t_start = std::chrono::high_resolution_clock::now();
 
         // clear the KV cache
         llama_kv_cache_clear(ctx);
 
-        for (int j = 0; j < num_batches; ++j) {
-            const int batch_start = start + j * n_batch;
-            const int batch_size  = std::min(end - batch_start, n_batch);
+        batch.n_tokens = 0;
+        for (int seq = 0; seq < n_seq_batch; ++seq) {
+            const int start = (i + seq) * n_ctx;
 
-            // save original token and restore it after eval
-            const auto token_org = tokens[batch_start];
+            for (int k = 0; k < n_ctx; ++k) {
+                const int idx = batch.n_tokens++;
 
-            // add BOS token for the first batch of each chunk
-            if (add_bos && j == 0) {
-                tokens[batch_start] = llama_token_bos(llama_get_model(ctx));
-            }
-
-            if (llama_decode(ctx, llama_batch_get_one(tokens.data() + batch_start, batch_size, j * n_batch, 0))) {
-                fprintf(stderr, "%s : failed to eval\n", __func__);
-                return {tokens, -1, logit_history, prob_history};
+                // add BOS token for the first token of each chunk
+                batch.token   [idx]    = add_bos && k == 0 ? llama_token_bos(llama_get_model(ctx)) : tokens[start + k];
+                batch.pos     [idx]    = k;
+                batch.n_seq_id[idx]    = 1;
+                batch.seq_id  [idx][0] = seq;
+                batch.logits  [idx]    = k >= first && k < n_ctx - 1;
             }
+        }
 
-            // restore the original token in case it was set to BOS
-            tokens[batch_start] = token_org;
-
-            const auto * batch_logits = llama_get_logits(ctx);
-            logits.insert(logits.end(), batch_logits, batch_logits + batch_size * n_vocab);
+        logits.clear();
+        if (!decode_helper(ctx, batch, logits, n_batch, n_vocab)) {
+            llama_batch_free(batch);
+            return {tokens, -1, logit_history, prob_history};
         }
 
         const auto t_end = std::chrono::high_resolution_clock::now();
@@ -367,7 +431,7 @@ static results_perplexity perplexity(llama_context * ctx, const gpt_params & par
         if (i == 0) {
             const float t_total = std::chrono::duration<float>(t_end - t_start).count();
             fprintf(stderr, "%s: %.2f seconds per pass - ETA ", __func__, t_total);
-            int total_seconds = (int)(t_total * n_chunk);
+            int total_seconds = (int)(t_total * ((n_chunk + n_seq - 1) / n_seq));
             if (total_seconds >= 60*60) {
                 fprintf(stderr, "%d hours ", total_seconds / (60*60));
                 total_seconds = total_seconds % (60*60);
@@ -375,34 +439,28 @@ static results_perplexity perplexity(llama_context * ctx, const gpt_params & par
             fprintf(stderr, "%.2f minutes\n", total_seconds / 60.0);
         }
 
-        // We get the logits for all the tokens in the context window (params.n_ctx)
-        // from llama_eval above.  Now, based on https://huggingface.co/docs/transformers/perplexity,
-        // calculate the perplexity over the last half of the window (so the model always has
-        // some context to predict the token).
-        //
-        // We rely on the fact that attention in the forward pass only looks at previous
-        // tokens here, so the logits returned for each token are an accurate representation
-        // of what the model would have predicted at that point.
-        //
-        // Example, we have a context window of 512, we will compute perplexity for each of the
-        // last 256 tokens.  Then, we split the input up into context window size chunks to
-        // process the entire prompt.
-        const int first = n_ctx/2;
-        process_logits(n_vocab, logits.data() + first*n_vocab, tokens.data() + start + first, n_ctx - 1 - first,
-                       workers, nll, nll2, logit_history.data() + start + first, prob_history.data() + start + first);
-        count += n_ctx - first - 1;
-
-        // perplexity is e^(average negative log-likelihood)
-        if (params.ppl_output_type == 0) {
-            printf("[%d]%.4lf,", i + 1, std::exp(nll / count));
-        } else {
-            double av = nll/count;
-            double av2 = nll2/count - av*av;
-            if (av2 > 0) av2 = sqrt(av2/(count-1));
-            printf("%8d  %.4lf  %4lf  %4lf\n", i*n_ctx, std::exp(nll / count), av, av2);
+        for (int seq = 0; seq < n_seq_batch; ++seq) {
+            const int start = (i + seq) * n_ctx;
+
+            process_logits(n_vocab, logits.data() + seq*n_out*n_vocab, tokens.data() + start + first, n_out,
+                           workers, nll, nll2, logit_history.data() + start + first, prob_history.data() + start + first);
+            count += n_out;
+
+            // perplexity is e^(average negative log-likelihood)
+            if (params.ppl_output_type == 0) {
+                printf("[%d]%.4lf,", i + seq + 1, std::exp(nll / count));
+            } else {
+                double av = nll/count;
+                double av2 = nll2/count - av*av;
+                if (av2 > 0) av2 = sqrt(av2/(count-1));
+                printf("%8d  %.4lf  %4lf  %4lf\n", start, std::exp(nll / count), av, av2);
+            }
         }
         fflush(stdout);
     }
+
+    llama_batch_free(batch);
+
     printf("\n");
 
     nll2 /= count;
@@ -419,28 +477,6 @@ static results_perplexity perplexity(llama_context * ctx, const gpt_params & par
     return {tokens, ppl, logit_history, prob_history};
 }
 
-static std::vector<float> hellaswag_evaluate_tokens(
-    llama_context * ctx, std::vector<int> & tokens, int n_past, int n_batch, int n_vocab
-) {
-    std::vector<float> result;
-    result.reserve(tokens.size() * n_vocab);
-    size_t n_chunk = (tokens.size() + n_batch - 1)/n_batch;
-    for (size_t i_chunk = 0; i_chunk < n_chunk; ++i_chunk) {
-        size_t n_tokens = tokens.size() - i_chunk * n_batch;
-        n_tokens = std::min(n_tokens, size_t(n_batch));
-        if (llama_decode(ctx, llama_batch_get_one(tokens.data() + i_chunk * n_batch, n_tokens, n_past, 0))) {
-            fprintf(stderr, "%s : failed to eval\n", __func__);
-            return {};
-        }
-
-        const auto logits = llama_get_logits(ctx);
-        result.insert(result.end(), logits, logits + n_tokens * n_vocab);
-
-        n_past += n_tokens;
-    }
-    return result;
-}
-
 static void hellaswag_score(llama_context * ctx, const gpt_params & params) {
     // Calculates hellaswag score (acc_norm) from prompt
     //
@@ -533,143 +569,158 @@ static void hellaswag_score(llama_context * ctx, const gpt_params & params) {
     const int n_vocab = llama_n_vocab(llama_get_model(ctx));
     const int n_ctx = llama_n_ctx(ctx);
 
-    std::vector<std::vector<int>> ending_tokens(4);
-
-    std::vector<float> tok_logits(n_vocab);
-
-    for (size_t task_idx = 0; task_idx < hs_task_count; task_idx++) {
-        // Tokenize the context to count tokens
-        std::vector<int> context_embd = ::llama_tokenize(ctx, hs_data[task_idx].context, add_bos);
-        size_t context_size = context_embd.size();
-
-        for (int i = 0; i < 4; ++i) {
-            ending_tokens[i] = ::llama_tokenize(ctx, hs_data[task_idx].context + " " + hs_data[task_idx].ending[i], add_bos);
-            for (int k = 0; k < int(context_size); ++k) {
-                if (ending_tokens[i][k] != context_embd[k]) {
-                    fprintf(stderr, "Oops: ending %d of task %d differs from context at position %d\n",i,int(task_idx),k);
-                    break;
-                }
-            }
-        }
-
-        // Do the 1st ending
-        // In this case we include the context when evaluating
-        //auto query_embd = ::llama_tokenize(ctx, hs_data[task_idx].context + hs_data[task_idx].ending[0], add_bos);
-        auto query_embd = ending_tokens[0];
-        auto query_size = query_embd.size();
+    // the tasks are evaluated together, as many as fit in the context: the tokens of the context of a task are shared by
+    // the sequences of its four endings, which follow it in the batch. Only the last token of the context and the tokens
+    // of the endings output logits
+    struct hs_task_batch_t {
+        size_t context_size;
+        std::vector<int> ending_tokens[4]; // without the context
+        size_t i_logits;                   // row of the logits of the last token of the context
+    };
 
-        // Stop if query wont fit the ctx window
-        if (query_size > (size_t)n_ctx) {
-            fprintf(stderr, "%s : number of tokens in query %zu > n_ctxl\n", __func__, query_size);
-            return;
-        }
+    llama_batch batch = llama_batch_init(n_ctx, 0, 4);
 
-        // Speedup small evaluations by evaluating atleast 32 tokens
-        if (query_size < 32) {
-            query_embd.resize(32);
-        }
+    std::vector<float> batch_logits;
+    std::vector<hs_task_batch_t> batch_tasks;
 
+    size_t task_idx = 0;
+    while (task_idx < hs_task_count) {
         // clear the KV cache
         llama_kv_cache_clear(ctx);
 
-        auto logits = hellaswag_evaluate_tokens(ctx, query_embd, 0, params.n_batch, n_vocab);
-        if (logits.empty()) {
-            fprintf(stderr, "%s : failed to eval\n", __func__);
-            return;
-        }
+        batch.n_tokens = 0;
+        batch_tasks.clear();
 
-        std::memcpy(tok_logits.data(), logits.data() + (context_size-1)*n_vocab, n_vocab*sizeof(float));
-        const auto first_probs = softmax(tok_logits);
+        size_t n_logits = 0;
 
-        hs_data[task_idx].ending_logprob_count[0] = 1;
-        hs_data[task_idx].ending_logprob[0] = std::log(first_probs[query_embd[context_size]]);
+        for (; task_idx < hs_task_count; ++task_idx) {
+            // Tokenize the context to count tokens
+            std::vector<int> context_embd = ::llama_tokenize(ctx, hs_data[task_idx].context, add_bos);
+            const size_t context_size = context_embd.size();
 
-        // Calculate the logprobs over the ending
-        for (size_t j = context_size; j < query_size - 1; j++) {
+            hs_task_batch_t task;
+            task.context_size = context_size;
 
-            std::memcpy(tok_logits.data(), logits.data() + j*n_vocab, n_vocab*sizeof(float));
-
-            const float prob = softmax(tok_logits)[query_embd[j + 1]];
-
-            hs_data[task_idx].ending_logprob[0] += std::log(prob);
-            hs_data[task_idx].ending_logprob_count[0]++;
-        }
+            size_t n_tokens = context_size;
+            for (int i = 0; i < 4; ++i) {
+                std::vector<int> ending_tokens = ::llama_tokenize(ctx, hs_data[task_idx].context + " " + hs_data[task_idx].ending[i], add_bos);
+                for (int k = 0; k < int(context_size); ++k) {
+                    if (ending_tokens[k] != context_embd[k]) {
+                        fprintf(stderr, "Oops: ending %d of task %d differs from context at position %d\n",i,int(task_idx),k);
+                        break;
+                    }
+                }
+                task.ending_tokens[i].assign(ending_tokens.begin() + std::min(context_size, ending_tokens.size()), ending_tokens.end());
+                if (task.ending_tokens[i].empty()) {
+                    fprintf(stderr, "%s : ending %d of task %zu has no tokens\n", __func__, i, task_idx);
+                    llama_batch_free(batch);
+                    delete [] hs_data;
+                    return;
+                }
+                n_tokens += task.ending_tokens[i].size();
+            }
 
-        // Calculate the mean token logprob for acc_norm
-        hs_data[task_idx].ending_logprob[0] /= hs_data[task_idx].ending_logprob_count[0];
+            // Stop if the task wont fit the ctx window
+            if (n_tokens > (size_t)n_ctx) {
+                fprintf(stderr, "%s : number of tokens in task %zu > n_ctx\n", __func__, n_tokens);
+                llama_batch_free(batch);
+                delete [] hs_data;
+                return;
+            }
 
-        // Do the remaining endings
-        // For these, we use the bare ending with n_past = context_size
-        //
-        for (size_t ending_idx = 1; ending_idx < 4; ending_idx++) {
+            // evaluate the tasks so far, this one goes to the next batch
+            if (batch.n_tokens + n_tokens > (size_t)n_ctx) {
+                break;
+            }
 
-            // Tokenize the query
-            query_embd.resize(ending_tokens[ending_idx].size() - context_size);
-            std::memcpy(query_embd.data(), ending_tokens[ending_idx].data() + context_size, query_embd.size()*sizeof(int));
-            query_size = query_embd.size();
+            const llama_seq_id s0 = 4*batch_tasks.size();
 
-            // Stop if query wont fit the ctx window
-            if (context_size + query_size > (size_t)n_ctx) {
-                fprintf(stderr, "%s : number of tokens in query %zu > n_ctxl\n", __func__, query_size);
-                return;
+            for (size_t k = 0; k < context_size; ++k) {
+                const int idx = batch.n_tokens++;
+                batch.token   [idx] = context_embd[k];
+                batch.pos     [idx] = k;
+                batch.n_seq_id[idx] = 4;
+                for (int s = 0; s < 4; ++s) {
+                    batch.seq_id[idx][s] = s0 + s;
+                }
+                batch.logits  [idx] = k == context_size - 1;
+            }
+            task.i_logits = n_logits++;
+
+            for (int i = 0; i < 4; ++i) {
+                const std::vector<int> & ending = task.ending_tokens[i];
+                for (size_t k = 0; k < ending.size(); ++k) {
+                    const int idx = batch.n_tokens++;
+                    batch.token   [idx]    = ending[k];
+                    batch.pos     [idx]    = context_size + k;
+                    batch.n_seq_id[idx]    = 1;
+                    batch.seq_id  [idx][0] = s0 + i;
+                    // the last token of the ending predicts nothing
+                    batch.logits  [idx]    = k < ending.size() - 1;
+                }
+                n_logits += ending.size() - 1;
             }
 
-            // Speedup small evaluations by evaluating atleast 32 tokens
-            // No, resizing to 32 is actually slightly slower (at least on CUDA)
-            //if (query_size < 32) {
-            //    query_embd.resize(32);
-            //}
+            batch_tasks.push_back(std::move(task));
+        }
 
-            // Evaluate the query
-            logits = hellaswag_evaluate_tokens(ctx, query_embd, context_size, params.n_batch, n_vocab);
-            if (logits.empty()) {
-                fprintf(stderr, "%s : failed to eval\n", __func__);
-                return;
-            }
+        batch_logits.clear();
+        if (!decode_helper(ctx, batch, batch_logits, params.n_batch, n_vocab)) {
+            llama_batch_free(batch);
+            delete [] hs_data;
+            return;
+        }
 
-            hs_data[task_idx].ending_logprob_count[ending_idx] = 1;
-            hs_data[task_idx].ending_logprob[ending_idx] = std::log(first_probs[query_embd[0]]);
+        const size_t task_idx0 = task_idx - batch_tasks.size();
 
-            // Calculate the logprobs over the ending
-            for (size_t j = 0; j < query_size - 1; j++) {
-                std::memcpy(tok_logits.data(), logits.data() + j*n_vocab, n_vocab*sizeof(float));
+        for (size_t t = 0; t < batch_tasks.size(); ++t) {
+            const hs_task_batch_t & task = batch_tasks[t];
+            hs_data_t & hs = hs_data[task_idx0 + t];
 
-                const float prob = softmax(tok_logits)[query_embd[j + 1]];
+            const float * first_logits = batch_logits.data() + task.i_logits*n_vocab;
 
-                hs_data[task_idx].ending_logprob[ending_idx] += std::log(prob);
-                hs_data[task_idx].ending_logprob_count[ending_idx]++;
-            }
+            size_t i_logits = task.i_logits + 1;
+            for (int i = 0; i < 4; ++i) {
+                const std::vector<int> & ending = task.ending_tokens[i];
 
-            // Calculate the mean token logprob for acc_norm
-            hs_data[task_idx].ending_logprob[ending_idx] /= hs_data[task_idx].ending_logprob_count[ending_idx];
+                // Calculate the logprobs over the ending, the first token follows the context
+                hs.ending_logprob_count[i] = 1;
+                hs.ending_logprob[i] = log_softmax(n_vocab, first_logits, ending[0]).log_softmax;
 
+                for (size_t j = 0; j + 1 < ending.size(); j++) {
+                    const float * logits = batch_logits.data() + (i_logits++)*n_vocab;
 
-//            printf("task %lu, ending %lu, whole_len %lu, context_len %lu, ending_logprob_count %lu, ending_logprob %.4f\n",
-//                task_idx,ending_idx,whole_size,context_size, hs_data[task_idx].ending_logprob_count[ending_idx], hs_data[task_idx].ending_logprob[ending_idx] );
-        }
+                    hs.ending_logprob[i] += log_softmax(n_vocab, logits, ending[j + 1]).log_softmax;
+                    hs.ending_logprob_count[i]++;
+                }
 
-        // Find the ending with maximum logprob
-        size_t ending_logprob_max_idx = 0;
-        double ending_logprob_max_val = hs_data[task_idx].ending_logprob[0];
-        for (size_t j = 1; j < 4; j++) {
-            if (hs_data[task_idx].ending_logprob[j] > ending_logprob_max_val) {
-                ending_logprob_max_idx = j;
-                ending_logprob_max_val =  hs_data[task_idx].ending_logprob[j];
+                // Calculate the mean token logprob for acc_norm
+                hs.ending_logprob[i] /= hs.ending_logprob_count[i];
             }
-        }
 
-//        printf("max logprob ending idx %lu, gold ending idx %lu\n", ending_logprob_max_idx, hs_data[task_idx].gold_ending_idx);
+            // Find the ending with maximum logprob
+            size_t ending_logprob_max_idx = 0;
+            double ending_logprob_max_val = hs.ending_logprob[0];
+            for (size_t j = 1; j < 4; j++) {
+                if (hs.ending_logprob[j] > ending_logprob_max_val) {
+                    ending_logprob_max_idx = j;
+                    ending_logprob_max_val = hs.ending_logprob[j];
+                }
+            }
 
-        // If the gold ending got the maximum logprobe add one accuracy point
-        if (ending_logprob_max_idx == hs_data[task_idx].gold_ending_idx) {
-            acc += 1.0;
-        }
+            // If the gold ending got the maximum logprobe add one accuracy point
+            if (ending_logprob_max_idx == hs.gold_ending_idx) {
+                acc += 1.0;
+            }
 
-        // Print the accumulated accuracy mean x 100
-        printf("%zu\t%.8lf\n",task_idx+1, acc/double(task_idx+1)*100.0);
+            // Print the accumulated accuracy mean x 100
+            printf("%zu\t%.8lf\n", task_idx0 + t + 1, acc/double(task_idx0 + t + 1)*100.0);
+        }
         fflush(stdout);
     }
 
+    llama_batch_free(batch);
+
     delete [] hs_data;
 
     printf("\n");
@@ -683,7 +734,16 @@ int main(int argc, char ** argv) {
         return 1;
     }
 
-    params.logits_all = true;
+    // only the strided perplexity reads the logits of all the tokens of a batch, the others enable them in the batch
+    params.logits_all = params.ppl_stride > 0 && !params.hellaswag;
+
+    if (!params.hellaswag && params.ppl_stride == 0) {
+        // the chunks are evaluated as many at a time as fit in a batch, in sequences of their own
+        const int n_seq = std::max(1, params.n_batch / params.n_ctx);
+        params.n_parallel = n_seq;
+        params.n_ctx     *= n_seq;
+    }
+
     params.n_batch = std::min(params.n_batch, params.n_ctx);
 
     if (params.ppl_stride > 0) {
@@ -1,6 +1,7 @@
 #include "common.h"
 #include "llama.h"
 
+#include <algorithm>
 #include <vector>
 #include <cstdio>
 #include <chrono>
@@ -57,6 +58,14 @@ int main(int argc, char ** argv) {
     // save state (last tokens)
     const auto n_past_saved = n_past;
 
+    // save the sequence only, the generated tokens are appended to the file later
+    std::vector<llama_token> seq_tokens = tokens;
+    std::remove("dump_seq_session.bin");
+    if (!llama_save_seq_session_file(ctx, "dump_seq_session.bin", 0, seq_tokens.data(), seq_tokens.size())) {
+        fprintf(stderr, "\n%s : failed to save the sequence\n", __func__);
+        return 1;
+    }
+
     // first run
     printf("\nfirst run: %s", params.prompt.c_str());
 
@@ -83,10 +92,23 @@ int main(int argc, char ** argv) {
             return 1;
         }
         n_past += 1;
+        seq_tokens.push_back(next_token);
     }
 
     printf("\n\n");
 
+    // append the generated tokens and keep the most likely next token to check the restored sequence
+    if (!llama_save_seq_session_file(ctx, "dump_seq_session.bin", 0, seq_tokens.data(), seq_tokens.size())) {
+        fprintf(stderr, "\n%s : failed to append to the sequence\n", __func__);
+        return 1;
+    }
+
+    llama_token next_token0;
+    {
+        const auto * logits = llama_get_logits(ctx);
+        next_token0 = std::max_element(logits, logits + llama_n_vocab(model)) - logits;
+    }
+
     // free old context
     llama_free(ctx);
 
@@ -145,6 +167,31 @@ int main(int argc, char ** argv) {
     printf("\n");
 
     llama_free(ctx2);
+
+    // load the sequence in a new context, and evaluate its last token again for the logits
+    auto * ctx3 = llama_new_context_with_model(model, llama_context_params_from_gpt_params(params));
+
+    std::vector<llama_token> seq_tokens_loaded(llama_n_ctx(ctx3));
+    size_t n_seq_tokens_loaded = 0;
+    if (!llama_load_seq_session_file(ctx3, "dump_seq_session.bin", 0, seq_tokens_loaded.data(), seq_tokens_loaded.size(), &n_seq_tokens_loaded)) {
+        fprintf(stderr, "\n%s : failed to load the sequence\n", __func__);
+        return 1;
+    }
+    seq_tokens_loaded.resize(n_seq_tokens_loaded);
+
+    llama_kv_cache_seq_rm(ctx3, 0, n_seq_tokens_loaded - 1, -1);
+    if (llama_decode(ctx3, llama_batch_get_one(&seq_tokens_loaded.back(), 1, n_seq_tokens_loaded - 1, 0))) {
+        fprintf(stderr, "\n%s : failed to evaluate\n", __func__);
+        return 1;
+    }
+
+    llama_token next_token3;
+    {
+        const auto * logits = llama_get_logits(ctx3);
+        next_token3 = std::max_element(logits, logits + llama_n_vocab(model)) - logits;
+    }
+
+    llama_free(ctx3);
     llama_free_model(model);
 
     if (result0 != result1) {
@@ -152,6 +199,11 @@ int main(int argc, char ** argv) {
         return 1;
     }
 
+    if (seq_tokens_loaded != seq_tokens || next_token3 != next_token0) {
+        fprintf(stderr, "\n%s : error : the restored sequence is different\n", __func__);
+        return 1;
+    }
+
     fprintf(stderr, "\n%s : success\n", __func__);
 
     return 0;
@@ -0,0 +1,57 @@
+#!/usr/bin/env python3
+# Generates a trace of requests for `server --bench-trace`, one /completion request per line with its arrival time.
+# The arrivals follow a Poisson process, and the prompts are runs of words of a text file of varied lengths. A part of
+# the requests starts with a prefix shared by all of them, has a grammar, or is cancelled by its client.
+import argparse
+import json
+import random
+import sys
+
+parser = argparse.ArgumentParser(description="Generate a JSONL trace of requests for server --bench-trace.")
+parser.add_argument("--text", type=str, required=True, help="text file whose words make the prompts")
+parser.add_argument("-n", type=int, default=100, help="number of requests (default: 100)")
+parser.add_argument("--rate", type=float, default=2.0, help="mean number of requests per second (default: 2.0)")
+parser.add_argument("--prompt-words", type=int, nargs=2, default=[32, 512], metavar=("MIN", "MAX"), help="words of the prompts, uniform between MIN and MAX (default: 32 512)")
+parser.add_argument("--n-predict", type=int, nargs=2, default=[16, 256], metavar=("MIN", "MAX"), help="tokens to predict, uniform between MIN and MAX (default: 16 256)")
+parser.add_argument("--shared-prefix-words", type=int, default=0, help="words of the prefix shared by the prompts (default: 0, none)")
+parser.add_argument("--shared-prefix-ratio", type=float, default=0.5, help="share of the requests that start with the shared prefix (default: 0.5)")
+parser.add_argument("--grammar-ratio", type=float, default=0.0, help="share of the requests constrained by --grammar (default: 0.0)")
+parser.add_argument("--grammar", type=str, default='root ::= [a-z ,]+ "."', help="GBNF grammar of the constrained requests")
+parser.add_argument("--cancel-ratio", type=float, default=0.0, help="share of the requests cancelled by their client before the end (default: 0.0)")
+parser.add_argument("--cache-prompt", action="store_true", help="set cache_prompt in the requests")
+parser.add_argument("--seed", type=int, default=42, help="seed of the generator (default: 42)")
+args = parser.parse_args()
+
+rng = random.Random(args.seed)
+
+with open(args.text, encoding="utf-8", errors="replace") as f:
+    words = f.read().split()
+
+if len(words) < args.prompt_words[1] + args.shared_prefix_words:
+    sys.exit(f"error: {args.text} has {len(words)} words, fewer than the longest prompt")
+
+def run_of_words(n):
+    i = rng.randrange(len(words) - n + 1)
+    return " ".join(words[i:i + n])
+
+prefix = run_of_words(args.shared_prefix_words) + " " if args.shared_prefix_words > 0 else ""
+
+t = 0.0
+for _ in range(args.n):
+    t += rng.expovariate(args.rate)
+
+    prompt = run_of_words(rng.randint(*args.prompt_words))
+    if prefix and rng.random() < args.shared_prefix_ratio:
+        prompt = prefix + prompt
+
+    n_predict = rng.randint(*args.n_predict)
+
+    req = {"t": round(t, 3), "prompt": prompt, "n_predict": n_predict}
+    if args.cache_prompt:
+        req["cache_prompt"] = True
+    if rng.random() < args.grammar_ratio:
+        req["grammar"] = args.grammar
+    if rng.random() < args.cancel_ratio:
+        req["cancel_after"] = rng.randint(1, max(1, n_predict - 1))
+
+    print(json.dumps(req))
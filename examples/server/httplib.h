@@ -375,6 +375,7 @@ public:
   std::function<bool(const char *data, size_t data_len)> write;
   std::function<void()> done;
   std::function<void(const Headers &trailer)> done_with_trailer;
+  std::function<bool()> is_writable;
   std::ostream os;
 
 private:
@@ -3720,6 +3721,8 @@ inline bool write_content(Stream &strm, const ContentProvider &content_provider,
     return ok;
   };
 
+  data_sink.is_writable = [&](void) { return ok && strm.is_writable(); };
+
   while (offset < end_offset && !is_shutting_down()) {
     if (!strm.is_writable()) {
       error = Error::Write;
@@ -3766,6 +3769,8 @@ write_content_without_length(Stream &strm,
 
   data_sink.done = [&](void) { data_available = false; };
 
+  data_sink.is_writable = [&](void) { return ok && strm.is_writable(); };
+
   while (data_available && !is_shutting_down()) {
     if (!strm.is_writable()) {
       return false;
@@ -3860,6 +3865,8 @@ write_content_chunked(Stream &strm, const ContentProvider &content_provider,
 
   data_sink.done = [&](void) { done_with_trailer(nullptr); };
 
+  data_sink.is_writable = [&](void) { return ok && strm.is_writable(); };
+
   data_sink.done_with_trailer = [&](const Headers &trailer) {
     done_with_trailer(&trailer);
   };
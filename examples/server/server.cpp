@@ -1,6 +1,7 @@
 #include "common.h"
 #include "llama.h"
 #include "grammar-parser.h"
+#include "speculative.h"
 
 #include "../llava/clip.h"
 
@@ -20,10 +21,17 @@
 #include "completion.js.hpp"
 #include "json-schema-to-grammar.mjs.hpp"
 
+#include <atomic>
+#include <condition_variable>
 #include <cstddef>
+#include <deque>
+#include <fstream>
+#include <list>
 #include <thread>
 #include <mutex>
 #include <chrono>
+#include <map>
+#include <memory>
 
 #ifndef SERVER_VERBOSE
 #define SERVER_VERBOSE 1
@@ -31,6 +39,9 @@
 
 #define DEFAULT_OAICOMPAT_MODEL "gpt-3.5-turbo-0613"
 
+// the repetition detector of a slot costs this many bytes and steps per byte of output
+#define MAX_REPETITION_STOP_PERIOD 256
+
 using json = nlohmann::json;
 
 struct server_params
@@ -41,6 +52,12 @@ struct server_params
     int32_t port = 8080;
     int32_t read_timeout = 600;
     int32_t write_timeout = 600;
+
+    std::vector<std::pair<std::string, std::string>> extra_models; // name, path of the models loaded at startup
+    size_t models_budget = 0; // bytes of weights of all the models, 0 = unlimited
+    std::string models_dir;   // the directory of the files /models/load may load, empty = /models/load disabled
+
+    std::string bench_trace; // JSONL trace of requests replayed through the task loop instead of serving HTTP
 };
 
 static bool server_verbose = false;
@@ -157,6 +174,20 @@ struct task_server {
     bool infill_mode = false;
     bool embedding_mode = false;
     int multitask_id = -1;
+    int64_t t_queued = 0; // when the request was received, for the time to first token
+};
+
+struct completion_token_output
+{
+    struct token_prob
+    {
+        llama_token tok;
+        float prob;
+    };
+
+    std::vector<token_prob> probs;
+    llama_token tok;
+    std::string text_to_send;
 };
 
 struct task_result {
@@ -165,6 +196,24 @@ struct task_result {
     bool stop;
     bool error;
     json result_json;
+
+    // token of a stream: result_json is empty, the thread of the request writes its event from these fields,
+    // see write_partial_event
+    bool partial = false;
+    std::string content;
+    int slot_id = -1;
+    bool multimodal = false;
+    bool has_probs = false; // n_probs > 0, the probabilities are sent even if there are none
+    std::vector<completion_token_output> probs;
+    bool oaicompat = false;
+    int oaicompat_token_ctr = 0;
+    std::string model;
+};
+
+// results of a task, in the order they were sent, waited for by the thread of its request
+struct task_channel {
+    std::deque<task_result> results;
+    std::condition_variable cv;
 };
 
 struct task_multi {
@@ -173,6 +222,16 @@ struct task_multi {
     std::vector<task_result> results{};
 };
 
+// inputs of an embedding request, evaluated in the batches of the embedding step next to the inputs of the other
+// requests, each one in a sequence of its own, and pooled per sequence
+struct task_embedding {
+    int id;
+    bool batched;      // the request has an array of inputs
+    bool pooling_mean; // mean of the embeddings of the tokens, or embedding of the last token
+    std::vector<std::vector<llama_token>> inputs;
+    std::vector<std::vector<float>>       embeddings;
+};
+
 // TODO: can become bool if we can't find use of more states
 enum slot_state
 {
@@ -194,6 +253,7 @@ struct slot_params
 
     uint32_t seed      = -1; // RNG seed
     int32_t  n_keep    =  0; // number of tokens to keep from initial prompt
+    int32_t  n_discard = -1; // number of tokens to discard at each context shift (-1 = half of the tokens after n_keep)
     int32_t  n_predict = -1; // new tokens to predict
 
     std::vector<std::string> antiprompt;
@@ -216,19 +276,6 @@ struct slot_image
 };
 
 // completion token output with probabilities
-struct completion_token_output
-{
-    struct token_prob
-    {
-        llama_token tok;
-        float prob;
-    };
-
-    std::vector<token_prob> probs;
-    llama_token tok;
-    std::string text_to_send;
-};
-
 static size_t common_part(const std::vector<llama_token> &a, const std::vector<llama_token> &b)
 {
     size_t i;
@@ -278,7 +325,9 @@ static std::string tokens_to_str(llama_context *ctx, Iter begin, Iter end)
     std::string ret;
     for (; begin != end; ++begin)
     {
-        ret += llama_token_to_piece(ctx, *begin);
+        int32_t n_piece;
+        const char * piece = llama_token_get_piece_view(llama_get_model(ctx), *begin, &n_piece);
+        ret.append(piece, n_piece);
     }
     return ret;
 }
@@ -300,7 +349,13 @@ static void server_log(const char *level, const char *function, int line,
         log.merge_patch(extra);
     }
 
-    const std::string str = log.dump(-1, ' ', false, json::error_handler_t::replace);
+    std::string str = log.dump(-1, ' ', false, json::error_handler_t::replace);
+    if (log_async_enabled())
+    {
+        str += '\n';
+        log_async_write(stdout, str.data(), str.size());
+        return;
+    }
     printf("%.*s\n", (int)str.size(), str.data());
     fflush(stdout);
 }
@@ -346,6 +401,198 @@ static json probs_vector_to_json(const llama_context *ctx, const std::vector<com
     return out;
 }
 
+// appends the string s as json::dump does with the replace error handler and without ensure_ascii: the
+// invalid UTF-8 sequences become U+FFFD, a byte that breaks a sequence starts the next one
+static void json_escape_string(std::string &out, const std::string &s)
+{
+    static const char hex[] = "0123456789abcdef";
+
+    out += '"';
+    const size_t n = s.size();
+    size_t i = 0;
+    while (i < n)
+    {
+        const unsigned char c = s[i];
+        if (c < 0x80)
+        {
+            // the runs of characters without escapes are copied at once
+            size_t j = i;
+            while (j < n && (unsigned char) s[j] < 0x80 && (unsigned char) s[j] >= 0x20 && s[j] != '"' && s[j] != '\\')
+            {
+                j++;
+            }
+            if (j > i)
+            {
+                out.append(s, i, j - i);
+                i = j;
+                continue;
+            }
+
+            out += '\\';
+            switch (c)
+            {
+                case '\b': out += 'b';  break;
+                case '\t': out += 't';  break;
+                case '\n': out += 'n';  break;
+                case '\f': out += 'f';  break;
+                case '\r': out += 'r';  break;
+                case '"':  out += '"';  break;
+                case '\\': out += '\\'; break;
+                default:
+                {
+                    const char u[] = { 'u', '0', '0', hex[c >> 4], hex[c & 0xf] };
+                    out.append(u, sizeof(u));
+                } break;
+            }
+            i++;
+            continue;
+        }
+
+        // length of the sequence, and the range of its second byte, which excludes the overlong encodings, the
+        // surrogates and the code points after U+10FFFF
+        size_t len = 0;
+        unsigned char lo = 0x80;
+        unsigned char hi = 0xbf;
+        if      (c >= 0xc2 && c <= 0xdf) { len = 2; }
+        else if (c == 0xe0)              { len = 3; lo = 0xa0; }
+        else if (c == 0xed)              { len = 3; hi = 0x9f; }
+        else if (c >= 0xe1 && c <= 0xef) { len = 3; }
+        else if (c == 0xf0)              { len = 4; lo = 0x90; }
+        else if (c == 0xf4)              { len = 4; hi = 0x8f; }
+        else if (c >= 0xf1 && c <= 0xf3) { len = 4; }
+
+        size_t k = 1;
+        if (len > 0)
+        {
+            for (; k < len && i + k < n; ++k)
+            {
+                const unsigned char b = s[i + k];
+                if (b < (k == 1 ? lo : 0x80) || b > (k == 1 ? hi : 0xbf))
+                {
+                    break;
+                }
+            }
+            if (k == len)
+            {
+                out.append(s, i, len);
+                i += len;
+                continue;
+            }
+            if (i + k == n)
+            {
+                // incomplete at the end of the string
+                out += "\xEF\xBF\xBD";
+                break;
+            }
+        }
+        out += "\xEF\xBF\xBD";
+        i += k;
+    }
+    out += '"';
+}
+
+// appends the value as json::dump does with the numbers of type float
+static void json_append_float(std::string &out, double value)
+{
+    if (!std::isfinite(value))
+    {
+        out += "null";
+        return;
+    }
+    char buf[64];
+    const char *end = nlohmann::detail::to_chars(buf, buf + sizeof(buf), value);
+    out.append(buf, end - buf);
+}
+
+static void json_append_int(std::string &out, int value)
+{
+    char buf[16];
+    const int n = snprintf(buf, sizeof(buf), "%d", value);
+    out.append(buf, n);
+}
+
+// the same as probs_vector_to_json(ctx, probs).dump(), without the json objects
+static void write_probs(std::string &out, const llama_context *ctx, const std::vector<completion_token_output> &probs)
+{
+    out += '[';
+    for (size_t i = 0; i < probs.size(); ++i)
+    {
+        if (i > 0)
+        {
+            out += ',';
+        }
+        out += "{\"content\":";
+        json_escape_string(out, tokens_to_output_formatted_string(ctx, probs[i].tok));
+        out += ",\"probs\":[";
+        for (size_t j = 0; j < probs[i].probs.size(); ++j)
+        {
+            if (j > 0)
+            {
+                out += ',';
+            }
+            out += "{\"prob\":";
+            json_append_float(out, probs[i].probs[j].prob);
+            out += ",\"tok_str\":";
+            json_escape_string(out, tokens_to_output_formatted_string(ctx, probs[i].probs[j].tok));
+            out += '}';
+        }
+        out += "]}";
+    }
+    out += ']';
+}
+
+// writes the server-sent event of a token of a stream into out, which is reused from one token to the next: the
+// same bytes as the dump of partial_result_to_json, with the keys in the order of the json objects
+static void write_partial_event(std::string &out, const llama_context *ctx, const task_result &result)
+{
+    out.clear();
+    out += "data: {";
+    if (result.has_probs)
+    {
+        out += "\"completion_probabilities\":";
+        write_probs(out, ctx, result.probs);
+        out += ',';
+    }
+    out += "\"content\":";
+    json_escape_string(out, result.content);
+    if (result.oaicompat)
+    {
+        out += ",\"model\":";
+        json_escape_string(out, result.model);
+    }
+    out += result.multimodal ? ",\"multimodal\":true" : ",\"multimodal\":false";
+    if (result.oaicompat)
+    {
+        out += ",\"oaicompat_token_ctr\":";
+        json_append_int(out, result.oaicompat_token_ctr);
+    }
+    out += ",\"slot_id\":";
+    json_append_int(out, result.slot_id);
+    out += ",\"stop\":false}\n\n";
+}
+
+// the result of a token of a stream as a json object, for the consumers that format it again
+static json partial_result_to_json(const llama_context *ctx, const task_result &result)
+{
+    json out = json
+    {
+        {"content",    result.content},
+        {"stop",       false},
+        {"slot_id",    result.slot_id},
+        {"multimodal", result.multimodal}
+    };
+    if (result.has_probs)
+    {
+        out["completion_probabilities"] = probs_vector_to_json(ctx, result.probs);
+    }
+    if (result.oaicompat)
+    {
+        out["oaicompat_token_ctr"] = result.oaicompat_token_ctr;
+        out["model"] = result.model;
+    }
+    return out;
+}
+
 template <typename T>
 static T json_value(const json &body, const std::string &key, const T &default_value)
 {
@@ -378,12 +625,42 @@ struct llama_client_slot
     int32_t num_prompt_tokens           = 0;
     int32_t num_prompt_tokens_processed = 0;
 
+    // the prompt is evaluated in chunks over several steps, cache_tokens[n_past, end) are left
+    bool prefilling = false;
+
+    // scheduling class of the request: the slots of a higher priority preempt the lower ones,
+    // the tenants of a same priority share the slots evenly
+    int priority = 0;
+    std::string tenant;
+
+    // the KV of a preempted slot could not be kept, cache_tokens[0, n_past) are evaluated again when it resumes
+    bool kv_dropped = false;
+
+    // version of the system prompt at the start of the sequence of the slot, and its number of tokens
+    // the positions of cache_tokens start after it
+    int     system_id = 0;
+    int32_t n_system  = 0;
+
     json prompt;
     std::string generated_text;
     llama_token sampled;
     std::vector<llama_token> cache_tokens;
     std::vector<completion_token_output> generated_token_probs;
 
+    // speculative decoding: tokens in the KV cache of the draft model after the system prompt, and the tokens
+    // drafted for the next step, which are evaluated after the sampled one and kept while the samples agree
+    std::vector<llama_token> cache_tokens_dft;
+    std::vector<llama_token> draft;
+    int32_t i_batch_dft = -1;
+    int32_t n_drafted   = 0;
+    int32_t n_accepted  = 0;
+
+    // n-grams of cache_tokens, for the drafts of prompt lookup decoding
+    llama_ngram_index lookup;
+
+    // KV of cache_tokens after the system prompt, moved to host memory while the slot is idle
+    std::vector<uint8_t> kv_swap;
+
     bool infill = false;
     bool embedding = false;
     bool has_next_token = true;
@@ -410,6 +687,8 @@ struct llama_client_slot
 
     int64_t t_start_process_prompt;
     int64_t t_start_genereration;
+    int64_t t_queued     = 0;
+    int64_t t_last_token = 0;
 
     double t_prompt_processing; // ms
     double t_token_generation; // ms
@@ -426,6 +705,8 @@ struct llama_client_slot
         stopped_limit          = false;
         stopping_word          = "";
         n_past                 = 0;
+        n_drafted              = 0;
+        n_accepted             = 0;
         sent_count             = 0;
         sent_token_probs_index = 0;
         infill                 = false;
@@ -502,1098 +783,2877 @@ struct llama_client_slot
             __func__, t_prompt_processing, num_prompt_tokens_processed, t_prompt_processing / num_prompt_tokens_processed, 1e3 / t_prompt_processing * num_prompt_tokens_processed);
         LOG_TEE("%s:        eval time = %10.2f ms / %5d runs   (%8.2f ms per token, %8.2f tokens per second)\n",
             __func__, t_token_generation, n_decoded,t_token_generation / n_decoded, 1e3 / t_token_generation * n_decoded);
+        if (n_drafted > 0)
+        {
+            LOG_TEE("%s:   draft accepted = %10.2f %% / %5d tokens\n", __func__, 100.0 * n_accepted / n_drafted, n_drafted);
+        }
         LOG_TEE("%s:       total time = %10.2f ms\n", __func__, t_prompt_processing + t_token_generation);
     }
 };
 
-struct llama_server_context
+// histogram of the Prometheus text format, with fixed buckets counted by relaxed atomic increments, so that
+// the task loop can observe values without a lock while /metrics reads them
+struct server_histogram
 {
-    llama_model *model = nullptr;
-    llama_context *ctx = nullptr;
+    std::vector<uint64_t> bounds; // upper bounds of the buckets, in the unit of the observations
+    std::unique_ptr<std::atomic<uint64_t>[]> buckets; // observations in each bucket, the last one is +Inf
+    std::atomic<uint64_t> sum{0};
 
-    clip_ctx *clp_ctx = nullptr;
-
-    gpt_params params;
+    explicit server_histogram(std::vector<uint64_t> bounds_)
+        : bounds(std::move(bounds_)), buckets(new std::atomic<uint64_t>[bounds.size() + 1])
+    {
+        for (size_t i = 0; i <= bounds.size(); ++i)
+        {
+            buckets[i] = 0;
+        }
+    }
 
-    llama_batch batch;
+    void observe(uint64_t value)
+    {
+        const size_t i = std::lower_bound(bounds.begin(), bounds.end(), value) - bounds.begin();
+        buckets[i].fetch_add(1, std::memory_order_relaxed);
+        sum.fetch_add(value, std::memory_order_relaxed);
+    }
 
-    bool multimodal         = false;
-    bool clean_kv_cache     = true;
-    bool all_slots_are_idle = false;
-    bool add_bos_token      = true;
+    // the observations are multiplied by scale, e.g. 1e-6 for microseconds in seconds
+    void format(std::string &out, const char *name, const char *help, double scale) const
+    {
+        char buf[256];
+        snprintf(buf, sizeof(buf), "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+        out += buf;
+        uint64_t count = 0;
+        for (size_t i = 0; i <= bounds.size(); ++i)
+        {
+            count += buckets[i].load(std::memory_order_relaxed);
+            if (i < bounds.size())
+            {
+                snprintf(buf, sizeof(buf), "%s_bucket{le=\"%g\"} %llu\n", name, bounds[i] * scale, (unsigned long long) count);
+            }
+            else
+            {
+                snprintf(buf, sizeof(buf), "%s_bucket{le=\"+Inf\"} %llu\n", name, (unsigned long long) count);
+            }
+            out += buf;
+        }
+        snprintf(buf, sizeof(buf), "%s_sum %g\n%s_count %llu\n", name, sum.load(std::memory_order_relaxed) * scale, name, (unsigned long long) count);
+        out += buf;
+    }
+};
 
-    int32_t id_gen;
-    int32_t n_ctx;  // total context for all clients / slots
+// live metrics of a model, updated by its task loop and served by /metrics
+struct server_metrics
+{
+    std::atomic<uint64_t> n_prompt_tokens{0};    // prompt tokens evaluated
+    std::atomic<uint64_t> t_prompt_us{0};        // from the start of the prompts to their first token
+    std::atomic<uint64_t> n_predicted_tokens{0}; // tokens sampled after the first one
+    std::atomic<uint64_t> t_predicted_us{0};     // between these tokens and the previous ones
+    std::atomic<uint64_t> n_decode{0};           // calls of llama_decode
+
+    // state of the task loop at the start of its last step
+    std::atomic<int> n_processing{0}; // slots with a request
+    std::atomic<int> n_deferred{0};   // requests waiting for a slot, the preempted ones included
+    std::atomic<int> n_kv_used{0};    // cells of the KV cache
+    std::atomic<int> n_kv_size{0};
+
+    // microseconds, and tokens for the batches
+    server_histogram ttft{{10000, 25000, 50000, 100000, 250000, 500000, 1000000, 2500000, 5000000, 10000000, 30000000}};
+    server_histogram itl{{1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000, 1000000}};
+    server_histogram batch_tokens{{1, 2, 4, 8, 16, 32, 64, 128, 256, 512, 1024, 2048}};
+
+    std::string format() const
+    {
+        std::string out;
+        char buf[256];
+        const auto counter = [&](const char *name, const char *help, double value) {
+            snprintf(buf, sizeof(buf), "# HELP %s %s\n# TYPE %s counter\n%s %.10g\n", name, help, name, name, value);
+            out += buf;
+        };
+        const auto gauge = [&](const char *name, const char *help, double value) {
+            snprintf(buf, sizeof(buf), "# HELP %s %s\n# TYPE %s gauge\n%s %.10g\n", name, help, name, name, value);
+            out += buf;
+        };
 
-    // system prompt
-    bool system_need_update = false;
+        const double n_prompt    = n_prompt_tokens.load(std::memory_order_relaxed);
+        const double t_prompt    = t_prompt_us.load(std::memory_order_relaxed) / 1e6;
+        const double n_predicted = n_predicted_tokens.load(std::memory_order_relaxed);
+        const double t_predicted = t_predicted_us.load(std::memory_order_relaxed) / 1e6;
+        const int    n_kv        = n_kv_size.load(std::memory_order_relaxed);
+
+        counter("llamacpp:prompt_tokens_total",         "Number of prompt tokens processed.", n_prompt);
+        counter("llamacpp:prompt_seconds_total",        "Prompt process time.", t_prompt);
+        counter("llamacpp:tokens_predicted_total",      "Number of generation tokens processed.", n_predicted);
+        counter("llamacpp:tokens_predicted_seconds_total", "Predict process time.", t_predicted);
+        counter("llamacpp:decode_total",                "Number of calls of llama_decode.", n_decode.load(std::memory_order_relaxed));
+        gauge("llamacpp:prompt_tokens_seconds",         "Average prompt throughput in tokens/s.", t_prompt > 0 ? n_prompt / t_prompt : 0.0);
+        gauge("llamacpp:predicted_tokens_seconds",      "Average generation throughput in tokens/s.", t_predicted > 0 ? n_predicted / t_predicted : 0.0);
+        gauge("llamacpp:requests_processing",           "Number of requests processing.", n_processing.load(std::memory_order_relaxed));
+        gauge("llamacpp:requests_deferred",             "Number of requests deferred.", n_deferred.load(std::memory_order_relaxed));
+        gauge("llamacpp:kv_cache_tokens",               "KV-cache cells used.", n_kv_used.load(std::memory_order_relaxed));
+        gauge("llamacpp:kv_cache_usage_ratio",          "KV-cache usage. 1 means 100 percent usage.", n_kv > 0 ? (double) n_kv_used.load(std::memory_order_relaxed) / n_kv : 0.0);
+
+        ttft.format        (out, "llamacpp:time_to_first_token_seconds", "Time from the request to its first token.", 1e-6);
+        itl.format         (out, "llamacpp:inter_token_latency_seconds", "Time between the tokens of a request.", 1e-6);
+        batch_tokens.format(out, "llamacpp:decode_batch_tokens", "Tokens of the batches of llama_decode.", 1.0);
+        return out;
+    }
+};
 
-    std::string              system_prompt;
-    std::vector<llama_token> system_tokens;
+// radix tree of the token prefixes evaluated by the slots, shared by all the slots
+// each cached prefix keeps its KV in a sequence of its own, copied from the slot that evaluated it:
+// llama_kv_cache_seq_cp shares the cells, which are freed when no sequence refers to them any more
+// the tokens of the prefixes start with the ones of the system prompt of the slot, so that the prompts of different
+// system prompts do not match, but the cells of the system prompts are held by sequences of their own
+struct server_prefix_cache
+{
+    struct node
+    {
+        std::vector<llama_token> edge; // tokens from the parent
+        std::map<llama_token, std::unique_ptr<node>> children; // by the first token of their edge
+        node *parent  = nullptr;
+        int32_t depth = 0;  // number of tokens from the root to the end of the edge
+        int entry     = -1; // index of the prefix that ends here
+    };
 
-    std::string name_user;      // this should be the antiprompt
-    std::string name_assistant;
+    struct entry
+    {
+        llama_seq_id seq_id;
+        node *end           = nullptr; // nullptr if the entry is free
+        int64_t t_last_used = 0;
+    };
 
-    // slots / clients
-    std::vector<llama_client_slot> slots;
+    int32_t n_min = 32; // shorter prefixes are not cached
 
-    std::vector<task_server> queue_tasks;
-    std::vector<task_result> queue_results;
-    std::vector<task_multi>  queue_multitasks;
-    std::mutex mutex_tasks; // also guards id_gen, and queue_multitasks
-    std::mutex mutex_results;
+    node root;
+    std::vector<entry> entries;
 
-    ~llama_server_context()
+    // the prefixes use the sequences [seq_id_0, seq_id_0 + n_max)
+    void init(llama_seq_id seq_id_0, int32_t n_max)
     {
-        if (ctx)
-        {
-            llama_free(ctx);
-            ctx = nullptr;
-        }
-        if (model)
+        entries.clear();
+        for (int32_t i = 0; i < n_max; i++)
         {
-            llama_free_model(model);
-            model = nullptr;
+            entry e;
+            e.seq_id = seq_id_0 + i;
+            entries.push_back(e);
         }
     }
 
-    bool load_model(const gpt_params &params_)
+    bool enabled() const
     {
-        params = params_;
-        if (!params.mmproj.empty()) {
-            multimodal = true;
-            LOG_TEE("Multi Modal Mode Enabled");
-            clp_ctx = clip_model_load(params.mmproj.c_str(), /*verbosity=*/ 1);
-            if(clp_ctx == nullptr) {
-                LOG_ERROR("unable to load clip model", {{"model", params.mmproj}});
-                return false;
-            }
+        return !entries.empty();
+    }
 
-            if (params.n_ctx < 2048) { // request larger context for the image embedding
-                params.n_ctx = 2048;
+    // deepest point of the tree on the path of tokens: returns the number of matched tokens and the
+    // node whose subtree holds all the prefixes that start with them
+    int32_t match(const std::vector<llama_token> &tokens, node *&out)
+    {
+        node *cur = &root;
+        int32_t n = 0;
+        out = cur;
+        while (n < (int32_t) tokens.size())
+        {
+            auto it = cur->children.find(tokens[n]);
+            if (it == cur->children.end())
+            {
+                break;
+            }
+            node *child = it->second.get();
+            size_t k = 0;
+            while (k < child->edge.size() && n < (int32_t) tokens.size() && child->edge[k] == tokens[n])
+            {
+                k++;
+                n++;
+            }
+            out = child;
+            if (k < child->edge.size())
+            {
+                break;
             }
+            cur = child;
         }
+        return n;
+    }
 
-        std::tie(model, ctx) = llama_init_from_gpt_params(params);
-        if (model == nullptr)
+    static int find_entry(const node *cur)
+    {
+        if (cur->entry >= 0)
         {
-            LOG_ERROR("unable to load model", {{"model", params.model}});
-            return false;
+            return cur->entry;
         }
-
-        if (multimodal) {
-            const int n_embd_clip = clip_n_mmproj_embd(clp_ctx);
-            const int n_embd_llm  = llama_n_embd(model);
-            if (n_embd_clip != n_embd_llm) {
-                LOG_TEE("%s: embedding dim of the multimodal projector (%d) is not equal to that of LLaMA (%d). Make sure that you use the correct mmproj file.\n", __func__, n_embd_clip, n_embd_llm);
-                llama_free(ctx);
-                llama_free_model(model);
-                return false;
+        for (const auto &it : cur->children)
+        {
+            const int i = find_entry(it.second.get());
+            if (i >= 0)
+            {
+                return i;
             }
         }
-
-        n_ctx = llama_n_ctx(ctx);
-
-        add_bos_token = llama_should_add_bos_token(model);
-
-        return true;
+        return -1;
     }
 
-    void initialize() {
-        id_gen = 0;
-
-        // create slots
-        all_slots_are_idle = true;
-
-        const int32_t n_ctx_slot = n_ctx / params.n_parallel;
-
-        LOG_TEE("Available slots:\n");
-        for (int i = 0; i < params.n_parallel; i++)
+    // longest cached prefix of tokens: returns its length and the sequence that holds it
+    int32_t find(const std::vector<llama_token> &tokens, llama_seq_id &seq_id)
+    {
+        node *end = nullptr;
+        const int32_t n = match(tokens, end);
+        const int i = find_entry(end);
+        if (n == 0 || i < 0)
         {
-            llama_client_slot slot;
-
-            slot.id = i;
-            slot.n_ctx = n_ctx_slot;
-            slot.reset();
-
-            LOG_TEE(" -> Slot %i - max context: %i\n", slot.id, n_ctx_slot);
-            slots.push_back(slot);
+            return 0;
         }
+        entries[i].t_last_used = ggml_time_us();
+        seq_id = entries[i].seq_id;
+        return n;
+    }
 
-        batch = llama_batch_init(n_ctx, 0, params.n_parallel);
-
-        // empty system prompt
-        system_prompt = "";
-        system_tokens.clear();
+    // number of tokens that tokens shares with a cached prefix
+    int32_t overlap(const std::vector<llama_token> &tokens)
+    {
+        node *end = nullptr;
+        return match(tokens, end);
     }
 
-    std::vector<llama_token> tokenize(const json & json_prompt, bool add_bos) const
+    // caches the first n tokens, evaluated in the sequence seq_id_src, whose first n_system ones are the system prompt
+    void insert(llama_context *ctx, const std::vector<llama_token> &tokens, int32_t n, llama_seq_id seq_id_src, int32_t n_system)
     {
-        // TODO: currently, we tokenize using special tokens by default
-        //       this is not always correct (see https://github.com/ggerganov/llama.cpp/pull/4160#issuecomment-1824826216)
-        //       but it's better compared to completely ignoring ChatML and other chat templates
-        const bool TMP_FORCE_SPECIAL = true;
+        if (!enabled() || n - n_system < n_min)
+        {
+            return;
+        }
 
-        // If `add_bos` is true, we only add BOS, when json_prompt is a string,
-        // or the first element of the json_prompt array is a string.
-        std::vector<llama_token> prompt_tokens;
+        // look for the prefixes on the path first: removing them may merge the nodes of the path
+        node *end = nullptr;
+        const std::vector<llama_token> prefix(tokens.begin(), tokens.begin() + n);
+        const int32_t n_match = match(prefix, end);
+        if (n_match == n)
+        {
+            // a longer prefix holds this one already
+            const int i_longer = find_entry(end);
+            if (i_longer >= 0 && entries[i_longer].end->depth >= n)
+            {
+                entries[i_longer].t_last_used = ggml_time_us();
+                return;
+            }
+        }
 
-        if (json_prompt.is_array())
+        // the shorter prefix on the path is held by this one from now on
+        // an entry has no cached prefix above it, so there is at most one
+        for (node *p = end->depth > n_match ? end->parent : end; p != nullptr; p = p->parent)
         {
-            bool first = true;
-            for (const auto& p : json_prompt)
+            if (p->entry >= 0)
             {
-                if (p.is_string())
-                {
-                    auto s = p.template get<std::string>();
-                    std::vector<llama_token> p;
-                    if (first)
-                    {
-                        p = ::llama_tokenize(ctx, s, add_bos, TMP_FORCE_SPECIAL);
-                        first = false;
-                    }
-                    else
-                    {
-                        p = ::llama_tokenize(ctx, s, false, TMP_FORCE_SPECIAL);
-                    }
-                    prompt_tokens.insert(prompt_tokens.end(), p.begin(), p.end());
-                }
-                else
-                {
-                    if (first)
-                    {
-                        first = false;
-                    }
-                    prompt_tokens.push_back(p.template get<llama_token>());
-                }
+                remove(ctx, p->entry);
+                break;
             }
         }
-        else
+
+        int i_entry = -1;
+        for (size_t j = 0; j < entries.size(); j++)
         {
-            auto s = json_prompt.template get<std::string>();
-            prompt_tokens = ::llama_tokenize(ctx, s, add_bos, TMP_FORCE_SPECIAL);
+            if (entries[j].end == nullptr)
+            {
+                i_entry = j;
+                break;
+            }
+        }
+        if (i_entry < 0)
+        {
+            i_entry = lru();
+            remove(ctx, i_entry);
         }
 
-        return prompt_tokens;
-    }
-
-    llama_client_slot* get_slot(int id) {
-        int64_t t_last = ggml_time_us();
-        llama_client_slot *last_used = nullptr;
-
-        for (llama_client_slot & slot : slots)
+        // split or extend the tree so that a node ends after n tokens
+        node *cur = &root;
+        int32_t i = 0;
+        while (i < n)
         {
-            if (slot.id == id && slot.available())
+            auto it = cur->children.find(tokens[i]);
+            if (it == cur->children.end())
             {
-                return &slot;
+                std::unique_ptr<node> child(new node());
+                child->edge.assign(tokens.begin() + i, tokens.begin() + n);
+                child->parent = cur;
+                child->depth  = n;
+                node *next = child.get();
+                cur->children[tokens[i]] = std::move(child);
+                cur = next;
+                break;
             }
 
-            if (slot.available() && slot.t_last_used < t_last)
+            node *child = it->second.get();
+            size_t k = 0;
+            while (k < child->edge.size() && i < n && child->edge[k] == tokens[i])
             {
-                last_used = &slot;
-                t_last = slot.t_last_used;
+                k++;
+                i++;
+            }
+            if (k < child->edge.size())
+            {
+                // the new prefix ends or forks inside the edge
+                std::unique_ptr<node> mid(new node());
+                mid->edge.assign(child->edge.begin(), child->edge.begin() + k);
+                mid->parent = cur;
+                mid->depth  = child->depth - (int32_t) (child->edge.size() - k);
+
+                std::unique_ptr<node> rest = std::move(it->second);
+                rest->edge.erase(rest->edge.begin(), rest->edge.begin() + k);
+                rest->parent = mid.get();
+                mid->children[rest->edge[0]] = std::move(rest);
+
+                node *next = mid.get();
+                it->second = std::move(mid);
+                child = next;
             }
+            cur = child;
         }
 
-        return last_used;
-    }
-
-    bool launch_slot_with_data(llama_client_slot* &slot, json data) {
-        slot_params default_params;
-        llama_sampling_params default_sparams;
+        entry &e = entries[i_entry];
+        e.end = cur;
+        e.t_last_used = ggml_time_us();
+        cur->entry = i_entry;
 
-        if (data.count("__oaicompat") != 0) {
-            slot->oaicompat = true;
-            slot->oaicompat_model = json_value(data, "model", std::string(DEFAULT_OAICOMPAT_MODEL));
-        } else {
-            slot->oaicompat = false;
-            slot->oaicompat_model = "";
-        }
+        llama_kv_cache_seq_cp(ctx, seq_id_src, e.seq_id, n_system, n);
 
-        slot->params.stream           = json_value(data, "stream",            false);
-        slot->params.cache_prompt     = json_value(data, "cache_prompt",      false);
-        slot->params.n_predict        = json_value(data, "n_predict",         default_params.n_predict);
-        slot->sparams.top_k           = json_value(data, "top_k",             default_sparams.top_k);
-        slot->sparams.top_p           = json_value(data, "top_p",             default_sparams.top_p);
-        slot->sparams.min_p           = json_value(data, "min_p",             default_sparams.min_p);
-        slot->sparams.tfs_z           = json_value(data, "tfs_z",             default_sparams.tfs_z);
-        slot->sparams.typical_p       = json_value(data, "typical_p",         default_sparams.typical_p);
-        slot->sparams.temp            = json_value(data, "temperature",       default_sparams.temp);
-        slot->sparams.penalty_last_n  = json_value(data, "repeat_last_n",     default_sparams.penalty_last_n);
-        slot->sparams.penalty_repeat  = json_value(data, "repeat_penalty",    default_sparams.penalty_repeat);
-        slot->sparams.penalty_freq    = json_value(data, "frequency_penalty", default_sparams.penalty_freq);
-        slot->sparams.penalty_present = json_value(data, "presence_penalty",  default_sparams.penalty_present);
-        slot->sparams.mirostat        = json_value(data, "mirostat",          default_sparams.mirostat);
-        slot->sparams.mirostat_tau    = json_value(data, "mirostat_tau",      default_sparams.mirostat_tau);
-        slot->sparams.mirostat_eta    = json_value(data, "mirostat_eta",      default_sparams.mirostat_eta);
-        slot->sparams.penalize_nl     = json_value(data, "penalize_nl",       default_sparams.penalize_nl);
-        slot->params.n_keep           = json_value(data, "n_keep",            slot->params.n_keep);
-        slot->params.seed             = json_value(data, "seed",              default_params.seed);
-        slot->sparams.grammar         = json_value(data, "grammar",           default_sparams.grammar);
-        slot->sparams.n_probs         = json_value(data, "n_probs",           default_sparams.n_probs);
+        LOG_VERBOSE("prefix cached", {
+            {"seq_id",   e.seq_id},
+            {"n_tokens", n},
+        });
+    }
 
-        // infill
-        if (data.count("input_prefix") != 0)
+    int lru() const
+    {
+        int i_lru = -1;
+        for (size_t i = 0; i < entries.size(); i++)
         {
-            slot->params.input_prefix = data["input_prefix"];
+            if (entries[i].end != nullptr && (i_lru < 0 || entries[i].t_last_used < entries[i_lru].t_last_used))
+            {
+                i_lru = i;
+            }
         }
-        else
+        return i_lru;
+    }
+
+    // frees the least recently used prefix, returns false if there is none
+    bool evict(llama_context *ctx)
+    {
+        const int i = lru();
+        if (i < 0)
         {
-            slot->params.input_prefix = "";
+            return false;
         }
+        LOG_TEE("prefix cache: evicting %d tokens\n", entries[i].end->depth);
+        remove(ctx, i);
+        return true;
+    }
 
-        if (data.count("input_suffix") != 0)
+    void remove(llama_context *ctx, int i)
+    {
+        entry &e = entries[i];
+        node *cur = e.end;
+        if (cur == nullptr)
         {
-            slot->params.input_suffix = data["input_suffix"];
+            return;
         }
-        else
+
+        if (ctx != nullptr)
         {
-            slot->params.input_suffix = "";
+            llama_kv_cache_seq_rm(ctx, e.seq_id, -1, -1);
         }
+        cur->entry = -1;
+        e.end = nullptr;
 
-        if (data.count("prompt") != 0)
+        // remove the nodes that lead to no prefix, and merge the node left with a single child
+        while (cur != &root && cur->entry < 0 && cur->children.empty())
         {
-            slot->prompt = data["prompt"];
+            node *parent = cur->parent;
+            const llama_token key = cur->edge[0];
+            parent->children.erase(key);
+            cur = parent;
         }
-        else
+        if (cur != &root && cur->entry < 0 && cur->children.size() == 1)
         {
-            slot->prompt = "";
+            std::unique_ptr<node> child = std::move(cur->children.begin()->second);
+            cur->children.clear();
+            cur->edge.insert(cur->edge.end(), child->edge.begin(), child->edge.end());
+            cur->depth    = child->depth;
+            cur->entry    = child->entry;
+            cur->children = std::move(child->children);
+            for (auto &it : cur->children)
+            {
+                it.second->parent = cur;
+            }
+            if (cur->entry >= 0)
+            {
+                entries[cur->entry].end = cur;
+            }
         }
+    }
 
-        slot->sparams.logit_bias.clear();
+    // forgets all the prefixes, ctx is nullptr if their KV is already gone
+    void clear(llama_context *ctx)
+    {
+        for (size_t i = 0; i < entries.size(); i++)
+        {
+            remove(ctx, i);
+        }
+    }
+};
 
-        if (json_value(data, "ignore_eos", false))
+// a system prompt, evaluated once in a sequence of its own: the slots that use it copy its cells with
+// llama_kv_cache_seq_cp, which shares them, so that it is never evaluated again for a slot
+struct server_system_prompt
+{
+    int id = 0; // version, the requests select it with "system_prompt_id"
+
+    std::string prompt;
+    std::string name_user;      // this should be the antiprompt
+    std::string name_assistant;
+
+    std::vector<llama_token> tokens;
+    llama_seq_id seq_id      = -1; // -1 for an empty prompt
+    int64_t      t_last_used = 0;
+};
+
+// embeddings of the recently encoded images, by a hash of their pixels: an image sent again, e.g. with each turn of a
+// chat, is not encoded again. The pixels are compared on a hit, the least recently used image is evicted first
+struct server_image_cache
+{
+    struct entry
+    {
+        uint64_t hash;
+        int nx;
+        int ny;
+        std::vector<uint8_t> pixels;
+        std::vector<float> embedding;
+    };
+
+    size_t n_max = 0; // 0 = disabled
+
+    std::list<entry> entries; // most recently used first
+    std::multimap<uint64_t, std::list<entry>::iterator> by_hash;
+
+    static uint64_t hash(const clip_image_u8 &img)
+    {
+        // FNV-1a
+        uint64_t h = 14695981039346656037ULL;
+        auto add = [&h](const uint8_t *data, size_t size)
         {
-            slot->sparams.logit_bias[llama_token_eos(model)] = -INFINITY;
+            for (size_t i = 0; i < size; i++)
+            {
+                h ^= data[i];
+                h *= 1099511628211ULL;
+            }
+        };
+        add((const uint8_t *) &img.nx, sizeof(img.nx));
+        add((const uint8_t *) &img.ny, sizeof(img.ny));
+        add(img.data, img.size);
+        return h;
+    }
+
+    // copies the embedding of img to embedding, returns false if it is not cached
+    bool find(const clip_image_u8 &img, uint64_t h, float *embedding)
+    {
+        auto range = by_hash.equal_range(h);
+        for (auto it = range.first; it != range.second; ++it)
+        {
+            auto e = it->second;
+            if (e->nx == img.nx && e->ny == img.ny && e->pixels.size() == img.size &&
+                memcmp(e->pixels.data(), img.data, img.size) == 0)
+            {
+                memcpy(embedding, e->embedding.data(), e->embedding.size()*sizeof(float));
+                entries.splice(entries.begin(), entries, e);
+                return true;
+            }
         }
+        return false;
+    }
 
-        const auto &logit_bias = data.find("logit_bias");
-        if (logit_bias != data.end() && logit_bias->is_array())
+    void insert(const clip_image_u8 &img, uint64_t h, const float *embedding, size_t n_embd)
+    {
+        if (n_max == 0)
         {
-            const int n_vocab = llama_n_vocab(model);
-            for (const auto &el : *logit_bias)
+            return;
+        }
+        while (entries.size() >= n_max)
+        {
+            auto last = std::prev(entries.end());
+            auto range = by_hash.equal_range(last->hash);
+            for (auto it = range.first; it != range.second; ++it)
             {
-                if (el.is_array() && el.size() == 2 && el[0].is_number_integer())
+                if (it->second == last)
                 {
-                    llama_token tok = el[0].get<llama_token>();
-                    if (tok >= 0 && tok < n_vocab)
-                    {
-                        if (el[1].is_number())
-                        {
-                            slot->sparams.logit_bias[tok] = el[1].get<float>();
-                        }
-                        else if (el[1].is_boolean() && !el[1].get<bool>())
-                        {
-                            slot->sparams.logit_bias[tok] = -INFINITY;
-                        }
-                    }
+                    by_hash.erase(it);
+                    break;
                 }
             }
+            entries.pop_back();
         }
+        entry e;
+        e.hash = h;
+        e.nx   = img.nx;
+        e.ny   = img.ny;
+        e.pixels.assign(img.data, img.data + img.size);
+        e.embedding.assign(embedding, embedding + n_embd);
+        entries.push_front(std::move(e));
+        by_hash.emplace(h, entries.begin());
+    }
+};
 
-        slot->params.antiprompt.clear();
+struct llama_server_context
+{
+    llama_model *model = nullptr;
+    llama_context *ctx = nullptr;
 
-        const auto &stop = data.find("stop");
-        if (stop != data.end() && stop->is_array())
+    clip_ctx *clp_ctx = nullptr;
+
+    // embeddings of the recent images, reused when a client sends the same image again
+    server_image_cache image_cache;
+
+    gpt_params params;
+
+    llama_batch batch = {};
+
+    // draft model of the speculative decoding, its sequences are the ones of the slots
+    llama_model   *model_dft = nullptr;
+    llama_context *ctx_dft   = nullptr;
+    llama_batch    batch_dft;
+
+    // n-grams of the contexts of all the slots, and of the previous runs, for the lookup drafts of the slots that
+    // find none in their own context. Saved to params.path_ngram_pool at most every minute, after a request
+    llama_ngram_pool ngram_pool;
+    int64_t          ngram_pool_saved   = 0; // n_total at the last save
+    int64_t          t_ngram_pool_saved = 0;
+
+    bool multimodal         = false;
+    bool clean_kv_cache     = true;
+    bool all_slots_are_idle = false;
+    bool add_bos_token      = true;
+
+    int32_t id_gen;
+    int32_t n_ctx;  // total context for all clients / slots
+
+    // system prompts, the version 0 is the empty one. Changing the default one does not wait for the slots:
+    // the ones that use the previous version keep it until their next request
+    // the versions that no slot uses are evicted beyond n_system_prompts, the least recently used first
+    std::vector<server_system_prompt> system_prompts;
+    int     system_id_default = 0;
+    int     system_id_next    = 1;
+    int32_t n_system_prompts  = 4;
+    json    system_prompt_init; // default system prompt given before the model is loaded
+
+    // values of the dynamic_grammar of the requests that are passed to the grammar provider, the others are rejected
+    std::vector<std::string> dynamic_grammars;
+
+    // slots / clients
+    std::vector<llama_client_slot> slots;
+
+    // context size of each slot, 0 = n_ctx / n_parallel
+    // the slots may hold more cells than the KV cache has: the idle ones are then swapped out to host memory
+    int32_t n_ctx_slot = 0;
+
+    // prefixes of the prompts, reused by all the slots
+    int32_t n_prefix_cache = 0;
+    server_prefix_cache prefix_cache;
+
+    // tokens evaluated by each step of update_slots, 0 = unlimited: the prompts are evaluated whole
+    // the generating slots take one token each and the prompts share the rest, so long prompts do not stall them
+    int32_t n_step_tokens = 0;
+    // share of n_step_tokens left to the prompts when many slots are generating
+    float   prefill_ratio = 0.25f;
+
+    std::vector<task_server> queue_tasks;
+    std::vector<task_server> queue_pending; // completion tasks waiting for a slot
+    std::vector<task_multi>  queue_multitasks;
+
+    // embedding requests, moved to embd_tasks by process_tasks
+    std::vector<task_embedding> queue_embeddings;
+
+    // embedding requests of the task loop, the inputs are evaluated in order: embd_pos tokens of the input
+    // embd_input of the first one are in the KV cache, in the sequence embd_seq
+    std::deque<task_embedding> embd_tasks;
+    size_t       embd_input    = 0;
+    int32_t      embd_pos      = 0;
+    llama_seq_id embd_seq      = 0;
+    int32_t      embd_seq_next = 0;
+
+    // preempted slots, with their KV in host memory, waiting to resume in a free slot
+    std::vector<llama_client_slot> parked_slots;
+    std::mutex mutex_tasks; // also guards id_gen, queue_multitasks, queue_embeddings and wake_pending
+    std::condition_variable condition_tasks; // the task loop waits on it while all the slots are idle
+    bool wake_pending = false;
+
+    // channel of each task with a request waiting for its results, the results of the other tasks are dropped
+    // the subtasks of a multitask have none, their results are collected by update_multi_task
+    std::unordered_map<int, task_channel> queue_results;
+    std::mutex mutex_results;
+
+    server_metrics metrics;
+
+    ~llama_server_context()
+    {
+        for (llama_client_slot &slot : slots)
         {
-            for (const auto &word : *stop)
+            if (slot.ctx_sampling != nullptr)
             {
-                if (!word.empty())
-                {
-                    slot->params.antiprompt.push_back(word);
-                }
+                llama_sampling_free(slot.ctx_sampling);
+                slot.ctx_sampling = nullptr;
+            }
+        }
+        for (llama_client_slot &slot : parked_slots)
+        {
+            llama_sampling_free(slot.ctx_sampling);
+        }
+        if (ctx_dft)
+        {
+            llama_batch_free(batch_dft);
+            llama_free(ctx_dft);
+            llama_free_model(model_dft);
+            ctx_dft = nullptr;
+        }
+        llama_batch_free(batch);
+        if (ctx)
+        {
+            llama_free(ctx);
+            ctx = nullptr;
+        }
+        if (model)
+        {
+            llama_free_model(model);
+            model = nullptr;
+        }
+    }
+
+    bool load_model(const gpt_params &params_)
+    {
+        params = params_;
+        if (!params.mmproj.empty()) {
+            multimodal = true;
+            LOG_TEE("Multi Modal Mode Enabled");
+            clp_ctx = clip_model_load(params.mmproj.c_str(), /*verbosity=*/ 1);
+            if(clp_ctx == nullptr) {
+                LOG_ERROR("unable to load clip model", {{"model", params.mmproj}});
+                return false;
+            }
+
+            if (params.n_ctx < 2048) { // request larger context for the image embedding
+                params.n_ctx = 2048;
             }
         }
 
-        if (multimodal)
+        std::tie(model, ctx) = llama_init_from_gpt_params(params);
+        if (model == nullptr)
         {
-            const auto &images_data = data.find("image_data");
-            if (images_data != data.end() && images_data->is_array())
-            {
-                for (const auto &img : *images_data)
-                {
-                    std::string data_b64 = img["data"].get<std::string>();
-                    slot_image img_sl;
-                    img_sl.id = img.count("id") != 0 ? img["id"].get<int>() : slot->images.size();
-                    int width, height, channels;
-                    std::vector<uint8_t> image_buffer = base64_decode(data_b64);
-                    data_b64.clear();
-                    auto data = stbi_load_from_memory(image_buffer.data(), image_buffer.size(), &width, &height, &channels, 3);
-                    if (!data) {
-                        LOG_TEE("slot %i - failed to load image [id: %i]\n", slot->id, img_sl.id);
-                        return false;
+            LOG_ERROR("unable to load model", {{"model", params.model}});
+            return false;
+        }
+
+        if (multimodal) {
+            const int n_embd_clip = clip_n_mmproj_embd(clp_ctx);
+            const int n_embd_llm  = llama_n_embd(model);
+            if (n_embd_clip != n_embd_llm) {
+                LOG_TEE("%s: embedding dim of the multimodal projector (%d) is not equal to that of LLaMA (%d). Make sure that you use the correct mmproj file.\n", __func__, n_embd_clip, n_embd_llm);
+                llama_free(ctx);
+                llama_free_model(model);
+                return false;
+            }
+        }
+
+        if (!params.model_draft.empty())
+        {
+            gpt_params params_dft = params;
+            params_dft.model = params.model_draft;
+            params_dft.lora_adapter.clear();
+            params_dft.lora_base = "";
+            if (params.n_gpu_layers_draft != -1)
+            {
+                params_dft.n_gpu_layers = params.n_gpu_layers_draft;
+            }
+
+            std::tie(model_dft, ctx_dft) = llama_init_from_gpt_params(params_dft);
+            if (model_dft == nullptr)
+            {
+                LOG_ERROR("unable to load draft model", {{"model", params.model_draft}});
+                return false;
+            }
+
+            // the drafted tokens are evaluated by the model as they are, the vocabularies must be the same
+            // up to a few added tokens, which are never drafted
+            if (llama_vocab_type(model_dft) != llama_vocab_type(model) ||
+                std::abs(llama_n_vocab(model_dft) - llama_n_vocab(model)) > 100)
+            {
+                LOG_ERROR("the vocabulary of the draft model does not match the one of the model", {
+                    {"n_vocab", llama_n_vocab(model)},
+                    {"n_vocab_draft", llama_n_vocab(model_dft)},
+                });
+                llama_free(ctx_dft);
+                llama_free_model(model_dft);
+                ctx_dft   = nullptr;
+                model_dft = nullptr;
+                return false;
+            }
+        }
+
+        if (!params.path_ngram_pool.empty())
+        {
+            // the sizes of lookahead decoding
+            ngram_pool.init(llama_n_vocab(model), 5, 15);
+
+            FILE *fp = std::fopen(params.path_ngram_pool.c_str(), "rb");
+            if (fp != nullptr)
+            {
+                std::fclose(fp);
+                if (!ngram_pool.load(params.path_ngram_pool))
+                {
+                    LOG_ERROR("unable to load the n-gram pool", {{"path", params.path_ngram_pool}});
+                    return false;
+                }
+            }
+            ngram_pool_saved = ngram_pool.n_total;
+
+            LOG_INFO("n-gram pool", {{"path", params.path_ngram_pool}, {"n_ngrams", ngram_pool_saved}});
+            if (params.n_lookup_ngram <= 0)
+            {
+                LOG_WARNING("the n-gram pool is only used with --lookup-ngram", {});
+            }
+        }
+
+        n_ctx = llama_n_ctx(ctx);
+
+        add_bos_token = llama_should_add_bos_token(model);
+
+        return true;
+    }
+
+    // saves the n-gram pool if it has new n-grams and was not saved in the last minute, through a temporary file so
+    // that the previous file stays whole if the server stops while it writes
+    void save_ngram_pool()
+    {
+        const int64_t t_now = ggml_time_us();
+        if (params.path_ngram_pool.empty() || ngram_pool.n_total == ngram_pool_saved || t_now - t_ngram_pool_saved < 60*1000000LL)
+        {
+            return;
+        }
+
+        const std::string path_tmp = params.path_ngram_pool + ".tmp";
+        if (!ngram_pool.save(path_tmp) || std::rename(path_tmp.c_str(), params.path_ngram_pool.c_str()) != 0)
+        {
+            LOG_WARNING("unable to save the n-gram pool", {{"path", params.path_ngram_pool}});
+        }
+        ngram_pool_saved   = ngram_pool.n_total;
+        t_ngram_pool_saved = t_now;
+    }
+
+    void initialize() {
+        id_gen = 0;
+
+        // create slots
+        all_slots_are_idle = true;
+
+        if (n_ctx_slot <= 0 || n_ctx_slot > n_ctx)
+        {
+            n_ctx_slot = n_ctx / params.n_parallel;
+        }
+
+        LOG_TEE("Available slots:\n");
+        for (int i = 0; i < params.n_parallel; i++)
+        {
+            llama_client_slot slot;
+
+            slot.id = i;
+            slot.n_ctx = n_ctx_slot;
+            slot.reset();
+
+            LOG_TEE(" -> Slot %i - max context: %i\n", slot.id, n_ctx_slot);
+            slots.push_back(slot);
+        }
+
+        batch = llama_batch_init(std::max(n_ctx, n_ctx_slot*params.n_parallel), 0, params.n_parallel);
+        if (ctx_dft != nullptr)
+        {
+            batch_dft = llama_batch_init(std::max(n_ctx, n_ctx_slot*params.n_parallel), 0, 1);
+        }
+
+        // the cached prefixes use the sequences after the ones of the slots
+        prefix_cache.init(params.n_parallel, n_prefix_cache);
+
+        // the empty system prompt, then the one given before the model was loaded
+        system_prompts.clear();
+        system_prompts.emplace_back();
+        system_id_default = 0;
+        if (!system_prompt_init.is_null())
+        {
+            process_system_prompt_data(system_prompt_init);
+        }
+    }
+
+    std::vector<llama_token> tokenize(const json & json_prompt, bool add_bos) const
+    {
+        // TODO: currently, we tokenize using special tokens by default
+        //       this is not always correct (see https://github.com/ggerganov/llama.cpp/pull/4160#issuecomment-1824826216)
+        //       but it's better compared to completely ignoring ChatML and other chat templates
+        const bool TMP_FORCE_SPECIAL = true;
+
+        // If `add_bos` is true, we only add BOS, when json_prompt is a string,
+        // or the first element of the json_prompt array is a string.
+        std::vector<llama_token> prompt_tokens;
+
+        if (json_prompt.is_array())
+        {
+            bool first = true;
+            for (const auto& p : json_prompt)
+            {
+                if (p.is_string())
+                {
+                    auto s = p.template get<std::string>();
+                    std::vector<llama_token> p;
+                    if (first)
+                    {
+                        p = ::llama_tokenize(ctx, s, add_bos, TMP_FORCE_SPECIAL);
+                        first = false;
                     }
-                    LOG_TEE("slot %i - image loaded [id: %i] resolution (%i x %i)\n", slot->id, img_sl.id, width, height);
-                    img_sl.img_data.nx = width;
-                    img_sl.img_data.ny = height;
-                    img_sl.img_data.size = width * height * 3;
-                    img_sl.img_data.data = new uint8_t[width * height * 3]();
-                    memcpy(img_sl.img_data.data, data, width * height * 3);
-                    stbi_image_free(data);
-                    img_sl.request_encode_image = true;
-                    slot->images.push_back(img_sl);
+                    else
+                    {
+                        p = ::llama_tokenize(ctx, s, false, TMP_FORCE_SPECIAL);
+                    }
+                    prompt_tokens.insert(prompt_tokens.end(), p.begin(), p.end());
                 }
-                // process prompt
-                // example: system prompt [img-102] user [img-103] describe [img-134] -> [{id: 102, prefix: 'system prompt '}, {id: 103, prefix: ' user '}, {id: 134, prefix: ' describe '}]}
-                if (slot->images.size() > 0 && !slot->prompt.is_array())
+                else
                 {
-                    std::string prompt = slot->prompt.get<std::string>();
-                    size_t pos = 0, begin_prefix = 0;
-                    std::string pattern = "[img-";
-                    while ((pos = prompt.find(pattern, pos)) != std::string::npos) {
-                        size_t end_prefix = pos;
-                        pos += pattern.length();
-                        size_t end_pos = prompt.find("]", pos);
-                        if (end_pos != std::string::npos)
-                        {
-                            std::string image_id = prompt.substr(pos, end_pos - pos);
-                            try
-                            {
-                                int img_id = std::stoi(image_id);
-                                bool found = false;
-                                for (slot_image &img : slot->images)
-                                {
-                                    if (img.id == img_id) {
-                                        found = true;
-                                        img.prefix_prompt = prompt.substr(begin_prefix, end_prefix - begin_prefix);
-                                        begin_prefix = end_pos + 1;
-                                        break;
-                                    }
-                                }
-                                if (!found) {
-                                    LOG_TEE("ERROR: Image with id: %i, not found.\n", img_id);
-                                    slot->images.clear();
-                                    return false;
-                                }
-                            } catch (const std::invalid_argument& e) {
-                                LOG_TEE("Invalid image number id in prompt\n");
-                                slot->images.clear();
-                                return false;
-                            }
-                        }
+                    if (first)
+                    {
+                        first = false;
                     }
-                    slot->prompt = "";
-                    slot->params.input_suffix = prompt.substr(begin_prefix);
-                    slot->params.cache_prompt = false; // multimodal doesn't support cache prompt
+                    prompt_tokens.push_back(p.template get<llama_token>());
                 }
             }
         }
+        else
+        {
+            auto s = json_prompt.template get<std::string>();
+            prompt_tokens = ::llama_tokenize(ctx, s, add_bos, TMP_FORCE_SPECIAL);
+        }
+
+        return prompt_tokens;
+    }
+
+    // the free slot of the given id, else the least recently used one, preferably among the ones that have the
+    // system prompt of version system_id already
+    llama_client_slot* get_slot(int id, int system_id = -1) {
+        int64_t t_last = ggml_time_us();
+        llama_client_slot *last_used = nullptr;
+
+        for (llama_client_slot & slot : slots)
+        {
+            if (slot.id == id && slot.available())
+            {
+                return &slot;
+            }
+
+            if (slot.available() && (last_used == nullptr ||
+                (slot.system_id == system_id) > (last_used->system_id == system_id) ||
+                ((slot.system_id == system_id) == (last_used->system_id == system_id) && slot.t_last_used < t_last)))
+            {
+                last_used = &slot;
+                t_last = slot.t_last_used;
+            }
+        }
+
+        return last_used;
+    }
+
+    bool launch_slot_with_data(llama_client_slot* &slot, json data) {
+        slot_params default_params;
+        llama_sampling_params default_sparams;
+
+        if (data.count("__oaicompat") != 0) {
+            slot->oaicompat = true;
+            slot->oaicompat_model = json_value(data, "model", std::string(DEFAULT_OAICOMPAT_MODEL));
+        } else {
+            slot->oaicompat = false;
+            slot->oaicompat_model = "";
+        }
+
+        slot->params.stream           = json_value(data, "stream",            false);
+        slot->params.cache_prompt     = json_value(data, "cache_prompt",      false);
+        slot->params.n_predict        = json_value(data, "n_predict",         default_params.n_predict);
+        slot->sparams.top_k           = json_value(data, "top_k",             default_sparams.top_k);
+        slot->sparams.top_p           = json_value(data, "top_p",             default_sparams.top_p);
+        slot->sparams.min_p           = json_value(data, "min_p",             default_sparams.min_p);
+        slot->sparams.tfs_z           = json_value(data, "tfs_z",             default_sparams.tfs_z);
+        slot->sparams.typical_p       = json_value(data, "typical_p",         default_sparams.typical_p);
+        slot->sparams.temp            = json_value(data, "temperature",       default_sparams.temp);
+        slot->sparams.penalty_last_n  = json_value(data, "repeat_last_n",     default_sparams.penalty_last_n);
+        slot->sparams.penalty_repeat  = json_value(data, "repeat_penalty",    default_sparams.penalty_repeat);
+        slot->sparams.penalty_freq    = json_value(data, "frequency_penalty", default_sparams.penalty_freq);
+        slot->sparams.penalty_present = json_value(data, "presence_penalty",  default_sparams.penalty_present);
+        slot->sparams.mirostat        = json_value(data, "mirostat",          default_sparams.mirostat);
+        slot->sparams.mirostat_tau    = json_value(data, "mirostat_tau",      default_sparams.mirostat_tau);
+        slot->sparams.mirostat_eta    = json_value(data, "mirostat_eta",      default_sparams.mirostat_eta);
+        slot->sparams.penalize_nl     = json_value(data, "penalize_nl",       default_sparams.penalize_nl);
+        slot->params.n_keep           = json_value(data, "n_keep",            slot->params.n_keep);
+        slot->params.n_discard        = json_value(data, "n_discard",         default_params.n_discard);
+        slot->params.seed             = json_value(data, "seed",              default_params.seed);
+        slot->sparams.grammar         = json_value(data, "grammar",           default_sparams.grammar);
+        slot->sparams.n_probs         = json_value(data, "n_probs",           default_sparams.n_probs);
+
+        // the LSP command and the prelude it type checks against are set on the command line only, and the
+        // targets a request may ask for are the ones allowed with --dynamic-grammar-allow
+        slot->sparams.dynamic_grammar         = json_value(data, "dynamic_grammar", default_sparams.dynamic_grammar);
+        if (!slot->sparams.dynamic_grammar.empty() &&
+            std::find(dynamic_grammars.begin(), dynamic_grammars.end(), slot->sparams.dynamic_grammar) == dynamic_grammars.end())
+        {
+            LOG_TEE("slot %i - dynamic grammar not allowed: %s [task id: %i]\n", slot->id, slot->sparams.dynamic_grammar.c_str(), slot->task_id);
+            return false;
+        }
+        slot->sparams.dynamic_grammar_cmd     = params.sparams.dynamic_grammar_cmd;
+        slot->sparams.dynamic_grammar_prelude = params.sparams.dynamic_grammar_prelude;
+        // each candidate prefetched is a session of the LSP, a request may lower the number set on the command line
+        slot->sparams.grammar_prefetch        = std::max(0, std::min(json_value(data, "grammar_prefetch", params.sparams.grammar_prefetch), params.sparams.grammar_prefetch));
+        slot->sparams.prelude                 = json_value(data, "prelude",         params.sparams.prelude);
+        slot->sparams.repetition_stop_period  = json_value(data, "repetition_stop_period", default_sparams.repetition_stop_period);
+        slot->sparams.repetition_stop_count   = json_value(data, "repetition_stop_count",  default_sparams.repetition_stop_count);
+        if (slot->sparams.repetition_stop_period < 0 || slot->sparams.repetition_stop_period > MAX_REPETITION_STOP_PERIOD)
+        {
+            LOG_TEE("slot %i - repetition_stop_period out of range: %d [task id: %i]\n", slot->id, slot->sparams.repetition_stop_period, slot->task_id);
+            return false;
+        }
+
+        // infill
+        if (data.count("input_prefix") != 0)
+        {
+            slot->params.input_prefix = data["input_prefix"];
+        }
+        else
+        {
+            slot->params.input_prefix = "";
+        }
+
+        if (data.count("input_suffix") != 0)
+        {
+            slot->params.input_suffix = data["input_suffix"];
+        }
+        else
+        {
+            slot->params.input_suffix = "";
+        }
+
+        if (data.count("prompt") != 0)
+        {
+            slot->prompt = data["prompt"];
+        }
+        else
+        {
+            slot->prompt = "";
+        }
+
+        slot->sparams.logit_bias.clear();
+
+        if (json_value(data, "ignore_eos", false))
+        {
+            slot->sparams.logit_bias[llama_token_eos(model)] = -INFINITY;
+        }
+
+        const auto &logit_bias = data.find("logit_bias");
+        if (logit_bias != data.end() && logit_bias->is_array())
+        {
+            const int n_vocab = llama_n_vocab(model);
+            for (const auto &el : *logit_bias)
+            {
+                if (el.is_array() && el.size() == 2 && el[0].is_number_integer())
+                {
+                    llama_token tok = el[0].get<llama_token>();
+                    if (tok >= 0 && tok < n_vocab)
+                    {
+                        if (el[1].is_number())
+                        {
+                            slot->sparams.logit_bias[tok] = el[1].get<float>();
+                        }
+                        else if (el[1].is_boolean() && !el[1].get<bool>())
+                        {
+                            slot->sparams.logit_bias[tok] = -INFINITY;
+                        }
+                    }
+                }
+            }
+        }
+
+        slot->params.antiprompt.clear();
+
+        const auto &stop = data.find("stop");
+        if (stop != data.end() && stop->is_array())
+        {
+            for (const auto &word : *stop)
+            {
+                if (!word.empty())
+                {
+                    slot->params.antiprompt.push_back(word);
+                }
+            }
+        }
+
+        if (multimodal)
+        {
+            const auto &images_data = data.find("image_data");
+            if (images_data != data.end() && images_data->is_array())
+            {
+                for (const auto &img : *images_data)
+                {
+                    std::string data_b64 = img["data"].get<std::string>();
+                    slot_image img_sl;
+                    img_sl.id = img.count("id") != 0 ? img["id"].get<int>() : slot->images.size();
+                    int width, height, channels;
+                    std::vector<uint8_t> image_buffer = base64_decode(data_b64);
+                    data_b64.clear();
+                    auto data = stbi_load_from_memory(image_buffer.data(), image_buffer.size(), &width, &height, &channels, 3);
+                    if (!data) {
+                        LOG_TEE("slot %i - failed to load image [id: %i]\n", slot->id, img_sl.id);
+                        return false;
+                    }
+                    LOG_TEE("slot %i - image loaded [id: %i] resolution (%i x %i)\n", slot->id, img_sl.id, width, height);
+                    img_sl.img_data.nx = width;
+                    img_sl.img_data.ny = height;
+                    img_sl.img_data.size = width * height * 3;
+                    img_sl.img_data.data = new uint8_t[width * height * 3]();
+                    memcpy(img_sl.img_data.data, data, width * height * 3);
+                    stbi_image_free(data);
+                    img_sl.request_encode_image = true;
+                    slot->images.push_back(img_sl);
+                }
+                // process prompt
+                // example: system prompt [img-102] user [img-103] describe [img-134] -> [{id: 102, prefix: 'system prompt '}, {id: 103, prefix: ' user '}, {id: 134, prefix: ' describe '}]}
+                if (slot->images.size() > 0 && !slot->prompt.is_array())
+                {
+                    std::string prompt = slot->prompt.get<std::string>();
+                    size_t pos = 0, begin_prefix = 0;
+                    std::string pattern = "[img-";
+                    while ((pos = prompt.find(pattern, pos)) != std::string::npos) {
+                        size_t end_prefix = pos;
+                        pos += pattern.length();
+                        size_t end_pos = prompt.find("]", pos);
+                        if (end_pos != std::string::npos)
+                        {
+                            std::string image_id = prompt.substr(pos, end_pos - pos);
+                            try
+                            {
+                                int img_id = std::stoi(image_id);
+                                bool found = false;
+                                for (slot_image &img : slot->images)
+                                {
+                                    if (img.id == img_id) {
+                                        found = true;
+                                        img.prefix_prompt = prompt.substr(begin_prefix, end_prefix - begin_prefix);
+                                        begin_prefix = end_pos + 1;
+                                        break;
+                                    }
+                                }
+                                if (!found) {
+                                    LOG_TEE("ERROR: Image with id: %i, not found.\n", img_id);
+                                    slot->images.clear();
+                                    return false;
+                                }
+                            } catch (const std::invalid_argument& e) {
+                                LOG_TEE("Invalid image number id in prompt\n");
+                                slot->images.clear();
+                                return false;
+                            }
+                        }
+                    }
+                    slot->prompt = "";
+                    slot->params.input_suffix = prompt.substr(begin_prefix);
+                    slot->params.cache_prompt = false; // multimodal doesn't support cache prompt
+                }
+            }
+        }
+
+        // the slot keeps its grammar provider session between the requests with the same dynamic grammar
+        slot->ctx_sampling = llama_sampling_reinit(slot->ctx_sampling, slot->sparams);
+        if (slot->ctx_sampling == nullptr)
+        {
+            LOG_TEE("slot %i failed to parse the grammar or to load the grammar provider [task id: %i]\n", slot->id, slot->task_id);
+            return false;
+        }
+        slot->command = LOAD_PROMPT;
+
+        all_slots_are_idle = false;
+
+        LOG_TEE("slot %i is processing [task id: %i]\n", slot->id, slot->task_id);
+
+        return true;
+    }
+
+    void kv_cache_clear() {
+        // clear the entire KV cache
+        llama_kv_cache_clear(ctx);
+        prefix_cache.clear(nullptr);
+        if (ctx_dft != nullptr)
+        {
+            llama_kv_cache_clear(ctx_dft);
+        }
+        for (llama_client_slot &slot : slots)
+        {
+            slot.cache_tokens_dft.clear();
+            if (!slot.kv_swap.empty())
+            {
+                std::vector<uint8_t>().swap(slot.kv_swap);
+                slot.cache_tokens.clear();
+            }
+        }
+        clean_kv_cache = false;
+    }
+
+    // moves the KV of the least recently used idle slot to host memory and frees its cells,
+    // returns false if there is no such slot
+    bool swap_out_idle_slot()
+    {
+        llama_client_slot *lru = nullptr;
+        for (llama_client_slot &slot : slots)
+        {
+            if (slot.available() && slot.kv_swap.empty() && !slot.cache_tokens.empty() &&
+                (lru == nullptr || slot.t_last_used < lru->t_last_used))
+            {
+                lru = &slot;
+            }
+        }
+        if (lru == nullptr)
+        {
+            return false;
+        }
+
+        const llama_pos p0 = lru->n_system;
+        lru->kv_swap.resize(llama_kv_cache_seq_get_size(ctx, lru->id, p0, -1));
+        if (llama_kv_cache_seq_get_data(ctx, lru->id, p0, -1, lru->kv_swap.data()) == 0)
+        {
+            // the KV cannot be copied, it is evaluated again instead
+            std::vector<uint8_t>().swap(lru->kv_swap);
+            lru->cache_tokens.clear();
+        }
+        llama_kv_cache_seq_rm(ctx, lru->id, p0, -1);
+
+        LOG_TEE("slot %d : swapped out %zu bytes of KV\n", lru->id, lru->kv_swap.size());
+        return true;
+    }
+
+    // restores the KV swapped out by swap_out_idle_slot, in cells freed by the other idle slots if needed
+    void swap_in(llama_client_slot &slot)
+    {
+        bool restored = false;
+        if (slot.params.cache_prompt)
+        {
+            while (!(restored = llama_kv_cache_seq_set_data(ctx, slot.id, slot.kv_swap.data()) > 0) &&
+                   (prefix_cache.evict(ctx) || swap_out_idle_slot()))
+            {
+            }
+        }
+        if (restored)
+        {
+            LOG_TEE("slot %d : swapped in %zu bytes of KV\n", slot.id, slot.kv_swap.size());
+        }
+        else
+        {
+            slot.cache_tokens.clear();
+        }
+        std::vector<uint8_t>().swap(slot.kv_swap);
+    }
+
+    server_system_prompt * get_system_prompt(int id)
+    {
+        for (server_system_prompt &sys : system_prompts)
+        {
+            if (sys.id == id)
+            {
+                return &sys;
+            }
+        }
+        return nullptr;
+    }
+
+    // the default system prompt and the names of its chat, for /props and the other models
+    json system_prompt_data()
+    {
+        std::lock_guard<std::mutex> lock(mutex_tasks);
+        const server_system_prompt &sys = *get_system_prompt(system_id_default);
+        return json {
+            {"prompt",         sys.prompt},
+            {"anti_prompt",    sys.name_user},
+            {"assistant_name", sys.name_assistant},
+            {"id",             sys.id},
+        };
+    }
+
+    // adds the system prompt of sys_props, or returns the version that has the same one already
+    // a new prompt is evaluated in a sequence of its own, or copied from a version with the same text
+    // returns -1 if it could not be evaluated
+    int load_system_prompt(const json &sys_props)
+    {
+        server_system_prompt sys;
+        sys.prompt         = sys_props.value("prompt", "");
+        sys.name_user      = sys_props.value("anti_prompt", "");
+        sys.name_assistant = sys_props.value("assistant_name", "");
+        sys.t_last_used    = ggml_time_us();
+
+        const server_system_prompt *same = nullptr;
+        for (server_system_prompt &other : system_prompts)
+        {
+            if (other.prompt == sys.prompt)
+            {
+                if (other.name_user == sys.name_user && other.name_assistant == sys.name_assistant)
+                {
+                    other.t_last_used = sys.t_last_used;
+                    return other.id;
+                }
+                same = &other;
+            }
+        }
+
+        if (!sys.prompt.empty())
+        {
+            // the sequences of the system prompts follow the ones of the slots, the cached prefixes and the embeddings
+            sys.seq_id = params.n_parallel + n_prefix_cache + params.n_batch + 1;
+            for (bool used = true; used; )
+            {
+                used = false;
+                for (const server_system_prompt &other : system_prompts)
+                {
+                    if (other.seq_id == sys.seq_id)
+                    {
+                        sys.seq_id++;
+                        used = true;
+                    }
+                }
+            }
+
+            if (same != nullptr)
+            {
+                sys.tokens = same->tokens;
+                llama_kv_cache_seq_cp(ctx, same->seq_id, sys.seq_id, -1, -1);
+                if (ctx_dft != nullptr)
+                {
+                    llama_kv_cache_seq_cp(ctx_dft, same->seq_id, sys.seq_id, -1, -1);
+                }
+            }
+            else
+            {
+                sys.tokens = ::llama_tokenize(ctx, sys.prompt, add_bos_token);
+
+                const int32_t n_tokens = sys.tokens.size();
+                int ret = 0;
+                for (int32_t i0 = 0; ret == 0 && i0 < n_tokens; i0 += params.n_batch)
+                {
+                    llama_batch_clear(batch);
+                    for (int32_t i = i0; i < std::min(n_tokens, i0 + params.n_batch); ++i)
+                    {
+                        llama_batch_add(batch, sys.tokens[i], i, { sys.seq_id }, false);
+                    }
+
+                    // the cells of the cached prefixes and of the idle slots are given back if needed
+                    while ((ret = llama_decode(ctx, batch)) > 0 && (prefix_cache.evict(ctx) || swap_out_idle_slot()))
+                    {
+                    }
+                    if (ret == 0 && ctx_dft != nullptr)
+                    {
+                        ret = llama_decode(ctx_dft, batch);
+                    }
+                }
+                llama_batch_clear(batch);
+                if (ret != 0)
+                {
+                    LOG_TEE("%s: failed to evaluate the system prompt, ret = %d\n", __func__, ret);
+                    llama_kv_cache_seq_rm(ctx, sys.seq_id, -1, -1);
+                    if (ctx_dft != nullptr)
+                    {
+                        llama_kv_cache_seq_rm(ctx_dft, sys.seq_id, -1, -1);
+                    }
+                    return -1;
+                }
+            }
+        }
+
+        sys.id = system_id_next++;
+        system_prompts.push_back(sys);
+
+        LOG_TEE("system prompt %d loaded (%zu tokens%s)\n", sys.id, sys.tokens.size(), same != nullptr ? ", copied" : "");
+
+        return sys.id;
+    }
+
+    // puts the system prompt of version id at the start of the sequence of the slot, instead of the one it has:
+    // the cells of the prompt are shared, the ones of the previous request of the slot are dropped
+    void set_slot_system_prompt(llama_client_slot &slot, int id)
+    {
+        if (slot.system_id == id)
+        {
+            return;
+        }
+        const server_system_prompt &sys = *get_system_prompt(id);
+
+        llama_kv_cache_seq_rm(ctx, slot.id, -1, -1);
+        if (sys.seq_id >= 0)
+        {
+            llama_kv_cache_seq_cp(ctx, sys.seq_id, slot.id, -1, -1);
+        }
+        if (ctx_dft != nullptr)
+        {
+            llama_kv_cache_seq_rm(ctx_dft, slot.id, -1, -1);
+            if (sys.seq_id >= 0)
+            {
+                llama_kv_cache_seq_cp(ctx_dft, sys.seq_id, slot.id, -1, -1);
+            }
+        }
+
+        slot.system_id = id;
+        slot.n_system  = sys.tokens.size();
+        slot.cache_tokens.clear();
+        slot.cache_tokens_dft.clear();
+        std::vector<uint8_t>().swap(slot.kv_swap);
+    }
+
+    // the system prompt tokens of the slot followed by the first n of tokens, the keys of the prefix cache
+    std::vector<llama_token> with_system_prompt(const llama_client_slot &slot, const std::vector<llama_token> &tokens, size_t n)
+    {
+        std::vector<llama_token> res = get_system_prompt(slot.system_id)->tokens;
+        res.insert(res.end(), tokens.begin(), tokens.begin() + std::min(n, tokens.size()));
+        return res;
+    }
+
+    // frees the least recently used versions that neither the default, a slot nor a parked slot uses, beyond
+    // n_system_prompts
+    void evict_system_prompts()
+    {
+        while (true)
+        {
+            int n_unused = 0;
+            server_system_prompt *lru = nullptr;
+            for (server_system_prompt &sys : system_prompts)
+            {
+                bool used = sys.id == 0 || sys.id == system_id_default;
+                for (const llama_client_slot &slot : slots)
+                {
+                    used = used || slot.system_id == sys.id;
+                }
+                for (const llama_client_slot &slot : parked_slots)
+                {
+                    used = used || slot.system_id == sys.id;
+                }
+                if (!used)
+                {
+                    n_unused++;
+                    if (lru == nullptr || sys.t_last_used < lru->t_last_used)
+                    {
+                        lru = &sys;
+                    }
+                }
+            }
+            if (n_unused <= n_system_prompts)
+            {
+                return;
+            }
+
+            LOG_TEE("system prompt %d evicted\n", lru->id);
+            if (lru->seq_id >= 0)
+            {
+                llama_kv_cache_seq_rm(ctx, lru->seq_id, -1, -1);
+                if (ctx_dft != nullptr)
+                {
+                    llama_kv_cache_seq_rm(ctx_dft, lru->seq_id, -1, -1);
+                }
+            }
+            system_prompts.erase(system_prompts.begin() + (lru - system_prompts.data()));
+        }
+    }
+
+    // sets the default system prompt, of the requests that select none
+    // before the model is loaded, it is kept for initialize
+    void process_system_prompt_data(const json &sys_props) {
+        if (ctx == nullptr)
+        {
+            system_prompt_init = sys_props;
+            return;
+        }
+
+        const int id = load_system_prompt(sys_props);
+        if (id >= 0)
+        {
+            system_id_default = id;
+            evict_system_prompts();
+        }
+    }
+
+    static size_t find_stopping_strings(const std::string &text, const size_t last_token_size,
+                                        const stop_type type, llama_client_slot &slot)
+    {
+        size_t stop_pos = std::string::npos;
+
+        for (const std::string &word : slot.params.antiprompt)
+        {
+            size_t pos;
+            if (type == STOP_FULL)
+            {
+                const size_t tmp = word.size() + last_token_size;
+                const size_t from_pos = text.size() > tmp ? text.size() - tmp : 0;
+                pos = text.find(word, from_pos);
+            }
+            else
+            {
+                pos = find_partial_stop_string(word, text);
+            }
+            if (pos != std::string::npos &&
+                (stop_pos == std::string::npos || pos < stop_pos))
+            {
+                if (type == STOP_FULL)
+                {
+                    slot.stopped_word = true;
+                    slot.stopping_word = word;
+                    slot.has_next_token = false;
+                }
+                stop_pos = pos;
+            }
+        }
+
+        return stop_pos;
+    }
+
+    bool process_token(completion_token_output &result, llama_client_slot &slot) {
+        // remember which tokens were sampled - used for repetition penalties during sampling
+        int32_t n_token_str;
+        const char * token_str = llama_token_get_piece_view(model, result.tok, &n_token_str);
+        slot.sampled = result.tok;
+
+        // search stop word and delete it
+        slot.generated_text.append(token_str, n_token_str);
+        slot.has_next_token = true;
+
+        // check if there is incomplete UTF-8 character at the end
+        bool incomplete = false;
+        for (unsigned i = 1; i < 5 && i <= slot.generated_text.size(); ++i)
+        {
+            unsigned char c = slot.generated_text[slot.generated_text.size() - i];
+            if ((c & 0xC0) == 0x80)
+            {
+                // continuation byte: 10xxxxxx
+                continue;
+            }
+            if ((c & 0xE0) == 0xC0)
+            {
+                // 2-byte character: 110xxxxx ...
+                incomplete = i < 2;
+            }
+            else if ((c & 0xF0) == 0xE0)
+            {
+                // 3-byte character: 1110xxxx ...
+                incomplete = i < 3;
+            }
+            else if ((c & 0xF8) == 0xF0)
+            {
+                // 4-byte character: 11110xxx ...
+                incomplete = i < 4;
+            }
+            // else 1-byte character or invalid byte
+            break;
+        }
+
+        if (!incomplete)
+        {
+            size_t pos = std::min(slot.sent_count, slot.generated_text.size());
+            const std::string str_test = slot.generated_text.substr(pos);
+            bool is_stop_full = false;
+            size_t stop_pos = find_stopping_strings(str_test, n_token_str, STOP_FULL, slot);
+            if (stop_pos != std::string::npos)
+            {
+                is_stop_full = true;
+                slot.generated_text.erase(
+                    slot.generated_text.begin() + pos + stop_pos,
+                    slot.generated_text.end());
+                pos = std::min(slot.sent_count, slot.generated_text.size());
+            }
+            else
+            {
+                is_stop_full = false;
+                stop_pos = find_stopping_strings(str_test, n_token_str, STOP_PARTIAL, slot);
+            }
+
+            // check if there is any token to predict
+            if (stop_pos == std::string::npos || (!slot.has_next_token && !is_stop_full && stop_pos > 0))
+            {
+                // no send the stop word in the response
+                result.text_to_send = slot.generated_text.substr(pos, std::string::npos);
+                slot.sent_count += result.text_to_send.size();
+                // add the token to slot queue and cache
+            }
+            slot.add_token_string(result);
+            if (slot.params.stream)
+            {
+                send_partial_response(slot, result);
+            }
+        }
+
+        if (incomplete)
+        {
+            slot.has_next_token = true;
+        }
+
+        // check the limits
+        if (slot.n_decoded > 2 && slot.has_next_token && !slot.has_budget(params))
+        {
+            slot.stopped_limit = true;
+            slot.has_next_token = false;
+        }
+
+        if (slot.ctx_sampling->stop_reason != LLAMA_SAMPLING_STOP_NONE)
+        {
+            slot.has_next_token = false;
+            LOG_VERBOSE("sampling stopped", {{"stop_reason", llama_sampling_stop_reason_str(slot.ctx_sampling->stop_reason)}});
+        }
+        else if (!slot.cache_tokens.empty() && result.tok == llama_token_eos(model))
+        {
+            slot.stopped_eos = true;
+            slot.has_next_token = false;
+            LOG_VERBOSE("eos token found", {});
+        }
+
+        LOG_VERBOSE("next token", {
+                                      {"token", result.tok},
+                                      {"token_text", tokens_to_output_formatted_string(ctx, result.tok)},
+                                      {"has_next_token", slot.has_next_token},
+                                      {"n_remain", slot.n_remaining},
+                                      {"num_tokens_predicted", slot.n_decoded},
+                                      {"stopped_eos", slot.stopped_eos},
+                                      {"stopped_word", slot.stopped_word},
+                                      {"stopped_limit", slot.stopped_limit},
+                                      {"stopping_word", slot.stopping_word},
+                                  });
+
+        return slot.has_next_token; // continue
+    }
+
+    // images encoded by a single graph: the compute buffer of the CLIP encoder grows with the batch
+    static const int n_image_batch = 4;
+
+    bool process_images(llama_client_slot &slot)
+    {
+        if (slot.images.empty())
+        {
+            return false;
+        }
+
+        const size_t n_embd_bytes = clip_embd_nbytes(clp_ctx);
+
+        // the images that are not cached, with the hash of their pixels
+        std::vector<std::pair<slot_image *, uint64_t>> pending;
+
+        for (slot_image &img : slot.images)
+        {
+            if (!img.request_encode_image)
+            {
+                continue;
+            }
+            img.image_tokens = clip_n_patches(clp_ctx);
+            img.image_embedding = (float *)malloc(n_embd_bytes);
+            if (!img.image_embedding)
+            {
+                LOG_TEE("Unable to allocate memory for image embeddings\n");
+                return false;
+            }
+            const uint64_t h = server_image_cache::hash(img.img_data);
+            if (image_cache.find(img.img_data, h, img.image_embedding))
+            {
+                LOG_TEE("slot %i - image [id: %i] found in the cache\n", slot.id, img.id);
+                img.request_encode_image = false;
+                continue;
+            }
+            pending.emplace_back(&img, h);
+        }
+
+        for (size_t i0 = 0; i0 < pending.size(); i0 += n_image_batch)
+        {
+            const size_t n_imgs = std::min(pending.size() - i0, (size_t) n_image_batch);
+
+            std::vector<clip_image_f32> imgs_res(n_imgs);
+            bool ok = true;
+            for (size_t i = 0; i < n_imgs && ok; i++)
+            {
+                if (!clip_image_preprocess(clp_ctx, &pending[i0 + i].first->img_data, &imgs_res[i], /*pad2square =*/ true))
+                {
+                    LOG_TEE("Error processing the given image");
+                    ok = false;
+                }
+            }
+
+            std::vector<float> embeddings;
+            if (ok)
+            {
+                for (size_t i = 0; i < n_imgs; i++)
+                {
+                    LOG_TEE("slot %i - encoding image [id: %i]\n", slot.id, pending[i0 + i].first->id);
+                }
+                embeddings.resize(n_imgs*n_embd_bytes/sizeof(float));
+
+                clip_image_f32_batch batch = { imgs_res.data(), n_imgs };
+                if (!clip_image_batch_encode(clp_ctx, params.n_threads, &batch, embeddings.data()))
+                {
+                    LOG_TEE("Unable to encode image\n");
+                    ok = false;
+                }
+            }
+
+            for (clip_image_f32 &img_res : imgs_res)
+            {
+                delete[] img_res.data;
+            }
+
+            if (!ok)
+            {
+                return false;
+            }
+
+            for (size_t i = 0; i < n_imgs; i++)
+            {
+                slot_image &img = *pending[i0 + i].first;
+                const float *embd = embeddings.data() + i*n_embd_bytes/sizeof(float);
+                memcpy(img.image_embedding, embd, n_embd_bytes);
+                image_cache.insert(img.img_data, pending[i0 + i].second, embd, n_embd_bytes/sizeof(float));
+                img.request_encode_image = false;
+            }
+        }
+
+        return slot.images.size() > 0;
+    }
+
+    // called by process_tasks, with mutex_tasks held
+    void send_error(task_server& task, std::string error)
+    {
+        task_result res;
+        res.id = task.id;
+        res.multitask_id = task.multitask_id;
+        res.stop = false;
+        res.error = true;
+        res.result_json = { { "content", error } };
+
+        // the multitask is done with this subtask
+        for (auto& multitask : queue_multitasks)
+        {
+            if (multitask.id == task.multitask_id)
+            {
+                multitask.subtasks_remaining.erase(task.id);
+                multitask.results.push_back(res);
+            }
+        }
+
+        push_result(res);
+    }
+
+    void push_result(task_result res)
+    {
+        std::lock_guard<std::mutex> lock(mutex_results);
+        auto it = queue_results.find(res.id);
+        if (it == queue_results.end())
+        {
+            return;
+        }
+        it->second.results.push_back(std::move(res));
+        it->second.cv.notify_one();
+    }
+
+    // opens the channel of a task before it is queued, so that none of its results are missed
+    void open_channel(int task_id)
+    {
+        std::lock_guard<std::mutex> lock(mutex_results);
+        queue_results[task_id];
+    }
+
+    void close_channel(int task_id)
+    {
+        std::lock_guard<std::mutex> lock(mutex_results);
+        queue_results.erase(task_id);
+    }
+
+    // wakes the task loop up when it waits for tasks
+    void wake()
+    {
+        std::lock_guard<std::mutex> lock(mutex_tasks);
+        wake_pending = true;
+        condition_tasks.notify_one();
+    }
+
+    void add_multi_task(int id, std::vector<int>& sub_ids)
+    {
+        std::lock_guard<std::mutex> lock(mutex_tasks);
+        task_multi multi;
+        multi.id = id;
+        std::copy(sub_ids.begin(), sub_ids.end(), std::inserter(multi.subtasks_remaining, multi.subtasks_remaining.end()));
+        queue_multitasks.push_back(multi);
+    }
+
+    void update_multi_task(int multitask_id, int subtask_id, task_result& result)
+    {
+        std::lock_guard<std::mutex> lock(mutex_tasks);
+        for (auto& multitask : queue_multitasks)
+        {
+            if (multitask.id == multitask_id)
+            {
+                multitask.subtasks_remaining.erase(subtask_id);
+                multitask.results.push_back(result);
+            }
+        }
+    }
+
+    json get_model_props()
+    {
+        return get_formated_generation(slots[0]);
+    }
+
+    json get_formated_generation(llama_client_slot &slot)
+    {
+        const auto eos_bias = slot.sparams.logit_bias.find(llama_token_eos(model));
+        const bool ignore_eos = eos_bias != slot.sparams.logit_bias.end() &&
+                                eos_bias->second < 0.0f && std::isinf(eos_bias->second);
+        return json {
+            {"n_ctx",             slot.n_ctx},
+            {"model",             params.model_alias},
+            {"seed",              slot.params.seed},
+            {"temp",              slot.sparams.temp},
+            {"top_k",             slot.sparams.top_k},
+            {"top_p",             slot.sparams.top_p},
+            {"min_p",             slot.sparams.min_p},
+            {"tfs_z",             slot.sparams.tfs_z},
+            {"typical_p",         slot.sparams.typical_p},
+            {"repeat_last_n",     slot.sparams.penalty_last_n},
+            {"repeat_penalty",    slot.sparams.penalty_repeat},
+            {"presence_penalty",  slot.sparams.penalty_present},
+            {"frequency_penalty", slot.sparams.penalty_freq},
+            {"mirostat",          slot.sparams.mirostat},
+            {"mirostat_tau",      slot.sparams.mirostat_tau},
+            {"mirostat_eta",      slot.sparams.mirostat_eta},
+            {"penalize_nl",       slot.sparams.penalize_nl},
+            {"stop",              slot.params.antiprompt},
+            {"n_predict",         slot.params.n_predict},
+            {"n_keep",            params.n_keep},
+            {"n_discard",         slot.params.n_discard},
+            {"ignore_eos",        ignore_eos},
+            {"stream",            slot.params.stream},
+            {"logit_bias",        slot.sparams.logit_bias},
+            {"n_probs",           slot.sparams.n_probs},
+            {"grammar",           slot.sparams.grammar},
+            {"dynamic_grammar",   slot.sparams.dynamic_grammar},
+            {"grammar_prefetch",  slot.sparams.grammar_prefetch},
+            {"system_prompt_id",  slot.system_id},
+        };
+    }
+
+    void send_partial_response(llama_client_slot &slot, completion_token_output tkn)
+    {
+        task_result res;
+        res.id = slot.task_id;
+        res.multitask_id = slot.multitask_id;
+        res.error = false;
+        res.stop = false;
+
+        // the event is written by the thread of the request, see write_partial_event
+        res.partial    = true;
+        res.content    = std::move(tkn.text_to_send);
+        res.slot_id    = slot.id;
+        res.multimodal = multimodal;
+
+        if (slot.sparams.n_probs > 0)
+        {
+            const std::vector<llama_token> to_send_toks = llama_tokenize(ctx, res.content, false);
+            size_t probs_pos = std::min(slot.sent_token_probs_index, slot.generated_token_probs.size());
+            size_t probs_stop_pos = std::min(slot.sent_token_probs_index + to_send_toks.size(), slot.generated_token_probs.size());
+            if (probs_pos < probs_stop_pos)
+            {
+                res.probs.assign(slot.generated_token_probs.begin() + probs_pos, slot.generated_token_probs.begin() + probs_stop_pos);
+            }
+            slot.sent_token_probs_index = probs_stop_pos;
+            res.has_probs = true;
+        }
+
+        if (slot.oaicompat)
+        {
+            res.oaicompat = true;
+            res.oaicompat_token_ctr = slot.n_decoded;
+            res.model = slot.oaicompat_model;
+        }
+
+        push_result(std::move(res));
+    }
+
+    void send_final_response(llama_client_slot &slot)
+    {
+        task_result res;
+        res.id = slot.task_id;
+        res.multitask_id = slot.multitask_id;
+        res.error = false;
+        res.stop = true;
+
+        res.result_json = json
+        {
+            {"content",             !slot.params.stream ? slot.generated_text : ""},
+            {"slot_id",             slot.id},
+            {"stop",                true},
+            {"model",               params.model_alias},
+            {"tokens_predicted",    slot.n_decoded},
+            {"tokens_evaluated",    slot.num_prompt_tokens},
+            {"generation_settings", get_formated_generation(slot)},
+            {"prompt",              slot.prompt},
+            {"truncated",           slot.truncated},
+            {"stopped_eos",         slot.stopped_eos},
+            {"stopped_word",        slot.stopped_word},
+            {"stopped_limit",       slot.stopped_limit},
+            {"stopping_word",       slot.stopping_word},
+            {"stop_reason",         llama_sampling_stop_reason_str(slot.ctx_sampling->stop_reason)},
+            {"tokens_cached",       slot.n_past},
+            {"timings",             slot.get_formated_timings()}
+        };
+
+        if (slot.sparams.n_probs > 0)
+        {
+            std::vector<completion_token_output> probs = {};
+            if (!slot.params.stream && slot.stopped_word)
+            {
+                const std::vector<llama_token> stop_word_toks = llama_tokenize(ctx, slot.stopping_word, false);
+                probs = std::vector<completion_token_output>(slot.generated_token_probs.begin(), slot.generated_token_probs.end() - stop_word_toks.size());
+            }
+            else
+            {
+                probs = std::vector<completion_token_output>(
+                                    slot.generated_token_probs.begin(),
+                                    slot.generated_token_probs.begin() + slot.sent_token_probs_index);
+            }
+            res.result_json["completion_probabilities"] = probs_vector_to_json(ctx, probs);
+        }
 
-        if (slot->ctx_sampling != nullptr)
+        if (slot.oaicompat)
         {
-            llama_sampling_free(slot->ctx_sampling);
+            res.result_json["oaicompat_token_ctr"] = slot.n_decoded;
+            res.result_json["model"] = slot.oaicompat_model;
         }
-        slot->ctx_sampling = llama_sampling_init(slot->sparams);
-        slot->command = LOAD_PROMPT;
-
-        all_slots_are_idle = false;
-
-        LOG_TEE("slot %i is processing [task id: %i]\n", slot->id, slot->task_id);
 
-        return true;
-    }
+        // parent multitask, if any, needs to be updated
+        if (slot.multitask_id != -1)
+        {
+            update_multi_task(slot.multitask_id, slot.task_id, res);
+        }
 
-    void kv_cache_clear() {
-        // clear the entire KV cache
-        llama_kv_cache_clear(ctx);
-        clean_kv_cache = false;
+        push_result(res);
     }
 
-    void update_system_prompt() {
-        system_tokens = ::llama_tokenize(ctx, system_prompt, add_bos_token);
-
-        llama_batch_clear(batch);
-
-        kv_cache_clear();
+    void send_embedding(llama_client_slot &slot)
+    {
+        task_result res;
+        res.id = slot.task_id;
+        res.multitask_id = slot.multitask_id;
+        res.error = false;
+        res.stop = true;
 
-        for (int i = 0; i < (int) system_tokens.size(); ++i)
+        const int n_embd = llama_n_embd(model);
+        if (!params.embedding)
+        {
+            LOG_WARNING("embedding disabled", {
+                                                  {"params.embedding", params.embedding},
+                                              });
+            res.result_json = json
+            {
+                {"embedding", std::vector<float>(n_embd, 0.0f)},
+            };
+        }
+        else
         {
-            llama_batch_add(batch, system_tokens[i], i, { 0 }, false);
+            const float *data = llama_get_embeddings(ctx);
+            std::vector<float> embedding(data, data + n_embd);
+            res.result_json = json
+            {
+                {"embedding", embedding },
+            };
         }
+        push_result(res);
+    }
+
+    int request_completion(json data, bool infill, bool embedding, int multitask_id)
+    {
+        std::unique_lock<std::mutex> lock(mutex_tasks);
+        task_server task;
+        task.id = id_gen++;
+        task.target_id = 0;
+        task.data = std::move(data);
+        task.infill_mode = infill;
+        task.embedding_mode = embedding;
+        task.type = COMPLETION_TASK;
+        task.multitask_id = multitask_id;
+        task.t_queued = ggml_time_us();
 
-        if (llama_decode(ctx, batch) != 0)
+        // when a completion task's prompt array is not a singleton, we split it into multiple requests
+        if (task.data.at("prompt").size() > 1)
         {
-            LOG_TEE("%s: llama_decode() failed\n", __func__);
-            return;
+            lock.unlock(); // entering new func scope
+            return split_multiprompt_task(task);
         }
 
-        // assign the system KV cache to all parallel sequences
-        for (int32_t i = 1; i < params.n_parallel; ++i)
+        // otherwise, it's a single-prompt task, we actually queue it
+        if (multitask_id == -1)
         {
-            llama_kv_cache_seq_cp(ctx, 0, i, 0, system_tokens.size());
+            open_channel(task.id);
         }
+        queue_tasks.push_back(task);
+        condition_tasks.notify_one();
+        return task.id;
+    }
 
-        LOG_TEE("system prompt updated\n");
-        system_need_update = false;
+    task_result next_result(int task_id)
+    {
+        task_result res;
+        next_result(task_id, nullptr, res);
+        return res;
     }
 
-    void notify_system_prompt_changed() {
-        // release all slots
-        for (llama_client_slot &slot : slots)
+    // waits for the next result of a task, and checks is_alive every 100 ms while it waits, if given: returns false
+    // without a result as soon as it is false, the client of the request has gone
+    bool next_result(int task_id, const std::function<bool()> &is_alive, task_result &res)
+    {
+        std::unique_lock<std::mutex> lock(mutex_results);
+        auto it = queue_results.find(task_id);
+        if (it == queue_results.end())
         {
-            slot.release();
+            res.id = task_id;
+            res.stop = false;
+            res.error = true;
+            res.result_json = { { "content", "unknown task" } };
+            return true;
         }
 
-        system_need_update = true;
-    }
+        // the channel stays in place while its request waits on it, the other channels may be added and removed
+        task_channel & channel = it->second;
+        const auto has_result = [&channel] { return !channel.results.empty(); };
+        if (!is_alive)
+        {
+            channel.cv.wait(lock, has_result);
+        }
+        else
+        {
+            while (!channel.cv.wait_for(lock, std::chrono::milliseconds(100), has_result))
+            {
+                lock.unlock();
+                const bool alive = is_alive();
+                lock.lock();
+                if (!alive)
+                {
+                    return false;
+                }
+            }
+        }
 
-    void process_system_prompt_data(const json &sys_props) {
-        system_prompt  = sys_props.value("prompt", "");
-        name_user      = sys_props.value("anti_prompt", "");
-        name_assistant = sys_props.value("assistant_name", "");
+        res = std::move(channel.results.front());
+        channel.results.pop_front();
 
-        if (slots.size() > 0)
+        // no more results will come
+        if (res.stop || res.error)
         {
-            notify_system_prompt_changed();
+            queue_results.erase(task_id);
         }
+        return true;
     }
 
-    static size_t find_stopping_strings(const std::string &text, const size_t last_token_size,
-                                        const stop_type type, llama_client_slot &slot)
+    // for multiple images processing
+    bool ingest_images(llama_client_slot &slot, int n_batch)
     {
-        size_t stop_pos = std::string::npos;
+        int image_idx = 0;
 
-        for (const std::string &word : slot.params.antiprompt)
+        while (image_idx < (int) slot.images.size())
         {
-            size_t pos;
-            if (type == STOP_FULL)
-            {
-                const size_t tmp = word.size() + last_token_size;
-                const size_t from_pos = text.size() > tmp ? text.size() - tmp : 0;
-                pos = text.find(word, from_pos);
-            }
-            else
+            slot_image &img = slot.images[image_idx];
+
+            // process prefix prompt
+            for (int32_t i = 0; i < (int32_t) batch.n_tokens; i += n_batch)
             {
-                pos = find_partial_stop_string(word, text);
+                const int32_t n_tokens = std::min(n_batch, (int32_t) (batch.n_tokens - i));
+                llama_batch batch_view = {
+                    n_tokens,
+                    batch.token    + i,
+                    nullptr,
+                    batch.pos      + i,
+                    batch.n_seq_id + i,
+                    batch.seq_id   + i,
+                    batch.logits   + i,
+                    0, 0, 0, // unused
+                };
+                if (llama_decode(ctx, batch_view))
+                {
+                    LOG_TEE("%s : failed to eval\n", __func__);
+                    return false;
+                }
             }
-            if (pos != std::string::npos &&
-                (stop_pos == std::string::npos || pos < stop_pos))
+
+            // process image with llm
+            for (int i = 0; i < img.image_tokens; i += n_batch)
             {
-                if (type == STOP_FULL)
+                int n_eval = img.image_tokens - i;
+                if (n_eval > n_batch)
                 {
-                    slot.stopped_word = true;
-                    slot.stopping_word = word;
-                    slot.has_next_token = false;
+                    n_eval = n_batch;
                 }
-                stop_pos = pos;
+
+                const int n_embd = llama_n_embd(model);
+                llama_batch batch_img = { n_eval, nullptr, (img.image_embedding + i * n_embd), nullptr, nullptr, nullptr, nullptr, slot.n_past, 1, 0, };
+                if (llama_decode(ctx, batch_img))
+                {
+                    LOG_TEE("%s : failed to eval image\n", __func__);
+                    return false;
+                }
+                slot.n_past += n_eval;
+            }
+            image_idx++;
+
+            llama_batch_clear(batch);
+
+            // append prefix of next image
+            const auto json_prompt = (image_idx >= (int) slot.images.size()) ?
+                slot.params.input_suffix : // no more images, then process suffix prompt
+                (json)(slot.images[image_idx].prefix_prompt);
+
+            std::vector<llama_token> append_tokens = tokenize(json_prompt, false); // has next image
+            for (int i = 0; i < (int) append_tokens.size(); ++i)
+            {
+                llama_batch_add(batch, append_tokens[i], slot.n_past, { slot.id }, true);
+                slot.n_past += 1;
             }
         }
 
-        return stop_pos;
+        return true;
     }
 
-    bool process_token(completion_token_output &result, llama_client_slot &slot) {
-        // remember which tokens were sampled - used for repetition penalties during sampling
-        const std::string token_str = llama_token_to_piece(ctx, result.tok);
-        slot.sampled = result.tok;
+    void request_cancel(int task_id)
+    {
+        close_channel(task_id);
 
-        // search stop word and delete it
-        slot.generated_text += token_str;
-        slot.has_next_token = true;
+        std::lock_guard<std::mutex> lock(mutex_tasks);
+        task_server task;
+        task.id = id_gen++;
+        task.type = CANCEL_TASK;
+        task.target_id = task_id;
+        queue_tasks.push_back(task);
+        wake_pending = true;
+        condition_tasks.notify_one();
+    }
 
-        // check if there is incomplete UTF-8 character at the end
-        bool incomplete = false;
-        for (unsigned i = 1; i < 5 && i <= slot.generated_text.size(); ++i)
+    // queues the inputs of an embedding request, which do not take a slot
+    int request_embedding(std::vector<std::vector<llama_token>> inputs, bool batched, bool pooling_mean)
+    {
+        task_embedding task;
+        task.batched      = batched;
+        task.pooling_mean = pooling_mean;
+        task.inputs       = std::move(inputs);
+        task.embeddings.assign(task.inputs.size(), std::vector<float>(llama_n_embd(model), 0.0f));
+
+        // the inputs longer than a slot are truncated
+        for (std::vector<llama_token> &tokens : task.inputs)
         {
-            unsigned char c = slot.generated_text[slot.generated_text.size() - i];
-            if ((c & 0xC0) == 0x80)
-            {
-                // continuation byte: 10xxxxxx
-                continue;
-            }
-            if ((c & 0xE0) == 0xC0)
+            if ((int32_t) tokens.size() > n_ctx_slot)
             {
-                // 2-byte character: 110xxxxx ...
-                incomplete = i < 2;
+                LOG_VERBOSE("embedding input truncated", {{"n_tokens", tokens.size()}, {"n_ctx_slot", n_ctx_slot}});
+                tokens.resize(n_ctx_slot);
             }
-            else if ((c & 0xF0) == 0xE0)
+        }
+
+        std::lock_guard<std::mutex> lock(mutex_tasks);
+        task.id = id_gen++;
+        open_channel(task.id);
+        if (!params.embedding)
+        {
+            LOG_WARNING("embedding disabled", {
+                                                  {"params.embedding", params.embedding},
+                                              });
+            send_embeddings(task);
+            return task.id;
+        }
+        queue_embeddings.push_back(std::move(task));
+        wake_pending = true;
+        condition_tasks.notify_one();
+        return task.id;
+    }
+
+    void send_embeddings(const task_embedding &task)
+    {
+        task_result res;
+        res.id = task.id;
+        res.error = false;
+        res.stop = true;
+
+        if (!task.batched)
+        {
+            res.result_json = json
             {
-                // 3-byte character: 1110xxxx ...
-                incomplete = i < 3;
-            }
-            else if ((c & 0xF8) == 0xF0)
+                {"embedding", task.embeddings[0]},
+            };
+        }
+        else
+        {
+            std::vector<json> result_jsons;
+            for (const std::vector<float> &embedding : task.embeddings)
             {
-                // 4-byte character: 11110xxx ...
-                incomplete = i < 4;
+                result_jsons.push_back(json{{"embedding", embedding}});
             }
-            // else 1-byte character or invalid byte
-            break;
+            // same as the results of a multitask
+            res.result_json = json{ "results", result_jsons };
         }
+        push_result(res);
+    }
 
-        if (!incomplete)
+    // evaluates the next inputs of the embedding requests, as many tokens as fit in a batch, and sends the
+    // requests whose inputs are all pooled. An input longer than what is left of the batch goes on in the
+    // next step. The inputs are evaluated alone, without the system prompt, in the sequences after the ones
+    // of the slots and of the cached prefixes
+    void update_embeddings()
+    {
+        struct span
         {
-            size_t pos = std::min(slot.sent_count, slot.generated_text.size());
-            const std::string str_test = slot.generated_text.substr(pos);
-            bool is_stop_full = false;
-            size_t stop_pos = find_stopping_strings(str_test, token_str.size(), STOP_FULL, slot);
-            if (stop_pos != std::string::npos)
+            size_t       task;
+            size_t       input;
+            int32_t      i0;   // tokens [i0, i1) of the batch
+            int32_t      i1;
+            bool         last; // the batch ends the input
+            llama_seq_id seq_id;
+        };
+
+        const int32_t      n_batch  = params.n_batch;
+        const int32_t      n_embd   = llama_n_embd(model);
+        const llama_seq_id seq_id_0 = params.n_parallel + n_prefix_cache;
+
+        llama_batch_clear(batch);
+
+        std::vector<span> spans;
+        size_t       k_task        = 0;
+        size_t       input         = embd_input;
+        int32_t      pos           = embd_pos;
+        llama_seq_id seq_id        = embd_seq;
+        int32_t      seq_id_next   = embd_seq_next;
+        while (batch.n_tokens < n_batch && k_task < embd_tasks.size())
+        {
+            const task_embedding &task = embd_tasks[k_task];
+            if (input == task.inputs.size())
+            {
+                k_task++;
+                input = 0;
+                continue;
+            }
+
+            const std::vector<llama_token> &tokens = task.inputs[input];
+            if (tokens.empty())
             {
-                is_stop_full = true;
-                slot.generated_text.erase(
-                    slot.generated_text.begin() + pos + stop_pos,
-                    slot.generated_text.end());
-                pos = std::min(slot.sent_count, slot.generated_text.size());
+                input++;
+                continue;
             }
-            else
+            if (pos == 0)
             {
-                is_stop_full = false;
-                stop_pos = find_stopping_strings(str_test, token_str.size(), STOP_PARTIAL, slot);
+                // at most one input per token of the batch is in the KV cache, and the one that goes on
+                seq_id = seq_id_0 + seq_id_next;
+                seq_id_next = (seq_id_next + 1) % (n_batch + 1);
             }
 
-            // check if there is any token to predict
-            if (stop_pos == std::string::npos || (!slot.has_next_token && !is_stop_full && stop_pos > 0))
+            const int32_t n_tokens = std::min(n_batch - batch.n_tokens, (int32_t) tokens.size() - pos);
+            span sp = { k_task, input, batch.n_tokens, batch.n_tokens + n_tokens, pos + n_tokens == (int32_t) tokens.size(), seq_id };
+            for (int32_t i = 0; i < n_tokens; ++i)
             {
-                // no send the stop word in the response
-                result.text_to_send = slot.generated_text.substr(pos, std::string::npos);
-                slot.sent_count += result.text_to_send.size();
-                // add the token to slot queue and cache
+                llama_batch_add(batch, tokens[pos + i], pos + i, { seq_id }, false);
             }
-            slot.add_token_string(result);
-            if (slot.params.stream)
+            spans.push_back(sp);
+
+            pos += n_tokens;
+            if (sp.last)
             {
-                send_partial_response(slot, result);
+                input++;
+                pos = 0;
             }
         }
 
-        if (incomplete)
+        if (batch.n_tokens > 0)
         {
-            slot.has_next_token = true;
+            const int ret = llama_decode(ctx, batch);
+            metrics.n_decode += 1;
+            if (ret != 0)
+            {
+                // the cells of the cached prefixes and of the idle slots are given back first, and the batch is
+                // evaluated again in the next step
+                if (ret > 0 && (prefix_cache.evict(ctx) || swap_out_idle_slot()))
+                {
+                    return;
+                }
+
+                LOG_TEE("%s : failed to decode the batch of the embeddings, ret = %d\n", __func__, ret);
+                for (size_t k = 0; k <= k_task && k < embd_tasks.size(); ++k)
+                {
+                    task_result res;
+                    res.id = embd_tasks[k].id;
+                    res.stop = false;
+                    res.error = true;
+                    res.result_json = { { "content", "failed to evaluate the embedding inputs, the KV cache is full" } };
+                    push_result(res);
+                }
+                for (int32_t i = 0; i <= n_batch; ++i)
+                {
+                    llama_kv_cache_seq_rm(ctx, seq_id_0 + i, -1, -1);
+                }
+                embd_tasks.erase(embd_tasks.begin(), embd_tasks.begin() + std::min(k_task + 1, embd_tasks.size()));
+                embd_input = 0;
+                embd_pos   = 0;
+                return;
+            }
+
+            metrics.batch_tokens.observe(batch.n_tokens);
+
+            for (const span &sp : spans)
+            {
+                task_embedding &task = embd_tasks[sp.task];
+                std::vector<float> &embedding = task.embeddings[sp.input];
+                if (task.pooling_mean)
+                {
+                    for (int32_t i = sp.i0; i < sp.i1; ++i)
+                    {
+                        const float *data = llama_get_embeddings_ith(ctx, i);
+                        for (int32_t j = 0; j < n_embd; ++j)
+                        {
+                            embedding[j] += data[j];
+                        }
+                    }
+                }
+                if (sp.last)
+                {
+                    if (task.pooling_mean)
+                    {
+                        const float scale = 1.0f / task.inputs[sp.input].size();
+                        for (float &v : embedding)
+                        {
+                            v *= scale;
+                        }
+                    }
+                    else
+                    {
+                        const float *data = llama_get_embeddings_ith(ctx, sp.i1 - 1);
+                        embedding.assign(data, data + n_embd);
+                    }
+                    llama_kv_cache_seq_rm(ctx, sp.seq_id, -1, -1);
+                }
+            }
         }
 
-        // check the limits
-        if (slot.n_decoded > 2 && slot.has_next_token && !slot.has_budget(params))
+        embd_input    = input;
+        embd_pos      = pos;
+        embd_seq      = seq_id;
+        embd_seq_next = seq_id_next;
+
+        for (; k_task > 0; --k_task)
         {
-            slot.stopped_limit = true;
-            slot.has_next_token = false;
+            send_embeddings(embd_tasks.front());
+            embd_tasks.pop_front();
+        }
+        if (!embd_tasks.empty() && embd_input == embd_tasks.front().inputs.size())
+        {
+            send_embeddings(embd_tasks.front());
+            embd_tasks.pop_front();
+            embd_input = 0;
         }
+    }
+
+    int split_multiprompt_task(task_server& multiprompt_task)
+    {
+        int prompt_count = multiprompt_task.data.at("prompt").size();
+        assert(prompt_count > 1);
 
-        if (!slot.cache_tokens.empty() && result.tok == llama_token_eos(model))
+        int multitask_id = id_gen++;
+        open_channel(multitask_id);
+        std::vector<int> subtask_ids(prompt_count);
+        for (int i = 0; i < prompt_count; i++)
         {
-            slot.stopped_eos = true;
-            slot.has_next_token = false;
-            LOG_VERBOSE("eos token found", {});
+            json subtask_data = multiprompt_task.data;
+            subtask_data["prompt"] = subtask_data["prompt"][i];
+
+            // subtasks inherit everything else (infill mode, embedding mode, etc.)
+            subtask_ids[i] = request_completion(subtask_data, multiprompt_task.infill_mode, multiprompt_task.embedding_mode, multitask_id);
         }
 
-        LOG_VERBOSE("next token", {
-                                      {"token", result.tok},
-                                      {"token_text", tokens_to_output_formatted_string(ctx, result.tok)},
-                                      {"has_next_token", slot.has_next_token},
-                                      {"n_remain", slot.n_remaining},
-                                      {"num_tokens_predicted", slot.n_decoded},
-                                      {"stopped_eos", slot.stopped_eos},
-                                      {"stopped_word", slot.stopped_word},
-                                      {"stopped_limit", slot.stopped_limit},
-                                      {"stopping_word", slot.stopping_word},
-                                  });
+        // queue up the multitask so we can track its subtask progression
+        add_multi_task(multitask_id, subtask_ids);
+        return multitask_id;
+    }
 
-        return slot.has_next_token; // continue
+    // number of slots each tenant is using
+    std::map<std::string, int> count_tenant_slots() const
+    {
+        std::map<std::string, int> counts;
+        for (const llama_client_slot &slot : slots)
+        {
+            if (slot.is_processing())
+            {
+                counts[slot.tenant]++;
+            }
+        }
+        return counts;
     }
 
-    bool process_images(llama_client_slot &slot) const
+    // gives the free slots to the pending tasks and the preempted slots: the highest priority first, then the tenant
+    // using the fewest slots, then the oldest task; when no slot is free, the task may preempt a slot of a lower priority,
+    // or of a tenant using more than its share
+    // called by process_tasks, with mutex_tasks held
+    void schedule_tasks()
     {
-        for (slot_image &img : slot.images)
+        while (!queue_pending.empty() || !parked_slots.empty())
         {
-            if (!img.request_encode_image)
+            const std::map<std::string, int> counts = count_tenant_slots();
+            auto n_slots_of = [&counts](const std::string &tenant) {
+                auto it = counts.find(tenant);
+                return it == counts.end() ? 0 : it->second;
+            };
+
+            // a parked slot goes first among equals, its task is older
+            int  best_priority = 0;
+            int  best_count    = 0;
+            int  best_id       = 0;
+            int  i_best        = -1;
+            bool best_parked   = false;
+            auto consider = [&](int priority, const std::string &tenant, int id, int i, bool parked) {
+                const int count = n_slots_of(tenant);
+                if (i_best < 0 || priority > best_priority ||
+                    (priority == best_priority && (count < best_count || (count == best_count && id < best_id))))
+                {
+                    best_priority = priority;
+                    best_count    = count;
+                    best_id       = id;
+                    i_best        = i;
+                    best_parked   = parked;
+                }
+            };
+            for (size_t i = 0; i < parked_slots.size(); ++i)
             {
-                continue;
+                consider(parked_slots[i].priority, parked_slots[i].tenant, parked_slots[i].task_id, i, true);
             }
-            clip_image_f32 img_res;
-            if (!clip_image_preprocess(clp_ctx, &img.img_data, &img_res, /*pad2square =*/ true))
+            for (size_t i = 0; i < queue_pending.size(); ++i)
             {
-                LOG_TEE("Error processing the given image");
-                clip_free(clp_ctx);
-                return false;
+                const task_server &task = queue_pending[i];
+                consider(json_value(task.data, "priority", 0), json_value(task.data, "tenant", std::string()), task.id, i, false);
             }
-            img.image_tokens = clip_n_patches(clp_ctx);
-            img.image_embedding = (float *)malloc(clip_embd_nbytes(clp_ctx));
-            if (!img.image_embedding)
+
+            const std::string tenant = best_parked ? parked_slots[i_best].tenant : json_value(queue_pending[i_best].data, "tenant", std::string());
+            llama_client_slot *slot = best_parked ?
+                get_slot(-1, parked_slots[i_best].system_id) :
+                get_slot(json_value(queue_pending[i_best].data, "slot_id", -1),
+                         json_value(queue_pending[i_best].data, "system_prompt_id", system_id_default));
+            if (slot == nullptr)
             {
-                LOG_TEE("Unable to allocate memory for image embeddings\n");
-                clip_free(clp_ctx);
-                return false;
+                slot = preempt_slot(best_priority, n_slots_of(tenant), counts);
             }
-            LOG_TEE("slot %i - encoding image [id: %i]\n", slot.id, img.id);
-            if (!clip_image_encode(clp_ctx, params.n_threads, &img_res, img.image_embedding))
+            if (slot == nullptr)
             {
-                LOG_TEE("Unable to encode image\n");
-                return false;
+                break;
             }
-            img.request_encode_image = false;
-        }
-
-        return slot.images.size() > 0;
-    }
-
-    void send_error(task_server& task, std::string error)
-    {
-        std::lock_guard<std::mutex> lock(mutex_results);
-        task_result res;
-        res.id = task.id;
-        res.multitask_id = task.multitask_id;
-        res.stop = false;
-        res.error = true;
-        res.result_json = { { "content", error } };
-        queue_results.push_back(res);
-    }
-
-    void add_multi_task(int id, std::vector<int>& sub_ids)
-    {
-        std::lock_guard<std::mutex> lock(mutex_tasks);
-        task_multi multi;
-        multi.id = id;
-        std::copy(sub_ids.begin(), sub_ids.end(), std::inserter(multi.subtasks_remaining, multi.subtasks_remaining.end()));
-        queue_multitasks.push_back(multi);
-    }
 
-    void update_multi_task(int multitask_id, int subtask_id, task_result& result)
-    {
-        std::lock_guard<std::mutex> lock(mutex_tasks);
-        for (auto& multitask : queue_multitasks)
-        {
-            if (multitask.id == multitask_id)
+            if (best_parked)
             {
-                multitask.subtasks_remaining.erase(subtask_id);
-                multitask.results.push_back(result);
+                resume_slot(*slot, parked_slots[i_best]);
+                parked_slots.erase(parked_slots.begin() + i_best);
+                continue;
             }
-        }
-    }
 
-    json get_model_props()
-    {
-        return get_formated_generation(slots[0]);
-    }
+            task_server task = queue_pending[i_best];
+            queue_pending.erase(queue_pending.begin() + i_best);
 
-    json get_formated_generation(llama_client_slot &slot)
-    {
-        const auto eos_bias = slot.sparams.logit_bias.find(llama_token_eos(model));
-        const bool ignore_eos = eos_bias != slot.sparams.logit_bias.end() &&
-                                eos_bias->second < 0.0f && std::isinf(eos_bias->second);
-        return json {
-            {"n_ctx",             slot.n_ctx},
-            {"model",             params.model_alias},
-            {"seed",              slot.params.seed},
-            {"temp",              slot.sparams.temp},
-            {"top_k",             slot.sparams.top_k},
-            {"top_p",             slot.sparams.top_p},
-            {"min_p",             slot.sparams.min_p},
-            {"tfs_z",             slot.sparams.tfs_z},
-            {"typical_p",         slot.sparams.typical_p},
-            {"repeat_last_n",     slot.sparams.penalty_last_n},
-            {"repeat_penalty",    slot.sparams.penalty_repeat},
-            {"presence_penalty",  slot.sparams.penalty_present},
-            {"frequency_penalty", slot.sparams.penalty_freq},
-            {"mirostat",          slot.sparams.mirostat},
-            {"mirostat_tau",      slot.sparams.mirostat_tau},
-            {"mirostat_eta",      slot.sparams.mirostat_eta},
-            {"penalize_nl",       slot.sparams.penalize_nl},
-            {"stop",              slot.params.antiprompt},
-            {"n_predict",         slot.params.n_predict},
-            {"n_keep",            params.n_keep},
-            {"ignore_eos",        ignore_eos},
-            {"stream",            slot.params.stream},
-            {"logit_bias",        slot.sparams.logit_bias},
-            {"n_probs",           slot.sparams.n_probs},
-            {"grammar",           slot.sparams.grammar},
-        };
-    }
+            // a system prompt sent with the request becomes the default one
+            int system_id = json_value(task.data, "system_prompt_id", system_id_default);
+            if (task.data.contains("system_prompt"))
+            {
+                system_id = load_system_prompt(task.data["system_prompt"]);
+                if (system_id >= 0)
+                {
+                    system_id_default = system_id;
+                }
+            }
+            server_system_prompt *sys = get_system_prompt(system_id);
+            if (sys == nullptr)
+            {
+                send_error(task, system_id < 0 ? "failed to evaluate the system prompt" : "unknown system prompt id");
+                continue;
+            }
+            sys->t_last_used = ggml_time_us();
+            set_slot_system_prompt(*slot, system_id);
+            evict_system_prompts();
 
-    void send_partial_response(llama_client_slot &slot, completion_token_output tkn)
-    {
-        std::lock_guard<std::mutex> lock(mutex_results);
-        task_result res;
-        res.id = slot.task_id;
-        res.multitask_id = slot.multitask_id;
-        res.error = false;
-        res.stop = false;
+            slot->reset();
 
-        res.result_json = json
-        {
-            {"content",    tkn.text_to_send},
-            {"stop",       false},
-            {"slot_id",    slot.id},
-            {"multimodal", multimodal}
-        };
+            slot->infill = task.infill_mode;
+            slot->embedding = task.embedding_mode;
+            slot->t_queued = task.t_queued;
+            slot->task_id = task.id;
+            slot->multitask_id = task.multitask_id;
+            slot->priority = best_priority;
+            slot->tenant = tenant;
 
-        if (slot.sparams.n_probs > 0)
-        {
-            std::vector<completion_token_output> probs_output = {};
-            const std::vector<llama_token> to_send_toks = llama_tokenize(ctx, tkn.text_to_send, false);
-            size_t probs_pos = std::min(slot.sent_token_probs_index, slot.generated_token_probs.size());
-            size_t probs_stop_pos = std::min(slot.sent_token_probs_index + to_send_toks.size(), slot.generated_token_probs.size());
-            if (probs_pos < probs_stop_pos)
+            if (!launch_slot_with_data(slot, task.data))
             {
-                probs_output = std::vector<completion_token_output>(slot.generated_token_probs.begin() + probs_pos, slot.generated_token_probs.begin() + probs_stop_pos);
+                // send error result
+                send_error(task, "internal_error");
             }
-            slot.sent_token_probs_index = probs_stop_pos;
-            res.result_json["completion_probabilities"] = probs_vector_to_json(ctx, probs_output);
         }
+    }
 
-        if (slot.oaicompat)
+    // frees a slot whose request was cancelled before the next batch, so that the tasks scheduled in this step can
+    // take it: the cells of the generated tokens are given back, the prompt stays cached for a retry
+    void cancel_slot(llama_client_slot &slot)
+    {
+        const bool loaded = slot.state == PROCESSING;
+        slot.state   = IDLE;
+        slot.command = NONE;
+        slot.t_last_used = ggml_time_us();
+        slot.draft.clear();
+        if (!loaded)
         {
-            res.result_json["oaicompat_token_ctr"] = slot.n_decoded;
-            res.result_json["model"] = slot.oaicompat_model;
+            // the prompt was not evaluated yet, the KV cache of the slot is still the one of its previous request
+            LOG_TEE("slot %d cancelled before its prompt\n", slot.id);
+            return;
         }
 
-        queue_results.push_back(res);
-    }
+        // after a context shift, the prompt is not at the start of the cache anymore
+        const int32_t n_keep = slot.truncated ? 0 : std::min(slot.n_past, (int32_t) slot.num_prompt_tokens);
+        llama_kv_cache_seq_rm(ctx, slot.id, slot.n_system + n_keep, -1);
+        slot.cache_tokens.resize(std::min(slot.cache_tokens.size(), (size_t) n_keep));
+        slot.n_past     = n_keep;
+        slot.prefilling = false;
 
-    void send_final_response(llama_client_slot &slot)
-    {
-        std::lock_guard<std::mutex> lock(mutex_results);
-        task_result res;
-        res.id = slot.task_id;
-        res.multitask_id = slot.multitask_id;
-        res.error = false;
-        res.stop = true;
+        LOG_TEE("slot %d cancelled (%d tokens in cache)\n", slot.id, n_keep);
 
-        res.result_json = json
+        if (slot.images.empty())
         {
-            {"content",             !slot.params.stream ? slot.generated_text : ""},
-            {"slot_id",             slot.id},
-            {"stop",                true},
-            {"model",               params.model_alias},
-            {"tokens_predicted",    slot.n_decoded},
-            {"tokens_evaluated",    slot.num_prompt_tokens},
-            {"generation_settings", get_formated_generation(slot)},
-            {"prompt",              slot.prompt},
-            {"truncated",           slot.truncated},
-            {"stopped_eos",         slot.stopped_eos},
-            {"stopped_word",        slot.stopped_word},
-            {"stopped_limit",       slot.stopped_limit},
-            {"stopping_word",       slot.stopping_word},
-            {"tokens_cached",       slot.n_past},
-            {"timings",             slot.get_formated_timings()}
-        };
+            prefix_cache.insert(ctx, with_system_prompt(slot, slot.cache_tokens, n_keep), slot.n_system + n_keep, slot.id, slot.n_system);
+        }
+    }
 
-        if (slot.sparams.n_probs > 0)
+    // parks the slot that a task of the given priority, whose tenant uses n_slots_tenant slots, may take, and returns it
+    llama_client_slot * preempt_slot(int priority, int n_slots_tenant, const std::map<std::string, int> &counts)
+    {
+        llama_client_slot *victim = nullptr;
+        int victim_count = 0;
+        for (llama_client_slot &slot : slots)
         {
-            std::vector<completion_token_output> probs = {};
-            if (!slot.params.stream && slot.stopped_word)
+            if (slot.state != PROCESSING || slot.command != NONE || slot.embedding)
             {
-                const std::vector<llama_token> stop_word_toks = llama_tokenize(ctx, slot.stopping_word, false);
-                probs = std::vector<completion_token_output>(slot.generated_token_probs.begin(), slot.generated_token_probs.end() - stop_word_toks.size());
+                continue;
             }
-            else
+            const int count = counts.at(slot.tenant);
+            if (slot.priority > priority || (slot.priority == priority && count <= n_slots_tenant + 1))
             {
-                probs = std::vector<completion_token_output>(
-                                    slot.generated_token_probs.begin(),
-                                    slot.generated_token_probs.begin() + slot.sent_token_probs_index);
+                continue;
+            }
+            // the lowest priority, then the tenant with the most slots, then the one that started last
+            if (victim == nullptr || slot.priority < victim->priority ||
+                (slot.priority == victim->priority && (count > victim_count ||
+                (count == victim_count && slot.t_start_process_prompt > victim->t_start_process_prompt))))
+            {
+                victim = &slot;
+                victim_count = count;
             }
-            res.result_json["completion_probabilities"] = probs_vector_to_json(ctx, probs);
         }
-
-        if (slot.oaicompat)
+        if (victim == nullptr)
         {
-            res.result_json["oaicompat_token_ctr"] = slot.n_decoded;
-            res.result_json["model"] = slot.oaicompat_model;
+            return nullptr;
         }
 
-        // parent multitask, if any, needs to be updated
-        if (slot.multitask_id != -1)
+        const llama_pos p0 = victim->n_system;
+        llama_client_slot parked = *victim;
+        parked.kv_swap.resize(llama_kv_cache_seq_get_size(ctx, victim->id, p0, -1));
+        if (llama_kv_cache_seq_get_data(ctx, victim->id, p0, -1, parked.kv_swap.data()) == 0)
         {
-            update_multi_task(slot.multitask_id, slot.task_id, res);
+            std::vector<uint8_t>().swap(parked.kv_swap);
+            parked.kv_dropped = true;
         }
+        llama_kv_cache_seq_rm(ctx, victim->id, p0, -1);
 
-        queue_results.push_back(res);
+        LOG_TEE("slot %d : preempted [task id: %d, priority: %d, tenant: '%s'], %zu bytes of KV swapped out\n",
+                victim->id, victim->task_id, victim->priority, victim->tenant.c_str(), parked.kv_swap.size());
+        parked_slots.push_back(std::move(parked));
+
+        // the parked slot took the sampling context and the images
+        llama_client_slot fresh;
+        fresh.id        = victim->id;
+        fresh.n_ctx     = victim->n_ctx;
+        fresh.system_id = victim->system_id;
+        fresh.n_system  = victim->n_system;
+        *victim = fresh;
+
+        return victim;
     }
 
-    void send_embedding(llama_client_slot &slot)
+    // continues a parked slot in the free slot
+    void resume_slot(llama_client_slot &slot, llama_client_slot &parked)
     {
-        std::lock_guard<std::mutex> lock(mutex_results);
-        task_result res;
-        res.id = slot.task_id;
-        res.multitask_id = slot.multitask_id;
-        res.error = false;
-        res.stop = true;
-
-        const int n_embd = llama_n_embd(model);
-        if (!params.embedding)
+        set_slot_system_prompt(slot, parked.system_id);
+        llama_kv_cache_seq_rm(ctx, slot.id, slot.n_system, -1);
+        if (slot.ctx_sampling != nullptr)
         {
-            LOG_WARNING("embedding disabled", {
-                                                  {"params.embedding", params.embedding},
-                                              });
-            res.result_json = json
-            {
-                {"embedding", std::vector<float>(n_embd, 0.0f)},
-            };
+            llama_sampling_free(slot.ctx_sampling);
         }
-        else
+
+        const int id = slot.id;
+        slot = std::move(parked);
+        slot.id = id;
+        slot.cache_tokens_dft.clear(); // they are in the draft sequence of the slot it left
+        slot.t_last_used = ggml_time_us();
+
+        if (!slot.kv_dropped)
         {
-            const float *data = llama_get_embeddings(ctx);
-            std::vector<float> embedding(data, data + n_embd);
-            res.result_json = json
+            bool restored;
+            while (!(restored = llama_kv_cache_seq_set_data(ctx, slot.id, slot.kv_swap.data()) > 0) &&
+                   (prefix_cache.evict(ctx) || swap_out_idle_slot()))
             {
-                {"embedding", embedding },
-            };
+            }
+            slot.kv_dropped = !restored;
         }
-        queue_results.push_back(res);
+        std::vector<uint8_t>().swap(slot.kv_swap);
+
+        all_slots_are_idle = false;
+
+        LOG_TEE("slot %d : resumed [task id: %d]%s\n", slot.id, slot.task_id, slot.kv_dropped ? ", evaluating its tokens again" : "");
     }
 
-    int request_completion(json data, bool infill, bool embedding, int multitask_id)
+    void process_tasks()
     {
-        std::unique_lock<std::mutex> lock(mutex_tasks);
-        task_server task;
-        task.id = id_gen++;
-        task.target_id = 0;
-        task.data = std::move(data);
-        task.infill_mode = infill;
-        task.embedding_mode = embedding;
-        task.type = COMPLETION_TASK;
-        task.multitask_id = multitask_id;
+        std::lock_guard<std::mutex> lock(mutex_tasks);
+        while (!queue_tasks.empty())
+        {
+            task_server task = queue_tasks.front();
+            queue_tasks.erase(queue_tasks.begin());
+            switch (task.type)
+            {
+                case COMPLETION_TASK: {
+                    // the tasks are given a slot by schedule_tasks
+                    queue_pending.push_back(task);
+                } break;
+                case CANCEL_TASK: { // release slot linked with the task id
+                    for (auto & slot : slots)
+                    {
+                        if (slot.task_id == task.target_id && slot.is_processing() && slot.command != RELEASE)
+                        {
+                            cancel_slot(slot);
+                            break;
+                        }
+                    }
+                    for (size_t i = 0; i < queue_pending.size(); ++i)
+                    {
+                        if (queue_pending[i].id == task.target_id || queue_pending[i].multitask_id == task.target_id)
+                        {
+                            queue_pending.erase(queue_pending.begin() + i--);
+                        }
+                    }
+                    for (size_t i = 0; i < parked_slots.size(); ++i)
+                    {
+                        if (parked_slots[i].task_id == task.target_id)
+                        {
+                            llama_sampling_free(parked_slots[i].ctx_sampling);
+                            parked_slots.erase(parked_slots.begin() + i);
+                            break;
+                        }
+                    }
+                } break;
+            }
+        }
 
-        // when a completion task's prompt array is not a singleton, we split it into multiple requests
-        if (task.data.at("prompt").size() > 1)
+        for (task_embedding &task : queue_embeddings)
         {
-            lock.unlock(); // entering new func scope
-            return split_multiprompt_task(task);
+            embd_tasks.push_back(std::move(task));
         }
+        queue_embeddings.clear();
 
-        // otherwise, it's a single-prompt task, we actually queue it
-        queue_tasks.push_back(task);
-        return task.id;
-    }
+        schedule_tasks();
 
-    task_result next_result(int task_id)
-    {
-        while (true)
+        // remove finished multitasks from the queue of multitasks, and add the corresponding result to the result queue
+        auto queue_iterator = queue_multitasks.begin();
+        while (queue_iterator != queue_multitasks.end())
         {
-            std::this_thread::sleep_for(std::chrono::microseconds(5));
-            std::lock_guard<std::mutex> lock(mutex_results);
-
-            if (queue_results.empty())
+            if (queue_iterator->subtasks_remaining.empty())
             {
-                continue;
-            }
+                // all subtasks done == multitask is done
+                task_result aggregate_result;
+                aggregate_result.id = queue_iterator->id;
+                aggregate_result.stop = true;
+                aggregate_result.error = false;
 
-            for (int i = 0; i < (int) queue_results.size(); i++)
-            {
-                // for now, tasks that have associated parent multitasks just get erased once multitask picks up the result
-                if (queue_results[i].multitask_id == task_id)
+                // collect json results into one json result
+                std::vector<json> result_jsons;
+                for (auto& subres : queue_iterator->results)
                 {
-                    update_multi_task(task_id, queue_results[i].id, queue_results[i]);
-                    queue_results.erase(queue_results.begin() + i);
-                    continue;
+                    result_jsons.push_back(subres.result_json);
+                    aggregate_result.error = aggregate_result.error && subres.error;
                 }
+                aggregate_result.result_json = json{ "results", result_jsons };
 
-                if (queue_results[i].id == task_id)
-                {
-                    assert(queue_results[i].multitask_id == -1);
-                    task_result res = queue_results[i];
-                    queue_results.erase(queue_results.begin() + i);
-                    return res;
-                }
+                push_result(aggregate_result);
+
+                queue_iterator = queue_multitasks.erase(queue_iterator);
+            }
+            else
+            {
+                ++queue_iterator;
             }
         }
-
-        // never reached
-        //return task_result{-1, false, false, {}};
     }
 
-    // for multiple images processing
-    bool ingest_images(llama_client_slot &slot, int n_batch)
+    // drafts the next tokens of the generating slots with the draft model: greedily, while the draft model is
+    // confident enough, with one batch for all the slots per drafted token. The tokens of a slot that are not in
+    // the draft KV cache yet are evaluated with its first draft
+    // the slots whose context has the n-gram at its end draft the tokens that followed it instead, see
+    // llama_ngram_index
+    void draft_slots()
     {
-        int image_idx = 0;
+        const int32_t n_vocab = ctx_dft != nullptr ? std::min(llama_n_vocab(model), llama_n_vocab(model_dft)) : 0;
 
-        while (image_idx < (int) slot.images.size())
+        if (ctx_dft != nullptr)
         {
-            slot_image &img = slot.images[image_idx];
+            llama_batch_clear(batch_dft);
+        }
 
-            // process prefix prompt
-            for (int32_t i = 0; i < (int32_t) batch.n_tokens; i += n_batch)
+        std::vector<std::pair<llama_client_slot *, int32_t>> drafting; // and the most tokens it can draft
+        for (llama_client_slot &slot : slots)
+        {
+            if (slot.state != PROCESSING || slot.command != NONE || slot.prefilling || slot.kv_dropped ||
+                slot.embedding || !slot.images.empty())
             {
-                const int32_t n_tokens = std::min(n_batch, (int32_t) (batch.n_tokens - i));
-                llama_batch batch_view = {
-                    n_tokens,
-                    batch.token    + i,
-                    nullptr,
-                    batch.pos      + i,
-                    batch.n_seq_id + i,
-                    batch.seq_id   + i,
-                    batch.logits   + i,
-                    0, 0, 0, // unused
-                };
-                if (llama_decode(ctx, batch_view))
-                {
-                    LOG_TEE("%s : failed to eval\n", __func__);
-                    return false;
-                }
+                continue;
             }
 
-            // process image with llm
-            for (int i = 0; i < img.image_tokens; i += n_batch)
+            // the drafted tokens must fit in the context of the slot and in the budget of the request
+            int32_t n_max = std::min(params.n_draft, slot.n_ctx - 2 - slot.n_past);
+            if (slot.n_remaining > 0)
             {
-                int n_eval = img.image_tokens - i;
-                if (n_eval > n_batch)
+                n_max = std::min(n_max, slot.n_remaining - 1);
+            }
+            if (n_max <= 0)
+            {
+                continue;
+            }
+
+            const int32_t n_hist = std::min(slot.n_past, (int32_t) slot.cache_tokens.size());
+
+            // the sampled token ends cache_tokens
+            if (params.n_lookup_ngram > 0 && (int32_t) slot.cache_tokens.size() > n_hist && slot.cache_tokens[n_hist] == slot.sampled)
+            {
+                if (slot.lookup.n_max != params.n_lookup_ngram)
                 {
-                    n_eval = n_batch;
+                    slot.lookup.init(std::min(2, params.n_lookup_ngram), params.n_lookup_ngram);
                 }
-
-                const int n_embd = llama_n_embd(model);
-                llama_batch batch_img = { n_eval, nullptr, (img.image_embedding + i * n_embd), nullptr, nullptr, nullptr, nullptr, slot.n_past, 1, 0, };
-                if (llama_decode(ctx, batch_img))
+                slot.lookup.update(slot.cache_tokens.data(), n_hist + 1, ngram_pool.N > 0 ? &ngram_pool : nullptr);
+                slot.lookup.draft(slot.draft, n_max);
+                if (slot.draft.empty() && ngram_pool.count(slot.sampled) > 0)
                 {
-                    LOG_TEE("%s : failed to eval image\n", __func__);
-                    return false;
+                    // the most recent n-gram of the pool that starts with the sampled token
+                    slot.draft.resize(ngram_pool.N - 1);
+                    ngram_pool.get(slot.sampled, 0, slot.draft.data());
+                    slot.draft.resize(std::min(n_max, ngram_pool.N - 1));
+                }
+                if (!slot.draft.empty())
+                {
+                    continue;
                 }
-                slot.n_past += n_eval;
             }
-            image_idx++;
-
-            llama_batch_clear(batch);
-
-            // append prefix of next image
-            const auto json_prompt = (image_idx >= (int) slot.images.size()) ?
-                slot.params.input_suffix : // no more images, then process suffix prompt
-                (json)(slot.images[image_idx].prefix_prompt);
-
-            std::vector<llama_token> append_tokens = tokenize(json_prompt, false); // has next image
-            for (int i = 0; i < (int) append_tokens.size(); ++i)
+            if (ctx_dft == nullptr)
             {
-                llama_batch_add(batch, append_tokens[i], slot.n_past, { slot.id }, true);
-                slot.n_past += 1;
+                continue;
             }
-        }
 
-        return true;
-    }
+            // the draft KV cache is kept up to the first token that differs
+            int32_t n_keep = 0;
+            while (n_keep < n_hist && n_keep < (int32_t) slot.cache_tokens_dft.size() &&
+                   slot.cache_tokens_dft[n_keep] == slot.cache_tokens[n_keep])
+            {
+                n_keep++;
+            }
+            slot.cache_tokens_dft.resize(n_keep);
+            llama_kv_cache_seq_rm(ctx_dft, slot.id, slot.n_system + n_keep, -1);
 
-    void request_cancel(int task_id)
-    {
-        std::lock_guard<std::mutex> lock(mutex_tasks);
-        task_server task;
-        task.id = id_gen++;
-        task.type = CANCEL_TASK;
-        task.target_id = task_id;
-        queue_tasks.push_back(task);
-    }
+            for (int32_t i = n_keep; i < n_hist; ++i)
+            {
+                llama_batch_add(batch_dft, slot.cache_tokens[i], slot.n_system + i, { slot.id }, false);
+                slot.cache_tokens_dft.push_back(slot.cache_tokens[i]);
+            }
+            llama_batch_add(batch_dft, slot.sampled, slot.n_system + n_hist, { slot.id }, true);
+            slot.cache_tokens_dft.push_back(slot.sampled);
 
-    int split_multiprompt_task(task_server& multiprompt_task)
-    {
-        int prompt_count = multiprompt_task.data.at("prompt").size();
-        assert(prompt_count > 1);
+            slot.i_batch_dft = batch_dft.n_tokens - 1;
+            drafting.emplace_back(&slot, n_max);
+        }
 
-        int multitask_id = id_gen++;
-        std::vector<int> subtask_ids(prompt_count);
-        for (int i = 0; i < prompt_count; i++)
+        for (int32_t n_round = 0; !drafting.empty(); ++n_round)
         {
-            json subtask_data = multiprompt_task.data;
-            subtask_data["prompt"] = subtask_data["prompt"][i];
+            for (int32_t i = 0; i < batch_dft.n_tokens; i += params.n_batch)
+            {
+                const int32_t n_tokens = std::min(params.n_batch, batch_dft.n_tokens - i);
+                llama_batch batch_view =
+                {
+                    n_tokens,
+                    batch_dft.token    + i,
+                    nullptr,
+                    batch_dft.pos      + i,
+                    batch_dft.n_seq_id + i,
+                    batch_dft.seq_id   + i,
+                    batch_dft.logits   + i,
+                    0, 0, 0, // unused
+                };
 
-            // subtasks inherit everything else (infill mode, embedding mode, etc.)
-            subtask_ids[i] = request_completion(subtask_data, multiprompt_task.infill_mode, multiprompt_task.embedding_mode, multitask_id);
-        }
+                if (llama_decode(ctx_dft, batch_view) != 0)
+                {
+                    // the draft KV cache is full: it is given back, the slots draft again from their whole context
+                    LOG_TEE("%s : failed to decode the batch of the draft model, clearing its KV cache\n", __func__);
+                    for (llama_client_slot &slot : slots)
+                    {
+                        llama_kv_cache_seq_rm(ctx_dft, slot.id, slot.n_system, -1);
+                        slot.cache_tokens_dft.clear();
+                        slot.draft.clear();
+                    }
+                    return;
+                }
 
-        // queue up the multitask so we can track its subtask progression
-        add_multi_task(multitask_id, subtask_ids);
-        return multitask_id;
-    }
+                for (const auto &d : drafting)
+                {
+                    llama_client_slot &slot = *d.first;
+                    if (slot.i_batch_dft < i || slot.i_batch_dft >= i + n_tokens)
+                    {
+                        continue;
+                    }
 
-    void process_tasks()
-    {
-        std::lock_guard<std::mutex> lock(mutex_tasks);
-        while (!queue_tasks.empty())
-        {
-            task_server task = queue_tasks.front();
-            queue_tasks.erase(queue_tasks.begin());
-            switch (task.type)
-            {
-                case COMPLETION_TASK: {
-                    llama_client_slot *slot = get_slot(json_value(task.data, "slot_id", -1));
-                    if (slot == nullptr)
+                    // the most likely token, and its probability
+                    const float *logits = llama_get_logits_ith(ctx_dft, slot.i_batch_dft - i);
+                    llama_token id = 0;
+                    for (llama_token t = 1; t < n_vocab; ++t)
                     {
-                        LOG_TEE("slot unavailable\n");
-                        // send error result
-                        send_error(task, "slot unavailable");
-                        return;
+                        if (logits[t] > logits[id])
+                        {
+                            id = t;
+                        }
+                    }
+                    double sum = 0.0;
+                    for (llama_token t = 0; t < n_vocab; ++t)
+                    {
+                        sum += std::exp(logits[t] - logits[id]);
                     }
 
-                    if (task.data.contains("system_prompt"))
+                    if (1.0 / sum >= params.p_accept)
                     {
-                        process_system_prompt_data(task.data["system_prompt"]);
+                        slot.draft.push_back(id);
                     }
+                    slot.i_batch_dft = -1;
+                }
+            }
+
+            // the slots that drafted a token in this round evaluate it to draft the next one
+            llama_batch_clear(batch_dft);
+
+            std::vector<std::pair<llama_client_slot *, int32_t>> next;
+            for (const auto &d : drafting)
+            {
+                llama_client_slot &slot = *d.first;
+                if ((int32_t) slot.draft.size() != n_round + 1 || (int32_t) slot.draft.size() >= d.second)
+                {
+                    continue;
+                }
+
+                llama_batch_add(batch_dft, slot.draft.back(), slot.n_system + (int32_t) slot.cache_tokens_dft.size(), { slot.id }, true);
+                slot.cache_tokens_dft.push_back(slot.draft.back());
+
+                slot.i_batch_dft = batch_dft.n_tokens - 1;
+                next.push_back(d);
+            }
+            drafting.swap(next);
+        }
+    }
 
-                    slot->reset();
+    // accepts the sampled token, sends it and releases the slot if it ends the generation
+    // returns false if the slot has released
+    bool process_sampled(llama_client_slot &slot, llama_token id)
+    {
+        completion_token_output result;
 
-                    slot->infill = task.infill_mode;
-                    slot->embedding = task.embedding_mode;
-                    slot->task_id = task.id;
-                    slot->multitask_id = task.multitask_id;
+        llama_sampling_accept(slot.ctx_sampling, ctx, id, true);
 
-                    if (!launch_slot_with_data(slot, task.data))
-                    {
-                        // send error result
-                        send_error(task, "internal_error");
-                        break;
-                    }
-                } break;
-                case CANCEL_TASK: { // release slot linked with the task id
-                    for (auto & slot : slots)
-                    {
-                        if (slot.task_id == task.target_id)
-                        {
-                            slot.release();
-                            break;
-                        }
-                    }
-                } break;
-            }
+        // the prompt has just been evaluated, the next requests can share it already
+        if (slot.n_decoded == 0 && slot.images.empty())
+        {
+            prefix_cache.insert(ctx, with_system_prompt(slot, slot.cache_tokens, slot.num_prompt_tokens), slot.n_system + slot.num_prompt_tokens, slot.id, slot.n_system);
         }
 
-        // remove finished multitasks from the queue of multitasks, and add the corresponding result to the result queue
-        auto queue_iterator = queue_multitasks.begin();
-        while (queue_iterator != queue_multitasks.end())
+        const int64_t t_now = ggml_time_us();
+        if (slot.n_decoded == 0)
         {
-            if (queue_iterator->subtasks_remaining.empty())
-            {
-                // all subtasks done == multitask is done
-                task_result aggregate_result;
-                aggregate_result.id = queue_iterator->id;
-                aggregate_result.stop = true;
-                aggregate_result.error = false;
+            metrics.n_prompt_tokens += slot.num_prompt_tokens_processed;
+            metrics.t_prompt_us     += t_now - slot.t_start_process_prompt;
+            metrics.ttft.observe(t_now - slot.t_queued);
+        }
+        else
+        {
+            metrics.n_predicted_tokens += 1;
+            metrics.t_predicted_us     += t_now - slot.t_last_token;
+            metrics.itl.observe(t_now - slot.t_last_token);
+        }
+        slot.t_last_token = t_now;
 
-                // collect json results into one json result
-                std::vector<json> result_jsons;
-                for (auto& subres : queue_iterator->results)
-                {
-                    result_jsons.push_back(subres.result_json);
-                    aggregate_result.error = aggregate_result.error && subres.error;
-                }
-                aggregate_result.result_json = json{ "results", result_jsons };
+        if (slot.n_decoded == 1)
+        {
+            slot.t_start_genereration = ggml_time_us();
+            slot.t_prompt_processing = (slot.t_start_genereration - slot.t_start_process_prompt) / 1e3;
+        }
 
-                std::lock_guard<std::mutex> lock(mutex_results);
-                queue_results.push_back(aggregate_result);
+        llama_token_data_array cur_p = { slot.ctx_sampling->cur.data(), slot.ctx_sampling->cur.size(), false };
+        result.tok = id;
 
-                queue_iterator = queue_multitasks.erase(queue_iterator);
-            }
-            else
-            {
-                ++queue_iterator;
-            }
+        const int32_t n_probs = slot.sparams.n_probs;
+        if (slot.sparams.temp <= 0 && n_probs > 0)
+        {
+            // for llama_sample_token_greedy we need to sort candidates
+            llama_sample_softmax(ctx, &cur_p);
+        }
+
+        for (size_t i = 0; i < std::min(cur_p.size, (size_t)n_probs); ++i)
+        {
+            result.probs.push_back({cur_p.data[i].id, cur_p.data[i].p});
         }
+
+        if (!process_token(result, slot))
+        {
+            slot.release();
+            slot.print_timings();
+            send_final_response(slot);
+            return false;
+        }
+        return true;
     }
 
     bool update_slots() {
         // attend tasks
         process_tasks();
 
-        // update the system prompt wait until all slots are idle state
-        if (system_need_update && all_slots_are_idle)
+        int n_processing = 0;
+        for (const llama_client_slot &slot : slots)
+        {
+            n_processing += slot.is_processing();
+        }
+        metrics.n_processing = n_processing;
+        metrics.n_deferred   = queue_pending.size() + parked_slots.size();
+        metrics.n_kv_used    = llama_get_kv_cache_used_cells(ctx);
+        metrics.n_kv_size    = n_ctx;
+
+        // the embedding inputs have a batch of their own
+        if (!embd_tasks.empty())
         {
-            LOG_TEE("updating system prompt\n");
-            update_system_prompt();
+            update_embeddings();
         }
 
         llama_batch_clear(batch);
 
-        if (all_slots_are_idle)
+        if (all_slots_are_idle && embd_tasks.empty())
         {
-            if (system_prompt.empty() && clean_kv_cache)
+            const bool system_empty = std::all_of(system_prompts.begin(), system_prompts.end(),
+                                                  [](const server_system_prompt &sys) { return sys.tokens.empty(); });
+            if (system_empty && clean_kv_cache)
             {
                 LOG_TEE("all slots are idle and system prompt is empty, clear the KV cache\n");
                 kv_cache_clear();
             }
-            // avoid 100% usage of cpu all time
-            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+            // sleep until the next task
+            std::unique_lock<std::mutex> lock(mutex_tasks);
+            condition_tasks.wait(lock, [this] { return !queue_tasks.empty() || wake_pending; });
+            wake_pending = false;
         }
 
         for (llama_client_slot &slot : slots)
@@ -1602,18 +3662,42 @@ struct llama_server_context
             {
                 // Shift context
                 const int n_left    = slot.n_past - slot.params.n_keep - 1;
-                const int n_discard = n_left / 2;
+                const int n_discard = slot.params.n_discard < 0 ? n_left / 2 : std::min(n_left, std::max(1, slot.params.n_discard));
+                const int n_system  = slot.n_system;
 
-                LOG_TEE("slot %d: context shift - n_keep = %d, n_left = %d, n_discard = %d\n", slot.id, slot.params.n_keep, n_left, n_discard);
-                llama_kv_cache_seq_rm   (ctx, slot.id, slot.params.n_keep + 1            , slot.params.n_keep + n_discard + 1);
-                llama_kv_cache_seq_shift(ctx, slot.id, slot.params.n_keep + 1 + n_discard, slot.n_past, -n_discard);
+                // the cells shared with the cached prefixes and the other slots must not move:
+                // they are evaluated again at their new positions instead
+                int n_shared = 0;
+                if (prefix_cache.enabled())
+                {
+                    n_shared = std::max(0, prefix_cache.overlap(with_system_prompt(slot, slot.cache_tokens, slot.cache_tokens.size())) - n_system);
+                    for (const llama_client_slot &other : slots)
+                    {
+                        if (other.id != slot.id && other.system_id == slot.system_id)
+                        {
+                            n_shared = std::max(n_shared, (int) common_part(other.cache_tokens, slot.cache_tokens));
+                        }
+                    }
+                }
 
-                for (size_t i = slot.params.n_keep + 1 + n_discard; i < slot.cache_tokens.size(); i++)
+                LOG_TEE("slot %d: context shift - n_keep = %d, n_left = %d, n_discard = %d\n", slot.id, slot.params.n_keep, n_left, n_discard);
+                if (n_shared > slot.params.n_keep + 1 + n_discard)
+                {
+                    LOG_TEE("slot %d: context shift - evaluating %d shared tokens again\n", slot.id, n_left - n_discard);
+                    llama_kv_cache_seq_rm(ctx, slot.id, n_system + slot.params.n_keep + 1, -1);
+                    for (int i = slot.params.n_keep + 1 + n_discard; i < slot.n_past; i++)
+                    {
+                        llama_batch_add(batch, slot.cache_tokens[i], n_system + i - n_discard, { slot.id }, false);
+                    }
+                }
+                else
                 {
-                    slot.cache_tokens[i - n_discard] = slot.cache_tokens[i];
+                    llama_kv_cache_seq_rm   (ctx, slot.id, n_system + slot.params.n_keep + 1            , n_system + slot.params.n_keep + n_discard + 1);
+                    llama_kv_cache_seq_shift(ctx, slot.id, n_system + slot.params.n_keep + 1 + n_discard, n_system + slot.n_past, -n_discard);
                 }
 
-                slot.cache_tokens.resize(slot.cache_tokens.size() - n_discard);
+                slot.cache_tokens.erase(slot.cache_tokens.begin() + slot.params.n_keep + 1,
+                                        slot.cache_tokens.begin() + slot.params.n_keep + 1 + n_discard);
 
                 slot.n_past -= n_discard;
 
@@ -1627,6 +3711,11 @@ struct llama_server_context
             }
         }
 
+        if ((ctx_dft != nullptr || params.n_lookup_ngram > 0) && params.n_draft > 0)
+        {
+            draft_slots();
+        }
+
         // decode any currently ongoing sequences
         for (auto & slot : slots)
         {
@@ -1637,8 +3726,23 @@ struct llama_server_context
                 slot.command = NONE;
                 slot.t_last_used = ggml_time_us();
 
+                // the rest of an unfinished prompt is not in the KV cache
+                if (slot.prefilling)
+                {
+                    slot.cache_tokens.resize(slot.n_past);
+                    slot.prefilling = false;
+                }
+
                 LOG_TEE("slot %d released (%d tokens in cache)\n", slot.id, (int) slot.cache_tokens.size());
 
+                save_ngram_pool();
+
+                if (slot.images.empty())
+                {
+                    const int32_t n_keep = std::min(slot.n_past, (int32_t) slot.cache_tokens.size());
+                    prefix_cache.insert(ctx, with_system_prompt(slot, slot.cache_tokens, n_keep), slot.n_system + n_keep, slot.id, slot.n_system);
+                }
+
                 continue;
             }
 
@@ -1647,9 +3751,37 @@ struct llama_server_context
                 continue;
             }
 
+            // a resumed slot whose KV could not be kept evaluates its tokens again
+            if (slot.kv_dropped)
+            {
+                for (int32_t i = 0; i < slot.n_past; ++i)
+                {
+                    llama_batch_add(batch, slot.cache_tokens[i], slot.n_system + i, { slot.id }, false);
+                }
+                slot.kv_dropped = false;
+            }
+
+            if (slot.prefilling)
+            {
+                continue;
+            }
+
+            // the drafted tokens follow, in the same view of the batch so that they are verified together
+            const int32_t n_view_left = params.n_batch - batch.n_tokens % params.n_batch - 1;
+
             slot.i_batch = batch.n_tokens;
 
-            llama_batch_add(batch, slot.sampled, system_tokens.size() + slot.n_past, { slot.id }, true);
+            llama_batch_add(batch, slot.sampled, slot.n_system + slot.n_past, { slot.id }, true);
+
+            if ((int32_t) slot.draft.size() > n_view_left)
+            {
+                slot.draft.resize(n_view_left);
+            }
+            for (size_t j = 0; j < slot.draft.size(); ++j)
+            {
+                llama_batch_add(batch, slot.draft[j], slot.n_system + slot.n_past + 1 + j, { slot.id }, true);
+            }
+            slot.n_drafted += slot.draft.size();
 
             slot.n_decoded += 1;
             slot.n_past += 1;
@@ -1708,7 +3840,7 @@ struct llama_server_context
                     }
                     else
                     {
-                        prompt_tokens = tokenize(slot.prompt, system_prompt.empty() && add_bos_token);  // add BOS if there isn't system prompt
+                        prompt_tokens = tokenize(slot.prompt, slot.n_system == 0 && add_bos_token);  // add BOS if there isn't system prompt
                     }
 
                     slot.num_prompt_tokens = prompt_tokens.size();
@@ -1742,10 +3874,24 @@ struct llama_server_context
                         GGML_ASSERT(slot.num_prompt_tokens < slot.n_ctx);
                     }
 
+                    if (!slot.kv_swap.empty())
+                    {
+                        swap_in(slot);
+                    }
+
                     if (!slot.params.cache_prompt)
                     {
                         llama_sampling_reset(slot.ctx_sampling);
 
+                        // the grammar provider is given the program of the prompt
+                        if (slot.ctx_sampling->grammar_provider != nullptr)
+                        {
+                            for (auto &token : prompt_tokens)
+                            {
+                                llama_sampling_accept(slot.ctx_sampling, ctx, token, false);
+                            }
+                        }
+
                         slot.n_past = 0;
                         slot.num_prompt_tokens_processed = slot.num_prompt_tokens;
                     }
@@ -1763,11 +3909,20 @@ struct llama_server_context
                         LOG_TEE("slot %d : in cache: %i tokens | to process: %i tokens\n", slot.id, slot.n_past, slot.num_prompt_tokens_processed);
                     }
 
-                    LOG_TEE("slot %d : kv cache rm - [%d, end)\n", slot.id, (int) system_tokens.size() + slot.n_past);
+                    // a longer prefix evaluated by another slot is shared with this one
+                    llama_seq_id seq_id_cached = -1;
+                    const int32_t n_cached = slot.images.empty() ?
+                        std::max(0, prefix_cache.find(with_system_prompt(slot, prompt_tokens, prompt_tokens.size()), seq_id_cached) - slot.n_system) : 0;
+                    if (n_cached > slot.n_past)
+                    {
+                        LOG_TEE("slot %d : prefix cache: %i tokens from seq %d\n", slot.id, n_cached, seq_id_cached);
 
-                    llama_kv_cache_seq_rm(ctx, slot.id, system_tokens.size() + slot.n_past, -1);
+                        llama_kv_cache_seq_rm(ctx, slot.id, slot.n_system, -1);
+                        llama_kv_cache_seq_cp(ctx, seq_id_cached, slot.id, slot.n_system, slot.n_system + n_cached);
 
-                    slot.cache_tokens = prompt_tokens;
+                        slot.n_past = n_cached;
+                        slot.num_prompt_tokens_processed = slot.num_prompt_tokens - slot.n_past;
+                    }
 
                     if (slot.n_past == slot.num_prompt_tokens)
                     {
@@ -1776,6 +3931,18 @@ struct llama_server_context
                         slot.n_past--;
                     }
 
+                    // the prelude in the prompt is not part of the program
+                    if (!slot.sparams.prelude.empty())
+                    {
+                        llama_sampling_set_prelude_len(slot.ctx_sampling, tokenize(slot.sparams.prelude, slot.n_system == 0 && add_bos_token).size());
+                    }
+
+                    LOG_TEE("slot %d : kv cache rm - [%d, end)\n", slot.id, slot.n_system + slot.n_past);
+
+                    llama_kv_cache_seq_rm(ctx, slot.id, slot.n_system + slot.n_past, -1);
+
+                    slot.cache_tokens = prompt_tokens;
+
                     LOG_VERBOSE("prompt ingested", {
                                                     {"n_past", slot.n_past},
                                                     {"cached", tokens_to_str(ctx, slot.cache_tokens.cbegin(), slot.cache_tokens.cbegin() + slot.n_past)},
@@ -1784,11 +3951,20 @@ struct llama_server_context
 
                     const bool has_images = process_images(slot);
 
+                    // the prompt is added to the batches of the next steps, along with the generated tokens
+                    if (n_step_tokens > 0 && !has_images)
+                    {
+                        slot.prefilling = true;
+                        slot.n_decoded  = 0;
+                        slot.i_batch    = -1;
+                        continue;
+                    }
+
                     // process the prefix of first image
                     std::vector<llama_token> prefix_tokens = has_images ? tokenize(slot.images[0].prefix_prompt, add_bos_token) : prompt_tokens;
                     for (; slot.n_past < (int) prefix_tokens.size(); ++slot.n_past)
                     {
-                       llama_batch_add(batch, prefix_tokens[slot.n_past], system_tokens.size() + slot.n_past, { slot.id }, false);
+                       llama_batch_add(batch, prefix_tokens[slot.n_past], slot.n_system + slot.n_past, { slot.id }, false);
                     }
 
                     if (has_images && !ingest_images(slot, n_batch))
@@ -1809,6 +3985,46 @@ struct llama_server_context
             }
         }
 
+        // the prompts get what is left of the step, the oldest first, and at least their share of it
+        if (n_step_tokens > 0)
+        {
+            std::vector<llama_client_slot *> prefilling;
+            for (auto & slot : slots)
+            {
+                if (slot.prefilling)
+                {
+                    prefilling.push_back(&slot);
+                }
+            }
+            std::sort(prefilling.begin(), prefilling.end(), [](const llama_client_slot * a, const llama_client_slot * b) {
+                return a->t_start_process_prompt < b->t_start_process_prompt;
+            });
+
+            int32_t n_prefill = std::max(n_step_tokens - batch.n_tokens, std::max(1, (int32_t) (prefill_ratio * n_step_tokens)));
+            for (llama_client_slot * slot : prefilling)
+            {
+                const int32_t n_chunk = std::min(n_prefill, (int32_t) slot->cache_tokens.size() - slot->n_past);
+                for (int32_t k = 0; k < n_chunk; ++k, ++slot->n_past)
+                {
+                    llama_batch_add(batch, slot->cache_tokens[slot->n_past], slot->n_system + slot->n_past, { slot->id }, false);
+                }
+                n_prefill -= n_chunk;
+
+                // extract the logits only for the last token of the prompt
+                if (slot->n_past == (int32_t) slot->cache_tokens.size())
+                {
+                    batch.logits[batch.n_tokens - 1] = true;
+                    slot->i_batch    = batch.n_tokens - 1;
+                    slot->prefilling = false;
+                }
+
+                if (n_prefill == 0)
+                {
+                    break;
+                }
+            }
+        }
+
         if (batch.n_tokens == 0)
         {
             all_slots_are_idle = true;
@@ -1831,8 +4047,16 @@ struct llama_server_context
             };
 
             const int ret = llama_decode(ctx, batch_view);
+            metrics.n_decode += 1;
             if (ret != 0)
             {
+                // the cells of the cached prefixes and of the idle slots are given back first
+                if (ret > 0 && (prefix_cache.evict(ctx) || swap_out_idle_slot()))
+                {
+                    i -= n_batch;
+                    continue;
+                }
+
                 if (n_batch == 1 || ret < 0)
                 {
                     // if you get here, it means the KV cache is full - try increasing it via the context size
@@ -1847,61 +4071,409 @@ struct llama_server_context
                 i -= n_batch;
                 continue;
             }
+            metrics.batch_tokens.observe(n_tokens);
+
+            // the slots of this batch are sampled together, their grammars and samplers run in parallel
+            std::vector<llama_client_slot *>      batch_slots;
+            std::vector<llama_sampling_context *> batch_ctx_samplings;
+            std::vector<int>                      batch_idxs;
+
+            for (auto & slot : slots)
+            {
+                if (slot.i_batch < (int) i || slot.i_batch >= (int) (i + n_tokens))
+                {
+                    continue;
+                }
+
+                // prompt evaluated for embedding
+                if (slot.embedding)
+                {
+                    send_embedding(slot);
+                    slot.release();
+                    slot.i_batch = -1;
+                    continue;
+                }
+
+                batch_slots.push_back(&slot);
+                batch_ctx_samplings.push_back(slot.ctx_sampling);
+                batch_idxs.push_back(slot.i_batch - i);
+            }
+
+            const std::vector<llama_token> batch_ids = llama_sampling_sample_batch(batch_ctx_samplings, ctx, batch_idxs, params.n_threads);
+
+            for (size_t k = 0; k < batch_slots.size(); ++k)
+            {
+                llama_client_slot & slot = *batch_slots[k];
+
+                // a drafted token is kept if it is the one sampled after the previous token, then the token
+                // sampled after it is the next one: the output is the same as without the draft
+                llama_token id = batch_ids[k];
+                for (size_t j = 0; process_sampled(slot, id) && j < slot.draft.size() && id == slot.draft[j] &&
+                                   slot.i_batch + 1 + (int32_t) j < i + n_tokens; ++j)
+                {
+                    slot.n_decoded  += 1;
+                    slot.n_past     += 1;
+                    slot.n_accepted += 1;
+                    id = llama_sampling_sample(slot.ctx_sampling, ctx, nullptr, slot.i_batch + 1 + j - i);
+                }
+
+                slot.i_batch = -1;
+            }
+        }
+
+        // the KV of the drafted tokens that were not kept is removed
+        for (auto & slot : slots)
+        {
+            if (!slot.draft.empty())
+            {
+                llama_kv_cache_seq_rm(ctx, slot.id, slot.n_system + slot.n_past, -1);
+                slot.draft.clear();
+            }
+        }
+        return true;
+    }
+};
+
+// the absolute path of an existing file or directory, with the symbolic links resolved
+static bool canonical_path(const std::string &path, std::string &out)
+{
+#if defined(_WIN32)
+    char buf[_MAX_PATH];
+    if (_fullpath(buf, path.c_str(), _MAX_PATH) == NULL)
+    {
+        return false;
+    }
+    out = buf;
+    std::ifstream file(out);
+    return (bool) file;
+#else
+    char * buf = realpath(path.c_str(), NULL);
+    if (buf == NULL)
+    {
+        return false;
+    }
+    out = buf;
+    free(buf);
+    return true;
+#endif
+}
+
+// the models served next to the one of --model, selected by the "model" field of the requests
+// each one has its own context, slots and task loop; they are loaded in the background while the others keep
+// serving, and the least recently used idle ones are unloaded when a new one does not fit in the memory budget
+struct server_model_registry
+{
+    struct entry
+    {
+        std::string path;
+        std::string lora;
+        std::string state = "loading"; // loading, loaded or failed
+        size_t      size  = 0;         // size of the file until it is loaded, then of the weights
+
+        std::shared_ptr<llama_server_context> llama;
+
+        std::atomic<bool> stop{false};
+        std::atomic<bool> done{false}; // the thread of the model has returned
+        std::atomic<int>  n_active{0}; // requests that are using the model
+        int64_t t_last_used = 0;
+    };
+
+    // the thread that loads a model and then runs its task loop, joined by shutdown
+    struct loader
+    {
+        std::shared_ptr<entry> e;
+        std::thread            thread;
+    };
+
+    std::shared_ptr<llama_server_context> llama_default;
+    gpt_params  params_default;
+    size_t      budget = 0; // bytes of weights of all the models, 0 = unlimited
+    std::string dir;        // canonical path of --models-dir, empty = no model may be loaded by a request
+
+    using entry_map = std::map<std::string, std::shared_ptr<entry>>;
+
+    entry_map           entries;
+    std::vector<loader> loaders;
+    bool                shutting_down = false;
+    std::mutex          mutex;
+
+    ~server_model_registry()
+    {
+        shutdown();
+    }
+
+    // the path of a file named by a request, relative to --models-dir: the files outside of it are refused
+    bool resolve(const std::string &path, std::string &resolved, std::string &error) const
+    {
+        if (dir.empty())
+        {
+            error = "loading models is disabled, see --models-dir";
+            return false;
+        }
+#if defined(_WIN32)
+        const char sep = '\\';
+#else
+        const char sep = '/';
+#endif
+        const std::string prefix = dir.back() == sep ? dir : dir + sep;
+        if (path.empty() || !canonical_path(prefix + path, resolved) || resolved.compare(0, prefix.size(), prefix) != 0)
+        {
+            error = "not a file of the models directory: " + path;
+            return false;
+        }
+        return true;
+    }
+
+    // stops the task loops of all the models and waits for their threads, including the ones still loading
+    void shutdown()
+    {
+        std::vector<loader> pending;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            shutting_down = true;
+            for (loader &l : loaders)
+            {
+                l.e->stop = true;
+                if (l.e->llama)
+                {
+                    l.e->llama->wake();
+                }
+            }
+            pending.swap(loaders);
+            entries.clear();
+        }
+        for (loader &l : pending)
+        {
+            l.thread.join();
+        }
+    }
+
+    // the model of a request, kept loaded until the returned pointer is released
+    // the names that are not in the registry (e.g. the OAI model names) select the default model
+    std::shared_ptr<llama_server_context> acquire(const std::string &name, std::string &error)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = entries.find(name);
+        if (it == entries.end())
+        {
+            return llama_default;
+        }
+        std::shared_ptr<entry> e = it->second;
+        if (e->state != "loaded")
+        {
+            error = "model " + name + " is " + (e->state == "loading" ? "still loading" : "not available, it failed to load");
+            return nullptr;
+        }
+        e->n_active++;
+        e->t_last_used = ggml_time_us();
+        return std::shared_ptr<llama_server_context>(e->llama.get(), [e](llama_server_context * llama) {
+            // the task loop of an unloaded model exits once the last request is done
+            if (--e->n_active == 0 && e->stop)
+            {
+                llama->wake();
+            }
+        });
+    }
+
+    bool load(const std::string &name, const std::string &path, const std::string &lora, std::string &error)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (shutting_down)
+        {
+            error = "the server is shutting down";
+            return false;
+        }
+        if (name.empty() || name == params_default.model_alias)
+        {
+            error = "invalid model name: " + name;
+            return false;
+        }
+        auto it = entries.find(name);
+        if (it != entries.end() && it->second->state != "failed")
+        {
+            error = "model " + name + " is already " + it->second->state;
+            return false;
+        }
+
+        std::ifstream file(path, std::ios::binary | std::ios::ate);
+        if (!file)
+        {
+            error = "failed to open " + path;
+            return false;
+        }
+        const size_t size = file.tellg();
+        if (!make_room_locked(size, error))
+        {
+            return false;
+        }
 
-            for (auto & slot : slots)
-            {
-                if (slot.i_batch < (int) i || slot.i_batch >= (int) (i + n_tokens))
-                {
-                    continue;
-                }
+        std::shared_ptr<entry> e = std::make_shared<entry>();
+        e->path = path;
+        e->lora = lora;
+        e->size = size;
+        e->t_last_used = ggml_time_us();
+        entries[name] = e;
 
-                // prompt evaluated for embedding
-                if (slot.embedding)
-                {
-                    send_embedding(slot);
-                    slot.release();
-                    slot.i_batch = -1;
-                    return true;
-                }
+        LOG_INFO("loading model", {{"model", name}, {"path", path}, {"lora", lora}});
 
-                completion_token_output result;
-                const llama_token id = llama_sampling_sample(slot.ctx_sampling, ctx, NULL, slot.i_batch - i);
+        // the threads of the unloaded models that have returned
+        loaders.erase(std::remove_if(loaders.begin(), loaders.end(), [](loader &l) {
+            if (l.e->done)
+            {
+                l.thread.join();
+                return true;
+            }
+            return false;
+        }), loaders.end());
 
-                llama_sampling_accept(slot.ctx_sampling, ctx, id, true);
+        loaders.push_back({e, std::thread([this, name, e]() {
+            run(name, e);
+            e->done = true;
+        })});
 
-                if (slot.n_decoded == 1)
-                {
-                    slot.t_start_genereration = ggml_time_us();
-                    slot.t_prompt_processing = (slot.t_start_genereration - slot.t_start_process_prompt) / 1e3;
-                }
+        return true;
+    }
 
-                llama_token_data_array cur_p = { slot.ctx_sampling->cur.data(), slot.ctx_sampling->cur.size(), false };
-                result.tok = id;
+    bool unload(const std::string &name, std::string &error)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = entries.find(name);
+        if (it == entries.end() || it->second->state == "loading")
+        {
+            error = it == entries.end() ? "model " + name + " is not loaded" : "model " + name + " is still loading";
+            return false;
+        }
+        unload_locked(it);
+        return true;
+    }
 
-                const int32_t n_probs = slot.sparams.n_probs;
-                if (slot.sparams.temp <= 0 && n_probs > 0)
-                {
-                    // for llama_sample_token_greedy we need to sort candidates
-                    llama_sample_softmax(ctx, &cur_p);
-                }
+    json to_json()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        json data = json::array();
+        for (const auto &it : entries)
+        {
+            data.push_back({
+                {"id",       it.first},
+                {"object",   "model"},
+                {"owned_by", "llamacpp"},
+                {"path",     it.second->path},
+                {"lora",     it.second->lora},
+                {"status",   it.second->state},
+                {"size",     it.second->size},
+                {"n_active", it.second->n_active.load()},
+            });
+        }
+        return data;
+    }
 
-                for (size_t i = 0; i < std::min(cur_p.size, (size_t)n_probs); ++i)
-                {
-                    result.probs.push_back({cur_p.data[i].id, cur_p.data[i].p});
-                }
+private:
+    void unload_locked(entry_map::iterator it)
+    {
+        LOG_INFO("unloading model", {{"model", it->first}});
+        // the task loop frees the model once the requests in flight are done
+        it->second->stop = true;
+        if (it->second->llama)
+        {
+            it->second->llama->wake();
+        }
+        entries.erase(it);
+    }
 
-                if (!process_token(result, slot))
-                {
-                    slot.release();
-                    slot.print_timings();
-                    send_final_response(slot);
-                }
+    // unloads the least recently used idle models until size more bytes fit in the budget
+    bool make_room_locked(size_t size, std::string &error)
+    {
+        if (budget == 0)
+        {
+            return true;
+        }
 
-                slot.i_batch = -1;
+        size_t used = llama_model_size(llama_default->model);
+        size_t freeable = 0;
+        std::vector<entry_map::iterator> idle;
+        for (auto it = entries.begin(); it != entries.end(); ++it)
+        {
+            used += it->second->size;
+            if (it->second->state != "loading" && it->second->n_active == 0)
+            {
+                freeable += it->second->size;
+                idle.push_back(it);
             }
         }
+        if (used - freeable + size > budget)
+        {
+            error = "not enough memory budget left for the model";
+            return false;
+        }
+
+        std::sort(idle.begin(), idle.end(), [](const entry_map::iterator &a, const entry_map::iterator &b) {
+            return a->second->t_last_used < b->second->t_last_used;
+        });
+        for (size_t i = 0; used + size > budget; ++i)
+        {
+            used -= idle[i]->second->size;
+            unload_locked(idle[i]);
+        }
         return true;
     }
+
+    void run(const std::string &name, std::shared_ptr<entry> e)
+    {
+        gpt_params params = params_default;
+        params.model       = e->path;
+        params.model_alias = name;
+        params.mmproj      = "";
+        params.model_draft = "";
+        params.lora_adapter.clear();
+        if (!e->lora.empty())
+        {
+            params.lora_adapter.emplace_back(e->lora, 1.0f);
+            params.use_mmap = false;
+        }
+
+        std::shared_ptr<llama_server_context> llama = std::make_shared<llama_server_context>();
+        llama->n_ctx_slot       = llama_default->n_ctx_slot;
+        llama->n_prefix_cache   = llama_default->n_prefix_cache;
+        llama->n_system_prompts = llama_default->n_system_prompts;
+        llama->dynamic_grammars = llama_default->dynamic_grammars;
+        llama->n_step_tokens    = llama_default->n_step_tokens;
+        llama->prefill_ratio    = llama_default->prefill_ratio;
+        llama->process_system_prompt_data(llama_default->system_prompt_data());
+
+        if (!llama->load_model(params))
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            e->state = "failed";
+            return;
+        }
+        llama->initialize();
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            e->llama = llama;
+            e->size  = llama_model_size(llama->model);
+            e->state = "loaded";
+        }
+        LOG_INFO("model loaded", {{"model", name}});
+
+        // at shutdown, the slots left processing have no client waiting for them
+        while (!(e->stop && e->n_active == 0 && (llama->all_slots_are_idle || is_shutting_down())))
+        {
+            llama->update_slots();
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            e->llama.reset();
+        }
+        LOG_INFO("model unloaded", {{"model", name}});
+    }
+
+    bool is_shutting_down()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return shutting_down;
+    }
 };
 
 static void server_print_usage(const char *argv0, const gpt_params &params,
@@ -1934,10 +4506,13 @@ static void server_print_usage(const char *argv0, const gpt_params &params,
     {
         printf("  --no-mmap             do not memory-map model (slower load but may reduce pageouts if not using mlock)\n");
     }
+    printf("  --vocab-cache         keep the tokenizer index in MODEL.vocab-cache, built on the first load and mapped on the next ones\n");
     printf("  --numa                attempt optimizations that help on some NUMA systems\n");
 #ifdef LLAMA_SUPPORTS_GPU_OFFLOAD
     printf("  -ngl N, --n-gpu-layers N\n");
     printf("                        number of layers to store in VRAM\n");
+    printf("  -ngld N, --n-gpu-layers-draft N\n");
+    printf("                        number of layers of the draft model to store in VRAM\n");
     printf("  -ts SPLIT --tensor-split SPLIT\n");
     printf("                        how to split tensors across multiple GPUs, comma-separated list of proportions, e.g. 3,1\n");
     printf("  -mg i, --main-gpu i   the GPU to use for scratch and small tensors\n");
@@ -1947,6 +4522,14 @@ static void server_print_usage(const char *argv0, const gpt_params &params,
 #endif
     printf("  -m FNAME, --model FNAME\n");
     printf("                        model path (default: %s)\n", params.model.c_str());
+    printf("  -md FNAME, --model-draft FNAME\n");
+    printf("                        draft model of the speculative decoding, its tokens are verified by the model (default: unused)\n");
+    printf("  --draft N             most tokens drafted for each slot per step (default: %d)\n", params.n_draft);
+    printf("  -pa N, --p-accept N   the draft ends at a token of a lower probability for the draft model (default: %.1f)\n", (double) params.p_accept);
+    printf("  --lookup-ngram N      draft the tokens that followed the last n-gram of the context earlier in it, with n-grams\n");
+    printf("                        of at most N tokens, without a draft model (default: %d, 0 = disabled)\n", params.n_lookup_ngram);
+    printf("  --ngram-pool FNAME    with --lookup-ngram, also draft from the n-grams of all the slots and of the previous runs,\n");
+    printf("                        loaded from FNAME and saved to it (default: none)\n");
     printf("  -a ALIAS, --alias ALIAS\n");
     printf("                        set an alias for the model, will be added as `model` field in completion response\n");
     printf("  --lora FNAME          apply LoRA adapter (implies --no-mmap)\n");
@@ -1959,10 +4542,36 @@ static void server_print_usage(const char *argv0, const gpt_params &params,
     printf("  --embedding           enable embedding vector output (default: %s)\n", params.embedding ? "enabled" : "disabled");
     printf("  -np N, --parallel N   number of slots for process requests (default: %d)\n", params.n_parallel);
     printf("  -cb, --cont-batching  enable continuous batching (a.k.a dynamic batching) (default: disabled)\n");
+    printf("  --prefix-cache N      number of prompt prefixes kept in the KV cache and shared by all the slots (default: 0, disabled)\n");
+    printf("  --image-cache N       number of image embeddings kept for the images sent again, with --mmproj (default: 0, disabled)\n");
+    printf("  --step-tokens N       tokens evaluated per step, the prompts are evaluated in chunks next to the generated tokens (default: 0, whole prompts)\n");
+    printf("  --prefill-ratio F     share of --step-tokens left to the prompts when many slots are generating (default: 0.25)\n");
+    printf("  --slot-ctx N          context size of each slot, the idle slots are swapped out to host memory when the KV cache is full (default: ctx-size / parallel)\n");
     printf("    -spf FNAME, --system-prompt-file FNAME\n");
     printf("                        Set a file to load a system prompt (initial prompt of all slots), this is useful for chat applications.\n");
+    printf("  --system-prompts N    number of system prompts kept in the KV cache when no slot uses them, for the requests that select them (default: 4)\n");
     printf("  --mmproj MMPROJ_FILE  path to a multimodal projector file for LLaVA.\n");
+    printf("  --extra-model NAME=FNAME\n");
+    printf("                        load another model in the background, served to the requests with \"model\": NAME (can be repeated)\n");
+    printf("  --models-budget N     memory budget in MiB of the weights of all the models, the least recently used ones are unloaded to fit (default: 0, unlimited)\n");
+    printf("  --models-dir DIR      directory of the models and LoRA adapters that /models/load may load, named relative to it (default: none, /models/load disabled)\n");
+    printf("  --prelude FNAME       default prelude of the prompts, which the dynamic grammar provider skips\n");
+    printf("  --dynamic-grammar-cmd CMD\n");
+    printf("                        LSP command that computes the grammar of the requests with a dynamic_grammar (default: %s)\n", params.sparams.dynamic_grammar_cmd.c_str());
+    printf("                        a path ending in .so, .dylib or .dll is loaded in-process as a grammar plugin\n");
+    printf("  --dynamic-grammar-allow TARGET\n");
+    printf("                        allow the requests with \"dynamic_grammar\": TARGET, the other requests with a dynamic_grammar are rejected (can be repeated)\n");
+    printf("  --dynamic-grammar-prelude FNAME\n");
+    printf("                        prelude the LSP type checks against (default: %s)\n", params.sparams.dynamic_grammar_prelude.c_str());
+    printf("  --grammar-prefetch N  default and largest number of candidates of a token whose dynamic grammar is queried ahead (default: %d, 0 = disabled)\n", params.sparams.grammar_prefetch);
+    printf("  --trace FNAME         write the timings of the sampling phases to FNAME (default: none)\n");
+    printf("  --trace-format {jsonl,chrome}\n");
+    printf("                        format of the trace, chrome can be loaded in chrome://tracing or Perfetto (default: jsonl)\n");
+    printf("  --trace-rate N        fraction of the sampled tokens that are traced (default: %.1f)\n", (double) params.trace.rate);
+    printf("  --bench-trace FNAME   replay the requests of the JSONL trace FNAME at their arrival times instead of serving HTTP,\n");
+    printf("                        and print the throughput, latencies and KV cache usage as JSON\n");
     printf("  --log-disable         disables logging to a file.\n");
+    printf("  --log-async           write the logs from a background thread.\n");
     printf("\n");
 }
 
@@ -2032,6 +4641,66 @@ static void server_params_parse(int argc, char **argv, server_params &sparams,
             }
             params.model = argv[i];
         }
+        else if (arg == "-md" || arg == "--model-draft")
+        {
+            if (++i >= argc)
+            {
+                invalid_param = true;
+                break;
+            }
+            params.model_draft = argv[i];
+        }
+        else if (arg == "--draft")
+        {
+            if (++i >= argc)
+            {
+                invalid_param = true;
+                break;
+            }
+            params.n_draft = std::stoi(argv[i]);
+        }
+        else if (arg == "--lookup-ngram")
+        {
+            if (++i >= argc)
+            {
+                invalid_param = true;
+                break;
+            }
+            params.n_lookup_ngram = std::stoi(argv[i]);
+        }
+        else if (arg == "--ngram-pool")
+        {
+            if (++i >= argc)
+            {
+                invalid_param = true;
+                break;
+            }
+            params.path_ngram_pool = argv[i];
+        }
+        else if (arg == "--p-accept" || arg == "-pa")
+        {
+            if (++i >= argc)
+            {
+                invalid_param = true;
+                break;
+            }
+            params.p_accept = std::stof(argv[i]);
+        }
+        else if (arg == "--gpu-layers-draft" || arg == "-ngld" || arg == "--n-gpu-layers-draft")
+        {
+            if (++i >= argc)
+            {
+                invalid_param = true;
+                break;
+            }
+#ifdef LLAMA_SUPPORTS_GPU_OFFLOAD
+            params.n_gpu_layers_draft = std::stoi(argv[i]);
+#else
+            LOG_WARNING("Not compiled with GPU offload support, --n-gpu-layers-draft option will be ignored. "
+                        "See main README.md for information on enabling GPU BLAS support",
+                        {{"n_gpu_layers_draft", params.n_gpu_layers_draft}});
+#endif
+        }
         else if (arg == "-a" || arg == "--alias")
         {
             if (++i >= argc)
@@ -2264,69 +4933,255 @@ static void server_params_parse(int argc, char **argv, server_params &sparams,
         {
             params.use_mmap = false;
         }
-        else if (arg == "--numa")
+        else if (arg == "--vocab-cache")
+        {
+            params.vocab_cache = true;
+        }
+        else if (arg == "--numa")
+        {
+            params.numa = true;
+        }
+        else if (arg == "--embedding")
+        {
+            params.embedding = true;
+        }
+        else if (arg == "-cb" || arg == "--cont-batching")
+        {
+            params.cont_batching = true;
+        }
+        else if (arg == "-np" || arg == "--parallel")
+        {
+            if (++i >= argc)
+            {
+                invalid_param = true;
+                break;
+            }
+            params.n_parallel = std::stoi(argv[i]);
+        }
+        else if (arg == "--prefix-cache")
+        {
+            if (++i >= argc)
+            {
+                invalid_param = true;
+                break;
+            }
+            llama.n_prefix_cache = std::stoi(argv[i]);
+        }
+        else if (arg == "--system-prompts")
+        {
+            if (++i >= argc)
+            {
+                invalid_param = true;
+                break;
+            }
+            llama.n_system_prompts = std::stoi(argv[i]);
+        }
+        else if (arg == "--image-cache")
+        {
+            if (++i >= argc)
+            {
+                invalid_param = true;
+                break;
+            }
+            llama.image_cache.n_max = std::stoi(argv[i]);
+        }
+        else if (arg == "--step-tokens")
+        {
+            if (++i >= argc)
+            {
+                invalid_param = true;
+                break;
+            }
+            llama.n_step_tokens = std::stoi(argv[i]);
+        }
+        else if (arg == "--prefill-ratio")
+        {
+            if (++i >= argc)
+            {
+                invalid_param = true;
+                break;
+            }
+            llama.prefill_ratio = std::stof(argv[i]);
+        }
+        else if (arg == "--slot-ctx")
+        {
+            if (++i >= argc)
+            {
+                invalid_param = true;
+                break;
+            }
+            llama.n_ctx_slot = std::stoi(argv[i]);
+        } else if (arg == "-n" || arg == "--n-predict")
+        {
+            if (++i >= argc)
+            {
+                invalid_param = true;
+                break;
+            }
+            params.n_predict = std::stoi(argv[i]);
+        } else if (arg == "-spf" || arg == "--system-prompt-file")
+        {
+            if (++i >= argc)
+            {
+                invalid_param = true;
+                break;
+            }
+            std::ifstream file(argv[i]);
+            if (!file) {
+                fprintf(stderr, "error: failed to open file '%s'\n", argv[i]);
+                invalid_param = true;
+                break;
+            }
+            std::string systm_content;
+            std::copy(
+                std::istreambuf_iterator<char>(file),
+                std::istreambuf_iterator<char>(),
+                std::back_inserter(systm_content)
+            );
+            llama.process_system_prompt_data(json::parse(systm_content));
+        }
+        else if (arg == "--prelude")
+        {
+            if (++i >= argc)
+            {
+                invalid_param = true;
+                break;
+            }
+            std::ifstream file(argv[i]);
+            if (!file) {
+                fprintf(stderr, "error: failed to open prelude '%s'\n", argv[i]);
+                invalid_param = true;
+                break;
+            }
+            params.sparams.prelude.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+        }
+        else if (arg == "--dynamic-grammar-cmd")
+        {
+            if (++i >= argc)
+            {
+                invalid_param = true;
+                break;
+            }
+            params.sparams.dynamic_grammar_cmd = argv[i];
+        }
+        else if (arg == "--dynamic-grammar-allow")
+        {
+            if (++i >= argc)
+            {
+                invalid_param = true;
+                break;
+            }
+            llama.dynamic_grammars.push_back(argv[i]);
+        }
+        else if (arg == "--dynamic-grammar-prelude")
+        {
+            if (++i >= argc)
+            {
+                invalid_param = true;
+                break;
+            }
+            params.sparams.dynamic_grammar_prelude = argv[i];
+        }
+        else if (arg == "--grammar-prefetch")
+        {
+            if (++i >= argc)
+            {
+                invalid_param = true;
+                break;
+            }
+            params.sparams.grammar_prefetch = std::stoi(argv[i]);
+        }
+        else if (arg == "--trace")
         {
-            params.numa = true;
+            if (++i >= argc)
+            {
+                invalid_param = true;
+                break;
+            }
+            params.trace.path = argv[i];
         }
-        else if (arg == "--embedding")
+        else if (arg == "--trace-format")
         {
-            params.embedding = true;
+            if (++i >= argc)
+            {
+                invalid_param = true;
+                break;
+            }
+            std::string value(argv[i]);
+            /**/ if (value == "jsonl")  { params.trace.format = LLAMA_TRACE_FORMAT_JSONL; }
+            else if (value == "chrome") { params.trace.format = LLAMA_TRACE_FORMAT_CHROME; }
+            else { invalid_param = true; break; }
         }
-        else if (arg == "-cb" || arg == "--cont-batching")
+        else if (arg == "--trace-rate")
         {
-            params.cont_batching = true;
+            if (++i >= argc)
+            {
+                invalid_param = true;
+                break;
+            }
+            params.trace.rate = std::stof(argv[i]);
         }
-        else if (arg == "-np" || arg == "--parallel")
+        else if(arg == "--mmproj")
         {
             if (++i >= argc)
             {
                 invalid_param = true;
                 break;
             }
-            params.n_parallel = std::stoi(argv[i]);
-        } else if (arg == "-n" || arg == "--n-predict")
+            params.mmproj = argv[i];
+        }
+        else if (arg == "--extra-model")
         {
             if (++i >= argc)
             {
                 invalid_param = true;
                 break;
             }
-            params.n_predict = std::stoi(argv[i]);
-        } else if (arg == "-spf" || arg == "--system-prompt-file")
+            std::string value(argv[i]);
+            const size_t pos = value.find('=');
+            if (pos == std::string::npos || pos == 0)
+            {
+                invalid_param = true;
+                break;
+            }
+            sparams.extra_models.emplace_back(value.substr(0, pos), value.substr(pos + 1));
+        }
+        else if (arg == "--models-budget")
         {
             if (++i >= argc)
             {
                 invalid_param = true;
                 break;
             }
-            std::ifstream file(argv[i]);
-            if (!file) {
-                fprintf(stderr, "error: failed to open file '%s'\n", argv[i]);
+            sparams.models_budget = (size_t) std::stoll(argv[i]) * 1024 * 1024;
+        }
+        else if (arg == "--models-dir")
+        {
+            if (++i >= argc)
+            {
                 invalid_param = true;
                 break;
             }
-            std::string systm_content;
-            std::copy(
-                std::istreambuf_iterator<char>(file),
-                std::istreambuf_iterator<char>(),
-                std::back_inserter(systm_content)
-            );
-            llama.process_system_prompt_data(json::parse(systm_content));
+            sparams.models_dir = argv[i];
         }
-        else if(arg == "--mmproj")
+        else if (arg == "--bench-trace")
         {
             if (++i >= argc)
             {
                 invalid_param = true;
                 break;
             }
-            params.mmproj = argv[i];
+            sparams.bench_trace = argv[i];
         }
         else if (arg == "--log-disable")
         {
             log_set_target(stdout);
             LOG_INFO("logging to file is disabled.", {});
         }
+        else if (arg == "--log-async")
+        {
+            log_async(true);
+        }
         else
         {
             fprintf(stderr, "error: unknown argument: %s\n", arg.c_str());
@@ -2626,6 +5481,241 @@ struct token_translator
     std::string operator()(const completion_token_output &cto) const { return (*this)(cto.tok); }
 };
 
+//
+// offline replay of a trace of requests, with --bench-trace
+//
+
+// a request of the trace: the body of a /completion request, with the time it arrives at and the number of streamed
+// results after which its client cancels it. The times are in microseconds from the start of the replay
+struct bench_request
+{
+    json    data;
+    int64_t t_arrival    = 0;
+    int     cancel_after = -1; // -1: never
+
+    // as seen by the client of the request
+    int64_t t_first = -1; // first token
+    int64_t t_end   = -1; // last result
+    std::vector<int64_t> itl;
+    int  n_prompt    = 0; // tokens of the prompt evaluated, without the cached ones
+    int  n_cached    = 0;
+    int  n_predicted = 0;
+    bool cancelled   = false;
+    bool error       = false;
+};
+
+// mean, maximum and nearest-rank percentiles
+static json bench_distribution(std::vector<double> values)
+{
+    if (values.empty())
+    {
+        return json::object();
+    }
+    std::sort(values.begin(), values.end());
+    const auto percentile = [&values](double p) {
+        const size_t rank = (size_t) std::ceil(p * values.size());
+        return values[std::max<size_t>(rank, 1) - 1];
+    };
+    double sum = 0.0;
+    for (const double value : values)
+    {
+        sum += value;
+    }
+    return json{
+        {"mean", sum / values.size()},
+        {"p50",  percentile(0.50)},
+        {"p90",  percentile(0.90)},
+        {"p99",  percentile(0.99)},
+        {"max",  values.back()},
+    };
+}
+
+// the client of a request: streams its results, and cancels it like a client that goes away
+static void bench_client(llama_server_context &llama, bench_request &req, int64_t t_start)
+{
+    req.data["stream"] = true;
+
+    const int task_id = llama.request_completion(req.data, false, false, -1);
+
+    int n_results = 0;
+    int64_t t_last = -1;
+    while (true)
+    {
+        task_result res = llama.next_result(task_id);
+        const int64_t t_now = ggml_time_us() - t_start;
+
+        if (res.error)
+        {
+            req.error = true;
+            req.t_end = t_now;
+            break;
+        }
+
+        if (!res.stop)
+        {
+            if (req.t_first < 0)
+            {
+                req.t_first = t_now;
+            }
+            else
+            {
+                req.itl.push_back(t_now - t_last);
+            }
+            t_last = t_now;
+
+            if (++n_results == req.cancel_after)
+            {
+                llama.request_cancel(task_id);
+                req.cancelled   = true;
+                req.n_predicted = n_results;
+                req.t_end       = t_now;
+                break;
+            }
+            continue;
+        }
+
+        req.n_prompt    = json_value(res.result_json["timings"], "prompt_n", 0);
+        req.n_cached    = json_value(res.result_json, "tokens_evaluated", 0) - req.n_prompt;
+        req.n_predicted = json_value(res.result_json, "tokens_predicted", 0);
+        req.t_end       = t_now;
+        break;
+    }
+}
+
+// replays the requests of the trace at their arrival times through the task loop, which the caller runs meanwhile,
+// and returns the report, or an object with an error
+static json bench_replay(llama_server_context &llama, const std::string &path)
+{
+    std::vector<bench_request> reqs;
+    {
+        std::ifstream file(path);
+        if (!file)
+        {
+            return json{{"error", "unable to open " + path}};
+        }
+        std::string line;
+        for (int i_line = 1; std::getline(file, line); ++i_line)
+        {
+            if (line.find_first_not_of(" \t\r") == std::string::npos)
+            {
+                continue;
+            }
+            bench_request req;
+            try
+            {
+                req.data = json::parse(line);
+                req.t_arrival    = (int64_t) (json_value(req.data, "t", 0.0) * 1e6);
+                req.cancel_after = json_value(req.data, "cancel_after", -1);
+                req.data.erase("t");
+                req.data.erase("cancel_after");
+                if (!req.data.contains("prompt"))
+                {
+                    throw std::runtime_error("no prompt");
+                }
+            }
+            catch (const std::exception &e)
+            {
+                return json{{"error", path + ":" + std::to_string(i_line) + ": " + e.what()}};
+            }
+            reqs.push_back(std::move(req));
+        }
+    }
+    std::stable_sort(reqs.begin(), reqs.end(), [](const bench_request &a, const bench_request &b) {
+        return a.t_arrival < b.t_arrival;
+    });
+
+    const int64_t t_start = ggml_time_us();
+
+    // the usage of the KV cache, sampled every 10 ms
+    std::atomic<bool> sampling{true};
+    double kv_sum = 0.0;
+    double kv_max = 0.0;
+    int    kv_n   = 0;
+    std::thread sampler([&]() {
+        while (sampling)
+        {
+            const int n_kv = llama.metrics.n_kv_size;
+            if (n_kv > 0)
+            {
+                const double usage = (double) llama.metrics.n_kv_used / n_kv;
+                kv_sum += usage;
+                kv_max  = std::max(kv_max, usage);
+                kv_n   += 1;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+    });
+
+    const uint64_t n_decode_start = llama.metrics.n_decode;
+
+    std::vector<std::thread> clients;
+    for (bench_request &req : reqs)
+    {
+        const int64_t t_wait = req.t_arrival - (ggml_time_us() - t_start);
+        if (t_wait > 0)
+        {
+            std::this_thread::sleep_for(std::chrono::microseconds(t_wait));
+        }
+        req.t_arrival = ggml_time_us() - t_start;
+        clients.emplace_back(bench_client, std::ref(llama), std::ref(req), t_start);
+    }
+    for (std::thread &client : clients)
+    {
+        client.join();
+    }
+
+    const double t_total = (ggml_time_us() - t_start) / 1e6;
+
+    sampling = false;
+    sampler.join();
+
+    int n_completed = 0, n_cancelled = 0, n_errors = 0;
+    int64_t n_prompt = 0, n_cached = 0, n_predicted = 0;
+    std::vector<double> ttft, itl, e2e;
+    for (const bench_request &req : reqs)
+    {
+        n_errors    += req.error;
+        n_cancelled += req.cancelled;
+        n_completed += !req.error && !req.cancelled;
+        n_prompt    += req.n_prompt;
+        n_cached    += req.n_cached;
+        n_predicted += req.n_predicted;
+        if (req.t_first >= 0)
+        {
+            ttft.push_back((req.t_first - req.t_arrival) / 1e3);
+        }
+        for (const int64_t t : req.itl)
+        {
+            itl.push_back(t / 1e3);
+        }
+        if (!req.error && !req.cancelled)
+        {
+            e2e.push_back((req.t_end - req.t_arrival) / 1e3);
+        }
+    }
+
+    const uint64_t n_decode = llama.metrics.n_decode - n_decode_start;
+
+    return json{
+        {"requests",         reqs.size()},
+        {"completed",        n_completed},
+        {"cancelled",        n_cancelled},
+        {"errors",           n_errors},
+        {"duration_s",       t_total},
+        {"prompt_tokens",    n_prompt},
+        {"cached_tokens",    n_cached},
+        {"predicted_tokens", n_predicted},
+        {"requests_per_s",   n_completed / t_total},
+        {"prompt_tokens_per_s",    n_prompt / t_total},
+        {"predicted_tokens_per_s", n_predicted / t_total},
+        {"ttft_ms",          bench_distribution(ttft)},
+        {"itl_ms",           bench_distribution(itl)},
+        {"e2e_ms",           bench_distribution(e2e)},
+        {"decode_calls",     n_decode},
+        {"kv_usage",         json{{"mean", kv_n > 0 ? kv_sum / kv_n : 0.0}, {"max", kv_max}}},
+    };
+}
+
 static void append_to_generated_text_from_generated_token_probs(llama_server_context &llama, llama_client_slot *slot)
 {
     auto & gtps = slot->generated_token_probs;
@@ -2658,6 +5748,11 @@ int main(int argc, char **argv)
         params.model_alias = params.model;
     }
 
+    if (!llama_trace_start(params.trace))
+    {
+        return 1;
+    }
+
     llama_backend_init(params.numa);
 
     LOG_INFO("build info", {{"build", LLAMA_BUILD_NUMBER},
@@ -2678,6 +5773,50 @@ int main(int argc, char **argv)
 
     llama.initialize();
 
+    if (!sparams.bench_trace.empty())
+    {
+        std::atomic<bool> done{false};
+        json report;
+        std::thread replay([&]() {
+            report = bench_replay(llama, sparams.bench_trace);
+            done = true;
+            llama.wake();
+        });
+
+        while (!done)
+        {
+            llama.update_slots();
+        }
+        replay.join();
+
+        printf("%s\n", report.dump(4).c_str());
+
+        llama_backend_free();
+        llama_trace_stop();
+        return report.contains("error") ? 1 : 0;
+    }
+
+    server_model_registry models;
+    models.llama_default  = std::shared_ptr<llama_server_context>(&llama, [](llama_server_context *) {});
+    models.params_default = params;
+    models.budget         = sparams.models_budget;
+
+    if (!sparams.models_dir.empty() && !canonical_path(sparams.models_dir, models.dir))
+    {
+        LOG_ERROR("models directory not found", {{"path", sparams.models_dir}});
+        return 1;
+    }
+
+    for (const auto &extra : sparams.extra_models)
+    {
+        std::string error;
+        if (!models.load(extra.first, extra.second, "", error))
+        {
+            LOG_ERROR("unable to load model", {{"model", extra.first}, {"error", error}});
+            return 1;
+        }
+    }
+
     httplib::Server svr;
 
     // Middleware for API key validation
@@ -2741,23 +5880,47 @@ int main(int argc, char **argv)
     svr.Get("/props", [&llama](const httplib::Request & /*req*/, httplib::Response &res)
             {
                 res.set_header("Access-Control-Allow-Origin", "*");
+                const json sys = llama.system_prompt_data();
                 json data = {
-                    { "user_name",      llama.name_user.c_str() },
-                    { "assistant_name", llama.name_assistant.c_str() }
+                    { "user_name",        sys["anti_prompt"] },
+                    { "assistant_name",   sys["assistant_name"] },
+                    { "system_prompt_id", sys["id"] },
                 };
                 res.set_content(data.dump(), "application/json");
             });
 
-    svr.Post("/completion", [&llama, &validate_api_key](const httplib::Request &req, httplib::Response &res)
+    // metrics of the default model, or of the one of ?model=NAME, in the Prometheus text format
+    svr.Get("/metrics", [&models](const httplib::Request &req, httplib::Response &res)
+            {
+                std::string error;
+                auto llama = models.acquire(req.get_param_value("model"), error);
+                if (!llama)
+                {
+                    res.status = 503;
+                    res.set_content(error, "text/plain");
+                    return;
+                }
+                res.set_content(llama->metrics.format(), "text/plain; version=0.0.4");
+            });
+
+    svr.Post("/completion", [&models, &validate_api_key](const httplib::Request &req, httplib::Response &res)
             {
                 if (!validate_api_key(req, res)) {
                     return;
                 }
                 json data = json::parse(req.body);
-                const int task_id = llama.request_completion(data, false, false, -1);
+                std::string error;
+                auto llama = models.acquire(json_value(data, "model", std::string()), error);
+                if (!llama)
+                {
+                    res.status = 503;
+                    res.set_content(error, "text/plain");
+                    return;
+                }
+                const int task_id = llama->request_completion(data, false, false, -1);
                 if (!json_value(data, "stream", false)) {
                     std::string completion_text;
-                    task_result result = llama.next_result(task_id);
+                    task_result result = llama->next_result(task_id);
                     if (!result.error && result.stop) {
                         res.set_content(result.result_json.dump(-1, ' ', false, json::error_handler_t::replace), "application/json");
                     }
@@ -2768,16 +5931,28 @@ int main(int argc, char **argv)
                         return;
                     }
                 } else {
-                    const auto chunked_content_provider = [task_id, &llama](size_t, httplib::DataSink & sink)
+                    const auto chunked_content_provider = [task_id, llama](size_t, httplib::DataSink & sink)
                     {
+                        std::string str; // the buffer of the events, reused
+                        task_result result;
                         while (true)
                         {
-                            task_result result = llama.next_result(task_id);
+                            // a closed connection cancels the request at once, without waiting for a write to fail
+                            if (!llama->next_result(task_id, sink.is_writable, result))
+                            {
+                                return false;
+                            }
                             if (!result.error) {
-                                const std::string str =
-                                    "data: " +
-                                    result.result_json.dump(-1, ' ', false, json::error_handler_t::replace) +
-                                    "\n\n";
+                                if (result.partial)
+                                {
+                                    write_partial_event(str, llama->ctx, result);
+                                }
+                                else
+                                {
+                                    str = "data: " +
+                                          result.result_json.dump(-1, ' ', false, json::error_handler_t::replace) +
+                                          "\n\n";
+                                }
                                 LOG_VERBOSE("data stream", {
                                     { "to_send", str }
                                 });
@@ -2789,7 +5964,7 @@ int main(int argc, char **argv)
                                     break;
                                 }
                             } else {
-                                const std::string str =
+                                str =
                                     "error: " +
                                     result.result_json.dump(-1, ' ', false, json::error_handler_t::replace) +
                                     "\n\n";
@@ -2807,10 +5982,10 @@ int main(int argc, char **argv)
                         return true;
                     };
 
-                    auto on_complete = [task_id, &llama] (bool)
+                    auto on_complete = [task_id, llama] (bool)
                     {
                         // cancel
-                        llama.request_cancel(task_id);
+                        llama->request_cancel(task_id);
                     };
 
                     res.set_chunked_content_provider("text/event-stream", chunked_content_provider, on_complete);
@@ -2819,38 +5994,99 @@ int main(int argc, char **argv)
 
 
 
-    svr.Get("/v1/models", [&params](const httplib::Request&, httplib::Response& res)
+    svr.Get("/v1/models", [&params, &models](const httplib::Request&, httplib::Response& res)
             {
                 std::time_t t = std::time(0);
 
-                json models = {
+                json data = {
+                    {
+                        {"id", params.model_alias},
+                        {"object", "model"},
+                        {"created", t},
+                        {"owned_by", "llamacpp"},
+                        {"status", "loaded"}
+                    },
+                };
+                for (json &model : models.to_json())
+                {
+                    model["created"] = t;
+                    data.push_back(model);
+                }
+
+                const json result = {
                     {"object", "list"},
-                    {"data", {
-                        {
-                            {"id", params.model_alias},
-                            {"object", "model"},
-                            {"created", t},
-                            {"owned_by", "llamacpp"}
-                        },
-                    }}
+                    {"data", data}
                 };
 
-                res.set_content(models.dump(), "application/json");
+                res.set_content(result.dump(), "application/json");
+            });
+
+    // loads a model (optionally with a LoRA adapter) in the background, see /v1/models for its status
+    svr.Post("/models/load", [&models, &validate_api_key](const httplib::Request &req, httplib::Response &res)
+            {
+                if (!validate_api_key(req, res)) {
+                    return;
+                }
+                const json body = json::parse(req.body);
+                const std::string lora = json_value(body, "lora", std::string());
+                std::string error;
+                std::string path_model;
+                std::string path_lora;
+                if (!models.resolve(json_value(body, "path", std::string()), path_model, error) ||
+                    (!lora.empty() && !models.resolve(lora, path_lora, error)))
+                {
+                    res.status = 403;
+                    res.set_content(error, "text/plain");
+                    return;
+                }
+                if (!models.load(json_value(body, "model", std::string()), path_model, path_lora, error))
+                {
+                    res.status = 409;
+                    res.set_content(error, "text/plain");
+                    return;
+                }
+                res.status = 202;
+                res.set_content(json{{"model", body["model"]}, {"status", "loading"}}.dump(), "application/json");
+            });
+
+    // the model is freed once the requests that use it are done
+    svr.Post("/models/unload", [&models, &validate_api_key](const httplib::Request &req, httplib::Response &res)
+            {
+                if (!validate_api_key(req, res)) {
+                    return;
+                }
+                const json body = json::parse(req.body);
+                std::string error;
+                if (!models.unload(json_value(body, "model", std::string()), error))
+                {
+                    res.status = 409;
+                    res.set_content(error, "text/plain");
+                    return;
+                }
+                res.set_content(json{{"model", body["model"]}, {"status", "unloading"}}.dump(), "application/json");
             });
 
     // TODO: add mount point without "/v1" prefix -- how?
-    svr.Post("/v1/chat/completions", [&llama, &validate_api_key](const httplib::Request &req, httplib::Response &res)
+    svr.Post("/v1/chat/completions", [&models, &validate_api_key](const httplib::Request &req, httplib::Response &res)
             {
                 if (!validate_api_key(req, res)) {
                     return;
                 }
                 json data = oaicompat_completion_params_parse(json::parse(req.body));
+                std::string error;
+                auto llama = models.acquire(json_value(data, "model", std::string()), error);
+                if (!llama)
+                {
+                    res.status = 503;
+                    res.set_content(error, "text/plain");
+                    return;
+                }
 
-                const int task_id = llama.request_completion(data, false, false, -1);
+                const int task_id = llama->request_completion(data, false, false, -1);
 
                 if (!json_value(data, "stream", false)) {
                     std::string completion_text;
-                    task_result result = llama.next_result(task_id);
+                    task_result result = llama->next_result(task_id);
 
                     if (!result.error && result.stop) {
                         json oaicompat_result = format_final_response_oaicompat(data, result);
@@ -2864,10 +6100,19 @@ int main(int argc, char **argv)
                         return;
                     }
                 } else {
-                    const auto chunked_content_provider = [task_id, &llama](size_t, httplib::DataSink &sink) {
+                    const auto chunked_content_provider = [task_id, llama](size_t, httplib::DataSink &sink) {
+                        task_result llama_result;
                         while (true) {
-                            task_result llama_result = llama.next_result(task_id);
+                            // a closed connection cancels the request at once, without waiting for a write to fail
+                            if (!llama->next_result(task_id, sink.is_writable, llama_result))
+                            {
+                                return false;
+                            }
                             if (!llama_result.error) {
+                                if (llama_result.partial)
+                                {
+                                    llama_result.result_json = partial_result_to_json(llama->ctx, llama_result);
+                                }
                                 std::vector<json> result_array = format_partial_response_oaicompat( llama_result);
 
                                 for (auto it = result_array.begin(); it != result_array.end(); ++it)
@@ -2903,25 +6148,33 @@ int main(int argc, char **argv)
                         return true;
                     };
 
-                    auto on_complete = [task_id, &llama](bool) {
+                    auto on_complete = [task_id, llama](bool) {
                         // cancel request
-                        llama.request_cancel(task_id);
+                        llama->request_cancel(task_id);
                     };
 
                     res.set_chunked_content_provider("text/event-stream", chunked_content_provider, on_complete);
                 }
             });
 
-    svr.Post("/infill", [&llama, &validate_api_key](const httplib::Request &req, httplib::Response &res)
+    svr.Post("/infill", [&models, &validate_api_key](const httplib::Request &req, httplib::Response &res)
             {
                 if (!validate_api_key(req, res)) {
                     return;
                 }
                 json data = json::parse(req.body);
-                const int task_id = llama.request_completion(data, true, false, -1);
+                std::string error;
+                auto llama = models.acquire(json_value(data, "model", std::string()), error);
+                if (!llama)
+                {
+                    res.status = 503;
+                    res.set_content(error, "text/plain");
+                    return;
+                }
+                const int task_id = llama->request_completion(data, true, false, -1);
                 if (!json_value(data, "stream", false)) {
                     std::string completion_text;
-                    task_result result = llama.next_result(task_id);
+                    task_result result = llama->next_result(task_id);
                     if (!result.error && result.stop)
                     {
                         res.set_content(result.result_json.dump(-1, ' ', false, json::error_handler_t::replace), "application/json");
@@ -2933,15 +6186,27 @@ int main(int argc, char **argv)
                         return;
                     }
                 } else {
-                    const auto chunked_content_provider = [task_id, &llama](size_t, httplib::DataSink & sink) {
+                    const auto chunked_content_provider = [task_id, llama](size_t, httplib::DataSink & sink) {
+                        std::string str; // the buffer of the events, reused
+                        task_result result;
                         while (true)
                         {
-                            task_result result = llama.next_result(task_id);
+                            // a closed connection cancels the request at once, without waiting for a write to fail
+                            if (!llama->next_result(task_id, sink.is_writable, result))
+                            {
+                                return false;
+                            }
                             if (!result.error) {
-                                const std::string str =
-                                "data: " +
-                                result.result_json.dump(-1, ' ', false, json::error_handler_t::replace) +
-                                "\n\n";
+                                if (result.partial)
+                                {
+                                    write_partial_event(str, llama->ctx, result);
+                                }
+                                else
+                                {
+                                    str = "data: " +
+                                          result.result_json.dump(-1, ' ', false, json::error_handler_t::replace) +
+                                          "\n\n";
+                                }
                                 LOG_VERBOSE("data stream", {
                                     { "to_send", str }
                                 });
@@ -2965,10 +6230,10 @@ int main(int argc, char **argv)
                         return true;
                     };
 
-                    auto on_complete = [task_id, &llama] (bool)
+                    auto on_complete = [task_id, llama] (bool)
                     {
                         // cancel
-                        llama.request_cancel(task_id);
+                        llama->request_cancel(task_id);
                     };
 
                     res.set_chunked_content_provider("text/event-stream", chunked_content_provider, on_complete);
@@ -2984,35 +6249,59 @@ int main(int argc, char **argv)
     svr.Options(R"(/.*)", [](const httplib::Request &, httplib::Response &res)
                 { return res.set_content("", "application/json"); });
 
-    svr.Post("/tokenize", [&llama](const httplib::Request &req, httplib::Response &res)
+    svr.Post("/tokenize", [&models](const httplib::Request &req, httplib::Response &res)
             {
                 const json body = json::parse(req.body);
+                std::string error;
+                auto llama = models.acquire(json_value(body, "model", std::string()), error);
+                if (!llama)
+                {
+                    res.status = 503;
+                    res.set_content(error, "text/plain");
+                    return;
+                }
                 std::vector<llama_token> tokens;
                 if (body.count("content") != 0)
                 {
-                    tokens = llama.tokenize(body["content"], false);
+                    tokens = llama->tokenize(body["content"], false);
                 }
                 const json data = format_tokenizer_response(tokens);
                 return res.set_content(data.dump(), "application/json");
             });
 
-    svr.Post("/detokenize", [&llama](const httplib::Request &req, httplib::Response &res)
+    svr.Post("/detokenize", [&models](const httplib::Request &req, httplib::Response &res)
             {
                 const json body = json::parse(req.body);
+                std::string error;
+                auto llama = models.acquire(json_value(body, "model", std::string()), error);
+                if (!llama)
+                {
+                    res.status = 503;
+                    res.set_content(error, "text/plain");
+                    return;
+                }
                 std::string content;
                 if (body.count("tokens") != 0)
                 {
                     const std::vector<llama_token> tokens = body["tokens"];
-                    content = tokens_to_str(llama.ctx, tokens.cbegin(), tokens.cend());
+                    content = tokens_to_str(llama->ctx, tokens.cbegin(), tokens.cend());
                 }
 
                 const json data = format_detokenized_response(content);
                 return res.set_content(data.dump(), "application/json");
             });
 
-    svr.Post("/embedding", [&llama](const httplib::Request &req, httplib::Response &res)
+    svr.Post("/embedding", [&models](const httplib::Request &req, httplib::Response &res)
             {
                 const json body = json::parse(req.body);
+                std::string error;
+                auto llama = models.acquire(json_value(body, "model", std::string()), error);
+                if (!llama)
+                {
+                    res.status = 503;
+                    res.set_content(error, "text/plain");
+                    return;
+                }
                 json prompt;
                 if (body.count("content") != 0)
                 {
@@ -3022,8 +6311,25 @@ int main(int argc, char **argv)
                 {
                     prompt = "";
                 }
-                const int task_id = llama.request_completion({ {"prompt", prompt}, { "n_predict", 0} }, false, true, -1);
-                task_result result = llama.next_result(task_id);
+
+                // an array of prompts is evaluated as a batch, unless it is the token ids of a single prompt
+                const bool batched = prompt.is_array() && !prompt.empty() && !prompt[0].is_number_integer();
+                std::vector<std::vector<llama_token>> inputs;
+                if (batched)
+                {
+                    for (const json &p : prompt)
+                    {
+                        inputs.push_back(llama->tokenize(p, llama->add_bos_token));
+                    }
+                }
+                else
+                {
+                    inputs.push_back(llama->tokenize(prompt, llama->add_bos_token));
+                }
+                const bool pooling_mean = json_value(body, "pooling", std::string("last")) == "mean";
+
+                const int task_id = llama->request_embedding(std::move(inputs), batched, pooling_mean);
+                task_result result = llama->next_result(task_id);
                 return res.set_content(result.result_json.dump(), "application/json");
             });
 
@@ -3114,8 +6420,13 @@ int main(int argc, char **argv)
     }
     //);
 
+    svr.stop();
     t.join();
 
+    // the models of the registry use the backend too
+    models.shutdown();
+
     llama_backend_free();
+    llama_trace_stop();
     return 0;
 }
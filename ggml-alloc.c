@@ -426,6 +426,7 @@ static bool ggml_op_can_inplace(enum ggml_op op) {
         case GGML_OP_UNARY:
         case GGML_OP_ROPE:
         case GGML_OP_RMS_NORM:
+        case GGML_OP_SWIGLU:
         case GGML_OP_SOFT_MAX:
             return true;
 
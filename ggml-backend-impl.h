@@ -74,9 +74,9 @@ extern "C" {
         void (*set_tensor_async)(ggml_backend_t backend,       struct ggml_tensor * tensor, const void * data, size_t offset, size_t size);
         void (*get_tensor_async)(ggml_backend_t backend, const struct ggml_tensor * tensor,       void * data, size_t offset, size_t size);
 
-        // (optional) asynchroneous tensor copy
-        void (*cpy_tensor_from_async)(ggml_backend_t backend, struct ggml_tensor * src, struct ggml_tensor * dst);
-        void (*cpy_tensor_to_async)  (ggml_backend_t backend, struct ggml_tensor * src, struct ggml_tensor * dst);
+        // (optional) asynchroneous tensor copy, returns false if the copy between the buffers of src and dst is not supported
+        bool (*cpy_tensor_from_async)(ggml_backend_t backend, struct ggml_tensor * src, struct ggml_tensor * dst);
+        bool (*cpy_tensor_to_async)  (ggml_backend_t backend, struct ggml_tensor * src, struct ggml_tensor * dst);
 
         void (*synchronize)     (ggml_backend_t backend);
 
@@ -90,6 +90,13 @@ extern "C" {
 
         // check if the backend supports an operation
         bool (*supports_op)(ggml_backend_t backend, const struct ggml_tensor * op);
+
+        // (optional) events, for the backends that queue their work
+        ggml_backend_event_t (*event_new)        (ggml_backend_t backend);
+        void                 (*event_free)       (ggml_backend_event_t event);
+        void                 (*event_record)     (ggml_backend_event_t event);
+        void                 (*event_wait)       (ggml_backend_t backend, ggml_backend_event_t event);
+        void                 (*event_synchronize)(ggml_backend_event_t event);
     };
 
     struct ggml_backend {
@@ -98,6 +105,11 @@ extern "C" {
         ggml_backend_context_t context;
     };
 
+    struct ggml_backend_event {
+        ggml_backend_t backend;
+        void * context;
+    };
+
 
     //
     // Backend registry
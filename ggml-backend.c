@@ -187,10 +187,56 @@ void ggml_backend_graph_compute(ggml_backend_t backend, struct ggml_cgraph * cgr
     ggml_backend_synchronize(backend);
 }
 
+void ggml_backend_graph_compute_async(ggml_backend_t backend, struct ggml_cgraph * cgraph) {
+    backend->iface.graph_compute(backend, cgraph);
+}
+
 bool ggml_backend_supports_op(ggml_backend_t backend, const struct ggml_tensor * op) {
     return backend->iface.supports_op(backend, op);
 }
 
+// events
+
+ggml_backend_event_t ggml_backend_event_new(ggml_backend_t backend) {
+    if (backend->iface.event_new == NULL) {
+        return NULL;
+    }
+    return backend->iface.event_new(backend);
+}
+
+void ggml_backend_event_free(ggml_backend_event_t event) {
+    if (event == NULL) {
+        return;
+    }
+    event->backend->iface.event_free(event);
+}
+
+void ggml_backend_event_record(ggml_backend_event_t event) {
+    if (event == NULL) {
+        return;
+    }
+    event->backend->iface.event_record(event);
+}
+
+void ggml_backend_event_synchronize(ggml_backend_event_t event) {
+    if (event == NULL) {
+        return;
+    }
+    event->backend->iface.event_synchronize(event);
+}
+
+void ggml_backend_event_wait(ggml_backend_t backend, ggml_backend_event_t event) {
+    if (event == NULL) {
+        return;
+    }
+    if (backend->iface.event_wait == NULL) {
+        // the backend computes synchronously, the host has to wait
+        ggml_backend_event_synchronize(event);
+        return;
+    }
+    backend->iface.event_wait(backend, event);
+}
+
 // backend copy
 
 static bool ggml_are_same_layout(const struct ggml_tensor * a, const struct ggml_tensor * b) {
@@ -239,6 +285,25 @@ void ggml_backend_tensor_copy(struct ggml_tensor * src, struct ggml_tensor * dst
     }
 }
 
+void ggml_backend_tensor_copy_async(ggml_backend_t backend, struct ggml_tensor * src, struct ggml_tensor * dst) {
+    GGML_ASSERT(ggml_are_same_layout(src, dst) && "cannot copy tensors with different layouts");
+
+    if (src == dst) {
+        return;
+    }
+
+    if (backend->iface.cpy_tensor_from_async != NULL && backend->iface.cpy_tensor_from_async(backend, src, dst)) {
+        return;
+    }
+    if (backend->iface.cpy_tensor_to_async != NULL && backend->iface.cpy_tensor_to_async(backend, src, dst)) {
+        return;
+    }
+
+    // the copy must not overtake the work already queued on the backend
+    ggml_backend_synchronize(backend);
+    ggml_backend_tensor_copy(src, dst);
+}
+
 // backend registry
 
 #define GGML_MAX_BACKENDS_REG 16
@@ -277,6 +342,12 @@ static void ggml_backend_registry_init(void) {
     extern ggml_backend_buffer_type_t ggml_backend_metal_buffer_type(void);
     ggml_backend_register("Metal", ggml_backend_reg_metal_init, ggml_backend_metal_buffer_type(), NULL);
 #endif
+
+#ifdef GGML_USE_CLBLAST
+    extern ggml_backend_t ggml_backend_reg_opencl_init(const char * params, void * user_data);
+    extern ggml_backend_buffer_type_t ggml_backend_opencl_buffer_type(void);
+    ggml_backend_register("OpenCL", ggml_backend_reg_opencl_init, ggml_backend_opencl_buffer_type(), NULL);
+#endif
 }
 
 void ggml_backend_register(const char * name, ggml_backend_init_fn init_fn, ggml_backend_buffer_type_t default_buffer_type, void * user_data) {
@@ -471,6 +542,7 @@ ggml_backend_buffer_type_t ggml_backend_cpu_buffer_type(void) {
 
 struct ggml_backend_cpu_context {
     int n_threads;
+    struct ggml_threadpool * threadpool;
     void * work_data;
     size_t work_size;
 };
@@ -505,6 +577,7 @@ static ggml_backend_graph_plan_t ggml_backend_cpu_graph_plan_create(ggml_backend
     struct ggml_backend_plan_cpu * cpu_plan = malloc(sizeof(struct ggml_backend_plan_cpu));
 
     cpu_plan->cplan = ggml_graph_plan(cgraph, cpu_ctx->n_threads);
+    cpu_plan->cplan.threadpool = cpu_ctx->threadpool;
     cpu_plan->cgraph = *cgraph;
 
     if (cpu_plan->cplan.work_size > 0) {
@@ -542,7 +615,8 @@ static void ggml_backend_cpu_graph_compute(ggml_backend_t backend, struct ggml_c
         cpu_ctx->work_size = cplan.work_size;
     }
 
-    cplan.work_data = cpu_ctx->work_data;
+    cplan.work_data  = cpu_ctx->work_data;
+    cplan.threadpool = cpu_ctx->threadpool;
 
     ggml_graph_compute(cgraph, &cplan);
 }
@@ -568,12 +642,18 @@ static struct ggml_backend_i cpu_backend_i = {
     /* .graph_plan_compute      = */ ggml_backend_cpu_graph_plan_compute,
     /* .graph_compute           = */ ggml_backend_cpu_graph_compute,
     /* .supports_op             = */ ggml_backend_cpu_supports_op,
+    /* .event_new               = */ NULL,
+    /* .event_free              = */ NULL,
+    /* .event_record            = */ NULL,
+    /* .event_wait              = */ NULL,
+    /* .event_synchronize       = */ NULL,
 };
 
 ggml_backend_t ggml_backend_cpu_init(void) {
     struct ggml_backend_cpu_context * ctx = malloc(sizeof(struct ggml_backend_cpu_context));
 
     ctx->n_threads = GGML_DEFAULT_N_THREADS;
+    ctx->threadpool = NULL;
     ctx->work_data = NULL;
     ctx->work_size = 0;
 
@@ -597,6 +677,13 @@ void ggml_backend_cpu_set_n_threads(ggml_backend_t backend_cpu, int n_threads) {
     ctx->n_threads = n_threads;
 }
 
+void ggml_backend_cpu_set_threadpool(ggml_backend_t backend_cpu, struct ggml_threadpool * threadpool) {
+    GGML_ASSERT(ggml_backend_is_cpu(backend_cpu));
+
+    struct ggml_backend_cpu_context * ctx = (struct ggml_backend_cpu_context *)backend_cpu->context;
+    ctx->threadpool = threadpool;
+}
+
 ggml_backend_buffer_t ggml_backend_cpu_buffer_from_ptr(void * ptr, size_t size) {
     return ggml_backend_buffer_init(ggml_backend_cpu_buffer_type(), cpu_backend_buffer_i_from_ptr, ptr, size);
 }
@@ -614,12 +701,14 @@ static ggml_backend_t ggml_backend_reg_cpu_init(const char * params, void * user
 #define GGML_MAX_BACKENDS 4
 #define GGML_MAX_SPLITS 256
 #define GGML_MAX_SPLIT_INPUTS 16
+#define GGML_MAX_COPIES 4
 
 struct ggml_backend_sched_split {
     ggml_tallocr_t tallocr;
     int i_start;
     int i_end;
     struct ggml_tensor * inputs[GGML_MAX_SPLIT_INPUTS];
+    bool inputs_copied[GGML_MAX_SPLIT_INPUTS]; // the input was prefetched while the previous split was computed
     int n_inputs;
     struct ggml_cgraph graph;
 };
@@ -639,6 +728,20 @@ struct ggml_backend_sched {
     struct ggml_backend_sched_split splits[GGML_MAX_SPLITS];
     int n_splits;
 
+    // pipeline parallelism: with n_copies > 1, the inputs of the splits are copied to n_copies separate slots
+    // used by consecutive graphs in turn, so that a backend can start the next graph while the others finish the previous one
+    int n_copies;
+    int cur_copy;
+    ggml_backend_buffer_t input_buffers[GGML_MAX_BACKENDS]; // n_copies slots of input_sizes[i] bytes
+    size_t                input_sizes  [GGML_MAX_BACKENDS];
+
+    // recorded after each split computed by a backend with each copy of the inputs, and after the copies queued on a backend
+    // NULL for the backends that compute synchronously
+    ggml_backend_event_t events     [GGML_MAX_BACKENDS][GGML_MAX_COPIES];
+    ggml_backend_event_t last_event [GGML_MAX_BACKENDS]; // the last recorded of events[i]
+    ggml_backend_event_t copy_events[GGML_MAX_BACKENDS];
+    bool                 copy_pending[GGML_MAX_BACKENDS]; // the last input copies may still read the memory of other backends
+
     struct ggml_context * ctx;
 
     // align context_buffer to GGML_MEM_ALIGN
@@ -1022,6 +1125,59 @@ static void sched_split_graph(ggml_backend_sched_t sched, struct ggml_cgraph * g
     sched->graph = graph_copy;
 }
 
+// calls cb for each distinct copy of the split inputs, with the id of the backend of the copy
+static void sched_foreach_input_copy(ggml_backend_sched_t sched, void (*cb)(ggml_backend_sched_t, int, struct ggml_tensor *, void *), void * user_data) {
+    bool * visited = calloc(sched->hash_set.size, sizeof(bool));
+
+    for (int i = 0; i < sched->n_splits; i++) {
+        struct ggml_backend_sched_split * split = &sched->splits[i];
+        int backend_id = sched_allocr_prio(sched, split->tallocr);
+        for (int j = 0; j < split->n_inputs; j++) {
+            struct ggml_tensor * input_cpy = sched->node_copies[hash_id(split->inputs[j])][backend_id];
+            size_t id = hash_id(input_cpy);
+            if (!visited[id]) {
+                visited[id] = true;
+                cb(sched, backend_id, input_cpy, user_data);
+            }
+        }
+    }
+
+    free(visited);
+}
+
+static size_t sched_input_copy_size(ggml_backend_t backend, struct ggml_tensor * tensor) {
+    size_t align = ggml_backend_get_alignment(backend);
+    size_t size  = ggml_backend_buft_get_alloc_size(ggml_backend_get_default_buffer_type(backend), tensor);
+    return ((size + align - 1) / align) * align;
+}
+
+static void sched_measure_input_copy(ggml_backend_sched_t sched, int backend_id, struct ggml_tensor * input_cpy, void * user_data) {
+    sched->input_sizes[backend_id] += sched_input_copy_size(sched->backends[backend_id], input_cpy);
+    GGML_UNUSED(user_data);
+}
+
+static void sched_alloc_input_copy(ggml_backend_sched_t sched, int backend_id, struct ggml_tensor * input_cpy, void * user_data) {
+    size_t * offs = (size_t *) user_data;
+    ggml_backend_buffer_t buffer = sched->input_buffers[backend_id];
+
+    size_t size = sched_input_copy_size(sched->backends[backend_id], input_cpy);
+    GGML_ASSERT(offs[backend_id] + size <= sched->input_sizes[backend_id] && "the graph needs more input memory than the measure graph");
+
+    char * base = (char *) ggml_backend_buffer_get_base(buffer) + sched->cur_copy*sched->input_sizes[backend_id];
+    ggml_backend_tensor_alloc(buffer, input_cpy, base + offs[backend_id]);
+    offs[backend_id] += size;
+}
+
+// with multiple copies, the input copies are placed in the current slot of the input buffers
+// ggml-alloc skips the tensors that are already allocated and does not free the tensors of other buffers
+static void sched_alloc_inputs(ggml_backend_sched_t sched) {
+    if (sched->n_copies == 1) {
+        return;
+    }
+    size_t offs[GGML_MAX_BACKENDS] = {0};
+    sched_foreach_input_copy(sched, sched_alloc_input_copy, offs);
+}
+
 static void sched_alloc_splits(ggml_backend_sched_t sched) {
     ggml_gallocr_alloc_graph_n(
         sched->galloc,
@@ -1030,12 +1186,114 @@ static void sched_alloc_splits(ggml_backend_sched_t sched) {
         sched->node_talloc);
 }
 
+// returns true if a node of the split writes to the memory of tensor
+static bool sched_split_writes(const struct ggml_backend_sched_split * split, const struct ggml_tensor * tensor) {
+    const struct ggml_tensor * base = tensor->view_src != NULL ? tensor->view_src : tensor;
+
+    for (int i = 0; i < split->graph.n_nodes; i++) {
+        const struct ggml_tensor * node = split->graph.nodes[i];
+        if (ggml_is_view_op(node->op)) {
+            continue;
+        }
+        if (node == base || node->view_src == base) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// copies input j of the split to the backend of the split
+// the copy is queued after the work of the backend that computed the input, and may not be complete when this returns
+static void sched_copy_input(ggml_backend_sched_t sched, struct ggml_backend_sched_split * split, int j) {
+    ggml_backend_t split_backend = get_allocr_backend(sched, split->tallocr);
+    int split_backend_id = sched_backend_prio(sched, split_backend);
+
+    struct ggml_tensor * input = split->inputs[j];
+    struct ggml_tensor * input_cpy = sched->node_copies[hash_id(input)][split_backend_id];
+    if (input->buffer == NULL) {
+        if (input->view_src == NULL) {
+            fprintf(stderr, "input %s has no buffer and no view_src\n", input->name);
+            exit(1);
+        }
+        // FIXME: may need to use the sched buffer instead
+        ggml_backend_view_init(input->view_src->buffer, input);
+    }
+    if (input_cpy->buffer == NULL) {
+        fprintf(stderr, "input_cpy %s has no buffer\n", input_cpy->name);
+        exit(1);
+    }
+    //GGML_ASSERT(input->buffer->backend != input_cpy->buffer->backend);
+    //GGML_ASSERT(input_cpy->buffer->backend == split_backend);
+
+    int input_backend_id = sched_allocr_prio(sched, node_allocr(input));
+    ggml_backend_t input_backend = input_backend_id < sched->n_backends ? sched->backends[input_backend_id] : NULL;
+    ggml_backend_event_t input_event = input_backend != NULL ? sched->last_event[input_backend_id] : NULL;
+
+    // the slot of the copy may still be read by the split backend with the graph queued n_copies graphs before
+    ggml_backend_event_t slot_event = sched->events[split_backend_id][sched->cur_copy];
+
+    if (slot_event == NULL) {
+        // the split backend is synchronous, the input must be complete before it is read
+        ggml_backend_event_synchronize(input_event);
+        ggml_backend_tensor_copy(input, input_cpy);
+    } else if (input_event == NULL && sched->n_copies > 1) {
+        // the input is in host memory and may be overwritten by the user as soon as the graph is queued, copy it now
+        ggml_backend_event_synchronize(slot_event);
+        ggml_backend_tensor_copy(input, input_cpy);
+    } else {
+        bool queued = false;
+        if (input_event != NULL && input_backend->iface.cpy_tensor_to_async != NULL) {
+            // queue the copy on the input backend (e.g. peer to peer between GPUs), so that the split backend does not wait for all its work
+            ggml_backend_event_wait(input_backend, slot_event);
+            if (input_backend->iface.cpy_tensor_to_async(input_backend, input, input_cpy)) {
+                ggml_backend_event_record(sched->copy_events[input_backend_id]);
+                ggml_backend_event_wait(split_backend, sched->copy_events[input_backend_id]);
+                queued = true;
+            }
+        }
+        if (!queued && sched->n_copies > 1) {
+            // nothing orders a copy queued on the split backend with the next graphs queued on the input backend,
+            // which may overwrite the input before it is read: copy it now
+            ggml_backend_event_synchronize(input_event);
+            ggml_backend_event_synchronize(slot_event);
+            ggml_backend_tensor_copy(input, input_cpy);
+        } else if (!queued) {
+            ggml_backend_event_wait(split_backend, input_event);
+            ggml_backend_tensor_copy_async(split_backend, input, input_cpy);
+        }
+    }
+
+    split->inputs_copied[j] = true;
+}
+
+// makes the work queued next on backend wait for the input copies of the other backends
+// once a copy is complete, its source may be overwritten
+static void sched_wait_copies(ggml_backend_sched_t sched, ggml_backend_t backend) {
+    int backend_id = sched_backend_prio(sched, backend);
+
+    for (int i = 0; i < sched->n_backends; i++) {
+        if (i == backend_id || !sched->copy_pending[i]) {
+            continue;
+        }
+        if (sched->copy_events[backend_id] == NULL) {
+            ggml_backend_event_synchronize(sched->copy_events[i]);
+            sched->copy_pending[i] = false;
+        } else {
+            ggml_backend_event_wait(backend, sched->copy_events[i]);
+        }
+    }
+}
+
 static void sched_compute_splits(ggml_backend_sched_t sched) {
     uint64_t copy_us[GGML_MAX_BACKENDS] = {0};
     uint64_t compute_us[GGML_MAX_BACKENDS] = {0};
 
     struct ggml_backend_sched_split * splits = sched->splits;
 
+    for (int i = 0; i < sched->n_splits; i++) {
+        memset(splits[i].inputs_copied, 0, sizeof(splits[i].inputs_copied));
+    }
+
     for (int i = 0; i < sched->n_splits; i++) {
         struct ggml_backend_sched_split * split = &splits[i];
         ggml_backend_t split_backend = get_allocr_backend(sched, split->tallocr);
@@ -1044,37 +1302,43 @@ static void sched_compute_splits(ggml_backend_sched_t sched) {
         // copy the input tensors to the split backend
         uint64_t copy_start_us = ggml_time_us();
         for (int j = 0; j < split->n_inputs; j++) {
-            struct ggml_tensor * input = split->inputs[j];
-            struct ggml_tensor * input_cpy = sched->node_copies[hash_id(input)][sched_backend_prio(sched, split_backend)];
-            if (input->buffer == NULL) {
-                if (input->view_src == NULL) {
-                    fprintf(stderr, "input %s has no buffer and no view_src\n", input->name);
-                    exit(1);
-                }
-                // FIXME: may need to use the sched buffer instead
-                ggml_backend_view_init(input->view_src->buffer, input);
-            }
-            if (input_cpy->buffer == NULL) {
-                fprintf(stderr, "input_cpy %s has no buffer\n", input_cpy->name);
-                exit(1);
+            if (!split->inputs_copied[j]) {
+                sched_copy_input(sched, split, j);
             }
-            //GGML_ASSERT(input->buffer->backend != input_cpy->buffer->backend);
-            //GGML_ASSERT(input_cpy->buffer->backend == split_backend);
-            ggml_backend_tensor_copy(input, input_cpy);
         }
-        // ggml_backend_synchronize(split_backend);
+        if (split->n_inputs > 0 && sched->copy_events[split_backend_id] != NULL) {
+            ggml_backend_event_record(sched->copy_events[split_backend_id]);
+            sched->copy_pending[split_backend_id] = true;
+        }
         int64_t copy_end_us = ggml_time_us();
         copy_us[split_backend_id] += copy_end_us - copy_start_us;
 
+        // queue the copies of the inputs of the next split that do not depend on this split, so that they overlap with its compute
+        if (i + 1 < sched->n_splits) {
+            struct ggml_backend_sched_split * next = &splits[i + 1];
+            int next_backend_id = sched_allocr_prio(sched, next->tallocr);
+            if (sched->copy_events[next_backend_id] != NULL) {
+                for (int j = 0; j < next->n_inputs; j++) {
+                    if (!sched_split_writes(split, next->inputs[j])) {
+                        sched_copy_input(sched, next, j);
+                    }
+                }
+            }
+        }
+
 #if 0
         char split_filename[GGML_MAX_NAME];
         snprintf(split_filename, GGML_MAX_NAME, "split_%i_%s.dot", i, ggml_backend_name(split_backend));
         ggml_graph_dump_dot(split->graph, NULL, split_filename);
 #endif
 
+        // the split may overwrite the memory read by the copies to the other backends
+        sched_wait_copies(sched, split_backend);
+
         uint64_t compute_start_us = ggml_time_us();
-        ggml_backend_graph_compute(split_backend, &split->graph);
-        // ggml_backend_synchronize(split_backend);
+        ggml_backend_graph_compute_async(split_backend, &split->graph);
+        ggml_backend_event_record(sched->events[split_backend_id][sched->cur_copy]);
+        sched->last_event[split_backend_id] = sched->events[split_backend_id][sched->cur_copy];
         uint64_t compute_end_us = ggml_time_us();
         compute_us[split_backend_id] += compute_end_us - compute_start_us;
     }
@@ -1096,7 +1360,7 @@ static void sched_reset(ggml_backend_sched_t sched) {
     }
 }
 
-ggml_backend_sched_t ggml_backend_sched_new(ggml_backend_t * backends, int n_backends) {
+ggml_backend_sched_t ggml_backend_sched_new(ggml_backend_t * backends, int n_backends, bool parallel) {
     GGML_ASSERT(n_backends <= GGML_MAX_BACKENDS);
 
     struct ggml_backend_sched * sched = malloc(sizeof(struct ggml_backend_sched));
@@ -1106,6 +1370,7 @@ ggml_backend_sched_t ggml_backend_sched_new(ggml_backend_t * backends, int n_bac
     for (int i = 0; i < n_backends; i++) {
         sched->backends[i] = backends[i];
     }
+    sched->n_copies = parallel ? GGML_MAX_COPIES : 1;
 
     sched->galloc = ggml_gallocr_new();
 
@@ -1114,6 +1379,13 @@ ggml_backend_sched_t ggml_backend_sched_new(ggml_backend_t * backends, int n_bac
         sched->tallocs[i] = ggml_tallocr_new_measure_from_backend(backends[i]);
     }
 
+    for (int i = 0; i < n_backends; i++) {
+        for (int c = 0; c < sched->n_copies; c++) {
+            sched->events[i][c] = ggml_backend_event_new(backends[i]);
+        }
+        sched->copy_events[i] = ggml_backend_event_new(backends[i]);
+    }
+
     return sched;
 }
 
@@ -1123,6 +1395,11 @@ void ggml_backend_sched_free(ggml_backend_sched_t sched) {
     }
     for (int i = 0; i < sched->n_backends; i++) {
         ggml_tallocr_free(sched->tallocs[i]);
+        ggml_backend_buffer_free(sched->input_buffers[i]);
+        for (int c = 0; c < sched->n_copies; c++) {
+            ggml_backend_event_free(sched->events[i][c]);
+        }
+        ggml_backend_event_free(sched->copy_events[i]);
     }
     ggml_gallocr_free(sched->galloc);
     free(sched->hash_set.keys);
@@ -1142,23 +1419,46 @@ void ggml_backend_sched_init_measure(ggml_backend_sched_t sched, struct ggml_cgr
     sched_split_graph(sched, measure_graph);
     sched_alloc_splits(sched);
 
+    if (sched->n_copies > 1) {
+        sched_foreach_input_copy(sched, sched_measure_input_copy, NULL);
+    }
+
     // allocate buffers and reset allocators
     for (int i = 0; i < sched->n_backends; i++) {
         size_t size = ggml_tallocr_max_size(sched->tallocs[i]);
         ggml_tallocr_free(sched->tallocs[i]);
         sched->tallocs[i] = ggml_tallocr_new_from_backend(sched->backends[i], size);
+
+        if (sched->input_sizes[i] > 0) {
+            sched->input_buffers[i] = ggml_backend_alloc_buffer(sched->backends[i], sched->n_copies*sched->input_sizes[i]);
+        }
     }
 
     sched_reset(sched);
 }
 
 void ggml_backend_sched_graph_compute(ggml_backend_sched_t sched, struct ggml_cgraph * graph) {
+    ggml_backend_sched_graph_compute_async(sched, graph);
+    ggml_backend_sched_synchronize(sched);
+}
+
+void ggml_backend_sched_graph_compute_async(ggml_backend_sched_t sched, struct ggml_cgraph * graph) {
     GGML_ASSERT(sched->hash_set.size >= graph->visited_hash_table.size + GGML_MAX_SPLITS*GGML_MAX_SPLIT_INPUTS);
 
     sched_split_graph(sched, graph);
+    sched_alloc_inputs(sched);
     sched_alloc_splits(sched);
     sched_compute_splits(sched);
     sched_reset(sched);
+
+    sched->cur_copy = (sched->cur_copy + 1) % sched->n_copies;
+}
+
+void ggml_backend_sched_synchronize(ggml_backend_sched_t sched) {
+    for (int i = 0; i < sched->n_backends; i++) {
+        ggml_backend_synchronize(sched->backends[i]);
+        sched->copy_pending[i] = false;
+    }
 }
 
 ggml_tallocr_t ggml_backend_sched_get_tallocr(ggml_backend_sched_t sched, ggml_backend_t backend) {
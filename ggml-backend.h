@@ -10,6 +10,7 @@ extern "C" {
     typedef struct ggml_backend_buffer_type * ggml_backend_buffer_type_t;
     typedef struct ggml_backend_buffer * ggml_backend_buffer_t;
     typedef struct ggml_backend * ggml_backend_t;
+    typedef struct ggml_backend_event * ggml_backend_event_t;
     typedef void * ggml_backend_graph_plan_t;
 
     //
@@ -56,8 +57,17 @@ extern "C" {
     GGML_API void ggml_backend_graph_plan_free   (ggml_backend_t backend, ggml_backend_graph_plan_t plan);
     GGML_API void ggml_backend_graph_plan_compute(ggml_backend_t backend, ggml_backend_graph_plan_t plan);
     GGML_API void ggml_backend_graph_compute     (ggml_backend_t backend, struct ggml_cgraph * cgraph);
+    GGML_API void ggml_backend_graph_compute_async(ggml_backend_t backend, struct ggml_cgraph * cgraph); // may return before the graph is computed
     GGML_API bool ggml_backend_supports_op       (ggml_backend_t backend, const struct ggml_tensor * op);
 
+    // events mark a point in the work queued on a backend
+    // the backends that compute synchronously (CPU) have no events: ggml_backend_event_new returns NULL and the other functions do nothing with a NULL event
+    GGML_API ggml_backend_event_t ggml_backend_event_new        (ggml_backend_t backend);
+    GGML_API void                 ggml_backend_event_free       (ggml_backend_event_t event);
+    GGML_API void                 ggml_backend_event_record     (ggml_backend_event_t event); // marks the work queued so far on the backend of the event
+    GGML_API void                 ggml_backend_event_synchronize(ggml_backend_event_t event); // waits on the host until the marked work is done
+    GGML_API void                 ggml_backend_event_wait       (ggml_backend_t backend, ggml_backend_event_t event); // the work queued next on backend waits for the marked work
+
     // tensor copy between different backends
     GGML_API void ggml_backend_tensor_copy(struct ggml_tensor * src, struct ggml_tensor * dst);
     GGML_API void ggml_backend_tensor_copy_async(ggml_backend_t backend, struct ggml_tensor * src, struct ggml_tensor * dst); // automatic fallback to sync copy
@@ -70,6 +80,7 @@ extern "C" {
 
     GGML_API bool ggml_backend_is_cpu(ggml_backend_t backend);
     GGML_API void ggml_backend_cpu_set_n_threads(ggml_backend_t backend_cpu, int n_threads);
+    GGML_API void ggml_backend_cpu_set_threadpool(ggml_backend_t backend_cpu, struct ggml_threadpool * threadpool);
 
     // Create a backend buffer from an existing pointer
     GGML_API ggml_backend_buffer_t ggml_backend_cpu_buffer_from_ptr(void * ptr, size_t size);
@@ -102,7 +113,7 @@ extern "C" {
     /*
       Example usage:
 
-        sched = ggml_backend_sched_new({backend_gpu, backend_gpu2, backend_cpu}, num_backends);
+        sched = ggml_backend_sched_new({backend_gpu, backend_gpu2, backend_cpu}, num_backends, false);
         // sched is initialized with measure allocators and cannot be used until allocated with a measure graph
 
         // initialize buffers from a measure graph
@@ -127,13 +138,22 @@ extern "C" {
         // compute
         graph = build_graph(sched);
         ggml_backend_sched_graph_compute(sched, graph);
+
+        // pipeline parallelism (parallel = true): queue the graphs of several micro-batches, then wait for all of them
+        // each backend starts the next micro-batch as soon as it has finished its part of the previous one
+        for (int i = 0; i < n_ubatch; i++) {
+            graph = build_graph(sched, ubatch[i]);
+            ggml_backend_sched_graph_compute_async(sched, graph);
+        }
+        ggml_backend_sched_synchronize(sched);
     */
 
     struct ggml_backend_sched;
     typedef struct ggml_backend_sched * ggml_backend_sched_t;
 
     // Initialize a backend scheduler
-    GGML_API ggml_backend_sched_t ggml_backend_sched_new(ggml_backend_t * backends, int n_backends);
+    // with parallel, the inputs of the splits are kept in several copies so that consecutive graphs can be computed concurrently
+    GGML_API ggml_backend_sched_t ggml_backend_sched_new(ggml_backend_t * backends, int n_backends, bool parallel);
 
     GGML_API void ggml_backend_sched_free(ggml_backend_sched_t sched);
 
@@ -150,6 +170,15 @@ extern "C" {
             ggml_backend_sched_t sched,
             struct ggml_cgraph * graph);
 
+    // Queue a graph without waiting for it to complete
+    // with a single copy of the inputs, call ggml_backend_sched_synchronize before changing the inputs of the graph
+    GGML_API void ggml_backend_sched_graph_compute_async(
+            ggml_backend_sched_t sched,
+            struct ggml_cgraph * graph);
+
+    // Wait for the queued graphs to complete
+    GGML_API void ggml_backend_sched_synchronize(ggml_backend_sched_t sched);
+
 
     //
     // Utils
@@ -6,8 +6,10 @@
 #include <cstdint>
 #include <float.h>
 #include <limits>
+#include <memory>
 #include <stdint.h>
 #include <stdio.h>
+#include <unordered_map>
 #include <vector>
 
 
@@ -447,6 +449,8 @@ static_assert(sizeof(block_q6_K) == sizeof(ggml_fp16_t) + 13*QK_K/16, "wrong q6_
 #define CUDA_CLAMP_BLOCK_SIZE 256
 #define CUDA_ROPE_BLOCK_SIZE 256
 #define CUDA_SOFT_MAX_BLOCK_SIZE 1024
+#define CUDA_FLASH_ATTN_EXT_NWARPS 4
+#define CUDA_FLASH_ATTN_EXT_MAX_D 256
 #define CUDA_ALIBI_BLOCK_SIZE 32
 #define CUDA_DIAG_MASK_INF_BLOCK_SIZE 32
 #define CUDA_QUANTIZE_BLOCK_SIZE 256
@@ -658,6 +662,15 @@ static __global__ void silu_f32(const float * x, float * dst, const int k) {
     dst[i] = x[i] / (1.0f + expf(-x[i]));
 }
 
+static __global__ void swiglu_f32(const float * x, const float * g, float * dst, const int k) {
+    const int i = blockDim.x*blockIdx.x + threadIdx.x;
+
+    if (i >= k) {
+        return;
+    }
+    dst[i] = x[i] / (1.0f + expf(-x[i])) * g[i];
+}
+
 static __global__ void gelu_quick_f32(const float *x, float *dst, int k) {
     const float GELU_QUICK_COEF = -1.702f;
     const int i  = blockDim.x*blockIdx.x + threadIdx.x;
@@ -863,8 +876,9 @@ static __global__ void group_norm_f32(const float * x, float * dst, const int gr
     }
 }
 
+// w: weight of the columns multiplied with the result, or nullptr
 template <int block_size>
-static __global__ void rms_norm_f32(const float * x, float * dst, const int ncols, const float eps) {
+static __global__ void rms_norm_f32(const float * x, const float * w, float * dst, const int ncols, const float eps) {
     const int row = blockIdx.x*blockDim.y + threadIdx.y;
     const int tid = threadIdx.x;
 
@@ -893,7 +907,8 @@ static __global__ void rms_norm_f32(const float * x, float * dst, const int ncol
     const float scale = rsqrtf(mean + eps);
 
     for (int col = tid; col < ncols; col += block_size) {
-        dst[row*ncols + col] = scale * x[row*ncols + col];
+        const float y = scale * x[row*ncols + col];
+        dst[row*ncols + col] = w ? y * w[col] : y;
     }
 }
 
@@ -4958,7 +4973,7 @@ static __device__ void rope_yarn(
 template<typename T, bool has_pos>
 static __global__ void rope(
     const T * x, T * dst, int ncols, const int32_t * pos, float freq_scale, int p_delta_rows, float freq_base,
-    float ext_factor, float attn_factor, rope_corr_dims corr_dims
+    float ext_factor, float attn_factor, rope_corr_dims corr_dims, const float * cache
 ) {
     const int col = 2*(blockDim.y*blockIdx.y + threadIdx.y);
 
@@ -4970,11 +4985,16 @@ static __global__ void rope(
     const int i = row*ncols + col;
     const int i2 = row/p_delta_rows;
 
-    const int p = has_pos ? pos[i2] : 0;
-    const float theta_base = p*powf(freq_base, -float(col)/ncols);
-
     float cos_theta, sin_theta;
-    rope_yarn(theta_base, freq_scale, corr_dims, col, ext_factor, attn_factor, &cos_theta, &sin_theta);
+    if (cache) {
+        cos_theta = cache[i2*ncols + col + 0];
+        sin_theta = cache[i2*ncols + col + 1];
+    } else {
+        const int p = has_pos ? pos[i2] : 0;
+        const float theta_base = p*powf(freq_base, -float(col)/ncols);
+
+        rope_yarn(theta_base, freq_scale, corr_dims, col, ext_factor, attn_factor, &cos_theta, &sin_theta);
+    }
 
     const float x0 = x[i + 0];
     const float x1 = x[i + 1];
@@ -4986,7 +5006,7 @@ static __global__ void rope(
 template<typename T, bool has_pos>
 static __global__ void rope_neox(
     const T * x, T * dst, int ncols, int n_dims, const int32_t * pos, float freq_scale, int p_delta_rows,
-    float ext_factor, float attn_factor, rope_corr_dims corr_dims, float theta_scale, float inv_ndims
+    float ext_factor, float attn_factor, rope_corr_dims corr_dims, float theta_scale, float inv_ndims, const float * cache
 ) {
     const int col = 2*(blockDim.y*blockIdx.y + threadIdx.y);
 
@@ -5001,13 +5021,19 @@ static __global__ void rope_neox(
     const int i = row*ncols + ib*n_dims + ic/2;
     const int i2 = row/p_delta_rows;
 
-    float cur_rot = inv_ndims * ic - ib;
+    float cos_theta, sin_theta;
+    if (cache) {
+        // only set when ncols == n_dims, so ib == 0
+        cos_theta = cache[i2*n_dims + ic + 0];
+        sin_theta = cache[i2*n_dims + ic + 1];
+    } else {
+        float cur_rot = inv_ndims * ic - ib;
 
-    const int p = has_pos ? pos[i2] : 0;
-    const float theta_base = p*freq_scale*powf(theta_scale, col/2.0f);
+        const int p = has_pos ? pos[i2] : 0;
+        const float theta_base = p*freq_scale*powf(theta_scale, col/2.0f);
 
-    float cos_theta, sin_theta;
-    rope_yarn(theta_base, freq_scale, corr_dims, cur_rot, ext_factor, attn_factor, &cos_theta, &sin_theta);
+        rope_yarn(theta_base, freq_scale, corr_dims, cur_rot, ext_factor, attn_factor, &cos_theta, &sin_theta);
+    }
 
     const float x0 = x[i + 0];
     const float x1 = x[i + n_dims/2];
@@ -5016,6 +5042,35 @@ static __global__ void rope_neox(
     dst[i + n_dims/2] = x0*sin_theta + x1*cos_theta;
 }
 
+// sin and cos of the rope angles of the positions, with the formulas of rope and rope_neox
+static __global__ void rope_cache_f32(
+    const int32_t * pos, float * dst, int n_dims, bool is_neox, float freq_scale, float freq_base,
+    float ext_factor, float attn_factor, rope_corr_dims corr_dims, float theta_scale, float inv_ndims
+) {
+    const int col = 2*(blockDim.y*blockIdx.y + threadIdx.y);
+
+    if (col >= n_dims) {
+        return;
+    }
+
+    const int row = blockIdx.x;
+    const int p   = pos[row];
+
+    float * cs = dst + row*n_dims + col;
+
+    if (is_neox) {
+        float cur_rot = inv_ndims * col;
+
+        const float theta_base = p*freq_scale*powf(theta_scale, col/2.0f);
+
+        rope_yarn(theta_base, freq_scale, corr_dims, cur_rot, ext_factor, attn_factor, cs + 0, cs + 1);
+    } else {
+        const float theta_base = p*powf(freq_base, -float(col)/n_dims);
+
+        rope_yarn(theta_base, freq_scale, corr_dims, col, ext_factor, attn_factor, cs + 0, cs + 1);
+    }
+}
+
 static __global__ void rope_glm_f32(
     const float * x, float * dst, int ncols, const int32_t * pos, float freq_scale, int p_delta_rows, float freq_base,
     int n_ctx
@@ -5224,6 +5279,102 @@ static __global__ void soft_max_f32(const float * x, const float * y, float * ds
     }
 }
 
+static __device__ __forceinline__ float flash_attn_ext_load(const float * x) {
+    return *x;
+}
+
+static __device__ __forceinline__ float flash_attn_ext_load(const half * x) {
+    return __half2float(*x);
+}
+
+// one warp per row of the result, the softmax over the KV cells is computed online so kq is never stored
+template<typename k_t, typename v_t>
+static __global__ void flash_attn_ext_f32(
+        const char * q, const char * k, const char * v, const float * mask, float * dst,
+        const int D, const int n_kv, const int ne1, const int ne2, const int nrows, const int n_gqa, const float scale,
+        const int nbq1, const int nbq2, const int nbq3,
+        const int nbk1, const int nbk2, const int nbk3,
+        const int nbv0, const int nbv1, const int nbv2, const int nbv3,
+        const int ne_mask) {
+    const int row  = blockIdx.x*blockDim.y + threadIdx.y;
+    const int lane = threadIdx.x;
+
+    if (row >= nrows) {
+        return;
+    }
+
+    const int iq3 = row/(ne2*ne1);
+    const int iq2 = (row - iq3*ne2*ne1)/ne1;
+    const int iq1 =  row - iq3*ne2*ne1 - iq2*ne1;
+
+    const int ik2 = iq2/n_gqa;
+
+    const float * qp = (const float *) (q + (int64_t) iq1*nbq1 + (int64_t) iq2*nbq2 + (int64_t) iq3*nbq3);
+    const float * mp = mask ? mask + (int64_t) iq1*ne_mask : nullptr;
+
+    // each lane holds the dims lane, lane + WARP_SIZE, ... of q and of the accumulator
+    float qv[CUDA_FLASH_ATTN_EXT_MAX_D/WARP_SIZE];
+    float acc[CUDA_FLASH_ATTN_EXT_MAX_D/WARP_SIZE];
+
+#pragma unroll
+    for (int i = 0; i < CUDA_FLASH_ATTN_EXT_MAX_D/WARP_SIZE; ++i) {
+        const int d = lane + i*WARP_SIZE;
+        qv[i]  = d < D ? qp[d] : 0.0f;
+        acc[i] = 0.0f;
+    }
+
+    float M = -INFINITY;
+    float S = 0.0f;
+
+    for (int ic = 0; ic < n_kv; ++ic) {
+        const float mv = mp ? mp[ic] : 0.0f;
+        if (mv == -INFINITY) {
+            continue;
+        }
+
+        const k_t  * kp = (const k_t *) (k + (int64_t) ic*nbk1 + (int64_t) ik2*nbk2 + (int64_t) iq3*nbk3);
+        const char * vp =                 v + (int64_t) ic*nbv1 + (int64_t) ik2*nbv2 + (int64_t) iq3*nbv3;
+
+        float s = 0.0f;
+#pragma unroll
+        for (int i = 0; i < CUDA_FLASH_ATTN_EXT_MAX_D/WARP_SIZE; ++i) {
+            const int d = lane + i*WARP_SIZE;
+            if (d < D) {
+                s += qv[i]*flash_attn_ext_load(kp + d);
+            }
+        }
+        s = warp_reduce_sum(s)*scale + mv;
+
+        const float M_new = max(M, s);
+        const float ms    = expf(M - M_new);
+        const float vs    = expf(s - M_new);
+
+        S = S*ms + vs;
+        M = M_new;
+
+#pragma unroll
+        for (int i = 0; i < CUDA_FLASH_ATTN_EXT_MAX_D/WARP_SIZE; ++i) {
+            const int d = lane + i*WARP_SIZE;
+            if (d < D) {
+                acc[i] = acc[i]*ms + vs*flash_attn_ext_load((const v_t *) (vp + (int64_t) d*nbv0));
+            }
+        }
+    }
+
+    const float inv_S = S == 0.0f ? 0.0f : 1.0f/S;
+
+    // the result is permuted: [D, n_head, n_tokens]
+    float * dp = dst + ((int64_t) iq3*ne1*ne2 + (int64_t) iq1*ne2 + iq2)*D;
+
+#pragma unroll
+    for (int i = 0; i < CUDA_FLASH_ATTN_EXT_MAX_D/WARP_SIZE; ++i) {
+        const int d = lane + i*WARP_SIZE;
+        if (d < D) {
+            dp[d] = acc[i]*inv_S;
+        }
+    }
+}
+
 static __global__ void scale_f32(const float * x, float * dst, const float scale, const int k) {
     const int i = blockDim.x*blockIdx.x + threadIdx.x;
 
@@ -5472,6 +5623,11 @@ static void silu_f32_cuda(const float * x, float * dst, const int k, cudaStream_
     silu_f32<<<num_blocks, CUDA_SILU_BLOCK_SIZE, 0, stream>>>(x, dst, k);
 }
 
+static void swiglu_f32_cuda(const float * x, const float * g, float * dst, const int k, cudaStream_t stream) {
+    const int num_blocks = (k + CUDA_SILU_BLOCK_SIZE - 1) / CUDA_SILU_BLOCK_SIZE;
+    swiglu_f32<<<num_blocks, CUDA_SILU_BLOCK_SIZE, 0, stream>>>(x, g, dst, k);
+}
+
 static void gelu_quick_f32_cuda(const float * x, float * dst, const int k, cudaStream_t stream) {
     const int num_blocks = (k + CUDA_GELU_BLOCK_SIZE - 1) / CUDA_GELU_BLOCK_SIZE;
     gelu_quick_f32<<<num_blocks, CUDA_GELU_BLOCK_SIZE, 0, stream>>>(x, dst, k);
@@ -5540,14 +5696,14 @@ static void pad_f32_cuda(const float * x, float * dst,
     pad_f32<<<gridDim, CUDA_PAD_BLOCK_SIZE, 0, stream>>>(x, dst, ne0, ne00, ne01, ne02);
 }
 
-static void rms_norm_f32_cuda(const float * x, float * dst, const int ncols, const int nrows, const float eps, cudaStream_t stream) {
+static void rms_norm_f32_cuda(const float * x, const float * w, float * dst, const int ncols, const int nrows, const float eps, cudaStream_t stream) {
     GGML_ASSERT(ncols % WARP_SIZE == 0);
     if (ncols < 1024) {
         const dim3 block_dims(WARP_SIZE, 1, 1);
-        rms_norm_f32<WARP_SIZE><<<nrows, block_dims, 0, stream>>>(x, dst, ncols, eps);
+        rms_norm_f32<WARP_SIZE><<<nrows, block_dims, 0, stream>>>(x, w, dst, ncols, eps);
     } else {
         const dim3 block_dims(1024, 1, 1);
-        rms_norm_f32<1024><<<nrows, block_dims, 0, stream>>>(x, dst, ncols, eps);
+        rms_norm_f32<1024><<<nrows, block_dims, 0, stream>>>(x, w, dst, ncols, eps);
     }
 }
 
@@ -6403,7 +6559,7 @@ static void clamp_f32_cuda(const float * x, float * dst, const float min, const
 template<typename T>
 static void rope_cuda(
     const T * x, T * dst, int ncols, int nrows, const int32_t * pos, float freq_scale, int p_delta_rows,
-    float freq_base, float ext_factor, float attn_factor, rope_corr_dims corr_dims, cudaStream_t stream
+    float freq_base, float ext_factor, float attn_factor, rope_corr_dims corr_dims, const float * cache, cudaStream_t stream
 ) {
     GGML_ASSERT(ncols % 2 == 0);
     const dim3 block_dims(1, CUDA_ROPE_BLOCK_SIZE, 1);
@@ -6411,11 +6567,11 @@ static void rope_cuda(
     const dim3 block_nums(nrows, num_blocks_x, 1);
     if (pos == nullptr) {
         rope<T, false><<<block_nums, block_dims, 0, stream>>>(
-            x, dst, ncols, pos, freq_scale, p_delta_rows, freq_base, ext_factor, attn_factor, corr_dims
+            x, dst, ncols, pos, freq_scale, p_delta_rows, freq_base, ext_factor, attn_factor, corr_dims, cache
         );
     } else {
         rope<T, true><<<block_nums, block_dims, 0, stream>>>(
-            x, dst, ncols, pos, freq_scale, p_delta_rows, freq_base, ext_factor, attn_factor, corr_dims
+            x, dst, ncols, pos, freq_scale, p_delta_rows, freq_base, ext_factor, attn_factor, corr_dims, cache
         );
     }
 }
@@ -6423,7 +6579,7 @@ static void rope_cuda(
 template<typename T>
 static void rope_neox_cuda(
     const T * x, T * dst, int ncols, int n_dims, int nrows, const int32_t * pos, float freq_scale, int p_delta_rows,
-    float freq_base, float ext_factor, float attn_factor, rope_corr_dims corr_dims, cudaStream_t stream
+    float freq_base, float ext_factor, float attn_factor, rope_corr_dims corr_dims, const float * cache, cudaStream_t stream
 ) {
     GGML_ASSERT(ncols % 2 == 0);
     const dim3 block_dims(1, CUDA_ROPE_BLOCK_SIZE, 1);
@@ -6436,16 +6592,33 @@ static void rope_neox_cuda(
     if (pos == nullptr) {
         rope_neox<T, false><<<block_nums, block_dims, 0, stream>>>(
             x, dst, ncols, n_dims, pos, freq_scale, p_delta_rows, ext_factor, attn_factor, corr_dims,
-            theta_scale, inv_ndims
+            theta_scale, inv_ndims, cache
         );
     } else {
         rope_neox<T, true><<<block_nums, block_dims, 0, stream>>>(
             x, dst, ncols, n_dims, pos, freq_scale, p_delta_rows, ext_factor, attn_factor, corr_dims,
-            theta_scale, inv_ndims
+            theta_scale, inv_ndims, cache
         );
     }
 }
 
+static void rope_cache_f32_cuda(
+    const int32_t * pos, float * dst, int n_dims, int n_pos, bool is_neox, float freq_scale, float freq_base,
+    float ext_factor, float attn_factor, rope_corr_dims corr_dims, cudaStream_t stream
+) {
+    GGML_ASSERT(n_dims % 2 == 0);
+    const dim3 block_dims(1, CUDA_ROPE_BLOCK_SIZE, 1);
+    const int num_blocks_x = (n_dims + 2*CUDA_ROPE_BLOCK_SIZE - 1) / (2*CUDA_ROPE_BLOCK_SIZE);
+    const dim3 block_nums(n_pos, num_blocks_x, 1);
+
+    const float theta_scale = powf(freq_base, -2.0f/n_dims);
+    const float inv_ndims = -1.0f / n_dims;
+
+    rope_cache_f32<<<block_nums, block_dims, 0, stream>>>(
+        pos, dst, n_dims, is_neox, freq_scale, freq_base, ext_factor, attn_factor, corr_dims, theta_scale, inv_ndims
+    );
+}
+
 static void rope_glm_f32_cuda(
     const float * x, float * dst, int ncols, int nrows, const int32_t * pos, float freq_scale, int p_delta_rows,
     float freq_base, int n_ctx, cudaStream_t stream
@@ -6502,6 +6675,21 @@ static void soft_max_f32_cuda(const float * x, const float * y, float * dst, con
     soft_max_f32<<<block_nums, block_dims, 0, stream>>>(x, y, dst, ncols_x, nrows_y, scale);
 }
 
+template<typename k_t, typename v_t>
+static void flash_attn_ext_f32_cuda(
+        const char * q, const char * k, const char * v, const float * mask, float * dst,
+        const int D, const int n_kv, const int ne1, const int ne2, const int nrows, const int n_gqa, const float scale,
+        const int nbq1, const int nbq2, const int nbq3,
+        const int nbk1, const int nbk2, const int nbk3,
+        const int nbv0, const int nbv1, const int nbv2, const int nbv3,
+        const int ne_mask, cudaStream_t stream) {
+    const dim3 block_dims(WARP_SIZE, CUDA_FLASH_ATTN_EXT_NWARPS, 1);
+    const dim3 block_nums((nrows + CUDA_FLASH_ATTN_EXT_NWARPS - 1) / CUDA_FLASH_ATTN_EXT_NWARPS, 1, 1);
+    flash_attn_ext_f32<k_t, v_t><<<block_nums, block_dims, 0, stream>>>(
+            q, k, v, mask, dst, D, n_kv, ne1, ne2, nrows, n_gqa, scale,
+            nbq1, nbq2, nbq3, nbk1, nbk2, nbk3, nbv0, nbv1, nbv2, nbv3, ne_mask);
+}
+
 static void im2col_f32_f16_cuda(const float* x, half* dst,
     int IW, int IH, int OW, int OH, int KW, int KH, int IC,
     int offset_delta,
@@ -6917,6 +7105,20 @@ inline void ggml_cuda_op_silu(
     (void) src1_dd;
 }
 
+inline void ggml_cuda_op_swiglu(
+    const ggml_tensor * src0, const ggml_tensor * src1, ggml_tensor * dst,
+    const float * src0_dd, const float * src1_dd, float * dst_dd, const cudaStream_t & main_stream) {
+
+    GGML_ASSERT(src0->type == GGML_TYPE_F32);
+    GGML_ASSERT(src1->type == GGML_TYPE_F32);
+    GGML_ASSERT( dst->type == GGML_TYPE_F32);
+    GGML_ASSERT(ggml_is_contiguous(src0) && ggml_is_contiguous(src1));
+
+    swiglu_f32_cuda(src0_dd, src1_dd, dst_dd, ggml_nelements(src0), main_stream);
+
+    (void) dst;
+}
+
 inline void ggml_cuda_op_gelu_quick(
     const ggml_tensor * src0, const ggml_tensor * src1, ggml_tensor * dst,
     const float * src0_dd, const float * src1_dd, float * dst_dd, const cudaStream_t & main_stream) {
@@ -7088,13 +7290,35 @@ inline void ggml_cuda_op_rms_norm(
     float eps;
     memcpy(&eps, dst->op_params, sizeof(float));
 
-    rms_norm_f32_cuda(src0_dd, dst_dd, ne00, nrows, eps, main_stream);
+    rms_norm_f32_cuda(src0_dd, nullptr, dst_dd, ne00, nrows, eps, main_stream);
 
     (void) src1;
     (void) dst;
     (void) src1_dd;
 }
 
+inline void ggml_cuda_op_rms_norm_mul(
+    const ggml_tensor * src0, const ggml_tensor * src1, ggml_tensor * dst,
+    const float * src0_dd, const float * src1_dd, float * dst_dd, const cudaStream_t & main_stream) {
+
+    GGML_ASSERT(src0->type == GGML_TYPE_F32);
+    GGML_ASSERT(src1->type == GGML_TYPE_F32);
+    GGML_ASSERT( dst->type == GGML_TYPE_F32);
+
+    // TODO: broadcast the weight along the rows
+    GGML_ASSERT(ggml_nelements(src1) == src0->ne[0]);
+
+    const int64_t ne00 = src0->ne[0];
+    const int64_t nrows = ggml_nrows(src0);
+
+    float eps;
+    memcpy(&eps, dst->op_params, sizeof(float));
+
+    rms_norm_f32_cuda(src0_dd, src1_dd, dst_dd, ne00, nrows, eps, main_stream);
+
+    (void) dst;
+}
+
 inline void ggml_cuda_op_mul_mat_q(
     const ggml_tensor * src0, const ggml_tensor * src1, ggml_tensor * dst, const char * src0_dd_i, const float * src1_ddf_i,
     const char * src1_ddq_i, float * dst_dd_i, const int64_t row_low, const int64_t row_high, const int64_t src1_ncols,
@@ -7502,6 +7726,13 @@ inline void ggml_cuda_op_rope(
     rope_corr_dims corr_dims;
     ggml_rope_yarn_corr_dims(n_dims, n_orig_ctx, freq_base, beta_fast, beta_slow, corr_dims.v);
 
+    // sin and cos precomputed by ggml_rope_cache, used when the rows are rotated entirely
+    const float * cache = nullptr;
+    const ggml_tensor * src2 = dst->src[2];
+    if (src2 && src2->backend == GGML_BACKEND_GPU && pos && !is_glm && ne00 == n_dims) {
+        cache = (const float *) ((ggml_tensor_extra_gpu *) src2->extra)->data_device[g_main_device];
+    }
+
     // compute
     if (is_glm) {
         GGML_ASSERT(false);
@@ -7510,12 +7741,12 @@ inline void ggml_cuda_op_rope(
         if (src0->type == GGML_TYPE_F32) {
             rope_neox_cuda(
                 (const float *)src0_dd, (float *)dst_dd, ne00, n_dims, nrows, pos, freq_scale, ne01, freq_base, ext_factor,
-                attn_factor, corr_dims, main_stream
+                attn_factor, corr_dims, cache, main_stream
             );
         } else if (src0->type == GGML_TYPE_F16) {
             rope_neox_cuda(
                 (const half *)src0_dd, (half *)dst_dd, ne00, n_dims, nrows, pos, freq_scale, ne01, freq_base, ext_factor,
-                attn_factor, corr_dims, main_stream
+                attn_factor, corr_dims, cache, main_stream
             );
         } else {
             GGML_ASSERT(false);
@@ -7524,12 +7755,12 @@ inline void ggml_cuda_op_rope(
         if (src0->type == GGML_TYPE_F32) {
             rope_cuda(
                 (const float *)src0_dd, (float *)dst_dd, ne00, nrows, pos, freq_scale, ne01, freq_base, ext_factor,
-                attn_factor, corr_dims, main_stream
+                attn_factor, corr_dims, cache, main_stream
             );
         } else if (src0->type == GGML_TYPE_F16) {
             rope_cuda(
                 (const half *)src0_dd, (half *)dst_dd, ne00, nrows, pos, freq_scale, ne01, freq_base, ext_factor,
-                attn_factor, corr_dims, main_stream
+                attn_factor, corr_dims, cache, main_stream
             );
         } else {
             GGML_ASSERT(false);
@@ -8176,6 +8407,10 @@ static void ggml_cuda_silu(const ggml_tensor * src0, const ggml_tensor * src1, g
     ggml_cuda_op_flatten(src0, src1, dst, ggml_cuda_op_silu);
 }
 
+static void ggml_cuda_swiglu(const ggml_tensor * src0, const ggml_tensor * src1, ggml_tensor * dst) {
+    ggml_cuda_op_flatten(src0, src1, dst, ggml_cuda_op_swiglu);
+}
+
 static void ggml_cuda_gelu_quick(const ggml_tensor * src0, const ggml_tensor * src1, ggml_tensor * dst) {
     ggml_cuda_op_flatten(src0, src1, dst, ggml_cuda_op_gelu_quick);
 }
@@ -8220,6 +8455,10 @@ static void ggml_cuda_rms_norm(const ggml_tensor * src0, const ggml_tensor * src
     ggml_cuda_op_flatten(src0, src1, dst, ggml_cuda_op_rms_norm);
 }
 
+static void ggml_cuda_rms_norm_mul(const ggml_tensor * src0, const ggml_tensor * src1, ggml_tensor * dst) {
+    ggml_cuda_op_flatten(src0, src1, dst, ggml_cuda_op_rms_norm_mul);
+}
+
 bool ggml_cuda_can_mul_mat(const struct ggml_tensor * src0, const struct ggml_tensor * src1, struct ggml_tensor * dst) {
     if (!g_cublas_loaded) return false;
 
@@ -8869,11 +9108,95 @@ static void ggml_cuda_soft_max(const ggml_tensor * src0, const ggml_tensor * src
     ggml_cuda_op_flatten(src0, src1, dst, ggml_cuda_op_soft_max);
 }
 
+static void ggml_cuda_flash_attn_ext(const ggml_tensor * src0, const ggml_tensor * src1, ggml_tensor * dst) {
+    const ggml_tensor * q    = src0;
+    const ggml_tensor * k    = src1;
+    const ggml_tensor * v    = dst->src[2];
+    const ggml_tensor * mask = dst->src[3];
+
+    GGML_ASSERT(q->backend == GGML_BACKEND_GPU);
+    GGML_ASSERT(k->backend == GGML_BACKEND_GPU);
+    GGML_ASSERT(v->backend == GGML_BACKEND_GPU);
+    GGML_ASSERT(mask == nullptr || mask->backend == GGML_BACKEND_GPU);
+    GGML_ASSERT(dst->backend == GGML_BACKEND_GPU);
+
+    GGML_ASSERT(q->type == GGML_TYPE_F32);
+    GGML_ASSERT(k->type == v->type);
+
+    float scale;
+    memcpy(&scale, dst->op_params, sizeof(float));
+
+    CUDA_CHECK(ggml_cuda_set_device(g_main_device));
+    cudaStream_t main_stream = g_cudaStreams[g_main_device][0];
+
+    const char  * q_dd    = (const char  *) ((ggml_tensor_extra_gpu *) q->extra)->data_device[g_main_device];
+    const char  * k_dd    = (const char  *) ((ggml_tensor_extra_gpu *) k->extra)->data_device[g_main_device];
+    const char  * v_dd    = (const char  *) ((ggml_tensor_extra_gpu *) v->extra)->data_device[g_main_device];
+    const float * mask_dd = mask ? (const float *) ((ggml_tensor_extra_gpu *) mask->extra)->data_device[g_main_device] : nullptr;
+    float       * dst_dd  = (float *) ((ggml_tensor_extra_gpu *) dst->extra)->data_device[g_main_device];
+
+    const int D     = q->ne[0];
+    const int n_kv  = k->ne[1];
+    const int nrows = q->ne[1]*q->ne[2]*q->ne[3];
+    const int n_gqa = q->ne[2]/k->ne[2];
+
+    const int ne_mask = mask ? mask->ne[0] : 0;
+
+    if (k->type == GGML_TYPE_F16) {
+        flash_attn_ext_f32_cuda<half, half>(q_dd, k_dd, v_dd, mask_dd, dst_dd,
+                D, n_kv, q->ne[1], q->ne[2], nrows, n_gqa, scale,
+                q->nb[1], q->nb[2], q->nb[3], k->nb[1], k->nb[2], k->nb[3], v->nb[0], v->nb[1], v->nb[2], v->nb[3],
+                ne_mask, main_stream);
+    } else if (k->type == GGML_TYPE_F32) {
+        flash_attn_ext_f32_cuda<float, float>(q_dd, k_dd, v_dd, mask_dd, dst_dd,
+                D, n_kv, q->ne[1], q->ne[2], nrows, n_gqa, scale,
+                q->nb[1], q->nb[2], q->nb[3], k->nb[1], k->nb[2], k->nb[3], v->nb[0], v->nb[1], v->nb[2], v->nb[3],
+                ne_mask, main_stream);
+    } else {
+        GGML_ASSERT(false);
+    }
+    CUDA_CHECK(cudaGetLastError());
+}
+
 static void ggml_cuda_rope(const ggml_tensor * src0, const ggml_tensor * src1, ggml_tensor * dst) {
     GGML_ASSERT(ggml_is_contiguous(src0)); // TODO: this restriction is temporary until non-cont support is implemented
     ggml_cuda_op_flatten(src0, src1, dst, ggml_cuda_op_rope);
 }
 
+static void ggml_cuda_rope_cache(const ggml_tensor * src0, const ggml_tensor * src1, ggml_tensor * dst) {
+    GGML_ASSERT(src0->backend == GGML_BACKEND_GPU);
+    GGML_ASSERT( dst->backend == GGML_BACKEND_GPU);
+    GGML_ASSERT(src0->type == GGML_TYPE_I32);
+    GGML_ASSERT( dst->type == GGML_TYPE_F32);
+
+    const int n_dims     = ((int32_t *) dst->op_params)[1];
+    const int mode       = ((int32_t *) dst->op_params)[2];
+    const int n_orig_ctx = ((int32_t *) dst->op_params)[4];
+
+    float freq_base, freq_scale, ext_factor, attn_factor, beta_fast, beta_slow;
+    memcpy(&freq_base,   (int32_t *) dst->op_params +  5, sizeof(float));
+    memcpy(&freq_scale,  (int32_t *) dst->op_params +  6, sizeof(float));
+    memcpy(&ext_factor,  (int32_t *) dst->op_params +  7, sizeof(float));
+    memcpy(&attn_factor, (int32_t *) dst->op_params +  8, sizeof(float));
+    memcpy(&beta_fast,   (int32_t *) dst->op_params +  9, sizeof(float));
+    memcpy(&beta_slow,   (int32_t *) dst->op_params + 10, sizeof(float));
+
+    rope_corr_dims corr_dims;
+    ggml_rope_yarn_corr_dims(n_dims, n_orig_ctx, freq_base, beta_fast, beta_slow, corr_dims.v);
+
+    CUDA_CHECK(ggml_cuda_set_device(g_main_device));
+    cudaStream_t main_stream = g_cudaStreams[g_main_device][0];
+
+    const int32_t * pos_dd = (const int32_t *) ((ggml_tensor_extra_gpu *) src0->extra)->data_device[g_main_device];
+    float         * dst_dd = (float *)         ((ggml_tensor_extra_gpu *)  dst->extra)->data_device[g_main_device];
+
+    rope_cache_f32_cuda(pos_dd, dst_dd, n_dims, src0->ne[0], mode & 2, freq_scale, freq_base,
+            ext_factor, attn_factor, corr_dims, main_stream);
+    CUDA_CHECK(cudaGetLastError());
+
+    (void) src1;
+}
+
 static void ggml_cuda_alibi(const ggml_tensor * src0, const ggml_tensor * src1, ggml_tensor * dst) {
     ggml_cuda_op_flatten(src0, src1, dst, ggml_cuda_op_alibi);
 }
@@ -9264,6 +9587,12 @@ bool ggml_cuda_compute_forward(struct ggml_compute_params * params, struct ggml_
         case GGML_OP_RMS_NORM:
             func = ggml_cuda_rms_norm;
             break;
+        case GGML_OP_RMS_NORM_MUL:
+            func = ggml_cuda_rms_norm_mul;
+            break;
+        case GGML_OP_SWIGLU:
+            func = ggml_cuda_swiglu;
+            break;
         case GGML_OP_MUL_MAT:
             if (!any_on_device && !ggml_cuda_can_mul_mat(tensor->src[0], tensor->src[1], tensor)) {
                 return false;
@@ -9304,9 +9633,15 @@ bool ggml_cuda_compute_forward(struct ggml_compute_params * params, struct ggml_
         case GGML_OP_SOFT_MAX:
             func = ggml_cuda_soft_max;
             break;
+        case GGML_OP_FLASH_ATTN_EXT:
+            func = ggml_cuda_flash_attn_ext;
+            break;
         case GGML_OP_ROPE:
             func = ggml_cuda_rope;
             break;
+        case GGML_OP_ROPE_CACHE:
+            func = ggml_cuda_rope_cache;
+            break;
         case GGML_OP_ALIBI:
             func = ggml_cuda_alibi;
             break;
@@ -9568,8 +9903,62 @@ ggml_backend_buffer_type_t ggml_backend_cuda_host_buffer_type() {
 
 // backend
 
+#if !defined(GGML_USE_HIPBLAS) && defined(GGML_CUDA_USE_GRAPHS) && CUDART_VERSION >= 12000
+#define USE_CUDA_GRAPH
+#endif
+
+#ifdef USE_CUDA_GRAPH
+#define GGML_CUDA_MAX_GRAPHS 8
+// a graph that must be captured again this many times in a row is no longer captured
+#define GGML_CUDA_MAX_GRAPH_UPDATES 4
+
+// the properties of a node that the captured kernels depend on
+struct ggml_cuda_graph_node_properties {
+    void *  data;
+    void *  src_data[GGML_MAX_SRC];
+    int32_t op_params[GGML_MAX_OP_PARAMS / sizeof(int32_t)];
+    bool    cpy_updated; // the destination of the copy is updated before each launch instead
+};
+
+// a copy kernel whose destination is updated before each launch, e.g. the store of the new tokens in the KV cache
+struct ggml_cuda_graph_cpy {
+    cudaGraphNode_t      node;
+    cudaKernelNodeParams params;
+    int                  i_node; // index of the DUP, CONT or CPY node in the ggml graph
+    char *               dst;
+};
+
+struct ggml_cuda_graph {
+    cudaGraph_t     graph    = nullptr;
+    cudaGraphExec_t instance = nullptr;
+
+    std::vector<ggml_cuda_graph_node_properties> props;
+    std::vector<ggml_cuda_graph_cpy>             cpys;
+
+    int64_t n_evals   = 0;
+    int64_t last_used = 0;
+    int     n_updates = 0; // captures in a row
+    bool    disabled  = false;
+
+    ~ggml_cuda_graph() {
+        if (instance != nullptr) {
+            CUDA_CHECK(cudaGraphExecDestroy(instance));
+        }
+        if (graph != nullptr) {
+            CUDA_CHECK(cudaGraphDestroy(graph));
+        }
+    }
+};
+#endif
+
 struct ggml_backend_context_cuda {
     int device;
+
+#ifdef USE_CUDA_GRAPH
+    // the graphs captured by the backend, keyed by the ops and shapes of their nodes
+    std::unordered_map<uint64_t, std::unique_ptr<ggml_cuda_graph>> graphs;
+    int64_t n_evals = 0;
+#endif
 };
 
 static const char * ggml_backend_cuda_name(ggml_backend_t backend) {
@@ -9613,6 +10002,56 @@ static void ggml_backend_cuda_get_tensor_async(ggml_backend_t backend, const ggm
     CUDA_CHECK(cudaMemcpyAsync(data, (const char *)tensor->data + offset, size, cudaMemcpyDeviceToHost, g_cudaStreams[cuda_ctx->device][0]));
 }
 
+static bool ggml_backend_buffer_is_cuda_host(ggml_backend_buffer_t buffer) {
+    return buffer->buft == ggml_backend_cpu_buffer_type() || buffer->buft == ggml_backend_cuda_host_buffer_type();
+}
+
+static bool ggml_backend_cuda_cpy_tensor_from_async(ggml_backend_t backend, ggml_tensor * src, ggml_tensor * dst) {
+    ggml_backend_context_cuda * cuda_ctx = (ggml_backend_context_cuda *)backend->context;
+
+    if (dst->buffer->buft != ggml_backend_cuda_buffer_type(cuda_ctx->device)) {
+        return false;
+    }
+
+    cudaMemcpyKind kind;
+    if (ggml_backend_buffer_is_cuda_host(src->buffer)) {
+        kind = cudaMemcpyHostToDevice;
+    } else if (src->buffer->buft == dst->buffer->buft) {
+        kind = cudaMemcpyDeviceToDevice;
+    } else {
+        return false;
+    }
+
+    CUDA_CHECK(ggml_cuda_set_device(cuda_ctx->device));
+    CUDA_CHECK(cudaMemcpyAsync(dst->data, src->data, ggml_nbytes(dst), kind, g_cudaStreams[cuda_ctx->device][0]));
+
+    return true;
+}
+
+static bool ggml_backend_cuda_cpy_tensor_to_async(ggml_backend_t backend, ggml_tensor * src, ggml_tensor * dst) {
+    ggml_backend_context_cuda * cuda_ctx = (ggml_backend_context_cuda *)backend->context;
+
+    if (src->buffer->buft != ggml_backend_cuda_buffer_type(cuda_ctx->device)) {
+        return false;
+    }
+
+    if (ggml_backend_buffer_is_cuda_host(dst->buffer)) {
+        CUDA_CHECK(ggml_cuda_set_device(cuda_ctx->device));
+        CUDA_CHECK(cudaMemcpyAsync(dst->data, src->data, ggml_nbytes(src), cudaMemcpyDeviceToHost, g_cudaStreams[cuda_ctx->device][0]));
+        return true;
+    }
+
+    if (dst->buffer->buft->iface.alloc_buffer == ggml_backend_cuda_buffer_type_alloc_buffer) {
+        // peer copy to another device, queued after the work of this device
+        ggml_backend_buffer_context_cuda * dst_ctx = (ggml_backend_buffer_context_cuda *)dst->buffer->context;
+        CUDA_CHECK(ggml_cuda_set_device(cuda_ctx->device));
+        CUDA_CHECK(cudaMemcpyPeerAsync(dst->data, dst_ctx->device, src->data, cuda_ctx->device, ggml_nbytes(src), g_cudaStreams[cuda_ctx->device][0]));
+        return true;
+    }
+
+    return false;
+}
+
 static void ggml_backend_cuda_synchronize(ggml_backend_t backend) {
     ggml_backend_context_cuda * cuda_ctx = (ggml_backend_context_cuda *)backend->context;
 
@@ -9644,11 +10083,7 @@ static void ggml_backend_cuda_graph_plan_compute(ggml_backend_t backend, ggml_ba
     UNUSED(plan);
 }
 
-static void ggml_backend_cuda_graph_compute(ggml_backend_t backend, ggml_cgraph * cgraph) {
-    ggml_backend_context_cuda * cuda_ctx = (ggml_backend_context_cuda *)backend->context;
-
-    ggml_cuda_set_main_device(cuda_ctx->device);
-
+static void ggml_backend_cuda_compute_nodes(ggml_backend_context_cuda * cuda_ctx, ggml_cgraph * cgraph) {
     ggml_compute_params params = {};
     params.type = GGML_TASK_COMPUTE;
     params.ith = 0;
@@ -9700,7 +10135,232 @@ static void ggml_backend_cuda_graph_compute(ggml_backend_t backend, ggml_cgraph
 #endif
     }
 
-    UNUSED(backend);
+    UNUSED(cuda_ctx);
+}
+
+
+#ifdef USE_CUDA_GRAPH
+static bool ggml_cuda_is_view_op(ggml_op op) {
+    return op == GGML_OP_RESHAPE || op == GGML_OP_TRANSPOSE || op == GGML_OP_VIEW || op == GGML_OP_PERMUTE;
+}
+
+// hash of the ops, types and shapes of the nodes, the graphs with the same key differ at most in the addresses of the tensors
+static uint64_t ggml_cuda_graph_key(const ggml_cgraph * cgraph) {
+    uint64_t h = 14695981039346656037ULL;
+    auto mix = [&h](const void * data, size_t size) {
+        for (size_t i = 0; i < size; ++i) {
+            h = (h ^ ((const uint8_t *) data)[i]) * 1099511628211ULL;
+        }
+    };
+
+    mix(&cgraph->n_nodes, sizeof(cgraph->n_nodes));
+    for (int i = 0; i < cgraph->n_nodes; i++) {
+        const ggml_tensor * node = cgraph->nodes[i];
+        mix(&node->op,   sizeof(node->op));
+        mix(&node->type, sizeof(node->type));
+        mix(node->ne,    sizeof(node->ne));
+        mix(node->nb,    sizeof(node->nb));
+    }
+    return h;
+}
+
+static bool ggml_cuda_graph_can_capture(const ggml_cgraph * cgraph) {
+    for (int i = 0; i < cgraph->n_nodes; i++) {
+        switch (cgraph->nodes[i]->op) {
+            case GGML_OP_MUL_MAT_ID: // reads the ids on the host
+            case GGML_OP_SCALE:      // reads the scale on the host
+                return false;
+            default:
+                break;
+        }
+    }
+    return true;
+}
+
+// the destination of the copy launched by ggml_cuda_cpy for the node
+static char * ggml_cuda_cpy_dst(const ggml_tensor * node) {
+    const ggml_tensor * dst = node->op == GGML_OP_CPY ? node->src[1] : node;
+    return (char *) ((const ggml_tensor_extra_gpu *) dst->extra)->data_device[g_main_device];
+}
+
+static bool ggml_cuda_is_cpy_kernel(const void * func) {
+    return func == (const void *) cpy_f32_f16<cpy_1_f32_f32> ||
+           func == (const void *) cpy_f32_f16<cpy_1_f32_f16> ||
+           func == (const void *) cpy_f32_f16<cpy_1_f16_f16> ||
+           func == (const void *) cpy_f32_q<cpy_blck_f32_q8_0, QK8_0> ||
+           func == (const void *) cpy_f32_q<cpy_blck_f32_q4_0, QK4_0> ||
+           func == (const void *) cpy_f32_q<cpy_blck_f32_q4_1, QK4_1>;
+}
+
+static void ggml_cuda_graph_set_props(ggml_cuda_graph_node_properties & props, const ggml_tensor * node) {
+    props.data = node->data;
+    for (int j = 0; j < GGML_MAX_SRC; j++) {
+        props.src_data[j] = node->src[j] != nullptr ? node->src[j]->data : nullptr;
+    }
+    memcpy(props.op_params, node->op_params, sizeof(props.op_params));
+}
+
+static bool ggml_cuda_graph_props_match(const ggml_cuda_graph * graph, const ggml_cgraph * cgraph) {
+    for (int i = 0; i < cgraph->n_nodes; i++) {
+        const ggml_tensor * node = cgraph->nodes[i];
+        if (ggml_cuda_is_view_op(node->op)) {
+            continue;
+        }
+
+        ggml_cuda_graph_node_properties props;
+        ggml_cuda_graph_set_props(props, node);
+
+        const ggml_cuda_graph_node_properties & cur = graph->props[i];
+        if (cur.cpy_updated) {
+            props.data = cur.data;
+            if (node->op == GGML_OP_CPY) {
+                props.src_data[1] = cur.src_data[1];
+            }
+        }
+        if (props.data != cur.data || memcmp(props.src_data, cur.src_data, sizeof(props.src_data)) != 0 ||
+            memcmp(props.op_params, cur.op_params, sizeof(props.op_params)) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// captures the kernels of the nodes into a new instance of the graph, without running them
+static bool ggml_backend_cuda_graph_capture(ggml_backend_context_cuda * cuda_ctx, ggml_cuda_graph * graph, ggml_cgraph * cgraph) {
+    cudaStream_t stream = g_cudaStreams[cuda_ctx->device][0];
+
+    CUDA_CHECK(cudaStreamBeginCapture(stream, cudaStreamCaptureModeRelaxed));
+    ggml_backend_cuda_compute_nodes(cuda_ctx, cgraph);
+
+    cudaGraph_t cuda_graph = nullptr;
+    cudaError_t err = cudaStreamEndCapture(stream, &cuda_graph);
+    if (err != cudaSuccess) {
+        (void) cudaGetLastError();
+        fprintf(stderr, "%s: failed to capture the graph, computing it without CUDA graphs: %s\n", __func__, cudaGetErrorString(err));
+        return false;
+    }
+
+    if (graph->instance != nullptr) {
+        CUDA_CHECK(cudaGraphExecDestroy(graph->instance));
+        CUDA_CHECK(cudaGraphDestroy(graph->graph));
+    }
+    graph->graph = cuda_graph;
+    CUDA_CHECK(cudaGraphInstantiate(&graph->instance, cuda_graph, 0));
+
+    graph->props.resize(cgraph->n_nodes);
+    for (int i = 0; i < cgraph->n_nodes; i++) {
+        ggml_cuda_graph_set_props(graph->props[i], cgraph->nodes[i]);
+        graph->props[i].cpy_updated = false;
+    }
+
+    // find the copy kernels of the nodes, their destination can be updated in the instance without a new capture
+    size_t n_graph_nodes = 0;
+    CUDA_CHECK(cudaGraphGetNodes(cuda_graph, nullptr, &n_graph_nodes));
+    std::vector<cudaGraphNode_t> graph_nodes(n_graph_nodes);
+    CUDA_CHECK(cudaGraphGetNodes(cuda_graph, graph_nodes.data(), &n_graph_nodes));
+
+    graph->cpys.clear();
+    for (cudaGraphNode_t graph_node : graph_nodes) {
+        cudaGraphNodeType type;
+        CUDA_CHECK(cudaGraphNodeGetType(graph_node, &type));
+        if (type != cudaGraphNodeTypeKernel) {
+            continue;
+        }
+
+        cudaKernelNodeParams params;
+        CUDA_CHECK(cudaGraphKernelNodeGetParams(graph_node, &params));
+        if (!ggml_cuda_is_cpy_kernel(params.func)) {
+            continue;
+        }
+
+        char * dst = *(char **) params.kernelParams[1];
+
+        int i_node = -1;
+        for (int i = 0; i < cgraph->n_nodes; i++) {
+            const ggml_tensor * node = cgraph->nodes[i];
+            if ((node->op == GGML_OP_DUP || node->op == GGML_OP_CONT || node->op == GGML_OP_CPY) && ggml_cuda_cpy_dst(node) == dst) {
+                // a destination shared by several copies is compared instead
+                i_node = i_node == -1 ? i : -2;
+            }
+        }
+        if (i_node >= 0 && !graph->props[i_node].cpy_updated) {
+            graph->props[i_node].cpy_updated = true;
+            graph->cpys.push_back({graph_node, params, i_node, dst});
+        }
+    }
+
+    return true;
+}
+
+// computes the graph with a CUDA graph, captured on the second computation of a graph of the same shape
+// returns false if the graph must be computed node by node instead
+static bool ggml_backend_cuda_graph_launch(ggml_backend_context_cuda * cuda_ctx, ggml_cgraph * cgraph) {
+    static const bool disable_graphs = getenv("GGML_CUDA_DISABLE_GRAPHS") != nullptr;
+    if (disable_graphs) {
+        return false;
+    }
+
+    const uint64_t key = ggml_cuda_graph_key(cgraph);
+
+    std::unique_ptr<ggml_cuda_graph> & entry = cuda_ctx->graphs[key];
+    if (entry == nullptr) {
+        if (cuda_ctx->graphs.size() > GGML_CUDA_MAX_GRAPHS) {
+            auto lru = cuda_ctx->graphs.end();
+            for (auto it = cuda_ctx->graphs.begin(); it != cuda_ctx->graphs.end(); ++it) {
+                if (it->first != key && (lru == cuda_ctx->graphs.end() || it->second->last_used < lru->second->last_used)) {
+                    lru = it;
+                }
+            }
+            cuda_ctx->graphs.erase(lru);
+        }
+        entry.reset(new ggml_cuda_graph);
+        entry->disabled = !ggml_cuda_graph_can_capture(cgraph);
+    }
+
+    ggml_cuda_graph * graph = cuda_ctx->graphs[key].get();
+    graph->last_used = cuda_ctx->n_evals++;
+
+    // the first computation is not captured, it initializes the cuBLAS handles and the memory pool
+    if (graph->disabled || graph->n_evals++ == 0) {
+        return false;
+    }
+
+    if (graph->instance == nullptr || !ggml_cuda_graph_props_match(graph, cgraph)) {
+        if (graph->n_updates++ == GGML_CUDA_MAX_GRAPH_UPDATES || !ggml_backend_cuda_graph_capture(cuda_ctx, graph, cgraph)) {
+            graph->disabled = true;
+            return false;
+        }
+    } else {
+        graph->n_updates = 0;
+    }
+
+    for (ggml_cuda_graph_cpy & cpy : graph->cpys) {
+        char * dst = ggml_cuda_cpy_dst(cgraph->nodes[cpy.i_node]);
+        if (dst != cpy.dst) {
+            cpy.dst = dst;
+            cpy.params.kernelParams[1] = &cpy.dst;
+            CUDA_CHECK(cudaGraphExecKernelNodeSetParams(graph->instance, cpy.node, &cpy.params));
+        }
+    }
+
+    CUDA_CHECK(cudaGraphLaunch(graph->instance, g_cudaStreams[cuda_ctx->device][0]));
+
+    return true;
+}
+#endif // USE_CUDA_GRAPH
+
+static void ggml_backend_cuda_graph_compute(ggml_backend_t backend, ggml_cgraph * cgraph) {
+    ggml_backend_context_cuda * cuda_ctx = (ggml_backend_context_cuda *)backend->context;
+
+    ggml_cuda_set_main_device(cuda_ctx->device);
+
+#ifdef USE_CUDA_GRAPH
+    if (ggml_backend_cuda_graph_launch(cuda_ctx, cgraph)) {
+        return;
+    }
+#endif
+
+    ggml_backend_cuda_compute_nodes(cuda_ctx, cgraph);
 }
 
 static bool ggml_backend_cuda_supports_op(ggml_backend_t backend, const ggml_tensor * op) {
@@ -9773,6 +10433,17 @@ static bool ggml_backend_cuda_supports_op(ggml_backend_t backend, const ggml_ten
                 }
                 return false;
             } break;
+        case GGML_OP_RMS_NORM_MUL:
+            {
+                return ggml_nelements(op->src[1]) == op->src[0]->ne[0];
+            } break;
+        case GGML_OP_FLASH_ATTN_EXT:
+            {
+                const ggml_tensor * k = op->src[1];
+                const ggml_tensor * v = op->src[2];
+                return (k->type == GGML_TYPE_F16 || k->type == GGML_TYPE_F32) && v->type == k->type &&
+                    op->ne[0] % WARP_SIZE == 0 && op->ne[0] <= CUDA_FLASH_ATTN_EXT_MAX_D;
+            } break;
         case GGML_OP_NONE:
         case GGML_OP_RESHAPE:
         case GGML_OP_VIEW:
@@ -9785,6 +10456,7 @@ static bool ggml_backend_cuda_supports_op(ggml_backend_t backend, const ggml_ten
         case GGML_OP_MUL:
         case GGML_OP_DIV:
         case GGML_OP_RMS_NORM:
+        case GGML_OP_SWIGLU:
         case GGML_OP_SCALE:
         case GGML_OP_SQR:
         case GGML_OP_CLAMP:
@@ -9792,6 +10464,7 @@ static bool ggml_backend_cuda_supports_op(ggml_backend_t backend, const ggml_ten
         case GGML_OP_DIAG_MASK_INF:
         case GGML_OP_SOFT_MAX:
         case GGML_OP_ROPE:
+        case GGML_OP_ROPE_CACHE:
         case GGML_OP_ALIBI:
         case GGML_OP_IM2COL:
         case GGML_OP_SUM_ROWS:
@@ -9810,20 +10483,66 @@ static bool ggml_backend_cuda_supports_op(ggml_backend_t backend, const ggml_ten
     UNUSED(backend);
 }
 
+static ggml_backend_event_t ggml_backend_cuda_event_new(ggml_backend_t backend) {
+    ggml_backend_context_cuda * cuda_ctx = (ggml_backend_context_cuda *)backend->context;
+
+    CUDA_CHECK(ggml_cuda_set_device(cuda_ctx->device));
+
+    cudaEvent_t event;
+    CUDA_CHECK(cudaEventCreateWithFlags(&event, cudaEventDisableTiming));
+
+    return new ggml_backend_event {
+        /* .backend = */ backend,
+        /* .context = */ event,
+    };
+}
+
+static void ggml_backend_cuda_event_free(ggml_backend_event_t event) {
+    CUDA_CHECK(cudaEventDestroy((cudaEvent_t)event->context));
+
+    delete event;
+}
+
+static void ggml_backend_cuda_event_record(ggml_backend_event_t event) {
+    ggml_backend_context_cuda * cuda_ctx = (ggml_backend_context_cuda *)event->backend->context;
+
+    CUDA_CHECK(cudaEventRecord((cudaEvent_t)event->context, g_cudaStreams[cuda_ctx->device][0]));
+}
+
+static void ggml_backend_cuda_event_wait(ggml_backend_t backend, ggml_backend_event_t event) {
+    ggml_backend_context_cuda * cuda_ctx = (ggml_backend_context_cuda *)backend->context;
+
+    if (ggml_backend_is_cuda(event->backend)) {
+        CUDA_CHECK(cudaStreamWaitEvent(g_cudaStreams[cuda_ctx->device][0], (cudaEvent_t)event->context, 0));
+    } else {
+        // the events of other backends cannot be waited for on a stream
+        ggml_backend_event_synchronize(event);
+    }
+}
+
+static void ggml_backend_cuda_event_synchronize(ggml_backend_event_t event) {
+    CUDA_CHECK(cudaEventSynchronize((cudaEvent_t)event->context));
+}
+
 static ggml_backend_i cuda_backend_i = {
     /* .get_name                = */ ggml_backend_cuda_name,
     /* .free                    = */ ggml_backend_cuda_free,
     /* .get_default_buffer_type = */ ggml_backend_cuda_get_default_buffer_type,
     /* .set_tensor_async        = */ ggml_backend_cuda_set_tensor_async,
     /* .get_tensor_async        = */ ggml_backend_cuda_get_tensor_async,
-    /* .cpy_tensor_from_async   = */ NULL,
-    /* .cpy_tensor_to_async     = */ NULL,
+    /* .cpy_tensor_from_async   = */ ggml_backend_cuda_cpy_tensor_from_async,
+    /* .cpy_tensor_to_async     = */ ggml_backend_cuda_cpy_tensor_to_async,
     /* .synchronize             = */ ggml_backend_cuda_synchronize,
     /* .graph_plan_create       = */ ggml_backend_cuda_graph_plan_create,
     /* .graph_plan_free         = */ ggml_backend_cuda_graph_plan_free,
     /* .graph_plan_compute      = */ ggml_backend_cuda_graph_plan_compute,
     /* .graph_compute           = */ ggml_backend_cuda_graph_compute,
     /* .supports_op             = */ ggml_backend_cuda_supports_op,
+    /* .event_new               = */ ggml_backend_cuda_event_new,
+    /* .event_free              = */ ggml_backend_cuda_event_free,
+    /* .event_record            = */ ggml_backend_cuda_event_record,
+    /* .event_wait              = */ ggml_backend_cuda_event_wait,
+    /* .event_synchronize       = */ ggml_backend_cuda_event_synchronize,
 };
 
 ggml_backend_t ggml_backend_cuda_init(int device) {
@@ -87,6 +87,8 @@ int * ggml_metal_get_concur_list(struct ggml_metal_context * ctx);
 
 // same as ggml_graph_compute but uses Metal
 // creates gf->n_threads command buffers in parallel
+// the commands encoded for a graph are reused for the next graphs with the same nodes and shapes
+// without a concur_list, the nodes are dispatched concurrently with barriers only between dependent nodes
 void ggml_metal_graph_compute(struct ggml_metal_context * ctx, struct ggml_cgraph * gf);
 
 //
@@ -35,6 +35,55 @@ struct ggml_metal_buffer {
     id<MTLBuffer> metal;
 };
 
+// a command of an encoder
+// the commands are recorded when a graph is encoded, the next graphs of the same shape are encoded from the recorded
+// commands instead of going through the ops again, only the buffers of the tensors are looked up again
+enum ggml_metal_cmd_type {
+    GGML_METAL_CMD_NODE,     // start of the commands of a node
+    GGML_METAL_CMD_PIPELINE,
+    GGML_METAL_CMD_BUFFER,
+    GGML_METAL_CMD_BYTES,
+    GGML_METAL_CMD_TG_MEM,
+    GGML_METAL_CMD_DISPATCH,
+    GGML_METAL_CMD_BARRIER,
+};
+
+struct ggml_metal_cmd {
+    enum ggml_metal_cmd_type type;
+
+    int32_t    node;  // index of the node in the graph
+    int32_t    src;   // GGML_METAL_CMD_BUFFER: the src of the node bound to the buffer, -1 for the node
+    NSUInteger index; // argument index
+
+    union {
+        id<MTLComputePipelineState> pipeline;
+        NSUInteger length;
+        struct {
+            uint8_t    data[16];
+            NSUInteger length;
+        } bytes;
+        struct {
+            MTLSize threadgroups;
+            MTLSize threads;
+        } dispatch;
+    };
+};
+
+struct ggml_metal_cmd_list {
+    struct ggml_metal_cmd * cmds;
+    int n;
+    int size;
+};
+
+#define GGML_METAL_MAX_GRAPHS 8
+
+struct ggml_metal_graph_cache {
+    uint64_t key; // 0 if unused
+    int64_t  last_used;
+
+    struct ggml_metal_cmd_list lists[GGML_METAL_MAX_COMMAND_BUFFERS];
+};
+
 struct ggml_metal_context {
     int n_cb;
 
@@ -53,6 +102,10 @@ struct ggml_metal_context {
     int concur_list[GGML_MAX_CONCUR];
     int concur_list_len;
 
+    // the commands of the last graphs encoded, reused for the graphs of the same shape
+    struct ggml_metal_graph_cache graphs[GGML_METAL_MAX_GRAPHS];
+    int64_t n_evals;
+
     // custom kernels
 #define GGML_METAL_DECL_KERNEL(name) \
     id<MTLFunction>             function_##name; \
@@ -238,6 +291,9 @@ struct ggml_metal_context * ggml_metal_init(int n_cb) {
     ctx->n_buffers = 0;
     ctx->concur_list_len = 0;
 
+    memset(ctx->graphs, 0, sizeof(ctx->graphs));
+    ctx->n_evals = 0;
+
     ctx->d_queue = dispatch_queue_create("ggml-metal", DISPATCH_QUEUE_CONCURRENT);
 
     // load library
@@ -570,6 +626,12 @@ void ggml_metal_free(struct ggml_metal_context * ctx) {
         [ctx->buffers[i].metal release];
     }
 
+    for (int i = 0; i < GGML_METAL_MAX_GRAPHS; ++i) {
+        for (int j = 0; j < GGML_METAL_MAX_COMMAND_BUFFERS; ++j) {
+            free(ctx->graphs[i].lists[j].cmds);
+        }
+    }
+
     [ctx->library release];
     [ctx->queue release];
     [ctx->device release];
@@ -934,25 +996,301 @@ static bool ggml_metal_supports_op(const struct ggml_tensor * op) {
             return false;
     }
 }
+
+// the range of memory of a tensor, accessed by a node encoded since the last barrier
+struct ggml_metal_mem_range {
+    int64_t start;
+    int64_t end;
+    bool    write;
+};
+
+#define GGML_METAL_MAX_MEM_RANGES 256
+
+struct ggml_metal_encoder {
+    id<MTLComputeCommandEncoder> encoder;
+
+    struct ggml_metal_cmd_list * list; // the commands are recorded in the list, if not NULL
+    int node;                          // the node being encoded
+
+    // with concurrent dispatch in the order of the graph, a barrier is inserted before a node that accesses the memory
+    // written by the nodes since the last barrier, or that writes the memory they access
+    bool track;
+    int  n_ranges;
+    struct ggml_metal_mem_range ranges[GGML_METAL_MAX_MEM_RANGES];
+};
+
+static struct ggml_metal_cmd * ggml_metal_enc_push(struct ggml_metal_encoder * enc, enum ggml_metal_cmd_type type) {
+    struct ggml_metal_cmd_list * list = enc->list;
+    if (list == NULL) {
+        return NULL;
+    }
+
+    if (list->n == list->size) {
+        list->size = MAX(1024, 2*list->size);
+        list->cmds = realloc(list->cmds, list->size*sizeof(struct ggml_metal_cmd));
+    }
+
+    struct ggml_metal_cmd * cmd = &list->cmds[list->n++];
+    cmd->type  = type;
+    cmd->node  = enc->node;
+    cmd->src   = -1;
+    cmd->index = 0;
+
+    return cmd;
+}
+
+static bool ggml_metal_mem_range_overlaps(const struct ggml_metal_encoder * enc, struct ggml_metal_mem_range r) {
+    for (int i = 0; i < enc->n_ranges; ++i) {
+        const struct ggml_metal_mem_range * cur = &enc->ranges[i];
+        if ((r.write || cur->write) && r.start < cur->end && cur->start < r.end) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static struct ggml_metal_mem_range ggml_metal_mem_range_of(const struct ggml_tensor * t, bool write) {
+    const int64_t start = (int64_t) t->data;
+    return (struct ggml_metal_mem_range) { start, start + (int64_t) ggml_nbytes(t), write };
+}
+
+static void ggml_metal_enc_barrier(struct ggml_metal_encoder * enc) {
+    [enc->encoder memoryBarrierWithScope:MTLBarrierScopeBuffers];
+    enc->n_ranges = 0;
+
+    ggml_metal_enc_push(enc, GGML_METAL_CMD_BARRIER);
+}
+
+// inserts a barrier before the node if it depends on the nodes encoded since the last barrier
+static void ggml_metal_enc_hazards(struct ggml_metal_encoder * enc, const struct ggml_tensor * node) {
+    if (!enc->track) {
+        return;
+    }
+
+    bool barrier = enc->n_ranges + GGML_MAX_SRC + 1 > GGML_METAL_MAX_MEM_RANGES;
+
+    for (int j = 0; j < GGML_MAX_SRC && !barrier; ++j) {
+        if (node->src[j] != NULL) {
+            barrier = ggml_metal_mem_range_overlaps(enc, ggml_metal_mem_range_of(node->src[j], false));
+        }
+    }
+    barrier = barrier || ggml_metal_mem_range_overlaps(enc, ggml_metal_mem_range_of(node, true));
+
+    if (barrier) {
+        [enc->encoder memoryBarrierWithScope:MTLBarrierScopeBuffers];
+        enc->n_ranges = 0;
+    }
+
+    for (int j = 0; j < GGML_MAX_SRC; ++j) {
+        if (node->src[j] != NULL) {
+            enc->ranges[enc->n_ranges++] = ggml_metal_mem_range_of(node->src[j], false);
+        }
+    }
+    enc->ranges[enc->n_ranges++] = ggml_metal_mem_range_of(node, true);
+}
+
+static void ggml_metal_enc_node(struct ggml_metal_encoder * enc, struct ggml_cgraph * gf, int i) {
+    enc->node = i;
+
+    // the barriers before the nodes are not recorded, they depend on the addresses of the tensors
+    ggml_metal_enc_push(enc, GGML_METAL_CMD_NODE);
+    ggml_metal_enc_hazards(enc, gf->nodes[i]);
+}
+
+static void ggml_metal_enc_pipeline(struct ggml_metal_encoder * enc, id<MTLComputePipelineState> pipeline) {
+    [enc->encoder setComputePipelineState:pipeline];
+
+    struct ggml_metal_cmd * cmd = ggml_metal_enc_push(enc, GGML_METAL_CMD_PIPELINE);
+    if (cmd) {
+        cmd->pipeline = pipeline;
+    }
+}
+
+static void ggml_metal_enc_buffer(struct ggml_metal_encoder * enc, id<MTLBuffer> buffer, size_t offs, NSUInteger index, int src) {
+    [enc->encoder setBuffer:buffer offset:offs atIndex:index];
+
+    struct ggml_metal_cmd * cmd = ggml_metal_enc_push(enc, GGML_METAL_CMD_BUFFER);
+    if (cmd) {
+        cmd->src   = src;
+        cmd->index = index;
+    }
+}
+
+static void ggml_metal_enc_bytes(struct ggml_metal_encoder * enc, const void * data, NSUInteger length, NSUInteger index) {
+    [enc->encoder setBytes:data length:length atIndex:index];
+
+    struct ggml_metal_cmd * cmd = ggml_metal_enc_push(enc, GGML_METAL_CMD_BYTES);
+    if (cmd) {
+        GGML_ASSERT(length <= sizeof(cmd->bytes.data));
+        memcpy(cmd->bytes.data, data, length);
+        cmd->bytes.length = length;
+        cmd->index        = index;
+    }
+}
+
+static void ggml_metal_enc_tg_mem(struct ggml_metal_encoder * enc, NSUInteger length, NSUInteger index) {
+    [enc->encoder setThreadgroupMemoryLength:length atIndex:index];
+
+    struct ggml_metal_cmd * cmd = ggml_metal_enc_push(enc, GGML_METAL_CMD_TG_MEM);
+    if (cmd) {
+        cmd->length = length;
+        cmd->index  = index;
+    }
+}
+
+static void ggml_metal_enc_dispatch(struct ggml_metal_encoder * enc, MTLSize threadgroups, MTLSize threads) {
+    [enc->encoder dispatchThreadgroups:threadgroups threadsPerThreadgroup:threads];
+
+    struct ggml_metal_cmd * cmd = ggml_metal_enc_push(enc, GGML_METAL_CMD_DISPATCH);
+    if (cmd) {
+        cmd->dispatch.threadgroups = threadgroups;
+        cmd->dispatch.threads      = threads;
+    }
+}
+
+// encodes the recorded commands with the tensors of the graph
+static void ggml_metal_enc_replay(struct ggml_metal_context * ctx, struct ggml_metal_encoder * enc, struct ggml_cgraph * gf, const struct ggml_metal_cmd_list * list) {
+    id<MTLComputeCommandEncoder> encoder = enc->encoder;
+
+    for (int k = 0; k < list->n; ++k) {
+        const struct ggml_metal_cmd * cmd = &list->cmds[k];
+
+        switch (cmd->type) {
+            case GGML_METAL_CMD_NODE:
+                {
+                    ggml_metal_enc_hazards(enc, gf->nodes[cmd->node]);
+                } break;
+            case GGML_METAL_CMD_PIPELINE:
+                {
+                    [encoder setComputePipelineState:cmd->pipeline];
+                } break;
+            case GGML_METAL_CMD_BUFFER:
+                {
+                    struct ggml_tensor * node = gf->nodes[cmd->node];
+                    struct ggml_tensor * t    = cmd->src < 0 ? node : node->src[cmd->src];
+
+                    size_t offs = 0;
+                    id<MTLBuffer> buffer = ggml_metal_get_buffer(ctx, t, &offs);
+
+                    [encoder setBuffer:buffer offset:offs atIndex:cmd->index];
+                } break;
+            case GGML_METAL_CMD_BYTES:
+                {
+                    [encoder setBytes:cmd->bytes.data length:cmd->bytes.length atIndex:cmd->index];
+                } break;
+            case GGML_METAL_CMD_TG_MEM:
+                {
+                    [encoder setThreadgroupMemoryLength:cmd->length atIndex:cmd->index];
+                } break;
+            case GGML_METAL_CMD_DISPATCH:
+                {
+                    [encoder dispatchThreadgroups:cmd->dispatch.threadgroups threadsPerThreadgroup:cmd->dispatch.threads];
+                } break;
+            case GGML_METAL_CMD_BARRIER:
+                {
+                    [encoder memoryBarrierWithScope:MTLBarrierScopeBuffers];
+                    enc->n_ranges = 0;
+                } break;
+        }
+    }
+}
+
+// hash of everything the commands depend on, except the addresses of the tensors
+// returns 0 if the graph cannot be encoded from recorded commands
+static uint64_t ggml_metal_graph_key(struct ggml_metal_context * ctx, struct ggml_cgraph * gf, bool has_concur) {
+    uint64_t h = 14695981039346656037ULL;
+
+#define GGML_METAL_HASH(ptr, size) \
+    for (size_t k = 0; k < (size); ++k) { h = (h ^ ((const uint8_t *) (ptr))[k]) * 1099511628211ULL; }
+
+    GGML_METAL_HASH(&ctx->n_cb,    sizeof(ctx->n_cb));
+    GGML_METAL_HASH(&gf->n_nodes,  sizeof(gf->n_nodes));
+    GGML_METAL_HASH(&has_concur,   sizeof(has_concur));
+    if (has_concur) {
+        GGML_METAL_HASH(ctx->concur_list, ctx->concur_list_len*sizeof(int));
+    }
+
+    for (int i = 0; i < gf->n_nodes; ++i) {
+        const struct ggml_tensor * node = gf->nodes[i];
+
+        // the scale is read from the data of src1 while encoding
+        if (node->op == GGML_OP_SCALE) {
+            return 0;
+        }
+
+        GGML_METAL_HASH(&node->op,      sizeof(node->op));
+        GGML_METAL_HASH(&node->type,    sizeof(node->type));
+        GGML_METAL_HASH(node->ne,       sizeof(node->ne));
+        GGML_METAL_HASH(node->nb,       sizeof(node->nb));
+        GGML_METAL_HASH(node->op_params, sizeof(node->op_params));
+
+        for (int j = 0; j < GGML_MAX_SRC; ++j) {
+            const struct ggml_tensor * src = node->src[j];
+            const bool has_src = src != NULL;
+            GGML_METAL_HASH(&has_src, sizeof(has_src));
+            if (has_src) {
+                GGML_METAL_HASH(&src->type, sizeof(src->type));
+                GGML_METAL_HASH(src->ne,    sizeof(src->ne));
+                GGML_METAL_HASH(src->nb,    sizeof(src->nb));
+            }
+        }
+    }
+
+#undef GGML_METAL_HASH
+
+    return h == 0 ? 1 : h;
+}
+
 void ggml_metal_graph_compute(
         struct ggml_metal_context * ctx,
                struct ggml_cgraph * gf) {
     @autoreleasepool {
 
-    // if there is ctx->concur_list, dispatch concurrently
-    // else fallback to serial dispatch
+    // the nodes are dispatched concurrently
+    // if there is ctx->concur_list, in its order with its barriers
+    // else in the order of the graph, with a barrier before the nodes that depend on the previous ones
     MTLComputePassDescriptor * edesc = MTLComputePassDescriptor.computePassDescriptor;
 
     const bool has_concur = ctx->concur_list_len && ctx->concur_list_len <= GGML_MAX_CONCUR;
 
-    const int n_nodes  = has_concur ? ctx->concur_list_len      : gf->n_nodes;
-    edesc.dispatchType = has_concur ? MTLDispatchTypeConcurrent : MTLDispatchTypeSerial;
+    const int n_nodes  = has_concur ? ctx->concur_list_len : gf->n_nodes;
+    edesc.dispatchType = MTLDispatchTypeConcurrent;
 
     // create multiple command buffers and enqueue them
     // then, we encode the graph into the command buffers in parallel
 
     const int n_cb = ctx->n_cb;
 
+    // encode the graph from the commands recorded for a graph of the same shape, or record them
+    const uint64_t key = ggml_metal_graph_key(ctx, gf, has_concur);
+
+    struct ggml_metal_graph_cache * graph = NULL;
+    bool replay = false;
+
+    if (key != 0) {
+        for (int i = 0; i < GGML_METAL_MAX_GRAPHS; ++i) {
+            if (ctx->graphs[i].key == key) {
+                graph  = &ctx->graphs[i];
+                replay = true;
+                break;
+            }
+        }
+        if (graph == NULL) {
+            // replace the least recently used graph
+            graph = &ctx->graphs[0];
+            for (int i = 1; i < GGML_METAL_MAX_GRAPHS; ++i) {
+                if (ctx->graphs[i].last_used < graph->last_used) {
+                    graph = &ctx->graphs[i];
+                }
+            }
+            graph->key = key;
+            for (int i = 0; i < n_cb; ++i) {
+                graph->lists[i].n = 0;
+            }
+        }
+        graph->last_used = ++ctx->n_evals;
+    }
+
     for (int i = 0; i < n_cb; ++i) {
         ctx->command_buffers[i] = [ctx->queue commandBuffer];
 
@@ -973,14 +1311,26 @@ void ggml_metal_graph_compute(
             id<MTLCommandBuffer> command_buffer  = ctx->command_buffers[cb_idx];
             id<MTLComputeCommandEncoder> encoder = ctx->command_encoders[cb_idx];
 
-            const int node_start =                                      (cb_idx + 0) * n_nodes_per_cb;
-            const int node_end   = MIN((cb_idx == n_cb - 1) ? n_nodes : (cb_idx + 1) * n_nodes_per_cb, n_nodes);
+            struct ggml_metal_encoder enc;
+            enc.encoder  = encoder;
+            enc.list     = graph != NULL && !replay ? &graph->lists[cb_idx] : NULL;
+            enc.node     = -1;
+            enc.track    = !has_concur;
+            enc.n_ranges = 0;
+
+            if (replay) {
+                ggml_metal_enc_replay(ctx, &enc, gf, &graph->lists[cb_idx]);
+            }
+
+            // nothing left to encode when the commands were replayed
+            const int node_start = replay ? 0 :                         (cb_idx + 0) * n_nodes_per_cb;
+            const int node_end   = replay ? 0 : MIN((cb_idx == n_cb - 1) ? n_nodes : (cb_idx + 1) * n_nodes_per_cb, n_nodes);
 
             for (int ind = node_start; ind < node_end; ++ind) {
                 const int i = has_concur ? ctx->concur_list[ind] : ind;
 
                 if (i == -1) {
-                    [encoder memoryBarrierWithScope:MTLBarrierScopeBuffers];
+                    ggml_metal_enc_barrier(&enc);
                     continue;
                 }
 
@@ -1009,6 +1359,8 @@ void ggml_metal_graph_compute(
                     GGML_ASSERT(!"unsupported op");
                 }
 
+                ggml_metal_enc_node(&enc, gf, i);
+
                 const int64_t  ne00 = src0 ? src0->ne[0] : 0;
                 const int64_t  ne01 = src0 ? src0->ne[1] : 0;
                 const int64_t  ne02 = src0 ? src0->ne[2] : 0;
@@ -1066,39 +1418,39 @@ void ggml_metal_graph_compute(
                         {
                             const int64_t nb = ne00;
 
-                            [encoder setComputePipelineState:ctx->pipeline_concat];
-                            [encoder setBuffer:id_src0 offset:offs_src0 atIndex:0];
-                            [encoder setBuffer:id_src1 offset:offs_src1 atIndex:1];
-                            [encoder setBuffer:id_dst  offset:offs_dst  atIndex:2];
-                            [encoder setBytes:&ne00 length:sizeof(ne00) atIndex:3];
-                            [encoder setBytes:&ne01 length:sizeof(ne01) atIndex:4];
-                            [encoder setBytes:&ne02 length:sizeof(ne02) atIndex:5];
-                            [encoder setBytes:&ne03 length:sizeof(ne03) atIndex:6];
-                            [encoder setBytes:&nb00 length:sizeof(nb00) atIndex:7];
-                            [encoder setBytes:&nb01 length:sizeof(nb01) atIndex:8];
-                            [encoder setBytes:&nb02 length:sizeof(nb02) atIndex:9];
-                            [encoder setBytes:&nb03 length:sizeof(nb03) atIndex:10];
-                            [encoder setBytes:&ne10 length:sizeof(ne10) atIndex:11];
-                            [encoder setBytes:&ne11 length:sizeof(ne11) atIndex:12];
-                            [encoder setBytes:&ne12 length:sizeof(ne12) atIndex:13];
-                            [encoder setBytes:&ne13 length:sizeof(ne13) atIndex:14];
-                            [encoder setBytes:&nb10 length:sizeof(nb10) atIndex:15];
-                            [encoder setBytes:&nb11 length:sizeof(nb11) atIndex:16];
-                            [encoder setBytes:&nb12 length:sizeof(nb12) atIndex:17];
-                            [encoder setBytes:&nb13 length:sizeof(nb13) atIndex:18];
-                            [encoder setBytes:&ne0  length:sizeof(ne0)  atIndex:19];
-                            [encoder setBytes:&ne1  length:sizeof(ne1)  atIndex:20];
-                            [encoder setBytes:&ne2  length:sizeof(ne2)  atIndex:21];
-                            [encoder setBytes:&ne3  length:sizeof(ne3)  atIndex:22];
-                            [encoder setBytes:&nb0  length:sizeof(nb0)  atIndex:23];
-                            [encoder setBytes:&nb1  length:sizeof(nb1)  atIndex:24];
-                            [encoder setBytes:&nb2  length:sizeof(nb2)  atIndex:25];
-                            [encoder setBytes:&nb3  length:sizeof(nb3)  atIndex:26];
-                            [encoder setBytes:&nb   length:sizeof(nb)   atIndex:27];
+                            ggml_metal_enc_pipeline(&enc, ctx->pipeline_concat);
+                            ggml_metal_enc_buffer(&enc, id_src0, offs_src0, 0, 0);
+                            ggml_metal_enc_buffer(&enc, id_src1, offs_src1, 1, 1);
+                            ggml_metal_enc_buffer(&enc, id_dst,  offs_dst,  2, -1);
+                            ggml_metal_enc_bytes(&enc, &ne00, sizeof(ne00), 3);
+                            ggml_metal_enc_bytes(&enc, &ne01, sizeof(ne01), 4);
+                            ggml_metal_enc_bytes(&enc, &ne02, sizeof(ne02), 5);
+                            ggml_metal_enc_bytes(&enc, &ne03, sizeof(ne03), 6);
+                            ggml_metal_enc_bytes(&enc, &nb00, sizeof(nb00), 7);
+                            ggml_metal_enc_bytes(&enc, &nb01, sizeof(nb01), 8);
+                            ggml_metal_enc_bytes(&enc, &nb02, sizeof(nb02), 9);
+                            ggml_metal_enc_bytes(&enc, &nb03, sizeof(nb03), 10);
+                            ggml_metal_enc_bytes(&enc, &ne10, sizeof(ne10), 11);
+                            ggml_metal_enc_bytes(&enc, &ne11, sizeof(ne11), 12);
+                            ggml_metal_enc_bytes(&enc, &ne12, sizeof(ne12), 13);
+                            ggml_metal_enc_bytes(&enc, &ne13, sizeof(ne13), 14);
+                            ggml_metal_enc_bytes(&enc, &nb10, sizeof(nb10), 15);
+                            ggml_metal_enc_bytes(&enc, &nb11, sizeof(nb11), 16);
+                            ggml_metal_enc_bytes(&enc, &nb12, sizeof(nb12), 17);
+                            ggml_metal_enc_bytes(&enc, &nb13, sizeof(nb13), 18);
+                            ggml_metal_enc_bytes(&enc, &ne0,  sizeof(ne0),  19);
+                            ggml_metal_enc_bytes(&enc, &ne1,  sizeof(ne1),  20);
+                            ggml_metal_enc_bytes(&enc, &ne2,  sizeof(ne2),  21);
+                            ggml_metal_enc_bytes(&enc, &ne3,  sizeof(ne3),  22);
+                            ggml_metal_enc_bytes(&enc, &nb0,  sizeof(nb0),  23);
+                            ggml_metal_enc_bytes(&enc, &nb1,  sizeof(nb1),  24);
+                            ggml_metal_enc_bytes(&enc, &nb2,  sizeof(nb2),  25);
+                            ggml_metal_enc_bytes(&enc, &nb3,  sizeof(nb3),  26);
+                            ggml_metal_enc_bytes(&enc, &nb,   sizeof(nb),   27);
 
                             const int nth = MIN(1024, ne0);
 
-                            [encoder dispatchThreadgroups:MTLSizeMake(ne1, ne2, ne3) threadsPerThreadgroup:MTLSizeMake(nth, 1, 1)];
+                            ggml_metal_enc_dispatch(&enc, MTLSizeMake(ne1, ne2, ne3), MTLSizeMake(nth, 1, 1));
                         } break;
                     case GGML_OP_ADD:
                     case GGML_OP_MUL:
@@ -1136,45 +1488,45 @@ void ggml_metal_graph_compute(
                                 }
                             }
 
-                            [encoder setComputePipelineState:pipeline];
-                            [encoder setBuffer:id_src0 offset:offs_src0 atIndex:0];
-                            [encoder setBuffer:id_src1 offset:offs_src1 atIndex:1];
-                            [encoder setBuffer:id_dst  offset:offs_dst  atIndex:2];
-                            [encoder setBytes:&ne00 length:sizeof(ne00) atIndex:3];
-                            [encoder setBytes:&ne01 length:sizeof(ne01) atIndex:4];
-                            [encoder setBytes:&ne02 length:sizeof(ne02) atIndex:5];
-                            [encoder setBytes:&ne03 length:sizeof(ne03) atIndex:6];
-                            [encoder setBytes:&nb00 length:sizeof(nb00) atIndex:7];
-                            [encoder setBytes:&nb01 length:sizeof(nb01) atIndex:8];
-                            [encoder setBytes:&nb02 length:sizeof(nb02) atIndex:9];
-                            [encoder setBytes:&nb03 length:sizeof(nb03) atIndex:10];
-                            [encoder setBytes:&ne10 length:sizeof(ne10) atIndex:11];
-                            [encoder setBytes:&ne11 length:sizeof(ne11) atIndex:12];
-                            [encoder setBytes:&ne12 length:sizeof(ne12) atIndex:13];
-                            [encoder setBytes:&ne13 length:sizeof(ne13) atIndex:14];
-                            [encoder setBytes:&nb10 length:sizeof(nb10) atIndex:15];
-                            [encoder setBytes:&nb11 length:sizeof(nb11) atIndex:16];
-                            [encoder setBytes:&nb12 length:sizeof(nb12) atIndex:17];
-                            [encoder setBytes:&nb13 length:sizeof(nb13) atIndex:18];
-                            [encoder setBytes:&ne0  length:sizeof(ne0)  atIndex:19];
-                            [encoder setBytes:&ne1  length:sizeof(ne1)  atIndex:20];
-                            [encoder setBytes:&ne2  length:sizeof(ne2)  atIndex:21];
-                            [encoder setBytes:&ne3  length:sizeof(ne3)  atIndex:22];
-                            [encoder setBytes:&nb0  length:sizeof(nb0)  atIndex:23];
-                            [encoder setBytes:&nb1  length:sizeof(nb1)  atIndex:24];
-                            [encoder setBytes:&nb2  length:sizeof(nb2)  atIndex:25];
-                            [encoder setBytes:&nb3  length:sizeof(nb3)  atIndex:26];
-                            [encoder setBytes:&offs length:sizeof(offs) atIndex:27];
-                            [encoder setBytes:&nb   length:sizeof(nb)   atIndex:28];
+                            ggml_metal_enc_pipeline(&enc, pipeline);
+                            ggml_metal_enc_buffer(&enc, id_src0, offs_src0, 0, 0);
+                            ggml_metal_enc_buffer(&enc, id_src1, offs_src1, 1, 1);
+                            ggml_metal_enc_buffer(&enc, id_dst,  offs_dst,  2, -1);
+                            ggml_metal_enc_bytes(&enc, &ne00, sizeof(ne00), 3);
+                            ggml_metal_enc_bytes(&enc, &ne01, sizeof(ne01), 4);
+                            ggml_metal_enc_bytes(&enc, &ne02, sizeof(ne02), 5);
+                            ggml_metal_enc_bytes(&enc, &ne03, sizeof(ne03), 6);
+                            ggml_metal_enc_bytes(&enc, &nb00, sizeof(nb00), 7);
+                            ggml_metal_enc_bytes(&enc, &nb01, sizeof(nb01), 8);
+                            ggml_metal_enc_bytes(&enc, &nb02, sizeof(nb02), 9);
+                            ggml_metal_enc_bytes(&enc, &nb03, sizeof(nb03), 10);
+                            ggml_metal_enc_bytes(&enc, &ne10, sizeof(ne10), 11);
+                            ggml_metal_enc_bytes(&enc, &ne11, sizeof(ne11), 12);
+                            ggml_metal_enc_bytes(&enc, &ne12, sizeof(ne12), 13);
+                            ggml_metal_enc_bytes(&enc, &ne13, sizeof(ne13), 14);
+                            ggml_metal_enc_bytes(&enc, &nb10, sizeof(nb10), 15);
+                            ggml_metal_enc_bytes(&enc, &nb11, sizeof(nb11), 16);
+                            ggml_metal_enc_bytes(&enc, &nb12, sizeof(nb12), 17);
+                            ggml_metal_enc_bytes(&enc, &nb13, sizeof(nb13), 18);
+                            ggml_metal_enc_bytes(&enc, &ne0,  sizeof(ne0),  19);
+                            ggml_metal_enc_bytes(&enc, &ne1,  sizeof(ne1),  20);
+                            ggml_metal_enc_bytes(&enc, &ne2,  sizeof(ne2),  21);
+                            ggml_metal_enc_bytes(&enc, &ne3,  sizeof(ne3),  22);
+                            ggml_metal_enc_bytes(&enc, &nb0,  sizeof(nb0),  23);
+                            ggml_metal_enc_bytes(&enc, &nb1,  sizeof(nb1),  24);
+                            ggml_metal_enc_bytes(&enc, &nb2,  sizeof(nb2),  25);
+                            ggml_metal_enc_bytes(&enc, &nb3,  sizeof(nb3),  26);
+                            ggml_metal_enc_bytes(&enc, &offs, sizeof(offs), 27);
+                            ggml_metal_enc_bytes(&enc, &nb,   sizeof(nb),   28);
 
                             if (bcast_row) {
                                 const int64_t n = ggml_nelements(dst)/4;
 
-                                [encoder dispatchThreadgroups:MTLSizeMake(n, 1, 1) threadsPerThreadgroup:MTLSizeMake(1, 1, 1)];
+                                ggml_metal_enc_dispatch(&enc, MTLSizeMake(n, 1, 1), MTLSizeMake(1, 1, 1));
                             } else {
                                 const int nth = MIN((int) pipeline.maxTotalThreadsPerThreadgroup, ne0);
 
-                                [encoder dispatchThreadgroups:MTLSizeMake(ne01, ne02, ne03) threadsPerThreadgroup:MTLSizeMake(nth, 1, 1)];
+                                ggml_metal_enc_dispatch(&enc, MTLSizeMake(ne01, ne02, ne03), MTLSizeMake(nth, 1, 1));
                             }
                         } break;
                     case GGML_OP_ACC:
@@ -1200,62 +1552,62 @@ void ggml_metal_graph_compute(
 
                                 const int nth = MIN(1024, ne00);
 
-                                [encoder setComputePipelineState:ctx->pipeline_cpy_f32_f32];
-                                [encoder setBuffer:id_src0 offset:offs_src0        atIndex:0];
-                                [encoder setBuffer:id_dst  offset:offs_dst         atIndex:1];
-                                [encoder setBytes:&ne00    length:sizeof( int64_t) atIndex:2];
-                                [encoder setBytes:&ne01    length:sizeof( int64_t) atIndex:3];
-                                [encoder setBytes:&ne02    length:sizeof( int64_t) atIndex:4];
-                                [encoder setBytes:&ne03    length:sizeof( int64_t) atIndex:5];
-                                [encoder setBytes:&nb00    length:sizeof(uint64_t) atIndex:6];
-                                [encoder setBytes:&nb01    length:sizeof(uint64_t) atIndex:7];
-                                [encoder setBytes:&nb02    length:sizeof(uint64_t) atIndex:8];
-                                [encoder setBytes:&nb03    length:sizeof(uint64_t) atIndex:9];
-                                [encoder setBytes:&ne0     length:sizeof( int64_t) atIndex:10];
-                                [encoder setBytes:&ne1     length:sizeof( int64_t) atIndex:11];
-                                [encoder setBytes:&ne2     length:sizeof( int64_t) atIndex:12];
-                                [encoder setBytes:&ne3     length:sizeof( int64_t) atIndex:13];
-                                [encoder setBytes:&nb0     length:sizeof(uint64_t) atIndex:14];
-                                [encoder setBytes:&nb1     length:sizeof(uint64_t) atIndex:15];
-                                [encoder setBytes:&nb2     length:sizeof(uint64_t) atIndex:16];
-                                [encoder setBytes:&nb3     length:sizeof(uint64_t) atIndex:17];
-
-                                [encoder dispatchThreadgroups:MTLSizeMake(ne01, ne02, ne03) threadsPerThreadgroup:MTLSizeMake(nth, 1, 1)];
+                                ggml_metal_enc_pipeline(&enc, ctx->pipeline_cpy_f32_f32);
+                                ggml_metal_enc_buffer(&enc, id_src0, offs_src0,        0, 0);
+                                ggml_metal_enc_buffer(&enc, id_dst,  offs_dst,         1, -1);
+                                ggml_metal_enc_bytes(&enc, &ne00,    sizeof( int64_t), 2);
+                                ggml_metal_enc_bytes(&enc, &ne01,    sizeof( int64_t), 3);
+                                ggml_metal_enc_bytes(&enc, &ne02,    sizeof( int64_t), 4);
+                                ggml_metal_enc_bytes(&enc, &ne03,    sizeof( int64_t), 5);
+                                ggml_metal_enc_bytes(&enc, &nb00,    sizeof(uint64_t), 6);
+                                ggml_metal_enc_bytes(&enc, &nb01,    sizeof(uint64_t), 7);
+                                ggml_metal_enc_bytes(&enc, &nb02,    sizeof(uint64_t), 8);
+                                ggml_metal_enc_bytes(&enc, &nb03,    sizeof(uint64_t), 9);
+                                ggml_metal_enc_bytes(&enc, &ne0,     sizeof( int64_t), 10);
+                                ggml_metal_enc_bytes(&enc, &ne1,     sizeof( int64_t), 11);
+                                ggml_metal_enc_bytes(&enc, &ne2,     sizeof( int64_t), 12);
+                                ggml_metal_enc_bytes(&enc, &ne3,     sizeof( int64_t), 13);
+                                ggml_metal_enc_bytes(&enc, &nb0,     sizeof(uint64_t), 14);
+                                ggml_metal_enc_bytes(&enc, &nb1,     sizeof(uint64_t), 15);
+                                ggml_metal_enc_bytes(&enc, &nb2,     sizeof(uint64_t), 16);
+                                ggml_metal_enc_bytes(&enc, &nb3,     sizeof(uint64_t), 17);
+
+                                ggml_metal_enc_dispatch(&enc, MTLSizeMake(ne01, ne02, ne03), MTLSizeMake(nth, 1, 1));
                             }
 
-                            [encoder setComputePipelineState:ctx->pipeline_add];
-                            [encoder setBuffer:id_src0 offset:offs_src0 atIndex:0];
-                            [encoder setBuffer:id_src1 offset:offs_src1 atIndex:1];
-                            [encoder setBuffer:id_dst  offset:offs_dst  atIndex:2];
-                            [encoder setBytes:&ne00 length:sizeof(ne00) atIndex:3];
-                            [encoder setBytes:&ne01 length:sizeof(ne01) atIndex:4];
-                            [encoder setBytes:&ne02 length:sizeof(ne02) atIndex:5];
-                            [encoder setBytes:&ne03 length:sizeof(ne03) atIndex:6];
-                            [encoder setBytes:&nb00 length:sizeof(nb00) atIndex:7];
-                            [encoder setBytes:&pnb1 length:sizeof(pnb1) atIndex:8];
-                            [encoder setBytes:&pnb2 length:sizeof(pnb2) atIndex:9];
-                            [encoder setBytes:&pnb3 length:sizeof(pnb3) atIndex:10];
-                            [encoder setBytes:&ne10 length:sizeof(ne10) atIndex:11];
-                            [encoder setBytes:&ne11 length:sizeof(ne11) atIndex:12];
-                            [encoder setBytes:&ne12 length:sizeof(ne12) atIndex:13];
-                            [encoder setBytes:&ne13 length:sizeof(ne13) atIndex:14];
-                            [encoder setBytes:&nb10 length:sizeof(nb10) atIndex:15];
-                            [encoder setBytes:&nb11 length:sizeof(nb11) atIndex:16];
-                            [encoder setBytes:&nb12 length:sizeof(nb12) atIndex:17];
-                            [encoder setBytes:&nb13 length:sizeof(nb13) atIndex:18];
-                            [encoder setBytes:&ne0  length:sizeof(ne0)  atIndex:19];
-                            [encoder setBytes:&ne1  length:sizeof(ne1)  atIndex:20];
-                            [encoder setBytes:&ne2  length:sizeof(ne2)  atIndex:21];
-                            [encoder setBytes:&ne3  length:sizeof(ne3)  atIndex:22];
-                            [encoder setBytes:&nb0  length:sizeof(nb0)  atIndex:23];
-                            [encoder setBytes:&pnb1 length:sizeof(pnb1) atIndex:24];
-                            [encoder setBytes:&pnb2 length:sizeof(pnb2) atIndex:25];
-                            [encoder setBytes:&pnb3 length:sizeof(pnb3) atIndex:26];
-                            [encoder setBytes:&offs length:sizeof(offs) atIndex:27];
+                            ggml_metal_enc_pipeline(&enc, ctx->pipeline_add);
+                            ggml_metal_enc_buffer(&enc, id_src0, offs_src0, 0, 0);
+                            ggml_metal_enc_buffer(&enc, id_src1, offs_src1, 1, 1);
+                            ggml_metal_enc_buffer(&enc, id_dst,  offs_dst,  2, -1);
+                            ggml_metal_enc_bytes(&enc, &ne00, sizeof(ne00), 3);
+                            ggml_metal_enc_bytes(&enc, &ne01, sizeof(ne01), 4);
+                            ggml_metal_enc_bytes(&enc, &ne02, sizeof(ne02), 5);
+                            ggml_metal_enc_bytes(&enc, &ne03, sizeof(ne03), 6);
+                            ggml_metal_enc_bytes(&enc, &nb00, sizeof(nb00), 7);
+                            ggml_metal_enc_bytes(&enc, &pnb1, sizeof(pnb1), 8);
+                            ggml_metal_enc_bytes(&enc, &pnb2, sizeof(pnb2), 9);
+                            ggml_metal_enc_bytes(&enc, &pnb3, sizeof(pnb3), 10);
+                            ggml_metal_enc_bytes(&enc, &ne10, sizeof(ne10), 11);
+                            ggml_metal_enc_bytes(&enc, &ne11, sizeof(ne11), 12);
+                            ggml_metal_enc_bytes(&enc, &ne12, sizeof(ne12), 13);
+                            ggml_metal_enc_bytes(&enc, &ne13, sizeof(ne13), 14);
+                            ggml_metal_enc_bytes(&enc, &nb10, sizeof(nb10), 15);
+                            ggml_metal_enc_bytes(&enc, &nb11, sizeof(nb11), 16);
+                            ggml_metal_enc_bytes(&enc, &nb12, sizeof(nb12), 17);
+                            ggml_metal_enc_bytes(&enc, &nb13, sizeof(nb13), 18);
+                            ggml_metal_enc_bytes(&enc, &ne0,  sizeof(ne0),  19);
+                            ggml_metal_enc_bytes(&enc, &ne1,  sizeof(ne1),  20);
+                            ggml_metal_enc_bytes(&enc, &ne2,  sizeof(ne2),  21);
+                            ggml_metal_enc_bytes(&enc, &ne3,  sizeof(ne3),  22);
+                            ggml_metal_enc_bytes(&enc, &nb0,  sizeof(nb0),  23);
+                            ggml_metal_enc_bytes(&enc, &pnb1, sizeof(pnb1), 24);
+                            ggml_metal_enc_bytes(&enc, &pnb2, sizeof(pnb2), 25);
+                            ggml_metal_enc_bytes(&enc, &pnb3, sizeof(pnb3), 26);
+                            ggml_metal_enc_bytes(&enc, &offs, sizeof(offs), 27);
 
                             const int nth = MIN(1024, ne0);
 
-                            [encoder dispatchThreadgroups:MTLSizeMake(ne11, ne12, ne13) threadsPerThreadgroup:MTLSizeMake(nth, 1, 1)];
+                            ggml_metal_enc_dispatch(&enc, MTLSizeMake(ne11, ne12, ne13), MTLSizeMake(nth, 1, 1));
                         } break;
                     case GGML_OP_SCALE:
                         {
@@ -1267,71 +1619,71 @@ void ggml_metal_graph_compute(
 
                             if (n % 4 == 0) {
                                 n /= 4;
-                                [encoder setComputePipelineState:ctx->pipeline_scale_4];
+                                ggml_metal_enc_pipeline(&enc, ctx->pipeline_scale_4);
                             } else {
-                                [encoder setComputePipelineState:ctx->pipeline_scale];
+                                ggml_metal_enc_pipeline(&enc, ctx->pipeline_scale);
                             }
 
-                            [encoder setBuffer:id_src0 offset:offs_src0 atIndex:0];
-                            [encoder setBuffer:id_dst  offset:offs_dst  atIndex:1];
-                            [encoder setBytes:&scale length:sizeof(scale) atIndex:2];
+                            ggml_metal_enc_buffer(&enc, id_src0, offs_src0, 0, 0);
+                            ggml_metal_enc_buffer(&enc, id_dst,  offs_dst,  1, -1);
+                            ggml_metal_enc_bytes(&enc, &scale, sizeof(scale), 2);
 
-                            [encoder dispatchThreadgroups:MTLSizeMake(n, 1, 1) threadsPerThreadgroup:MTLSizeMake(1, 1, 1)];
+                            ggml_metal_enc_dispatch(&enc, MTLSizeMake(n, 1, 1), MTLSizeMake(1, 1, 1));
                         } break;
                     case GGML_OP_UNARY:
                         switch (ggml_get_unary_op(gf->nodes[i])) {
                             case GGML_UNARY_OP_TANH:
                                 {
-                                    [encoder setComputePipelineState:ctx->pipeline_tanh];
-                                    [encoder setBuffer:id_src0 offset:offs_src0 atIndex:0];
-                                    [encoder setBuffer:id_dst  offset:offs_dst  atIndex:1];
+                                    ggml_metal_enc_pipeline(&enc, ctx->pipeline_tanh);
+                                    ggml_metal_enc_buffer(&enc, id_src0, offs_src0, 0, 0);
+                                    ggml_metal_enc_buffer(&enc, id_dst,  offs_dst,  1, -1);
 
                                     const int64_t n = ggml_nelements(dst);
 
-                                    [encoder dispatchThreadgroups:MTLSizeMake(n, 1, 1) threadsPerThreadgroup:MTLSizeMake(1, 1, 1)];
+                                    ggml_metal_enc_dispatch(&enc, MTLSizeMake(n, 1, 1), MTLSizeMake(1, 1, 1));
                                 } break;
                             case GGML_UNARY_OP_RELU:
                                 {
-                                    [encoder setComputePipelineState:ctx->pipeline_relu];
-                                    [encoder setBuffer:id_src0 offset:offs_src0 atIndex:0];
-                                    [encoder setBuffer:id_dst  offset:offs_dst  atIndex:1];
+                                    ggml_metal_enc_pipeline(&enc, ctx->pipeline_relu);
+                                    ggml_metal_enc_buffer(&enc, id_src0, offs_src0, 0, 0);
+                                    ggml_metal_enc_buffer(&enc, id_dst,  offs_dst,  1, -1);
 
                                     const int64_t n = ggml_nelements(dst);
 
-                                    [encoder dispatchThreadgroups:MTLSizeMake(n, 1, 1) threadsPerThreadgroup:MTLSizeMake(1, 1, 1)];
+                                    ggml_metal_enc_dispatch(&enc, MTLSizeMake(n, 1, 1), MTLSizeMake(1, 1, 1));
                                 } break;
                             case GGML_UNARY_OP_GELU:
                                 {
-                                    [encoder setComputePipelineState:ctx->pipeline_gelu];
-                                    [encoder setBuffer:id_src0 offset:offs_src0 atIndex:0];
-                                    [encoder setBuffer:id_dst  offset:offs_dst  atIndex:1];
+                                    ggml_metal_enc_pipeline(&enc, ctx->pipeline_gelu);
+                                    ggml_metal_enc_buffer(&enc, id_src0, offs_src0, 0, 0);
+                                    ggml_metal_enc_buffer(&enc, id_dst,  offs_dst,  1, -1);
 
                                     const int64_t n = ggml_nelements(dst);
                                     GGML_ASSERT(n % 4 == 0);
 
-                                    [encoder dispatchThreadgroups:MTLSizeMake(n/4, 1, 1) threadsPerThreadgroup:MTLSizeMake(1, 1, 1)];
+                                    ggml_metal_enc_dispatch(&enc, MTLSizeMake(n/4, 1, 1), MTLSizeMake(1, 1, 1));
                                 } break;
                             case GGML_UNARY_OP_GELU_QUICK:
                                 {
-                                    [encoder setComputePipelineState:ctx->pipeline_gelu_quick];
-                                    [encoder setBuffer:id_src0 offset:offs_src0 atIndex:0];
-                                    [encoder setBuffer:id_dst  offset:offs_dst  atIndex:1];
+                                    ggml_metal_enc_pipeline(&enc, ctx->pipeline_gelu_quick);
+                                    ggml_metal_enc_buffer(&enc, id_src0, offs_src0, 0, 0);
+                                    ggml_metal_enc_buffer(&enc, id_dst,  offs_dst,  1, -1);
 
                                     const int64_t n = ggml_nelements(dst);
                                     GGML_ASSERT(n % 4 == 0);
 
-                                    [encoder dispatchThreadgroups:MTLSizeMake(n/4, 1, 1) threadsPerThreadgroup:MTLSizeMake(1, 1, 1)];
+                                    ggml_metal_enc_dispatch(&enc, MTLSizeMake(n/4, 1, 1), MTLSizeMake(1, 1, 1));
                                 } break;
                             case GGML_UNARY_OP_SILU:
                                 {
-                                    [encoder setComputePipelineState:ctx->pipeline_silu];
-                                    [encoder setBuffer:id_src0 offset:offs_src0 atIndex:0];
-                                    [encoder setBuffer:id_dst  offset:offs_dst  atIndex:1];
+                                    ggml_metal_enc_pipeline(&enc, ctx->pipeline_silu);
+                                    ggml_metal_enc_buffer(&enc, id_src0, offs_src0, 0, 0);
+                                    ggml_metal_enc_buffer(&enc, id_dst,  offs_dst,  1, -1);
 
                                     const int64_t n = ggml_nelements(dst);
                                     GGML_ASSERT(n % 4 == 0);
 
-                                    [encoder dispatchThreadgroups:MTLSizeMake(n/4, 1, 1) threadsPerThreadgroup:MTLSizeMake(1, 1, 1)];
+                                    ggml_metal_enc_dispatch(&enc, MTLSizeMake(n/4, 1, 1), MTLSizeMake(1, 1, 1));
                                 } break;
                             default:
                                 {
@@ -1343,46 +1695,46 @@ void ggml_metal_graph_compute(
                         {
                             GGML_ASSERT(ggml_is_contiguous(src0));
 
-                            [encoder setComputePipelineState:ctx->pipeline_sqr];
-                            [encoder setBuffer:id_src0 offset:offs_src0 atIndex:0];
-                            [encoder setBuffer:id_dst  offset:offs_dst atIndex:1];
+                            ggml_metal_enc_pipeline(&enc, ctx->pipeline_sqr);
+                            ggml_metal_enc_buffer(&enc, id_src0, offs_src0, 0, 0);
+                            ggml_metal_enc_buffer(&enc, id_dst,  offs_dst, 1, -1);
 
                             const int64_t n = ggml_nelements(dst);
-                            [encoder dispatchThreadgroups:MTLSizeMake(n, 1, 1) threadsPerThreadgroup:MTLSizeMake(1, 1, 1)];
+                            ggml_metal_enc_dispatch(&enc, MTLSizeMake(n, 1, 1), MTLSizeMake(1, 1, 1));
                         } break;
                     case GGML_OP_SUM_ROWS:
                         {
                             GGML_ASSERT(src0->nb[0] == ggml_type_size(src0->type));
 
-                            [encoder setComputePipelineState:ctx->pipeline_sum_rows];
-                            [encoder setBuffer:id_src0 offset:offs_src0 atIndex:0];
-                            [encoder setBuffer:id_dst  offset:offs_dst  atIndex:1];
-                            [encoder setBytes:&ne00 length:sizeof(ne00) atIndex:2];
-                            [encoder setBytes:&ne01 length:sizeof(ne01) atIndex:3];
-                            [encoder setBytes:&ne02 length:sizeof(ne02) atIndex:4];
-                            [encoder setBytes:&ne03 length:sizeof(ne03) atIndex:5];
-                            [encoder setBytes:&nb00 length:sizeof(nb00) atIndex:6];
-                            [encoder setBytes:&nb01 length:sizeof(nb01) atIndex:7];
-                            [encoder setBytes:&nb02 length:sizeof(nb02) atIndex:8];
-                            [encoder setBytes:&nb03 length:sizeof(nb03) atIndex:9];
-                            [encoder setBytes:&ne10 length:sizeof(ne10) atIndex:10];
-                            [encoder setBytes:&ne11 length:sizeof(ne11) atIndex:11];
-                            [encoder setBytes:&ne12 length:sizeof(ne12) atIndex:12];
-                            [encoder setBytes:&ne13 length:sizeof(ne13) atIndex:13];
-                            [encoder setBytes:&nb10 length:sizeof(nb10) atIndex:14];
-                            [encoder setBytes:&nb11 length:sizeof(nb11) atIndex:15];
-                            [encoder setBytes:&nb12 length:sizeof(nb12) atIndex:16];
-                            [encoder setBytes:&nb13 length:sizeof(nb13) atIndex:17];
-                            [encoder setBytes:&ne0  length:sizeof(ne0)  atIndex:18];
-                            [encoder setBytes:&ne1  length:sizeof(ne1)  atIndex:19];
-                            [encoder setBytes:&ne2  length:sizeof(ne2)  atIndex:20];
-                            [encoder setBytes:&ne3  length:sizeof(ne3)  atIndex:21];
-                            [encoder setBytes:&nb0  length:sizeof(nb0)  atIndex:22];
-                            [encoder setBytes:&nb1  length:sizeof(nb1)  atIndex:23];
-                            [encoder setBytes:&nb2  length:sizeof(nb2)  atIndex:24];
-                            [encoder setBytes:&nb3  length:sizeof(nb3)  atIndex:25];
-
-                            [encoder dispatchThreadgroups:MTLSizeMake(ne01, ne02, ne03) threadsPerThreadgroup:MTLSizeMake(1, 1, 1)];
+                            ggml_metal_enc_pipeline(&enc, ctx->pipeline_sum_rows);
+                            ggml_metal_enc_buffer(&enc, id_src0, offs_src0, 0, 0);
+                            ggml_metal_enc_buffer(&enc, id_dst,  offs_dst,  1, -1);
+                            ggml_metal_enc_bytes(&enc, &ne00, sizeof(ne00), 2);
+                            ggml_metal_enc_bytes(&enc, &ne01, sizeof(ne01), 3);
+                            ggml_metal_enc_bytes(&enc, &ne02, sizeof(ne02), 4);
+                            ggml_metal_enc_bytes(&enc, &ne03, sizeof(ne03), 5);
+                            ggml_metal_enc_bytes(&enc, &nb00, sizeof(nb00), 6);
+                            ggml_metal_enc_bytes(&enc, &nb01, sizeof(nb01), 7);
+                            ggml_metal_enc_bytes(&enc, &nb02, sizeof(nb02), 8);
+                            ggml_metal_enc_bytes(&enc, &nb03, sizeof(nb03), 9);
+                            ggml_metal_enc_bytes(&enc, &ne10, sizeof(ne10), 10);
+                            ggml_metal_enc_bytes(&enc, &ne11, sizeof(ne11), 11);
+                            ggml_metal_enc_bytes(&enc, &ne12, sizeof(ne12), 12);
+                            ggml_metal_enc_bytes(&enc, &ne13, sizeof(ne13), 13);
+                            ggml_metal_enc_bytes(&enc, &nb10, sizeof(nb10), 14);
+                            ggml_metal_enc_bytes(&enc, &nb11, sizeof(nb11), 15);
+                            ggml_metal_enc_bytes(&enc, &nb12, sizeof(nb12), 16);
+                            ggml_metal_enc_bytes(&enc, &nb13, sizeof(nb13), 17);
+                            ggml_metal_enc_bytes(&enc, &ne0,  sizeof(ne0),  18);
+                            ggml_metal_enc_bytes(&enc, &ne1,  sizeof(ne1),  19);
+                            ggml_metal_enc_bytes(&enc, &ne2,  sizeof(ne2),  20);
+                            ggml_metal_enc_bytes(&enc, &ne3,  sizeof(ne3),  21);
+                            ggml_metal_enc_bytes(&enc, &nb0,  sizeof(nb0),  22);
+                            ggml_metal_enc_bytes(&enc, &nb1,  sizeof(nb1),  23);
+                            ggml_metal_enc_bytes(&enc, &nb2,  sizeof(nb2),  24);
+                            ggml_metal_enc_bytes(&enc, &nb3,  sizeof(nb3),  25);
+
+                            ggml_metal_enc_dispatch(&enc, MTLSizeMake(ne01, ne02, ne03), MTLSizeMake(1, 1, 1));
                         } break;
                     case GGML_OP_SOFT_MAX:
                         {
@@ -1392,51 +1744,51 @@ void ggml_metal_graph_compute(
                                 while (nth < ne00/4 && nth < 256) {
                                     nth *= 2;
                                 }
-                                [encoder setComputePipelineState:ctx->pipeline_soft_max_4];
+                                ggml_metal_enc_pipeline(&enc, ctx->pipeline_soft_max_4);
                             } else {
                                 while (nth < ne00 && nth < 1024) {
                                     nth *= 2;
                                 }
-                                [encoder setComputePipelineState:ctx->pipeline_soft_max];
+                                ggml_metal_enc_pipeline(&enc, ctx->pipeline_soft_max);
                             }
 
                             const float scale = ((float *) dst->op_params)[0];
 
-                            [encoder setBuffer:id_src0 offset:offs_src0   atIndex:0];
+                            ggml_metal_enc_buffer(&enc, id_src0, offs_src0,   0, 0);
                             if (id_src1) {
-                                [encoder setBuffer:id_src1 offset:offs_src1   atIndex:1];
+                                ggml_metal_enc_buffer(&enc, id_src1, offs_src1,   1, 1);
                             } else {
-                                [encoder setBuffer:id_src0 offset:offs_src0   atIndex:1];
+                                ggml_metal_enc_buffer(&enc, id_src0, offs_src0,   1, 0);
                             }
-                            [encoder setBuffer:id_dst  offset:offs_dst    atIndex:2];
-                            [encoder setBytes:&ne00  length:sizeof(ne00)  atIndex:3];
-                            [encoder setBytes:&ne01  length:sizeof(ne01)  atIndex:4];
-                            [encoder setBytes:&ne02  length:sizeof(ne02)  atIndex:5];
-                            [encoder setBytes:&scale length:sizeof(scale) atIndex:6];
-                            [encoder setThreadgroupMemoryLength:32*sizeof(float) atIndex:0];
-
-                            [encoder dispatchThreadgroups:MTLSizeMake(ne01*ne02*ne03, 1, 1) threadsPerThreadgroup:MTLSizeMake(nth, 1, 1)];
+                            ggml_metal_enc_buffer(&enc, id_dst,  offs_dst,    2, -1);
+                            ggml_metal_enc_bytes(&enc, &ne00,  sizeof(ne00),  3);
+                            ggml_metal_enc_bytes(&enc, &ne01,  sizeof(ne01),  4);
+                            ggml_metal_enc_bytes(&enc, &ne02,  sizeof(ne02),  5);
+                            ggml_metal_enc_bytes(&enc, &scale, sizeof(scale), 6);
+                            ggml_metal_enc_tg_mem(&enc, 32*sizeof(float), 0);
+
+                            ggml_metal_enc_dispatch(&enc, MTLSizeMake(ne01*ne02*ne03, 1, 1), MTLSizeMake(nth, 1, 1));
                         } break;
                     case GGML_OP_DIAG_MASK_INF:
                         {
                             const int n_past = ((int32_t *)(dst->op_params))[0];
 
                             if (ne00%8 == 0) {
-                                [encoder setComputePipelineState:ctx->pipeline_diag_mask_inf_8];
+                                ggml_metal_enc_pipeline(&enc, ctx->pipeline_diag_mask_inf_8);
                             } else {
-                                [encoder setComputePipelineState:ctx->pipeline_diag_mask_inf];
+                                ggml_metal_enc_pipeline(&enc, ctx->pipeline_diag_mask_inf);
                             }
-                            [encoder setBuffer:id_src0 offset:offs_src0 atIndex:0];
-                            [encoder setBuffer:id_dst  offset:offs_dst  atIndex:1];
-                            [encoder setBytes:&ne00   length:sizeof(ne00) atIndex:2];
-                            [encoder setBytes:&ne01   length:sizeof(ne01) atIndex:3];
-                            [encoder setBytes:&n_past length:sizeof(int)  atIndex:4];
+                            ggml_metal_enc_buffer(&enc, id_src0, offs_src0, 0, 0);
+                            ggml_metal_enc_buffer(&enc, id_dst,  offs_dst,  1, -1);
+                            ggml_metal_enc_bytes(&enc, &ne00,   sizeof(ne00), 2);
+                            ggml_metal_enc_bytes(&enc, &ne01,   sizeof(ne01), 3);
+                            ggml_metal_enc_bytes(&enc, &n_past, sizeof(int),  4);
 
                             if (ne00%8 == 0) {
-                                [encoder dispatchThreadgroups:MTLSizeMake(ne00*ne01*ne02/8, 1, 1) threadsPerThreadgroup:MTLSizeMake(1, 1, 1)];
+                                ggml_metal_enc_dispatch(&enc, MTLSizeMake(ne00*ne01*ne02/8, 1, 1), MTLSizeMake(1, 1, 1));
                             }
                             else {
-                                [encoder dispatchThreadgroups:MTLSizeMake(ne00, ne01, ne02) threadsPerThreadgroup:MTLSizeMake(1, 1, 1)];
+                                ggml_metal_enc_dispatch(&enc, MTLSizeMake(ne00, ne01, ne02), MTLSizeMake(1, 1, 1));
                             }
                         } break;
                     case GGML_OP_MUL_MAT:
@@ -1486,37 +1838,37 @@ void ggml_metal_graph_compute(
                                 (ne11 > ne11_mm_min || (ggml_is_quantized(src0t) && ne12 > 1))) {
                                 //printf("matrix: ne00 = %6d, ne01 = %6d, ne02 = %6d, ne11 = %6d, ne12 = %6d\n", ne00, ne01, ne02, ne11, ne12);
                                 switch (src0->type) {
-                                    case GGML_TYPE_F32:  [encoder setComputePipelineState:ctx->pipeline_mul_mm_f32_f32];  break;
-                                    case GGML_TYPE_F16:  [encoder setComputePipelineState:ctx->pipeline_mul_mm_f16_f32];  break;
-                                    case GGML_TYPE_Q4_0: [encoder setComputePipelineState:ctx->pipeline_mul_mm_q4_0_f32]; break;
-                                    case GGML_TYPE_Q4_1: [encoder setComputePipelineState:ctx->pipeline_mul_mm_q4_1_f32]; break;
-                                    case GGML_TYPE_Q5_0: [encoder setComputePipelineState:ctx->pipeline_mul_mm_q5_0_f32]; break;
-                                    case GGML_TYPE_Q5_1: [encoder setComputePipelineState:ctx->pipeline_mul_mm_q5_1_f32]; break;
-                                    case GGML_TYPE_Q8_0: [encoder setComputePipelineState:ctx->pipeline_mul_mm_q8_0_f32]; break;
-                                    case GGML_TYPE_Q2_K: [encoder setComputePipelineState:ctx->pipeline_mul_mm_q2_K_f32]; break;
-                                    case GGML_TYPE_Q3_K: [encoder setComputePipelineState:ctx->pipeline_mul_mm_q3_K_f32]; break;
-                                    case GGML_TYPE_Q4_K: [encoder setComputePipelineState:ctx->pipeline_mul_mm_q4_K_f32]; break;
-                                    case GGML_TYPE_Q5_K: [encoder setComputePipelineState:ctx->pipeline_mul_mm_q5_K_f32]; break;
-                                    case GGML_TYPE_Q6_K: [encoder setComputePipelineState:ctx->pipeline_mul_mm_q6_K_f32]; break;
+                                    case GGML_TYPE_F32:  ggml_metal_enc_pipeline(&enc, ctx->pipeline_mul_mm_f32_f32);  break;
+                                    case GGML_TYPE_F16:  ggml_metal_enc_pipeline(&enc, ctx->pipeline_mul_mm_f16_f32);  break;
+                                    case GGML_TYPE_Q4_0: ggml_metal_enc_pipeline(&enc, ctx->pipeline_mul_mm_q4_0_f32); break;
+                                    case GGML_TYPE_Q4_1: ggml_metal_enc_pipeline(&enc, ctx->pipeline_mul_mm_q4_1_f32); break;
+                                    case GGML_TYPE_Q5_0: ggml_metal_enc_pipeline(&enc, ctx->pipeline_mul_mm_q5_0_f32); break;
+                                    case GGML_TYPE_Q5_1: ggml_metal_enc_pipeline(&enc, ctx->pipeline_mul_mm_q5_1_f32); break;
+                                    case GGML_TYPE_Q8_0: ggml_metal_enc_pipeline(&enc, ctx->pipeline_mul_mm_q8_0_f32); break;
+                                    case GGML_TYPE_Q2_K: ggml_metal_enc_pipeline(&enc, ctx->pipeline_mul_mm_q2_K_f32); break;
+                                    case GGML_TYPE_Q3_K: ggml_metal_enc_pipeline(&enc, ctx->pipeline_mul_mm_q3_K_f32); break;
+                                    case GGML_TYPE_Q4_K: ggml_metal_enc_pipeline(&enc, ctx->pipeline_mul_mm_q4_K_f32); break;
+                                    case GGML_TYPE_Q5_K: ggml_metal_enc_pipeline(&enc, ctx->pipeline_mul_mm_q5_K_f32); break;
+                                    case GGML_TYPE_Q6_K: ggml_metal_enc_pipeline(&enc, ctx->pipeline_mul_mm_q6_K_f32); break;
                                     default: GGML_ASSERT(false && "MUL MAT-MAT not implemented");
                                 }
-                                [encoder setBuffer:id_src0 offset:offs_src0    atIndex:0];
-                                [encoder setBuffer:id_src1 offset:offs_src1    atIndex:1];
-                                [encoder setBuffer:id_dst  offset:offs_dst     atIndex:2];
-                                [encoder setBytes:&ne00    length:sizeof(ne00) atIndex:3];
-                                [encoder setBytes:&ne02    length:sizeof(ne02) atIndex:4];
-                                [encoder setBytes:&nb01    length:sizeof(nb01) atIndex:5];
-                                [encoder setBytes:&nb02    length:sizeof(nb02) atIndex:6];
-                                [encoder setBytes:&ne12    length:sizeof(ne12) atIndex:7];
-                                [encoder setBytes:&nb10    length:sizeof(nb10) atIndex:8];
-                                [encoder setBytes:&nb11    length:sizeof(nb11) atIndex:9];
-                                [encoder setBytes:&nb12    length:sizeof(nb12) atIndex:10];
-                                [encoder setBytes:&ne0     length:sizeof(ne0)  atIndex:11];
-                                [encoder setBytes:&ne1     length:sizeof(ne1)  atIndex:12];
-                                [encoder setBytes:&r2      length:sizeof(r2)   atIndex:13];
-                                [encoder setBytes:&r3      length:sizeof(r3)   atIndex:14];
-                                [encoder setThreadgroupMemoryLength:8192 atIndex:0];
-                                [encoder dispatchThreadgroups:MTLSizeMake( (ne11 + 31)/32, (ne01 + 63)/64, ne12*ne13) threadsPerThreadgroup:MTLSizeMake(128, 1, 1)];
+                                ggml_metal_enc_buffer(&enc, id_src0, offs_src0,    0, 0);
+                                ggml_metal_enc_buffer(&enc, id_src1, offs_src1,    1, 1);
+                                ggml_metal_enc_buffer(&enc, id_dst,  offs_dst,     2, -1);
+                                ggml_metal_enc_bytes(&enc, &ne00,    sizeof(ne00), 3);
+                                ggml_metal_enc_bytes(&enc, &ne02,    sizeof(ne02), 4);
+                                ggml_metal_enc_bytes(&enc, &nb01,    sizeof(nb01), 5);
+                                ggml_metal_enc_bytes(&enc, &nb02,    sizeof(nb02), 6);
+                                ggml_metal_enc_bytes(&enc, &ne12,    sizeof(ne12), 7);
+                                ggml_metal_enc_bytes(&enc, &nb10,    sizeof(nb10), 8);
+                                ggml_metal_enc_bytes(&enc, &nb11,    sizeof(nb11), 9);
+                                ggml_metal_enc_bytes(&enc, &nb12,    sizeof(nb12), 10);
+                                ggml_metal_enc_bytes(&enc, &ne0,     sizeof(ne0),  11);
+                                ggml_metal_enc_bytes(&enc, &ne1,     sizeof(ne1),  12);
+                                ggml_metal_enc_bytes(&enc, &r2,      sizeof(r2),   13);
+                                ggml_metal_enc_bytes(&enc, &r3,      sizeof(r3),   14);
+                                ggml_metal_enc_tg_mem(&enc, 8192, 0);
+                                ggml_metal_enc_dispatch(&enc, MTLSizeMake( (ne11 + 31)/32, (ne01 + 63)/64, ne12*ne13), MTLSizeMake(128, 1, 1));
                             } else {
                                 int nth0 = 32;
                                 int nth1 = 1;
@@ -1528,7 +1880,7 @@ void ggml_metal_graph_compute(
                                     case GGML_TYPE_F32:
                                         {
                                             GGML_ASSERT(src1t == GGML_TYPE_F32);
-                                            [encoder setComputePipelineState:ctx->pipeline_mul_mv_f32_f32];
+                                            ggml_metal_enc_pipeline(&enc, ctx->pipeline_mul_mv_f32_f32);
                                             nrows = 4;
                                         } break;
                                     case GGML_TYPE_F16:
@@ -1537,16 +1889,16 @@ void ggml_metal_graph_compute(
                                             nth1 = 1;
                                             if (src1t == GGML_TYPE_F32) {
                                                 if (ne11 * ne12 < 4) {
-                                                    [encoder setComputePipelineState:ctx->pipeline_mul_mv_f16_f32_1row];
+                                                    ggml_metal_enc_pipeline(&enc, ctx->pipeline_mul_mv_f16_f32_1row);
                                                 } else if (ne00 >= 128 && ne01 >= 8 && ne00%4 == 0) {
-                                                    [encoder setComputePipelineState:ctx->pipeline_mul_mv_f16_f32_l4];
+                                                    ggml_metal_enc_pipeline(&enc, ctx->pipeline_mul_mv_f16_f32_l4);
                                                     nrows = ne11;
                                                 } else {
-                                                    [encoder setComputePipelineState:ctx->pipeline_mul_mv_f16_f32];
+                                                    ggml_metal_enc_pipeline(&enc, ctx->pipeline_mul_mv_f16_f32);
                                                     nrows = 4;
                                                 }
                                             } else {
-                                                [encoder setComputePipelineState:ctx->pipeline_mul_mv_f16_f16];
+                                                ggml_metal_enc_pipeline(&enc, ctx->pipeline_mul_mv_f16_f16);
                                                 nrows = 4;
                                             }
                                         } break;
@@ -1554,61 +1906,61 @@ void ggml_metal_graph_compute(
                                         {
                                             nth0 = 8;
                                             nth1 = 8;
-                                            [encoder setComputePipelineState:ctx->pipeline_mul_mv_q4_0_f32];
+                                            ggml_metal_enc_pipeline(&enc, ctx->pipeline_mul_mv_q4_0_f32);
                                         } break;
                                     case GGML_TYPE_Q4_1:
                                         {
                                             nth0 = 8;
                                             nth1 = 8;
-                                            [encoder setComputePipelineState:ctx->pipeline_mul_mv_q4_1_f32];
+                                            ggml_metal_enc_pipeline(&enc, ctx->pipeline_mul_mv_q4_1_f32);
                                         } break;
                                     case GGML_TYPE_Q5_0:
                                         {
                                             nth0 = 8;
                                             nth1 = 8;
-                                            [encoder setComputePipelineState:ctx->pipeline_mul_mv_q5_0_f32];
+                                            ggml_metal_enc_pipeline(&enc, ctx->pipeline_mul_mv_q5_0_f32);
                                         } break;
                                     case GGML_TYPE_Q5_1:
                                         {
                                             nth0 = 8;
                                             nth1 = 8;
-                                            [encoder setComputePipelineState:ctx->pipeline_mul_mv_q5_1_f32];
+                                            ggml_metal_enc_pipeline(&enc, ctx->pipeline_mul_mv_q5_1_f32);
                                         } break;
                                     case GGML_TYPE_Q8_0:
                                         {
                                             nth0 = 8;
                                             nth1 = 8;
-                                            [encoder setComputePipelineState:ctx->pipeline_mul_mv_q8_0_f32];
+                                            ggml_metal_enc_pipeline(&enc, ctx->pipeline_mul_mv_q8_0_f32);
                                         } break;
                                     case GGML_TYPE_Q2_K:
                                         {
                                             nth0 = 2;
                                             nth1 = 32;
-                                            [encoder setComputePipelineState:ctx->pipeline_mul_mv_q2_K_f32];
+                                            ggml_metal_enc_pipeline(&enc, ctx->pipeline_mul_mv_q2_K_f32);
                                         } break;
                                     case GGML_TYPE_Q3_K:
                                         {
                                             nth0 = 2;
                                             nth1 = 32;
-                                            [encoder setComputePipelineState:ctx->pipeline_mul_mv_q3_K_f32];
+                                            ggml_metal_enc_pipeline(&enc, ctx->pipeline_mul_mv_q3_K_f32);
                                         } break;
                                     case GGML_TYPE_Q4_K:
                                         {
                                             nth0 = 4; //1;
                                             nth1 = 8; //32;
-                                            [encoder setComputePipelineState:ctx->pipeline_mul_mv_q4_K_f32];
+                                            ggml_metal_enc_pipeline(&enc, ctx->pipeline_mul_mv_q4_K_f32);
                                         } break;
                                     case GGML_TYPE_Q5_K:
                                         {
                                             nth0 = 2;
                                             nth1 = 32;
-                                            [encoder setComputePipelineState:ctx->pipeline_mul_mv_q5_K_f32];
+                                            ggml_metal_enc_pipeline(&enc, ctx->pipeline_mul_mv_q5_K_f32);
                                         } break;
                                     case GGML_TYPE_Q6_K:
                                         {
                                             nth0 = 2;
                                             nth1 = 32;
-                                            [encoder setComputePipelineState:ctx->pipeline_mul_mv_q6_K_f32];
+                                            ggml_metal_enc_pipeline(&enc, ctx->pipeline_mul_mv_q6_K_f32);
                                         } break;
                                     default:
                                         {
@@ -1617,49 +1969,49 @@ void ggml_metal_graph_compute(
                                         }
                                 };
 
-                                [encoder setBuffer:id_src0 offset:offs_src0 atIndex:0];
-                                [encoder setBuffer:id_src1 offset:offs_src1 atIndex:1];
-                                [encoder setBuffer:id_dst  offset:offs_dst  atIndex:2];
-                                [encoder setBytes:&ne00 length:sizeof(ne00) atIndex:3];
-                                [encoder setBytes:&ne01 length:sizeof(ne01) atIndex:4];
-                                [encoder setBytes:&ne02 length:sizeof(ne02) atIndex:5];
-                                [encoder setBytes:&nb00 length:sizeof(nb00) atIndex:6];
-                                [encoder setBytes:&nb01 length:sizeof(nb01) atIndex:7];
-                                [encoder setBytes:&nb02 length:sizeof(nb02) atIndex:8];
-                                [encoder setBytes:&ne10 length:sizeof(ne10) atIndex:9];
-                                [encoder setBytes:&ne11 length:sizeof(ne11) atIndex:10];
-                                [encoder setBytes:&ne12 length:sizeof(ne12) atIndex:11];
-                                [encoder setBytes:&nb10 length:sizeof(nb10) atIndex:12];
-                                [encoder setBytes:&nb11 length:sizeof(nb11) atIndex:13];
-                                [encoder setBytes:&nb12 length:sizeof(nb12) atIndex:14];
-                                [encoder setBytes:&ne0  length:sizeof(ne0)  atIndex:15];
-                                [encoder setBytes:&ne1  length:sizeof(ne1)  atIndex:16];
-                                [encoder setBytes:&r2   length:sizeof(r2)   atIndex:17];
-                                [encoder setBytes:&r3   length:sizeof(r3)   atIndex:18];
+                                ggml_metal_enc_buffer(&enc, id_src0, offs_src0, 0, 0);
+                                ggml_metal_enc_buffer(&enc, id_src1, offs_src1, 1, 1);
+                                ggml_metal_enc_buffer(&enc, id_dst,  offs_dst,  2, -1);
+                                ggml_metal_enc_bytes(&enc, &ne00, sizeof(ne00), 3);
+                                ggml_metal_enc_bytes(&enc, &ne01, sizeof(ne01), 4);
+                                ggml_metal_enc_bytes(&enc, &ne02, sizeof(ne02), 5);
+                                ggml_metal_enc_bytes(&enc, &nb00, sizeof(nb00), 6);
+                                ggml_metal_enc_bytes(&enc, &nb01, sizeof(nb01), 7);
+                                ggml_metal_enc_bytes(&enc, &nb02, sizeof(nb02), 8);
+                                ggml_metal_enc_bytes(&enc, &ne10, sizeof(ne10), 9);
+                                ggml_metal_enc_bytes(&enc, &ne11, sizeof(ne11), 10);
+                                ggml_metal_enc_bytes(&enc, &ne12, sizeof(ne12), 11);
+                                ggml_metal_enc_bytes(&enc, &nb10, sizeof(nb10), 12);
+                                ggml_metal_enc_bytes(&enc, &nb11, sizeof(nb11), 13);
+                                ggml_metal_enc_bytes(&enc, &nb12, sizeof(nb12), 14);
+                                ggml_metal_enc_bytes(&enc, &ne0,  sizeof(ne0),  15);
+                                ggml_metal_enc_bytes(&enc, &ne1,  sizeof(ne1),  16);
+                                ggml_metal_enc_bytes(&enc, &r2,   sizeof(r2),   17);
+                                ggml_metal_enc_bytes(&enc, &r3,   sizeof(r3),   18);
 
                                 if (src0t == GGML_TYPE_Q4_0 || src0t == GGML_TYPE_Q4_1 ||
                                     src0t == GGML_TYPE_Q5_0 || src0t == GGML_TYPE_Q5_1 || src0t == GGML_TYPE_Q8_0 ||
                                     src0t == GGML_TYPE_Q2_K) { // || src0t == GGML_TYPE_Q4_K) {
-                                    [encoder dispatchThreadgroups:MTLSizeMake((ne01 + 7)/8, ne11, ne12*ne13) threadsPerThreadgroup:MTLSizeMake(nth0, nth1, 1)];
+                                    ggml_metal_enc_dispatch(&enc, MTLSizeMake((ne01 + 7)/8, ne11, ne12*ne13), MTLSizeMake(nth0, nth1, 1));
                                 }
                                 else if (src0t == GGML_TYPE_Q4_K) {
-                                    [encoder dispatchThreadgroups:MTLSizeMake((ne01 + 3)/4, ne11, ne12*ne13) threadsPerThreadgroup:MTLSizeMake(nth0, nth1, 1)];
+                                    ggml_metal_enc_dispatch(&enc, MTLSizeMake((ne01 + 3)/4, ne11, ne12*ne13), MTLSizeMake(nth0, nth1, 1));
                                 }
                                 else if (src0t == GGML_TYPE_Q3_K) {
 #ifdef GGML_QKK_64
-                                    [encoder dispatchThreadgroups:MTLSizeMake((ne01 + 1)/2, ne11, ne12*ne13) threadsPerThreadgroup:MTLSizeMake(nth0, nth1, 1)];
+                                    ggml_metal_enc_dispatch(&enc, MTLSizeMake((ne01 + 1)/2, ne11, ne12*ne13), MTLSizeMake(nth0, nth1, 1));
 #else
-                                    [encoder dispatchThreadgroups:MTLSizeMake((ne01 + 3)/4, ne11, ne12*ne13) threadsPerThreadgroup:MTLSizeMake(nth0, nth1, 1)];
+                                    ggml_metal_enc_dispatch(&enc, MTLSizeMake((ne01 + 3)/4, ne11, ne12*ne13), MTLSizeMake(nth0, nth1, 1));
 #endif
                                 }
                                 else if (src0t == GGML_TYPE_Q5_K) {
-                                    [encoder dispatchThreadgroups:MTLSizeMake((ne01 + 3)/4, ne11, ne12*ne13) threadsPerThreadgroup:MTLSizeMake(nth0, nth1, 1)];
+                                    ggml_metal_enc_dispatch(&enc, MTLSizeMake((ne01 + 3)/4, ne11, ne12*ne13), MTLSizeMake(nth0, nth1, 1));
                                 }
                                 else if (src0t == GGML_TYPE_Q6_K) {
-                                    [encoder dispatchThreadgroups:MTLSizeMake((ne01 + 1)/2, ne11, ne12*ne13) threadsPerThreadgroup:MTLSizeMake(nth0, nth1, 1)];
+                                    ggml_metal_enc_dispatch(&enc, MTLSizeMake((ne01 + 1)/2, ne11, ne12*ne13), MTLSizeMake(nth0, nth1, 1));
                                 } else {
                                     const int64_t ny = (ne11 + nrows - 1)/nrows;
-                                    [encoder dispatchThreadgroups:MTLSizeMake(ne01, ny, ne12*ne13) threadsPerThreadgroup:MTLSizeMake(nth0, nth1, 1)];
+                                    ggml_metal_enc_dispatch(&enc, MTLSizeMake(ne01, ny, ne12*ne13), MTLSizeMake(nth0, nth1, 1));
                                 }
                             }
                         } break;
@@ -1719,39 +2071,39 @@ void ggml_metal_graph_compute(
                             // !!!
                             if ([ctx->device supportsFamily:MTLGPUFamilyApple7] && _ne1 > ne11_mm_min) {
                                 switch (src2->type) {
-                                    case GGML_TYPE_F32:  [encoder setComputePipelineState:ctx->pipeline_mul_mm_id_f32_f32];  break;
-                                    case GGML_TYPE_F16:  [encoder setComputePipelineState:ctx->pipeline_mul_mm_id_f16_f32];  break;
-                                    case GGML_TYPE_Q4_0: [encoder setComputePipelineState:ctx->pipeline_mul_mm_id_q4_0_f32]; break;
-                                    case GGML_TYPE_Q4_1: [encoder setComputePipelineState:ctx->pipeline_mul_mm_id_q4_1_f32]; break;
-                                    case GGML_TYPE_Q5_0: [encoder setComputePipelineState:ctx->pipeline_mul_mm_id_q5_0_f32]; break;
-                                    case GGML_TYPE_Q5_1: [encoder setComputePipelineState:ctx->pipeline_mul_mm_id_q5_1_f32]; break;
-                                    case GGML_TYPE_Q8_0: [encoder setComputePipelineState:ctx->pipeline_mul_mm_id_q8_0_f32]; break;
-                                    case GGML_TYPE_Q2_K: [encoder setComputePipelineState:ctx->pipeline_mul_mm_id_q2_K_f32]; break;
-                                    case GGML_TYPE_Q3_K: [encoder setComputePipelineState:ctx->pipeline_mul_mm_id_q3_K_f32]; break;
-                                    case GGML_TYPE_Q4_K: [encoder setComputePipelineState:ctx->pipeline_mul_mm_id_q4_K_f32]; break;
-                                    case GGML_TYPE_Q5_K: [encoder setComputePipelineState:ctx->pipeline_mul_mm_id_q5_K_f32]; break;
-                                    case GGML_TYPE_Q6_K: [encoder setComputePipelineState:ctx->pipeline_mul_mm_id_q6_K_f32]; break;
+                                    case GGML_TYPE_F32:  ggml_metal_enc_pipeline(&enc, ctx->pipeline_mul_mm_id_f32_f32);  break;
+                                    case GGML_TYPE_F16:  ggml_metal_enc_pipeline(&enc, ctx->pipeline_mul_mm_id_f16_f32);  break;
+                                    case GGML_TYPE_Q4_0: ggml_metal_enc_pipeline(&enc, ctx->pipeline_mul_mm_id_q4_0_f32); break;
+                                    case GGML_TYPE_Q4_1: ggml_metal_enc_pipeline(&enc, ctx->pipeline_mul_mm_id_q4_1_f32); break;
+                                    case GGML_TYPE_Q5_0: ggml_metal_enc_pipeline(&enc, ctx->pipeline_mul_mm_id_q5_0_f32); break;
+                                    case GGML_TYPE_Q5_1: ggml_metal_enc_pipeline(&enc, ctx->pipeline_mul_mm_id_q5_1_f32); break;
+                                    case GGML_TYPE_Q8_0: ggml_metal_enc_pipeline(&enc, ctx->pipeline_mul_mm_id_q8_0_f32); break;
+                                    case GGML_TYPE_Q2_K: ggml_metal_enc_pipeline(&enc, ctx->pipeline_mul_mm_id_q2_K_f32); break;
+                                    case GGML_TYPE_Q3_K: ggml_metal_enc_pipeline(&enc, ctx->pipeline_mul_mm_id_q3_K_f32); break;
+                                    case GGML_TYPE_Q4_K: ggml_metal_enc_pipeline(&enc, ctx->pipeline_mul_mm_id_q4_K_f32); break;
+                                    case GGML_TYPE_Q5_K: ggml_metal_enc_pipeline(&enc, ctx->pipeline_mul_mm_id_q5_K_f32); break;
+                                    case GGML_TYPE_Q6_K: ggml_metal_enc_pipeline(&enc, ctx->pipeline_mul_mm_id_q6_K_f32); break;
                                     default: GGML_ASSERT(false && "MUL_MAT_ID not implemented");
                                 }
-                                [encoder setBuffer:id_src0 offset:offs_src0    atIndex:0];
-                                [encoder setBuffer:id_src1 offset:offs_src1    atIndex:1];
-                                [encoder setBuffer:id_dst  offset:offs_dst     atIndex:2];
-                                [encoder setBytes:&nb01    length:sizeof(nb01) atIndex:3];
-                                [encoder setBytes:&ne20    length:sizeof(ne20) atIndex:4];
-                                [encoder setBytes:&ne22    length:sizeof(ne22) atIndex:5];
-                                [encoder setBytes:&nb21    length:sizeof(nb21) atIndex:6];
-                                [encoder setBytes:&nb22    length:sizeof(nb22) atIndex:7];
-                                [encoder setBytes:&ne12    length:sizeof(ne12) atIndex:8];
-                                [encoder setBytes:&ne13    length:sizeof(ne13) atIndex:9];
-                                [encoder setBytes:&nb10    length:sizeof(nb10) atIndex:10];
-                                [encoder setBytes:&nb11    length:sizeof(nb11) atIndex:11];
-                                [encoder setBytes:&nb12    length:sizeof(nb12) atIndex:12];
-                                [encoder setBytes:&ne0     length:sizeof(ne0)  atIndex:13];
-                                [encoder setBytes:&_ne1    length:sizeof(_ne1) atIndex:14];
-                                [encoder setBytes:&nb1     length:sizeof(nb1)  atIndex:15];
-                                [encoder setBytes:&r2      length:sizeof(r2)   atIndex:16];
-                                [encoder setBytes:&r3      length:sizeof(r3)   atIndex:17];
-                                [encoder setBytes:&idx     length:sizeof(idx)  atIndex:18];
+                                ggml_metal_enc_buffer(&enc, id_src0, offs_src0,    0, 0);
+                                ggml_metal_enc_buffer(&enc, id_src1, offs_src1,    1, 1);
+                                ggml_metal_enc_buffer(&enc, id_dst,  offs_dst,     2, -1);
+                                ggml_metal_enc_bytes(&enc, &nb01,    sizeof(nb01), 3);
+                                ggml_metal_enc_bytes(&enc, &ne20,    sizeof(ne20), 4);
+                                ggml_metal_enc_bytes(&enc, &ne22,    sizeof(ne22), 5);
+                                ggml_metal_enc_bytes(&enc, &nb21,    sizeof(nb21), 6);
+                                ggml_metal_enc_bytes(&enc, &nb22,    sizeof(nb22), 7);
+                                ggml_metal_enc_bytes(&enc, &ne12,    sizeof(ne12), 8);
+                                ggml_metal_enc_bytes(&enc, &ne13,    sizeof(ne13), 9);
+                                ggml_metal_enc_bytes(&enc, &nb10,    sizeof(nb10), 10);
+                                ggml_metal_enc_bytes(&enc, &nb11,    sizeof(nb11), 11);
+                                ggml_metal_enc_bytes(&enc, &nb12,    sizeof(nb12), 12);
+                                ggml_metal_enc_bytes(&enc, &ne0,     sizeof(ne0),  13);
+                                ggml_metal_enc_bytes(&enc, &_ne1,    sizeof(_ne1), 14);
+                                ggml_metal_enc_bytes(&enc, &nb1,     sizeof(nb1),  15);
+                                ggml_metal_enc_bytes(&enc, &r2,      sizeof(r2),   16);
+                                ggml_metal_enc_bytes(&enc, &r3,      sizeof(r3),   17);
+                                ggml_metal_enc_bytes(&enc, &idx,     sizeof(idx),  18);
                                 // TODO: how to make this an array? read Metal docs
                                 for (int j = 0; j < n_as; ++j) {
                                     struct ggml_tensor * src_cur = dst->src[2 + j];
@@ -1759,13 +2111,13 @@ void ggml_metal_graph_compute(
                                     size_t offs_src_cur = 0;
                                     id<MTLBuffer> id_src_cur = ggml_metal_get_buffer(ctx, src_cur, &offs_src_cur);
 
-                                    [encoder setBuffer:id_src_cur offset:offs_src_cur atIndex:19 + j];
+                                    ggml_metal_enc_buffer(&enc, id_src_cur, offs_src_cur, 19 + j, 2 + j);
                                 }
 
-                                [encoder setThreadgroupMemoryLength:8192 atIndex:0];
+                                ggml_metal_enc_tg_mem(&enc, 8192, 0);
 
                                 // TODO: processing one row at a time (ne11 -> 1) is not efficient
-                                [encoder dispatchThreadgroups:MTLSizeMake( (_ne1 + 31)/32, (ne21 + 63)/64, ne01*ne12*ne13) threadsPerThreadgroup:MTLSizeMake(128, 1, 1)];
+                                ggml_metal_enc_dispatch(&enc, MTLSizeMake( (_ne1 + 31)/32, (ne21 + 63)/64, ne01*ne12*ne13), MTLSizeMake(128, 1, 1));
                             } else {
                                 int nth0 = 32;
                                 int nth1 = 1;
@@ -1777,74 +2129,74 @@ void ggml_metal_graph_compute(
                                     case GGML_TYPE_F32:
                                         {
                                             GGML_ASSERT(src1t == GGML_TYPE_F32);
-                                            [encoder setComputePipelineState:ctx->pipeline_mul_mv_id_f32_f32];
+                                            ggml_metal_enc_pipeline(&enc, ctx->pipeline_mul_mv_id_f32_f32);
                                         } break;
                                     case GGML_TYPE_F16:
                                         {
                                             GGML_ASSERT(src1t == GGML_TYPE_F32);
                                             nth0 = 32;
                                             nth1 = 1;
-                                            [encoder setComputePipelineState:ctx->pipeline_mul_mv_id_f16_f32];
+                                            ggml_metal_enc_pipeline(&enc, ctx->pipeline_mul_mv_id_f16_f32);
                                         } break;
                                     case GGML_TYPE_Q4_0:
                                         {
                                             nth0 = 8;
                                             nth1 = 8;
-                                            [encoder setComputePipelineState:ctx->pipeline_mul_mv_id_q4_0_f32];
+                                            ggml_metal_enc_pipeline(&enc, ctx->pipeline_mul_mv_id_q4_0_f32);
                                         } break;
                                     case GGML_TYPE_Q4_1:
                                         {
                                             nth0 = 8;
                                             nth1 = 8;
-                                            [encoder setComputePipelineState:ctx->pipeline_mul_mv_id_q4_1_f32];
+                                            ggml_metal_enc_pipeline(&enc, ctx->pipeline_mul_mv_id_q4_1_f32);
                                         } break;
                                     case GGML_TYPE_Q5_0:
                                         {
                                             nth0 = 8;
                                             nth1 = 8;
-                                            [encoder setComputePipelineState:ctx->pipeline_mul_mv_id_q5_0_f32];
+                                            ggml_metal_enc_pipeline(&enc, ctx->pipeline_mul_mv_id_q5_0_f32);
                                         } break;
                                     case GGML_TYPE_Q5_1:
                                         {
                                             nth0 = 8;
                                             nth1 = 8;
-                                            [encoder setComputePipelineState:ctx->pipeline_mul_mv_id_q5_1_f32];
+                                            ggml_metal_enc_pipeline(&enc, ctx->pipeline_mul_mv_id_q5_1_f32);
                                         } break;
                                     case GGML_TYPE_Q8_0:
                                         {
                                             nth0 = 8;
                                             nth1 = 8;
-                                            [encoder setComputePipelineState:ctx->pipeline_mul_mv_id_q8_0_f32];
+                                            ggml_metal_enc_pipeline(&enc, ctx->pipeline_mul_mv_id_q8_0_f32);
                                         } break;
                                     case GGML_TYPE_Q2_K:
                                         {
                                             nth0 = 2;
                                             nth1 = 32;
-                                            [encoder setComputePipelineState:ctx->pipeline_mul_mv_id_q2_K_f32];
+                                            ggml_metal_enc_pipeline(&enc, ctx->pipeline_mul_mv_id_q2_K_f32);
                                         } break;
                                     case GGML_TYPE_Q3_K:
                                         {
                                             nth0 = 2;
                                             nth1 = 32;
-                                            [encoder setComputePipelineState:ctx->pipeline_mul_mv_id_q3_K_f32];
+                                            ggml_metal_enc_pipeline(&enc, ctx->pipeline_mul_mv_id_q3_K_f32);
                                         } break;
                                     case GGML_TYPE_Q4_K:
                                         {
                                             nth0 = 4; //1;
                                             nth1 = 8; //32;
-                                            [encoder setComputePipelineState:ctx->pipeline_mul_mv_id_q4_K_f32];
+                                            ggml_metal_enc_pipeline(&enc, ctx->pipeline_mul_mv_id_q4_K_f32);
                                         } break;
                                     case GGML_TYPE_Q5_K:
                                         {
                                             nth0 = 2;
                                             nth1 = 32;
-                                            [encoder setComputePipelineState:ctx->pipeline_mul_mv_id_q5_K_f32];
+                                            ggml_metal_enc_pipeline(&enc, ctx->pipeline_mul_mv_id_q5_K_f32);
                                         } break;
                                     case GGML_TYPE_Q6_K:
                                         {
                                             nth0 = 2;
                                             nth1 = 32;
-                                            [encoder setComputePipelineState:ctx->pipeline_mul_mv_id_q6_K_f32];
+                                            ggml_metal_enc_pipeline(&enc, ctx->pipeline_mul_mv_id_q6_K_f32);
                                         } break;
                                     default:
                                         {
@@ -1853,29 +2205,29 @@ void ggml_metal_graph_compute(
                                         }
                                 };
 
-                                [encoder setBuffer:id_src0 offset:offs_src0 atIndex:0];
-                                [encoder setBuffer:id_src1 offset:offs_src1 atIndex:1];
-                                [encoder setBuffer:id_dst  offset:offs_dst  atIndex:2];
-                                [encoder setBytes:&nb01 length:sizeof(nb01) atIndex:3];
-                                [encoder setBytes:&ne20 length:sizeof(ne20) atIndex:4];
-                                [encoder setBytes:&ne21 length:sizeof(ne21) atIndex:5];
-                                [encoder setBytes:&ne22 length:sizeof(ne22) atIndex:6];
-                                [encoder setBytes:&nb20 length:sizeof(nb20) atIndex:7];
-                                [encoder setBytes:&nb21 length:sizeof(nb21) atIndex:8];
-                                [encoder setBytes:&nb22 length:sizeof(nb22) atIndex:9];
-                                [encoder setBytes:&ne10 length:sizeof(ne10) atIndex:10];
-                                [encoder setBytes:&_ne1 length:sizeof(_ne1) atIndex:11];
-                                [encoder setBytes:&ne12 length:sizeof(ne12) atIndex:12];
-                                [encoder setBytes:&ne13 length:sizeof(ne13) atIndex:13];
-                                [encoder setBytes:&nb10 length:sizeof(nb10) atIndex:14];
-                                [encoder setBytes:&nb11 length:sizeof(nb11) atIndex:15];
-                                [encoder setBytes:&nb12 length:sizeof(nb12) atIndex:16];
-                                [encoder setBytes:&ne0  length:sizeof(ne0)  atIndex:17];
-                                [encoder setBytes:&_ne1 length:sizeof(_ne1) atIndex:18];
-                                [encoder setBytes:&nb1  length:sizeof(nb1)  atIndex:19];
-                                [encoder setBytes:&r2   length:sizeof(r2)   atIndex:20];
-                                [encoder setBytes:&r3   length:sizeof(r3)   atIndex:21];
-                                [encoder setBytes:&idx  length:sizeof(idx)  atIndex:22];
+                                ggml_metal_enc_buffer(&enc, id_src0, offs_src0, 0, 0);
+                                ggml_metal_enc_buffer(&enc, id_src1, offs_src1, 1, 1);
+                                ggml_metal_enc_buffer(&enc, id_dst,  offs_dst,  2, -1);
+                                ggml_metal_enc_bytes(&enc, &nb01, sizeof(nb01), 3);
+                                ggml_metal_enc_bytes(&enc, &ne20, sizeof(ne20), 4);
+                                ggml_metal_enc_bytes(&enc, &ne21, sizeof(ne21), 5);
+                                ggml_metal_enc_bytes(&enc, &ne22, sizeof(ne22), 6);
+                                ggml_metal_enc_bytes(&enc, &nb20, sizeof(nb20), 7);
+                                ggml_metal_enc_bytes(&enc, &nb21, sizeof(nb21), 8);
+                                ggml_metal_enc_bytes(&enc, &nb22, sizeof(nb22), 9);
+                                ggml_metal_enc_bytes(&enc, &ne10, sizeof(ne10), 10);
+                                ggml_metal_enc_bytes(&enc, &_ne1, sizeof(_ne1), 11);
+                                ggml_metal_enc_bytes(&enc, &ne12, sizeof(ne12), 12);
+                                ggml_metal_enc_bytes(&enc, &ne13, sizeof(ne13), 13);
+                                ggml_metal_enc_bytes(&enc, &nb10, sizeof(nb10), 14);
+                                ggml_metal_enc_bytes(&enc, &nb11, sizeof(nb11), 15);
+                                ggml_metal_enc_bytes(&enc, &nb12, sizeof(nb12), 16);
+                                ggml_metal_enc_bytes(&enc, &ne0,  sizeof(ne0),  17);
+                                ggml_metal_enc_bytes(&enc, &_ne1, sizeof(_ne1), 18);
+                                ggml_metal_enc_bytes(&enc, &nb1,  sizeof(nb1),  19);
+                                ggml_metal_enc_bytes(&enc, &r2,   sizeof(r2),   20);
+                                ggml_metal_enc_bytes(&enc, &r3,   sizeof(r3),   21);
+                                ggml_metal_enc_bytes(&enc, &idx,  sizeof(idx),  22);
                                 // TODO: how to make this an array? read Metal docs
                                 for (int j = 0; j < n_as; ++j) {
                                     struct ggml_tensor * src_cur = dst->src[2 + j];
@@ -1883,66 +2235,66 @@ void ggml_metal_graph_compute(
                                     size_t offs_src_cur = 0;
                                     id<MTLBuffer> id_src_cur = ggml_metal_get_buffer(ctx, src_cur, &offs_src_cur);
 
-                                    [encoder setBuffer:id_src_cur offset:offs_src_cur atIndex:23 + j];
+                                    ggml_metal_enc_buffer(&enc, id_src_cur, offs_src_cur, 23 + j, 2 + j);
                                 }
 
                                 if (src2t == GGML_TYPE_Q4_0 || src2t == GGML_TYPE_Q4_1 ||
                                     src2t == GGML_TYPE_Q5_0 || src2t == GGML_TYPE_Q5_1 || src2t == GGML_TYPE_Q8_0 ||
                                     src2t == GGML_TYPE_Q2_K) { // || src2t == GGML_TYPE_Q4_K) {
-                                    [encoder dispatchThreadgroups:MTLSizeMake((ne21 + 7)/8, _ne1, ne01*ne12*ne13) threadsPerThreadgroup:MTLSizeMake(nth0, nth1, 1)];
+                                    ggml_metal_enc_dispatch(&enc, MTLSizeMake((ne21 + 7)/8, _ne1, ne01*ne12*ne13), MTLSizeMake(nth0, nth1, 1));
                                 }
                                 else if (src2t == GGML_TYPE_Q4_K) {
-                                    [encoder dispatchThreadgroups:MTLSizeMake((ne21 + 3)/4, _ne1, ne01*ne12*ne13) threadsPerThreadgroup:MTLSizeMake(nth0, nth1, 1)];
+                                    ggml_metal_enc_dispatch(&enc, MTLSizeMake((ne21 + 3)/4, _ne1, ne01*ne12*ne13), MTLSizeMake(nth0, nth1, 1));
                                 }
                                 else if (src2t == GGML_TYPE_Q3_K) {
 #ifdef GGML_QKK_64
-                                    [encoder dispatchThreadgroups:MTLSizeMake((ne21 + 1)/2, _ne1, ne01*ne12*ne13) threadsPerThreadgroup:MTLSizeMake(nth0, nth1, 1)];
+                                    ggml_metal_enc_dispatch(&enc, MTLSizeMake((ne21 + 1)/2, _ne1, ne01*ne12*ne13), MTLSizeMake(nth0, nth1, 1));
 #else
-                                    [encoder dispatchThreadgroups:MTLSizeMake((ne21 + 3)/4, _ne1, ne01*ne12*ne13) threadsPerThreadgroup:MTLSizeMake(nth0, nth1, 1)];
+                                    ggml_metal_enc_dispatch(&enc, MTLSizeMake((ne21 + 3)/4, _ne1, ne01*ne12*ne13), MTLSizeMake(nth0, nth1, 1));
 #endif
                                 }
                                 else if (src2t == GGML_TYPE_Q5_K) {
-                                    [encoder dispatchThreadgroups:MTLSizeMake((ne21 + 3)/4, _ne1, ne01*ne12*ne13) threadsPerThreadgroup:MTLSizeMake(nth0, nth1, 1)];
+                                    ggml_metal_enc_dispatch(&enc, MTLSizeMake((ne21 + 3)/4, _ne1, ne01*ne12*ne13), MTLSizeMake(nth0, nth1, 1));
                                 }
                                 else if (src2t == GGML_TYPE_Q6_K) {
-                                    [encoder dispatchThreadgroups:MTLSizeMake((ne21 + 1)/2, _ne1, ne01*ne12*ne13) threadsPerThreadgroup:MTLSizeMake(nth0, nth1, 1)];
+                                    ggml_metal_enc_dispatch(&enc, MTLSizeMake((ne21 + 1)/2, _ne1, ne01*ne12*ne13), MTLSizeMake(nth0, nth1, 1));
                                 } else {
                                     const int64_t ny = (_ne1 + nrows - 1)/nrows;
-                                    [encoder dispatchThreadgroups:MTLSizeMake(ne21, ny, ne01*ne12*ne13) threadsPerThreadgroup:MTLSizeMake(nth0, nth1, 1)];
+                                    ggml_metal_enc_dispatch(&enc, MTLSizeMake(ne21, ny, ne01*ne12*ne13), MTLSizeMake(nth0, nth1, 1));
                                 }
                             }
                         } break;
                     case GGML_OP_GET_ROWS:
                         {
                             switch (src0->type) {
-                                case GGML_TYPE_F32:  [encoder setComputePipelineState:ctx->pipeline_get_rows_f32];  break;
-                                case GGML_TYPE_F16:  [encoder setComputePipelineState:ctx->pipeline_get_rows_f16];  break;
-                                case GGML_TYPE_Q4_0: [encoder setComputePipelineState:ctx->pipeline_get_rows_q4_0]; break;
-                                case GGML_TYPE_Q4_1: [encoder setComputePipelineState:ctx->pipeline_get_rows_q4_1]; break;
-                                case GGML_TYPE_Q5_0: [encoder setComputePipelineState:ctx->pipeline_get_rows_q5_0]; break;
-                                case GGML_TYPE_Q5_1: [encoder setComputePipelineState:ctx->pipeline_get_rows_q5_1]; break;
-                                case GGML_TYPE_Q8_0: [encoder setComputePipelineState:ctx->pipeline_get_rows_q8_0]; break;
-                                case GGML_TYPE_Q2_K: [encoder setComputePipelineState:ctx->pipeline_get_rows_q2_K]; break;
-                                case GGML_TYPE_Q3_K: [encoder setComputePipelineState:ctx->pipeline_get_rows_q3_K]; break;
-                                case GGML_TYPE_Q4_K: [encoder setComputePipelineState:ctx->pipeline_get_rows_q4_K]; break;
-                                case GGML_TYPE_Q5_K: [encoder setComputePipelineState:ctx->pipeline_get_rows_q5_K]; break;
-                                case GGML_TYPE_Q6_K: [encoder setComputePipelineState:ctx->pipeline_get_rows_q6_K]; break;
+                                case GGML_TYPE_F32:  ggml_metal_enc_pipeline(&enc, ctx->pipeline_get_rows_f32);  break;
+                                case GGML_TYPE_F16:  ggml_metal_enc_pipeline(&enc, ctx->pipeline_get_rows_f16);  break;
+                                case GGML_TYPE_Q4_0: ggml_metal_enc_pipeline(&enc, ctx->pipeline_get_rows_q4_0); break;
+                                case GGML_TYPE_Q4_1: ggml_metal_enc_pipeline(&enc, ctx->pipeline_get_rows_q4_1); break;
+                                case GGML_TYPE_Q5_0: ggml_metal_enc_pipeline(&enc, ctx->pipeline_get_rows_q5_0); break;
+                                case GGML_TYPE_Q5_1: ggml_metal_enc_pipeline(&enc, ctx->pipeline_get_rows_q5_1); break;
+                                case GGML_TYPE_Q8_0: ggml_metal_enc_pipeline(&enc, ctx->pipeline_get_rows_q8_0); break;
+                                case GGML_TYPE_Q2_K: ggml_metal_enc_pipeline(&enc, ctx->pipeline_get_rows_q2_K); break;
+                                case GGML_TYPE_Q3_K: ggml_metal_enc_pipeline(&enc, ctx->pipeline_get_rows_q3_K); break;
+                                case GGML_TYPE_Q4_K: ggml_metal_enc_pipeline(&enc, ctx->pipeline_get_rows_q4_K); break;
+                                case GGML_TYPE_Q5_K: ggml_metal_enc_pipeline(&enc, ctx->pipeline_get_rows_q5_K); break;
+                                case GGML_TYPE_Q6_K: ggml_metal_enc_pipeline(&enc, ctx->pipeline_get_rows_q6_K); break;
                                 default: GGML_ASSERT(false && "not implemented");
                             }
 
-                            [encoder setBuffer:id_src0     offset:offs_src0 atIndex:0];
-                            [encoder setBuffer:id_src1     offset:offs_src1 atIndex:1];
-                            [encoder setBuffer:id_dst      offset:offs_dst  atIndex:2];
-                            [encoder setBytes:&ne00 length:sizeof( int64_t) atIndex:3];
-                            [encoder setBytes:&nb01 length:sizeof(uint64_t) atIndex:4];
-                            [encoder setBytes:&nb02 length:sizeof(uint64_t) atIndex:5];
-                            [encoder setBytes:&ne10 length:sizeof( int64_t) atIndex:6];
-                            [encoder setBytes:&nb10 length:sizeof( int64_t) atIndex:7];
-                            [encoder setBytes:&nb11 length:sizeof( int64_t) atIndex:8];
-                            [encoder setBytes:&nb1  length:sizeof(uint64_t) atIndex:9];
-                            [encoder setBytes:&nb2  length:sizeof(uint64_t) atIndex:10];
-
-                            [encoder dispatchThreadgroups:MTLSizeMake(ne10, ne11, 1) threadsPerThreadgroup:MTLSizeMake(32, 1, 1)];
+                            ggml_metal_enc_buffer(&enc, id_src0,     offs_src0, 0, 0);
+                            ggml_metal_enc_buffer(&enc, id_src1,     offs_src1, 1, 1);
+                            ggml_metal_enc_buffer(&enc, id_dst,      offs_dst,  2, -1);
+                            ggml_metal_enc_bytes(&enc, &ne00, sizeof( int64_t), 3);
+                            ggml_metal_enc_bytes(&enc, &nb01, sizeof(uint64_t), 4);
+                            ggml_metal_enc_bytes(&enc, &nb02, sizeof(uint64_t), 5);
+                            ggml_metal_enc_bytes(&enc, &ne10, sizeof( int64_t), 6);
+                            ggml_metal_enc_bytes(&enc, &nb10, sizeof( int64_t), 7);
+                            ggml_metal_enc_bytes(&enc, &nb11, sizeof( int64_t), 8);
+                            ggml_metal_enc_bytes(&enc, &nb1,  sizeof(uint64_t), 9);
+                            ggml_metal_enc_bytes(&enc, &nb2,  sizeof(uint64_t), 10);
+
+                            ggml_metal_enc_dispatch(&enc, MTLSizeMake(ne10, ne11, 1), MTLSizeMake(32, 1, 1));
                         } break;
                     case GGML_OP_RMS_NORM:
                         {
@@ -1957,17 +2309,17 @@ void ggml_metal_graph_compute(
                                 nth *= 2;
                             }
 
-                            [encoder setComputePipelineState:ctx->pipeline_rms_norm];
-                            [encoder setBuffer:id_src0 offset:offs_src0        atIndex:0];
-                            [encoder setBuffer:id_dst  offset:offs_dst         atIndex:1];
-                            [encoder setBytes:&ne00    length:sizeof( int64_t) atIndex:2];
-                            [encoder setBytes:&nb01    length:sizeof(uint64_t) atIndex:3];
-                            [encoder setBytes:&eps     length:sizeof(   float) atIndex:4];
-                            [encoder setThreadgroupMemoryLength:32*sizeof(float) atIndex:0];
+                            ggml_metal_enc_pipeline(&enc, ctx->pipeline_rms_norm);
+                            ggml_metal_enc_buffer(&enc, id_src0, offs_src0,        0, 0);
+                            ggml_metal_enc_buffer(&enc, id_dst,  offs_dst,         1, -1);
+                            ggml_metal_enc_bytes(&enc, &ne00,    sizeof( int64_t), 2);
+                            ggml_metal_enc_bytes(&enc, &nb01,    sizeof(uint64_t), 3);
+                            ggml_metal_enc_bytes(&enc, &eps,     sizeof(   float), 4);
+                            ggml_metal_enc_tg_mem(&enc, 32*sizeof(float), 0);
 
                             const int64_t nrows = ggml_nrows(src0);
 
-                            [encoder dispatchThreadgroups:MTLSizeMake(nrows, 1, 1) threadsPerThreadgroup:MTLSizeMake(nth, 1, 1)];
+                            ggml_metal_enc_dispatch(&enc, MTLSizeMake(nrows, 1, 1), MTLSizeMake(nth, 1, 1));
                         } break;
                     case GGML_OP_GROUP_NORM:
                         {
@@ -1986,20 +2338,20 @@ void ggml_metal_graph_compute(
                             //    nth *= 2;
                             //}
 
-                            [encoder setComputePipelineState:ctx->pipeline_group_norm];
-                            [encoder setBuffer:id_src0  offset:offs_src0        atIndex:0];
-                            [encoder setBuffer:id_dst   offset:offs_dst         atIndex:1];
-                            [encoder setBytes:&ne00     length:sizeof( int64_t) atIndex:2];
-                            [encoder setBytes:&ne01     length:sizeof( int64_t) atIndex:3];
-                            [encoder setBytes:&ne02     length:sizeof( int64_t) atIndex:4];
-                            [encoder setBytes:&nb00     length:sizeof(uint64_t) atIndex:5];
-                            [encoder setBytes:&nb01     length:sizeof(uint64_t) atIndex:6];
-                            [encoder setBytes:&nb02     length:sizeof(uint64_t) atIndex:7];
-                            [encoder setBytes:&n_groups length:sizeof( int32_t) atIndex:8];
-                            [encoder setBytes:&eps      length:sizeof(   float) atIndex:9];
-                            [encoder setThreadgroupMemoryLength:32*sizeof(float) atIndex:0];
-
-                            [encoder dispatchThreadgroups:MTLSizeMake(n_groups, 1, 1) threadsPerThreadgroup:MTLSizeMake(nth, 1, 1)];
+                            ggml_metal_enc_pipeline(&enc, ctx->pipeline_group_norm);
+                            ggml_metal_enc_buffer(&enc, id_src0,  offs_src0,        0, 0);
+                            ggml_metal_enc_buffer(&enc, id_dst,   offs_dst,         1, -1);
+                            ggml_metal_enc_bytes(&enc, &ne00,     sizeof( int64_t), 2);
+                            ggml_metal_enc_bytes(&enc, &ne01,     sizeof( int64_t), 3);
+                            ggml_metal_enc_bytes(&enc, &ne02,     sizeof( int64_t), 4);
+                            ggml_metal_enc_bytes(&enc, &nb00,     sizeof(uint64_t), 5);
+                            ggml_metal_enc_bytes(&enc, &nb01,     sizeof(uint64_t), 6);
+                            ggml_metal_enc_bytes(&enc, &nb02,     sizeof(uint64_t), 7);
+                            ggml_metal_enc_bytes(&enc, &n_groups, sizeof( int32_t), 8);
+                            ggml_metal_enc_bytes(&enc, &eps,      sizeof(   float), 9);
+                            ggml_metal_enc_tg_mem(&enc, 32*sizeof(float), 0);
+
+                            ggml_metal_enc_dispatch(&enc, MTLSizeMake(n_groups, 1, 1), MTLSizeMake(nth, 1, 1));
                         } break;
                     case GGML_OP_NORM:
                         {
@@ -2008,17 +2360,17 @@ void ggml_metal_graph_compute(
 
                             const int nth = MIN(256, ne00);
 
-                            [encoder setComputePipelineState:ctx->pipeline_norm];
-                            [encoder setBuffer:id_src0 offset:offs_src0        atIndex:0];
-                            [encoder setBuffer:id_dst  offset:offs_dst         atIndex:1];
-                            [encoder setBytes:&ne00    length:sizeof( int64_t) atIndex:2];
-                            [encoder setBytes:&nb01    length:sizeof(uint64_t) atIndex:3];
-                            [encoder setBytes:&eps     length:sizeof(   float) atIndex:4];
-                            [encoder setThreadgroupMemoryLength:GGML_PAD(nth*sizeof(float), 16) atIndex:0];
+                            ggml_metal_enc_pipeline(&enc, ctx->pipeline_norm);
+                            ggml_metal_enc_buffer(&enc, id_src0, offs_src0,        0, 0);
+                            ggml_metal_enc_buffer(&enc, id_dst,  offs_dst,         1, -1);
+                            ggml_metal_enc_bytes(&enc, &ne00,    sizeof( int64_t), 2);
+                            ggml_metal_enc_bytes(&enc, &nb01,    sizeof(uint64_t), 3);
+                            ggml_metal_enc_bytes(&enc, &eps,     sizeof(   float), 4);
+                            ggml_metal_enc_tg_mem(&enc, GGML_PAD(nth*sizeof(float), 16), 0);
 
                             const int64_t nrows = ggml_nrows(src0);
 
-                            [encoder dispatchThreadgroups:MTLSizeMake(nrows, 1, 1) threadsPerThreadgroup:MTLSizeMake(nth, 1, 1)];
+                            ggml_metal_enc_dispatch(&enc, MTLSizeMake(nrows, 1, 1), MTLSizeMake(nth, 1, 1));
                         } break;
                     case GGML_OP_ALIBI:
                         {
@@ -2035,30 +2387,30 @@ void ggml_metal_graph_compute(
                             const float m0 = powf(2.0f, -(max_bias) / n_heads_log2_floor);
                             const float m1 = powf(2.0f, -(max_bias / 2.0f) / n_heads_log2_floor);
 
-                            [encoder setComputePipelineState:ctx->pipeline_alibi_f32];
-                            [encoder setBuffer:id_src0 offset:offs_src0 atIndex:0];
-                            [encoder setBuffer:id_dst  offset:offs_dst  atIndex:1];
-                            [encoder setBytes:&ne00 length:sizeof( int64_t) atIndex:2];
-                            [encoder setBytes:&ne01 length:sizeof( int64_t) atIndex:3];
-                            [encoder setBytes:&ne02 length:sizeof( int64_t) atIndex:4];
-                            [encoder setBytes:&ne03 length:sizeof( int64_t) atIndex:5];
-                            [encoder setBytes:&nb00 length:sizeof(uint64_t) atIndex:6];
-                            [encoder setBytes:&nb01 length:sizeof(uint64_t) atIndex:7];
-                            [encoder setBytes:&nb02 length:sizeof(uint64_t) atIndex:8];
-                            [encoder setBytes:&nb03 length:sizeof(uint64_t) atIndex:9];
-                            [encoder setBytes:&ne0  length:sizeof( int64_t) atIndex:10];
-                            [encoder setBytes:&ne1  length:sizeof( int64_t) atIndex:11];
-                            [encoder setBytes:&ne2  length:sizeof( int64_t) atIndex:12];
-                            [encoder setBytes:&ne3  length:sizeof( int64_t) atIndex:13];
-                            [encoder setBytes:&nb0  length:sizeof(uint64_t) atIndex:14];
-                            [encoder setBytes:&nb1  length:sizeof(uint64_t) atIndex:15];
-                            [encoder setBytes:&nb2  length:sizeof(uint64_t) atIndex:16];
-                            [encoder setBytes:&nb3  length:sizeof(uint64_t) atIndex:17];
-                            [encoder setBytes:&m0   length:sizeof(   float) atIndex:18];
-                            [encoder setBytes:&m1   length:sizeof(   float) atIndex:19];
-                            [encoder setBytes:&n_heads_log2_floor   length:sizeof(int) atIndex:20];
-
-                            [encoder dispatchThreadgroups:MTLSizeMake(ne01, ne02, ne03) threadsPerThreadgroup:MTLSizeMake(nth, 1, 1)];
+                            ggml_metal_enc_pipeline(&enc, ctx->pipeline_alibi_f32);
+                            ggml_metal_enc_buffer(&enc, id_src0, offs_src0, 0, 0);
+                            ggml_metal_enc_buffer(&enc, id_dst,  offs_dst,  1, -1);
+                            ggml_metal_enc_bytes(&enc, &ne00, sizeof( int64_t), 2);
+                            ggml_metal_enc_bytes(&enc, &ne01, sizeof( int64_t), 3);
+                            ggml_metal_enc_bytes(&enc, &ne02, sizeof( int64_t), 4);
+                            ggml_metal_enc_bytes(&enc, &ne03, sizeof( int64_t), 5);
+                            ggml_metal_enc_bytes(&enc, &nb00, sizeof(uint64_t), 6);
+                            ggml_metal_enc_bytes(&enc, &nb01, sizeof(uint64_t), 7);
+                            ggml_metal_enc_bytes(&enc, &nb02, sizeof(uint64_t), 8);
+                            ggml_metal_enc_bytes(&enc, &nb03, sizeof(uint64_t), 9);
+                            ggml_metal_enc_bytes(&enc, &ne0,  sizeof( int64_t), 10);
+                            ggml_metal_enc_bytes(&enc, &ne1,  sizeof( int64_t), 11);
+                            ggml_metal_enc_bytes(&enc, &ne2,  sizeof( int64_t), 12);
+                            ggml_metal_enc_bytes(&enc, &ne3,  sizeof( int64_t), 13);
+                            ggml_metal_enc_bytes(&enc, &nb0,  sizeof(uint64_t), 14);
+                            ggml_metal_enc_bytes(&enc, &nb1,  sizeof(uint64_t), 15);
+                            ggml_metal_enc_bytes(&enc, &nb2,  sizeof(uint64_t), 16);
+                            ggml_metal_enc_bytes(&enc, &nb3,  sizeof(uint64_t), 17);
+                            ggml_metal_enc_bytes(&enc, &m0,   sizeof(   float), 18);
+                            ggml_metal_enc_bytes(&enc, &m1,   sizeof(   float), 19);
+                            ggml_metal_enc_bytes(&enc, &n_heads_log2_floor,   sizeof(int), 20);
+
+                            ggml_metal_enc_dispatch(&enc, MTLSizeMake(ne01, ne02, ne03), MTLSizeMake(nth, 1, 1));
                         } break;
                     case GGML_OP_ROPE:
                         {
@@ -2081,42 +2433,42 @@ void ggml_metal_graph_compute(
                             memcpy(&beta_slow,   (int32_t *) dst->op_params + 10, sizeof(float));
 
                             switch (src0->type) {
-                                case GGML_TYPE_F32: [encoder setComputePipelineState:ctx->pipeline_rope_f32]; break;
-                                case GGML_TYPE_F16: [encoder setComputePipelineState:ctx->pipeline_rope_f16]; break;
+                                case GGML_TYPE_F32: ggml_metal_enc_pipeline(&enc, ctx->pipeline_rope_f32); break;
+                                case GGML_TYPE_F16: ggml_metal_enc_pipeline(&enc, ctx->pipeline_rope_f16); break;
                                 default: GGML_ASSERT(false);
                             };
 
-                            [encoder setBuffer:id_src0     offset:offs_src0        atIndex:0];
-                            [encoder setBuffer:id_src1     offset:offs_src1        atIndex:1];
-                            [encoder setBuffer:id_dst      offset:offs_dst         atIndex:2];
-                            [encoder setBytes:&ne00        length:sizeof( int64_t) atIndex:3];
-                            [encoder setBytes:&ne01        length:sizeof( int64_t) atIndex:4];
-                            [encoder setBytes:&ne02        length:sizeof( int64_t) atIndex:5];
-                            [encoder setBytes:&ne03        length:sizeof( int64_t) atIndex:6];
-                            [encoder setBytes:&nb00        length:sizeof(uint64_t) atIndex:7];
-                            [encoder setBytes:&nb01        length:sizeof(uint64_t) atIndex:8];
-                            [encoder setBytes:&nb02        length:sizeof(uint64_t) atIndex:9];
-                            [encoder setBytes:&nb03        length:sizeof(uint64_t) atIndex:10];
-                            [encoder setBytes:&ne0         length:sizeof( int64_t) atIndex:11];
-                            [encoder setBytes:&ne1         length:sizeof( int64_t) atIndex:12];
-                            [encoder setBytes:&ne2         length:sizeof( int64_t) atIndex:13];
-                            [encoder setBytes:&ne3         length:sizeof( int64_t) atIndex:14];
-                            [encoder setBytes:&nb0         length:sizeof(uint64_t) atIndex:15];
-                            [encoder setBytes:&nb1         length:sizeof(uint64_t) atIndex:16];
-                            [encoder setBytes:&nb2         length:sizeof(uint64_t) atIndex:17];
-                            [encoder setBytes:&nb3         length:sizeof(uint64_t) atIndex:18];
-                            [encoder setBytes:&n_past      length:sizeof(     int) atIndex:19];
-                            [encoder setBytes:&n_dims      length:sizeof(     int) atIndex:20];
-                            [encoder setBytes:&mode        length:sizeof(     int) atIndex:21];
-                            [encoder setBytes:&n_orig_ctx  length:sizeof(     int) atIndex:22];
-                            [encoder setBytes:&freq_base   length:sizeof(   float) atIndex:23];
-                            [encoder setBytes:&freq_scale  length:sizeof(   float) atIndex:24];
-                            [encoder setBytes:&ext_factor  length:sizeof(   float) atIndex:25];
-                            [encoder setBytes:&attn_factor length:sizeof(   float) atIndex:26];
-                            [encoder setBytes:&beta_fast   length:sizeof(   float) atIndex:27];
-                            [encoder setBytes:&beta_slow   length:sizeof(   float) atIndex:28];
-
-                            [encoder dispatchThreadgroups:MTLSizeMake(ne01, ne02, ne03) threadsPerThreadgroup:MTLSizeMake(nth, 1, 1)];
+                            ggml_metal_enc_buffer(&enc, id_src0,     offs_src0,        0, 0);
+                            ggml_metal_enc_buffer(&enc, id_src1,     offs_src1,        1, 1);
+                            ggml_metal_enc_buffer(&enc, id_dst,      offs_dst,         2, -1);
+                            ggml_metal_enc_bytes(&enc, &ne00,        sizeof( int64_t), 3);
+                            ggml_metal_enc_bytes(&enc, &ne01,        sizeof( int64_t), 4);
+                            ggml_metal_enc_bytes(&enc, &ne02,        sizeof( int64_t), 5);
+                            ggml_metal_enc_bytes(&enc, &ne03,        sizeof( int64_t), 6);
+                            ggml_metal_enc_bytes(&enc, &nb00,        sizeof(uint64_t), 7);
+                            ggml_metal_enc_bytes(&enc, &nb01,        sizeof(uint64_t), 8);
+                            ggml_metal_enc_bytes(&enc, &nb02,        sizeof(uint64_t), 9);
+                            ggml_metal_enc_bytes(&enc, &nb03,        sizeof(uint64_t), 10);
+                            ggml_metal_enc_bytes(&enc, &ne0,         sizeof( int64_t), 11);
+                            ggml_metal_enc_bytes(&enc, &ne1,         sizeof( int64_t), 12);
+                            ggml_metal_enc_bytes(&enc, &ne2,         sizeof( int64_t), 13);
+                            ggml_metal_enc_bytes(&enc, &ne3,         sizeof( int64_t), 14);
+                            ggml_metal_enc_bytes(&enc, &nb0,         sizeof(uint64_t), 15);
+                            ggml_metal_enc_bytes(&enc, &nb1,         sizeof(uint64_t), 16);
+                            ggml_metal_enc_bytes(&enc, &nb2,         sizeof(uint64_t), 17);
+                            ggml_metal_enc_bytes(&enc, &nb3,         sizeof(uint64_t), 18);
+                            ggml_metal_enc_bytes(&enc, &n_past,      sizeof(     int), 19);
+                            ggml_metal_enc_bytes(&enc, &n_dims,      sizeof(     int), 20);
+                            ggml_metal_enc_bytes(&enc, &mode,        sizeof(     int), 21);
+                            ggml_metal_enc_bytes(&enc, &n_orig_ctx,  sizeof(     int), 22);
+                            ggml_metal_enc_bytes(&enc, &freq_base,   sizeof(   float), 23);
+                            ggml_metal_enc_bytes(&enc, &freq_scale,  sizeof(   float), 24);
+                            ggml_metal_enc_bytes(&enc, &ext_factor,  sizeof(   float), 25);
+                            ggml_metal_enc_bytes(&enc, &attn_factor, sizeof(   float), 26);
+                            ggml_metal_enc_bytes(&enc, &beta_fast,   sizeof(   float), 27);
+                            ggml_metal_enc_bytes(&enc, &beta_slow,   sizeof(   float), 28);
+
+                            ggml_metal_enc_dispatch(&enc, MTLSizeMake(ne01, ne02, ne03), MTLSizeMake(nth, 1, 1));
                         } break;
                     case GGML_OP_IM2COL:
                         {
@@ -2150,25 +2502,25 @@ void ggml_metal_graph_compute(
 
                             switch (src0->type) {
                                 case GGML_TYPE_F32: GGML_ASSERT(false && "not implemented"); break;
-                                case GGML_TYPE_F16: [encoder setComputePipelineState:ctx->pipeline_im2col_f16]; break;
+                                case GGML_TYPE_F16: ggml_metal_enc_pipeline(&enc, ctx->pipeline_im2col_f16); break;
                                 default: GGML_ASSERT(false);
                             };
 
-                            [encoder setBuffer:id_src1 offset:offs_src1        atIndex:0];
-                            [encoder setBuffer:id_dst  offset:offs_dst         atIndex:1];
-                            [encoder setBytes:&ofs0    length:sizeof( int32_t) atIndex:2];
-                            [encoder setBytes:&ofs1    length:sizeof( int32_t) atIndex:3];
-                            [encoder setBytes:&IW      length:sizeof( int32_t) atIndex:4];
-                            [encoder setBytes:&IH      length:sizeof( int32_t) atIndex:5];
-                            [encoder setBytes:&CHW     length:sizeof( int32_t) atIndex:6];
-                            [encoder setBytes:&s0      length:sizeof( int32_t) atIndex:7];
-                            [encoder setBytes:&s1      length:sizeof( int32_t) atIndex:8];
-                            [encoder setBytes:&p0      length:sizeof( int32_t) atIndex:9];
-                            [encoder setBytes:&p1      length:sizeof( int32_t) atIndex:10];
-                            [encoder setBytes:&d0      length:sizeof( int32_t) atIndex:11];
-                            [encoder setBytes:&d1      length:sizeof( int32_t) atIndex:12];
-
-                            [encoder dispatchThreadgroups:MTLSizeMake(IC, OH, OW) threadsPerThreadgroup:MTLSizeMake(N, KH, KW)];
+                            ggml_metal_enc_buffer(&enc, id_src1, offs_src1,        0, 1);
+                            ggml_metal_enc_buffer(&enc, id_dst,  offs_dst,         1, -1);
+                            ggml_metal_enc_bytes(&enc, &ofs0,    sizeof( int32_t), 2);
+                            ggml_metal_enc_bytes(&enc, &ofs1,    sizeof( int32_t), 3);
+                            ggml_metal_enc_bytes(&enc, &IW,      sizeof( int32_t), 4);
+                            ggml_metal_enc_bytes(&enc, &IH,      sizeof( int32_t), 5);
+                            ggml_metal_enc_bytes(&enc, &CHW,     sizeof( int32_t), 6);
+                            ggml_metal_enc_bytes(&enc, &s0,      sizeof( int32_t), 7);
+                            ggml_metal_enc_bytes(&enc, &s1,      sizeof( int32_t), 8);
+                            ggml_metal_enc_bytes(&enc, &p0,      sizeof( int32_t), 9);
+                            ggml_metal_enc_bytes(&enc, &p1,      sizeof( int32_t), 10);
+                            ggml_metal_enc_bytes(&enc, &d0,      sizeof( int32_t), 11);
+                            ggml_metal_enc_bytes(&enc, &d1,      sizeof( int32_t), 12);
+
+                            ggml_metal_enc_dispatch(&enc, MTLSizeMake(IC, OH, OW), MTLSizeMake(N, KH, KW));
                         } break;
                     case GGML_OP_UPSCALE:
                         {
@@ -2176,58 +2528,58 @@ void ggml_metal_graph_compute(
 
                             const int sf = dst->op_params[0];
 
-                            [encoder setComputePipelineState:ctx->pipeline_upscale_f32];
-                            [encoder setBuffer:id_src0 offset:offs_src0 atIndex:0];
-                            [encoder setBuffer:id_dst  offset:offs_dst  atIndex:1];
-                            [encoder setBytes:&ne00 length:sizeof(ne00) atIndex:2];
-                            [encoder setBytes:&ne01 length:sizeof(ne01) atIndex:3];
-                            [encoder setBytes:&ne02 length:sizeof(ne02) atIndex:4];
-                            [encoder setBytes:&ne03 length:sizeof(ne03) atIndex:5];
-                            [encoder setBytes:&nb00 length:sizeof(nb00) atIndex:6];
-                            [encoder setBytes:&nb01 length:sizeof(nb01) atIndex:7];
-                            [encoder setBytes:&nb02 length:sizeof(nb02) atIndex:8];
-                            [encoder setBytes:&nb03 length:sizeof(nb03) atIndex:9];
-                            [encoder setBytes:&ne0  length:sizeof(ne0)  atIndex:10];
-                            [encoder setBytes:&ne1  length:sizeof(ne1)  atIndex:11];
-                            [encoder setBytes:&ne2  length:sizeof(ne2)  atIndex:12];
-                            [encoder setBytes:&ne3  length:sizeof(ne3)  atIndex:13];
-                            [encoder setBytes:&nb0  length:sizeof(nb0)  atIndex:14];
-                            [encoder setBytes:&nb1  length:sizeof(nb1)  atIndex:15];
-                            [encoder setBytes:&nb2  length:sizeof(nb2)  atIndex:16];
-                            [encoder setBytes:&nb3  length:sizeof(nb3)  atIndex:17];
-                            [encoder setBytes:&sf   length:sizeof(sf)   atIndex:18];
+                            ggml_metal_enc_pipeline(&enc, ctx->pipeline_upscale_f32);
+                            ggml_metal_enc_buffer(&enc, id_src0, offs_src0, 0, 0);
+                            ggml_metal_enc_buffer(&enc, id_dst,  offs_dst,  1, -1);
+                            ggml_metal_enc_bytes(&enc, &ne00, sizeof(ne00), 2);
+                            ggml_metal_enc_bytes(&enc, &ne01, sizeof(ne01), 3);
+                            ggml_metal_enc_bytes(&enc, &ne02, sizeof(ne02), 4);
+                            ggml_metal_enc_bytes(&enc, &ne03, sizeof(ne03), 5);
+                            ggml_metal_enc_bytes(&enc, &nb00, sizeof(nb00), 6);
+                            ggml_metal_enc_bytes(&enc, &nb01, sizeof(nb01), 7);
+                            ggml_metal_enc_bytes(&enc, &nb02, sizeof(nb02), 8);
+                            ggml_metal_enc_bytes(&enc, &nb03, sizeof(nb03), 9);
+                            ggml_metal_enc_bytes(&enc, &ne0,  sizeof(ne0),  10);
+                            ggml_metal_enc_bytes(&enc, &ne1,  sizeof(ne1),  11);
+                            ggml_metal_enc_bytes(&enc, &ne2,  sizeof(ne2),  12);
+                            ggml_metal_enc_bytes(&enc, &ne3,  sizeof(ne3),  13);
+                            ggml_metal_enc_bytes(&enc, &nb0,  sizeof(nb0),  14);
+                            ggml_metal_enc_bytes(&enc, &nb1,  sizeof(nb1),  15);
+                            ggml_metal_enc_bytes(&enc, &nb2,  sizeof(nb2),  16);
+                            ggml_metal_enc_bytes(&enc, &nb3,  sizeof(nb3),  17);
+                            ggml_metal_enc_bytes(&enc, &sf,   sizeof(sf),   18);
 
                             const int nth = MIN(1024, ne0);
 
-                            [encoder dispatchThreadgroups:MTLSizeMake(ne1, ne2, ne3) threadsPerThreadgroup:MTLSizeMake(nth, 1, 1)];
+                            ggml_metal_enc_dispatch(&enc, MTLSizeMake(ne1, ne2, ne3), MTLSizeMake(nth, 1, 1));
                         } break;
                     case GGML_OP_PAD:
                         {
                             GGML_ASSERT(src0->type == GGML_TYPE_F32);
 
-                            [encoder setComputePipelineState:ctx->pipeline_pad_f32];
-                            [encoder setBuffer:id_src0 offset:offs_src0 atIndex:0];
-                            [encoder setBuffer:id_dst  offset:offs_dst  atIndex:1];
-                            [encoder setBytes:&ne00 length:sizeof(ne00) atIndex:2];
-                            [encoder setBytes:&ne01 length:sizeof(ne01) atIndex:3];
-                            [encoder setBytes:&ne02 length:sizeof(ne02) atIndex:4];
-                            [encoder setBytes:&ne03 length:sizeof(ne03) atIndex:5];
-                            [encoder setBytes:&nb00 length:sizeof(nb00) atIndex:6];
-                            [encoder setBytes:&nb01 length:sizeof(nb01) atIndex:7];
-                            [encoder setBytes:&nb02 length:sizeof(nb02) atIndex:8];
-                            [encoder setBytes:&nb03 length:sizeof(nb03) atIndex:9];
-                            [encoder setBytes:&ne0  length:sizeof(ne0)  atIndex:10];
-                            [encoder setBytes:&ne1  length:sizeof(ne1)  atIndex:11];
-                            [encoder setBytes:&ne2  length:sizeof(ne2)  atIndex:12];
-                            [encoder setBytes:&ne3  length:sizeof(ne3)  atIndex:13];
-                            [encoder setBytes:&nb0  length:sizeof(nb0)  atIndex:14];
-                            [encoder setBytes:&nb1  length:sizeof(nb1)  atIndex:15];
-                            [encoder setBytes:&nb2  length:sizeof(nb2)  atIndex:16];
-                            [encoder setBytes:&nb3  length:sizeof(nb3)  atIndex:17];
+                            ggml_metal_enc_pipeline(&enc, ctx->pipeline_pad_f32);
+                            ggml_metal_enc_buffer(&enc, id_src0, offs_src0, 0, 0);
+                            ggml_metal_enc_buffer(&enc, id_dst,  offs_dst,  1, -1);
+                            ggml_metal_enc_bytes(&enc, &ne00, sizeof(ne00), 2);
+                            ggml_metal_enc_bytes(&enc, &ne01, sizeof(ne01), 3);
+                            ggml_metal_enc_bytes(&enc, &ne02, sizeof(ne02), 4);
+                            ggml_metal_enc_bytes(&enc, &ne03, sizeof(ne03), 5);
+                            ggml_metal_enc_bytes(&enc, &nb00, sizeof(nb00), 6);
+                            ggml_metal_enc_bytes(&enc, &nb01, sizeof(nb01), 7);
+                            ggml_metal_enc_bytes(&enc, &nb02, sizeof(nb02), 8);
+                            ggml_metal_enc_bytes(&enc, &nb03, sizeof(nb03), 9);
+                            ggml_metal_enc_bytes(&enc, &ne0,  sizeof(ne0),  10);
+                            ggml_metal_enc_bytes(&enc, &ne1,  sizeof(ne1),  11);
+                            ggml_metal_enc_bytes(&enc, &ne2,  sizeof(ne2),  12);
+                            ggml_metal_enc_bytes(&enc, &ne3,  sizeof(ne3),  13);
+                            ggml_metal_enc_bytes(&enc, &nb0,  sizeof(nb0),  14);
+                            ggml_metal_enc_bytes(&enc, &nb1,  sizeof(nb1),  15);
+                            ggml_metal_enc_bytes(&enc, &nb2,  sizeof(nb2),  16);
+                            ggml_metal_enc_bytes(&enc, &nb3,  sizeof(nb3),  17);
 
                             const int nth = MIN(1024, ne0);
 
-                            [encoder dispatchThreadgroups:MTLSizeMake(ne1, ne2, ne3) threadsPerThreadgroup:MTLSizeMake(nth, 1, 1)];
+                            ggml_metal_enc_dispatch(&enc, MTLSizeMake(ne1, ne2, ne3), MTLSizeMake(nth, 1, 1));
                         } break;
                     case GGML_OP_ARGSORT:
                         {
@@ -2239,16 +2591,16 @@ void ggml_metal_graph_compute(
                             enum ggml_sort_order order = (enum ggml_sort_order) dst->op_params[0];
 
                             switch (order) {
-                                case GGML_SORT_ASC:  [encoder setComputePipelineState:ctx->pipeline_argsort_f32_i32_asc];  break;
-                                case GGML_SORT_DESC: [encoder setComputePipelineState:ctx->pipeline_argsort_f32_i32_desc]; break;
+                                case GGML_SORT_ASC:  ggml_metal_enc_pipeline(&enc, ctx->pipeline_argsort_f32_i32_asc);  break;
+                                case GGML_SORT_DESC: ggml_metal_enc_pipeline(&enc, ctx->pipeline_argsort_f32_i32_desc); break;
                                 default: GGML_ASSERT(false);
                             };
 
-                            [encoder setBuffer:id_src0 offset:offs_src0        atIndex:0];
-                            [encoder setBuffer:id_dst  offset:offs_dst         atIndex:1];
-                            [encoder setBytes:&ne00    length:sizeof( int64_t) atIndex:2];
+                            ggml_metal_enc_buffer(&enc, id_src0, offs_src0,        0, 0);
+                            ggml_metal_enc_buffer(&enc, id_dst,  offs_dst,         1, -1);
+                            ggml_metal_enc_bytes(&enc, &ne00,    sizeof( int64_t), 2);
 
-                            [encoder dispatchThreadgroups:MTLSizeMake(1, nrows, 1) threadsPerThreadgroup:MTLSizeMake(ne00, 1, 1)];
+                            ggml_metal_enc_dispatch(&enc, MTLSizeMake(1, nrows, 1), MTLSizeMake(ne00, 1, 1));
                         } break;
                     case GGML_OP_LEAKY_RELU:
                         {
@@ -2257,14 +2609,14 @@ void ggml_metal_graph_compute(
                             float slope;
                             memcpy(&slope, dst->op_params, sizeof(float));
 
-                            [encoder setComputePipelineState:ctx->pipeline_leaky_relu_f32];
-                            [encoder setBuffer:id_src0 offset:offs_src0   atIndex:0];
-                            [encoder setBuffer:id_dst  offset:offs_dst    atIndex:1];
-                            [encoder setBytes:&slope length:sizeof(slope) atIndex:2];
+                            ggml_metal_enc_pipeline(&enc, ctx->pipeline_leaky_relu_f32);
+                            ggml_metal_enc_buffer(&enc, id_src0, offs_src0,   0, 0);
+                            ggml_metal_enc_buffer(&enc, id_dst,  offs_dst,    1, -1);
+                            ggml_metal_enc_bytes(&enc, &slope, sizeof(slope), 2);
 
                             const int64_t n = ggml_nelements(dst);
 
-                            [encoder dispatchThreadgroups:MTLSizeMake(n, 1, 1) threadsPerThreadgroup:MTLSizeMake(1, 1, 1)];
+                            ggml_metal_enc_dispatch(&enc, MTLSizeMake(n, 1, 1), MTLSizeMake(1, 1, 1));
                         } break;
                     case GGML_OP_DUP:
                     case GGML_OP_CPY:
@@ -2280,47 +2632,47 @@ void ggml_metal_graph_compute(
                                         GGML_ASSERT(ne0 % ggml_blck_size(dst->type) == 0);
 
                                         switch (dstt) {
-                                            case GGML_TYPE_F16:  [encoder setComputePipelineState:ctx->pipeline_cpy_f32_f16];  break;
-                                            case GGML_TYPE_F32:  [encoder setComputePipelineState:ctx->pipeline_cpy_f32_f32];  break;
-                                            case GGML_TYPE_Q8_0: [encoder setComputePipelineState:ctx->pipeline_cpy_f32_q8_0]; break;
-                                            case GGML_TYPE_Q4_0: [encoder setComputePipelineState:ctx->pipeline_cpy_f32_q4_0]; break;
-                                            case GGML_TYPE_Q4_1: [encoder setComputePipelineState:ctx->pipeline_cpy_f32_q4_1]; break;
-                                            //case GGML_TYPE_Q5_0: [encoder setComputePipelineState:ctx->pipeline_cpy_f32_q5_0]; break;
-                                            //case GGML_TYPE_Q5_1: [encoder setComputePipelineState:ctx->pipeline_cpy_f32_q5_1]; break;
+                                            case GGML_TYPE_F16:  ggml_metal_enc_pipeline(&enc, ctx->pipeline_cpy_f32_f16);  break;
+                                            case GGML_TYPE_F32:  ggml_metal_enc_pipeline(&enc, ctx->pipeline_cpy_f32_f32);  break;
+                                            case GGML_TYPE_Q8_0: ggml_metal_enc_pipeline(&enc, ctx->pipeline_cpy_f32_q8_0); break;
+                                            case GGML_TYPE_Q4_0: ggml_metal_enc_pipeline(&enc, ctx->pipeline_cpy_f32_q4_0); break;
+                                            case GGML_TYPE_Q4_1: ggml_metal_enc_pipeline(&enc, ctx->pipeline_cpy_f32_q4_1); break;
+                                            //case GGML_TYPE_Q5_0: ggml_metal_enc_pipeline(&enc, ctx->pipeline_cpy_f32_q5_0); break;
+                                            //case GGML_TYPE_Q5_1: ggml_metal_enc_pipeline(&enc, ctx->pipeline_cpy_f32_q5_1); break;
                                             default: GGML_ASSERT(false && "not implemented");
                                         };
                                     } break;
                                 case GGML_TYPE_F16:
                                     {
                                         switch (dstt) {
-                                            case GGML_TYPE_F16: [encoder setComputePipelineState:ctx->pipeline_cpy_f16_f16]; break;
-                                            case GGML_TYPE_F32: [encoder setComputePipelineState:ctx->pipeline_cpy_f16_f32]; break;
+                                            case GGML_TYPE_F16: ggml_metal_enc_pipeline(&enc, ctx->pipeline_cpy_f16_f16); break;
+                                            case GGML_TYPE_F32: ggml_metal_enc_pipeline(&enc, ctx->pipeline_cpy_f16_f32); break;
                                             default: GGML_ASSERT(false && "not implemented");
                                         };
                                     } break;
                                 default: GGML_ASSERT(false && "not implemented");
                             }
 
-                            [encoder setBuffer:id_src0 offset:offs_src0        atIndex:0];
-                            [encoder setBuffer:id_dst  offset:offs_dst         atIndex:1];
-                            [encoder setBytes:&ne00    length:sizeof( int64_t) atIndex:2];
-                            [encoder setBytes:&ne01    length:sizeof( int64_t) atIndex:3];
-                            [encoder setBytes:&ne02    length:sizeof( int64_t) atIndex:4];
-                            [encoder setBytes:&ne03    length:sizeof( int64_t) atIndex:5];
-                            [encoder setBytes:&nb00    length:sizeof(uint64_t) atIndex:6];
-                            [encoder setBytes:&nb01    length:sizeof(uint64_t) atIndex:7];
-                            [encoder setBytes:&nb02    length:sizeof(uint64_t) atIndex:8];
-                            [encoder setBytes:&nb03    length:sizeof(uint64_t) atIndex:9];
-                            [encoder setBytes:&ne0     length:sizeof( int64_t) atIndex:10];
-                            [encoder setBytes:&ne1     length:sizeof( int64_t) atIndex:11];
-                            [encoder setBytes:&ne2     length:sizeof( int64_t) atIndex:12];
-                            [encoder setBytes:&ne3     length:sizeof( int64_t) atIndex:13];
-                            [encoder setBytes:&nb0     length:sizeof(uint64_t) atIndex:14];
-                            [encoder setBytes:&nb1     length:sizeof(uint64_t) atIndex:15];
-                            [encoder setBytes:&nb2     length:sizeof(uint64_t) atIndex:16];
-                            [encoder setBytes:&nb3     length:sizeof(uint64_t) atIndex:17];
-
-                            [encoder dispatchThreadgroups:MTLSizeMake(ne01, ne02, ne03) threadsPerThreadgroup:MTLSizeMake(nth, 1, 1)];
+                            ggml_metal_enc_buffer(&enc, id_src0, offs_src0,        0, 0);
+                            ggml_metal_enc_buffer(&enc, id_dst,  offs_dst,         1, -1);
+                            ggml_metal_enc_bytes(&enc, &ne00,    sizeof( int64_t), 2);
+                            ggml_metal_enc_bytes(&enc, &ne01,    sizeof( int64_t), 3);
+                            ggml_metal_enc_bytes(&enc, &ne02,    sizeof( int64_t), 4);
+                            ggml_metal_enc_bytes(&enc, &ne03,    sizeof( int64_t), 5);
+                            ggml_metal_enc_bytes(&enc, &nb00,    sizeof(uint64_t), 6);
+                            ggml_metal_enc_bytes(&enc, &nb01,    sizeof(uint64_t), 7);
+                            ggml_metal_enc_bytes(&enc, &nb02,    sizeof(uint64_t), 8);
+                            ggml_metal_enc_bytes(&enc, &nb03,    sizeof(uint64_t), 9);
+                            ggml_metal_enc_bytes(&enc, &ne0,     sizeof( int64_t), 10);
+                            ggml_metal_enc_bytes(&enc, &ne1,     sizeof( int64_t), 11);
+                            ggml_metal_enc_bytes(&enc, &ne2,     sizeof( int64_t), 12);
+                            ggml_metal_enc_bytes(&enc, &ne3,     sizeof( int64_t), 13);
+                            ggml_metal_enc_bytes(&enc, &nb0,     sizeof(uint64_t), 14);
+                            ggml_metal_enc_bytes(&enc, &nb1,     sizeof(uint64_t), 15);
+                            ggml_metal_enc_bytes(&enc, &nb2,     sizeof(uint64_t), 16);
+                            ggml_metal_enc_bytes(&enc, &nb3,     sizeof(uint64_t), 17);
+
+                            ggml_metal_enc_dispatch(&enc, MTLSizeMake(ne01, ne02, ne03), MTLSizeMake(nth, 1, 1));
                         } break;
                     default:
                         {
@@ -2535,6 +2887,11 @@ static struct ggml_backend_i metal_backend_i = {
     /* .graph_plan_compute      = */ NULL,
     /* .graph_compute           = */ ggml_backend_metal_graph_compute,
     /* .supports_op             = */ ggml_backend_metal_supports_op,
+    /* .event_new               = */ NULL, // ggml_metal_graph_compute waits for the command buffers to complete
+    /* .event_free              = */ NULL,
+    /* .event_record            = */ NULL,
+    /* .event_wait              = */ NULL,
+    /* .event_synchronize       = */ NULL,
 };
 
 // TODO: make a common log callback for all backends in ggml-backend
@@ -1,19 +1,54 @@
 #include "ggml-mpi.h"
 
 #include "ggml.h"
+#include "ggml-impl.h"
 
 #include <mpi.h>
 
+#include <limits.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
 
 #define UNUSED GGML_UNUSED
 
+#define GGML_MPI_ALIGNMENT 64
+
+// a copy of a tensor on its way to the next rank
+struct ggml_mpi_send {
+    MPI_Request req;
+    void      * data;
+};
+
 struct ggml_mpi_context {
     int rank;
     int size;
+
+    // the tensors exchanged with the neighbour ranks by the last split graph, in the same order on both sides
+    struct ggml_tensor ** recv;
+    struct ggml_tensor ** send;
+    int n_recv;
+    int n_send;
+    int n_max; // capacity of recv and send
+
+    // memory of the tensors in recv and send
+    void * buf;
+    size_t buf_size;
+
+    // sends not completed yet
+    struct ggml_mpi_send * pending;
+    int n_pending;
+    int n_pending_max;
+
+    // the slices of the rows of all the ranks, gathered by ggml_mpi_gather_rows
+    void * gather;
+    size_t gather_size;
+    int  * counts;
+    int  * displs;
 };
 
 void ggml_mpi_backend_init(void) {
@@ -30,10 +65,22 @@ struct ggml_mpi_context * ggml_mpi_init(void) {
     MPI_Comm_rank(MPI_COMM_WORLD, &ctx->rank);
     MPI_Comm_size(MPI_COMM_WORLD, &ctx->size);
 
+    ctx->counts = malloc(ctx->size*sizeof(int));
+    ctx->displs = malloc(ctx->size*sizeof(int));
+
     return ctx;
 }
 
 void ggml_mpi_free(struct ggml_mpi_context * ctx) {
+    ggml_mpi_flush(ctx);
+
+    free(ctx->recv);
+    free(ctx->send);
+    free(ctx->buf);
+    free(ctx->pending);
+    free(ctx->gather);
+    free(ctx->counts);
+    free(ctx->displs);
     free(ctx);
 }
 
@@ -41,176 +88,423 @@ int ggml_mpi_rank(struct ggml_mpi_context * ctx) {
     return ctx->rank;
 }
 
-void ggml_mpi_eval_init(
+int ggml_mpi_size(struct ggml_mpi_context * ctx) {
+    return ctx->size;
+}
+
+void ggml_mpi_bcast(
         struct ggml_mpi_context * ctx_mpi,
-                            int * n_tokens,
-                            int * n_past,
-                            int * n_threads) {
+                           void * data,
+                         size_t   size) {
     UNUSED(ctx_mpi);
 
-    // synchronize the worker node parameters with the root node
-    MPI_Barrier(MPI_COMM_WORLD);
+    GGML_ASSERT(size <= INT_MAX);
 
-    MPI_Bcast(n_tokens,  1, MPI_INT, 0, MPI_COMM_WORLD);
-    MPI_Bcast(n_past,    1, MPI_INT, 0, MPI_COMM_WORLD);
-    MPI_Bcast(n_threads, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    const int retval = MPI_Bcast(data, (int) size, MPI_BYTE, 0, MPI_COMM_WORLD);
+    GGML_ASSERT(retval == MPI_SUCCESS);
 }
 
-static int ggml_graph_get_node_idx(struct ggml_cgraph * gf, const char * name) {
-    struct ggml_tensor * t = ggml_graph_get_tensor(gf, name);
-    if (t == NULL) {
-        fprintf(stderr, "%s: tensor %s not found\n", __func__, name);
-        return -1;
+// the layer of a node from its name, "<name>-<il>" followed by the suffix of the views, e.g. " (view)", or -1
+static int ggml_mpi_node_layer(const struct ggml_tensor * t) {
+    const char * end = strchr(t->name, ' ');
+    if (end == NULL) {
+        end = t->name + strlen(t->name);
     }
 
-    for (int i = 0; i < gf->n_nodes; i++) {
-        if (gf->nodes[i] == t) {
-            return i;
-        }
+    const char * p = end;
+    while (p > t->name && p[-1] >= '0' && p[-1] <= '9') {
+        p--;
     }
 
-    fprintf(stderr, "%s: tensor %s not found in graph (should not happen)\n", __func__, name);
-    return -1;
-}
-
-static void ggml_mpi_tensor_send(struct ggml_tensor * t, int mpi_rank_dst) {
-    MPI_Datatype mpi_type;
-
-    switch (t->type) {
-        case GGML_TYPE_I32: mpi_type = MPI_INT32_T; break;
-        case GGML_TYPE_F32: mpi_type = MPI_FLOAT;   break;
-        default: GGML_ASSERT(false && "not implemented");
+    if (p == end || p == t->name || p[-1] != '-') {
+        return -1;
     }
 
-    const int retval = MPI_Send(t->data, ggml_nelements(t), mpi_type, mpi_rank_dst, 0, MPI_COMM_WORLD);
-    GGML_ASSERT(retval == MPI_SUCCESS);
+    return atoi(p);
 }
 
-static void ggml_mpi_tensor_recv(struct ggml_tensor * t, int mpi_rank_src) {
-    MPI_Datatype mpi_type;
-
-    switch (t->type) {
-        case GGML_TYPE_I32: mpi_type = MPI_INT32_T; break;
-        case GGML_TYPE_F32: mpi_type = MPI_FLOAT;   break;
-        default: GGML_ASSERT(false && "not implemented");
+static struct ggml_tensor * ggml_mpi_view_root(struct ggml_tensor * t) {
+    while (t->view_src != NULL) {
+        t = t->view_src;
     }
-
-    MPI_Status status; UNUSED(status);
-
-    const int retval = MPI_Recv(t->data, ggml_nelements(t), mpi_type, mpi_rank_src, MPI_ANY_TAG, MPI_COMM_WORLD, &status);
-    GGML_ASSERT(retval == MPI_SUCCESS);
+    return t;
 }
 
-// TODO: there are many improvements that can be done to this implementation
-void ggml_mpi_graph_compute_pre(
+void ggml_mpi_graph_split(
         struct ggml_mpi_context * ctx_mpi,
              struct ggml_cgraph * gf,
                             int   n_layers) {
     const int mpi_rank = ctx_mpi->rank;
     const int mpi_size = ctx_mpi->size;
 
-    struct ggml_tensor * inp_tokens = ggml_graph_get_tensor(gf, "inp_tokens");
-    if (inp_tokens == NULL) {
-        fprintf(stderr, "%s: tensor 'inp_tokens' not found\n", __func__);
-        return;
-    }
+    ctx_mpi->n_recv = 0;
+    ctx_mpi->n_send = 0;
 
-    struct ggml_tensor * inp0 = ggml_graph_get_tensor(gf, "layer_inp_0");
-    if (inp0 == NULL) {
-        fprintf(stderr, "%s: tensor 'inp0' not found\n", __func__);
+    if (mpi_size == 1) {
         return;
     }
 
-    GGML_ASSERT(inp0 == gf->nodes[0]);
-
-    // distribute the compute graph into slices across the MPI nodes
+    // distribute the layers into slices across the MPI nodes
     //
     // the main node (0) processes the last layers + the remainder of the compute graph
-    // and is responsible to pass the input tokens to the first node (1)
     //
     // node 1:   [(  0) * n_per_node, (  1) * n_per_node)
     // node 2:   [(  1) * n_per_node, (  2) * n_per_node)
     // ...
     // node n-1: [(n-2) * n_per_node, (n-1) * n_per_node)
-    // node 0:   [(n-1) * n_per_node,            n_nodes)
+    // node 0:   [(n-1) * n_per_node,            n_layers)
     //
-    if (mpi_rank > 0) {
-        if (mpi_rank == 1) {
-            // the first node (1) receives the input tokens from the main node (0)
-            ggml_mpi_tensor_recv(inp_tokens, 0);
+    const int n_per_node = (n_layers + (mpi_size - 1)) / mpi_size;
+
+    GGML_ASSERT((mpi_size - 2) * n_per_node < n_layers && "more MPI nodes than layers");
+
+    const int mpi_idx = mpi_rank > 0 ? mpi_rank - 1 : mpi_size - 1;
+
+    // the stage of each tensor of the graph, by its slot in the visited hash table:
+    //  -2: a leaf, available on all the nodes
+    //  -1: a node that does not depend on a layer, e.g. the input embeddings, computed by all the nodes
+    // >=0: the slice of the node that computes it, the one of its layer, or the last one of its sources for the nodes
+    //      without a layer within the layers, or the last slice for the ones after the layers, e.g. the output
+    const struct ggml_hash_set hs = gf->visited_hash_table;
+
+    int * stage = malloc(hs.size*sizeof(int));
+    for (size_t i = 0; i < hs.size; i++) {
+        stage[i] = -2;
+    }
+
+    int i_last = -1; // the last node with a layer
+    for (int i = 0; i < gf->n_nodes; i++) {
+        const int il = ggml_mpi_node_layer(gf->nodes[i]);
+        if (il >= 0 && il < n_layers) {
+            i_last = i;
+        }
+    }
+
+    for (int i = 0; i < gf->n_nodes; i++) {
+        struct ggml_tensor * node = gf->nodes[i];
+
+        int st = -1;
+
+        const int il = ggml_mpi_node_layer(node);
+        if (il >= 0 && il < n_layers) {
+            st = MIN(il / n_per_node, mpi_size - 1);
         } else {
-            // recv input data for each node into the "inp0" tensor (i.e. the first node in the compute graph)
-            ggml_mpi_tensor_recv(inp0, mpi_rank - 1);
+            for (int j = 0; j < GGML_MAX_SRC; j++) {
+                if (node->src[j] != NULL) {
+                    st = MAX(st, stage[ggml_hash_find(hs, node->src[j])]);
+                }
+            }
+            if (st >= 0 && i > i_last) {
+                st = mpi_size - 1;
+            }
         }
-    } else if (mpi_size > 1) {
-        // node 0 sends the input tokens to node 1
-        ggml_mpi_tensor_send(inp_tokens, 1);
 
-        // recv the output data from the last node
-        ggml_mpi_tensor_recv(inp0, mpi_size - 1);
+        stage[ggml_hash_find(hs, node)] = st;
     }
 
-    {
-        const int n_per_node = (n_layers + (mpi_size - 1)) / mpi_size;
+    // the inputs of a slice are the tensors of the previous slice used by its nodes, the views are exchanged through
+    // the tensors they view
+    if (ctx_mpi->n_max < gf->n_nodes) {
+        ctx_mpi->n_max = gf->n_nodes;
+        ctx_mpi->recv = realloc(ctx_mpi->recv, ctx_mpi->n_max*sizeof(struct ggml_tensor *));
+        ctx_mpi->send = realloc(ctx_mpi->send, ctx_mpi->n_max*sizeof(struct ggml_tensor *));
+    }
+
+    char * listed = calloc(hs.size, 1); // 1: in recv, 2: in send
+
+    for (int i = 0; i < gf->n_nodes; i++) {
+        struct ggml_tensor * node = gf->nodes[i];
 
-        const int mpi_idx = mpi_rank > 0 ? mpi_rank - 1 : mpi_size - 1;
+        const int st = stage[ggml_hash_find(hs, node)];
+        if (st < 0 || (st != mpi_idx && st != mpi_idx + 1)) {
+            continue;
+        }
 
-        const int il0 =               (mpi_idx + 0) * n_per_node;
-        const int il1 = MIN(n_layers, (mpi_idx + 1) * n_per_node);
+        for (int j = 0; j < GGML_MAX_SRC; j++) {
+            if (node->src[j] == NULL) {
+                continue;
+            }
 
-        char name_l0[GGML_MAX_NAME];
-        char name_l1[GGML_MAX_NAME];
+            struct ggml_tensor * src = ggml_mpi_view_root(node->src[j]);
 
-        snprintf(name_l0, sizeof(name_l0), "layer_inp_%d", il0);
-        snprintf(name_l1, sizeof(name_l1), "layer_inp_%d", il1);
+            const size_t k = ggml_hash_find(hs, src);
+            const int   ss = stage[k];
 
-        const int idx_l0 =                ggml_graph_get_node_idx(gf, name_l0);
-        const int idx_l1 = mpi_rank > 0 ? ggml_graph_get_node_idx(gf, name_l1) + 1 : gf->n_nodes;
+            if (ss < 0 || ss == st) {
+                continue;
+            }
 
-        if (idx_l0 < 0 || idx_l1 < 0) {
-            fprintf(stderr, "%s: layer input nodes not found\n", __func__);
-            return;
-        }
+            GGML_ASSERT(ss == st - 1 && "a node uses a tensor of a slice other than the previous one");
+            GGML_ASSERT(ggml_is_contiguous(src));
 
-        // attach the input data to all nodes that need it
-        // TODO: not great - should be able to do this without modifying the compute graph (see next TODO below)
-        for (int i = idx_l0; i < idx_l1; i++) {
-            if (gf->nodes[i]->src[0] == gf->nodes[idx_l0]) {
-                gf->nodes[i]->src[0] =  inp0;
+            if (st == mpi_idx && !(listed[k] & 1)) {
+                listed[k] |= 1;
+                ctx_mpi->recv[ctx_mpi->n_recv++] = src;
             }
-            if (gf->nodes[i]->src[1] == gf->nodes[idx_l0]) {
-                gf->nodes[i]->src[1] =  inp0;
+            if (st == mpi_idx + 1 && !(listed[k] & 2)) {
+                listed[k] |= 2;
+                ctx_mpi->send[ctx_mpi->n_send++] = src;
             }
         }
+    }
+
+    free(listed);
+
+    // keep the nodes of this slice, and the ones computed by all the nodes
+    int n_nodes = 0;
+    for (int i = 0; i < gf->n_nodes; i++) {
+        const int st = stage[ggml_hash_find(hs, gf->nodes[i])];
+        if (st == -1 || st == mpi_idx) {
+            gf->nodes[n_nodes] = gf->nodes[i];
+            if (gf->grads) {
+                gf->grads[n_nodes] = gf->grads[i];
+            }
+            n_nodes++;
+        }
+    }
+    gf->n_nodes = n_nodes;
+
+    free(stage);
+
+    // the exchanged tensors are not allocated with the graph: the received ones are computed by another node, and the
+    // sent ones must not be overwritten by the nodes after them
+    size_t size = 0;
+    for (int i = 0; i < ctx_mpi->n_recv + ctx_mpi->n_send; i++) {
+        struct ggml_tensor * t = i < ctx_mpi->n_recv ? ctx_mpi->recv[i] : ctx_mpi->send[i - ctx_mpi->n_recv];
+        size += GGML_PAD(ggml_nbytes(t), GGML_MPI_ALIGNMENT);
+    }
+
+    if (ctx_mpi->buf_size < size) {
+        free(ctx_mpi->buf);
+        ctx_mpi->buf      = malloc(size + GGML_MPI_ALIGNMENT);
+        ctx_mpi->buf_size = size;
+    }
+
+    size_t offs = GGML_PAD((uintptr_t) ctx_mpi->buf, GGML_MPI_ALIGNMENT) - (uintptr_t) ctx_mpi->buf;
+    for (int i = 0; i < ctx_mpi->n_recv + ctx_mpi->n_send; i++) {
+        struct ggml_tensor * t = i < ctx_mpi->n_recv ? ctx_mpi->recv[i] : ctx_mpi->send[i - ctx_mpi->n_recv];
+        GGML_ASSERT(t->data == NULL);
+        t->data = (char *) ctx_mpi->buf + offs;
+        offs += GGML_PAD(ggml_nbytes(t), GGML_MPI_ALIGNMENT);
+    }
+
+    //fprintf(stderr, "%s: node %d: processing %d nodes, %d inputs, %d outputs\n", __func__, mpi_rank, gf->n_nodes, ctx_mpi->n_recv, ctx_mpi->n_send);
+}
+
+// the first row of the slice of a rank, of the nr rows of a matrix
+static int64_t ggml_mpi_row0(int64_t nr, int rank, int size) {
+    return nr*rank/size;
+}
+
+// gather the slices a of all the ranks into the rows of dst
+static void ggml_mpi_gather_rows(struct ggml_tensor * dst, const struct ggml_tensor * a, int ith, int nth, void * userdata) {
+    GGML_ASSERT(ith == 0 && nth == 1);
+
+    struct ggml_mpi_context * ctx_mpi = userdata;
+
+    const int mpi_size = ctx_mpi->size;
+
+    const int64_t nr = dst->ne[0];       // the rows of the weights are the elements of the rows of the result
+    const int64_t nc = ggml_nrows(dst);  // one per column of the input
+
+    GGML_ASSERT(dst->type == GGML_TYPE_F32 && a->type == GGML_TYPE_F32);
+    GGML_ASSERT(ggml_is_contiguous(dst) && ggml_is_contiguous(a));
+    GGML_ASSERT(ggml_nbytes(dst) <= INT_MAX);
+
+    for (int r = 0; r < mpi_size; r++) {
+        const int64_t r0 = ggml_mpi_row0(nr, r,     mpi_size);
+        const int64_t r1 = ggml_mpi_row0(nr, r + 1, mpi_size);
+
+        ctx_mpi->counts[r] = (int) ((r1 - r0)*nc*sizeof(float));
+        ctx_mpi->displs[r] = (int) (r0*nc*sizeof(float));
+    }
+
+    if (ctx_mpi->gather_size < ggml_nbytes(dst)) {
+        free(ctx_mpi->gather);
+        ctx_mpi->gather      = malloc(ggml_nbytes(dst));
+        ctx_mpi->gather_size = ggml_nbytes(dst);
+    }
+
+    const int retval = MPI_Allgatherv(a->data, ctx_mpi->counts[ctx_mpi->rank], MPI_BYTE,
+            ctx_mpi->gather, ctx_mpi->counts, ctx_mpi->displs, MPI_BYTE, MPI_COMM_WORLD);
+    GGML_ASSERT(retval == MPI_SUCCESS);
+
+    // the slices are gathered one after the other, each one with its columns one after the other
+    for (int r = 0; r < mpi_size; r++) {
+        const int64_t r0 = ggml_mpi_row0(nr, r,     mpi_size);
+        const int64_t r1 = ggml_mpi_row0(nr, r + 1, mpi_size);
+
+        const char * src = (const char *) ctx_mpi->gather + ctx_mpi->displs[r];
+
+        for (int64_t c = 0; c < nc; c++) {
+            memcpy((char *) dst->data + c*dst->nb[1] + r0*sizeof(float), src + c*(r1 - r0)*sizeof(float), (r1 - r0)*sizeof(float));
+        }
+    }
+}
+
+// the multiplications by a matrix of weights, the KV cache and the other operands are views
+static bool ggml_mpi_can_split_rows(const struct ggml_mpi_context * ctx_mpi, const struct ggml_tensor * node) {
+    if (node->op != GGML_OP_MUL_MAT) {
+        return false;
+    }
+
+    const struct ggml_tensor * w = node->src[0];
+
+    return w->op == GGML_OP_NONE && w->view_src == NULL && ggml_is_matrix(w) && w->ne[1] >= ctx_mpi->size &&
+        node->type == GGML_TYPE_F32 && ggml_is_contiguous(node);
+}
+
+void ggml_mpi_graph_split_rows(
+        struct ggml_mpi_context * ctx_mpi,
+            struct ggml_context * ctx,
+             struct ggml_cgraph * gf) {
+    const int mpi_rank = ctx_mpi->rank;
+    const int mpi_size = ctx_mpi->size;
+
+    ctx_mpi->n_recv = 0;
+    ctx_mpi->n_send = 0;
+
+    if (mpi_size == 1) {
+        return;
+    }
+
+    int n_split = 0;
+    for (int i = 0; i < gf->n_nodes; i++) {
+        n_split += ggml_mpi_can_split_rows(ctx_mpi, gf->nodes[i]);
+    }
+
+    GGML_ASSERT(gf->n_nodes + 2*n_split <= gf->size);
+
+    // each multiplication becomes the view of the slice of the weights, its multiplication, and the gather of the
+    // slices in place of the multiplication, so that its uses are unchanged. The nodes are moved from the end
+    int j = gf->n_nodes + 2*n_split;
+
+    for (int i = gf->n_nodes - 1; i >= 0; i--) {
+        struct ggml_tensor * node = gf->nodes[i];
+
+        gf->nodes[--j] = node;
+        if (gf->grads) {
+            gf->grads[j] = gf->grads[i];
+        }
+
+        if (!ggml_mpi_can_split_rows(ctx_mpi, node)) {
+            continue;
+        }
+
+        struct ggml_tensor * w = node->src[0];
+
+        const int64_t r0 = ggml_mpi_row0(w->ne[1], mpi_rank,     mpi_size);
+        const int64_t r1 = ggml_mpi_row0(w->ne[1], mpi_rank + 1, mpi_size);
+
+        struct ggml_tensor * w_slice = ggml_view_2d(ctx, w, w->ne[0], r1 - r0, w->nb[1], r0*w->nb[1]);
+        ggml_format_name(w_slice, "%s (rows)", w->name);
+
+        struct ggml_tensor * slice = ggml_mul_mat(ctx, w_slice, node->src[1]);
+        ggml_format_name(slice, "%s (rows)", node->name);
+
+        // only the op of the gather is used
+        struct ggml_tensor * gather = ggml_map_custom1(ctx, slice, ggml_mpi_gather_rows, 1, ctx_mpi);
+
+        node->op = gather->op;
+        memcpy(node->op_params, gather->op_params, sizeof(node->op_params));
+        node->src[0] = slice;
+        node->src[1] = NULL;
+
+        gf->nodes[--j] = slice;
+        gf->nodes[--j] = w_slice;
+        if (gf->grads) {
+            gf->grads[j + 1] = NULL;
+            gf->grads[j]     = NULL;
+        }
+    }
 
-        // TODO: instead of rearranging the nodes, we should be able to execute a subset of the compute graph
-        for (int i = 1; i < idx_l1 - idx_l0; i++) {
-            gf->nodes[i] = gf->nodes[idx_l0 + i];
-            gf->grads[i] = gf->grads[idx_l0 + i];
+    GGML_ASSERT(j == 0);
+
+    gf->n_nodes += 2*n_split;
+}
+
+// free the copies of the completed sends
+static void ggml_mpi_reap(struct ggml_mpi_context * ctx_mpi, bool wait) {
+    int n = 0;
+    for (int i = 0; i < ctx_mpi->n_pending; i++) {
+        struct ggml_mpi_send * s = &ctx_mpi->pending[i];
+
+        int done = 0;
+        if (wait) {
+            MPI_Wait(&s->req, MPI_STATUS_IGNORE);
+            done = 1;
+        } else {
+            MPI_Test(&s->req, &done, MPI_STATUS_IGNORE);
         }
 
-        // the first node performs the "get_rows" operation, the rest of the nodes get the data from the previous node
-        if (mpi_idx != 0) {
-            gf->nodes[0]->op = GGML_OP_NONE;
+        if (done) {
+            free(s->data);
+        } else {
+            ctx_mpi->pending[n++] = *s;
         }
+    }
+    ctx_mpi->n_pending = n;
+}
 
-        gf->n_nodes = idx_l1 - idx_l0;
+void ggml_mpi_graph_compute_pre(
+        struct ggml_mpi_context * ctx_mpi,
+             struct ggml_cgraph * gf) {
+    UNUSED(gf);
 
-        //fprintf(stderr, "%s: node %d: processing %d nodes [%d, %d)\n", __func__, mpi_rank, gf->n_nodes, il0, il1);
+    const int mpi_rank = ctx_mpi->rank;
+    const int mpi_size = ctx_mpi->size;
+
+    if (mpi_size == 1) {
+        return;
+    }
+
+    // the transfers of the previous graphs make progress while this node waits for its inputs
+    ggml_mpi_reap(ctx_mpi, false);
+
+    const int mpi_rank_src = (mpi_rank + mpi_size - 1) % mpi_size;
+
+    for (int i = 0; i < ctx_mpi->n_recv; i++) {
+        struct ggml_tensor * t = ctx_mpi->recv[i];
+
+        const int retval = MPI_Recv(t->data, (int) ggml_nbytes(t), MPI_BYTE, mpi_rank_src, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+        GGML_ASSERT(retval == MPI_SUCCESS);
     }
 }
 
 void ggml_mpi_graph_compute_post(
         struct ggml_mpi_context * ctx_mpi,
-             struct ggml_cgraph * gf,
-                            int   n_layers) {
-    UNUSED(n_layers);
+             struct ggml_cgraph * gf) {
+    UNUSED(gf);
 
     const int mpi_rank = ctx_mpi->rank;
     const int mpi_size = ctx_mpi->size;
 
-    // send the output data to the next node
-    if (mpi_rank > 0) {
-        ggml_mpi_tensor_send(gf->nodes[gf->n_nodes - 1], (mpi_rank + 1) % mpi_size);
+    if (mpi_size == 1) {
+        return;
+    }
+
+    const int mpi_rank_dst = (mpi_rank + 1) % mpi_size;
+
+    if (ctx_mpi->n_pending + ctx_mpi->n_send > ctx_mpi->n_pending_max) {
+        ctx_mpi->n_pending_max = 2*ctx_mpi->n_pending_max + ctx_mpi->n_send;
+        ctx_mpi->pending = realloc(ctx_mpi->pending, ctx_mpi->n_pending_max*sizeof(struct ggml_mpi_send));
     }
+
+    // the tensors are copied, the next graph reuses their memory
+    for (int i = 0; i < ctx_mpi->n_send; i++) {
+        struct ggml_tensor * t = ctx_mpi->send[i];
+
+        const size_t nbytes = ggml_nbytes(t);
+
+        struct ggml_mpi_send * s = &ctx_mpi->pending[ctx_mpi->n_pending++];
+        s->data = malloc(nbytes);
+        memcpy(s->data, t->data, nbytes);
+
+        const int retval = MPI_Isend(s->data, (int) nbytes, MPI_BYTE, mpi_rank_dst, 0, MPI_COMM_WORLD, &s->req);
+        GGML_ASSERT(retval == MPI_SUCCESS);
+    }
+}
+
+void ggml_mpi_flush(struct ggml_mpi_context * ctx_mpi) {
+    ggml_mpi_reap(ctx_mpi, true);
 }
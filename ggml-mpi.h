@@ -1,5 +1,7 @@
 #pragma once
 
+#include <stddef.h>
+
 struct ggml_context;
 struct ggml_tensor;
 struct ggml_cgraph;
@@ -17,22 +19,49 @@ struct ggml_mpi_context * ggml_mpi_init(void);
 void ggml_mpi_free(struct ggml_mpi_context * ctx);
 
 int ggml_mpi_rank(struct ggml_mpi_context * ctx);
+int ggml_mpi_size(struct ggml_mpi_context * ctx);
 
-void ggml_mpi_eval_init(
+// broadcast size bytes of data from the rank 0 to the other ranks
+void ggml_mpi_bcast(
         struct ggml_mpi_context * ctx_mpi,
-                            int * n_tokens,
-                            int * n_past,
-                            int * n_threads);
+                           void * data,
+                         size_t   size);
 
-void ggml_mpi_graph_compute_pre(
+// the layers are split into a pipeline of stages, one per rank: the ranks 1, 2, ..., n-1 compute the first layers in
+// this order, the rank 0 computes the last ones and the rest of the graph, e.g. the output. The layer of a node is the
+// index in its name, "attn_norm-3", the nodes without an index are computed by all the ranks, unless they depend on
+// a layer, then only by the rank 0
+//
+// remove from gf the nodes of the other ranks, before the graph is allocated. The tensors received from the previous
+// rank and the ones sent to the next rank are kept in a buffer of ctx_mpi, out of the graph allocator, so that the
+// other nodes do not overwrite them
+void ggml_mpi_graph_split(
         struct ggml_mpi_context * ctx_mpi,
              struct ggml_cgraph * gf,
                             int   n_layers);
 
+// instead of ggml_mpi_graph_split, split the rows of the weights of the matrix multiplications of gf between the
+// ranks: each rank multiplies its slice of the rows, and the slices of all the ranks are gathered into the result.
+// The other nodes are computed by all the ranks. The nodes of the slices are created in ctx and added to gf, before
+// the graph is allocated
+void ggml_mpi_graph_split_rows(
+        struct ggml_mpi_context * ctx_mpi,
+            struct ggml_context * ctx,
+             struct ggml_cgraph * gf);
+
+// receive the inputs of the split graph from the previous rank, before its computation
+void ggml_mpi_graph_compute_pre(
+        struct ggml_mpi_context * ctx_mpi,
+             struct ggml_cgraph * gf);
+
+// send the outputs of the split graph to the next rank, after its computation: the outputs are copied and sent
+// without waiting for the next rank, so that this one can go on with the next graph
 void ggml_mpi_graph_compute_post(
         struct ggml_mpi_context * ctx_mpi,
-             struct ggml_cgraph * gf,
-                            int   n_layers);
+             struct ggml_cgraph * gf);
+
+// wait for the sends of the previous graphs
+void ggml_mpi_flush(struct ggml_mpi_context * ctx_mpi);
 
 #ifdef __cplusplus
 }
@@ -1,6 +1,8 @@
 #include "ggml.h"
 #include "ggml-opencl.h"
+#include "ggml-backend-impl.h"
 
+#include <algorithm>
 #include <array>
 #include <atomic>
 #include <cstdio>
@@ -18,6 +20,7 @@
 #endif
 
 #define CL_DMMV_LOCAL_SIZE 32
+#define CL_ROW_LOCAL_SIZE 64 // work group size of the kernels that reduce a row, must be a power of 2
 
 #ifndef K_QUANTS_PER_ITERATION
 #define K_QUANTS_PER_ITERATION 1
@@ -798,6 +801,266 @@ __kernel void KERNEL_NAME(__global TYPE* x, const int x_offset, __global TYPE* y
 }
 );
 
+// kernels of the ggml-backend interface
+// tensors are addressed as a buffer and a byte offset, and strides are in bytes
+std::string backend_source = MULTILINE_QUOTE(
+float load_f32(__global const char * p) {
+    return *(__global const float *) p;
+}
+
+float load_f16(__global const char * p) {
+    return vload_half(0, (__global const half *) p);
+}
+
+void store_f32(__global char * p, const float v) {
+    *(__global float *) p = v;
+}
+
+void store_f16(__global char * p, const float v) {
+    vstore_half(v, 0, (__global half *) p);
+}
+
+float local_sum(__local float * buf, const float v) {
+    const int tid = get_local_id(0);
+
+    buf[tid] = v;
+    barrier(CLK_LOCAL_MEM_FENCE);
+    for (int s = get_local_size(0)/2; s > 0; s >>= 1) {
+        if (tid < s) {
+            buf[tid] += buf[tid + s];
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+    const float r = buf[0];
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    return r;
+}
+
+float local_max(__local float * buf, const float v) {
+    const int tid = get_local_id(0);
+
+    buf[tid] = v;
+    barrier(CLK_LOCAL_MEM_FENCE);
+    for (int s = get_local_size(0)/2; s > 0; s >>= 1) {
+        if (tid < s) {
+            buf[tid] = fmax(buf[tid], buf[tid + s]);
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+    const float r = buf[0];
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    return r;
+}
+
+__kernel void kernel_scale_f32(__global const char * src0, const ulong offset0, __global const char * src1, const ulong offset1, __global char * dst, const ulong offsetd) {
+    const int i = get_global_id(0);
+    const float v = *(__global const float *) (src1 + offset1);
+
+    ((__global float *) (dst + offsetd))[i] = ((__global const float *) (src0 + offset0))[i] * v;
+}
+
+// one work group per row, dst is contiguous
+__kernel void kernel_norm_f32(__global const char * src0, const ulong offset0, __global char * dst, const ulong offsetd,
+        const int ne00, const int ne01, const int ne02, const ulong nb01, const ulong nb02, const ulong nb03,
+        const float eps, __local float * buf) {
+    const int row = get_group_id(0);
+    const int tid = get_local_id(0);
+    const int nth = get_local_size(0);
+
+    const int i01 = row % ne01;
+    const int i02 = (row / ne01) % ne02;
+    const int i03 = row / (ne01*ne02);
+
+    __global const float * x = (__global const float *) (src0 + offset0 + i01*nb01 + i02*nb02 + i03*nb03);
+    __global float * y = (__global float *) (dst + offsetd) + (long) row*ne00;
+
+    float sum = 0.0f;
+    for (int i00 = tid; i00 < ne00; i00 += nth) {
+        sum += x[i00];
+    }
+    const float mean = local_sum(buf, sum)/ne00;
+
+    float sum2 = 0.0f;
+    for (int i00 = tid; i00 < ne00; i00 += nth) {
+        const float v = x[i00] - mean;
+        y[i00] = v;
+        sum2 += v*v;
+    }
+    const float scale = 1.0f/sqrt(local_sum(buf, sum2)/ne00 + eps);
+
+    for (int i00 = tid; i00 < ne00; i00 += nth) {
+        y[i00] *= scale;
+    }
+}
+
+__kernel void kernel_rms_norm_f32(__global const char * src0, const ulong offset0, __global char * dst, const ulong offsetd,
+        const int ne00, const int ne01, const int ne02, const ulong nb01, const ulong nb02, const ulong nb03,
+        const float eps, __local float * buf) {
+    const int row = get_group_id(0);
+    const int tid = get_local_id(0);
+    const int nth = get_local_size(0);
+
+    const int i01 = row % ne01;
+    const int i02 = (row / ne01) % ne02;
+    const int i03 = row / (ne01*ne02);
+
+    __global const float * x = (__global const float *) (src0 + offset0 + i01*nb01 + i02*nb02 + i03*nb03);
+    __global float * y = (__global float *) (dst + offsetd) + (long) row*ne00;
+
+    float sum = 0.0f;
+    for (int i00 = tid; i00 < ne00; i00 += nth) {
+        sum += x[i00]*x[i00];
+    }
+    const float scale = 1.0f/sqrt(local_sum(buf, sum)/ne00 + eps);
+
+    for (int i00 = tid; i00 < ne00; i00 += nth) {
+        y[i00] = x[i00]*scale;
+    }
+}
+
+// one work group per row, the mask is broadcast across the rows
+__kernel void kernel_soft_max_f32(__global const char * src0, const ulong offset0, __global const char * src1, const ulong offset1, __global char * dst, const ulong offsetd,
+        const int ne00, const ulong nb01, const int ne11, const ulong nb11, const int has_mask, const float scale, __local float * buf) {
+    const int row = get_group_id(0);
+    const int tid = get_local_id(0);
+    const int nth = get_local_size(0);
+
+    __global const float * x = (__global const float *) (src0 + offset0 + row*nb01);
+    __global const float * m = has_mask ? (__global const float *) (src1 + offset1 + (row % ne11)*nb11) : 0;
+    __global float * y = (__global float *) (dst + offsetd) + (long) row*ne00;
+
+    float max = -FLT_MAX;
+    for (int i00 = tid; i00 < ne00; i00 += nth) {
+        max = fmax(max, x[i00]*scale + (m ? m[i00] : 0.0f));
+    }
+    max = local_max(buf, max);
+
+    float sum = 0.0f;
+    for (int i00 = tid; i00 < ne00; i00 += nth) {
+        const float v = exp(x[i00]*scale + (m ? m[i00] : 0.0f) - max);
+        y[i00] = v;
+        sum += v;
+    }
+    sum = local_sum(buf, sum);
+
+    for (int i00 = tid; i00 < ne00; i00 += nth) {
+        y[i00] /= sum;
+    }
+}
+
+// one work item per rotated pair, without YaRN extrapolation and xPos
+__kernel void kernel_rope_f32(__global const char * src0, const ulong offset0, __global const char * src1, const ulong offset1, __global char * dst, const ulong offsetd,
+        const int ne2, const ulong nb01, const ulong nb02, const ulong nb03, const ulong nb1, const ulong nb2, const ulong nb3,
+        const int n_dims, const int is_neox, const float freq_base, const float freq_scale, const float attn_factor) {
+    const int k  = get_global_id(0);
+    const int i1 = get_global_id(1);
+    const int i2 = get_global_id(2) % ne2;
+    const int i3 = get_global_id(2) / ne2;
+
+    const float p = (float) ((__global const int *) (src1 + offset1))[i2];
+
+    int i0a;
+    int i0b;
+    float theta = p*freq_scale*pow(freq_base, -2.0f*k/n_dims);
+    if (is_neox) {
+        i0a = (k / (n_dims/2))*n_dims + k % (n_dims/2);
+        i0b = i0a + n_dims/2;
+        theta *= freq_scale;
+    } else {
+        i0a = 2*k;
+        i0b = 2*k + 1;
+    }
+
+    const float cos_theta = cos(theta)*attn_factor;
+    const float sin_theta = sin(theta)*attn_factor;
+
+    __global const float * x = (__global const float *) (src0 + offset0 + i1*nb01 + i2*nb02 + i3*nb03);
+    __global float * y = (__global float *) (dst + offsetd + i1*nb1 + i2*nb2 + i3*nb3);
+
+    const float x0 = x[i0a];
+    const float x1 = x[i0b];
+
+    y[i0a] = x0*cos_theta - x1*sin_theta;
+    y[i0b] = x0*sin_theta + x1*cos_theta;
+}
+
+__kernel void kernel_diag_mask_inf_f32(__global const char * src0, const ulong offset0, __global char * dst, const ulong offsetd,
+        const int ne00, const int ne01, const int n_past) {
+    const int i00 = get_global_id(0);
+    const int i01 = get_global_id(1);
+    const int i02 = get_global_id(2);
+
+    const long i = ((long) i02*ne01 + i01)*ne00 + i00;
+
+    ((__global float *) (dst + offsetd))[i] = i00 > n_past + i01 ? -INFINITY : ((__global const float *) (src0 + offset0))[i];
+}
+);
+
+std::string binary_template = MULTILINE_QUOTE(
+__kernel void KERNEL_NAME(__global const char * src0, const ulong offset0, __global const char * src1, const ulong offset1, __global char * dst, const ulong offsetd,
+        const int ne2, const ulong nb00, const ulong nb01, const ulong nb02, const ulong nb03,
+        const int ne10, const int ne11, const int ne12, const int ne13, const ulong nb10, const ulong nb11, const ulong nb12, const ulong nb13,
+        const ulong nb0, const ulong nb1, const ulong nb2, const ulong nb3) {
+    const int i0 = get_global_id(0);
+    const int i1 = get_global_id(1);
+    const int i2 = get_global_id(2) % ne2;
+    const int i3 = get_global_id(2) / ne2;
+
+    const float x = load_f32(src0 + offset0 + i0*nb00 + i1*nb01 + i2*nb02 + i3*nb03);
+    const float y = load_f32(src1 + offset1 + (i0 % ne10)*nb10 + (i1 % ne11)*nb11 + (i2 % ne12)*nb12 + (i3 % ne13)*nb13);
+
+    store_f32(dst + offsetd + i0*nb0 + i1*nb1 + i2*nb2 + i3*nb3, x OP y);
+}
+);
+
+std::string unary_template = MULTILINE_QUOTE(
+__kernel void KERNEL_NAME(__global const char * src0, const ulong offset0, __global char * dst, const ulong offsetd) {
+    const int i = get_global_id(0);
+    const float x = ((__global const float *) (src0 + offset0))[i];
+
+    ((__global float *) (dst + offsetd))[i] = OP;
+}
+);
+
+// copies the elements in the row-major order of both tensors, converting the type
+std::string cpy_template = MULTILINE_QUOTE(
+__kernel void KERNEL_NAME(__global const char * src0, const ulong offset0, __global char * dst, const ulong offsetd,
+        const int ne00, const int ne01, const int ne02, const ulong nb00, const ulong nb01, const ulong nb02, const ulong nb03,
+        const int ne0, const int ne1, const int ne2, const ulong nb0, const ulong nb1, const ulong nb2, const ulong nb3) {
+    const long i = get_global_id(0);
+
+    const long i03 = i/((long) ne00*ne01*ne02);
+    const long i02 = (i - i03*ne00*ne01*ne02)/((long) ne00*ne01);
+    const long i01 = (i - i03*ne00*ne01*ne02 - i02*ne00*ne01)/ne00;
+    const long i00 = i - i03*ne00*ne01*ne02 - i02*ne00*ne01 - i01*ne00;
+
+    const long i3 = i/((long) ne0*ne1*ne2);
+    const long i2 = (i - i3*ne0*ne1*ne2)/((long) ne0*ne1);
+    const long i1 = (i - i3*ne0*ne1*ne2 - i2*ne0*ne1)/ne0;
+    const long i0 = i - i3*ne0*ne1*ne2 - i2*ne0*ne1 - i1*ne0;
+
+    STORE_FUNC(dst + offsetd + i0*nb0 + i1*nb1 + i2*nb2 + i3*nb3, LOAD_FUNC(src0 + offset0 + i00*nb00 + i01*nb01 + i02*nb02 + i03*nb03));
+}
+);
+
+std::string get_rows_template = MULTILINE_QUOTE(
+__kernel void KERNEL_NAME(__global const char * src0, const ulong offset0, __global const char * src1, const ulong offset1, __global char * dst, const ulong offsetd,
+        const ulong nb00, const ulong nb01, const ulong nb02, const ulong nb03,
+        const int ne11, const ulong nb10, const ulong nb11, const ulong nb12,
+        const ulong nb1, const ulong nb2, const ulong nb3) {
+    const int i00 = get_global_id(0);
+    const int i10 = get_global_id(1);
+    const int i11 = get_global_id(2) % ne11;
+    const int i12 = get_global_id(2) / ne11;
+
+    const int i01 = *(__global const int *) (src1 + offset1 + i10*nb10 + i11*nb11 + i12*nb12);
+
+    store_f32(dst + offsetd + i00*sizeof(float) + i10*nb1 + i11*nb2 + i12*nb3, LOAD_FUNC(src0 + offset0 + i00*nb00 + i01*nb01 + i11*nb02 + i12*nb03));
+}
+);
+
 #define CL_CHECK(err)                                               \
     do {                                                            \
         cl_int err_ = (err);                                        \
@@ -847,6 +1110,41 @@ std::array<std::string, 2> mul_str_values = {
     "mul_f32", "float"
 };
 
+std::array<std::string, 2> binary_str_keys = {
+    "KERNEL_NAME", "OP"
+};
+std::array<std::string, 4> binary_str_values = {
+    "kernel_add_f32", "+",
+    "kernel_mul_f32", "*"
+};
+
+std::array<std::string, 2> unary_str_keys = {
+    "KERNEL_NAME", "OP"
+};
+std::array<std::string, 6> unary_str_values = {
+    "kernel_gelu_f32", "0.5f*x*(1.0f + tanh(0.7978845608f*x*(1.0f + 0.044715f*x*x)))",
+    "kernel_silu_f32", "x/(1.0f + exp(-x))",
+    "kernel_relu_f32", "fmax(x, 0.0f)"
+};
+
+std::array<std::string, 3> cpy_str_keys = {
+    "KERNEL_NAME", "LOAD_FUNC", "STORE_FUNC"
+};
+std::array<std::string, 12> cpy_str_values = {
+    "kernel_cpy_f32_f32", "load_f32", "store_f32",
+    "kernel_cpy_f32_f16", "load_f32", "store_f16",
+    "kernel_cpy_f16_f32", "load_f16", "store_f32",
+    "kernel_cpy_f16_f16", "load_f16", "store_f16"
+};
+
+std::array<std::string, 2> get_rows_str_keys = {
+    "KERNEL_NAME", "LOAD_FUNC"
+};
+std::array<std::string, 4> get_rows_str_values = {
+    "kernel_get_rows_f32", "load_f32",
+    "kernel_get_rows_f16", "load_f16"
+};
+
 static std::string& replace(std::string& s, const std::string& from, const std::string& to) {
     size_t pos = 0;
     while ((pos = s.find(from, pos)) != std::string::npos) {
@@ -856,6 +1154,19 @@ static std::string& replace(std::string& s, const std::string& from, const std::
     return s;
 }
 
+// one kernel per row of values, the values replace the keys in the order of the keys
+static std::string generate_kernels_from_template(const std::string & tmpl, const std::string * keys, size_t n_keys, const std::string * values, size_t n_values) {
+    std::stringstream src;
+    for (size_t i = 0; i < n_values; i += n_keys) {
+        std::string kernel = tmpl;
+        for (size_t j = 0; j < n_keys; j++) {
+            replace(kernel, keys[j], values[i + j]);
+        }
+        src << kernel << '\n';
+    }
+    return src.str();
+}
+
 static std::string generate_kernels() {
     std::stringstream src;
     src << program_source << '\n';
@@ -877,6 +1188,11 @@ static std::string generate_kernels() {
         }
         src << mul_kernel << '\n';
     }
+    src << backend_source << '\n';
+    src << generate_kernels_from_template(binary_template,   binary_str_keys.data(),   binary_str_keys.size(),   binary_str_values.data(),   binary_str_values.size());
+    src << generate_kernels_from_template(unary_template,    unary_str_keys.data(),    unary_str_keys.size(),    unary_str_values.data(),    unary_str_values.size());
+    src << generate_kernels_from_template(cpy_template,      cpy_str_keys.data(),      cpy_str_keys.size(),      cpy_str_values.data(),      cpy_str_values.size());
+    src << generate_kernels_from_template(get_rows_template, get_rows_str_keys.data(), get_rows_str_keys.size(), get_rows_str_values.data(), get_rows_str_values.size());
 
     return src.str();
 }
@@ -894,6 +1210,14 @@ static cl_kernel dequantize_mul_mat_vec_q2_K_cl, dequantize_mul_mat_vec_q3_K_cl,
 static cl_kernel mul_f32_cl;
 static bool fp16_support;
 
+// the ggml-backend interface runs everything on its own in-order queue
+static cl_command_queue backend_queue;
+static cl_kernel kernel_add_f32_cl, kernel_mul_f32_cl, kernel_scale_f32_cl;
+static cl_kernel kernel_norm_f32_cl, kernel_rms_norm_f32_cl, kernel_soft_max_f32_cl, kernel_rope_f32_cl, kernel_diag_mask_inf_f32_cl;
+static cl_kernel kernel_gelu_f32_cl, kernel_silu_f32_cl, kernel_relu_f32_cl;
+static cl_kernel kernel_cpy_f32_f32_cl, kernel_cpy_f32_f16_cl, kernel_cpy_f16_f32_cl, kernel_cpy_f16_f16_cl;
+static cl_kernel kernel_get_rows_f32_cl, kernel_get_rows_f16_cl;
+
 static cl_program build_program_from_source(cl_context ctx, cl_device_id dev, const char* program_buffer) {
     cl_program p;
     char *program_log;
@@ -929,6 +1253,11 @@ static cl_program build_program_from_source(cl_context ctx, cl_device_id dev, co
 }
 
 void ggml_cl_init(void) {
+    if (context != NULL) {
+        // already initialized, by ggml_init or by the backend
+        return;
+    }
+
     cl_int err;
 
     struct cl_device;
@@ -1143,6 +1472,27 @@ void ggml_cl_init(void) {
 
     // mul kernel
     CL_CHECK((mul_f32_cl = clCreateKernel(program, "mul_f32", &err), err));
+
+    // backend queue and kernels
+    CL_CHECK((backend_queue = clCreateCommandQueue(context, device, 0, &err), err));
+
+    CL_CHECK((kernel_add_f32_cl           = clCreateKernel(program, "kernel_add_f32",           &err), err));
+    CL_CHECK((kernel_mul_f32_cl           = clCreateKernel(program, "kernel_mul_f32",           &err), err));
+    CL_CHECK((kernel_scale_f32_cl         = clCreateKernel(program, "kernel_scale_f32",         &err), err));
+    CL_CHECK((kernel_norm_f32_cl          = clCreateKernel(program, "kernel_norm_f32",          &err), err));
+    CL_CHECK((kernel_rms_norm_f32_cl      = clCreateKernel(program, "kernel_rms_norm_f32",      &err), err));
+    CL_CHECK((kernel_soft_max_f32_cl      = clCreateKernel(program, "kernel_soft_max_f32",      &err), err));
+    CL_CHECK((kernel_rope_f32_cl          = clCreateKernel(program, "kernel_rope_f32",          &err), err));
+    CL_CHECK((kernel_diag_mask_inf_f32_cl = clCreateKernel(program, "kernel_diag_mask_inf_f32", &err), err));
+    CL_CHECK((kernel_gelu_f32_cl          = clCreateKernel(program, "kernel_gelu_f32",          &err), err));
+    CL_CHECK((kernel_silu_f32_cl          = clCreateKernel(program, "kernel_silu_f32",          &err), err));
+    CL_CHECK((kernel_relu_f32_cl          = clCreateKernel(program, "kernel_relu_f32",          &err), err));
+    CL_CHECK((kernel_cpy_f32_f32_cl       = clCreateKernel(program, "kernel_cpy_f32_f32",       &err), err));
+    CL_CHECK((kernel_cpy_f32_f16_cl       = clCreateKernel(program, "kernel_cpy_f32_f16",       &err), err));
+    CL_CHECK((kernel_cpy_f16_f32_cl       = clCreateKernel(program, "kernel_cpy_f16_f32",       &err), err));
+    CL_CHECK((kernel_cpy_f16_f16_cl       = clCreateKernel(program, "kernel_cpy_f16_f16",       &err), err));
+    CL_CHECK((kernel_get_rows_f32_cl      = clCreateKernel(program, "kernel_get_rows_f32",      &err), err));
+    CL_CHECK((kernel_get_rows_f16_cl      = clCreateKernel(program, "kernel_get_rows_f16",      &err), err));
 }
 
 static cl_kernel* ggml_get_to_fp32_cl(ggml_type type) {
@@ -1895,3 +2245,816 @@ void ggml_cl_transform_tensor(void * data, ggml_tensor * tensor) {
     tensor->extra = dst;
     GGML_ASSERT(tensor->backend == GGML_BACKEND_GPU);
 }
+
+////////////////////////////////////////////////////////////////////////////////
+
+// backend interface
+
+#define GGML_OPENCL_NAME "OpenCL"
+
+// the tensors of a buffer are sub-allocated from a single cl_mem: their data pointers are
+// offsets from a fake base address, and the kernels take the buffer and the byte offset
+static void * const g_cl_buffer_base = (void *) 0x1000;
+
+struct ggml_backend_opencl_buffer_context {
+    cl_mem mem;
+};
+
+static cl_mem ggml_cl_tensor_mem(const ggml_tensor * tensor) {
+    ggml_backend_buffer_t buffer = tensor->view_src != nullptr ? tensor->view_src->buffer : tensor->buffer;
+    GGML_ASSERT(buffer != nullptr && buffer->buft == ggml_backend_opencl_buffer_type() && "tensor not in an OpenCL buffer");
+
+    return ((ggml_backend_opencl_buffer_context *) buffer->context)->mem;
+}
+
+static cl_ulong ggml_cl_tensor_offset(const ggml_tensor * tensor) {
+    return (cl_ulong) ((const char *) tensor->data - (const char *) g_cl_buffer_base);
+}
+
+// opencl buffer
+
+static void ggml_backend_opencl_buffer_free_buffer(ggml_backend_buffer_t buffer) {
+    ggml_backend_opencl_buffer_context * ctx = (ggml_backend_opencl_buffer_context *) buffer->context;
+    CL_CHECK(clReleaseMemObject(ctx->mem));
+    delete ctx;
+}
+
+static void * ggml_backend_opencl_buffer_get_base(ggml_backend_buffer_t buffer) {
+    return g_cl_buffer_base;
+
+    GGML_UNUSED(buffer);
+}
+
+static void ggml_backend_opencl_buffer_init_tensor(ggml_backend_buffer_t buffer, ggml_tensor * tensor) {
+    tensor->backend = GGML_BACKEND_GPU;
+
+    GGML_UNUSED(buffer);
+}
+
+static void ggml_backend_opencl_buffer_set_tensor(ggml_backend_buffer_t buffer, ggml_tensor * tensor, const void * data, size_t offset, size_t size) {
+    ggml_backend_opencl_buffer_context * ctx = (ggml_backend_opencl_buffer_context *) buffer->context;
+
+    CL_CHECK(clEnqueueWriteBuffer(backend_queue, ctx->mem, CL_TRUE, ggml_cl_tensor_offset(tensor) + offset, size, data, 0, NULL, NULL));
+}
+
+static void ggml_backend_opencl_buffer_get_tensor(ggml_backend_buffer_t buffer, const ggml_tensor * tensor, void * data, size_t offset, size_t size) {
+    ggml_backend_opencl_buffer_context * ctx = (ggml_backend_opencl_buffer_context *) buffer->context;
+
+    CL_CHECK(clEnqueueReadBuffer(backend_queue, ctx->mem, CL_TRUE, ggml_cl_tensor_offset(tensor) + offset, size, data, 0, NULL, NULL));
+}
+
+static struct ggml_backend_buffer_i opencl_backend_buffer_interface = {
+    /* .free_buffer     = */ ggml_backend_opencl_buffer_free_buffer,
+    /* .get_base        = */ ggml_backend_opencl_buffer_get_base,
+    /* .init_tensor     = */ ggml_backend_opencl_buffer_init_tensor,
+    /* .set_tensor      = */ ggml_backend_opencl_buffer_set_tensor,
+    /* .get_tensor      = */ ggml_backend_opencl_buffer_get_tensor,
+    /* .cpy_tensor_from = */ NULL,
+    /* .cpy_tensor_to   = */ NULL,
+};
+
+// opencl buffer type
+
+static ggml_backend_buffer_t ggml_backend_opencl_buffer_type_alloc_buffer(ggml_backend_buffer_type_t buft, size_t size) {
+    ggml_cl_init();
+
+    size = std::max(size, (size_t) 1); // clCreateBuffer fails for size 0
+
+    cl_int err;
+    cl_mem mem;
+    CL_CHECK((mem = clCreateBuffer(context, CL_MEM_READ_WRITE, size, NULL, &err), err));
+
+    ggml_backend_opencl_buffer_context * ctx = new ggml_backend_opencl_buffer_context { mem };
+
+    return ggml_backend_buffer_init(buft, opencl_backend_buffer_interface, ctx, size);
+}
+
+static size_t ggml_backend_opencl_buffer_type_get_alignment(ggml_backend_buffer_type_t buft) {
+    return 128;
+
+    GGML_UNUSED(buft);
+}
+
+static bool ggml_backend_opencl_buffer_type_supports_backend(ggml_backend_buffer_type_t buft, ggml_backend_t backend) {
+    return ggml_backend_is_opencl(backend);
+
+    GGML_UNUSED(buft);
+}
+
+static ggml_backend_buffer_type_i opencl_backend_buffer_type_interface = {
+    /* .alloc_buffer     = */ ggml_backend_opencl_buffer_type_alloc_buffer,
+    /* .get_alignment    = */ ggml_backend_opencl_buffer_type_get_alignment,
+    /* .get_alloc_size   = */ NULL, // defaults to ggml_nbytes
+    /* .supports_backend = */ ggml_backend_opencl_buffer_type_supports_backend,
+};
+
+ggml_backend_buffer_type_t ggml_backend_opencl_buffer_type(void) {
+    static struct ggml_backend_buffer_type ggml_backend_buffer_type_opencl = {
+        /* .iface    = */ opencl_backend_buffer_type_interface,
+        /* .context  = */ nullptr,
+    };
+
+    return &ggml_backend_buffer_type_opencl;
+}
+
+// ops
+
+// device memory of the intermediate results of mul_mat, grown on demand
+// the queue is in order, so a released buffer is only freed after the kernels that use it
+struct ggml_cl_scratch {
+    cl_mem mem = nullptr;
+    size_t size = 0;
+
+    cl_mem reserve(size_t needed) {
+        if (needed > size) {
+            if (mem != nullptr) {
+                CL_CHECK(clReleaseMemObject(mem));
+            }
+            cl_int err;
+            CL_CHECK((mem = clCreateBuffer(context, CL_MEM_READ_WRITE, needed, NULL, &err), err));
+            size = needed;
+        }
+        return mem;
+    }
+
+    ~ggml_cl_scratch() {
+        if (mem != nullptr) {
+            clReleaseMemObject(mem);
+        }
+    }
+};
+
+struct ggml_backend_opencl_context {
+    ggml_cl_scratch scratch_x; // src0 converted to f32
+    ggml_cl_scratch scratch_q; // src0 moved to an offset that is a multiple of its block size
+    ggml_cl_scratch scratch_y; // src1 column of the matrix vector kernels
+    ggml_cl_scratch scratch_d; // dst column of the matrix vector kernels
+};
+
+// a __local kernel argument
+struct ggml_cl_local_mem {
+    size_t size;
+};
+
+static void ggml_cl_set_kernel_args(cl_kernel kernel, cl_uint index) {
+    GGML_UNUSED(kernel);
+    GGML_UNUSED(index);
+}
+
+template <typename... Args>
+static void ggml_cl_set_kernel_args(cl_kernel kernel, cl_uint index, const ggml_cl_local_mem & arg, const Args &... args);
+
+// the argument types must match the kernel exactly: cl_mem, cl_int, cl_ulong or cl_float
+template <typename T, typename... Args>
+static void ggml_cl_set_kernel_args(cl_kernel kernel, cl_uint index, const T & arg, const Args &... args) {
+    CL_CHECK(clSetKernelArg(kernel, index, sizeof(T), &arg));
+    ggml_cl_set_kernel_args(kernel, index + 1, args...);
+}
+
+template <typename... Args>
+static void ggml_cl_set_kernel_args(cl_kernel kernel, cl_uint index, const ggml_cl_local_mem & arg, const Args &... args) {
+    CL_CHECK(clSetKernelArg(kernel, index, arg.size, NULL));
+    ggml_cl_set_kernel_args(kernel, index + 1, args...);
+}
+
+static void ggml_cl_enqueue(cl_kernel kernel, cl_uint work_dim, const size_t * global, const size_t * local) {
+    CL_CHECK(clEnqueueNDRangeKernel(backend_queue, kernel, work_dim, NULL, global, local, 0, NULL, NULL));
+}
+
+static cl_kernel ggml_cl_get_cpy_kernel(ggml_type src_type, ggml_type dst_type) {
+    if (src_type == GGML_TYPE_F32) {
+        return dst_type == GGML_TYPE_F32 ? kernel_cpy_f32_f32_cl : kernel_cpy_f32_f16_cl;
+    }
+    return dst_type == GGML_TYPE_F32 ? kernel_cpy_f16_f32_cl : kernel_cpy_f16_f16_cl;
+}
+
+static void ggml_cl_cpy(
+        cl_kernel kernel,
+        cl_mem src, cl_ulong src_offset, const int64_t * src_ne, const size_t * src_nb,
+        cl_mem dst, cl_ulong dst_offset, const int64_t * dst_ne, const size_t * dst_nb) {
+    ggml_cl_set_kernel_args(kernel, 0,
+        src, src_offset, dst, dst_offset,
+        (cl_int) src_ne[0], (cl_int) src_ne[1], (cl_int) src_ne[2],
+        (cl_ulong) src_nb[0], (cl_ulong) src_nb[1], (cl_ulong) src_nb[2], (cl_ulong) src_nb[3],
+        (cl_int) dst_ne[0], (cl_int) dst_ne[1], (cl_int) dst_ne[2],
+        (cl_ulong) dst_nb[0], (cl_ulong) dst_nb[1], (cl_ulong) dst_nb[2], (cl_ulong) dst_nb[3]);
+
+    const size_t global = src_ne[0]*src_ne[1]*src_ne[2]*src_ne[3];
+    ggml_cl_enqueue(kernel, 1, &global, NULL);
+}
+
+static void ggml_cl_op_cpy(const ggml_tensor * src0, ggml_tensor * dst) {
+    GGML_ASSERT(ggml_nelements(src0) == ggml_nelements(dst));
+
+    ggml_cl_cpy(ggml_cl_get_cpy_kernel(src0->type, dst->type),
+        ggml_cl_tensor_mem(src0), ggml_cl_tensor_offset(src0), src0->ne, src0->nb,
+        ggml_cl_tensor_mem(dst),  ggml_cl_tensor_offset(dst),  dst->ne,  dst->nb);
+}
+
+static void ggml_cl_op_binary(cl_kernel kernel, ggml_tensor * dst) {
+    const ggml_tensor * src0 = dst->src[0];
+    const ggml_tensor * src1 = dst->src[1];
+
+    GGML_TENSOR_BINARY_OP_LOCALS
+
+    ggml_cl_set_kernel_args(kernel, 0,
+        ggml_cl_tensor_mem(src0), ggml_cl_tensor_offset(src0),
+        ggml_cl_tensor_mem(src1), ggml_cl_tensor_offset(src1),
+        ggml_cl_tensor_mem(dst),  ggml_cl_tensor_offset(dst),
+        (cl_int) ne2, (cl_ulong) nb00, (cl_ulong) nb01, (cl_ulong) nb02, (cl_ulong) nb03,
+        (cl_int) ne10, (cl_int) ne11, (cl_int) ne12, (cl_int) ne13,
+        (cl_ulong) nb10, (cl_ulong) nb11, (cl_ulong) nb12, (cl_ulong) nb13,
+        (cl_ulong) nb0, (cl_ulong) nb1, (cl_ulong) nb2, (cl_ulong) nb3);
+
+    const size_t global[3] = { (size_t) ne0, (size_t) ne1, (size_t) (ne2*ne3) };
+    ggml_cl_enqueue(kernel, 3, global, NULL);
+}
+
+static void ggml_cl_op_unary(cl_kernel kernel, ggml_tensor * dst) {
+    const ggml_tensor * src0 = dst->src[0];
+
+    ggml_cl_set_kernel_args(kernel, 0,
+        ggml_cl_tensor_mem(src0), ggml_cl_tensor_offset(src0),
+        ggml_cl_tensor_mem(dst),  ggml_cl_tensor_offset(dst));
+
+    const size_t global = ggml_nelements(dst);
+    ggml_cl_enqueue(kernel, 1, &global, NULL);
+}
+
+static void ggml_cl_op_scale(ggml_tensor * dst) {
+    const ggml_tensor * src0 = dst->src[0];
+    const ggml_tensor * src1 = dst->src[1];
+
+    ggml_cl_set_kernel_args(kernel_scale_f32_cl, 0,
+        ggml_cl_tensor_mem(src0), ggml_cl_tensor_offset(src0),
+        ggml_cl_tensor_mem(src1), ggml_cl_tensor_offset(src1),
+        ggml_cl_tensor_mem(dst),  ggml_cl_tensor_offset(dst));
+
+    const size_t global = ggml_nelements(dst);
+    ggml_cl_enqueue(kernel_scale_f32_cl, 1, &global, NULL);
+}
+
+static void ggml_cl_op_norm(cl_kernel kernel, ggml_tensor * dst) {
+    const ggml_tensor * src0 = dst->src[0];
+
+    GGML_TENSOR_UNARY_OP_LOCALS
+
+    float eps;
+    memcpy(&eps, dst->op_params, sizeof(float));
+
+    ggml_cl_set_kernel_args(kernel, 0,
+        ggml_cl_tensor_mem(src0), ggml_cl_tensor_offset(src0),
+        ggml_cl_tensor_mem(dst),  ggml_cl_tensor_offset(dst),
+        (cl_int) ne00, (cl_int) ne01, (cl_int) ne02, (cl_ulong) nb01, (cl_ulong) nb02, (cl_ulong) nb03,
+        (cl_float) eps, ggml_cl_local_mem { sizeof(float)*CL_ROW_LOCAL_SIZE });
+
+    const size_t local  = CL_ROW_LOCAL_SIZE;
+    const size_t global = ggml_nrows(src0)*local;
+    ggml_cl_enqueue(kernel, 1, &global, &local);
+}
+
+static void ggml_cl_op_soft_max(ggml_tensor * dst) {
+    const ggml_tensor * src0 = dst->src[0];
+    const ggml_tensor * src1 = dst->src[1]; // optional mask
+
+    float scale;
+    memcpy(&scale, dst->op_params, sizeof(float));
+
+    const ggml_tensor * mask = src1 != nullptr ? src1 : src0;
+
+    ggml_cl_set_kernel_args(kernel_soft_max_f32_cl, 0,
+        ggml_cl_tensor_mem(src0), ggml_cl_tensor_offset(src0),
+        ggml_cl_tensor_mem(mask), ggml_cl_tensor_offset(mask),
+        ggml_cl_tensor_mem(dst),  ggml_cl_tensor_offset(dst),
+        (cl_int) src0->ne[0], (cl_ulong) src0->nb[1], (cl_int) mask->ne[1], (cl_ulong) mask->nb[1],
+        (cl_int) (src1 != nullptr), (cl_float) scale, ggml_cl_local_mem { sizeof(float)*CL_ROW_LOCAL_SIZE });
+
+    const size_t local  = CL_ROW_LOCAL_SIZE;
+    const size_t global = ggml_nrows(src0)*local;
+    ggml_cl_enqueue(kernel_soft_max_f32_cl, 1, &global, &local);
+}
+
+static void ggml_cl_op_rope(ggml_tensor * dst) {
+    const ggml_tensor * src0 = dst->src[0];
+    const ggml_tensor * src1 = dst->src[1]; // positions
+
+    GGML_TENSOR_UNARY_OP_LOCALS
+
+    const int n_dims = ((int32_t *) dst->op_params)[1];
+    const int mode   = ((int32_t *) dst->op_params)[2];
+
+    float freq_base;
+    float freq_scale;
+    float attn_factor;
+    memcpy(&freq_base,   (int32_t *) dst->op_params + 5, sizeof(float));
+    memcpy(&freq_scale,  (int32_t *) dst->op_params + 6, sizeof(float));
+    memcpy(&attn_factor, (int32_t *) dst->op_params + 8, sizeof(float));
+
+    ggml_cl_set_kernel_args(kernel_rope_f32_cl, 0,
+        ggml_cl_tensor_mem(src0), ggml_cl_tensor_offset(src0),
+        ggml_cl_tensor_mem(src1), ggml_cl_tensor_offset(src1),
+        ggml_cl_tensor_mem(dst),  ggml_cl_tensor_offset(dst),
+        (cl_int) ne2, (cl_ulong) nb01, (cl_ulong) nb02, (cl_ulong) nb03, (cl_ulong) nb1, (cl_ulong) nb2, (cl_ulong) nb3,
+        (cl_int) n_dims, (cl_int) ((mode & 2) != 0), (cl_float) freq_base, (cl_float) freq_scale, (cl_float) attn_factor);
+
+    const size_t global[3] = { (size_t) ne0/2, (size_t) ne1, (size_t) (ne2*ne3) };
+    ggml_cl_enqueue(kernel_rope_f32_cl, 3, global, NULL);
+}
+
+static void ggml_cl_op_diag_mask_inf(ggml_tensor * dst) {
+    const ggml_tensor * src0 = dst->src[0];
+
+    const int n_past = ((int32_t *) dst->op_params)[0];
+
+    ggml_cl_set_kernel_args(kernel_diag_mask_inf_f32_cl, 0,
+        ggml_cl_tensor_mem(src0), ggml_cl_tensor_offset(src0),
+        ggml_cl_tensor_mem(dst),  ggml_cl_tensor_offset(dst),
+        (cl_int) src0->ne[0], (cl_int) src0->ne[1], (cl_int) n_past);
+
+    const size_t global[3] = { (size_t) src0->ne[0], (size_t) src0->ne[1], (size_t) (ggml_nrows(src0)/src0->ne[1]) };
+    ggml_cl_enqueue(kernel_diag_mask_inf_f32_cl, 3, global, NULL);
+}
+
+static void ggml_cl_op_get_rows(ggml_tensor * dst) {
+    const ggml_tensor * src0 = dst->src[0];
+    const ggml_tensor * src1 = dst->src[1];
+
+    GGML_TENSOR_BINARY_OP_LOCALS
+
+    cl_kernel kernel = src0->type == GGML_TYPE_F16 ? kernel_get_rows_f16_cl : kernel_get_rows_f32_cl;
+
+    ggml_cl_set_kernel_args(kernel, 0,
+        ggml_cl_tensor_mem(src0), ggml_cl_tensor_offset(src0),
+        ggml_cl_tensor_mem(src1), ggml_cl_tensor_offset(src1),
+        ggml_cl_tensor_mem(dst),  ggml_cl_tensor_offset(dst),
+        (cl_ulong) nb00, (cl_ulong) nb01, (cl_ulong) nb02, (cl_ulong) nb03,
+        (cl_int) ne11, (cl_ulong) nb10, (cl_ulong) nb11, (cl_ulong) nb12,
+        (cl_ulong) nb1, (cl_ulong) nb2, (cl_ulong) nb3);
+
+    const size_t global[3] = { (size_t) ne00, (size_t) ne10, (size_t) (ne11*ne12) };
+    ggml_cl_enqueue(kernel, 3, global, NULL);
+}
+
+// same kernels as ggml_cl_mul_mat_q_f32, but the operands stay in device memory:
+// matrix vector products dequantize src0 on the fly, the others convert src0 to f32 and use CLBlast
+static void ggml_cl_op_mul_mat(ggml_backend_opencl_context * ctx, ggml_tensor * dst) {
+    const ggml_tensor * src0 = dst->src[0];
+    const ggml_tensor * src1 = dst->src[1];
+
+    GGML_TENSOR_BINARY_OP_LOCALS
+
+    const ggml_type type = src0->type;
+
+    const int64_t r2 = ne12 / ne02;
+    const int64_t r3 = ne13 / ne03;
+
+    const cl_mem   mem0 = ggml_cl_tensor_mem(src0);
+    const cl_ulong off0 = ggml_cl_tensor_offset(src0);
+    const cl_mem   mem1 = ggml_cl_tensor_mem(src1);
+    const cl_ulong off1 = ggml_cl_tensor_offset(src1);
+    const cl_mem   memd = ggml_cl_tensor_mem(dst);
+    const cl_ulong offd = ggml_cl_tensor_offset(dst);
+
+    const int64_t x_ne  = ne01 * ne00;
+    const int64_t x_bps = x_ne / ggml_blck_size(type); // blocks per 2D slice
+    const size_t  q_sz  = ggml_type_size(type) * x_bps;
+
+    const bool mul_mat_vec = ne11 == 1 && ne00%2 == 0 && type != GGML_TYPE_F32 && ggml_is_contiguous(src0);
+
+    for (int64_t i03 = 0; i03 < ne03; i03++) {
+        for (int64_t i02 = 0; i02 < ne02; i02++) {
+            const cl_ulong offs0 = off0 + i02*nb02 + i03*nb03;
+
+            // the dequantize kernels take the offset of the slice in blocks
+            cl_mem d_Q      = mem0;
+            size_t q_offset = 0;
+            if (mul_mat_vec || ggml_is_quantized(type)) {
+                const size_t ts = ggml_type_size(type);
+                if (offs0 % ts == 0) {
+                    q_offset = offs0 / ts;
+                } else {
+                    d_Q = ctx->scratch_q.reserve(q_sz);
+                    CL_CHECK(clEnqueueCopyBuffer(backend_queue, mem0, d_Q, offs0, 0, q_sz, 0, NULL, NULL));
+                }
+            }
+
+            if (mul_mat_vec) {
+                cl_kernel dmmv = *ggml_get_dequantize_mul_mat_vec_cl(type);
+
+                const size_t local  = CL_DMMV_LOCAL_SIZE;
+                const size_t global = ne01 * local;
+                const cl_int ncols  = ne00;
+
+                // the kernels read src1 and write dst at the start of their buffers
+                cl_mem d_Y = ctx->scratch_y.reserve(sizeof(float) * ne10);
+                cl_mem d_D = ctx->scratch_d.reserve(sizeof(float) * ne01);
+
+                for (int64_t i13 = i03 * r3, e13 = i13 + r3; i13 < e13; i13++) {
+                    for (int64_t i12 = i02 * r2, e12 = i12 + r2; i12 < e12; i12++) {
+                        CL_CHECK(clEnqueueCopyBuffer(backend_queue, mem1, d_Y, off1 + i12*nb12 + i13*nb13, 0, sizeof(float) * ne10, 0, NULL, NULL));
+
+                        ggml_cl_set_kernel_args(dmmv, 0, d_Q, ggml_cl_local_mem { sizeof(float) * local }, d_Y, d_D, ncols);
+                        CL_CHECK(clEnqueueNDRangeKernel(backend_queue, dmmv, 1, &q_offset, &global, &local, 0, NULL, NULL));
+
+                        CL_CHECK(clEnqueueCopyBuffer(backend_queue, d_D, memd, 0, offd + i12*nb2 + i13*nb3, sizeof(float) * ne01, 0, NULL, NULL));
+                    }
+                }
+                continue;
+            }
+
+            // src0 slice as a column-major f32 matrix
+            cl_mem d_X      = mem0;
+            size_t x_offset = offs0 / sizeof(float);
+            size_t ldx      = std::max((size_t) ne00, nb01 / sizeof(float));
+
+            if (type == GGML_TYPE_F32 && nb00 == sizeof(float) && nb01 % sizeof(float) == 0) {
+                // used in place
+            } else if (ggml_is_quantized(type)) {
+                d_X      = ctx->scratch_x.reserve(sizeof(float) * x_ne);
+                x_offset = 0;
+                ldx      = ne00;
+
+                cl_kernel to_fp32_cl = *ggml_get_to_fp32_cl(type);
+
+                const size_t global = x_ne / ggml_cl_global_denom(type);
+                const size_t local  = ggml_cl_local_size(type);
+
+                ggml_cl_set_kernel_args(to_fp32_cl, 0, d_Q, d_X);
+                CL_CHECK(clEnqueueNDRangeKernel(backend_queue, to_fp32_cl, 1, &q_offset, &global, local > 0 ? &local : NULL, 0, NULL, NULL));
+            } else {
+                // f16, or f32 with strided rows
+                d_X      = ctx->scratch_x.reserve(sizeof(float) * x_ne);
+                x_offset = 0;
+                ldx      = ne00;
+
+                const int64_t ne[4] = { ne00, ne01, 1, 1 };
+                const size_t  nb[4] = { sizeof(float), sizeof(float) * ne00, sizeof(float) * x_ne, sizeof(float) * x_ne };
+
+                ggml_cl_cpy(ggml_cl_get_cpy_kernel(type, GGML_TYPE_F32), mem0, offs0, ne, src0->nb, d_X, 0, ne, nb);
+            }
+
+            for (int64_t i13 = i03 * r3, e13 = i13 + r3; i13 < e13; i13++) {
+                for (int64_t i12 = i02 * r2, e12 = i12 + r2; i12 < e12; i12++) {
+                    const size_t y_offset = (off1 + i12*nb12 + i13*nb13) / sizeof(float);
+                    const size_t d_offset = (offd + i12*nb2  + i13*nb3)  / sizeof(float);
+
+                    clblast::StatusCode status = clblast::Gemm<cl_float>(clblast::Layout::kColMajor,
+                                                               clblast::Transpose::kYes, clblast::Transpose::kNo,
+                                                               ne01, ne11, ne10,
+                                                               1.0f,
+                                                               d_X, x_offset, ldx,
+                                                               mem1, y_offset, std::max((size_t) ne10, nb11 / sizeof(float)),
+                                                               0.0f,
+                                                               memd, d_offset, ne01,
+                                                               &backend_queue, NULL);
+
+                    if (status != clblast::StatusCode::kSuccess) {
+                        GGML_ASSERT(false);
+                    }
+                }
+            }
+        }
+    }
+}
+
+// backend
+
+static const char * ggml_backend_opencl_name(ggml_backend_t backend) {
+    return GGML_OPENCL_NAME;
+
+    GGML_UNUSED(backend);
+}
+
+static void ggml_backend_opencl_free(ggml_backend_t backend) {
+    ggml_backend_opencl_context * ctx = (ggml_backend_opencl_context *) backend->context;
+
+    CL_CHECK(clFinish(backend_queue));
+
+    delete ctx;
+    delete backend;
+}
+
+static ggml_backend_buffer_type_t ggml_backend_opencl_get_default_buffer_type(ggml_backend_t backend) {
+    return ggml_backend_opencl_buffer_type();
+
+    GGML_UNUSED(backend);
+}
+
+static void ggml_backend_opencl_set_tensor_async(ggml_backend_t backend, ggml_tensor * tensor, const void * data, size_t offset, size_t size) {
+    GGML_ASSERT(offset + size <= ggml_nbytes(tensor) && "tensor write out of bounds");
+
+    CL_CHECK(clEnqueueWriteBuffer(backend_queue, ggml_cl_tensor_mem(tensor), CL_FALSE, ggml_cl_tensor_offset(tensor) + offset, size, data, 0, NULL, NULL));
+
+    GGML_UNUSED(backend);
+}
+
+static void ggml_backend_opencl_get_tensor_async(ggml_backend_t backend, const ggml_tensor * tensor, void * data, size_t offset, size_t size) {
+    GGML_ASSERT(offset + size <= ggml_nbytes(tensor) && "tensor read out of bounds");
+
+    CL_CHECK(clEnqueueReadBuffer(backend_queue, ggml_cl_tensor_mem(tensor), CL_FALSE, ggml_cl_tensor_offset(tensor) + offset, size, data, 0, NULL, NULL));
+
+    GGML_UNUSED(backend);
+}
+
+static bool ggml_backend_opencl_cpy_tensor_from_async(ggml_backend_t backend, ggml_tensor * src, ggml_tensor * dst) {
+    if (dst->buffer->buft != ggml_backend_opencl_buffer_type()) {
+        return false;
+    }
+
+    if (src->buffer->buft == ggml_backend_cpu_buffer_type()) {
+        CL_CHECK(clEnqueueWriteBuffer(backend_queue, ggml_cl_tensor_mem(dst), CL_FALSE, ggml_cl_tensor_offset(dst), ggml_nbytes(dst), src->data, 0, NULL, NULL));
+        return true;
+    }
+
+    if (src->buffer->buft == ggml_backend_opencl_buffer_type()) {
+        CL_CHECK(clEnqueueCopyBuffer(backend_queue, ggml_cl_tensor_mem(src), ggml_cl_tensor_mem(dst), ggml_cl_tensor_offset(src), ggml_cl_tensor_offset(dst), ggml_nbytes(dst), 0, NULL, NULL));
+        return true;
+    }
+
+    return false;
+
+    GGML_UNUSED(backend);
+}
+
+static bool ggml_backend_opencl_cpy_tensor_to_async(ggml_backend_t backend, ggml_tensor * src, ggml_tensor * dst) {
+    if (src->buffer->buft != ggml_backend_opencl_buffer_type() || dst->buffer->buft != ggml_backend_cpu_buffer_type()) {
+        return false;
+    }
+
+    CL_CHECK(clEnqueueReadBuffer(backend_queue, ggml_cl_tensor_mem(src), CL_FALSE, ggml_cl_tensor_offset(src), ggml_nbytes(src), dst->data, 0, NULL, NULL));
+
+    return true;
+
+    GGML_UNUSED(backend);
+}
+
+static void ggml_backend_opencl_synchronize(ggml_backend_t backend) {
+    CL_CHECK(clFinish(backend_queue));
+
+    GGML_UNUSED(backend);
+}
+
+static ggml_backend_graph_plan_t ggml_backend_opencl_graph_plan_create(ggml_backend_t backend, ggml_cgraph * cgraph) {
+    GGML_ASSERT(!"not implemented");
+
+    return nullptr;
+
+    GGML_UNUSED(backend);
+    GGML_UNUSED(cgraph);
+}
+
+static void ggml_backend_opencl_graph_plan_free(ggml_backend_t backend, ggml_backend_graph_plan_t plan) {
+    GGML_ASSERT(!"not implemented");
+
+    GGML_UNUSED(backend);
+    GGML_UNUSED(plan);
+}
+
+static void ggml_backend_opencl_graph_plan_compute(ggml_backend_t backend, ggml_backend_graph_plan_t plan) {
+    GGML_ASSERT(!"not implemented");
+
+    GGML_UNUSED(backend);
+    GGML_UNUSED(plan);
+}
+
+// the nodes are only enqueued, the activations stay in device memory until the caller reads them
+static void ggml_backend_opencl_graph_compute(ggml_backend_t backend, ggml_cgraph * cgraph) {
+    ggml_backend_opencl_context * ctx = (ggml_backend_opencl_context *) backend->context;
+
+    for (int i = 0; i < cgraph->n_nodes; i++) {
+        ggml_tensor * node = cgraph->nodes[i];
+
+        if (ggml_nelements(node) == 0) {
+            continue;
+        }
+
+        switch (node->op) {
+            case GGML_OP_NONE:
+            case GGML_OP_RESHAPE:
+            case GGML_OP_VIEW:
+            case GGML_OP_PERMUTE:
+            case GGML_OP_TRANSPOSE:
+                break;
+            case GGML_OP_DUP:
+            case GGML_OP_CONT:
+            case GGML_OP_CPY:
+                ggml_cl_op_cpy(node->src[0], node);
+                break;
+            case GGML_OP_ADD:
+                ggml_cl_op_binary(kernel_add_f32_cl, node);
+                break;
+            case GGML_OP_MUL:
+                ggml_cl_op_binary(kernel_mul_f32_cl, node);
+                break;
+            case GGML_OP_SCALE:
+                ggml_cl_op_scale(node);
+                break;
+            case GGML_OP_NORM:
+                ggml_cl_op_norm(kernel_norm_f32_cl, node);
+                break;
+            case GGML_OP_RMS_NORM:
+                ggml_cl_op_norm(kernel_rms_norm_f32_cl, node);
+                break;
+            case GGML_OP_SOFT_MAX:
+                ggml_cl_op_soft_max(node);
+                break;
+            case GGML_OP_ROPE:
+                ggml_cl_op_rope(node);
+                break;
+            case GGML_OP_DIAG_MASK_INF:
+                ggml_cl_op_diag_mask_inf(node);
+                break;
+            case GGML_OP_GET_ROWS:
+                ggml_cl_op_get_rows(node);
+                break;
+            case GGML_OP_MUL_MAT:
+                ggml_cl_op_mul_mat(ctx, node);
+                break;
+            case GGML_OP_UNARY:
+                switch (ggml_get_unary_op(node)) {
+                    case GGML_UNARY_OP_GELU:
+                        ggml_cl_op_unary(kernel_gelu_f32_cl, node);
+                        break;
+                    case GGML_UNARY_OP_SILU:
+                        ggml_cl_op_unary(kernel_silu_f32_cl, node);
+                        break;
+                    case GGML_UNARY_OP_RELU:
+                        ggml_cl_op_unary(kernel_relu_f32_cl, node);
+                        break;
+                    default:
+                        fprintf(stderr, "%s: unsupported op %s\n", __func__, ggml_op_desc(node));
+                        GGML_ASSERT(false);
+                }
+                break;
+            default:
+                fprintf(stderr, "%s: unsupported op %s\n", __func__, ggml_op_desc(node));
+                GGML_ASSERT(false);
+        }
+    }
+}
+
+static bool ggml_backend_opencl_supports_op(ggml_backend_t backend, const ggml_tensor * op) {
+    const ggml_tensor * src0 = op->src[0];
+    const ggml_tensor * src1 = op->src[1];
+
+    switch (op->op) {
+        case GGML_OP_NONE:
+        case GGML_OP_RESHAPE:
+        case GGML_OP_VIEW:
+        case GGML_OP_PERMUTE:
+        case GGML_OP_TRANSPOSE:
+            return true;
+        case GGML_OP_DUP:
+        case GGML_OP_CONT:
+        case GGML_OP_CPY:
+            return (src0->type == GGML_TYPE_F32 || src0->type == GGML_TYPE_F16) &&
+                   (op->type   == GGML_TYPE_F32 || op->type   == GGML_TYPE_F16);
+        case GGML_OP_ADD:
+        case GGML_OP_MUL:
+            return src0->type == GGML_TYPE_F32 && src1->type == GGML_TYPE_F32 && op->type == GGML_TYPE_F32;
+        case GGML_OP_SCALE:
+            return src0->type == GGML_TYPE_F32 && ggml_is_contiguous(src0) && ggml_is_contiguous(op);
+        case GGML_OP_NORM:
+        case GGML_OP_RMS_NORM:
+            return src0->type == GGML_TYPE_F32 && src0->nb[0] == sizeof(float) && ggml_is_contiguous(op);
+        case GGML_OP_SOFT_MAX:
+            return src0->type == GGML_TYPE_F32 && ggml_is_contiguous(src0) && ggml_is_contiguous(op) &&
+                   (src1 == nullptr || (src1->type == GGML_TYPE_F32 && src1->nb[0] == sizeof(float)));
+        case GGML_OP_ROPE:
+            {
+                const int n_dims = ((const int32_t *) op->op_params)[1];
+                const int mode   = ((const int32_t *) op->op_params)[2];
+
+                float ext_factor;
+                float xpos_base;
+                memcpy(&ext_factor, (const int32_t *) op->op_params +  7, sizeof(float));
+                memcpy(&xpos_base,  (const int32_t *) op->op_params + 11, sizeof(float));
+
+                // no GLM, YaRN or xPos
+                if (src0->type != GGML_TYPE_F32 || src0->nb[0] != sizeof(float) || op->nb[0] != sizeof(float) ||
+                    (mode & 4) || ext_factor != 0.0f || xpos_base != 0.0f || n_dims % 2 != 0 || src0->ne[0] % 2 != 0) {
+                    return false;
+                }
+                return !(mode & 2) || src0->ne[0] % n_dims == 0;
+            }
+        case GGML_OP_DIAG_MASK_INF:
+            return src0->type == GGML_TYPE_F32 && ggml_is_contiguous(src0) && ggml_is_contiguous(op);
+        case GGML_OP_GET_ROWS:
+            return (src0->type == GGML_TYPE_F32 || src0->type == GGML_TYPE_F16) && src1->type == GGML_TYPE_I32 && op->type == GGML_TYPE_F32;
+        case GGML_OP_MUL_MAT:
+            {
+                if (src1->type != GGML_TYPE_F32 || src1->nb[0] != sizeof(float) || op->type != GGML_TYPE_F32) {
+                    return false;
+                }
+                if (src1->ne[2] % src0->ne[2] != 0 || src1->ne[3] % src0->ne[3] != 0) {
+                    return false;
+                }
+                if (src0->type == GGML_TYPE_F32 || src0->type == GGML_TYPE_F16) {
+                    return true;
+                }
+                return ggml_is_contiguous(src0) && ggml_get_to_fp32_cl(src0->type) != nullptr;
+            }
+        case GGML_OP_UNARY:
+            switch (ggml_get_unary_op(op)) {
+                case GGML_UNARY_OP_GELU:
+                case GGML_UNARY_OP_SILU:
+                case GGML_UNARY_OP_RELU:
+                    return src0->type == GGML_TYPE_F32 && ggml_is_contiguous(src0) && ggml_is_contiguous(op);
+                default:
+                    return false;
+            }
+        default:
+            return false;
+    }
+
+    GGML_UNUSED(backend);
+}
+
+// there is a single in-order queue, so the events only matter to the host and to the other backends
+static ggml_backend_event_t ggml_backend_opencl_event_new(ggml_backend_t backend) {
+    return new ggml_backend_event {
+        /* .backend = */ backend,
+        /* .context = */ nullptr, // cl_event of the last record
+    };
+}
+
+static void ggml_backend_opencl_event_free(ggml_backend_event_t event) {
+    if (event->context != nullptr) {
+        CL_CHECK(clReleaseEvent((cl_event) event->context));
+    }
+
+    delete event;
+}
+
+static void ggml_backend_opencl_event_record(ggml_backend_event_t event) {
+    if (event->context != nullptr) {
+        CL_CHECK(clReleaseEvent((cl_event) event->context));
+    }
+
+    cl_event ev;
+    CL_CHECK(clEnqueueMarker(backend_queue, &ev));
+    event->context = ev;
+}
+
+static void ggml_backend_opencl_event_wait(ggml_backend_t backend, ggml_backend_event_t event) {
+    if (!ggml_backend_is_opencl(event->backend)) {
+        // the events of other backends cannot be waited for on the queue
+        ggml_backend_event_synchronize(event);
+    }
+
+    GGML_UNUSED(backend);
+}
+
+static void ggml_backend_opencl_event_synchronize(ggml_backend_event_t event) {
+    if (event->context != nullptr) {
+        cl_event ev = (cl_event) event->context;
+        CL_CHECK(clWaitForEvents(1, &ev));
+    }
+}
+
+static ggml_backend_i opencl_backend_i = {
+    /* .get_name                = */ ggml_backend_opencl_name,
+    /* .free                    = */ ggml_backend_opencl_free,
+    /* .get_default_buffer_type = */ ggml_backend_opencl_get_default_buffer_type,
+    /* .set_tensor_async        = */ ggml_backend_opencl_set_tensor_async,
+    /* .get_tensor_async        = */ ggml_backend_opencl_get_tensor_async,
+    /* .cpy_tensor_from_async   = */ ggml_backend_opencl_cpy_tensor_from_async,
+    /* .cpy_tensor_to_async     = */ ggml_backend_opencl_cpy_tensor_to_async,
+    /* .synchronize             = */ ggml_backend_opencl_synchronize,
+    /* .graph_plan_create       = */ ggml_backend_opencl_graph_plan_create,
+    /* .graph_plan_free         = */ ggml_backend_opencl_graph_plan_free,
+    /* .graph_plan_compute      = */ ggml_backend_opencl_graph_plan_compute,
+    /* .graph_compute           = */ ggml_backend_opencl_graph_compute,
+    /* .supports_op             = */ ggml_backend_opencl_supports_op,
+    /* .event_new               = */ ggml_backend_opencl_event_new,
+    /* .event_free              = */ ggml_backend_opencl_event_free,
+    /* .event_record            = */ ggml_backend_opencl_event_record,
+    /* .event_wait              = */ ggml_backend_opencl_event_wait,
+    /* .event_synchronize       = */ ggml_backend_opencl_event_synchronize,
+};
+
+ggml_backend_t ggml_backend_opencl_init(void) {
+    ggml_cl_init();
+
+    ggml_backend_opencl_context * ctx = new ggml_backend_opencl_context;
+
+    ggml_backend_t opencl_backend = new ggml_backend {
+        /* .interface = */ opencl_backend_i,
+        /* .context   = */ ctx
+    };
+
+    return opencl_backend;
+}
+
+bool ggml_backend_is_opencl(ggml_backend_t backend) {
+    return backend->iface.get_name == ggml_backend_opencl_name;
+}
+
+extern "C" ggml_backend_t ggml_backend_reg_opencl_init(const char * params, void * user_data);
+
+ggml_backend_t ggml_backend_reg_opencl_init(const char * params, void * user_data) {
+    return ggml_backend_opencl_init();
+
+    GGML_UNUSED(params);
+    GGML_UNUSED(user_data);
+}
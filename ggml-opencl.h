@@ -1,6 +1,7 @@
 #pragma once
 
 #include "ggml.h"
+#include "ggml-backend.h"
 
 #ifdef  __cplusplus
 extern "C" {
@@ -20,6 +21,14 @@ void ggml_cl_free_data(const struct ggml_tensor* tensor);
 
 void ggml_cl_transform_tensor(void * data, struct ggml_tensor * tensor);
 
+// backend API
+// the whole graph runs on the device, see ggml_backend_opencl_supports_op for the operations
+ggml_backend_t ggml_backend_opencl_init(void);
+
+bool ggml_backend_is_opencl(ggml_backend_t backend);
+
+ggml_backend_buffer_type_t ggml_backend_opencl_buffer_type(void);
+
 #ifdef  __cplusplus
 }
 #endif
@@ -120,10 +120,28 @@ static inline __m256 sum_i16_pairs_float(const __m256i x) {
     return _mm256_cvtepi32_ps(summed_pairs);
 }
 
+// VNNI dot products: AVX512-VNNI needs AVX512VL for the 256-bit forms, AVX-VNNI has them under the _avx_ names
+#if defined(__AVX512VNNI__) && defined(__AVX512VL__)
+#define GGML_MM256_DPBUSD(acc, x, y) _mm256_dpbusd_epi32(acc, x, y)
+#define GGML_MM256_DPWSSD(acc, x, y) _mm256_dpwssd_epi32(acc, x, y)
+#elif defined(__AVXVNNI__)
+#define GGML_MM256_DPBUSD(acc, x, y) _mm256_dpbusd_avx_epi32(acc, x, y)
+#define GGML_MM256_DPWSSD(acc, x, y) _mm256_dpwssd_avx_epi32(acc, x, y)
+#endif
+
+// multiply int16_t, add results pairwise and accumulate into acc
+static inline __m256i mul_add_i16_pairs(const __m256i acc, const __m256i x, const __m256i y) {
+#if defined(GGML_MM256_DPWSSD)
+    return GGML_MM256_DPWSSD(acc, x, y);
+#else
+    return _mm256_add_epi32(acc, _mm256_madd_epi16(x, y));
+#endif
+}
+
 static inline __m256 mul_sum_us8_pairs_float(const __m256i ax, const __m256i sy) {
-#if __AVXVNNI__
+#if defined(GGML_MM256_DPBUSD)
     const __m256i zero = _mm256_setzero_si256();
-    const __m256i summed_pairs = _mm256_dpbusd_epi32(zero, ax, sy);
+    const __m256i summed_pairs = GGML_MM256_DPBUSD(zero, ax, sy);
     return _mm256_cvtepi32_ps(summed_pairs);
 #else
     // Perform multiplication and create 16-bit values
@@ -2378,6 +2396,18 @@ void quantize_row_q8_K(const float * restrict x, void * restrict y, int k) {
     quantize_row_q8_K_reference(x, y, k);
 }
 
+void repack_rows_q4_0_x4(const block_q4_0 * restrict x, block_q4_0_x4 * restrict y, int k) {
+    assert(k % QK4_0 == 0);
+    const int nb = k / QK4_0;
+
+    for (int i = 0; i < nb; i++) {
+        for (int r = 0; r < NR4_0_X4; ++r) {
+            y[i].d[r] = x[r*nb + i].d;
+            memcpy(y[i].qs + r*QK4_0/2, x[r*nb + i].qs, QK4_0/2);
+        }
+    }
+}
+
 //===================================== Dot ptoducts =================================
 
 //
@@ -2733,6 +2763,104 @@ void ggml_vec_dot_q4_0_q8_0(int n, float * restrict s, const void * restrict vx,
 #endif
 }
 
+void ggml_vec_dot_q4_0_x4_q8_0(int n, float * restrict s, const void * restrict vx, const void * restrict vy) {
+    const int qk = QK8_0;
+    const int nb = n / qk;
+
+    assert(n % qk == 0);
+
+    const block_q4_0_x4 * restrict x = vx;
+    const block_q8_0    * restrict y = vy;
+
+#if defined(__ARM_NEON) && defined(__ARM_FEATURE_DOTPROD)
+    const uint8x16_t m4b = vdupq_n_u8(0x0F);
+    const int8x16_t  s8b = vdupq_n_s8(0x8);
+
+    float32x4_t sumv = vdupq_n_f32(0.0f);
+
+    for (int i = 0; i < nb; ++i) {
+        // the block of y stays in registers for the NR4_0_X4 rows
+        const int8x16_t v1_l = vld1q_s8(y[i].qs);
+        const int8x16_t v1_h = vld1q_s8(y[i].qs + 16);
+
+        int32x4_t p[NR4_0_X4];
+        for (int r = 0; r < NR4_0_X4; ++r) {
+            const uint8x16_t v0 = vld1q_u8(x[i].qs + r*QK4_0/2);
+
+            // 4-bit -> 8-bit, offset to [ -8 .. +7 ]
+            const int8x16_t v0_ls = vsubq_s8(vreinterpretq_s8_u8(vandq_u8  (v0, m4b)), s8b);
+            const int8x16_t v0_hs = vsubq_s8(vreinterpretq_s8_u8(vshrq_n_u8(v0, 4)),   s8b);
+
+            p[r] = vdotq_s32(vdotq_s32(vdupq_n_s32(0), v0_ls, v1_l), v0_hs, v1_h);
+        }
+
+        // lane r is the dot product of row r
+        const int32x4_t sumi = vpaddq_s32(vpaddq_s32(p[0], p[1]), vpaddq_s32(p[2], p[3]));
+
+        const float dy = GGML_FP16_TO_FP32(y[i].d);
+        const float32_t d[NR4_0_X4] = {
+            GGML_FP16_TO_FP32(x[i].d[0])*dy, GGML_FP16_TO_FP32(x[i].d[1])*dy,
+            GGML_FP16_TO_FP32(x[i].d[2])*dy, GGML_FP16_TO_FP32(x[i].d[3])*dy,
+        };
+
+        sumv = vmlaq_f32(sumv, vcvtq_f32_s32(sumi), vld1q_f32(d));
+    }
+
+    vst1q_f32(s, sumv);
+#elif defined(__AVX2__)
+    const __m256i off = _mm256_set1_epi8(8);
+
+    __m256 acc[NR4_0_X4];
+    for (int r = 0; r < NR4_0_X4; ++r) {
+        acc[r] = _mm256_setzero_ps();
+    }
+
+    for (int i = 0; i < nb; ++i) {
+        // the block of y stays in registers for the NR4_0_X4 rows
+        const __m256i by = _mm256_loadu_si256((const __m256i *)y[i].qs);
+        const float   dy = GGML_FP16_TO_FP32(y[i].d);
+
+        // with the quants of x in [ 0 .. 15 ], subtract 8*sum(y) once instead of offsetting every row
+        const __m256 ys = mul_sum_us8_pairs_float(off, by);
+
+        for (int r = 0; r < NR4_0_X4; ++r) {
+            const __m256i bx = bytes_from_nibbles_32(x[i].qs + r*QK4_0/2);
+            const __m256  q  = _mm256_sub_ps(mul_sum_us8_pairs_float(bx, by), ys);
+
+            acc[r] = _mm256_fmadd_ps(_mm256_set1_ps(GGML_FP16_TO_FP32(x[i].d[r])*dy), q, acc[r]);
+        }
+    }
+
+    for (int r = 0; r < NR4_0_X4; ++r) {
+        s[r] = hsum_float_8(acc[r]);
+    }
+#else
+    // scalar
+    float sumf[NR4_0_X4] = { 0.0f };
+
+    for (int i = 0; i < nb; i++) {
+        for (int r = 0; r < NR4_0_X4; ++r) {
+            const uint8_t * restrict qs = x[i].qs + r*qk/2;
+
+            int sumi = 0;
+
+            for (int j = 0; j < qk/2; ++j) {
+                const int v0 = (qs[j] & 0x0F) - 8;
+                const int v1 = (qs[j] >>   4) - 8;
+
+                sumi += (v0 * y[i].qs[j]) + (v1 * y[i].qs[j + qk/2]);
+            }
+
+            sumf[r] += sumi*GGML_FP16_TO_FP32(x[i].d[r])*GGML_FP16_TO_FP32(y[i].d);
+        }
+    }
+
+    for (int r = 0; r < NR4_0_X4; ++r) {
+        s[r] = sumf[r];
+    }
+#endif
+}
+
 void ggml_vec_dot_q4_1_q8_1(const int n, float * restrict s, const void * restrict vx, const void * restrict vy) {
     const int qk = QK8_1;
     const int nb = n / qk;
@@ -3783,15 +3911,10 @@ void ggml_vec_dot_q2_K_q8_K(const int n, float * restrict s, const void * restri
             __m256i p2 = _mm256_maddubs_epi16(q2_2, q8_2);
             __m256i p3 = _mm256_maddubs_epi16(q2_3, q8_3);
 
-            p0 = _mm256_madd_epi16(_mm256_shuffle_epi8(scales[j], get_scale_shuffle_q3k(0)), p0);
-            p1 = _mm256_madd_epi16(_mm256_shuffle_epi8(scales[j], get_scale_shuffle_q3k(1)), p1);
-            p2 = _mm256_madd_epi16(_mm256_shuffle_epi8(scales[j], get_scale_shuffle_q3k(2)), p2);
-            p3 = _mm256_madd_epi16(_mm256_shuffle_epi8(scales[j], get_scale_shuffle_q3k(3)), p3);
-
-            p0 = _mm256_add_epi32(p0, p1);
-            p2 = _mm256_add_epi32(p2, p3);
-
-            sumi = _mm256_add_epi32(sumi, _mm256_add_epi32(p0, p2));
+            sumi = mul_add_i16_pairs(sumi, _mm256_shuffle_epi8(scales[j], get_scale_shuffle_q3k(0)), p0);
+            sumi = mul_add_i16_pairs(sumi, _mm256_shuffle_epi8(scales[j], get_scale_shuffle_q3k(1)), p1);
+            sumi = mul_add_i16_pairs(sumi, _mm256_shuffle_epi8(scales[j], get_scale_shuffle_q3k(2)), p2);
+            sumi = mul_add_i16_pairs(sumi, _mm256_shuffle_epi8(scales[j], get_scale_shuffle_q3k(3)), p3);
         }
 
         acc = _mm256_fmadd_ps(_mm256_broadcast_ss(&d), _mm256_cvtepi32_ps(sumi), acc);
@@ -4524,16 +4647,11 @@ void ggml_vec_dot_q3_K_q8_K(const int n, float * restrict s, const void * restri
             p16_2 = _mm256_sub_epi16(p16_2, q8s_2);
             p16_3 = _mm256_sub_epi16(p16_3, q8s_3);
 
-            // multiply with scales
-            p16_0 = _mm256_madd_epi16(_mm256_shuffle_epi8(scales[j], get_scale_shuffle_q3k(is + 0)), p16_0);
-            p16_1 = _mm256_madd_epi16(_mm256_shuffle_epi8(scales[j], get_scale_shuffle_q3k(is + 1)), p16_1);
-            p16_2 = _mm256_madd_epi16(_mm256_shuffle_epi8(scales[j], get_scale_shuffle_q3k(is + 2)), p16_2);
-            p16_3 = _mm256_madd_epi16(_mm256_shuffle_epi8(scales[j], get_scale_shuffle_q3k(is + 3)), p16_3);
-
-            // accumulate
-            p16_0 = _mm256_add_epi32(p16_0, p16_1);
-            p16_2 = _mm256_add_epi32(p16_2, p16_3);
-            sumi  = _mm256_add_epi32(sumi, _mm256_add_epi32(p16_0, p16_2));
+            // multiply with scales and accumulate
+            sumi = mul_add_i16_pairs(sumi, _mm256_shuffle_epi8(scales[j], get_scale_shuffle_q3k(is + 0)), p16_0);
+            sumi = mul_add_i16_pairs(sumi, _mm256_shuffle_epi8(scales[j], get_scale_shuffle_q3k(is + 1)), p16_1);
+            sumi = mul_add_i16_pairs(sumi, _mm256_shuffle_epi8(scales[j], get_scale_shuffle_q3k(is + 2)), p16_2);
+            sumi = mul_add_i16_pairs(sumi, _mm256_shuffle_epi8(scales[j], get_scale_shuffle_q3k(is + 3)), p16_3);
 
         }
 
@@ -5359,15 +5477,12 @@ void ggml_vec_dot_q4_K_q8_K(const int n, float * restrict s, const void * restri
             const __m256i q4h = _mm256_and_si256(_mm256_srli_epi16(q4bits, 4), m4);
 
             const __m256i q8l = _mm256_loadu_si256((const __m256i*)q8); q8 += 32;
-            __m256i p16l = _mm256_maddubs_epi16(q4l, q8l);
-            p16l = _mm256_madd_epi16(scale_l, p16l);
+            const __m256i p16l = _mm256_maddubs_epi16(q4l, q8l);
+            sumi = mul_add_i16_pairs(sumi, scale_l, p16l);
 
             const __m256i q8h = _mm256_loadu_si256((const __m256i*)q8); q8 += 32;
-            __m256i p16h = _mm256_maddubs_epi16(q4h, q8h);
-            p16h = _mm256_madd_epi16(scale_h, p16h);
-            const __m256i sumj = _mm256_add_epi32(p16l, p16h);
-
-            sumi = _mm256_add_epi32(sumi, sumj);
+            const __m256i p16h = _mm256_maddubs_epi16(q4h, q8h);
+            sumi = mul_add_i16_pairs(sumi, scale_h, p16h);
         }
 
         __m256 vd = _mm256_set1_ps(d);
@@ -6032,13 +6147,11 @@ void ggml_vec_dot_q5_K_q8_K(const int n, float * restrict s, const void * restri
             const __m256i q8_0 = _mm256_loadu_si256((const __m256i*)q8); q8 += 32;
             const __m256i q8_1 = _mm256_loadu_si256((const __m256i*)q8); q8 += 32;
 
-            __m256i p16_0 = _mm256_maddubs_epi16(q5_0, q8_0);
-            __m256i p16_1 = _mm256_maddubs_epi16(q5_1, q8_1);
-
-            p16_0 = _mm256_madd_epi16(scale_0, p16_0);
-            p16_1 = _mm256_madd_epi16(scale_1, p16_1);
+            const __m256i p16_0 = _mm256_maddubs_epi16(q5_0, q8_0);
+            const __m256i p16_1 = _mm256_maddubs_epi16(q5_1, q8_1);
 
-            sumi = _mm256_add_epi32(sumi, _mm256_add_epi32(p16_0, p16_1));
+            sumi = mul_add_i16_pairs(sumi, scale_0, p16_0);
+            sumi = mul_add_i16_pairs(sumi, scale_1, p16_1);
 
         }
 
@@ -6802,13 +6915,10 @@ void ggml_vec_dot_q6_K_q8_K(const int n, float * restrict s, const void * restri
             p16_2 = _mm256_sub_epi16(p16_2, q8s_2);
             p16_3 = _mm256_sub_epi16(p16_3, q8s_3);
 
-            p16_0 = _mm256_madd_epi16(_mm256_cvtepi8_epi16(scale_0), p16_0);
-            p16_1 = _mm256_madd_epi16(_mm256_cvtepi8_epi16(scale_1), p16_1);
-            p16_2 = _mm256_madd_epi16(_mm256_cvtepi8_epi16(scale_2), p16_2);
-            p16_3 = _mm256_madd_epi16(_mm256_cvtepi8_epi16(scale_3), p16_3);
-
-            sumi = _mm256_add_epi32(sumi, _mm256_add_epi32(p16_0, p16_1));
-            sumi = _mm256_add_epi32(sumi, _mm256_add_epi32(p16_2, p16_3));
+            sumi = mul_add_i16_pairs(sumi, _mm256_cvtepi8_epi16(scale_0), p16_0);
+            sumi = mul_add_i16_pairs(sumi, _mm256_cvtepi8_epi16(scale_1), p16_1);
+            sumi = mul_add_i16_pairs(sumi, _mm256_cvtepi8_epi16(scale_2), p16_2);
+            sumi = mul_add_i16_pairs(sumi, _mm256_cvtepi8_epi16(scale_3), p16_3);
 
         }
 
@@ -7380,3 +7490,240 @@ void ggml_vec_dot_q6_K_q8_K(const int n, float * restrict s, const void * restri
 }
 
 #endif
+
+//
+// 2x2 dot products: two rows of x against two rows of y with the i8mm SMMLA instruction
+//
+
+#if defined(__ARM_FEATURE_MATMUL_INT8)
+
+// acc + { x0·y0, x0·y1, x1·y0, x1·y1 } for 16 int8 values per row
+static inline int32x4_t ggml_vmmlaq_s32_2x2(int32x4_t acc, int8x16_t x0, int8x16_t x1, int8x16_t y0, int8x16_t y1) {
+    // SMMLA multiplies a 2x8 block by the transpose of another 2x8 block
+    const int8x16_t xl = vreinterpretq_s8_s64(vzip1q_s64(vreinterpretq_s64_s8(x0), vreinterpretq_s64_s8(x1)));
+    const int8x16_t xh = vreinterpretq_s8_s64(vzip2q_s64(vreinterpretq_s64_s8(x0), vreinterpretq_s64_s8(x1)));
+    const int8x16_t yl = vreinterpretq_s8_s64(vzip1q_s64(vreinterpretq_s64_s8(y0), vreinterpretq_s64_s8(y1)));
+    const int8x16_t yh = vreinterpretq_s8_s64(vzip2q_s64(vreinterpretq_s64_s8(y0), vreinterpretq_s64_s8(y1)));
+
+    return vmmlaq_s32(vmmlaq_s32(acc, xl, yl), xh, yh);
+}
+
+// store { x0·y0, x0·y1, x1·y0, x1·y1 } as s[0] = x0·y0, s[1] = x1·y0, s[bs] = x0·y1, s[bs + 1] = x1·y1
+static inline void ggml_vst1q_f32_2x2(float * restrict s, size_t bs, float32x4_t v) {
+    const float32x4_t t = vzip1q_f32(v, vextq_f32(v, v, 2));
+
+    vst1_f32(s,      vget_low_f32 (t));
+    vst1_f32(s + bs, vget_high_f32(t));
+}
+
+void ggml_vec_dot_q4_0_q8_0_2x2(int n, float * restrict s, size_t bs, const void * restrict vx, size_t bx, const void * restrict vy, size_t by) {
+    const int qk = QK8_0;
+    const int nb = n / qk;
+
+    assert(n % qk == 0);
+
+    const block_q4_0 * restrict x0 = vx;
+    const block_q4_0 * restrict x1 = (const block_q4_0 *) ((const char *) vx + bx);
+    const block_q8_0 * restrict y0 = vy;
+    const block_q8_0 * restrict y1 = (const block_q8_0 *) ((const char *) vy + by);
+
+    const uint8x16_t m4b = vdupq_n_u8(0x0F);
+    const int8x16_t  s8b = vdupq_n_s8(0x8);
+
+    float32x4_t sumv = vdupq_n_f32(0.0f);
+
+    for (int i = 0; i < nb; ++i) {
+        const uint8x16_t v0_0 = vld1q_u8(x0[i].qs);
+        const uint8x16_t v0_1 = vld1q_u8(x1[i].qs);
+
+        // 4-bit -> 8-bit, offset to [ -8 .. +7 ]
+        const int8x16_t v0_0ls = vsubq_s8(vreinterpretq_s8_u8(vandq_u8  (v0_0, m4b)), s8b);
+        const int8x16_t v0_0hs = vsubq_s8(vreinterpretq_s8_u8(vshrq_n_u8(v0_0, 4)),   s8b);
+        const int8x16_t v0_1ls = vsubq_s8(vreinterpretq_s8_u8(vandq_u8  (v0_1, m4b)), s8b);
+        const int8x16_t v0_1hs = vsubq_s8(vreinterpretq_s8_u8(vshrq_n_u8(v0_1, 4)),   s8b);
+
+        int32x4_t p = vdupq_n_s32(0);
+        p = ggml_vmmlaq_s32_2x2(p, v0_0ls, v0_1ls, vld1q_s8(y0[i].qs),      vld1q_s8(y1[i].qs));
+        p = ggml_vmmlaq_s32_2x2(p, v0_0hs, v0_1hs, vld1q_s8(y0[i].qs + 16), vld1q_s8(y1[i].qs + 16));
+
+        const float dx0 = GGML_FP16_TO_FP32(x0[i].d);
+        const float dx1 = GGML_FP16_TO_FP32(x1[i].d);
+        const float dy0 = GGML_FP16_TO_FP32(y0[i].d);
+        const float dy1 = GGML_FP16_TO_FP32(y1[i].d);
+
+        const float32_t d[4] = { dx0*dy0, dx0*dy1, dx1*dy0, dx1*dy1 };
+
+        sumv = vmlaq_f32(sumv, vcvtq_f32_s32(p), vld1q_f32(d));
+    }
+
+    ggml_vst1q_f32_2x2(s, bs, sumv);
+}
+
+void ggml_vec_dot_q4_1_q8_1_2x2(int n, float * restrict s, size_t bs, const void * restrict vx, size_t bx, const void * restrict vy, size_t by) {
+    const int qk = QK8_1;
+    const int nb = n / qk;
+
+    assert(n % qk == 0);
+
+    const block_q4_1 * restrict x0 = vx;
+    const block_q4_1 * restrict x1 = (const block_q4_1 *) ((const char *) vx + bx);
+    const block_q8_1 * restrict y0 = vy;
+    const block_q8_1 * restrict y1 = (const block_q8_1 *) ((const char *) vy + by);
+
+    const uint8x16_t m4b = vdupq_n_u8(0x0F);
+
+    float32x4_t sumv = vdupq_n_f32(0.0f);
+
+    for (int i = 0; i < nb; ++i) {
+        const uint8x16_t v0_0 = vld1q_u8(x0[i].qs);
+        const uint8x16_t v0_1 = vld1q_u8(x1[i].qs);
+
+        // 4-bit -> 8-bit
+        const int8x16_t v0_0l = vreinterpretq_s8_u8(vandq_u8  (v0_0, m4b));
+        const int8x16_t v0_0h = vreinterpretq_s8_u8(vshrq_n_u8(v0_0, 4));
+        const int8x16_t v0_1l = vreinterpretq_s8_u8(vandq_u8  (v0_1, m4b));
+        const int8x16_t v0_1h = vreinterpretq_s8_u8(vshrq_n_u8(v0_1, 4));
+
+        int32x4_t p = vdupq_n_s32(0);
+        p = ggml_vmmlaq_s32_2x2(p, v0_0l, v0_1l, vld1q_s8(y0[i].qs),      vld1q_s8(y1[i].qs));
+        p = ggml_vmmlaq_s32_2x2(p, v0_0h, v0_1h, vld1q_s8(y0[i].qs + 16), vld1q_s8(y1[i].qs + 16));
+
+        const float dx0 = GGML_FP16_TO_FP32(x0[i].d);
+        const float dx1 = GGML_FP16_TO_FP32(x1[i].d);
+        const float mx0 = GGML_FP16_TO_FP32(x0[i].m);
+        const float mx1 = GGML_FP16_TO_FP32(x1[i].m);
+
+        const float32_t d[4] = { dx0*y0[i].d, dx0*y1[i].d, dx1*y0[i].d, dx1*y1[i].d };
+        const float32_t m[4] = { mx0*y0[i].s, mx0*y1[i].s, mx1*y0[i].s, mx1*y1[i].s };
+
+        sumv = vaddq_f32(sumv, vld1q_f32(m));
+        sumv = vmlaq_f32(sumv, vcvtq_f32_s32(p), vld1q_f32(d));
+    }
+
+    ggml_vst1q_f32_2x2(s, bs, sumv);
+}
+
+void ggml_vec_dot_q8_0_q8_0_2x2(int n, float * restrict s, size_t bs, const void * restrict vx, size_t bx, const void * restrict vy, size_t by) {
+    const int qk = QK8_0;
+    const int nb = n / qk;
+
+    assert(n % qk == 0);
+
+    const block_q8_0 * restrict x0 = vx;
+    const block_q8_0 * restrict x1 = (const block_q8_0 *) ((const char *) vx + bx);
+    const block_q8_0 * restrict y0 = vy;
+    const block_q8_0 * restrict y1 = (const block_q8_0 *) ((const char *) vy + by);
+
+    float32x4_t sumv = vdupq_n_f32(0.0f);
+
+    for (int i = 0; i < nb; ++i) {
+        int32x4_t p = vdupq_n_s32(0);
+        p = ggml_vmmlaq_s32_2x2(p, vld1q_s8(x0[i].qs),      vld1q_s8(x1[i].qs),      vld1q_s8(y0[i].qs),      vld1q_s8(y1[i].qs));
+        p = ggml_vmmlaq_s32_2x2(p, vld1q_s8(x0[i].qs + 16), vld1q_s8(x1[i].qs + 16), vld1q_s8(y0[i].qs + 16), vld1q_s8(y1[i].qs + 16));
+
+        const float dx0 = GGML_FP16_TO_FP32(x0[i].d);
+        const float dx1 = GGML_FP16_TO_FP32(x1[i].d);
+        const float dy0 = GGML_FP16_TO_FP32(y0[i].d);
+        const float dy1 = GGML_FP16_TO_FP32(y1[i].d);
+
+        const float32_t d[4] = { dx0*dy0, dx0*dy1, dx1*dy0, dx1*dy1 };
+
+        sumv = vmlaq_f32(sumv, vcvtq_f32_s32(p), vld1q_f32(d));
+    }
+
+    ggml_vst1q_f32_2x2(s, bs, sumv);
+}
+
+#if QK_K == 256
+void ggml_vec_dot_q4_K_q8_K_2x2(int n, float * restrict s, size_t bs, const void * restrict vx, size_t bx, const void * restrict vy, size_t by) {
+    assert(n % QK_K == 0);
+
+    const block_q4_K * restrict x[2] = { vx, (const block_q4_K *) ((const char *) vx + bx) };
+    const block_q8_K * restrict y[2] = { vy, (const block_q8_K *) ((const char *) vy + by) };
+
+    const int nb = n / QK_K;
+
+    static const uint32_t kmask1 = 0x3f3f3f3f;
+    static const uint32_t kmask2 = 0x0f0f0f0f;
+    static const uint32_t kmask3 = 0x03030303;
+
+    const uint8x16_t m4b = vdupq_n_u8(0xf);
+
+    float32x4_t sumv = vdupq_n_f32(0.0f);
+
+    for (int i = 0; i < nb; ++i) {
+        // 6-bit scales and mins of both rows of x
+        uint32_t utmp[2][4];
+        for (int k = 0; k < 2; ++k) {
+            memcpy(utmp[k], x[k][i].scales, 12);
+            utmp[k][3] = ((utmp[k][2] >> 4) & kmask2) | (((utmp[k][1] >> 6) & kmask3) << 4);
+            const uint32_t uaux = utmp[k][1] & kmask1;
+            utmp[k][1] = (utmp[k][2] & kmask2) | (((utmp[k][0] >> 6) & kmask3) << 4);
+            utmp[k][2] = uaux;
+            utmp[k][0] &= kmask1;
+        }
+        const uint8_t * scales[2] = { (const uint8_t *) &utmp[0][0], (const uint8_t *) &utmp[1][0] };
+        const uint8_t * mins[2]   = { (const uint8_t *) &utmp[0][2], (const uint8_t *) &utmp[1][2] };
+
+        float32_t d[4];
+        float32_t m[4];
+        for (int k = 0; k < 2; ++k) {
+            for (int l = 0; l < 2; ++l) {
+                int32_t summ = 0;
+                for (int j = 0; j < QK_K/32; ++j) {
+                    summ += mins[k][j] * (y[l][i].bsums[2*j + 0] + y[l][i].bsums[2*j + 1]);
+                }
+                d[2*k + l] = y[l][i].d * GGML_FP16_TO_FP32(x[k][i].d);
+                m[2*k + l] = y[l][i].d * GGML_FP16_TO_FP32(x[k][i].dmin) * summ;
+            }
+        }
+
+        const uint8_t * restrict q40 = x[0][i].qs;
+        const uint8_t * restrict q41 = x[1][i].qs;
+        const int8_t  * restrict q80 = y[0][i].qs;
+        const int8_t  * restrict q81 = y[1][i].qs;
+
+        int32x4_t sumi = vdupq_n_s32(0);
+
+        for (int j = 0; j < QK_K/64; ++j) {
+            const ggml_uint8x16x2_t q4bits0 = ggml_vld1q_u8_x2(q40); q40 += 32;
+            const ggml_uint8x16x2_t q4bits1 = ggml_vld1q_u8_x2(q41); q41 += 32;
+
+            const ggml_int8x16x2_t q8bytes0l = ggml_vld1q_s8_x2(q80); q80 += 32;
+            const ggml_int8x16x2_t q8bytes1l = ggml_vld1q_s8_x2(q81); q81 += 32;
+            const ggml_int8x16x2_t q8bytes0h = ggml_vld1q_s8_x2(q80); q80 += 32;
+            const ggml_int8x16x2_t q8bytes1h = ggml_vld1q_s8_x2(q81); q81 += 32;
+
+            // low nibbles are sub-block 2*j, high nibbles are sub-block 2*j + 1
+            int32x4_t pl = vdupq_n_s32(0);
+            pl = ggml_vmmlaq_s32_2x2(pl,
+                    vreinterpretq_s8_u8(vandq_u8(q4bits0.val[0], m4b)), vreinterpretq_s8_u8(vandq_u8(q4bits1.val[0], m4b)),
+                    q8bytes0l.val[0], q8bytes1l.val[0]);
+            pl = ggml_vmmlaq_s32_2x2(pl,
+                    vreinterpretq_s8_u8(vandq_u8(q4bits0.val[1], m4b)), vreinterpretq_s8_u8(vandq_u8(q4bits1.val[1], m4b)),
+                    q8bytes0l.val[1], q8bytes1l.val[1]);
+
+            int32x4_t ph = vdupq_n_s32(0);
+            ph = ggml_vmmlaq_s32_2x2(ph,
+                    vreinterpretq_s8_u8(vshrq_n_u8(q4bits0.val[0], 4)), vreinterpretq_s8_u8(vshrq_n_u8(q4bits1.val[0], 4)),
+                    q8bytes0h.val[0], q8bytes1h.val[0]);
+            ph = ggml_vmmlaq_s32_2x2(ph,
+                    vreinterpretq_s8_u8(vshrq_n_u8(q4bits0.val[1], 4)), vreinterpretq_s8_u8(vshrq_n_u8(q4bits1.val[1], 4)),
+                    q8bytes0h.val[1], q8bytes1h.val[1]);
+
+            const int32_t scl[4] = { scales[0][2*j + 0], scales[0][2*j + 0], scales[1][2*j + 0], scales[1][2*j + 0] };
+            const int32_t sch[4] = { scales[0][2*j + 1], scales[0][2*j + 1], scales[1][2*j + 1], scales[1][2*j + 1] };
+
+            sumi = vmlaq_s32(sumi, pl, vld1q_s32(scl));
+            sumi = vmlaq_s32(sumi, ph, vld1q_s32(sch));
+        }
+
+        sumv = vmlaq_f32(sumv, vcvtq_f32_s32(sumi), vld1q_f32(d));
+        sumv = vsubq_f32(sumv, vld1q_f32(m));
+    }
+
+    ggml_vst1q_f32_2x2(s, bs, sumv);
+}
+#endif
+
+#endif
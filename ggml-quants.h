@@ -54,6 +54,15 @@ typedef struct {
 } block_q8_1;
 static_assert(sizeof(block_q8_1) == 2*sizeof(float) + QK8_1, "wrong q8_1 block size/padding");
 
+// q4_0 blocks of 4 consecutive rows, interleaved so that a dot product with a column reuses each column block
+// for all the rows - only made by repacking q4_0 tensors
+#define NR4_0_X4 4
+typedef struct {
+    ggml_fp16_t d[NR4_0_X4];              // deltas of the rows
+    uint8_t qs[NR4_0_X4 * QK4_0 / 2];     // nibbles / quants of the rows, QK4_0/2 bytes each
+} block_q4_0_x4;
+static_assert(sizeof(block_q4_0_x4) == NR4_0_X4 * sizeof(block_q4_0), "wrong q4_0_x4 block size/padding");
+
 //
 // Super-block quantization structures
 //
@@ -210,6 +219,9 @@ void dequantize_row_q5_K(const block_q5_K * restrict x, float * restrict y, int
 void dequantize_row_q6_K(const block_q6_K * restrict x, float * restrict y, int k);
 void dequantize_row_q8_K(const block_q8_K * restrict x, float * restrict y, int k);
 
+// Repacking of NR4_0_X4 consecutive rows of k elements
+void repack_rows_q4_0_x4(const block_q4_0 * restrict x, block_q4_0_x4 * restrict y, int k);
+
 // Dot product
 void ggml_vec_dot_q4_0_q8_0(int n, float * restrict s, const void * restrict vx, const void * restrict vy);
 void ggml_vec_dot_q4_1_q8_1(int n, float * restrict s, const void * restrict vx, const void * restrict vy);
@@ -222,3 +234,16 @@ void ggml_vec_dot_q3_K_q8_K(int n, float * restrict s, const void * restrict vx,
 void ggml_vec_dot_q4_K_q8_K(int n, float * restrict s, const void * restrict vx, const void * restrict vy);
 void ggml_vec_dot_q5_K_q8_K(int n, float * restrict s, const void * restrict vx, const void * restrict vy);
 void ggml_vec_dot_q6_K_q8_K(int n, float * restrict s, const void * restrict vx, const void * restrict vy);
+
+// Dot products of the NR4_0_X4 rows of x with y
+void ggml_vec_dot_q4_0_x4_q8_0(int n, float * restrict s, const void * restrict vx, const void * restrict vy);
+
+#if defined(__ARM_FEATURE_MATMUL_INT8)
+// Dot products of 2 rows of x with 2 rows of y
+void ggml_vec_dot_q4_0_q8_0_2x2(int n, float * restrict s, size_t bs, const void * restrict vx, size_t bx, const void * restrict vy, size_t by);
+void ggml_vec_dot_q4_1_q8_1_2x2(int n, float * restrict s, size_t bs, const void * restrict vx, size_t bx, const void * restrict vy, size_t by);
+void ggml_vec_dot_q8_0_q8_0_2x2(int n, float * restrict s, size_t bs, const void * restrict vx, size_t bx, const void * restrict vy, size_t by);
+#if QK_K == 256
+void ggml_vec_dot_q4_K_q8_K_2x2(int n, float * restrict s, size_t bs, const void * restrict vx, size_t bx, const void * restrict vy, size_t by);
+#endif
+#endif
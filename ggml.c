@@ -94,6 +94,16 @@ typedef void * thread_ret_t;
 #include <sys/stat.h>
 #include <unistd.h>
 
+#if defined(_POSIX_MAPPED_FILES)
+#include <fcntl.h>
+#include <sys/mman.h>
+#endif
+
+#endif
+
+#if defined(__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
 #endif
 
 #ifdef GGML_USE_CPU_HBM
@@ -442,6 +452,9 @@ static const ggml_type_traits_t type_traits[GGML_TYPE_COUNT] = {
         .from_float_reference     = (ggml_from_float_t) quantize_row_q4_0_reference,
         .vec_dot                  = ggml_vec_dot_q4_0_q8_0,
         .vec_dot_type             = GGML_TYPE_Q8_0,
+#if defined(__ARM_FEATURE_MATMUL_INT8)
+        .vec_dot_2x2              = ggml_vec_dot_q4_0_q8_0_2x2,
+#endif
     },
     [GGML_TYPE_Q4_1] = {
         .type_name                = "q4_1",
@@ -453,6 +466,9 @@ static const ggml_type_traits_t type_traits[GGML_TYPE_COUNT] = {
         .from_float_reference     = (ggml_from_float_t) quantize_row_q4_1_reference,
         .vec_dot                  = ggml_vec_dot_q4_1_q8_1,
         .vec_dot_type             = GGML_TYPE_Q8_1,
+#if defined(__ARM_FEATURE_MATMUL_INT8)
+        .vec_dot_2x2              = ggml_vec_dot_q4_1_q8_1_2x2,
+#endif
     },
     [4] = { // GGML_TYPE_Q4_2
         .type_name                = "DEPRECATED",
@@ -508,6 +524,9 @@ static const ggml_type_traits_t type_traits[GGML_TYPE_COUNT] = {
         .from_float_reference     = (ggml_from_float_t) quantize_row_q8_0_reference,
         .vec_dot                  = ggml_vec_dot_q8_0_q8_0,
         .vec_dot_type             = GGML_TYPE_Q8_0,
+#if defined(__ARM_FEATURE_MATMUL_INT8)
+        .vec_dot_2x2              = ggml_vec_dot_q8_0_q8_0_2x2,
+#endif
     },
     [GGML_TYPE_Q8_1] = {
         .type_name                = "q8_1",
@@ -550,6 +569,9 @@ static const ggml_type_traits_t type_traits[GGML_TYPE_COUNT] = {
         .from_float_reference     = (ggml_from_float_t) quantize_row_q4_K_reference,
         .vec_dot                  = ggml_vec_dot_q4_K_q8_K,
         .vec_dot_type             = GGML_TYPE_Q8_K,
+#if defined(__ARM_FEATURE_MATMUL_INT8) && QK_K == 256
+        .vec_dot_2x2              = ggml_vec_dot_q4_K_q8_K_2x2,
+#endif
     },
     [GGML_TYPE_Q5_K] = {
         .type_name                = "q5_K",
@@ -579,6 +601,15 @@ static const ggml_type_traits_t type_traits[GGML_TYPE_COUNT] = {
         .type_size                = sizeof(block_q8_K),
         .is_quantized             = true,
         .from_float               = quantize_row_q8_K,
+    },
+    [GGML_TYPE_Q4_0_X4] = {
+        .type_name                = "q4_0_x4",
+        .blck_size                = QK4_0,
+        .type_size                = sizeof(block_q4_0),
+        .is_quantized             = true,
+        .vec_dot                  = ggml_vec_dot_q4_0_x4_q8_0,
+        .vec_dot_type             = GGML_TYPE_Q8_0,
+        .nrows                    = NR4_0_X4,
     }
 };
 
@@ -1486,6 +1517,24 @@ inline static void ggml_vec_silu_f32(const int n, float * y, const float * x) {
 }
 #endif
 
+// y may alias x or g
+#ifdef GGML_SILU_FP16
+inline static void ggml_vec_swiglu_f32(const int n, float * y, const float * x, const float * g) {
+    uint16_t t;
+    for (int i = 0; i < n; ++i) {
+        ggml_fp16_t fp16 = GGML_FP32_TO_FP16(x[i]);
+        memcpy(&t, &fp16, sizeof(uint16_t));
+        y[i] = GGML_FP16_TO_FP32(ggml_table_silu_f16[t])*g[i];
+    }
+}
+#else
+inline static void ggml_vec_swiglu_f32(const int n, float * y, const float * x, const float * g) {
+    for (int i = 0; i < n; ++i) {
+        y[i] = ggml_silu_f32(x[i])*g[i];
+    }
+}
+#endif
+
 inline static float ggml_silu_backward_f32(float x, float dy) {
     const float s = 1.0f/(1.0f + expf(-x));
     return dy*s*(1.0f + x*(1.0f - s));
@@ -1589,9 +1638,11 @@ static const char * GGML_OP_NAME[GGML_OP_COUNT] = {
     "REPEAT_BACK",
     "CONCAT",
     "SILU_BACK",
+    "SWIGLU",
     "NORM",
     "RMS_NORM",
     "RMS_NORM_BACK",
+    "RMS_NORM_MUL",
     "GROUP_NORM",
 
     "MUL_MAT",
@@ -1615,6 +1666,7 @@ static const char * GGML_OP_NAME[GGML_OP_COUNT] = {
     "SOFT_MAX_BACK",
     "ROPE",
     "ROPE_BACK",
+    "ROPE_CACHE",
     "ALIBI",
     "CLAMP",
     "CONV_TRANSPOSE_1D",
@@ -1628,6 +1680,7 @@ static const char * GGML_OP_NAME[GGML_OP_COUNT] = {
     "LEAKY_RELU",
 
     "FLASH_ATTN",
+    "FLASH_ATTN_EXT",
     "FLASH_FF",
     "FLASH_ATTN_BACK",
     "WIN_PART",
@@ -1652,7 +1705,7 @@ static const char * GGML_OP_NAME[GGML_OP_COUNT] = {
     "CROSS_ENTROPY_LOSS_BACK",
 };
 
-static_assert(GGML_OP_COUNT == 72, "GGML_OP_COUNT != 72");
+static_assert(GGML_OP_COUNT == 76, "GGML_OP_COUNT != 76");
 
 static const char * GGML_OP_SYMBOL[GGML_OP_COUNT] = {
     "none",
@@ -1675,9 +1728,11 @@ static const char * GGML_OP_SYMBOL[GGML_OP_COUNT] = {
     "repeat_back(x)",
     "concat(x, y)",
     "silu_back(x)",
+    "silu(x)*y",
     "norm(x)",
     "rms_norm(x)",
     "rms_norm_back(x)",
+    "rms_norm(x)*y",
     "group_norm(x)",
 
     "X*Y",
@@ -1701,6 +1756,7 @@ static const char * GGML_OP_SYMBOL[GGML_OP_COUNT] = {
     "soft_max_back(x)",
     "rope(x)",
     "rope_back(x)",
+    "rope_cache(x)",
     "alibi(x)",
     "clamp(x)",
     "conv_transpose_1d(x)",
@@ -1714,6 +1770,7 @@ static const char * GGML_OP_SYMBOL[GGML_OP_COUNT] = {
     "leaky_relu(x)",
 
     "flash_attn(x)",
+    "flash_attn_ext(x)",
     "flash_ff(x)",
     "flash_attn_back(x)",
     "win_part(x)",
@@ -1738,7 +1795,7 @@ static const char * GGML_OP_SYMBOL[GGML_OP_COUNT] = {
     "cross_entropy_loss_back(x,y)",
 };
 
-static_assert(GGML_OP_COUNT == 72, "GGML_OP_COUNT != 72");
+static_assert(GGML_OP_COUNT == 76, "GGML_OP_COUNT != 76");
 
 static_assert(GGML_OP_POOL_COUNT == 2, "GGML_OP_POOL_COUNT != 2");
 
@@ -1795,6 +1852,9 @@ static void ggml_setup_op_has_task_pass(void) {
         bool * p = GGML_OP_HAS_FINALIZE;
 
         p[GGML_OP_CROSS_ENTROPY_LOSS     ] = true;
+#if defined(GGML_USE_ACCELERATE) || defined(GGML_USE_OPENBLAS)
+        p[GGML_OP_MUL_MAT                ] = true;
+#endif
     }
 }
 
@@ -1942,6 +2002,57 @@ bool ggml_is_numa(void) {
     return g_state.numa.n_nodes > 1;
 }
 
+// the threads of a computation are bound to the NUMA nodes in groups of consecutive threads
+static int ggml_numa_group_size(int n_threads) {
+    return (n_threads + g_state.numa.n_nodes - 1)/g_state.numa.n_nodes;
+}
+
+// the rows of a matrix are split between the NUMA nodes in contiguous ranges, see ggml_numa_place
+static void ggml_numa_rows(int64_t nr, int node, int64_t * ir0, int64_t * ir1) {
+    *ir0 = nr*node/g_state.numa.n_nodes;
+    *ir1 = nr*(node + 1)/g_state.numa.n_nodes;
+}
+
+void ggml_numa_place(const struct ggml_tensor * tensor) {
+    if (!ggml_is_numa() || tensor->data == NULL || !ggml_is_contiguous(tensor) || tensor->ne[1] < (int64_t) g_state.numa.n_nodes) {
+        return;
+    }
+
+#if defined(__linux__)
+    static bool warned = false;
+
+    const uintptr_t page = (uintptr_t) sysconf(_SC_PAGESIZE);
+
+    // the pages go to the node of the row at their start
+    for (int64_t i = 0; i < tensor->ne[2]*tensor->ne[3]; ++i) {
+        const uintptr_t base = (uintptr_t) tensor->data + i*tensor->nb[2];
+
+        for (uint32_t node = 0; node < g_state.numa.n_nodes; ++node) {
+            int64_t ir0;
+            int64_t ir1;
+            ggml_numa_rows(tensor->ne[1], node, &ir0, &ir1);
+
+            uintptr_t start = (base + ir0*tensor->nb[1]) / page * page;
+            uintptr_t end   = (base + ir1*tensor->nb[1]) / page * page;
+            if (node == g_state.numa.n_nodes - 1) {
+                end = (base + ir1*tensor->nb[1] + page - 1) / page * page;
+            }
+
+            if (start >= end) {
+                continue;
+            }
+
+            // MPOL_BIND, MPOL_MF_MOVE: also move the pages that are already resident
+            unsigned long nodemask = 1UL << node;
+            if (syscall(SYS_mbind, (void *) start, end - start, 2, &nodemask, 8*sizeof(nodemask) + 1, 1 << 1) != 0 && !warned) {
+                fprintf(stderr, "warning: mbind() failed: %s\n", strerror(errno));
+                warned = true;
+            }
+        }
+    }
+#endif
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 
 void ggml_print_object(const struct ggml_object * obj) {
@@ -3929,6 +4040,31 @@ struct ggml_tensor * ggml_silu_back(
     return result;
 }
 
+// ggml_swiglu
+
+struct ggml_tensor * ggml_swiglu(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * a,
+        struct ggml_tensor  * b) {
+    GGML_ASSERT(ggml_are_same_shape(a, b));
+
+    bool is_node = false;
+
+    if (a->grad || b->grad) {
+        // TODO: implement backward
+        is_node = true;
+    }
+
+    struct ggml_tensor * result = ggml_dup_tensor(ctx, a);
+
+    result->op   = GGML_OP_SWIGLU;
+    result->grad = is_node ? ggml_dup_tensor(ctx, result) : NULL;
+    result->src[0] = a;
+    result->src[1] = b;
+
+    return result;
+}
+
 // ggml_norm
 
 static struct ggml_tensor * ggml_norm_impl(
@@ -4032,6 +4168,34 @@ struct ggml_tensor * ggml_rms_norm_back(
     return result;
 }
 
+// ggml_rms_norm_mul
+
+struct ggml_tensor * ggml_rms_norm_mul(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * a,
+        struct ggml_tensor  * b,
+        float  eps) {
+    GGML_ASSERT(ggml_can_repeat(b, a) && b->ne[0] == a->ne[0]);
+
+    bool is_node = false;
+
+    if (a->grad || b->grad) {
+        // TODO: implement backward
+        is_node = true;
+    }
+
+    struct ggml_tensor * result = ggml_dup_tensor(ctx, a);
+
+    ggml_set_op_params(result, &eps, sizeof(eps));
+
+    result->op   = GGML_OP_RMS_NORM_MUL;
+    result->grad = is_node ? ggml_dup_tensor(ctx, result) : NULL;
+    result->src[0] = a;
+    result->src[1] = b;
+
+    return result;
+}
+
 // ggml_group_norm
 
 static struct ggml_tensor * ggml_group_norm_impl(
@@ -5008,6 +5172,7 @@ static struct ggml_tensor * ggml_rope_impl(
         struct ggml_context * ctx,
         struct ggml_tensor  * a,
         struct ggml_tensor  * b,
+        struct ggml_tensor  * c,
         int                   n_dims,
         int                   mode,
         int                   n_ctx,
@@ -5044,10 +5209,20 @@ static struct ggml_tensor * ggml_rope_impl(
     memcpy(params + 12, &xpos_down,    sizeof(bool));
     ggml_set_op_params(result, params, sizeof(params));
 
+    if (c) {
+        // the cache must hold the angles rope would compute
+        GGML_ASSERT(c->op == GGML_OP_ROPE_CACHE);
+        GGML_ASSERT(c->src[0] == b);
+        GGML_ASSERT(params[1] == c->op_params[1] && params[2] == c->op_params[2] && params[4] == c->op_params[4]);
+        GGML_ASSERT(memcmp(params + 5, c->op_params + 5, 6*sizeof(int32_t)) == 0);
+        GGML_ASSERT(xpos_base == 0.0f);
+    }
+
     result->op   = GGML_OP_ROPE;
     result->grad = is_node ? ggml_dup_tensor(ctx, result) : NULL;
     result->src[0] = a;
     result->src[1] = b;
+    result->src[2] = c;
 
     return result;
 }
@@ -5060,7 +5235,7 @@ struct ggml_tensor * ggml_rope(
         int                   mode,
         int                   n_ctx) {
     return ggml_rope_impl(
-        ctx, a, b, n_dims, mode, n_ctx, 0, 10000.0f, 1.0f, 0.0f, 1.0f, 0.0f, 0.0f, 0.0f, false, false
+        ctx, a, b, NULL, n_dims, mode, n_ctx, 0, 10000.0f, 1.0f, 0.0f, 1.0f, 0.0f, 0.0f, 0.0f, false, false
     );
 }
 
@@ -5072,7 +5247,7 @@ struct ggml_tensor * ggml_rope_inplace(
         int                   mode,
         int                   n_ctx) {
     return ggml_rope_impl(
-        ctx, a, b, n_dims, mode, n_ctx, 0, 10000.0f, 1.0f, 0.0f, 1.0f, 0.0f, 0.0f, 0.0f, false, true
+        ctx, a, b, NULL, n_dims, mode, n_ctx, 0, 10000.0f, 1.0f, 0.0f, 1.0f, 0.0f, 0.0f, 0.0f, false, true
     );
 }
 
@@ -5091,7 +5266,7 @@ struct ggml_tensor * ggml_rope_custom(
         float                 beta_fast,
         float                 beta_slow) {
     return ggml_rope_impl(
-        ctx, a, b, n_dims, mode, n_ctx, n_orig_ctx, freq_base, freq_scale,
+        ctx, a, b, NULL, n_dims, mode, n_ctx, n_orig_ctx, freq_base, freq_scale,
         ext_factor, attn_factor, beta_fast, beta_slow, 0.0f, false, false
     );
 }
@@ -5111,7 +5286,49 @@ struct ggml_tensor * ggml_rope_custom_inplace(
         float                 beta_fast,
         float                 beta_slow) {
     return ggml_rope_impl(
-        ctx, a, b, n_dims, mode, n_ctx, n_orig_ctx, freq_base, freq_scale,
+        ctx, a, b, NULL, n_dims, mode, n_ctx, n_orig_ctx, freq_base, freq_scale,
+        ext_factor, attn_factor, beta_fast, beta_slow, 0.0f, false, true
+    );
+}
+
+struct ggml_tensor * ggml_rope_custom_cached(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * a,
+        struct ggml_tensor  * b,
+        struct ggml_tensor  * c,
+        int                   n_dims,
+        int                   mode,
+        int                   n_ctx,
+        int                   n_orig_ctx,
+        float                 freq_base,
+        float                 freq_scale,
+        float                 ext_factor,
+        float                 attn_factor,
+        float                 beta_fast,
+        float                 beta_slow) {
+    return ggml_rope_impl(
+        ctx, a, b, c, n_dims, mode, n_ctx, n_orig_ctx, freq_base, freq_scale,
+        ext_factor, attn_factor, beta_fast, beta_slow, 0.0f, false, false
+    );
+}
+
+struct ggml_tensor * ggml_rope_custom_cached_inplace(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * a,
+        struct ggml_tensor  * b,
+        struct ggml_tensor  * c,
+        int                   n_dims,
+        int                   mode,
+        int                   n_ctx,
+        int                   n_orig_ctx,
+        float                 freq_base,
+        float                 freq_scale,
+        float                 ext_factor,
+        float                 attn_factor,
+        float                 beta_fast,
+        float                 beta_slow) {
+    return ggml_rope_impl(
+        ctx, a, b, c, n_dims, mode, n_ctx, n_orig_ctx, freq_base, freq_scale,
         ext_factor, attn_factor, beta_fast, beta_slow, 0.0f, false, true
     );
 }
@@ -5123,7 +5340,46 @@ struct ggml_tensor * ggml_rope_xpos_inplace(
         int                   n_dims,
         float                 base,
         bool                  down) {
-    return ggml_rope_impl(ctx, a, b, n_dims, 0, 0, 0, 10000.0f, 1.0f, 0.0f, 1.0f, 0.0f, 0.0f, base, down, true);
+    return ggml_rope_impl(ctx, a, b, NULL, n_dims, 0, 0, 0, 10000.0f, 1.0f, 0.0f, 1.0f, 0.0f, 0.0f, base, down, true);
+}
+
+// ggml_rope_cache
+
+struct ggml_tensor * ggml_rope_cache(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * b,
+        int                   n_dims,
+        int                   mode,
+        int                   n_orig_ctx,
+        float                 freq_base,
+        float                 freq_scale,
+        float                 ext_factor,
+        float                 attn_factor,
+        float                 beta_fast,
+        float                 beta_slow) {
+    GGML_ASSERT(ggml_is_vector(b));
+    GGML_ASSERT(b->type == GGML_TYPE_I32);
+    GGML_ASSERT(n_dims % 2 == 0);
+
+    GGML_ASSERT((mode & 5) == 0 && "ggml_rope_cache() for ChatGLM and n_past not implemented");
+
+    struct ggml_tensor * result = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, n_dims, b->ne[0]);
+
+    // same layout as the parameters of rope, without n_ctx and xPos
+    int32_t params[13] = { /*n_past*/ 0, n_dims, mode, /*n_ctx*/ 0, n_orig_ctx };
+    memcpy(params +  5, &freq_base,    sizeof(float));
+    memcpy(params +  6, &freq_scale,   sizeof(float));
+    memcpy(params +  7, &ext_factor,   sizeof(float));
+    memcpy(params +  8, &attn_factor,  sizeof(float));
+    memcpy(params +  9, &beta_fast,    sizeof(float));
+    memcpy(params + 10, &beta_slow,    sizeof(float));
+    ggml_set_op_params(result, params, sizeof(params));
+
+    result->op     = GGML_OP_ROPE_CACHE;
+    result->grad   = NULL;
+    result->src[0] = b;
+
+    return result;
 }
 
 // ggml_rope_back
@@ -5387,7 +5643,8 @@ struct ggml_tensor * ggml_conv_2d(
                 ggml_reshape_2d(ctx, im2col, im2col->ne[0],  im2col->ne[3] * im2col->ne[2] * im2col->ne[1]), // [N, OH, OW, IC * KH * KW] => [N*OH*OW, IC * KH * KW]
                 ggml_reshape_2d(ctx, a, (a->ne[0] * a->ne[1] * a->ne[2]),  a->ne[3]));                       // [OC，IC, KH, KW] => [OC, IC * KH * KW]
 
-    result = ggml_reshape_4d(ctx, result, im2col->ne[1], im2col->ne[2], a->ne[3], im2col->ne[3]); // [N, OC, OH, OW]
+    result = ggml_reshape_4d(ctx, result, im2col->ne[1], im2col->ne[2], im2col->ne[3], a->ne[3]); // [OC, N, OH, OW]
+    result = ggml_cont(ctx, ggml_permute(ctx, result, 0, 1, 3, 2)); // [N, OC, OH, OW]
 
     return result;
 }
@@ -5650,6 +5907,58 @@ struct ggml_tensor * ggml_flash_attn(
     return result;
 }
 
+// ggml_flash_attn_ext
+
+struct ggml_tensor * ggml_flash_attn_ext(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * q,
+        struct ggml_tensor  * k,
+        struct ggml_tensor  * v,
+        struct ggml_tensor  * mask,
+        float                 scale) {
+    GGML_ASSERT(q->type == GGML_TYPE_F32);
+    GGML_ASSERT(k->ne[0] == q->ne[0]);
+    GGML_ASSERT(v->ne[0] == q->ne[0]);
+    GGML_ASSERT(v->ne[1] == k->ne[1]);
+    GGML_ASSERT(q->ne[2] % k->ne[2] == 0); // GQA broadcast
+    GGML_ASSERT(v->ne[2] == k->ne[2]);
+    GGML_ASSERT(q->ne[3] == k->ne[3] && v->ne[3] == k->ne[3]);
+    // k rows are dot-ed with q in the vec_dot type of k
+    GGML_ASSERT(k->nb[0] == ggml_type_size(k->type));
+    // a transposed v is only supported for the non-quantized types
+    GGML_ASSERT(v->nb[0] == ggml_type_size(v->type) || !ggml_is_quantized(v->type));
+
+    if (mask) {
+        GGML_ASSERT(mask->type == GGML_TYPE_F32);
+        GGML_ASSERT(ggml_is_contiguous(mask));
+        GGML_ASSERT(mask->ne[0] == k->ne[1]);
+        GGML_ASSERT(mask->ne[1] >= q->ne[1]);
+        GGML_ASSERT(mask->ne[2] == 1 && mask->ne[3] == 1);
+    }
+
+    bool is_node = false;
+
+    if (q->grad || k->grad || v->grad) {
+        // TODO: implement backward
+        is_node = true;
+    }
+
+    const int64_t ne[4] = { q->ne[0], q->ne[2], q->ne[1], q->ne[3] };
+    struct ggml_tensor * result = ggml_new_tensor(ctx, GGML_TYPE_F32, 4, ne);
+
+    float params[] = { scale };
+    ggml_set_op_params(result, params, sizeof(params));
+
+    result->op   = GGML_OP_FLASH_ATTN_EXT;
+    result->grad = is_node ? ggml_dup_tensor(ctx, result) : NULL;
+    result->src[0] = q;
+    result->src[1] = k;
+    result->src[2] = v;
+    result->src[3] = mask;
+
+    return result;
+}
+
 // ggml_flash_ff
 
 struct ggml_tensor * ggml_flash_ff(
@@ -6405,23 +6714,22 @@ static void ggml_compute_forward_dup_same_cont(
         return;
     }
 
-    const size_t nb00 = src0->nb[0];
-    const size_t nb0 = dst->nb[0];
+    const size_t type_size = ggml_type_size(src0->type);
 
     const int ith = params->ith; // thread index
     const int nth = params->nth; // number of threads
 
-    // parallelize by elements
-    const int ne = ggml_nelements(dst);
+    // parallelize by blocks, a block being one element for the types that are not quantized
+    const int ne = ggml_nelements(dst)/ggml_blck_size(dst->type);
     const int dr = (ne + nth - 1) / nth;
     const int ie0 = dr * ith;
     const int ie1 = MIN(ie0 + dr, ne);
 
     if (ie0 < ie1) {
         memcpy(
-            ((char *)  dst->data + ie0*nb0),
-            ((char *) src0->data + ie0*nb00),
-            (ie1 - ie0) * ggml_type_size(src0->type));
+            ((char *)  dst->data + ie0*type_size),
+            ((char *) src0->data + ie0*type_size),
+            (ie1 - ie0) * type_size);
     }
 
 }
@@ -6945,6 +7253,51 @@ static void ggml_compute_forward_dup_f32(
     }
 }
 
+// copy without conversion to a contiguous tensor of the same type, for the types without a dup of their own
+static void ggml_compute_forward_dup_bytes(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * src0,
+        struct ggml_tensor * dst) {
+    GGML_ASSERT(ggml_nelements(dst) == ggml_nelements(src0));
+    GGML_ASSERT(src0->type == dst->type);
+    GGML_ASSERT(ggml_is_contiguous(dst));
+    GGML_ASSERT(ggml_blck_size(src0->type) == 1);
+
+    if (params->type == GGML_TASK_INIT || params->type == GGML_TASK_FINALIZE) {
+        return;
+    }
+
+    GGML_TENSOR_UNARY_OP_LOCALS
+
+    const size_t type_size = ggml_type_size(src0->type);
+
+    const int ith = params->ith; // thread index
+    const int nth = params->nth; // number of threads
+
+    // parallelize by rows
+    const int64_t nr  = ne01*ne02*ne03;
+    const int64_t dr  = (nr + nth - 1) / nth;
+    const int64_t ir0 = dr * ith;
+    const int64_t ir1 = MIN(ir0 + dr, nr);
+
+    for (int64_t ir = ir0; ir < ir1; ir++) {
+        const int64_t i03 = ir/(ne02*ne01);
+        const int64_t i02 = (ir - i03*ne02*ne01)/ne01;
+        const int64_t i01 = ir - i03*ne02*ne01 - i02*ne01;
+
+        const char * src_row = (const char *) src0->data + i01*nb01 + i02*nb02 + i03*nb03;
+        char       * dst_row = (char *) dst->data + ir*ne00*type_size;
+
+        if (nb00 == type_size) {
+            memcpy(dst_row, src_row, ne00*type_size);
+        } else {
+            for (int64_t i00 = 0; i00 < ne00; i00++) {
+                memcpy(dst_row + i00*type_size, src_row + i00*nb00, type_size);
+            }
+        }
+    }
+}
+
 static void ggml_compute_forward_dup(
         const struct ggml_compute_params * params,
         const struct ggml_tensor * src0,
@@ -6953,6 +7306,10 @@ static void ggml_compute_forward_dup(
         ggml_compute_forward_dup_same_cont(params, src0, dst);
         return;
     }
+    if (src0->type == dst->type && src0->type != GGML_TYPE_F16 && src0->type != GGML_TYPE_F32 && ggml_is_contiguous(dst)) {
+        ggml_compute_forward_dup_bytes(params, src0, dst);
+        return;
+    }
     switch (src0->type) {
         case GGML_TYPE_F16:
             {
@@ -9146,38 +9503,93 @@ static void ggml_compute_forward_silu_back(
     }
 }
 
-// ggml_compute_forward_norm
+// ggml_compute_forward_swiglu
 
-static void ggml_compute_forward_norm_f32(
+static void ggml_compute_forward_swiglu_f32(
         const struct ggml_compute_params * params,
         const struct ggml_tensor * src0,
+        const struct ggml_tensor * src1,
         struct ggml_tensor * dst) {
+    GGML_ASSERT(ggml_is_contiguous_except_dim_1(src0));
+    GGML_ASSERT(ggml_is_contiguous_except_dim_1(src1));
+    GGML_ASSERT(ggml_is_contiguous_except_dim_1(dst));
     GGML_ASSERT(ggml_are_same_shape(src0, dst));
+    GGML_ASSERT(ggml_are_same_shape(src0, src1));
 
     if (params->type == GGML_TASK_INIT || params->type == GGML_TASK_FINALIZE) {
         return;
     }
 
-    GGML_ASSERT(src0->nb[0] == sizeof(float));
-
     const int ith = params->ith;
     const int nth = params->nth;
 
-    GGML_TENSOR_UNARY_OP_LOCALS
+    const int nc = src0->ne[0];
+    const int nr = ggml_nrows(src0);
 
-    float eps;
-    memcpy(&eps, dst->op_params, sizeof(float));
+    // rows per thread
+    const int dr = (nr + nth - 1)/nth;
 
-    // TODO: optimize
-    for (int64_t i03 = 0; i03 < ne03; i03++) {
-        for (int64_t i02 = 0; i02 < ne02; i02++) {
-            for (int64_t i01 = ith; i01 < ne01; i01 += nth) {
-                const float * x = (float *) ((char *) src0->data + i01*nb01 + i02*nb02 + i03*nb03);
+    // row range for this thread
+    const int ir0 = dr*ith;
+    const int ir1 = MIN(ir0 + dr, nr);
 
-                ggml_float sum = 0.0;
-                for (int64_t i00 = 0; i00 < ne00; i00++) {
-                    sum += (ggml_float)x[i00];
-                }
+    for (int i1 = ir0; i1 < ir1; i1++) {
+        ggml_vec_swiglu_f32(nc,
+                (float *) ((char *) dst->data  + i1*( dst->nb[1])),
+                (float *) ((char *) src0->data + i1*(src0->nb[1])),
+                (float *) ((char *) src1->data + i1*(src1->nb[1])));
+    }
+}
+
+static void ggml_compute_forward_swiglu(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * src0,
+        const struct ggml_tensor * src1,
+        struct ggml_tensor * dst) {
+    switch (src0->type) {
+        case GGML_TYPE_F32:
+            {
+                ggml_compute_forward_swiglu_f32(params, src0, src1, dst);
+            } break;
+        default:
+            {
+                GGML_ASSERT(false);
+            } break;
+    }
+}
+
+// ggml_compute_forward_norm
+
+static void ggml_compute_forward_norm_f32(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * src0,
+        struct ggml_tensor * dst) {
+    GGML_ASSERT(ggml_are_same_shape(src0, dst));
+
+    if (params->type == GGML_TASK_INIT || params->type == GGML_TASK_FINALIZE) {
+        return;
+    }
+
+    GGML_ASSERT(src0->nb[0] == sizeof(float));
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    GGML_TENSOR_UNARY_OP_LOCALS
+
+    float eps;
+    memcpy(&eps, dst->op_params, sizeof(float));
+
+    // TODO: optimize
+    for (int64_t i03 = 0; i03 < ne03; i03++) {
+        for (int64_t i02 = 0; i02 < ne02; i02++) {
+            for (int64_t i01 = ith; i01 < ne01; i01 += nth) {
+                const float * x = (float *) ((char *) src0->data + i01*nb01 + i02*nb02 + i03*nb03);
+
+                ggml_float sum = 0.0;
+                for (int64_t i00 = 0; i00 < ne00; i00++) {
+                    sum += (ggml_float)x[i00];
+                }
 
                 float mean = sum/ne00;
 
@@ -9455,6 +9867,75 @@ static void ggml_compute_forward_rms_norm_back(
     }
 }
 
+// ggml_compute_forward_rms_norm_mul
+
+static void ggml_compute_forward_rms_norm_mul_f32(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * src0,
+        const struct ggml_tensor * src1,
+        struct ggml_tensor * dst) {
+    GGML_ASSERT(ggml_are_same_shape(src0, dst));
+    GGML_ASSERT(ggml_can_repeat(src1, src0) && src1->ne[0] == src0->ne[0]);
+
+    if (params->type == GGML_TASK_INIT || params->type == GGML_TASK_FINALIZE) {
+        return;
+    }
+
+    GGML_ASSERT(src0->nb[0] == sizeof(float));
+    GGML_ASSERT(src1->nb[0] == sizeof(float));
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    GGML_TENSOR_BINARY_OP_LOCALS
+
+    float eps;
+    memcpy(&eps, dst->op_params, sizeof(float));
+
+    for (int64_t i03 = 0; i03 < ne03; i03++) {
+        for (int64_t i02 = 0; i02 < ne02; i02++) {
+            for (int64_t i01 = ith; i01 < ne01; i01 += nth) {
+                const float * x = (float *) ((char *) src0->data + i01*nb01 + i02*nb02 + i03*nb03);
+                const float * w = (float *) ((char *) src1->data + (i01 % ne11)*nb11 + (i02 % ne12)*nb12 + (i03 % ne13)*nb13);
+
+                ggml_float sum = 0.0;
+                for (int64_t i00 = 0; i00 < ne00; i00++) {
+                    sum += (ggml_float)(x[i00] * x[i00]);
+                }
+
+                const float mean = sum/ne00;
+
+                float * y = (float *) ((char *) dst->data + i01*nb1 + i02*nb2 + i03*nb3);
+
+                memcpy(y, x, ne00 * sizeof(float));
+
+                const float scale = 1.0f/sqrtf(mean + eps);
+
+                // same rounding as ggml_rms_norm followed by ggml_mul
+                ggml_vec_scale_f32(ne00, y, scale);
+                ggml_vec_mul_f32  (ne00, y, y, w);
+            }
+        }
+    }
+}
+
+static void ggml_compute_forward_rms_norm_mul(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * src0,
+        const struct ggml_tensor * src1,
+        struct ggml_tensor * dst) {
+    switch (src0->type) {
+        case GGML_TYPE_F32:
+            {
+                ggml_compute_forward_rms_norm_mul_f32(params, src0, src1, dst);
+            } break;
+        default:
+            {
+                GGML_ASSERT(false);
+            } break;
+    }
+}
+
 // ggml_compute_forward_group_norm
 
 static void ggml_compute_forward_group_norm_f32(
@@ -9548,6 +10029,20 @@ static void ggml_compute_forward_group_norm(
 // ggml_compute_forward_mul_mat
 
 #if defined(GGML_USE_ACCELERATE) || defined(GGML_USE_OPENBLAS)
+// the batch sizes ne1 of the mul_mat that can go to BLAS are split in buckets [32, 64), [64, 128), ..., [1024, inf)
+#define GGML_BLAS_N_BUCKETS 6
+
+// set for the types and batch sizes for which the native kernels are faster than BLAS, see ggml_blas_tune()
+static bool g_blas_native[GGML_TYPE_COUNT][GGML_BLAS_N_BUCKETS] = { { false } };
+
+static int ggml_blas_bucket(int64_t ne1) {
+    int bucket = 0;
+    while (bucket < GGML_BLAS_N_BUCKETS - 1 && ne1 >= (32 << (bucket + 1))) {
+        bucket++;
+    }
+    return bucket;
+}
+
 // helper function to determine if it is better to use BLAS or not
 // for large matrices, BLAS is faster
 static bool ggml_compute_forward_mul_mat_use_blas(
@@ -9564,13 +10059,16 @@ static bool ggml_compute_forward_mul_mat_use_blas(
 
     // NOTE: with GGML_OP_MUL_MAT_ID we don't want to go through the BLAS branch because it will dequantize (to_float)
     //       all the experts for each batch element and the processing would become incredibly slow
+    //       the types that interleave rows have no to_float
     // TODO: find the optimal values for these
     if (dst->op != GGML_OP_MUL_MAT_ID &&
+        type_traits[src0->type].nrows == 0 &&
         ggml_is_contiguous(src0) &&
         ggml_is_contiguous(src1) &&
       //src0->type == GGML_TYPE_F32 &&
         src1->type == GGML_TYPE_F32 &&
-        (ne0 >= 32 && ne1 >= 32 && ne10 >= 32)) {
+        (ne0 >= 32 && ne1 >= 32 && ne10 >= 32) &&
+        !g_blas_native[src0->type][ggml_blas_bucket(ne1)]) {
 
         /*printf("BLAS: %d %d %d %d %d\n", ne0, ne1, ne10, ne00, ne01);*/
         return true;
@@ -9580,6 +10078,42 @@ static bool ggml_compute_forward_mul_mat_use_blas(
 }
 #endif
 
+// size of src1 converted to the vec_dot_type of src0 in the work buffer
+static size_t ggml_mul_mat_wsize_src1(const struct ggml_tensor * src0, const struct ggml_tensor * src1) {
+    const enum ggml_type vec_dot_type = type_traits[src0->type].vec_dot_type;
+
+    return src1->type != vec_dot_type ? ggml_row_size(vec_dot_type, ggml_nelements(src1)) : 0;
+}
+
+// bytes of the src0 rows, and of the src1 rows, of a tile of dst
+#define GGML_MUL_MAT_TILE_BYTES (128*1024)
+
+// the threads compute the tiles of dr0 src0 rows x dr1 src1 rows of dst in turn, taking the next one when they are
+// done: the rows of a tile fit in the L2 cache, and the tiles are made smaller until there are enough of them for the
+// threads that finish first to make up for the slower ones
+static void ggml_mul_mat_tile_size(
+        int64_t nr0, size_t nb0,
+        int64_t nr1, size_t nb1,
+        int nth, int64_t * dr0, int64_t * dr1) {
+    const int64_t blck = 16; // dst is computed by blocks of 16 x 16
+
+    int64_t d0 = MIN(nr0, MAX(blck, (int64_t) (GGML_MUL_MAT_TILE_BYTES/nb0) / blck * blck));
+    int64_t d1 = MIN(nr1, MAX(blck, (int64_t) (GGML_MUL_MAT_TILE_BYTES/nb1)));
+
+    while (nth > 1 && ((nr0 + d0 - 1)/d0)*((nr1 + d1 - 1)/d1) < 4*nth) {
+        if (d0 > blck && (d0 >= d1 || d1 <= blck)) {
+            d0 = MAX(blck, d0/2 / blck * blck);
+        } else if (d1 > blck) {
+            d1 = MAX(blck, d1/2);
+        } else {
+            break;
+        }
+    }
+
+    *dr0 = d0;
+    *dr1 = d1;
+}
+
 static void ggml_compute_forward_mul_mat(
         const struct ggml_compute_params * params,
         const struct ggml_tensor * src0,
@@ -9597,9 +10131,11 @@ static void ggml_compute_forward_mul_mat(
 
     const bool src1_cont = ggml_is_contiguous(src1);
 
-    ggml_vec_dot_t    const vec_dot               = type_traits[type].vec_dot;
-    enum ggml_type    const vec_dot_type          = type_traits[type].vec_dot_type;
-    ggml_from_float_t const from_float_to_vec_dot = type_traits[vec_dot_type].from_float;
+    ggml_vec_dot_t     const vec_dot               = type_traits[type].vec_dot;
+    ggml_vec_dot_2x2_t const vec_dot_2x2           = type_traits[type].vec_dot_2x2;
+    enum ggml_type     const vec_dot_type          = type_traits[type].vec_dot_type;
+    ggml_from_float_t  const from_float_to_vec_dot = type_traits[vec_dot_type].from_float;
+    int64_t            const vec_dot_nrows         = MAX(1, type_traits[type].nrows); // src0 rows per vec_dot
 
     GGML_ASSERT(ne0 == ne01);
     GGML_ASSERT(ne1 == ne11);
@@ -9634,15 +10170,32 @@ static void ggml_compute_forward_mul_mat(
 
 #if defined(GGML_USE_ACCELERATE) || defined(GGML_USE_OPENBLAS)
     if (ggml_compute_forward_mul_mat_use_blas(src0, src1, dst)) {
-        if (params->ith != 0) {
-            return;
-        }
-
+        // the threads dequantize src0 into the work buffer, then the last one to finish runs sgemm in FINALIZE
         if (params->type == GGML_TASK_INIT) {
             return;
         }
 
-        if (params->type == GGML_TASK_FINALIZE) {
+        if (params->type == GGML_TASK_COMPUTE) {
+            if (type != GGML_TYPE_F32) {
+                      float * const wdata    = params->wdata;
+                ggml_to_float_t const to_float = type_traits[type].to_float;
+
+                // src0 rows per thread
+                const int64_t nr  = ne01*ne02*ne03;
+                const int64_t dr  = (nr + nth - 1)/nth;
+                const int64_t ir0 = dr*ith;
+                const int64_t ir1 = MIN(ir0 + dr, nr);
+
+                for (int64_t ir = ir0; ir < ir1; ++ir) {
+                    const int64_t i03 = ir/(ne02*ne01);
+                    const int64_t i02 = (ir - i03*ne02*ne01)/ne01;
+                    const int64_t i01 = (ir - i03*ne02*ne01 - i02*ne01);
+
+                    to_float((const char *) src0->data + i01*nb01 + i02*nb02 + i03*nb03, wdata + ir*ne00, ne00);
+                }
+
+                assert(nr*ne00*sizeof(float) <= params->wsize);
+            }
             return;
         }
 
@@ -9657,17 +10210,7 @@ static void ggml_compute_forward_mul_mat(
                       float * d = (float *) ((char *)  dst->data + i12*nb2  + i13*nb3);
 
                 if (type != GGML_TYPE_F32) {
-                            float * const wdata    = params->wdata;
-                    ggml_to_float_t const to_float = type_traits[type].to_float;
-
-                    size_t id = 0;
-                    for (int64_t i01 = 0; i01 < ne01; ++i01) {
-                        to_float((const char *) x + i01*nb01, wdata + id, ne00);
-                        id += ne00;
-                    }
-
-                    assert(id*sizeof(float) <= params->wsize);
-                    x = wdata;
+                    x = (float *) params->wdata + (i03*ne02 + i02)*ne01*ne00;
                 }
 
                 cblas_sgemm(CblasRowMajor, CblasNoTrans, CblasTrans,
@@ -9684,6 +10227,15 @@ static void ggml_compute_forward_mul_mat(
     }
 #endif
 
+    // with NUMA, the threads of a node multiply the src0 rows that ggml_numa_place puts on their node, and with fewer
+    // groups of threads than nodes, a group takes the rows of several nodes
+    const int n_parts  = params->numa ? (int) g_state.numa.n_nodes : 1;
+    const int n_group  = params->numa ? ggml_numa_group_size(nth) : nth;
+    const int n_groups = (nth + n_group - 1)/n_group;
+
+    // the counters of the tiles of each part handed out to the threads, after src1 in the work buffer
+    char * tile_next = (char *) params->wdata + GGML_PAD(ggml_mul_mat_wsize_src1(src0, src1), CACHE_LINE_SIZE);
+
     if (params->type == GGML_TASK_INIT) {
         if (src1->type != vec_dot_type) {
             char * wdata = params->wdata;
@@ -9702,6 +10254,13 @@ static void ggml_compute_forward_mul_mat(
             }
         }
 
+        // the threads start with the tile of their index in their group
+        for (int part = 0; part < n_parts; ++part) {
+            const int group = part % n_groups;
+
+            atomic_store((atomic_int *) (tile_next + part*CACHE_LINE_SIZE), MIN(n_group, nth - group*n_group));
+        }
+
         return;
     }
 
@@ -9712,82 +10271,118 @@ static void ggml_compute_forward_mul_mat(
     const void * wdata    = (src1->type == vec_dot_type) ? src1->data : params->wdata;
     const size_t row_size = ggml_row_size(vec_dot_type, ne10);
 
-    const int64_t nr0 = ne01;          // src0 rows
     const int64_t nr1 = ne1*ne12*ne13; // src1 rows
 
-    //printf("nr0 = %lld, nr1 = %lld\n", nr0, nr1);
+    assert(ne12 % ne02 == 0);
+    assert(ne13 % ne03 == 0);
 
-    // distribute the thread work across the inner or outer loop based on which one is larger
+    const int group = ith/n_group;
+    const int ith_g = ith%n_group;
+    const int nth_g = MIN(n_group, nth - group*n_group);
 
-    const int64_t nth0 = nr0 > nr1 ? nth : 1; // parallelize by src0 rows
-    const int64_t nth1 = nr0 > nr1 ? 1 : nth; // parallelize by src1 rows
+    for (int part = group; part < n_parts; part += n_groups) {
+        atomic_int * tile_next_part = (atomic_int *) (tile_next + part*CACHE_LINE_SIZE);
 
-    const int64_t ith0 = ith % nth0;
-    const int64_t ith1 = ith / nth0;
+        // src0 rows of the part
+        int64_t ir00 = 0;
+        int64_t ir01 = ne01;
+        if (n_parts > 1) {
+            ggml_numa_rows(ne01, part, &ir00, &ir01);
 
-    const int64_t dr0 = (nr0 + nth0 - 1)/nth0;
-    const int64_t dr1 = (nr1 + nth1 - 1)/nth1;
+            // keep the groups of interleaved rows whole
+            ir00 -= ir00 % vec_dot_nrows;
+            ir01 -= ir01 % vec_dot_nrows;
+        }
 
-    const int64_t ir010 = dr0*ith0;
-    const int64_t ir011 = MIN(ir010 + dr0, nr0);
+        const int64_t nr0 = ir01 - ir00;
 
-    const int64_t ir110 = dr1*ith1;
-    const int64_t ir111 = MIN(ir110 + dr1, nr1);
+        //printf("nr0 = %lld, nr1 = %lld\n", nr0, nr1);
 
-    //printf("ir010 = %6lld, ir011 = %6lld, ir110 = %6lld, ir111 = %6lld\n", ir010, ir011, ir110, ir111);
+        int64_t dr0;
+        int64_t dr1;
+        ggml_mul_mat_tile_size(MAX(nr0, 1), nb01, nr1, row_size, nth_g, &dr0, &dr1);
+        dr0 = GGML_PAD(dr0, vec_dot_nrows);
 
-    // threads with no work simply yield (not sure if it helps)
-    if (ir010 >= ir011 || ir110 >= ir111) {
-        sched_yield();
-        return;
-    }
+        // the tiles along src0 are consecutive, so that the threads working at the same time share the src1 rows
+        const int64_t n_tiles0 = (nr0 + dr0 - 1)/dr0;
+        const int64_t n_tiles  = n_tiles0*((nr1 + dr1 - 1)/dr1);
 
-    assert(ne12 % ne02 == 0);
-    assert(ne13 % ne03 == 0);
+        for (int64_t tile = ith_g; tile < n_tiles; tile = nth_g > 1 ? atomic_fetch_add(tile_next_part, 1) : tile + 1) {
+            const int64_t ir010 = ir00 + dr0*(tile % n_tiles0);
+            const int64_t ir011 = MIN(ir010 + dr0, ir01);
 
-    // block-tiling attempt
-    const int64_t blck_0 = 16;
-    const int64_t blck_1 = 16;
+            const int64_t ir110 = dr1*(tile / n_tiles0);
+            const int64_t ir111 = MIN(ir110 + dr1, nr1);
 
-    // attempt to reduce false-sharing (does not seem to make a difference)
-    float tmp[16];
+            //printf("ir010 = %6lld, ir011 = %6lld, ir110 = %6lld, ir111 = %6lld\n", ir010, ir011, ir110, ir111);
 
-    for (int64_t iir1 = ir110; iir1 < ir111; iir1 += blck_1) {
-        for (int64_t iir0 = ir010; iir0 < ir011; iir0 += blck_0) {
-            for (int64_t ir1 = iir1; ir1 < iir1 + blck_1 && ir1 < ir111; ++ir1) {
-                const int64_t i13 = (ir1/(ne12*ne1));
-                const int64_t i12 = (ir1 - i13*ne12*ne1)/ne1;
-                const int64_t i11 = (ir1 - i13*ne12*ne1 - i12*ne1);
+            // block-tiling attempt
+            const int64_t blck_0 = 16;
+            const int64_t blck_1 = 16;
 
-                // broadcast src0 into src1
-                const int64_t i03 = i13/r3;
-                const int64_t i02 = i12/r2;
+            // attempt to reduce false-sharing (does not seem to make a difference)
+            // (room for two src1 columns when computing 2x2 blocks)
+            float tmp[2*16];
+
+            for (int64_t iir1 = ir110; iir1 < ir111; iir1 += blck_1) {
+                for (int64_t iir0 = ir010; iir0 < ir011; iir0 += blck_0) {
+                    int64_t nrc1 = 1;
+                    for (int64_t ir1 = iir1; ir1 < iir1 + blck_1 && ir1 < ir111; ir1 += nrc1) {
+                        const int64_t i13 = (ir1/(ne12*ne1));
+                        const int64_t i12 = (ir1 - i13*ne12*ne1)/ne1;
+                        const int64_t i11 = (ir1 - i13*ne12*ne1 - i12*ne1);
+
+                        // pair this column with the next one if it belongs to the same matrix
+                        nrc1 = vec_dot_2x2 && ir1 + 1 < MIN(iir1 + blck_1, ir111) && i11 + 1 < ne11 ? 2 : 1;
+
+                        // broadcast src0 into src1
+                        const int64_t i03 = i13/r3;
+                        const int64_t i02 = i12/r2;
+
+                        const int64_t i1 = i11;
+                        const int64_t i2 = i12;
+                        const int64_t i3 = i13;
+
+                        const char * src0_row = (const char *) src0->data + (0 + i02*nb02 + i03*nb03);
 
-                const int64_t i1 = i11;
-                const int64_t i2 = i12;
-                const int64_t i3 = i13;
+                        // desc: when src1 is not a contiguous memory block we have to calculate the offset using the strides
+                        //       if it is, then we have either copied the data to params->wdata and made it contiguous or we are using
+                        //       the original src1 data pointer, so we should index using the indices directly
+                        // TODO: this is a bit of a hack, we should probably have a better way to handle this
+                        const char * src1_col = (const char *) wdata +
+                            (src1_cont || src1->type != vec_dot_type
+                             ? (i11      + i12*ne11 + i13*ne12*ne11)*row_size
+                             : (i11*nb11 + i12*nb12 + i13*nb13));
 
-                const char * src0_row = (const char *) src0->data + (0 + i02*nb02 + i03*nb03);
+                        float * dst_col = (float *) ((char *) dst->data + (i1*nb1 + i2*nb2 + i3*nb3));
 
-                // desc: when src1 is not a contiguous memory block we have to calculate the offset using the strides
-                //       if it is, then we have either copied the data to params->wdata and made it contiguous or we are using
-                //       the original src1 data pointer, so we should index using the indices directly
-                // TODO: this is a bit of a hack, we should probably have a better way to handle this
-                const char * src1_col = (const char *) wdata +
-                    (src1_cont || src1->type != vec_dot_type
-                     ? (i11      + i12*ne11 + i13*ne12*ne11)*row_size
-                     : (i11*nb11 + i12*nb12 + i13*nb13));
+                        //for (int64_t ir0 = iir0; ir0 < iir0 + blck_0 && ir0 < ir011; ++ir0) {
+                        //    vec_dot(ne00, &dst_col[ir0], src0_row + ir0*nb01, src1_col);
+                        //}
 
-                float * dst_col = (float *) ((char *) dst->data + (i1*nb1 + i2*nb2 + i3*nb3));
+                        const int64_t ir0_end = MIN(iir0 + blck_0, ir011);
 
-                //for (int64_t ir0 = iir0; ir0 < iir0 + blck_0 && ir0 < ir011; ++ir0) {
-                //    vec_dot(ne00, &dst_col[ir0], src0_row + ir0*nb01, src1_col);
-                //}
+                        if (nrc1 == 2) {
+                            const size_t by = src1_cont || src1->type != vec_dot_type ? row_size : nb11;
 
-                for (int64_t ir0 = iir0; ir0 < iir0 + blck_0 && ir0 < ir011; ++ir0) {
-                    vec_dot(ne00, &tmp[ir0 - iir0], src0_row + ir0*nb01, src1_col);
+                            int64_t ir0 = iir0;
+                            for (; ir0 + 1 < ir0_end; ir0 += 2) {
+                                vec_dot_2x2(ne00, &tmp[ir0 - iir0], 16, src0_row + ir0*nb01, nb01, src1_col, by);
+                            }
+                            for (; ir0 < ir0_end; ++ir0) {
+                                vec_dot(ne00, &tmp[ir0 - iir0],      src0_row + ir0*nb01, src1_col);
+                                vec_dot(ne00, &tmp[ir0 - iir0 + 16], src0_row + ir0*nb01, src1_col + by);
+                            }
+                            memcpy(&dst_col[iir0],                              tmp,      (ir0_end - iir0)*sizeof(float));
+                            memcpy(&((float *) ((char *) dst_col + nb1))[iir0], tmp + 16, (ir0_end - iir0)*sizeof(float));
+                        } else {
+                            for (int64_t ir0 = iir0; ir0 < ir0_end; ir0 += vec_dot_nrows) {
+                                vec_dot(ne00, &tmp[ir0 - iir0], src0_row + ir0*nb01, src1_col);
+                            }
+                            memcpy(&dst_col[iir0], tmp, (ir0_end - iir0)*sizeof(float));
+                        }
+                    }
                 }
-                memcpy(&dst_col[iir0], tmp, (MIN(iir0 + blck_0, ir011) - iir0)*sizeof(float));
             }
         }
     }
@@ -9815,6 +10410,7 @@ static void ggml_compute_forward_mul_mat_id(
     ggml_vec_dot_t    const vec_dot               = type_traits[type].vec_dot;
     enum ggml_type    const vec_dot_type          = type_traits[type].vec_dot_type;
     ggml_from_float_t const from_float_to_vec_dot = type_traits[vec_dot_type].from_float;
+    int64_t           const vec_dot_nrows         = MAX(1, type_traits[type].nrows); // src0 rows per vec_dot
 
     GGML_ASSERT(ne0 == ne01);
     GGML_ASSERT(ne1 == ne11);
@@ -9912,7 +10508,7 @@ static void ggml_compute_forward_mul_mat_id(
         const int64_t ith0 = ith % nth0;
         const int64_t ith1 = ith / nth0;
 
-        const int64_t dr0 = (nr0 + nth0 - 1)/nth0;
+        const int64_t dr0 = GGML_PAD((nr0 + nth0 - 1)/nth0, vec_dot_nrows);
         const int64_t dr1 = (nr1 + nth1 - 1)/nth1;
 
         const int64_t ir010 = dr0*ith0;
@@ -9972,7 +10568,7 @@ static void ggml_compute_forward_mul_mat_id(
                     //    vec_dot(ne00, &dst_col[ir0], src0_row + ir0*nb01, src1_col);
                     //}
 
-                    for (int64_t ir0 = iir0; ir0 < iir0 + blck_0 && ir0 < ir011; ++ir0) {
+                    for (int64_t ir0 = iir0; ir0 < iir0 + blck_0 && ir0 < ir011; ir0 += vec_dot_nrows) {
                         vec_dot(ne00, &tmp[ir0 - iir0], src0_row + ir0*nb01, src1_col);
                     }
                     memcpy(&dst_col[iir0], tmp, (MIN(iir0 + blck_0, ir011) - iir0)*sizeof(float));
@@ -11310,6 +11906,7 @@ static void ggml_compute_forward_alibi(
         case GGML_TYPE_I8:
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
+        case GGML_TYPE_Q4_0_X4:
         case GGML_TYPE_COUNT:
             {
                 GGML_ASSERT(false);
@@ -11384,6 +11981,7 @@ static void ggml_compute_forward_clamp(
         case GGML_TYPE_I8:
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
+        case GGML_TYPE_Q4_0_X4:
         case GGML_TYPE_COUNT:
             {
                 GGML_ASSERT(false);
@@ -11432,6 +12030,73 @@ void ggml_rope_yarn_corr_dims(
     dims[1] = MIN(n_dims - 1, ceilf(ggml_rope_yarn_corr_dim(n_dims, n_orig_ctx, beta_slow, freq_base)));
 }
 
+static void ggml_compute_forward_rope_cache(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * src0,
+        struct ggml_tensor * dst) {
+    if (params->type == GGML_TASK_INIT || params->type == GGML_TASK_FINALIZE) {
+        return;
+    }
+
+    float freq_base, freq_scale, ext_factor, attn_factor, beta_fast, beta_slow;
+
+    const int n_dims     = ((int32_t *) dst->op_params)[1];
+    const int mode       = ((int32_t *) dst->op_params)[2];
+    const int n_orig_ctx = ((int32_t *) dst->op_params)[4];
+
+    memcpy(&freq_base,   (int32_t *) dst->op_params +  5, sizeof(float));
+    memcpy(&freq_scale,  (int32_t *) dst->op_params +  6, sizeof(float));
+    memcpy(&ext_factor,  (int32_t *) dst->op_params +  7, sizeof(float));
+    memcpy(&attn_factor, (int32_t *) dst->op_params +  8, sizeof(float));
+    memcpy(&beta_fast,   (int32_t *) dst->op_params +  9, sizeof(float));
+    memcpy(&beta_slow,   (int32_t *) dst->op_params + 10, sizeof(float));
+
+    GGML_ASSERT(dst->nb[0] == sizeof(float));
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    const int np = src0->ne[0];
+
+    // positions per thread
+    const int dp = (np + nth - 1)/nth;
+
+    // position range for this thread
+    const int ip0 = dp*ith;
+    const int ip1 = MIN(ip0 + dp, np);
+
+    const float theta_scale = powf(freq_base, -2.0f/n_dims);
+    const float inv_ndims = -1.f/n_dims;
+    float corr_dims[2];
+    ggml_rope_yarn_corr_dims(n_dims, n_orig_ctx, freq_base, beta_fast, beta_slow, corr_dims);
+
+    const bool is_neox = mode & 2;
+
+    const int32_t * pos = (const int32_t *) src0->data;
+
+    // the angles are accumulated as in ggml_compute_forward_rope_f32, so that rope gives the same results with the cache
+    for (int ip = ip0; ip < ip1; ip++) {
+        float * cache = (float *) ((char *) dst->data + ip*dst->nb[1]);
+
+        float theta_base = (float) pos[ip];
+
+        if (is_neox) {
+            theta_base *= freq_scale;
+        }
+
+        for (int64_t i0 = 0; i0 < n_dims; i0 += 2) {
+            if (is_neox) {
+                const float cur_rot = inv_ndims * i0;
+                rope_yarn(theta_base, freq_scale, corr_dims, cur_rot, ext_factor, attn_factor, &cache[i0 + 0], &cache[i0 + 1]);
+            } else {
+                rope_yarn(theta_base, freq_scale, corr_dims, i0,      ext_factor, attn_factor, &cache[i0 + 0], &cache[i0 + 1]);
+            }
+
+            theta_base *= theta_scale;
+        }
+    }
+}
+
 static void ggml_compute_forward_rope_f32(
         const struct ggml_compute_params * params,
         const struct ggml_tensor * src0,
@@ -11503,6 +12168,11 @@ static void ggml_compute_forward_rope_f32(
 
     const int32_t * pos = (const int32_t *) src1->data;
 
+    // sin and cos precomputed by ggml_rope_cache, they cover the first block of n_dims dims
+    const struct ggml_tensor * src2 = dst->src[2];
+    const bool use_cache = src2 != NULL && src2->backend == GGML_BACKEND_CPU && !is_glm &&
+        (is_neox ? ne0/n_dims == 1 : ne0 == n_dims);
+
     for (int64_t i3 = 0; i3 < ne3; i3++) {
         for (int64_t i2 = 0; i2 < ne2; i2++) {
             const int64_t p = pos[i2];
@@ -11512,6 +12182,8 @@ static void ggml_compute_forward_rope_f32(
 
                 float theta_base = (float)p;
 
+                const float * cache = use_cache ? (const float *) ((const char *) src2->data + i2*src2->nb[1]) : NULL;
+
                 if (is_glm) {
                     theta_base = MIN(p, n_ctx - 2);
                     float block_theta = MAX(p - (n_ctx - 2), 0);
@@ -11540,9 +12212,14 @@ static void ggml_compute_forward_rope_f32(
                 } else if (!is_neox) {
                     for (int64_t i0 = 0; i0 < ne0; i0 += 2) {
                         float cos_theta, sin_theta;
-                        rope_yarn(
-                            theta_base, freq_scale, corr_dims, i0, ext_factor, attn_factor, &cos_theta, &sin_theta
-                        );
+                        if (cache) {
+                            cos_theta = cache[i0 + 0];
+                            sin_theta = cache[i0 + 1];
+                        } else {
+                            rope_yarn(
+                                theta_base, freq_scale, corr_dims, i0, ext_factor, attn_factor, &cos_theta, &sin_theta
+                            );
+                        }
                         sin_theta *= sin_sign;
 
                         // zeta scaling for xPos only:
@@ -11570,10 +12247,15 @@ static void ggml_compute_forward_rope_f32(
                             float cur_rot = inv_ndims * ic - ib;
 
                             float cos_theta, sin_theta;
-                            rope_yarn(
-                                theta_base, freq_scale, corr_dims, cur_rot, ext_factor, attn_factor,
-                                &cos_theta, &sin_theta
-                            );
+                            if (cache) {
+                                cos_theta = cache[ic + 0];
+                                sin_theta = cache[ic + 1];
+                            } else {
+                                rope_yarn(
+                                    theta_base, freq_scale, corr_dims, cur_rot, ext_factor, attn_factor,
+                                    &cos_theta, &sin_theta
+                                );
+                            }
                             sin_theta *= sin_sign;
 
                             theta_base *= theta_scale;
@@ -11660,6 +12342,11 @@ static void ggml_compute_forward_rope_f16(
 
     const int32_t * pos = (const int32_t *) src1->data;
 
+    // sin and cos precomputed by ggml_rope_cache, they cover the first block of n_dims dims
+    const struct ggml_tensor * src2 = dst->src[2];
+    const bool use_cache = src2 != NULL && src2->backend == GGML_BACKEND_CPU && !is_glm &&
+        (is_neox ? ne0/n_dims == 1 : ne0 == n_dims);
+
     for (int64_t i3 = 0; i3 < ne3; i3++) {
         for (int64_t i2 = 0; i2 < ne2; i2++) {
             const int64_t p = pos[i2];
@@ -11669,6 +12356,8 @@ static void ggml_compute_forward_rope_f16(
 
                 float theta_base = (float)p;
 
+                const float * cache = use_cache ? (const float *) ((const char *) src2->data + i2*src2->nb[1]) : NULL;
+
                 if (is_glm) {
                     theta_base = MIN(p, n_ctx - 2);
                     float block_theta = MAX(p - (n_ctx - 2), 0);
@@ -11697,9 +12386,14 @@ static void ggml_compute_forward_rope_f16(
                 } else if (!is_neox) {
                     for (int64_t i0 = 0; i0 < ne0; i0 += 2) {
                         float cos_theta, sin_theta;
-                        rope_yarn(
-                            theta_base, freq_scale, corr_dims, i0, ext_factor, attn_factor, &cos_theta, &sin_theta
-                        );
+                        if (cache) {
+                            cos_theta = cache[i0 + 0];
+                            sin_theta = cache[i0 + 1];
+                        } else {
+                            rope_yarn(
+                                theta_base, freq_scale, corr_dims, i0, ext_factor, attn_factor, &cos_theta, &sin_theta
+                            );
+                        }
                         sin_theta *= sin_sign;
 
                         theta_base *= theta_scale;
@@ -11723,10 +12417,15 @@ static void ggml_compute_forward_rope_f16(
                             float cur_rot = inv_ndims * ic - ib;
 
                             float cos_theta, sin_theta;
-                            rope_yarn(
-                                theta_base, freq_scale, corr_dims, cur_rot, ext_factor, attn_factor,
-                                &cos_theta, &sin_theta
-                            );
+                            if (cache) {
+                                cos_theta = cache[ic + 0];
+                                sin_theta = cache[ic + 1];
+                            } else {
+                                rope_yarn(
+                                    theta_base, freq_scale, corr_dims, cur_rot, ext_factor, attn_factor,
+                                    &cos_theta, &sin_theta
+                                );
+                            }
                             sin_theta *= sin_sign;
 
                             theta_base *= theta_scale;
@@ -12473,6 +13172,31 @@ static void ggml_compute_forward_pad(
 
 // ggml_compute_forward_argsort
 
+// true if the element a goes before b in the order
+static inline bool ggml_argsort_before(float a, float b, enum ggml_sort_order order) {
+    return order == GGML_SORT_ASC ? a < b : a > b;
+}
+
+// restores the heap of the n first indices below root, the element that goes last in the order at the root
+static void ggml_argsort_sift_down(int32_t * idx, const float * src, int64_t root, int64_t n, enum ggml_sort_order order) {
+    for (;;) {
+        int64_t child = 2*root + 1;
+        if (child >= n) {
+            break;
+        }
+        if (child + 1 < n && ggml_argsort_before(src[idx[child]], src[idx[child + 1]], order)) {
+            child++;
+        }
+        if (!ggml_argsort_before(src[idx[root]], src[idx[child]], order)) {
+            break;
+        }
+        int32_t tmp = idx[root];
+        idx[root]   = idx[child];
+        idx[child]  = tmp;
+        root = child;
+    }
+}
+
 static void ggml_compute_forward_argsort_f32(
     const struct ggml_compute_params * params,
     const struct ggml_tensor * src0,
@@ -12501,16 +13225,16 @@ static void ggml_compute_forward_argsort_f32(
             dst_data[j] = j;
         }
 
-        // C doesn't have a functional sort, so we do a bubble sort instead
-        for (int64_t j = 0; j < ne0; j++) {
-            for (int64_t k = j + 1; k < ne0; k++) {
-                if ((order == GGML_SORT_ASC && src_data[dst_data[j]] > src_data[dst_data[k]]) ||
-                    (order == GGML_SORT_DESC && src_data[dst_data[j]] < src_data[dst_data[k]])) {
-                    int32_t tmp = dst_data[j];
-                    dst_data[j] = dst_data[k];
-                    dst_data[k] = tmp;
-                }
-            }
+        // C doesn't have a functional sort, so we do a heap sort instead: the heap keeps at its root the element
+        // that goes last, which is moved to the end of the unsorted part until the heap is empty
+        for (int64_t j = ne0/2 - 1; j >= 0; j--) {
+            ggml_argsort_sift_down(dst_data, src_data, j, ne0, order);
+        }
+        for (int64_t n = ne0 - 1; n > 0; n--) {
+            int32_t tmp = dst_data[0];
+            dst_data[0] = dst_data[n];
+            dst_data[n] = tmp;
+            ggml_argsort_sift_down(dst_data, src_data, 0, n, order);
         }
     }
 }
@@ -12973,6 +13697,205 @@ static void ggml_compute_forward_flash_attn(
     }
 }
 
+// ggml_compute_forward_flash_attn_ext
+
+// number of KV cells whose scores are computed before they are folded into the running softmax
+#define GGML_FLASH_ATTN_EXT_TILE 64
+
+static size_t ggml_flash_attn_ext_q_size(const struct ggml_tensor * dst) {
+    return GGML_PAD(ggml_row_size(type_traits[dst->src[1]->type].vec_dot_type, dst->ne[0]), CACHE_LINE_SIZE);
+}
+
+static size_t ggml_flash_attn_ext_wsize(const struct ggml_tensor * dst) {
+    const int64_t D = dst->ne[0];
+    const int64_t T = GGML_FLASH_ATTN_EXT_TILE;
+
+    // q in the vec_dot type of k, accumulator, dequantized v row, scores and probabilities (F32 and F16)
+    return ggml_flash_attn_ext_q_size(dst) +
+        GGML_PAD(sizeof(float)*(2*D + 2*T) + sizeof(ggml_fp16_t)*T, CACHE_LINE_SIZE);
+}
+
+static void ggml_compute_forward_flash_attn_ext_f32(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * q,
+        const struct ggml_tensor * k,
+        const struct ggml_tensor * v,
+        const struct ggml_tensor * mask,
+        struct ggml_tensor * dst) {
+    if (params->type == GGML_TASK_INIT || params->type == GGML_TASK_FINALIZE) {
+        return;
+    }
+
+    GGML_TENSOR_LOCALS(int64_t, neq, q,   ne)
+    GGML_TENSOR_LOCALS(size_t,  nbq, q,   nb)
+    GGML_TENSOR_LOCALS(int64_t, nek, k,   ne)
+    GGML_TENSOR_LOCALS(size_t,  nbk, k,   nb)
+    GGML_TENSOR_LOCALS(size_t,  nbv, v,   nb)
+    GGML_TENSOR_LOCALS(size_t,  nb,  dst, nb)
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    const int64_t D    = neq0;
+    const int64_t n_kv = nek1;
+    const int64_t T    = GGML_FLASH_ATTN_EXT_TILE;
+
+    GGML_ASSERT(nbq0 == sizeof(float));
+    GGML_ASSERT(nb0  == sizeof(float));
+
+    float scale = 1.0f;
+    memcpy(&scale, (const float *) dst->op_params + 0, sizeof(float));
+
+    const enum ggml_type    k_vec_dot_type = type_traits[k->type].vec_dot_type;
+    ggml_from_float_t const q_to_vec_dot   = type_traits[k_vec_dot_type].from_float;
+    ggml_vec_dot_t    const kq_vec_dot     = type_traits[k->type].vec_dot;
+    ggml_to_float_t   const v_to_float     = type_traits[v->type].to_float;
+
+    // v is stored transposed when its rows are the embedding dims of the cells
+    const bool v_trans = nbv0 != ggml_type_size(v->type);
+
+    GGML_ASSERT(!v_trans || v->type == GGML_TYPE_F32 || v->type == GGML_TYPE_F16);
+
+    // the heads of q that share a head of k and v
+    const int64_t n_gqa = neq2/nek2;
+
+    char * wdata = (char *) params->wdata + ith*ggml_flash_attn_ext_wsize(dst);
+
+    void        * q_vd = wdata;
+    float       * acc  = (float *) (wdata + ggml_flash_attn_ext_q_size(dst));
+    float       * vrow = acc  + D;
+    float       * sc   = vrow + D;
+    float       * pr   = sc   + T;
+    ggml_fp16_t * pr16 = (ggml_fp16_t *) (pr + T);
+
+    // rows of the result, one per (token, head)
+    const int64_t nr = neq1*neq2*neq3;
+
+    const int64_t dr = (nr + nth - 1)/nth;
+
+    const int64_t ir0 = dr*ith;
+    const int64_t ir1 = MIN(ir0 + dr, nr);
+
+    for (int64_t ir = ir0; ir < ir1; ++ir) {
+        const int64_t iq3 = ir/(neq2*neq1);
+        const int64_t iq2 = (ir - iq3*neq2*neq1)/neq1;
+        const int64_t iq1 = (ir - iq3*neq2*neq1 - iq2*neq1);
+
+        const int64_t ik2 = iq2/n_gqa;
+
+        const float * qp = (const float *) ((const char *) q->data + iq1*nbq1 + iq2*nbq2 + iq3*nbq3);
+        const float * mp = mask ? (const float *) ((const char *) mask->data + iq1*mask->nb[1]) : NULL;
+
+        if (q_to_vec_dot) {
+            q_to_vec_dot(qp, q_vd, D);
+        } else {
+            memcpy(q_vd, qp, D*sizeof(float));
+        }
+
+        ggml_vec_set_f32(D, acc, 0.0f);
+
+        float M = -INFINITY; // running maximum of the scores
+        float S = 0.0f;      // running sum of exp(score - M)
+
+        for (int64_t ic0 = 0; ic0 < n_kv; ic0 += T) {
+            const int64_t nt = MIN(T, n_kv - ic0);
+
+            float tile_max = -INFINITY;
+
+            for (int64_t j = 0; j < nt; ++j) {
+                const float mv = mp ? mp[ic0 + j] : 0.0f;
+                if (mv == -INFINITY) {
+                    sc[j] = -INFINITY;
+                    continue;
+                }
+
+                float s;
+                kq_vec_dot(D, &s, (const char *) k->data + (ic0 + j)*nbk1 + ik2*nbk2 + iq3*nbk3, q_vd);
+
+                sc[j] = s*scale + mv;
+                tile_max = MAX(tile_max, sc[j]);
+            }
+
+            if (tile_max == -INFINITY) {
+                // the whole tile is masked
+                continue;
+            }
+
+            if (tile_max > M) {
+                // rescale what was accumulated with the previous maximum
+                const float ms = expf(M - tile_max);
+                ggml_vec_scale_f32(D, acc, ms);
+                S *= ms;
+                M  = tile_max;
+            }
+
+            for (int64_t j = 0; j < nt; ++j) {
+                pr[j] = sc[j] == -INFINITY ? 0.0f : expf(sc[j] - M);
+                S += pr[j];
+            }
+
+            char * vp = (char *) v->data + ic0*nbv1 + ik2*nbv2 + iq3*nbv3;
+
+            if (v_trans) {
+                // the values of each embedding dim are contiguous over the cells of the tile
+                if (v->type == GGML_TYPE_F16) {
+                    for (int64_t j = 0; j < nt; ++j) {
+                        pr16[j] = GGML_FP32_TO_FP16(pr[j]);
+                    }
+                    for (int64_t d = 0; d < D; ++d) {
+                        float s;
+                        ggml_vec_dot_f16(nt, &s, (ggml_fp16_t *) (vp + d*nbv0), pr16);
+                        acc[d] += s;
+                    }
+                } else {
+                    for (int64_t d = 0; d < D; ++d) {
+                        float s;
+                        ggml_vec_dot_f32(nt, &s, (const float *) (vp + d*nbv0), pr);
+                        acc[d] += s;
+                    }
+                }
+            } else {
+                for (int64_t j = 0; j < nt; ++j) {
+                    if (pr[j] == 0.0f) {
+                        continue;
+                    }
+                    const float * vr = (const float *) (vp + j*nbv1);
+                    if (v->type != GGML_TYPE_F32) {
+                        v_to_float(vp + j*nbv1, vrow, D);
+                        vr = vrow;
+                    }
+                    ggml_vec_mad_f32(D, acc, vr, pr[j]);
+                }
+            }
+        }
+
+        // the result is permuted: [D, n_head, n_tokens]
+        float * dp = (float *) ((char *) dst->data + iq2*nb1 + iq1*nb2 + iq3*nb3);
+
+        ggml_vec_scale_f32(D, acc, S == 0.0f ? 0.0f : 1.0f/S);
+        ggml_vec_cpy_f32(D, dp, acc);
+    }
+}
+
+static void ggml_compute_forward_flash_attn_ext(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * q,
+        const struct ggml_tensor * k,
+        const struct ggml_tensor * v,
+        const struct ggml_tensor * mask,
+        struct ggml_tensor * dst) {
+    switch (q->type) {
+        case GGML_TYPE_F32:
+            {
+                ggml_compute_forward_flash_attn_ext_f32(params, q, k, v, mask, dst);
+            } break;
+        default:
+            {
+                GGML_ASSERT(false);
+            } break;
+    }
+}
+
 // ggml_compute_forward_flash_ff
 
 static void ggml_compute_forward_flash_ff_f16(
@@ -14331,6 +15254,10 @@ static void ggml_compute_forward(struct ggml_compute_params * params, struct ggm
             {
                 ggml_compute_forward_silu_back(params, tensor->src[0], tensor->src[1], tensor);
             } break;
+        case GGML_OP_SWIGLU:
+            {
+                ggml_compute_forward_swiglu(params, tensor->src[0], tensor->src[1], tensor);
+            } break;
         case GGML_OP_NORM:
             {
                 ggml_compute_forward_norm(params, tensor->src[0], tensor);
@@ -14343,6 +15270,10 @@ static void ggml_compute_forward(struct ggml_compute_params * params, struct ggm
             {
                 ggml_compute_forward_rms_norm_back(params, tensor->src[0], tensor->src[1], tensor);
             } break;
+        case GGML_OP_RMS_NORM_MUL:
+            {
+                ggml_compute_forward_rms_norm_mul(params, tensor->src[0], tensor->src[1], tensor);
+            } break;
         case GGML_OP_GROUP_NORM:
             {
                 ggml_compute_forward_group_norm(params, tensor->src[0], tensor);
@@ -14427,6 +15358,10 @@ static void ggml_compute_forward(struct ggml_compute_params * params, struct ggm
             {
                 ggml_compute_forward_rope_back(params, tensor->src[0], tensor->src[1], tensor);
             } break;
+        case GGML_OP_ROPE_CACHE:
+            {
+                ggml_compute_forward_rope_cache(params, tensor->src[0], tensor);
+            } break;
         case GGML_OP_ALIBI:
             {
                 ggml_compute_forward_alibi(params, tensor->src[0], tensor);
@@ -14478,6 +15413,10 @@ static void ggml_compute_forward(struct ggml_compute_params * params, struct ggm
                 const bool masked = t != 0;
                 ggml_compute_forward_flash_attn(params, tensor->src[0], tensor->src[1], tensor->src[2], masked, tensor);
             } break;
+        case GGML_OP_FLASH_ATTN_EXT:
+            {
+                ggml_compute_forward_flash_attn_ext(params, tensor->src[0], tensor->src[1], tensor->src[2], tensor->src[3], tensor);
+            } break;
         case GGML_OP_FLASH_FF:
             {
                 ggml_compute_forward_flash_ff(params, tensor->src[0], tensor->src[1], tensor->src[2], tensor->src[3], tensor->src[4], tensor);
@@ -15038,6 +15977,10 @@ static void ggml_compute_backward(struct ggml_context * ctx, struct ggml_tensor
             {
                 GGML_ASSERT(false); // TODO: not implemented
             } break;
+        case GGML_OP_SWIGLU:
+            {
+                GGML_ASSERT(false); // TODO: not implemented
+            } break;
         case GGML_OP_NORM:
             {
                 GGML_ASSERT(false); // TODO: not implemented
@@ -15059,6 +16002,10 @@ static void ggml_compute_backward(struct ggml_context * ctx, struct ggml_tensor
             {
                 GGML_ASSERT(false); // TODO: not implemented
             } break;
+        case GGML_OP_RMS_NORM_MUL:
+            {
+                GGML_ASSERT(false); // TODO: not implemented
+            } break;
         case GGML_OP_GROUP_NORM:
             {
                 GGML_ASSERT(false); // TODO: not implemented
@@ -15415,6 +16362,7 @@ static void ggml_compute_backward(struct ggml_context * ctx, struct ggml_tensor
                             ggml_rope_impl(ctx,
                                 tensor->grad,
                                 src1,
+                                NULL,
                                 n_dims,
                                 mode,
                                 n_ctx,
@@ -15431,6 +16379,10 @@ static void ggml_compute_backward(struct ggml_context * ctx, struct ggml_tensor
                             zero_table);
                 }
             } break;
+        case GGML_OP_ROPE_CACHE:
+            {
+                // depends only on the positions
+            } break;
         case GGML_OP_ALIBI:
             {
                 GGML_ASSERT(false); // TODO: not implemented
@@ -15475,6 +16427,10 @@ static void ggml_compute_backward(struct ggml_context * ctx, struct ggml_tensor
             {
                 GGML_ASSERT(false); // TODO: not implemented
             } break;
+        case GGML_OP_FLASH_ATTN_EXT:
+            {
+                GGML_ASSERT(false); // TODO: not implemented
+            } break;
         case GGML_OP_FLASH_ATTN:
             {
                 struct ggml_tensor * flash_grad = NULL;
@@ -15971,15 +16927,69 @@ typedef pthread_t ggml_thread_t;
 
 #endif
 
+#if defined(_WIN32)
+
+typedef SRWLOCK            ggml_mutex_t;
+typedef CONDITION_VARIABLE ggml_cond_t;
+
+#define ggml_mutex_init(x)     InitializeSRWLock(x)
+#define ggml_mutex_destroy(x)  UNUSED(x)
+#define ggml_mutex_lock(x)     AcquireSRWLockExclusive(x)
+#define ggml_mutex_unlock(x)   ReleaseSRWLockExclusive(x)
+
+#define ggml_cond_init(x)      InitializeConditionVariable(x)
+#define ggml_cond_destroy(x)   UNUSED(x)
+#define ggml_cond_wait(x, m)   SleepConditionVariableSRW(x, m, INFINITE, 0)
+#define ggml_cond_broadcast(x) WakeAllConditionVariable(x)
+
+#else
+
+typedef pthread_mutex_t ggml_mutex_t;
+typedef pthread_cond_t  ggml_cond_t;
+
+#define ggml_mutex_init(x)     pthread_mutex_init(x, NULL)
+#define ggml_mutex_destroy(x)  pthread_mutex_destroy(x)
+#define ggml_mutex_lock(x)     pthread_mutex_lock(x)
+#define ggml_mutex_unlock(x)   pthread_mutex_unlock(x)
+
+#define ggml_cond_init(x)      pthread_cond_init(x, NULL)
+#define ggml_cond_destroy(x)   pthread_cond_destroy(x)
+#define ggml_cond_wait(x, m)   pthread_cond_wait(x, m)
+#define ggml_cond_broadcast(x) pthread_cond_broadcast(x)
+
+#endif
+
+#if defined(__x86_64__) || (defined(_MSC_VER) && defined(_M_AMD64))
+#define ggml_spin_pause() _mm_pause()
+#elif defined(__aarch64__) && !defined(_MSC_VER)
+#define ggml_spin_pause() __asm__ __volatile__("yield")
+#else
+#define ggml_spin_pause()
+#endif
+
 // Android's libc implementation "bionic" does not support setting affinity
 #if defined(__linux__) && !defined(__BIONIC__)
-static void set_numa_thread_affinity(int thread_n, int n_threads) {
+static void set_thread_affinity_cpu(int cpu) {
+    size_t setsize = CPU_ALLOC_SIZE(cpu + 1);
+
+    cpu_set_t * cpus = CPU_ALLOC(cpu + 1);
+    CPU_ZERO_S(setsize, cpus);
+    CPU_SET_S(cpu, setsize, cpus);
+
+    int rv = pthread_setaffinity_np(pthread_self(), setsize, cpus);
+    if (rv) {
+        fprintf(stderr, "warning: pthread_setaffinity_np() failed: %s\n",
+            strerror(rv));
+    }
+
+    CPU_FREE(cpus);
+}
+
+static void set_numa_thread_affinity(int node_num) {
     if (!ggml_is_numa()) {
         return;
     }
 
-    // run thread on node_num thread_n / (threads per node)
-    const int node_num = thread_n / ((n_threads + g_state.numa.n_nodes - 1) / g_state.numa.n_nodes);
     struct ggml_numa_node * node = &g_state.numa.nodes[node_num];
     size_t setsize = CPU_ALLOC_SIZE(g_state.numa.total_cpus);
 
@@ -16022,19 +17032,88 @@ static void clear_numa_thread_affinity(void) {
 #else
 // TODO: Windows etc.
 // (the linux implementation may also work on BSD, someone should test)
-static void set_numa_thread_affinity(int thread_n, int n_threads) { UNUSED(thread_n); UNUSED(n_threads);  }
+static void set_thread_affinity_cpu(int cpu) { UNUSED(cpu); }
+static void set_numa_thread_affinity(int node_num) { UNUSED(node_num); }
 static void clear_numa_thread_affinity(void) {}
 #endif
 
+// persistent worker threads, see ggml_threadpool_new
+// the threads waiting for a value to change spin for params.n_spin checks, then sleep until they are woken up
+struct ggml_threadpool {
+    struct ggml_threadpool_params params;
+
+    struct ggml_compute_state * workers; // [params.n_threads], worker 0 is the thread calling ggml_graph_compute
+
+    ggml_mutex_t mutex_compute; // one graph is computed at a time
+
+    // sleeping threads
+    ggml_mutex_t mutex;
+    ggml_cond_t  cond;
+    atomic_int   n_sleeping;
+
+    atomic_int n_job;     // incremented to start computing the graph of shared
+    atomic_int n_running; // workers that have not finished the current job
+    atomic_int stop;
+
+    struct ggml_compute_state_shared * shared;
+};
+
+// waits until *value != last
+static void ggml_threadpool_wait(struct ggml_threadpool * threadpool, atomic_int * value, int last) {
+    for (int i = 0; i < threadpool->params.n_spin; ++i) {
+        if (atomic_load(value) != last) {
+            return;
+        }
+        ggml_spin_pause();
+    }
+
+    atomic_fetch_add(&threadpool->n_sleeping, 1);
+
+#if defined(__linux__)
+    while (atomic_load(value) == last) {
+        syscall(SYS_futex, value, FUTEX_WAIT_PRIVATE, last, NULL, NULL, 0);
+    }
+#else
+    ggml_mutex_lock(&threadpool->mutex);
+    while (atomic_load(value) == last) {
+        ggml_cond_wait(&threadpool->cond, &threadpool->mutex);
+    }
+    ggml_mutex_unlock(&threadpool->mutex);
+#endif
+
+    atomic_fetch_sub(&threadpool->n_sleeping, 1);
+}
+
+// wakes up the threads sleeping in ggml_threadpool_wait(threadpool, value, ...) after *value was changed
+static void ggml_threadpool_wake(struct ggml_threadpool * threadpool, atomic_int * value) {
+    if (atomic_load(&threadpool->n_sleeping) == 0) {
+        return;
+    }
+
+#if defined(__linux__)
+    syscall(SYS_futex, value, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+#else
+    UNUSED(value);
+    ggml_mutex_lock(&threadpool->mutex);
+    ggml_cond_broadcast(&threadpool->cond);
+    ggml_mutex_unlock(&threadpool->mutex);
+#endif
+}
+
 struct ggml_compute_state_shared {
     const struct ggml_cgraph * cgraph;
     const struct ggml_cplan  * cplan;
 
     int64_t perf_node_start_cycles;
     int64_t perf_node_start_time_us;
+    int64_t node_start_us; // with cplan->node_times
 
     const int n_threads;
 
+    struct ggml_threadpool * threadpool; // NULL if the threads are created for this graph
+
+    bool numa; // the threads are bound to the NUMA nodes
+
     // synchronization primitives
     atomic_int n_active; // num active threads
     atomic_int node_n;   // active graph node
@@ -16047,15 +17126,22 @@ struct ggml_compute_state {
     ggml_thread_t thrd;
     int ith;
     struct ggml_compute_state_shared * shared;
+    struct ggml_threadpool * threadpool;
+    int numa_node; // node the thread is bound to, -1 if none
 };
 
-static void ggml_graph_compute_perf_stats_node(struct ggml_tensor * node, const struct ggml_compute_state_shared * st) {
+static void ggml_graph_compute_perf_stats_node(struct ggml_tensor * node, int node_n, const struct ggml_compute_state_shared * st) {
     int64_t cycles_cur  = ggml_perf_cycles()  - st->perf_node_start_cycles;
     int64_t time_us_cur = ggml_perf_time_us() - st->perf_node_start_time_us;
 
     node->perf_runs++;
     node->perf_cycles  += cycles_cur;
     node->perf_time_us += time_us_cur;
+
+    if (st->cplan->node_times) {
+        st->cplan->node_times[2*node_n + 0] = st->node_start_us;
+        st->cplan->node_times[2*node_n + 1] = ggml_time_us();
+    }
 }
 
 static int ggml_get_n_tasks(struct ggml_tensor * node, int n_threads) {
@@ -16108,11 +17194,13 @@ static int ggml_get_n_tasks(struct ggml_tensor * node, int n_threads) {
             }
             break;
         case GGML_OP_SILU_BACK:
+        case GGML_OP_SWIGLU:
         case GGML_OP_MUL:
         case GGML_OP_DIV:
         case GGML_OP_NORM:
         case GGML_OP_RMS_NORM:
         case GGML_OP_RMS_NORM_BACK:
+        case GGML_OP_RMS_NORM_MUL:
         case GGML_OP_GROUP_NORM:
         case GGML_OP_CONCAT:
             {
@@ -16142,8 +17230,8 @@ static int ggml_get_n_tasks(struct ggml_tensor * node, int n_threads) {
 #endif
 #if defined(GGML_USE_ACCELERATE) || defined(GGML_USE_OPENBLAS)
                 if (ggml_compute_forward_mul_mat_use_blas(node->src[0], node->src[1], node)) {
-                    n_tasks = 1; // TODO: this actually is doing nothing
-                                 //       the threads are still spinning
+                    // the threads dequantize src0 before sgemm, which BLAS runs on its own threads
+                    n_tasks = node->src[0]->type == GGML_TYPE_F32 ? 1 : n_threads;
                 }
 #endif
             } break;
@@ -16173,6 +17261,7 @@ static int ggml_get_n_tasks(struct ggml_tensor * node, int n_threads) {
         case GGML_OP_SOFT_MAX_BACK:
         case GGML_OP_ROPE:
         case GGML_OP_ROPE_BACK:
+        case GGML_OP_ROPE_CACHE:
         case GGML_OP_ADD_REL_POS:
             {
                 n_tasks = n_threads;
@@ -16222,6 +17311,10 @@ static int ggml_get_n_tasks(struct ggml_tensor * node, int n_threads) {
             {
                 n_tasks = n_threads;
             } break;
+        case GGML_OP_FLASH_ATTN_EXT:
+            {
+                n_tasks = n_threads;
+            } break;
         case GGML_OP_FLASH_FF:
             {
                 n_tasks = n_threads;
@@ -16309,13 +17402,25 @@ static thread_ret_t ggml_graph_compute_thread(void * data) {
 
     const int   n_threads   = state->shared->n_threads;
 
-    set_numa_thread_affinity(state->ith, n_threads);
+    struct ggml_threadpool * threadpool = state->shared->threadpool;
+
+    if (state->shared->numa) {
+        // the workers of a pool stay on their node from one graph to the next, the calling thread is unbound after each graph
+        const int numa_node = state->ith/ggml_numa_group_size(n_threads);
+        if (state->ith == 0 || state->numa_node != numa_node) {
+            set_numa_thread_affinity(numa_node);
+            state->numa_node = numa_node;
+        }
+    }
 
     int node_n = -1;
 
     while (true) {
         if (cplan->abort_callback && cplan->abort_callback(cplan->abort_callback_data)) {
             state->shared->node_n += 1;
+            if (threadpool) {
+                ggml_threadpool_wake(threadpool, &state->shared->node_n);
+            }
             return (thread_ret_t) GGML_EXIT_ABORTED;
         }
         if (atomic_fetch_sub(&state->shared->n_active, 1) == 1) {
@@ -16327,6 +17432,7 @@ static thread_ret_t ggml_graph_compute_thread(void * data) {
                 /*.nth   =*/ 0,
                 /*.wsize =*/ cplan->work_size,
                 /*.wdata =*/ cplan->work_data,
+                /*.numa  =*/ state->shared->numa,
             };
 
             if (node_n != -1) {
@@ -16336,7 +17442,7 @@ static thread_ret_t ggml_graph_compute_thread(void * data) {
                     params.nth = ggml_get_n_tasks(node, n_threads);
                     ggml_compute_forward(&params, node);
                 }
-                ggml_graph_compute_perf_stats_node(node, state->shared);
+                ggml_graph_compute_perf_stats_node(node, node_n, state->shared);
             }
 
             // distribute new work or execute it direct if 1T
@@ -16348,6 +17454,9 @@ static thread_ret_t ggml_graph_compute_thread(void * data) {
 
                 state->shared->perf_node_start_cycles  = ggml_perf_cycles();
                 state->shared->perf_node_start_time_us = ggml_perf_time_us();
+                if (cplan->node_times) {
+                    state->shared->node_start_us = ggml_time_us();
+                }
 
                 params.nth = n_tasks;
 
@@ -16368,7 +17477,7 @@ static thread_ret_t ggml_graph_compute_thread(void * data) {
                         ggml_compute_forward(&params, node);
                     }
 
-                    ggml_graph_compute_perf_stats_node(node, state->shared);
+                    ggml_graph_compute_perf_stats_node(node, node_n, state->shared);
                 } else {
                     break;
                 }
@@ -16380,6 +17489,14 @@ static thread_ret_t ggml_graph_compute_thread(void * data) {
 
             atomic_store(&state->shared->n_active, n_threads);
             atomic_store(&state->shared->node_n,   node_n);
+
+            if (threadpool) {
+                ggml_threadpool_wake(threadpool, &state->shared->node_n);
+            }
+        } else if (threadpool) {
+            ggml_threadpool_wait(threadpool, &state->shared->node_n, node_n);
+
+            node_n = atomic_load(&state->shared->node_n);
         } else {
             // wait for other threads to finish
             const int last = node_n;
@@ -16410,6 +17527,7 @@ static thread_ret_t ggml_graph_compute_thread(void * data) {
             /*.nth   =*/ n_tasks,
             /*.wsize =*/ cplan->work_size,
             /*.wdata =*/ cplan->work_data,
+            /*.numa  =*/ state->shared->numa,
         };
 
         if (state->ith < n_tasks) {
@@ -16420,6 +17538,139 @@ static thread_ret_t ggml_graph_compute_thread(void * data) {
     return GGML_EXIT_SUCCESS;
 }
 
+static thread_ret_t ggml_threadpool_thread(void * data) {
+    struct ggml_compute_state * state = (struct ggml_compute_state *) data;
+    struct ggml_threadpool * threadpool = state->threadpool;
+
+    if (threadpool->params.cpu_start >= 0) {
+        set_thread_affinity_cpu(threadpool->params.cpu_start + state->ith);
+    }
+
+    int last_job = 0;
+
+    while (true) {
+        ggml_threadpool_wait(threadpool, &threadpool->n_job, last_job);
+        last_job = atomic_load(&threadpool->n_job);
+
+        if (atomic_load(&threadpool->stop)) {
+            break;
+        }
+
+        // all the workers take part in each job, so that none of them can miss one
+        struct ggml_compute_state_shared * shared = threadpool->shared;
+        if (state->ith < shared->n_threads) {
+            state->shared = shared;
+            ggml_graph_compute_thread(state);
+        }
+
+        if (atomic_fetch_sub(&threadpool->n_running, 1) == 1) {
+            ggml_threadpool_wake(threadpool, &threadpool->n_running);
+        }
+    }
+
+    return 0;
+}
+
+struct ggml_threadpool_params ggml_threadpool_default_params(int n_threads) {
+    struct ggml_threadpool_params params = {
+        /*.n_threads =*/ n_threads > 0 ? n_threads : GGML_DEFAULT_N_THREADS,
+        /*.n_spin    =*/ 4096,
+        /*.cpu_start =*/ -1,
+    };
+
+    return params;
+}
+
+struct ggml_threadpool * ggml_threadpool_new(struct ggml_threadpool_params params) {
+    GGML_ASSERT(params.n_threads > 0);
+
+    struct ggml_threadpool * threadpool = malloc(sizeof(struct ggml_threadpool));
+
+    threadpool->params  = params;
+    threadpool->workers = malloc(sizeof(struct ggml_compute_state)*params.n_threads);
+    threadpool->shared  = NULL;
+
+    ggml_mutex_init(&threadpool->mutex_compute);
+    ggml_mutex_init(&threadpool->mutex);
+    ggml_cond_init(&threadpool->cond);
+
+    atomic_store(&threadpool->n_sleeping, 0);
+    atomic_store(&threadpool->n_job,      0);
+    atomic_store(&threadpool->n_running,  0);
+    atomic_store(&threadpool->stop,       0);
+
+    for (int j = 0; j < params.n_threads; ++j) {
+        threadpool->workers[j] = (struct ggml_compute_state) {
+            .thrd       = 0,
+            .ith        = j,
+            .shared     = NULL,
+            .threadpool = threadpool,
+            .numa_node  = -1,
+        };
+
+        if (j > 0) {
+            const int rc = ggml_thread_create(&threadpool->workers[j].thrd, NULL, ggml_threadpool_thread, &threadpool->workers[j]);
+            GGML_ASSERT(rc == 0);
+            UNUSED(rc);
+        }
+    }
+
+    return threadpool;
+}
+
+void ggml_threadpool_free(struct ggml_threadpool * threadpool) {
+    if (threadpool == NULL) {
+        return;
+    }
+
+    atomic_store(&threadpool->stop, 1);
+    atomic_fetch_add(&threadpool->n_job, 1);
+    ggml_threadpool_wake(threadpool, &threadpool->n_job);
+
+    for (int j = 1; j < threadpool->params.n_threads; ++j) {
+        const int rc = ggml_thread_join(threadpool->workers[j].thrd, NULL);
+        GGML_ASSERT(rc == 0);
+        UNUSED(rc);
+    }
+
+    ggml_cond_destroy(&threadpool->cond);
+    ggml_mutex_destroy(&threadpool->mutex);
+    ggml_mutex_destroy(&threadpool->mutex_compute);
+
+    free(threadpool->workers);
+    free(threadpool);
+}
+
+int ggml_threadpool_n_threads(const struct ggml_threadpool * threadpool) {
+    return threadpool->params.n_threads;
+}
+
+// computes the graph with the threads of the pool, the calling thread is the worker 0
+static int ggml_threadpool_compute(struct ggml_threadpool * threadpool, struct ggml_compute_state_shared * shared) {
+    ggml_mutex_lock(&threadpool->mutex_compute);
+
+    threadpool->shared = shared;
+
+    atomic_store(&threadpool->n_running, threadpool->params.n_threads - 1);
+    atomic_fetch_add(&threadpool->n_job, 1);
+    ggml_threadpool_wake(threadpool, &threadpool->n_job);
+
+    struct ggml_compute_state * worker = &threadpool->workers[0];
+    worker->shared = shared;
+
+    const int compute_status = (size_t) ggml_graph_compute_thread(worker);
+
+    for (int n_running; (n_running = atomic_load(&threadpool->n_running)) != 0; ) {
+        ggml_threadpool_wait(threadpool, &threadpool->n_running, n_running);
+    }
+
+    threadpool->shared = NULL;
+
+    ggml_mutex_unlock(&threadpool->mutex_compute);
+
+    return compute_status;
+}
+
 struct ggml_cplan ggml_graph_plan(struct ggml_cgraph * cgraph, int n_threads) {
     if (n_threads <= 0) {
         n_threads = GGML_DEFAULT_N_THREADS;
@@ -16461,8 +17712,6 @@ struct ggml_cplan ggml_graph_plan(struct ggml_cgraph * cgraph, int n_threads) {
                 } break;
             case GGML_OP_MUL_MAT:
                 {
-                    const enum ggml_type vec_dot_type = type_traits[node->src[0]->type].vec_dot_type;
-
 #if defined(GGML_USE_CLBLAST)
                     if (ggml_cl_can_mul_mat(node->src[0], node->src[1], node)) {
                         cur = ggml_cl_mul_mat_get_wsize(node->src[0], node->src[1], node);
@@ -16471,13 +17720,16 @@ struct ggml_cplan ggml_graph_plan(struct ggml_cgraph * cgraph, int n_threads) {
 #if defined(GGML_USE_ACCELERATE) || defined(GGML_USE_OPENBLAS)
                     if (ggml_compute_forward_mul_mat_use_blas(node->src[0], node->src[1], node)) {
                         if (node->src[0]->type != GGML_TYPE_F32) {
-                            // here we need memory just for single 2D matrix from src0
-                            cur = ggml_type_size(GGML_TYPE_F32)*(node->src[0]->ne[0]*node->src[0]->ne[1]);
+                            // all of src0 is dequantized at once
+                            cur = ggml_type_size(GGML_TYPE_F32)*ggml_nelements(node->src[0]);
                         }
                     } else
 #endif
-                    if (node->src[1]->type != vec_dot_type) {
-                        cur = ggml_row_size(vec_dot_type, ggml_nelements(node->src[1]));
+                    {
+                        cur = ggml_mul_mat_wsize_src1(node->src[0], node->src[1]);
+
+                        // followed by the counters of the tiles handed out to the threads of each NUMA node
+                        cur = GGML_PAD(cur, CACHE_LINE_SIZE) + GGML_NUMA_MAX_NODES*CACHE_LINE_SIZE;
                     }
                 } break;
             case GGML_OP_MUL_MAT_ID:
@@ -16554,6 +17806,10 @@ struct ggml_cplan ggml_graph_plan(struct ggml_cgraph * cgraph, int n_threads) {
                         cur += sizeof(float)*ne11*n_tasks; // this is overestimated by x2
                     }
                 } break;
+            case GGML_OP_FLASH_ATTN_EXT:
+                {
+                    cur = ggml_flash_attn_ext_wsize(node)*n_tasks;
+                } break;
             case GGML_OP_FLASH_FF:
                 {
                     if (node->src[1]->type == GGML_TYPE_F32) {
@@ -16614,56 +17870,71 @@ int ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cplan * cplan) {
         }
     }
 
-    const int n_threads = cplan->n_threads;
+    struct ggml_threadpool * threadpool = cplan->threadpool;
+
+    // the work buffer of a plan for more threads is large enough for fewer threads
+    const int n_threads = threadpool ? MIN(cplan->n_threads, threadpool->params.n_threads) : cplan->n_threads;
 
     struct ggml_compute_state_shared state_shared = {
         /*.cgraph                  =*/ cgraph,
         /*.cgraph_plan             =*/ cplan,
         /*.perf_node_start_cycles  =*/ 0,
         /*.perf_node_start_time_us =*/ 0,
+        /*.node_start_us           =*/ 0,
         /*.n_threads               =*/ n_threads,
+        /*.threadpool              =*/ threadpool,
+        /*.numa                    =*/ ggml_is_numa() && (threadpool == NULL || threadpool->params.cpu_start < 0),
         /*.n_active                =*/ n_threads,
         /*.node_n                  =*/ -1,
         /*.abort_callback          =*/ NULL,
         /*.abort_callback_data     =*/ NULL,
     };
-    struct ggml_compute_state * workers = alloca(sizeof(struct ggml_compute_state)*n_threads);
-
-    // create thread pool
-    if (n_threads > 1) {
-        for (int j = 1; j < n_threads; ++j) {
-            workers[j] = (struct ggml_compute_state) {
-                .thrd   = 0,
-                .ith = j,
-                .shared = &state_shared,
-            };
+    const int64_t perf_start_cycles  = ggml_perf_cycles();
+    const int64_t perf_start_time_us = ggml_perf_time_us();
 
-            const int rc = ggml_thread_create(&workers[j].thrd, NULL, ggml_graph_compute_thread, &workers[j]);
-            GGML_ASSERT(rc == 0);
-            UNUSED(rc);
-        }
-    }
+    int compute_status = GGML_EXIT_SUCCESS;
 
-    workers[0].ith = 0;
-    workers[0].shared = &state_shared;
+    if (threadpool) {
+        compute_status = ggml_threadpool_compute(threadpool, &state_shared);
+    } else {
+        struct ggml_compute_state * workers = alloca(sizeof(struct ggml_compute_state)*n_threads);
+
+        // create thread pool
+        if (n_threads > 1) {
+            for (int j = 1; j < n_threads; ++j) {
+                workers[j] = (struct ggml_compute_state) {
+                    .thrd       = 0,
+                    .ith        = j,
+                    .shared     = &state_shared,
+                    .threadpool = NULL,
+                    .numa_node  = -1,
+                };
 
-    const int64_t perf_start_cycles  = ggml_perf_cycles();
-    const int64_t perf_start_time_us = ggml_perf_time_us();
+                const int rc = ggml_thread_create(&workers[j].thrd, NULL, ggml_graph_compute_thread, &workers[j]);
+                GGML_ASSERT(rc == 0);
+                UNUSED(rc);
+            }
+        }
 
-    // this is a work thread too
-    int compute_status = (size_t) ggml_graph_compute_thread(&workers[0]);
+        workers[0].ith = 0;
+        workers[0].shared = &state_shared;
+        workers[0].numa_node = -1;
 
-    // don't leave affinity set on the main thread
-    clear_numa_thread_affinity();
+        // this is a work thread too
+        compute_status = (size_t) ggml_graph_compute_thread(&workers[0]);
 
-    // join or kill thread pool
-    if (n_threads > 1) {
-        for (int j = 1; j < n_threads; j++) {
-            const int rc = ggml_thread_join(workers[j].thrd, NULL);
-            GGML_ASSERT(rc == 0);
+        // join or kill thread pool
+        if (n_threads > 1) {
+            for (int j = 1; j < n_threads; j++) {
+                const int rc = ggml_thread_join(workers[j].thrd, NULL);
+                GGML_ASSERT(rc == 0);
+            }
         }
     }
 
+    // don't leave affinity set on the main thread
+    clear_numa_thread_affinity();
+
     // performance stats (graph)
     {
         int64_t perf_cycles_cur  = ggml_perf_cycles()  - perf_start_cycles;
@@ -16694,6 +17965,213 @@ void ggml_graph_compute_with_ctx(struct ggml_context * ctx, struct ggml_cgraph *
     ggml_graph_compute(cgraph, &cplan);
 }
 
+#if defined(GGML_USE_ACCELERATE) || defined(GGML_USE_OPENBLAS)
+#define GGML_BLAS_TUNE_VERSION 1
+
+static bool ggml_blas_tune_type(enum ggml_type type) {
+    return type == GGML_TYPE_F32 || (type_traits[type].to_float && type_traits[type].from_float && type_traits[type].vec_dot);
+}
+
+static bool ggml_blas_tune_load(const char * fname, int n_threads) {
+    FILE * f = fopen(fname, "r");
+    if (!f) {
+        return false;
+    }
+
+    bool native[GGML_TYPE_COUNT][GGML_BLAS_N_BUCKETS] = { { false } };
+
+    int  version   = 0;
+    int  n_tuned   = 0;
+    bool ok        = fscanf(f, "ggml-blas-tune %d %d", &version, &n_tuned) == 2 && version == GGML_BLAS_TUNE_VERSION && n_tuned == n_threads;
+
+    char name[64];
+    while (ok && fscanf(f, "%63s", name) == 1) {
+        int type = 0;
+        while (type < GGML_TYPE_COUNT && (!type_traits[type].type_name || strcmp(type_traits[type].type_name, name) != 0)) {
+            type++;
+        }
+
+        for (int b = 0; ok && b < GGML_BLAS_N_BUCKETS; ++b) {
+            int v = 0;
+            ok = fscanf(f, "%d", &v) == 1;
+            if (type < GGML_TYPE_COUNT) {
+                native[type][b] = v != 0;
+            }
+        }
+    }
+
+    fclose(f);
+
+    if (ok) {
+        memcpy(g_blas_native, native, sizeof(native));
+    }
+
+    return ok;
+}
+
+static bool ggml_blas_tune_save(const char * fname, int n_threads) {
+    FILE * f = fopen(fname, "w");
+    if (!f) {
+        return false;
+    }
+
+    fprintf(f, "ggml-blas-tune %d %d\n", GGML_BLAS_TUNE_VERSION, n_threads);
+
+    for (int type = 0; type < GGML_TYPE_COUNT; ++type) {
+        if (!ggml_blas_tune_type(type)) {
+            continue;
+        }
+
+        fprintf(f, "%s", type_traits[type].type_name);
+        for (int b = 0; b < GGML_BLAS_N_BUCKETS; ++b) {
+            fprintf(f, " %d", g_blas_native[type][b] ? 1 : 0);
+        }
+        fprintf(f, "\n");
+    }
+
+    fclose(f);
+
+    return true;
+}
+
+// best time of a few runs of the graph, after a warm up run
+static int64_t ggml_blas_tune_time(struct ggml_cgraph * gf, struct ggml_threadpool * threadpool, int n_threads, void ** work, size_t * work_size) {
+    struct ggml_cplan cplan = ggml_graph_plan(gf, n_threads);
+
+    if (cplan.work_size > *work_size) {
+        free(*work);
+        *work      = malloc(cplan.work_size);
+        *work_size = cplan.work_size;
+    }
+
+    cplan.work_data  = *work;
+    cplan.threadpool = threadpool;
+
+    int64_t t_best = INT64_MAX;
+    for (int rep = 0; rep < 4; ++rep) {
+        const int64_t t_start = ggml_time_us();
+        ggml_graph_compute(gf, &cplan);
+        const int64_t t = ggml_time_us() - t_start;
+
+        if (rep > 0) {
+            t_best = MIN(t_best, t);
+        }
+    }
+
+    return t_best;
+}
+
+static void ggml_blas_tune_run(int n_threads) {
+    // the size of the attention and feed-forward weights of the smaller models
+    const int64_t ne00    = 1024;
+    const int64_t ne01    = 1024;
+    const int64_t ne1_max = 32 << (GGML_BLAS_N_BUCKETS - 1);
+
+    struct ggml_init_params params = {
+        /*.mem_size   =*/ ggml_row_size(GGML_TYPE_F32, ne00)*(ne01 + ne1_max) + 2*ggml_tensor_overhead(),
+        /*.mem_buffer =*/ NULL,
+        /*.no_alloc   =*/ false,
+    };
+
+    struct ggml_context * ctx = ggml_init(params);
+
+    struct ggml_tensor * x = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, ne00, ne01);
+    struct ggml_tensor * y = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, ne00, ne1_max);
+
+    for (int64_t i = 0; i < ne00*ne01; ++i) {
+        ((float *) x->data)[i] = (float) ((i*7919) % 2001 - 1000)/1000.0f;
+    }
+    for (int64_t i = 0; i < ne00*ne1_max; ++i) {
+        ((float *) y->data)[i] = (float) ((i*104729) % 2001 - 1000)/1000.0f;
+    }
+
+    // the tensors and graphs of one type
+    params.mem_size = ggml_row_size(GGML_TYPE_F32, ne00)*ne01 + ggml_tensor_overhead();
+    for (int b = 0; b < GGML_BLAS_N_BUCKETS; ++b) {
+        params.mem_size += ggml_row_size(GGML_TYPE_F32, ne01)*(32 << b) + 2*ggml_tensor_overhead() + ggml_graph_overhead_custom(8, false);
+    }
+
+    struct ggml_threadpool * threadpool = ggml_threadpool_new(ggml_threadpool_default_params(n_threads));
+
+    void * work      = NULL;
+    size_t work_size = 0;
+
+    for (int type = 0; type < GGML_TYPE_COUNT; ++type) {
+        if (!ggml_blas_tune_type(type)) {
+            continue;
+        }
+
+        struct ggml_context * ctx_type = ggml_init(params);
+
+        struct ggml_tensor * src0 = ggml_new_tensor_2d(ctx_type, type, ne00, ne01);
+        for (int64_t i01 = 0; i01 < ne01; ++i01) {
+            if (type == GGML_TYPE_F32) {
+                memcpy((char *) src0->data + i01*src0->nb[1], (char *) x->data + i01*x->nb[1], x->nb[1]);
+            } else {
+                type_traits[type].from_float((float *) ((char *) x->data + i01*x->nb[1]), (char *) src0->data + i01*src0->nb[1], ne00);
+            }
+        }
+
+        // BLAS is assumed to stay faster for the batches larger than the first one it wins
+        bool blas = false;
+
+        for (int b = 0; b < GGML_BLAS_N_BUCKETS; ++b) {
+            if (blas) {
+                g_blas_native[type][b] = false;
+                continue;
+            }
+
+            const int64_t ne1 = 32 << b;
+
+            struct ggml_tensor * src1 = ggml_view_2d(ctx_type, y, ne00, ne1, y->nb[1], 0);
+            struct ggml_tensor * dst  = ggml_mul_mat(ctx_type, src0, src1);
+
+            struct ggml_cgraph * gf = ggml_new_graph_custom(ctx_type, 8, false);
+            ggml_build_forward_expand(gf, dst);
+
+            g_blas_native[type][b] = true;
+            const int64_t t_native = ggml_blas_tune_time(gf, threadpool, n_threads, &work, &work_size);
+
+            g_blas_native[type][b] = false;
+            const int64_t t_blas   = ggml_blas_tune_time(gf, threadpool, n_threads, &work, &work_size);
+
+            GGML_PRINT_DEBUG("%s: %s, ne1 = %5d: native %8.3f ms, BLAS %8.3f ms\n",
+                    __func__, type_traits[type].type_name, (int) ne1, t_native/1000.0, t_blas/1000.0);
+
+            blas = t_blas < t_native;
+            g_blas_native[type][b] = !blas;
+        }
+
+        ggml_free(ctx_type);
+    }
+
+    free(work);
+    ggml_threadpool_free(threadpool);
+    ggml_free(ctx);
+}
+#endif
+
+bool ggml_blas_tune(const char * fname, int n_threads) {
+#if defined(GGML_USE_ACCELERATE) || defined(GGML_USE_OPENBLAS)
+    if (fname != NULL && ggml_blas_tune_load(fname, n_threads)) {
+        return true;
+    }
+
+    ggml_blas_tune_run(n_threads);
+
+    if (fname != NULL && !ggml_blas_tune_save(fname, n_threads)) {
+        fprintf(stderr, "%s: failed to save the BLAS tuning to '%s'\n", __func__, fname);
+    }
+
+    return true;
+#else
+    UNUSED(fname);
+    UNUSED(n_threads);
+
+    return false;
+#endif
+}
+
 struct ggml_tensor * ggml_graph_get_tensor(struct ggml_cgraph * cgraph, const char * name) {
     for (int i = 0; i < cgraph->n_leafs; i++) {
         struct ggml_tensor * leaf = cgraph->leafs[i];
@@ -17393,11 +18871,20 @@ void ggml_graph_dump_dot(const struct ggml_cgraph * gb, const struct ggml_cgraph
 
 ////////////////////////////////////////////////////////////////////////////////
 
+// the parameters and their gradients can be copied as a whole when they are F32 and contiguous
+static bool ggml_opt_is_flat(const struct ggml_tensor * t) {
+    return t->type == GGML_TYPE_F32 && ggml_is_contiguous(t);
+}
+
 static void ggml_opt_set_params(int np, struct ggml_tensor * const ps[], const float * x) {
-    int i = 0;
+    int64_t i = 0;
     for (int p = 0; p < np; ++p) {
         const int64_t ne = ggml_nelements(ps[p]) ;
-        // TODO: add function to set tensor from array
+        if (ggml_opt_is_flat(ps[p])) {
+            memcpy(ps[p]->data, x + i, ne*sizeof(float));
+            i += ne;
+            continue;
+        }
         for (int64_t j = 0; j < ne; ++j) {
             ggml_set_f32_1d(ps[p], j, x[i++]);
         }
@@ -17405,10 +18892,14 @@ static void ggml_opt_set_params(int np, struct ggml_tensor * const ps[], const f
 }
 
 static void ggml_opt_get_params(int np, struct ggml_tensor * const ps[], float * x) {
-    int i = 0;
+    int64_t i = 0;
     for (int p = 0; p < np; ++p) {
         const int64_t ne = ggml_nelements(ps[p]) ;
-        // TODO: add function to get all elements at once
+        if (ggml_opt_is_flat(ps[p])) {
+            memcpy(x + i, ps[p]->data, ne*sizeof(float));
+            i += ne;
+            continue;
+        }
         for (int64_t j = 0; j < ne; ++j) {
             x[i++] = ggml_get_f32_1d(ps[p], j);
         }
@@ -17419,7 +18910,11 @@ static void ggml_opt_get_grad(int np, struct ggml_tensor * const ps[], float * g
     int64_t i = 0;
     for (int p = 0; p < np; ++p) {
         const int64_t ne = ggml_nelements(ps[p]) ;
-        // TODO: add function to get all elements at once
+        if (ggml_opt_is_flat(ps[p]->grad)) {
+            memcpy(g + i, ps[p]->grad->data, ne*sizeof(float));
+            i += ne;
+            continue;
+        }
         for (int64_t j = 0; j < ne; ++j) {
             g[i++] = ggml_get_f32_1d(ps[p]->grad, j);
         }
@@ -17430,19 +18925,207 @@ static void ggml_opt_acc_grad(int np, struct ggml_tensor * const ps[], float * g
     int64_t i = 0;
     for (int p = 0; p < np; ++p) {
         const int64_t ne = ggml_nelements(ps[p]) ;
-        // TODO: add function to get all elements at once
+        if (ggml_opt_is_flat(ps[p]->grad) && ne <= INT_MAX) {
+            ggml_vec_mad_f32(ne, g + i, ps[p]->grad->data, scale);
+            i += ne;
+            continue;
+        }
         for (int64_t j = 0; j < ne; ++j) {
             g[i++] += ggml_get_f32_1d(ps[p]->grad, j) * scale;
         }
     }
 }
 
+// runs fn(data, ith, nth) on n_threads threads, the calling thread being the thread 0
+typedef void (*ggml_opt_task_fn)(void * data, int ith, int nth);
+
+struct ggml_opt_task {
+    ggml_opt_task_fn fn;
+    void * data;
+    int ith;
+    int nth;
+};
+
+static thread_ret_t ggml_opt_task_thread(void * data) {
+    struct ggml_opt_task * task = (struct ggml_opt_task *) data;
+    task->fn(task->data, task->ith, task->nth);
+    return 0;
+}
+
+static void ggml_opt_parallel(int n_threads, ggml_opt_task_fn fn, void * data) {
+    if (n_threads <= 1) {
+        fn(data, 0, 1);
+        return;
+    }
+
+    struct ggml_opt_task * tasks   = alloca(sizeof(struct ggml_opt_task)*n_threads);
+    ggml_thread_t        * threads = alloca(sizeof(ggml_thread_t)*n_threads);
+
+    for (int j = 1; j < n_threads; ++j) {
+        tasks[j] = (struct ggml_opt_task) { fn, data, j, n_threads };
+        const int rc = ggml_thread_create(&threads[j], NULL, ggml_opt_task_thread, &tasks[j]);
+        GGML_ASSERT(rc == 0);
+        UNUSED(rc);
+    }
+
+    fn(data, 0, n_threads);
+
+    for (int j = 1; j < n_threads; ++j) {
+        const int rc = ggml_thread_join(threads[j], NULL);
+        GGML_ASSERT(rc == 0);
+        UNUSED(rc);
+    }
+}
+
 //
 // ADAM
 //
 //   ref: https://arxiv.org/pdf/1412.6980.pdf
 //
 
+// the fused update of n parameters x from their gradients g and their moments m and v
+//   keep:   1 - weight decay of the parameters
+//   beta1h: learning rate times the bias correction of m
+//   beta2h: bias correction of v
+static void ggml_vec_adam_f32(const int n, float * restrict x, const float * restrict g, float * restrict m, float * restrict v,
+        const float gnorm, const float beta1, const float beta2, const float beta1h, const float beta2h, const float eps, const float keep) {
+    int i = 0;
+
+#if defined(__AVX__)
+    const __m256 vgnorm  = _mm256_set1_ps(gnorm);
+    const __m256 vbeta1  = _mm256_set1_ps(beta1);
+    const __m256 vbeta2  = _mm256_set1_ps(beta2);
+    const __m256 vbeta1c = _mm256_set1_ps(1.0f - beta1);
+    const __m256 vbeta2c = _mm256_set1_ps(1.0f - beta2);
+    const __m256 vbeta1h = _mm256_set1_ps(beta1h);
+    const __m256 vbeta2h = _mm256_set1_ps(beta2h);
+    const __m256 veps    = _mm256_set1_ps(eps);
+    const __m256 vkeep   = _mm256_set1_ps(keep);
+
+    for (; i + 8 <= n; i += 8) {
+        const __m256 g_ = _mm256_mul_ps(_mm256_loadu_ps(g + i), vgnorm);
+        const __m256 mi = _mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(m + i), vbeta1), _mm256_mul_ps(g_, vbeta1c));
+        const __m256 vi = _mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(v + i), vbeta2), _mm256_mul_ps(_mm256_mul_ps(g_, g_), vbeta2c));
+        _mm256_storeu_ps(m + i, mi);
+        _mm256_storeu_ps(v + i, vi);
+        const __m256 mh = _mm256_mul_ps(mi, vbeta1h);
+        const __m256 vh = _mm256_add_ps(_mm256_sqrt_ps(_mm256_mul_ps(vi, vbeta2h)), veps);
+        _mm256_storeu_ps(x + i, _mm256_sub_ps(_mm256_mul_ps(_mm256_loadu_ps(x + i), vkeep), _mm256_div_ps(mh, vh)));
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    for (; i + 4 <= n; i += 4) {
+        const float32x4_t g_ = vmulq_n_f32(vld1q_f32(g + i), gnorm);
+        const float32x4_t mi = vaddq_f32(vmulq_n_f32(vld1q_f32(m + i), beta1), vmulq_n_f32(g_, 1.0f - beta1));
+        const float32x4_t vi = vaddq_f32(vmulq_n_f32(vld1q_f32(v + i), beta2), vmulq_n_f32(vmulq_f32(g_, g_), 1.0f - beta2));
+        vst1q_f32(m + i, mi);
+        vst1q_f32(v + i, vi);
+        const float32x4_t mh = vmulq_n_f32(mi, beta1h);
+        const float32x4_t vh = vaddq_f32(vsqrtq_f32(vmulq_n_f32(vi, beta2h)), vdupq_n_f32(eps));
+        vst1q_f32(x + i, vsubq_f32(vmulq_n_f32(vld1q_f32(x + i), keep), vdivq_f32(mh, vh)));
+    }
+#endif
+
+    for (; i < n; ++i) {
+        const float g_ = g[i]*gnorm;
+        m[i] = m[i]*beta1 +    g_*(1.0f - beta1);
+        v[i] = v[i]*beta2 + g_*g_*(1.0f - beta2);
+        const float mh = m[i]*beta1h;
+        const float vh = sqrtf(v[i]*beta2h) + eps;
+        x[i] = x[i]*keep - mh/vh;
+    }
+}
+
+// one iteration of Adam over the parameters, split in equal ranges of the flattened parameters between the threads
+struct ggml_opt_adam_step {
+    int np;
+    struct ggml_tensor * const * ps;
+    const int64_t * offs; // [np + 1], offset of each parameter in g, m and v
+
+    float * g;
+    float * m;
+    float * v;
+
+    // sums of the squares of the gradients by blocks of the flattened parameters, for the clipping
+    // the blocks do not depend on the number of threads, so that neither does the norm of the gradients
+    ggml_float * sum_sq; // [n_blocks]
+    int64_t n_blocks;
+    int64_t block_size;
+
+    float gclip;
+    float beta1;
+    float beta2;
+    float beta1h;
+    float beta2h;
+    float eps;
+    float decay;
+    int   decay_min_ndim;
+};
+
+static void ggml_opt_adam_sum_sq(void * data, int ith, int nth) {
+    struct ggml_opt_adam_step * step = (struct ggml_opt_adam_step *) data;
+
+    const int64_t nx = step->offs[step->np];
+
+    for (int64_t ib = ith; ib < step->n_blocks; ib += nth) {
+        const int64_t i0 = ib*step->block_size;
+        const int64_t i1 = MIN(nx, i0 + step->block_size);
+
+        ggml_float sum = 0.0;
+        for (int64_t i = i0; i < i1; ++i) {
+            sum += (ggml_float)(step->g[i]*step->g[i]);
+        }
+        step->sum_sq[ib] = sum;
+    }
+}
+
+// the first element of the range of the thread ith, at a multiple of 32 elements from the start of its parameter,
+// so that the elements left to the scalar loop of ggml_vec_adam_f32 do not depend on the number of threads
+static int64_t ggml_opt_adam_split(const struct ggml_opt_adam_step * step, int ith, int nth) {
+    const int64_t nx = step->offs[step->np];
+    if (ith >= nth) {
+        return nx;
+    }
+
+    const int64_t i = nx*ith/nth;
+
+    int p = 0;
+    while (step->offs[p + 1] <= i) {
+        ++p;
+    }
+    return step->offs[p] + ((i - step->offs[p]) & ~(int64_t) 31);
+}
+
+static void ggml_opt_adam_update(void * data, int ith, int nth) {
+    struct ggml_opt_adam_step * step = (struct ggml_opt_adam_step *) data;
+
+    float gnorm = 1.0f;
+    if (step->gclip > 0.0f) {
+        ggml_float sum = 0.0;
+        for (int64_t ib = 0; ib < step->n_blocks; ++ib) {
+            sum += step->sum_sq[ib];
+        }
+        ggml_float norm = sqrt(sum);
+        if (norm > (ggml_float) step->gclip) {
+            gnorm = (float) ((ggml_float) step->gclip / norm);
+        }
+    }
+
+    const int64_t i0 = ggml_opt_adam_split(step, ith,     nth);
+    const int64_t i1 = ggml_opt_adam_split(step, ith + 1, nth);
+
+    for (int p = 0; p < step->np; ++p) {
+        const int64_t j0 = MAX(i0, step->offs[p]);
+        const int64_t j1 = MIN(i1, step->offs[p + 1]);
+        if (j0 >= j1) {
+            continue;
+        }
+        const float p_decay = ggml_n_dims(step->ps[p]) >= step->decay_min_ndim ? step->decay : 0.0f;
+        float * x = (float *) step->ps[p]->data + (j0 - step->offs[p]);
+        ggml_vec_adam_f32(j1 - j0, x, step->g + j0, step->m + j0, step->v + j0,
+                gnorm, step->beta1, step->beta2, step->beta1h, step->beta2h, step->eps, 1.0f - p_decay);
+    }
+}
+
 static enum ggml_opt_result ggml_opt_adam(
         struct ggml_context * ctx,
         struct ggml_opt_context * opt,
@@ -17457,6 +19140,12 @@ static enum ggml_opt_result ggml_opt_adam(
     // these will store the parameters we want to optimize
     struct ggml_tensor * ps[GGML_MAX_PARAMS];
 
+    // offsets of the parameters in the optimizer vectors
+    int64_t offs[GGML_MAX_PARAMS + 1];
+
+    // the parameters are updated by the threads of the optimizer when they all are F32 and contiguous
+    bool flat = true;
+
     int np = 0;
     int64_t nx = 0;
     for (int i = 0; i < gf->n_nodes; ++i) {
@@ -17465,10 +19154,14 @@ static enum ggml_opt_result ggml_opt_adam(
 
             GGML_ASSERT(np < GGML_MAX_PARAMS);
 
+            flat = flat && ggml_opt_is_flat(gf->nodes[i]) && ggml_nelements(gf->nodes[i]) <= INT_MAX;
+
+            offs[np] = nx;
             ps[np++] = gf->nodes[i];
             nx += ggml_nelements(gf->nodes[i]);
         }
     }
+    offs[np] = nx;
 
     if ((opt->params.type != params.type) || (opt->nx != nx) || (opt->params.past != params.past)) {
         int iter = opt->iter;
@@ -17558,7 +19251,39 @@ static enum ggml_opt_result ggml_opt_adam(
         UNUSED(t_start_wall);
         UNUSED(t_start_cpu);
 
-        {
+        if (flat) {
+            const int n_threads = MAX(1, params.n_threads);
+
+            const int64_t block_size = MAX(16*1024, (nx + 1023)/1024);
+            const int64_t n_blocks   = (nx + block_size - 1)/block_size;
+
+            ggml_float * sum_sq = alloca(sizeof(ggml_float)*n_blocks);
+
+            struct ggml_opt_adam_step step = {
+                /*.np             =*/ np,
+                /*.ps             =*/ ps,
+                /*.offs           =*/ offs,
+                /*.g              =*/ g,
+                /*.m              =*/ m,
+                /*.v              =*/ v,
+                /*.sum_sq         =*/ sum_sq,
+                /*.n_blocks       =*/ n_blocks,
+                /*.block_size     =*/ block_size,
+                /*.gclip          =*/ gclip,
+                /*.beta1          =*/ beta1,
+                /*.beta2          =*/ beta2,
+                /*.beta1h         =*/ alpha*sched/(1.0f - powf(beta1, opt->iter)),
+                /*.beta2h         =*/        1.0f/(1.0f - powf(beta2, opt->iter)),
+                /*.eps            =*/ eps,
+                /*.decay          =*/ decay*sched,
+                /*.decay_min_ndim =*/ decay_min_ndim,
+            };
+
+            if (gclip > 0.0f) {
+                ggml_opt_parallel(n_threads, ggml_opt_adam_sum_sq, &step);
+            }
+            ggml_opt_parallel(n_threads, ggml_opt_adam_update, &step);
+        } else {
             float gnorm = 1.0f;
             if (gclip > 0.0f) {
                 // gradient clipping
@@ -18506,6 +20231,32 @@ size_t ggml_quantize_chunk(enum ggml_type type, const float * src, void * dst, i
     return result;
 }
 
+bool ggml_repack(struct ggml_tensor * tensor) {
+    if (tensor->type != GGML_TYPE_Q4_0 || tensor->data == NULL || !ggml_is_contiguous(tensor) ||
+        tensor->ne[1] % NR4_0_X4 != 0) {
+        return false;
+    }
+
+    // the groups of rows do not cross matrices because ne[1] is a multiple of the group size
+    const int64_t nr       = ggml_nrows(tensor);
+    const size_t  row_size = ggml_row_size(tensor->type, tensor->ne[0]);
+
+    block_q4_0 * tmp = malloc(NR4_0_X4*row_size);
+
+    for (int64_t ir = 0; ir < nr; ir += NR4_0_X4) {
+        char * rows = (char *) tensor->data + ir*row_size;
+
+        memcpy(tmp, rows, NR4_0_X4*row_size);
+        repack_rows_q4_0_x4(tmp, (block_q4_0_x4 *) rows, tensor->ne[0]);
+    }
+
+    free(tmp);
+
+    tensor->type = GGML_TYPE_Q4_0_X4;
+
+    return true;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 
 struct gguf_str {
@@ -18567,6 +20318,11 @@ union gguf_value {
 
         uint64_t n;  // GGUFv2
         void * data;
+
+        // arrays of a mapped file: the elements in the mapping, data is set on first access (see gguf_arr_load)
+        // or points at view when the elements can be used in place
+        char     * view;
+        uint64_t * offsets; // strings: offset in view of each string, built on first access
     } arr;
 };
 
@@ -18612,26 +20368,220 @@ struct gguf_context {
 
     //uint8_t * padding;
     void * data;
+
+    // read-only mapping of the file the context was read from, NULL if it was read with fread
+    void * mapping;
+    size_t mapping_size;
+};
+
+#if defined(_WIN32)
+static void * gguf_map_file(const char * fname, size_t * size) {
+    HANDLE file = CreateFileA(fname, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        return NULL;
+    }
+
+    void * addr = NULL;
+
+    LARGE_INTEGER file_size;
+    if (GetFileSizeEx(file, &file_size) && file_size.QuadPart > 0 && (uint64_t) file_size.QuadPart == (uint64_t) (size_t) file_size.QuadPart) {
+        HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (mapping != NULL) {
+            addr = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+            CloseHandle(mapping);
+        }
+        *size = (size_t) file_size.QuadPart;
+    }
+
+    CloseHandle(file);
+
+    return addr;
+}
+
+static void gguf_unmap_file(void * addr, size_t size) {
+    GGML_UNUSED(size);
+    UnmapViewOfFile(addr);
+}
+#elif defined(_POSIX_MAPPED_FILES)
+static void * gguf_map_file(const char * fname, size_t * size) {
+    const int fd = open(fname, O_RDONLY);
+    if (fd == -1) {
+        return NULL;
+    }
+
+    void * addr = NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0 && (uint64_t) st.st_size == (uint64_t) (size_t) st.st_size) {
+        addr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (addr == MAP_FAILED) {
+            addr = NULL;
+        }
+        *size = st.st_size;
+    }
+
+    close(fd);
+
+    return addr;
+}
+
+static void gguf_unmap_file(void * addr, size_t size) {
+    munmap(addr, size);
+}
+#else
+static void * gguf_map_file(const char * fname, size_t * size) {
+    GGML_UNUSED(fname);
+    GGML_UNUSED(size);
+    return NULL;
+}
+
+static void gguf_unmap_file(void * addr, size_t size) {
+    GGML_UNUSED(addr);
+    GGML_UNUSED(size);
+}
+#endif
+
+// a file is read from a mapping when it can be mapped, with fread otherwise
+// from a mapping, the arrays are not copied while parsing, they are views into the mapping
+struct gguf_reader {
+    FILE * file;   // NULL when reading from the mapping
+    char * data;   // mapping of the file
+    size_t size;
+    size_t offset; // offset from start of file
 };
 
-static bool gguf_fread_el(FILE * file, void * dst, size_t size, size_t * offset) {
-    const size_t n = fread(dst, 1, size, file);
-    *offset += n;
-    return n == size;
+static void gguf_reader_close(struct gguf_reader * r) {
+    if (r->file) {
+        fclose(r->file);
+        r->file = NULL;
+    }
 }
 
-static bool gguf_fread_str(FILE * file, struct gguf_str * p, size_t * offset) {
+static bool gguf_read_el(struct gguf_reader * r, void * dst, size_t size) {
+    if (r->file) {
+        const size_t n = fread(dst, 1, size, r->file);
+        r->offset += n;
+        return n == size;
+    }
+
+    if (size > r->size - r->offset) {
+        return false;
+    }
+
+    memcpy(dst, r->data + r->offset, size);
+    r->offset += size;
+
+    return true;
+}
+
+static bool gguf_read_str(struct gguf_reader * r, struct gguf_str * p) {
     p->n    = 0;
     p->data = NULL;
 
     bool ok = true;
 
-    ok = ok && gguf_fread_el(file, &p->n,    sizeof(p->n), offset); p->data = calloc(p->n + 1, 1);
-    ok = ok && gguf_fread_el(file,  p->data, p->n,         offset);
+    ok = ok && gguf_read_el(r, &p->n, sizeof(p->n));
+    ok = ok && (r->file || p->n <= r->size - r->offset); p->data = calloc(ok ? p->n + 1 : 1, 1);
+    ok = ok && gguf_read_el(r,  p->data, p->n);
 
     return ok;
 }
 
+// skips the elements of an array in the mapping, they are read on first access
+static bool gguf_read_arr_view(struct gguf_reader * r, struct gguf_kv * kv) {
+    const enum gguf_type type = kv->value.arr.type;
+    const uint64_t       n    = kv->value.arr.n;
+
+    kv->value.arr.view = r->data + r->offset;
+
+    if (type == GGUF_TYPE_STRING) {
+        for (uint64_t j = 0; j < n; ++j) {
+            uint64_t len;
+            if (!gguf_read_el(r, &len, sizeof(len)) || len > r->size - r->offset) {
+                return false;
+            }
+            r->offset += len;
+        }
+
+        return true;
+    }
+
+    const size_t type_size = GGUF_TYPE_SIZE[type];
+    if (n > (r->size - r->offset)/type_size) {
+        return false;
+    }
+    r->offset += n*type_size;
+
+    // used in place when aligned
+    if ((uintptr_t) kv->value.arr.view % type_size == 0) {
+        kv->value.arr.data = kv->value.arr.view;
+    }
+
+    return true;
+}
+
+// offsets[j] is the offset in the view of the length of string j, offsets[n] the end of the array
+static void gguf_arr_index(struct gguf_kv * kv) {
+    if (kv->value.arr.offsets) {
+        return;
+    }
+
+    const uint64_t n = kv->value.arr.n;
+
+    uint64_t * offsets = malloc((n + 1)*sizeof(uint64_t));
+
+    uint64_t offset = 0;
+    for (uint64_t j = 0; j < n; ++j) {
+        uint64_t len;
+        memcpy(&len, kv->value.arr.view + offset, sizeof(len));
+
+        offsets[j] = offset;
+        offset += sizeof(len) + len;
+    }
+    offsets[n] = offset;
+
+    kv->value.arr.offsets = offsets;
+}
+
+// copies the elements of an array of a mapped file that cannot be used in place
+// the strings are copied with a terminating zero after their gguf_str, in the same allocation
+static void gguf_arr_load(struct gguf_kv * kv) {
+    if (kv->value.arr.view == NULL || kv->value.arr.data != NULL) {
+        return;
+    }
+
+    const uint64_t n = kv->value.arr.n;
+
+    if (kv->value.arr.type != GGUF_TYPE_STRING) {
+        const size_t size = n*GGUF_TYPE_SIZE[kv->value.arr.type];
+
+        kv->value.arr.data = malloc(size);
+        memcpy(kv->value.arr.data, kv->value.arr.view, size);
+        return;
+    }
+
+    gguf_arr_index(kv);
+
+    const uint64_t * offsets = kv->value.arr.offsets;
+
+    struct gguf_str * strs = malloc(n*sizeof(struct gguf_str) + (offsets[n] - n*sizeof(uint64_t)) + n);
+    char * chars = (char *) (strs + n);
+
+    for (uint64_t j = 0; j < n; ++j) {
+        const uint64_t len = offsets[j + 1] - offsets[j] - sizeof(uint64_t);
+
+        memcpy(chars, kv->value.arr.view + offsets[j] + sizeof(uint64_t), len);
+        chars[len] = 0;
+
+        strs[j].n    = len;
+        strs[j].data = chars;
+
+        chars += len + 1;
+    }
+
+    kv->value.arr.data = strs;
+}
+
 struct gguf_context * gguf_init_empty(void) {
     struct gguf_context * ctx = GGML_ALIGNED_MALLOC(sizeof(struct gguf_context));
 
@@ -18649,28 +20599,36 @@ struct gguf_context * gguf_init_empty(void) {
 
     ctx->data = NULL;
 
+    ctx->mapping      = NULL;
+    ctx->mapping_size = 0;
+
     return ctx;
 }
 
 struct gguf_context * gguf_init_from_file(const char * fname, struct gguf_init_params params) {
-    FILE * file = fopen(fname, "rb");
-    if (!file) {
-        return NULL;
-    }
+    struct gguf_reader r = { NULL, NULL, 0, 0 };
 
-    // offset from start of file
-    size_t offset = 0;
+    r.data = gguf_map_file(fname, &r.size);
+    if (!r.data) {
+        r.file = fopen(fname, "rb");
+        if (!r.file) {
+            return NULL;
+        }
+    }
 
-    char magic[4];
+    char magic[4] = { 0 };
 
     // check the magic before making allocations
     {
-        gguf_fread_el(file, &magic, sizeof(magic), &offset);
+        gguf_read_el(&r, &magic, sizeof(magic));
 
         for (uint32_t i = 0; i < sizeof(magic); i++) {
             if (magic[i] != GGUF_MAGIC[i]) {
                 fprintf(stderr, "%s: invalid magic characters '%c%c%c%c'\n", __func__, magic[0], magic[1], magic[2], magic[3]);
-                fclose(file);
+                gguf_reader_close(&r);
+                if (r.data) {
+                    gguf_unmap_file(r.data, r.size);
+                }
                 return NULL;
             }
         }
@@ -18680,6 +20638,10 @@ struct gguf_context * gguf_init_from_file(const char * fname, struct gguf_init_p
 
     struct gguf_context * ctx = GGML_ALIGNED_MALLOC(sizeof(struct gguf_context));
 
+    // the mapping is released by gguf_free
+    ctx->mapping      = r.data;
+    ctx->mapping_size = r.size;
+
     // read the header
     {
         strncpy(ctx->header.magic, magic, 4);
@@ -18688,20 +20650,20 @@ struct gguf_context * gguf_init_from_file(const char * fname, struct gguf_init_p
         ctx->infos = NULL;
         ctx->data  = NULL;
 
-        ok = ok && gguf_fread_el(file, &ctx->header.version,   sizeof(ctx->header.version),   &offset);
-        ok = ok && gguf_fread_el(file, &ctx->header.n_tensors, sizeof(ctx->header.n_tensors), &offset);
-        ok = ok && gguf_fread_el(file, &ctx->header.n_kv,      sizeof(ctx->header.n_kv),      &offset);
+        ok = ok && gguf_read_el(&r, &ctx->header.version,   sizeof(ctx->header.version));
+        ok = ok && gguf_read_el(&r, &ctx->header.n_tensors, sizeof(ctx->header.n_tensors));
+        ok = ok && gguf_read_el(&r, &ctx->header.n_kv,      sizeof(ctx->header.n_kv));
 
         if (ctx->header.version == 1) {
             fprintf(stderr, "%s: GGUFv1 is no longer supported. please use a more up-to-date version\n", __func__);
-            fclose(file);
+            gguf_reader_close(&r);
             gguf_free(ctx);
             return NULL;
         }
 
         if (!ok) {
             fprintf(stderr, "%s: failed to read header\n", __func__);
-            fclose(file);
+            gguf_reader_close(&r);
             gguf_free(ctx);
             return NULL;
         }
@@ -18709,35 +20671,39 @@ struct gguf_context * gguf_init_from_file(const char * fname, struct gguf_init_p
 
     // read the kv pairs
     {
-        ctx->kv = malloc(ctx->header.n_kv * sizeof(struct gguf_kv));
+        ctx->kv = calloc(ctx->header.n_kv, sizeof(struct gguf_kv));
 
         for (uint64_t i = 0; i < ctx->header.n_kv; ++i) {
             struct gguf_kv * kv = &ctx->kv[i];
 
             //fprintf(stderr, "%s: reading kv %d\n", __func__, i);
 
-            ok = ok && gguf_fread_str(file, &kv->key,                    &offset);
-            ok = ok && gguf_fread_el (file, &kv->type, sizeof(kv->type), &offset);
+            ok = ok && gguf_read_str(&r, &kv->key);
+            ok = ok && gguf_read_el (&r, &kv->type, sizeof(kv->type));
 
             //fprintf(stderr, "%s: reading kv with key %s\n", __func__, kv->key.data);
 
             switch (kv->type) {
-                case GGUF_TYPE_UINT8:   ok = ok && gguf_fread_el (file, &kv->value.uint8,   sizeof(kv->value.uint8),   &offset); break;
-                case GGUF_TYPE_INT8:    ok = ok && gguf_fread_el (file, &kv->value.int8,    sizeof(kv->value.int8),    &offset); break;
-                case GGUF_TYPE_UINT16:  ok = ok && gguf_fread_el (file, &kv->value.uint16,  sizeof(kv->value.uint16),  &offset); break;
-                case GGUF_TYPE_INT16:   ok = ok && gguf_fread_el (file, &kv->value.int16,   sizeof(kv->value.int16),   &offset); break;
-                case GGUF_TYPE_UINT32:  ok = ok && gguf_fread_el (file, &kv->value.uint32,  sizeof(kv->value.uint32),  &offset); break;
-                case GGUF_TYPE_INT32:   ok = ok && gguf_fread_el (file, &kv->value.int32,   sizeof(kv->value.int32),   &offset); break;
-                case GGUF_TYPE_FLOAT32: ok = ok && gguf_fread_el (file, &kv->value.float32, sizeof(kv->value.float32), &offset); break;
-                case GGUF_TYPE_UINT64:  ok = ok && gguf_fread_el (file, &kv->value.uint64,  sizeof(kv->value.uint64),  &offset); break;
-                case GGUF_TYPE_INT64:   ok = ok && gguf_fread_el (file, &kv->value.int64,   sizeof(kv->value.int64),   &offset); break;
-                case GGUF_TYPE_FLOAT64: ok = ok && gguf_fread_el (file, &kv->value.float64, sizeof(kv->value.float64), &offset); break;
-                case GGUF_TYPE_BOOL:    ok = ok && gguf_fread_el (file, &kv->value.bool_,   sizeof(kv->value.bool_),   &offset); break;
-                case GGUF_TYPE_STRING:  ok = ok && gguf_fread_str(file, &kv->value.str,                                &offset); break;
+                case GGUF_TYPE_UINT8:   ok = ok && gguf_read_el (&r, &kv->value.uint8,   sizeof(kv->value.uint8));    break;
+                case GGUF_TYPE_INT8:    ok = ok && gguf_read_el (&r, &kv->value.int8,    sizeof(kv->value.int8));     break;
+                case GGUF_TYPE_UINT16:  ok = ok && gguf_read_el (&r, &kv->value.uint16,  sizeof(kv->value.uint16));   break;
+                case GGUF_TYPE_INT16:   ok = ok && gguf_read_el (&r, &kv->value.int16,   sizeof(kv->value.int16));    break;
+                case GGUF_TYPE_UINT32:  ok = ok && gguf_read_el (&r, &kv->value.uint32,  sizeof(kv->value.uint32));   break;
+                case GGUF_TYPE_INT32:   ok = ok && gguf_read_el (&r, &kv->value.int32,   sizeof(kv->value.int32));    break;
+                case GGUF_TYPE_FLOAT32: ok = ok && gguf_read_el (&r, &kv->value.float32, sizeof(kv->value.float32));  break;
+                case GGUF_TYPE_UINT64:  ok = ok && gguf_read_el (&r, &kv->value.uint64,  sizeof(kv->value.uint64));   break;
+                case GGUF_TYPE_INT64:   ok = ok && gguf_read_el (&r, &kv->value.int64,   sizeof(kv->value.int64));    break;
+                case GGUF_TYPE_FLOAT64: ok = ok && gguf_read_el (&r, &kv->value.float64, sizeof(kv->value.float64));  break;
+                case GGUF_TYPE_BOOL:    ok = ok && gguf_read_el (&r, &kv->value.bool_,   sizeof(kv->value.bool_));    break;
+                case GGUF_TYPE_STRING:  ok = ok && gguf_read_str(&r, &kv->value.str);                                 break;
                 case GGUF_TYPE_ARRAY:
                     {
-                        ok = ok && gguf_fread_el(file, &kv->value.arr.type, sizeof(kv->value.arr.type), &offset);
-                        ok = ok && gguf_fread_el(file, &kv->value.arr.n,    sizeof(kv->value.arr.n), &offset);
+                        ok = ok && gguf_read_el(&r, &kv->value.arr.type, sizeof(kv->value.arr.type));
+                        ok = ok && gguf_read_el(&r, &kv->value.arr.n,    sizeof(kv->value.arr.n));
+
+                        kv->value.arr.data    = NULL;
+                        kv->value.arr.view    = NULL;
+                        kv->value.arr.offsets = NULL;
 
                         switch (kv->value.arr.type) {
                             case GGUF_TYPE_UINT8:
@@ -18752,14 +20718,22 @@ struct gguf_context * gguf_init_from_file(const char * fname, struct gguf_init_p
                             case GGUF_TYPE_FLOAT64:
                             case GGUF_TYPE_BOOL:
                                 {
+                                    if (!r.file) {
+                                        ok = ok && gguf_read_arr_view(&r, kv);
+                                        break;
+                                    }
                                     kv->value.arr.data = malloc(kv->value.arr.n * GGUF_TYPE_SIZE[kv->value.arr.type]);
-                                    ok = ok && gguf_fread_el(file, kv->value.arr.data, kv->value.arr.n * GGUF_TYPE_SIZE[kv->value.arr.type], &offset);
+                                    ok = ok && gguf_read_el(&r, kv->value.arr.data, kv->value.arr.n * GGUF_TYPE_SIZE[kv->value.arr.type]);
                                 } break;
                             case GGUF_TYPE_STRING:
                                 {
+                                    if (!r.file) {
+                                        ok = ok && gguf_read_arr_view(&r, kv);
+                                        break;
+                                    }
                                     kv->value.arr.data = malloc(kv->value.arr.n * sizeof(struct gguf_str));
                                     for (uint64_t j = 0; j < kv->value.arr.n; ++j) {
-                                        ok = ok && gguf_fread_str(file, &((struct gguf_str *) kv->value.arr.data)[j], &offset);
+                                        ok = ok && gguf_read_str(&r, &((struct gguf_str *) kv->value.arr.data)[j]);
                                     }
                                 } break;
                             case GGUF_TYPE_ARRAY:
@@ -18776,7 +20750,7 @@ struct gguf_context * gguf_init_from_file(const char * fname, struct gguf_init_p
 
         if (!ok) {
             fprintf(stderr, "%s: failed to read key-value pairs\n", __func__);
-            fclose(file);
+            gguf_reader_close(&r);
             gguf_free(ctx);
             return NULL;
         }
@@ -18793,17 +20767,17 @@ struct gguf_context * gguf_init_from_file(const char * fname, struct gguf_init_p
                 info->ne[j] = 1;
             }
 
-            ok = ok && gguf_fread_str(file, &info->name,                          &offset);
-            ok = ok && gguf_fread_el (file, &info->n_dims, sizeof(info->n_dims),  &offset);
+            ok = ok && gguf_read_str(&r, &info->name);
+            ok = ok && gguf_read_el (&r, &info->n_dims, sizeof(info->n_dims));
             for (uint32_t j = 0; j < info->n_dims; ++j) {
-                ok = ok && gguf_fread_el(file, &info->ne[j], sizeof(info->ne[j]), &offset);
+                ok = ok && gguf_read_el(&r, &info->ne[j], sizeof(info->ne[j]));
             }
-            ok = ok && gguf_fread_el (file, &info->type,   sizeof(info->type),    &offset);
-            ok = ok && gguf_fread_el (file, &info->offset, sizeof(info->offset),  &offset);
+            ok = ok && gguf_read_el (&r, &info->type,   sizeof(info->type));
+            ok = ok && gguf_read_el (&r, &info->offset, sizeof(info->offset));
 
             if (!ok) {
                 fprintf(stderr, "%s: failed to read tensor info\n", __func__);
-                fclose(file);
+                gguf_reader_close(&r);
                 gguf_free(ctx);
                 return NULL;
             }
@@ -18819,16 +20793,18 @@ struct gguf_context * gguf_init_from_file(const char * fname, struct gguf_init_p
 
     // we require the data section to be aligned, so take into account any padding
     {
-        const size_t offset_pad = offset % ctx->alignment;
+        const size_t offset_pad = r.offset % ctx->alignment;
 
         if (offset_pad != 0) {
-            offset += ctx->alignment - offset_pad;
-            fseek(file, offset, SEEK_SET);
+            r.offset += ctx->alignment - offset_pad;
+            if (r.file) {
+                fseek(r.file, r.offset, SEEK_SET);
+            }
         }
     }
 
     // store the current file offset - this is where the data section starts
-    ctx->offset = offset;
+    ctx->offset = r.offset;
 
     // compute the total size of the data section, taking into account the alignment
     {
@@ -18845,7 +20821,7 @@ struct gguf_context * gguf_init_from_file(const char * fname, struct gguf_init_p
             if (ne % ggml_blck_size(info->type) != 0) {
                 fprintf(stderr, "%s: tensor '%s' number of elements (%" PRId64 ") is not a multiple of block size (%d)\n",
                         __func__, info->name.data, ne, ggml_blck_size(info->type));
-                fclose(file);
+                gguf_reader_close(&r);
                 gguf_free(ctx);
                 return NULL;
             }
@@ -18886,11 +20862,11 @@ struct gguf_context * gguf_init_from_file(const char * fname, struct gguf_init_p
             ok = ok && data != NULL;
 
             // read the binary blob with the tensor data
-            ok = ok && gguf_fread_el(file, data->data, ctx->size, &offset);
+            ok = ok && gguf_read_el(&r, data->data, ctx->size);
 
             if (!ok) {
                 fprintf(stderr, "%s: failed to read tensor data\n", __func__);
-                fclose(file);
+                gguf_reader_close(&r);
                 ggml_free(ctx_data);
                 gguf_free(ctx);
                 return NULL;
@@ -18929,7 +20905,7 @@ struct gguf_context * gguf_init_from_file(const char * fname, struct gguf_init_p
 
         if (!ok) {
             fprintf(stderr, "%s: failed to read the tensor data\n", __func__);
-            fclose(file);
+            gguf_reader_close(&r);
             ggml_free(ctx_data);
             gguf_free(ctx);
             return NULL;
@@ -18938,7 +20914,7 @@ struct gguf_context * gguf_init_from_file(const char * fname, struct gguf_init_p
         ggml_set_no_alloc(ctx_data, params.no_alloc);
     }
 
-    fclose(file);
+    gguf_reader_close(&r);
 
     return ctx;
 }
@@ -18963,7 +20939,13 @@ void gguf_free(struct gguf_context * ctx) {
                 }
             }
 
-            if (kv->type == GGUF_TYPE_ARRAY) {
+            if (kv->type == GGUF_TYPE_ARRAY && kv->value.arr.view) {
+                // the strings are in the allocation of data
+                if (kv->value.arr.data != kv->value.arr.view) {
+                    free(kv->value.arr.data);
+                }
+                free(kv->value.arr.offsets);
+            } else if (kv->type == GGUF_TYPE_ARRAY) {
                 if (kv->value.arr.data) {
                     if (kv->value.arr.type == GGUF_TYPE_STRING) {
                         for (uint32_t j = 0; j < kv->value.arr.n; ++j) {
@@ -18993,6 +20975,10 @@ void gguf_free(struct gguf_context * ctx) {
         free(ctx->infos);
     }
 
+    if (ctx->mapping) {
+        gguf_unmap_file(ctx->mapping, ctx->mapping_size);
+    }
+
     GGML_ALIGNED_FREE(ctx);
 }
 
@@ -19055,6 +21041,7 @@ enum gguf_type gguf_get_arr_type(const struct gguf_context * ctx, int key_id) {
 const void * gguf_get_arr_data(const struct gguf_context * ctx, int key_id) {
     GGML_ASSERT(key_id >= 0 && key_id < gguf_get_n_kv(ctx));
     GGML_ASSERT(ctx->kv[key_id].type == GGUF_TYPE_ARRAY);
+    gguf_arr_load(&ctx->kv[key_id]);
     return ctx->kv[key_id].value.arr.data;
 }
 
@@ -19062,10 +21049,27 @@ const char * gguf_get_arr_str(const struct gguf_context * ctx, int key_id, int i
     GGML_ASSERT(key_id >= 0 && key_id < gguf_get_n_kv(ctx));
     GGML_ASSERT(ctx->kv[key_id].type == GGUF_TYPE_ARRAY);
     struct gguf_kv * kv = &ctx->kv[key_id];
+    gguf_arr_load(kv);
     struct gguf_str * str = &((struct gguf_str *) kv->value.arr.data)[i];
     return str->data;
 }
 
+const char * gguf_get_arr_str_view(const struct gguf_context * ctx, int key_id, int i, size_t * n) {
+    GGML_ASSERT(key_id >= 0 && key_id < gguf_get_n_kv(ctx));
+    GGML_ASSERT(ctx->kv[key_id].type == GGUF_TYPE_ARRAY);
+    GGML_ASSERT(ctx->kv[key_id].value.arr.type == GGUF_TYPE_STRING);
+    GGML_ASSERT(i >= 0 && (uint64_t) i < ctx->kv[key_id].value.arr.n);
+    struct gguf_kv * kv = &ctx->kv[key_id];
+    if (kv->value.arr.view == NULL || kv->value.arr.data != NULL) {
+        struct gguf_str * str = &((struct gguf_str *) kv->value.arr.data)[i];
+        *n = str->n;
+        return str->data;
+    }
+    gguf_arr_index(kv);
+    *n = kv->value.arr.offsets[i + 1] - kv->value.arr.offsets[i] - sizeof(uint64_t);
+    return kv->value.arr.view + kv->value.arr.offsets[i] + sizeof(uint64_t);
+}
+
 int gguf_get_arr_n(const struct gguf_context * ctx, int key_id) {
     GGML_ASSERT(key_id >= 0 && key_id < gguf_get_n_kv(ctx));
     GGML_ASSERT(ctx->kv[key_id].type == GGUF_TYPE_ARRAY);
@@ -19289,6 +21293,9 @@ void gguf_set_arr_data(struct gguf_context * ctx, const char * key, enum gguf_ty
     ctx->kv[idx].value.arr.n    = n;
     ctx->kv[idx].value.arr.data = malloc(n*GGUF_TYPE_SIZE[type]);
     memcpy(ctx->kv[idx].value.arr.data, data, n*GGUF_TYPE_SIZE[type]);
+
+    ctx->kv[idx].value.arr.view    = NULL;
+    ctx->kv[idx].value.arr.offsets = NULL;
 }
 
 void gguf_set_arr_str(struct gguf_context * ctx, const char * key, const char ** data, int n) {
@@ -19303,6 +21310,9 @@ void gguf_set_arr_str(struct gguf_context * ctx, const char * key, const char **
         str->n    = strlen(data[i]);
         str->data = strdup(data[i]);
     }
+
+    ctx->kv[idx].value.arr.view    = NULL;
+    ctx->kv[idx].value.arr.offsets = NULL;
 }
 
 // set or add KV pairs from another context
@@ -19323,6 +21333,8 @@ void gguf_set_kv(struct gguf_context * ctx, struct gguf_context * src) {
             case GGUF_TYPE_STRING:  gguf_set_val_str (ctx, src->kv[i].key.data, src->kv[i].value.str.data); break;
             case GGUF_TYPE_ARRAY:
                 {
+                    gguf_arr_load(&src->kv[i]);
+
                     if (src->kv[i].value.arr.type == GGUF_TYPE_STRING) {
                         const char ** data = malloc(src->kv[i].value.arr.n*sizeof(char *));
                         for (uint32_t j = 0; j < src->kv[i].value.arr.n; j++) {
@@ -19473,20 +21485,22 @@ static void gguf_write_to_buf(const struct gguf_context * ctx, struct gguf_buf *
         gguf_bwrite_el (buf, &kv->type, sizeof(kv->type));
 
         switch (kv->type) {
-            case GGUF_TYPE_UINT8:   gguf_bwrite_el( buf, &kv->value.uint8,   sizeof(kv->value.uint8)  ); break;
-            case GGUF_TYPE_INT8:    gguf_bwrite_el (buf, &kv->value.int8,    sizeof(kv->value.int8)   ); break;
-            case GGUF_TYPE_UINT16:  gguf_bwrite_el (buf, &kv->value.uint16,  sizeof(kv->value.uint16) ); break;
-            case GGUF_TYPE_INT16:   gguf_bwrite_el (buf, &kv->value.int16,   sizeof(kv->value.int16)  ); break;
-            case GGUF_TYPE_UINT32:  gguf_bwrite_el (buf, &kv->value.uint32,  sizeof(kv->value.uint32) ); break;
-            case GGUF_TYPE_INT32:   gguf_bwrite_el (buf, &kv->value.int32,   sizeof(kv->value.int32)  ); break;
+            case GGUF_TYPE_UINT8:   gguf_bwrite_el( buf, &kv->value.uint8,   sizeof(kv->value.uint8));   break;
+            case GGUF_TYPE_INT8:    gguf_bwrite_el (buf, &kv->value.int8,    sizeof(kv->value.int8));    break;
+            case GGUF_TYPE_UINT16:  gguf_bwrite_el (buf, &kv->value.uint16,  sizeof(kv->value.uint16));  break;
+            case GGUF_TYPE_INT16:   gguf_bwrite_el (buf, &kv->value.int16,   sizeof(kv->value.int16));   break;
+            case GGUF_TYPE_UINT32:  gguf_bwrite_el (buf, &kv->value.uint32,  sizeof(kv->value.uint32));  break;
+            case GGUF_TYPE_INT32:   gguf_bwrite_el (buf, &kv->value.int32,   sizeof(kv->value.int32));   break;
             case GGUF_TYPE_FLOAT32: gguf_bwrite_el (buf, &kv->value.float32, sizeof(kv->value.float32)); break;
-            case GGUF_TYPE_UINT64:  gguf_bwrite_el (buf, &kv->value.uint64,  sizeof(kv->value.uint64) ); break;
-            case GGUF_TYPE_INT64:   gguf_bwrite_el (buf, &kv->value.int64,   sizeof(kv->value.int64)  ); break;
+            case GGUF_TYPE_UINT64:  gguf_bwrite_el (buf, &kv->value.uint64,  sizeof(kv->value.uint64));  break;
+            case GGUF_TYPE_INT64:   gguf_bwrite_el (buf, &kv->value.int64,   sizeof(kv->value.int64));   break;
             case GGUF_TYPE_FLOAT64: gguf_bwrite_el (buf, &kv->value.float64, sizeof(kv->value.float64)); break;
-            case GGUF_TYPE_BOOL:    gguf_bwrite_el (buf, &kv->value.bool_,   sizeof(kv->value.bool_)  ); break;
+            case GGUF_TYPE_BOOL:    gguf_bwrite_el (buf, &kv->value.bool_,   sizeof(kv->value.bool_));   break;
             case GGUF_TYPE_STRING:  gguf_bwrite_str(buf, &kv->value.str                               ); break;
             case GGUF_TYPE_ARRAY:
                 {
+                    gguf_arr_load(kv);
+
                     gguf_bwrite_el(buf, &kv->value.arr.type, sizeof(kv->value.arr.type));
                     gguf_bwrite_el(buf, &kv->value.arr.n,    sizeof(kv->value.arr.n)   );
 
@@ -340,6 +340,7 @@ extern "C" {
         GGML_TYPE_I8,
         GGML_TYPE_I16,
         GGML_TYPE_I32,
+        GGML_TYPE_Q4_0_X4, // q4_0 with the blocks of 4 rows interleaved, see ggml_repack
         GGML_TYPE_COUNT,
     };
 
@@ -389,9 +390,11 @@ extern "C" {
         GGML_OP_REPEAT_BACK,
         GGML_OP_CONCAT,
         GGML_OP_SILU_BACK,
+        GGML_OP_SWIGLU,
         GGML_OP_NORM, // normalize
         GGML_OP_RMS_NORM,
         GGML_OP_RMS_NORM_BACK,
+        GGML_OP_RMS_NORM_MUL,
         GGML_OP_GROUP_NORM,
 
         GGML_OP_MUL_MAT,
@@ -415,6 +418,7 @@ extern "C" {
         GGML_OP_SOFT_MAX_BACK,
         GGML_OP_ROPE,
         GGML_OP_ROPE_BACK,
+        GGML_OP_ROPE_CACHE,
         GGML_OP_ALIBI,
         GGML_OP_CLAMP,
         GGML_OP_CONV_TRANSPOSE_1D,
@@ -428,6 +432,7 @@ extern "C" {
         GGML_OP_LEAKY_RELU,
 
         GGML_OP_FLASH_ATTN,
+        GGML_OP_FLASH_ATTN_EXT,
         GGML_OP_FLASH_FF,
         GGML_OP_FLASH_ATTN_BACK,
         GGML_OP_WIN_PART,
@@ -538,6 +543,16 @@ extern "C" {
 
     static const size_t GGML_TENSOR_SIZE = sizeof(struct ggml_tensor);
 
+    // persistent threads computing the graphs, instead of threads created for each graph
+    // a pool can be shared by several users, it computes one graph at a time
+    struct ggml_threadpool;
+
+    struct ggml_threadpool_params {
+        int n_threads; // including the thread calling ggml_graph_compute, which is the worker 0
+        int n_spin;    // number of checks of a waiting thread before it sleeps
+        int cpu_start; // if >= 0, the worker i > 0 is pinned to the CPU cpu_start + i (Linux only)
+    };
+
     // the compute plan that needs to be prepared for ggml_graph_compute()
     // since https://github.com/ggerganov/ggml/issues/287
     struct ggml_cplan {
@@ -549,6 +564,13 @@ extern "C" {
         // abort ggml_graph_compute when true
         bool (*abort_callback)(void * data);
         void * abort_callback_data;
+
+        // if not NULL, the graph is computed by the threads of the pool, at most its n_threads
+        struct ggml_threadpool * threadpool;
+
+        // if not NULL, [2*n_nodes]: the ggml_time_us() at the start and at the end of the computation of each node,
+        // the runtime counterpart of the GGML_PERF stats
+        int64_t * node_times;
     };
 
     enum ggml_cgraph_eval_order {
@@ -616,6 +638,9 @@ extern "C" {
         // work buffer for all threads
         size_t wsize;
         void * wdata;
+
+        // the threads are bound to the NUMA nodes in groups of consecutive threads
+        bool numa;
     };
 
     // misc
@@ -631,6 +656,10 @@ extern "C" {
     GGML_API void    ggml_numa_init(void); // call once for better performance on NUMA systems
     GGML_API bool    ggml_is_numa(void); // true if init detected that system has >1 NUMA node
 
+    // moves the rows of the matrices in tensor to the NUMA nodes whose threads multiply them in ggml_mul_mat
+    // node n gets the rows [n*ne1/n_nodes, (n + 1)*ne1/n_nodes) of each matrix
+    GGML_API void    ggml_numa_place(const struct ggml_tensor * tensor);
+
     GGML_API void    ggml_print_object (const struct ggml_object * obj);
     GGML_API void    ggml_print_objects(const struct ggml_context * ctx);
 
@@ -1007,6 +1036,12 @@ extern "C" {
             struct ggml_tensor  * a,
             struct ggml_tensor  * b);
 
+    // ggml_mul(ctx, ggml_silu(ctx, a), b) in one pass, a and b have the same shape
+    GGML_API struct ggml_tensor * ggml_swiglu(
+            struct ggml_context * ctx,
+            struct ggml_tensor  * a,
+            struct ggml_tensor  * b);
+
     // normalize along rows
     GGML_API struct ggml_tensor * ggml_norm(
             struct ggml_context * ctx,
@@ -1049,6 +1084,14 @@ extern "C" {
             struct ggml_tensor  * b,
             float                 eps);
 
+    // ggml_mul(ctx, ggml_rms_norm(ctx, a, eps), b) in one pass over a
+    // b is broadcast to a like in ggml_mul, and b->ne[0] == a->ne[0]
+    GGML_API struct ggml_tensor * ggml_rms_norm_mul(
+            struct ggml_context * ctx,
+            struct ggml_tensor  * a,
+            struct ggml_tensor  * b,
+            float                 eps);
+
     // A: k columns, n rows => [ne03, ne02, n, k]
     // B: k columns, m rows  (i.e. we transpose it internally) => [ne03 * x, ne02 * y, m, k]
     // result is n columns, m rows => [ne03 * x, ne02 * y, m, n]
@@ -1397,6 +1440,57 @@ extern "C" {
             float                 beta_fast,
             float                 beta_slow);
 
+    // sin and cos of the RoPE angles of the positions b, to be shared by the rope nodes with the same parameters
+    // the result is F32 [n_dims, b->ne[0]], row i holds the (cos, sin) pairs of position b[i], scaled as by rope
+    // only the standard and GPT-NeoX modes are supported
+    GGML_API struct ggml_tensor * ggml_rope_cache(
+            struct ggml_context * ctx,
+            struct ggml_tensor  * b,
+            int                   n_dims,
+            int                   mode,
+            int                   n_orig_ctx,
+            float                 freq_base,
+            float                 freq_scale,
+            float                 ext_factor,
+            float                 attn_factor,
+            float                 beta_fast,
+            float                 beta_slow);
+
+    // custom RoPE reading the angles from c = ggml_rope_cache(b, ...) computed with the same parameters
+    // c may be NULL, backends and shapes the cache does not cover compute the angles from b
+    GGML_API struct ggml_tensor * ggml_rope_custom_cached(
+            struct ggml_context * ctx,
+            struct ggml_tensor  * a,
+            struct ggml_tensor  * b,
+            struct ggml_tensor  * c,
+            int                   n_dims,
+            int                   mode,
+            int                   n_ctx,
+            int                   n_orig_ctx,
+            float                 freq_base,
+            float                 freq_scale,
+            float                 ext_factor,
+            float                 attn_factor,
+            float                 beta_fast,
+            float                 beta_slow);
+
+    // in-place, returns view(a)
+    GGML_API struct ggml_tensor * ggml_rope_custom_cached_inplace(
+            struct ggml_context * ctx,
+            struct ggml_tensor  * a,
+            struct ggml_tensor  * b,
+            struct ggml_tensor  * c,
+            int                   n_dims,
+            int                   mode,
+            int                   n_ctx,
+            int                   n_orig_ctx,
+            float                 freq_base,
+            float                 freq_scale,
+            float                 ext_factor,
+            float                 attn_factor,
+            float                 beta_fast,
+            float                 beta_slow);
+
     // compute correction dims for YaRN RoPE scaling
     void ggml_rope_yarn_corr_dims(
         int n_dims, int n_orig_ctx, float freq_base, float beta_fast, float beta_slow, float dims[2]);
@@ -1594,6 +1688,20 @@ extern "C" {
             struct ggml_tensor  * v,
             bool                  masked);
 
+    // fused softmax(mask + scale*k*q)*v, the kq matrix of each head is never materialized
+    // q:    [n_embd_head, n_tokens, n_head, ne3]
+    // k:    [n_embd_head, n_kv,     n_head_kv, ne3]
+    // v:    [n_embd_head, n_kv,     n_head_kv, ne3] !! can be a transposed view !!
+    // mask: [n_kv,        n_tokens, 1] or NULL
+    // res:  [n_embd_head, n_head,   n_tokens, ne3] !! permuted !!
+    GGML_API struct ggml_tensor * ggml_flash_attn_ext(
+            struct ggml_context * ctx,
+            struct ggml_tensor  * q,
+            struct ggml_tensor  * k,
+            struct ggml_tensor  * v,
+            struct ggml_tensor  * mask,
+            float                 scale);
+
     GGML_API struct ggml_tensor * ggml_flash_attn_back(
            struct ggml_context * ctx,
            struct ggml_tensor  * q,
@@ -1835,10 +1943,21 @@ extern "C" {
     GGML_API struct ggml_cplan ggml_graph_plan   (struct ggml_cgraph * cgraph, int n_threads /*= GGML_DEFAULT_N_THREADS*/);
     GGML_API int               ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cplan * cplan);
 
+    GGML_API struct ggml_threadpool_params ggml_threadpool_default_params(int n_threads);
+    GGML_API struct ggml_threadpool *      ggml_threadpool_new      (struct ggml_threadpool_params params);
+    GGML_API void                          ggml_threadpool_free     (struct ggml_threadpool * threadpool);
+    GGML_API int                           ggml_threadpool_n_threads(const struct ggml_threadpool * threadpool);
+
     // same as ggml_graph_compute() but the work data is allocated as a part of the context
     // note: the drawback of this API is that you must have ensured that the context has enough memory for the work data
     GGML_API void ggml_graph_compute_with_ctx(struct ggml_context * ctx, struct ggml_cgraph * cgraph, int n_threads);
 
+    // a mul_mat with a large enough batch goes to BLAS by default, when ggml is built with BLAS
+    // ggml_blas_tune() measures for which types of src0 and batch sizes the native kernels are faster with n_threads
+    // the results are loaded from the file fname if it was written for n_threads, or measured and saved to it
+    // call it before computing any graph; returns false if ggml is built without BLAS
+    GGML_API bool ggml_blas_tune(const char * fname, int n_threads);
+
     GGML_API struct ggml_tensor * ggml_graph_get_tensor(struct ggml_cgraph * cgraph, const char * name);
 
     GGML_API void                 ggml_graph_export(const struct ggml_cgraph * cgraph, const char * fname);
@@ -2055,6 +2174,12 @@ extern "C" {
 
     GGML_API size_t ggml_quantize_chunk(enum ggml_type type, const float * src, void * dst, int start, int n, int64_t * hist);
 
+    // convert the data of a tensor in place to a type that interleaves the blocks of several rows, so that
+    // ggml_mul_mat reuses each block of src1 for all of them
+    // returns false and leaves the tensor unchanged if its type or shape has no such layout
+    // the repacked tensor can only be used as src0 of ggml_mul_mat and ggml_mul_mat_id
+    GGML_API bool ggml_repack(struct ggml_tensor * tensor);
+
     //
     // gguf
     //
@@ -2086,6 +2211,8 @@ extern "C" {
     };
 
     GGML_API struct gguf_context * gguf_init_empty(void);
+
+    // the file is mapped when possible and stays mapped until gguf_free, the arrays are then read on first access
     GGML_API struct gguf_context * gguf_init_from_file(const char * fname, struct gguf_init_params params);
     //GGML_API struct gguf_context * gguf_init_from_buffer(..);
 
@@ -2123,6 +2250,10 @@ extern "C" {
     GGML_API const void * gguf_get_arr_data(const struct gguf_context * ctx, int key_id);
     GGML_API const char * gguf_get_arr_str (const struct gguf_context * ctx, int key_id, int i);
 
+    // string i of an array, of length *n and not zero-terminated
+    // unlike gguf_get_arr_str, the strings of a mapped file are not copied
+    GGML_API const char * gguf_get_arr_str_view(const struct gguf_context * ctx, int key_id, int i, size_t * n);
+
     GGML_API int    gguf_get_n_tensors    (const struct gguf_context * ctx);
     GGML_API int    gguf_find_tensor      (const struct gguf_context * ctx, const char * name);
     GGML_API size_t gguf_get_tensor_offset(const struct gguf_context * ctx, int i);
@@ -2213,7 +2344,10 @@ extern "C" {
 #endif
     typedef void (*ggml_to_float_t)  (const void  * GGML_RESTRICT x, float * GGML_RESTRICT y, int k);
     typedef void (*ggml_from_float_t)(const float * GGML_RESTRICT x, void  * GGML_RESTRICT y, int k);
+    // for the types that interleave rows, vec_dot computes the nrows dot products of a group of rows
     typedef void (*ggml_vec_dot_t)   (const int n, float * GGML_RESTRICT s, const void * GGML_RESTRICT x, const void * GGML_RESTRICT y);
+    // s[0] = x0·y0, s[1] = x1·y0, s[bs] = x0·y1, s[bs + 1] = x1·y1, where x1 is bx bytes after x0 and y1 is by bytes after y0
+    typedef void (*ggml_vec_dot_2x2_t)(const int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT x, size_t bx, const void * GGML_RESTRICT y, size_t by);
 
     typedef struct {
         const char      * type_name;
@@ -2225,6 +2359,8 @@ extern "C" {
         ggml_from_float_t from_float_reference;
         ggml_vec_dot_t    vec_dot;
         enum ggml_type    vec_dot_type;
+        ggml_vec_dot_2x2_t vec_dot_2x2; // optional, 2 rows of x with 2 rows of y at once
+        int64_t           nrows;          // rows interleaved in the blocks, 0 if the rows are not interleaved
     } ggml_type_traits_t;
 
     GGML_API ggml_type_traits_t ggml_internal_get_type_traits(enum ggml_type type);
@@ -50,20 +50,26 @@
 
 #include <algorithm>
 #include <array>
+#include <atomic>
+#include <bitset>
 #include <cassert>
 #include <cinttypes>
 #include <climits>
 #include <cmath>
+#include <condition_variable>
 #include <cstdarg>
 #include <cstddef>
 #include <cstdint>
 #include <cstdio>
 #include <cstring>
 #include <ctime>
+#include <exception>
 #include <forward_list>
 #include <fstream>
 #include <functional>
+#include <future>
 #include <initializer_list>
+#include <list>
 #include <map>
 #include <memory>
 #include <mutex>
@@ -74,6 +80,7 @@
 #include <set>
 #include <sstream>
 #include <thread>
+#include <tuple>
 #include <type_traits>
 #include <unordered_map>
 #include <iostream>
@@ -96,6 +103,9 @@
 #define LLAMA_MAX_NODES   8192
 #define LLAMA_MAX_EXPERTS 8
 
+// size of the grammar stack pool past which the nodes of the stacks no longer in use are dropped
+#define LLAMA_GRAMMAR_MAX_POOL_NODES 65536
+
 //
 // logging
 //
@@ -156,13 +166,6 @@ static bool is_float_close(float a, float b, float abs_tol) {
 #include <hbwmalloc.h>
 #endif
 
-static void zeros(std::ofstream & file, size_t n) {
-    char zero = 0;
-    for (size_t i = 0; i < n; ++i) {
-        file.write(&zero, 1);
-    }
-}
-
 LLAMA_ATTRIBUTE_FORMAT(1, 2)
 static std::string format(const char * fmt, ...) {
     va_list ap;
@@ -653,12 +656,15 @@ static std::string gguf_kv_to_str(const struct gguf_context * ctx_gguf, int i) {
             {
                 const enum gguf_type arr_type = gguf_get_arr_type(ctx_gguf, i);
                 int arr_n = gguf_get_arr_n(ctx_gguf, i);
-                const void * data = gguf_get_arr_data(ctx_gguf, i);
+                const void * data = arr_type == GGUF_TYPE_STRING ? nullptr : gguf_get_arr_data(ctx_gguf, i);
                 std::stringstream ss;
                 ss << "[";
                 for (int j = 0; j < arr_n; j++) {
                     if (arr_type == GGUF_TYPE_STRING) {
-                        std::string val = gguf_get_arr_str(ctx_gguf, i, j);
+                        size_t n;
+                        const char * str = gguf_get_arr_str_view(ctx_gguf, i, j, &n);
+
+                        std::string val(str, n);
                         // escape quotes
                         replace_all(val, "\\", "\\\\");
                         replace_all(val, "\"", "\\\"");
@@ -684,8 +690,10 @@ static std::string gguf_kv_to_str(const struct gguf_context * ctx_gguf, int i) {
 // ggml helpers
 //
 
-static void ggml_graph_compute_helper(std::vector<uint8_t> & buf, ggml_cgraph * graph, int n_threads) {
+static void ggml_graph_compute_helper(std::vector<uint8_t> & buf, ggml_cgraph * graph, int n_threads, ggml_threadpool * threadpool = nullptr, int64_t * node_times = nullptr) {
     struct ggml_cplan plan = ggml_graph_plan(graph, n_threads);
+    plan.threadpool = threadpool;
+    plan.node_times = node_times;
 
     if (plan.work_size > 0) {
         buf.resize(plan.work_size);
@@ -829,6 +837,37 @@ struct llama_file {
         }
     }
 
+    // positional read that does not use the position of fp, so several threads can read the same file at once
+    void read_raw_at(void * ptr, size_t len, size_t offset) const {
+        while (len > 0) {
+            const size_t n_req = std::min(len, (size_t) 1 << 30);
+#ifdef _WIN32
+            OVERLAPPED ov = {};
+            ov.Offset     = (DWORD) (offset & 0xFFFFFFFF);
+            ov.OffsetHigh = (DWORD) (offset >> 32);
+            DWORD n_read = 0;
+            if (!ReadFile((HANDLE) _get_osfhandle(_fileno(fp)), ptr, (DWORD) n_req, &n_read, &ov)) {
+                throw std::runtime_error(format("read error: %s", llama_format_win_err(GetLastError()).c_str()));
+            }
+            const size_t ret = n_read;
+#else
+            const ssize_t ret = pread(fileno(fp), ptr, n_req, (off_t) offset);
+            if (ret < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw std::runtime_error(format("read error: %s", strerror(errno)));
+            }
+#endif
+            if (ret == 0) {
+                throw std::runtime_error(std::string("unexpectedly reached end of file"));
+            }
+            ptr     = (uint8_t *) ptr + ret;
+            len    -= ret;
+            offset += ret;
+        }
+    }
+
     uint32_t read_u32() const {
         uint32_t ret;
         read_raw(&ret, sizeof(ret));
@@ -866,20 +905,34 @@ struct llama_mmap {
 #ifdef _POSIX_MAPPED_FILES
     static constexpr bool SUPPORTED = true;
 
-    llama_mmap(struct llama_file * file, size_t prefetch = (size_t) -1 /* -1 = max value */, bool numa = false) {
+    llama_mmap(struct llama_file * file, size_t prefetch = (size_t) -1 /* -1 = max value */, bool numa = false, bool hugepages = false) {
         size = file->size;
         int fd = fileno(file->fp);
         int flags = MAP_SHARED;
         // prefetch/readahead impairs performance on NUMA systems
         if (numa) { prefetch = 0; }
 #ifdef __linux__
-        if (prefetch) { flags |= MAP_POPULATE; }
+        // the pages populated by mmap are mapped before madvise can ask for huge pages
+        if (prefetch && !hugepages) { flags |= MAP_POPULATE; }
 #endif
         addr = mmap(NULL, file->size, PROT_READ, flags, fd, 0);
         if (addr == MAP_FAILED) {
             throw std::runtime_error(format("mmap failed: %s", strerror(errno)));
         }
 
+        if (hugepages) {
+#ifdef MADV_HUGEPAGE
+            // fewer TLB misses when the weights are streamed
+            // for the files on regular filesystems, this needs a kernel with CONFIG_READ_ONLY_THP_FOR_FS
+            if (madvise(addr, file->size, MADV_HUGEPAGE)) {
+                fprintf(stderr, "warning: madvise(.., MADV_HUGEPAGE) failed: %s\n",
+                        strerror(errno));
+            }
+#else
+            fprintf(stderr, "warning: huge pages are not supported on this platform\n");
+#endif
+        }
+
         if (prefetch > 0) {
             // Advise the kernel to preload the mapped memory
             if (posix_madvise(addr, std::min(file->size, prefetch), POSIX_MADV_WILLNEED)) {
@@ -897,14 +950,32 @@ struct llama_mmap {
         }
     }
 
+    // drops the pages fully inside [offs, offs + len) from the process, e.g. for the tensors that were offloaded;
+    // the mapping stays valid and the pages are read again from the file if they are accessed
+    void release(size_t offs, size_t len) {
+        const size_t page_size = (size_t) sysconf(_SC_PAGESIZE);
+
+        const size_t beg = GGML_PAD(offs, page_size);
+        const size_t end = std::min(offs + len, size) & ~(page_size - 1);
+        if (beg >= end) {
+            return;
+        }
+
+        if (posix_madvise((uint8_t *) addr + beg, end - beg, POSIX_MADV_DONTNEED)) {
+            fprintf(stderr, "warning: posix_madvise(.., POSIX_MADV_DONTNEED) failed: %s\n",
+                    strerror(errno));
+        }
+    }
+
     ~llama_mmap() {
         munmap(addr, size);
     }
 #elif defined(_WIN32)
     static constexpr bool SUPPORTED = true;
 
-    llama_mmap(struct llama_file * file, bool prefetch = true, bool numa = false) {
+    llama_mmap(struct llama_file * file, bool prefetch = true, bool numa = false, bool hugepages = false) {
         (void) numa;
+        (void) hugepages;
 
         size = file->size;
 
@@ -946,6 +1017,12 @@ struct llama_mmap {
         }
     }
 
+    void release(size_t offs, size_t len) {
+        // the pages of the view are trimmed from the working set by the memory manager when needed
+        (void) offs;
+        (void) len;
+    }
+
     ~llama_mmap() {
         if (!UnmapViewOfFile(addr)) {
             fprintf(stderr, "warning: UnmapViewOfFile failed: %s\n",
@@ -955,13 +1032,19 @@ struct llama_mmap {
 #else
     static constexpr bool SUPPORTED = false;
 
-    llama_mmap(struct llama_file * file, bool prefetch = true, bool numa = false) {
+    llama_mmap(struct llama_file * file, bool prefetch = true, bool numa = false, bool hugepages = false) {
         (void) file;
         (void) prefetch;
         (void) numa;
+        (void) hugepages;
 
         throw std::runtime_error(std::string("mmap not supported"));
     }
+
+    void release(size_t offs, size_t len) {
+        (void) offs;
+        (void) len;
+    }
 #endif
 };
 
@@ -1120,20 +1203,6 @@ static void ggml_offload_nop(struct ggml_tensor * tensor) {
     (void) tensor;
 }
 
-static std::string llama_token_to_piece(const struct llama_context * ctx, llama_token token) {
-    std::vector<char> result(8, 0);
-    const int n_tokens = llama_token_to_piece(llama_get_model(ctx), token, result.data(), result.size());
-    if (n_tokens < 0) {
-        result.resize(-n_tokens);
-        int check = llama_token_to_piece(llama_get_model(ctx), token, result.data(), result.size());
-        GGML_ASSERT(check == -n_tokens);
-    }
-    else {
-        result.resize(n_tokens);
-    }
-
-    return std::string(result.data(), result.size());
-}
 
 //
 // globals
@@ -1254,8 +1323,16 @@ struct llama_cparams {
     float yarn_beta_fast;
     float yarn_beta_slow;
 
+    uint32_t n_top_k;
+    bool     top_k_graph; // the top-k tokens are computed in the graph, instead of from the logits
+
+    uint32_t n_graph_cache;
+
+    int32_t mpi_split;
+
     bool mul_mat_q;
     bool offload_kqv;
+    bool profile;
 };
 
 struct llama_layer {
@@ -1314,10 +1391,22 @@ struct llama_kv_cell {
     }
 };
 
+// consecutive tokens of a batch stored in consecutive cells:
+// the tokens [i_token, i_token + n_tokens) of the batch go to the cells [cell, cell + n_tokens)
+struct llama_kv_run {
+    uint32_t i_token;
+    uint32_t cell;
+    uint32_t n_tokens;
+};
+
 // ring-buffer of cached KV data
 struct llama_kv_cache {
     bool has_shift = false;
 
+    // the cells with a pending shift (delta != 0) are all in [shift_min, shift_max)
+    uint32_t shift_min = 0;
+    uint32_t shift_max = 0;
+
     // Note: The value of head isn't only used to optimize searching
     // for a free KV slot. llama_decode_internal also uses it, so it
     // cannot be freely changed after a slot has been allocated.
@@ -1325,14 +1414,29 @@ struct llama_kv_cache {
     uint32_t size = 0;
     uint32_t used = 0; // used cells (i.e. at least one seq_id)
 
-    // computed before each graph build
-    uint32_t n = 0;
+    // computed before each graph build: the graph attends to the cells [base, base + n)
+    uint32_t base = 0;
+    uint32_t n    = 0;
+
+    // cells of the batch being decoded, set by llama_kv_cache_find_slot
+    std::vector<llama_kv_run> runs;
 
     std::vector<llama_kv_cell> cells;
 
+    // indices of the cells, kept in sync with cells by the llama_kv_cache_cell_* helpers
+    std::vector<uint64_t>                       free_mask; // bit i is set if cell i is free (pos < 0)
+    std::map<llama_seq_id, std::set<uint32_t>> seq_cells; // cells of each sequence
+
     std::vector<struct ggml_tensor *> k_l; // per layer
     std::vector<struct ggml_tensor *> v_l;
 
+    // V is stored transposed, one row per channel, unless it is quantized: the quantization blocks
+    // lie along the rows, so the V of each cell is then one row, like K
+    bool v_trans = true;
+
+    // 0, 1, ..., size - 1: the rows of the cells to dequantize with ggml_get_rows
+    struct ggml_tensor * cell_ids = nullptr;
+
     struct ggml_context * ctx = NULL;
 
     llama_buffer buf;
@@ -1353,6 +1457,254 @@ struct llama_kv_cache {
     }
 };
 
+// prefix trie over the bytes of the token pieces
+// used by llama_sample_grammar to match all the tokens sharing a prefix against the grammar at once
+struct llama_token_trie {
+    struct node {
+        uint32_t parent;
+        uint32_t child_begin; // children are stored contiguously, sorted by byte
+        uint32_t child_end;
+        uint32_t tok_begin;   // tokens whose piece ends at this node
+        uint32_t tok_end;
+        uint32_t sub_end;     // tokens of the subtree rooted at this node are [tok_begin, sub_end)
+        uint8_t  byte;
+    };
+
+    std::vector<node>     nodes;      // nodes[0] is the root
+    std::vector<int32_t>  tokens;
+    std::vector<uint32_t> token_node; // node of each token, 0 for pieces that are empty or start with a 0 byte
+
+    void build(const std::vector<std::string> & pieces) {
+        nodes.clear();
+        tokens.clear();
+        token_node.assign(pieces.size(), 0);
+
+        std::vector<int32_t> order;
+        order.reserve(pieces.size());
+        for (size_t i = 0; i < pieces.size(); ++i) {
+            if (!pieces[i].empty() && pieces[i][0] != 0) {
+                order.push_back(i);
+            }
+        }
+        std::sort(order.begin(), order.end(), [&pieces](int32_t a, int32_t b) {
+            return pieces[a] < pieces[b];
+        });
+
+        tokens.reserve(order.size());
+        nodes.push_back({ 0, 0, 0, 0, 0, 0, 0 });
+        build_node(pieces, order, 0, 0, order.size(), 0);
+    }
+
+private:
+    // order[lo, hi) are the sorted tokens sharing the first depth bytes, the prefix of node n
+    void build_node(const std::vector<std::string> & pieces, const std::vector<int32_t> & order, uint32_t n, size_t lo, size_t hi, size_t depth) {
+        nodes[n].tok_begin = tokens.size();
+        while (lo < hi && pieces[order[lo]].size() == depth) {
+            token_node[order[lo]] = n;
+            tokens.push_back(order[lo]);
+            lo++;
+        }
+        nodes[n].tok_end = tokens.size();
+
+        // one child per distinct byte at this depth
+        std::vector<size_t> bounds;
+        const uint32_t child_begin = nodes.size();
+        for (size_t i = lo; i < hi;) {
+            const uint8_t byte = pieces[order[i]][depth];
+            bounds.push_back(i);
+            while (i < hi && (uint8_t) pieces[order[i]][depth] == byte) {
+                i++;
+            }
+            nodes.push_back({ n, 0, 0, 0, 0, 0, byte });
+        }
+        bounds.push_back(hi);
+        const uint32_t child_end = nodes.size();
+
+        nodes[n].child_begin = child_begin;
+        nodes[n].child_end   = child_end;
+        for (uint32_t c = child_begin; c < child_end; ++c) {
+            build_node(pieces, order, c, bounds[c - child_begin], bounds[c - child_begin + 1], depth + 1);
+        }
+        nodes[n].sub_end = tokens.size();
+    }
+};
+
+// Aho-Corasick automaton over the texts of the special tokens
+// used by the tokenizer to split the input at the special tokens in a single pass
+struct llama_special_token_matcher {
+    struct node {
+        uint32_t child_begin; // children are stored contiguously, sorted by byte
+        uint32_t child_end;
+        uint32_t fail;        // longest proper suffix of the prefix of this node that is a node too
+        uint32_t dict;        // nearest node along the fail links that ends a token, 0 if none
+        uint32_t depth;
+        int32_t  token;       // token ending at this node, -1 if none
+        uint8_t  byte;
+    };
+
+    struct match {
+        size_t  start;
+        size_t  length;
+        int32_t token;
+    };
+
+    std::vector<node> nodes;    // nodes[0] is the root
+    uint32_t root_next[256];    // transitions of the root, 0 for the bytes that start no token
+
+    void build(const std::unordered_map<std::string, int32_t> & tokens) {
+        std::vector<std::pair<std::string, int32_t>> sorted(tokens.begin(), tokens.end());
+        std::sort(sorted.begin(), sorted.end());
+
+        nodes.clear();
+        nodes.push_back({ 0, 0, 0, 0, 0, -1, 0 });
+        build_node(sorted, 0, 0, sorted.size(), 0);
+
+        for (int b = 0; b < 256; ++b) {
+            root_next[b] = 0;
+        }
+        for (uint32_t c = nodes[0].child_begin; c < nodes[0].child_end; ++c) {
+            root_next[nodes[c].byte] = c;
+        }
+
+        // the fail link of a node is found from the one of its parent, so visit the nodes by depth
+        std::vector<uint32_t> queue;
+        queue.reserve(nodes.size());
+        for (uint32_t c = nodes[0].child_begin; c < nodes[0].child_end; ++c) {
+            queue.push_back(c);
+        }
+        for (size_t q = 0; q < queue.size(); ++q) {
+            const uint32_t n = queue[q];
+            for (uint32_t c = nodes[n].child_begin; c < nodes[n].child_end; ++c) {
+                const uint32_t f = next(nodes[n].fail, nodes[c].byte);
+                nodes[c].fail = f;
+                nodes[c].dict = nodes[f].token >= 0 ? f : nodes[f].dict;
+                queue.push_back(c);
+            }
+        }
+    }
+
+    uint32_t next(uint32_t n, uint8_t byte) const {
+        while (n != 0) {
+            const node * begin = nodes.data() + nodes[n].child_begin;
+            const node * end   = nodes.data() + nodes[n].child_end;
+            const node * it = std::lower_bound(begin, end, byte,
+                    [](const node & c, uint8_t b) { return c.byte < b; });
+            if (it != end && it->byte == byte) {
+                return it - nodes.data();
+            }
+            n = nodes[n].fail;
+        }
+        return root_next[byte];
+    }
+
+    // appends the leftmost-longest non-overlapping matches in text[offs, offs + len), in order
+    void find(const std::string & text, size_t offs, size_t len, std::vector<match> & out) const {
+        if (nodes.size() <= 1) {
+            return;
+        }
+
+        const size_t out_begin = out.size();
+
+        uint32_t n = 0;
+        for (size_t i = offs; i < offs + len; ++i) {
+            n = next(n, text[i]);
+            for (uint32_t m = nodes[n].token >= 0 ? n : nodes[n].dict; m != 0; m = nodes[m].dict) {
+                out.push_back({ i + 1 - nodes[m].depth, nodes[m].depth, nodes[m].token });
+            }
+        }
+
+        // the matches were found in order of their end, keep the longest one at each start and skip the overlaps
+        std::sort(out.begin() + out_begin, out.end(), [](const match & a, const match & b) {
+            return a.start != b.start ? a.start < b.start : a.length > b.length;
+        });
+        size_t n_kept = out_begin;
+        size_t pos    = offs;
+        for (size_t i = out_begin; i < out.size(); ++i) {
+            if (out[i].start >= pos) {
+                pos = out[i].start + out[i].length;
+                out[n_kept++] = out[i];
+            }
+        }
+        out.resize(n_kept);
+    }
+
+private:
+    // sorted[lo, hi) are the tokens sharing the first depth bytes, the prefix of node n
+    void build_node(const std::vector<std::pair<std::string, int32_t>> & sorted, uint32_t n, size_t lo, size_t hi, uint32_t depth) {
+        nodes[n].depth = depth;
+        if (lo < hi && sorted[lo].first.size() == depth) {
+            nodes[n].token = sorted[lo].second;
+            lo++;
+        }
+
+        std::vector<size_t> bounds;
+        const uint32_t child_begin = nodes.size();
+        for (size_t i = lo; i < hi;) {
+            const uint8_t byte = sorted[i].first[depth];
+            bounds.push_back(i);
+            while (i < hi && (uint8_t) sorted[i].first[depth] == byte) {
+                i++;
+            }
+            nodes.push_back({ 0, 0, 0, 0, 0, -1, byte });
+        }
+        bounds.push_back(hi);
+        const uint32_t child_end = nodes.size();
+
+        nodes[n].child_begin = child_begin;
+        nodes[n].child_end   = child_end;
+        for (uint32_t c = child_begin; c < child_end; ++c) {
+            build_node(sorted, c, bounds[c - child_begin], bounds[c - child_begin + 1], depth + 1);
+        }
+    }
+};
+
+// 64-bit FNV-1a, the hashes stored in the tokenizer index cache must be the same on every platform
+static uint64_t llama_hash_bytes(const void * data, size_t size, uint64_t hash = 14695981039346656037ull) {
+    const uint8_t * bytes = (const uint8_t *) data;
+    for (size_t i = 0; i < size; ++i) {
+        hash = (hash ^ bytes[i]) * 1099511628211ull;
+    }
+    return hash;
+}
+
+// open addressing index of the ids of strings by the hash of their text, the strings themselves are kept by the owner
+// of the index and compared by the function given to find; a slot holds id + 1, 0 if it is empty
+struct llama_hash_index {
+    std::vector<uint32_t> slots; // the size is a power of 2, at least twice the number of ids
+
+    void init(size_t n) {
+        size_t size = 16;
+        while (size < 2*n) {
+            size *= 2;
+        }
+        slots.assign(size, 0);
+    }
+
+    // the first id probed for this hash that eq accepts, -1 if none
+    template <typename Eq>
+    int32_t find(uint64_t hash, const Eq & eq) const {
+        if (slots.empty()) {
+            return -1;
+        }
+        const size_t mask = slots.size() - 1;
+        for (size_t i = hash & mask; slots[i] != 0; i = (i + 1) & mask) {
+            if (eq(slots[i] - 1)) {
+                return slots[i] - 1;
+            }
+        }
+        return -1;
+    }
+
+    void insert(uint64_t hash, uint32_t id) {
+        const size_t mask = slots.size() - 1;
+        size_t i = hash & mask;
+        while (slots[i] != 0) {
+            i = (i + 1) & mask;
+        }
+        slots[i] = id + 1;
+    }
+};
+
 struct llama_vocab {
     using id    = int32_t;
     using token = std::string;
@@ -1366,12 +1718,36 @@ struct llama_vocab {
 
     enum llama_vocab_type type = LLAMA_VOCAB_TYPE_SPM;
 
-    std::unordered_map<token, id> token_to_id;
-    std::vector<token_data>       id_to_token;
+    // merge of two tokens: its rank and the token of the merged text, -1 if it is not a token
+    struct bpe_merge {
+        uint64_t pair; // left << 32 | right, see bpe_pair
+        int32_t  rank;
+        id       merged;
+    };
+
+    static constexpr uint64_t BPE_PAIR_NONE = ~(uint64_t) 0;
+
+    llama_hash_index        token_to_id; // see find_token
+    std::vector<token_data> id_to_token;
 
     std::unordered_map<token, id> special_tokens_cache;
+    llama_special_token_matcher   special_tokens_matcher;
 
-    std::map<std::pair<std::string, std::string>, int> bpe_ranks;
+    // text of the merges in the order of their rank, as stored in the model: the two tokens separated by a space
+    // the text of merge i is merge_data[merge_offs[i], merge_offs[i + 1] - 1), followed by a 0
+    std::vector<char>     merge_data;
+    std::vector<uint32_t> merge_offs;
+    llama_hash_index      merge_ranks; // see find_merge
+
+    // merges of two tokens by their ids, open addressing by the hash of their pair, BPE_PAIR_NONE in the empty slots
+    std::vector<bpe_merge> bpe_merges;
+
+    llama_token_trie trie;
+
+    // decoded piece of each token, as returned by llama_token_to_piece, each one followed by a 0
+    // the piece of token i is piece_data[piece_offs[i], piece_offs[i + 1] - 1)
+    std::vector<char>     piece_data;
+    std::vector<uint32_t> piece_offs;
 
     // default LLaMA special tokens
     id special_bos_id = 1;
@@ -1389,18 +1765,63 @@ struct llama_vocab {
     id special_suffix_id = 32008;
     id special_eot_id    = 32010;
 
-    int find_bpe_rank(std::string token_left, std::string token_right) const {
+    static uint64_t bpe_pair(id left, id right) {
+        return ((uint64_t) (uint32_t) left << 32) | (uint32_t) right;
+    }
+
+    static uint64_t bpe_pair_hash(uint64_t pair) {
+        pair *= 0x9E3779B97F4A7C15ull;
+        return pair ^ (pair >> 32);
+    }
+
+    // token of this text, -1 if none
+    id find_token(const char * text, size_t len) const {
+        return token_to_id.find(llama_hash_bytes(text, len), [&](uint32_t i) {
+            const std::string & t = id_to_token[i].text;
+            return t.size() == len && memcmp(t.data(), text, len) == 0;
+        });
+    }
+
+    id find_token(const std::string & text) const {
+        return find_token(text.data(), text.size());
+    }
+
+    size_t n_merges() const {
+        return merge_offs.empty() ? 0 : merge_offs.size() - 1;
+    }
+
+    // rank of the merge of this text, -1 if none
+    int find_merge(const char * text, size_t len) const {
+        return merge_ranks.find(llama_hash_bytes(text, len), [&](uint32_t rank) {
+            return merge_offs[rank + 1] - merge_offs[rank] - 1 == len && memcmp(merge_data.data() + merge_offs[rank], text, len) == 0;
+        });
+    }
+
+    int find_bpe_rank(std::string token_left, const std::string & token_right) const {
         GGML_ASSERT(token_left.find(" ") == std::string::npos);
         GGML_ASSERT(token_left.find("\n") == std::string::npos);
         GGML_ASSERT(token_right.find(" ") == std::string::npos);
         GGML_ASSERT(token_right.find("\n") == std::string::npos);
 
-        auto it = bpe_ranks.find(std::make_pair(token_left, token_right));
-        if (it == bpe_ranks.end()) {
-            return -1;
-        }
+        token_left += ' ';
+        token_left += token_right;
 
-        return it->second;
+        return find_merge(token_left.data(), token_left.size());
+    }
+
+    // merge of the tokens left and right, NULL if none
+    const bpe_merge * find_bpe_merge(id left, id right) const {
+        if (bpe_merges.empty()) {
+            return nullptr;
+        }
+        const uint64_t pair = bpe_pair(left, right);
+        const size_t   mask = bpe_merges.size() - 1;
+        for (size_t i = bpe_pair_hash(pair) & mask; bpe_merges[i].pair != BPE_PAIR_NONE; i = (i + 1) & mask) {
+            if (bpe_merges[i].pair == pair) {
+                return &bpe_merges[i];
+            }
+        }
+        return nullptr;
     }
 };
 
@@ -1427,6 +1848,9 @@ struct llama_model {
 
     int n_gpu_layers;
 
+    // only the metadata of the tensors is loaded, not their data, see llama_plan_memory
+    bool dry_run = false;
+
     // gguf metadata
     std::unordered_map<std::string, std::string> gguf_kv;
 
@@ -1455,7 +1879,7 @@ struct llama_model {
         }
 
 #ifdef GGML_USE_CUBLAS
-        if (ggml_cublas_loaded()) {
+        if (ggml_cublas_loaded() && !dry_run) {
             for (size_t i = 0; i < tensors_by_name.size(); ++i) {
                 ggml_cuda_free_data(tensors_by_name[i].second);
             }
@@ -1464,16 +1888,133 @@ struct llama_model {
 #endif
 
 #if defined(GGML_USE_CLBLAST)
-        for (size_t i = 0; i < tensors_by_name.size(); ++i) {
-            ggml_cl_free_data(tensors_by_name[i].second);
+        if (!dry_run) {
+            for (size_t i = 0; i < tensors_by_name.size(); ++i) {
+                ggml_cl_free_data(tensors_by_name[i].second);
+            }
         }
 #endif
     }
 };
 
+// the input tensors of a graph, set before each evaluation
+struct llama_graph_inputs {
+    struct ggml_tensor * tokens     = nullptr;
+    struct ggml_tensor * embd       = nullptr;
+    struct ggml_tensor * pos        = nullptr;
+    struct ggml_tensor * KQ_scale   = nullptr;
+    struct ggml_tensor * KQ_mask    = nullptr;
+    struct ggml_tensor * K_shift    = nullptr;
+    struct ggml_tensor * top_k_bias = nullptr;
+    struct ggml_tensor * out_ids    = nullptr;
+};
+
+// a view of the KV cache at the cell kv.base (run < 0) or kv.runs[run].cell, at the offset stride*cell
+struct llama_kv_view {
+    struct ggml_tensor * tensor;
+    size_t               stride;
+    int32_t              run;
+};
+
+struct llama_graph {
+    struct ggml_cgraph * gf = nullptr;
+
+    llama_graph_inputs inp;
+
+    std::vector<llama_kv_view> kv_views;
+};
+
+// a graph kept for the batches of the same shape: the number of tokens, the attended cells and the runs of the
+// cells where the KV of the tokens is stored, which can start at different cells
+struct llama_cached_graph {
+    uint32_t n_tokens   = 0;
+    uint32_t n_kv       = 0;
+    bool     embd       = false; // the batch has embeddings instead of tokens
+    float    top_k_temp = 0.0f;
+    uint32_t n_outputs  = 0;
+
+    std::vector<llama_kv_run> runs;
+
+    int64_t t_used = -1; // < 0 if the graph was never built
+
+    // tensor and graph structs, the tensor data is in the allocator buffer like the data of the other graphs
+    llama_buffer buf;
+
+    llama_graph graph;
+};
+
+// compute time of a node of a graph, with cparams.profile
+struct llama_profile_node {
+    char         name[GGML_MAX_NAME];
+    const char * op;      // ggml_op_desc
+    ggml_type    type;    // of the first source, or of the node without sources
+    ggml_backend_type backend;
+    int64_t      ne[GGML_MAX_DIMS];
+    int64_t      t_start_us;
+    int64_t      t_end_us;
+};
+
+struct llama_profile_graph {
+    uint32_t n_tokens;
+    uint32_t n_kv;
+    int64_t  t_start_us;
+    int64_t  t_end_us;
+};
+
+// size of the compute buffer planned for the batches of at most n_tokens tokens that attend at most n_kv cells
+struct llama_alloc_bucket {
+    uint32_t n_tokens;
+    uint32_t n_kv;
+    size_t   size;
+};
+
+static const size_t LLAMA_TENSOR_ALIGNMENT = 32;
+
+// the thread that evaluates the batches of llama_decode_async, one at a time
+struct llama_decode_worker {
+    std::thread             thread;
+    std::mutex              mutex;
+    std::condition_variable cv;
+
+    bool quit    = false;
+    bool running = false; // the worker evaluates the batch, guarded by mutex
+    bool busy    = false; // llama_synchronize was not called yet for the batch, only used by the caller thread
+    int  result  = 0;
+
+    // the copy of the batch being evaluated
+    llama_batch                 batch = {};
+    std::vector<llama_token>    token;
+    std::vector<float>          embd;
+    std::vector<llama_pos>      pos;
+    std::vector<int32_t>        n_seq_id;
+    std::vector<llama_seq_id>   seq_id;
+    std::vector<llama_seq_id *> seq_id_ptr;
+    std::vector<int8_t>         logits;
+
+    // while busy: the outputs of the batch evaluated before, swapped with the ones of the context when a batch starts
+    std::vector<float>            out_logits;
+    std::vector<llama_token_data> out_top_k;
+    std::vector<float>            out_embedding;
+    std::vector<float>            out_embedding_all;
+
+    ~llama_decode_worker() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            quit = true;
+        }
+        cv.notify_all();
+        if (thread.joinable()) {
+            thread.join();
+        }
+    }
+};
+
 struct llama_context {
     llama_context(const llama_model & model) : model(model), t_start_us(model.t_start_us), t_load_us(model.t_load_us) {}
     ~llama_context() {
+        // the batch in progress is finished before anything is freed
+        decode_worker.reset();
+
 #ifdef GGML_USE_METAL
         if (ctx_metal) {
             ggml_metal_free(ctx_metal);
@@ -1482,6 +2023,14 @@ struct llama_context {
         if (alloc) {
             ggml_allocr_free(alloc);
         }
+        if (threadpool_owned) {
+            ggml_threadpool_free(threadpool);
+        }
+#ifdef GGML_USE_MPI
+        if (ctx_mpi) {
+            ggml_mpi_free(ctx_mpi);
+        }
+#endif
     }
 
     llama_cparams cparams;
@@ -1497,11 +2046,11 @@ struct llama_context {
 
     int64_t t_start_us;
     int64_t t_load_us;
-    int64_t t_sample_us = 0;
+    std::atomic<int64_t> t_sample_us{0}; // the candidates of several sequences may be sampled in parallel
     int64_t t_p_eval_us = 0;
     int64_t t_eval_us   = 0;
 
-    int32_t n_sample = 0; // number of tokens sampled
+    std::atomic<int32_t> n_sample{0}; // number of tokens sampled
     int32_t n_p_eval = 0; // number of tokens in eval calls for the prompt (with batch size > 1)
     int32_t n_eval   = 0; // number of eval calls
 
@@ -1509,18 +2058,50 @@ struct llama_context {
     std::vector<float> logits;
     bool logits_all = false;
 
+    // the tokens of the batch of the rows of the output of the graph being evaluated, see llama_set_out_ids
+    std::vector<int32_t> out_ids;
+
+    // most probable tokens of each output (2-dimensional array: [n_tokens][n_top_k]), with cparams.n_top_k > 0
+    std::vector<llama_token_data> top_k;
+    float                         top_k_temp = 1.0f;
+    std::vector<float>            top_k_bias; // [n_vocab], empty for none
+
     // input embedding (1-dimensional array: [n_embd])
     std::vector<float> embedding;
 
+    // embeddings of all the tokens of the last batch in embedding mode (2-dimensional array: [n_tokens][n_embd])
+    std::vector<float> embedding_all;
+
     // reusable buffer for `struct ggml_graph_plan.work_data`
     std::vector<uint8_t> work_buffer;
 
+    // created by the first llama_decode_async
+    std::unique_ptr<llama_decode_worker> decode_worker;
+
+    // threads computing the graphs, created by llama_get_threadpool unless set with llama_set_threadpool
+    ggml_threadpool * threadpool       = nullptr;
+    bool              threadpool_owned = false;
+
     // memory buffers used to evaluate the model
     llama_buffer buf_compute;
+    llama_graph  graph; // the last graph built in buf_compute
+
+    // sized once with cparams.n_graph_cache
+    std::vector<llama_cached_graph> graph_cache;
 
     llama_buffer buf_alloc;
     ggml_allocr * alloc = NULL;
 
+    // with cparams.profile: the start and end of each node of the graph being computed, and the nodes and the graphs
+    // computed since the last llama_reset_timings
+    std::vector<int64_t>             prof_times;
+    std::vector<llama_profile_node>  prof_nodes;
+    std::vector<llama_profile_graph> prof_graphs;
+
+    // measured once for a few shapes of batches, the allocator buffer grows to the bucket of the largest batch
+    // evaluated since the last llama_compute_buffer_trim
+    std::vector<llama_alloc_bucket> alloc_buckets;
+
 #ifdef GGML_USE_METAL
     ggml_metal_context * ctx_metal = NULL;
 #endif
@@ -1534,6 +2115,126 @@ struct llama_context {
 // kv cache helpers
 //
 
+static int llama_ctz64(uint64_t x) {
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_ctzll(x);
+#else
+    int n = 0;
+    while ((x & 1) == 0) {
+        x >>= 1;
+        n++;
+    }
+    return n;
+#endif
+}
+
+// the bits of free_mask past the last cell are 0, so these cells look used
+// returns the first free cell >= i, or cache.size
+static uint32_t llama_kv_cache_next_free(const struct llama_kv_cache & cache, uint32_t i) {
+    if (i >= cache.size) {
+        return cache.size;
+    }
+    size_t   iw = i/64;
+    uint64_t w  = cache.free_mask[iw] & (~0ull << (i%64));
+    while (w == 0) {
+        if (++iw == cache.free_mask.size()) {
+            return cache.size;
+        }
+        w = cache.free_mask[iw];
+    }
+    return std::min(cache.size, uint32_t(iw*64 + llama_ctz64(w)));
+}
+
+// returns the first used cell >= i, or cache.size
+static uint32_t llama_kv_cache_next_used(const struct llama_kv_cache & cache, uint32_t i) {
+    if (i >= cache.size) {
+        return cache.size;
+    }
+    size_t   iw = i/64;
+    uint64_t w  = ~cache.free_mask[iw] & (~0ull << (i%64));
+    while (w == 0) {
+        if (++iw == cache.free_mask.size()) {
+            return cache.size;
+        }
+        w = ~cache.free_mask[iw];
+    }
+    return std::min(cache.size, uint32_t(iw*64 + llama_ctz64(w)));
+}
+
+static void llama_kv_cache_cell_use(struct llama_kv_cache & cache, uint32_t i, llama_pos pos) {
+    if (cache.cells[i].pos < 0) {
+        cache.free_mask[i/64] &= ~(1ull << (i%64));
+        cache.used++;
+    }
+    cache.cells[i].pos = pos;
+}
+
+static void llama_kv_cache_cell_add_seq(struct llama_kv_cache & cache, uint32_t i, llama_seq_id seq_id) {
+    if (cache.cells[i].seq_id.insert(seq_id).second) {
+        cache.seq_cells[seq_id].insert(i);
+    }
+}
+
+static void llama_kv_cache_cell_rm_seq(struct llama_kv_cache & cache, uint32_t i, llama_seq_id seq_id) {
+    if (cache.cells[i].seq_id.erase(seq_id) > 0) {
+        auto it = cache.seq_cells.find(seq_id);
+        it->second.erase(i);
+        if (it->second.empty()) {
+            cache.seq_cells.erase(it);
+        }
+    }
+}
+
+static void llama_kv_cache_cell_shift(struct llama_kv_cache & cache, uint32_t i, llama_pos delta) {
+    cache.has_shift = true;
+    cache.cells[i].delta += delta;
+    cache.shift_min = std::min(cache.shift_min, i);
+    cache.shift_max = std::max(cache.shift_max, i + 1);
+}
+
+static void llama_kv_cache_cell_free(struct llama_kv_cache & cache, uint32_t i) {
+    llama_kv_cell & cell = cache.cells[i];
+    while (!cell.seq_id.empty()) {
+        llama_kv_cache_cell_rm_seq(cache, i, *cell.seq_id.begin());
+    }
+    if (cell.pos >= 0) {
+        cache.free_mask[i/64] |= 1ull << (i%64);
+        cache.used--;
+    }
+    cell.pos = -1;
+}
+
+// rebuilds the indices and the count of used cells from the cells
+static void llama_kv_cache_reindex(struct llama_kv_cache & cache) {
+    cache.free_mask.assign((cache.size + 63)/64, 0);
+    cache.seq_cells.clear();
+    cache.used = 0;
+
+    for (uint32_t i = 0; i < cache.size; ++i) {
+        const llama_kv_cell & cell = cache.cells[i];
+        if (cell.pos < 0) {
+            cache.free_mask[i/64] |= 1ull << (i%64);
+            continue;
+        }
+        cache.used++;
+        for (const llama_seq_id seq_id : cell.seq_id) {
+            cache.seq_cells[seq_id].insert(i);
+        }
+    }
+}
+
+// the tensors of a plan have no data, a placeholder keeps the graph allocator from allocating them as inputs of the
+// measured graphs, it is never read
+static void llama_plan_set_data(struct ggml_context * ctx) {
+    static char placeholder;
+
+    for (ggml_tensor * t = ggml_get_first_tensor(ctx); t != nullptr; t = ggml_get_next_tensor(ctx, t)) {
+        if (t->data == nullptr) {
+            t->data = &placeholder;
+        }
+    }
+}
+
 static bool llama_kv_cache_init(
         const struct llama_hparams & hparams,
              struct llama_kv_cache & cache,
@@ -1541,7 +2242,8 @@ static bool llama_kv_cache_init(
                          ggml_type   vtype,
                           uint32_t   n_ctx,
                                int   n_gpu_layers,
-                              bool   offload) {
+                              bool   offload,
+                              bool   alloc = true) {
     const uint32_t n_embd  = hparams.n_embd_gqa();
     const uint32_t n_layer = hparams.n_layer;
 
@@ -1549,6 +2251,8 @@ static bool llama_kv_cache_init(
     const int64_t n_elements = n_embd*n_mem;
 
     cache.has_shift = false;
+    cache.shift_min = n_ctx;
+    cache.shift_max = 0;
 
     cache.head = 0;
     cache.size = n_ctx;
@@ -1557,13 +2261,20 @@ static bool llama_kv_cache_init(
     cache.cells.clear();
     cache.cells.resize(n_ctx);
 
-    cache.buf.resize(ggml_row_size(ktype, n_elements) + ggml_row_size(vtype, n_elements) + 2u*n_layer*ggml_tensor_overhead());
+    llama_kv_cache_reindex(cache);
+
+    cache.v_trans = !ggml_is_quantized(vtype);
+
+    // without alloc, only the tensors are created, to plan the memory of a context
+    const size_t data_size = alloc ? ggml_row_size(ktype, n_elements) + ggml_row_size(vtype, n_elements) + ggml_row_size(GGML_TYPE_I32, n_ctx) : 0;
+
+    cache.buf.resize(data_size + 2u*n_layer*ggml_tensor_overhead() + ggml_tensor_overhead());
     memset(cache.buf.data, 0, cache.buf.size);
 
     struct ggml_init_params params;
     params.mem_size   = cache.buf.size;
     params.mem_buffer = cache.buf.data;
-    params.no_alloc   = false;
+    params.no_alloc   = !alloc;
 
     cache.ctx = ggml_init(params);
 
@@ -1574,6 +2285,12 @@ static bool llama_kv_cache_init(
         return false;
     }
 
+    cache.cell_ids = ggml_new_tensor_1d(cache.ctx, GGML_TYPE_I32, n_ctx);
+    ggml_set_name(cache.cell_ids, "cache_cell_ids");
+    for (uint32_t i = 0; alloc && i < n_ctx; i++) {
+        ((int32_t *) cache.cell_ids->data)[i] = i;
+    }
+
     cache.k_l.reserve(n_layer);
     cache.v_l.reserve(n_layer);
 
@@ -1589,7 +2306,7 @@ static bool llama_kv_cache_init(
         cache.k_l.push_back(k);
         cache.v_l.push_back(v);
 #ifdef GGML_USE_CUBLAS
-        if (i >= i_gpu_start) {
+        if (i >= i_gpu_start && alloc) {
             if (offload) {
                 ggml_cuda_assign_buffers_no_scratch(k);
                 vram_kv_cache += ggml_nbytes(k);
@@ -1600,6 +2317,10 @@ static bool llama_kv_cache_init(
 #endif // GGML_USE_CUBLAS
     }
 
+    if (!alloc) {
+        llama_plan_set_data(cache.ctx);
+    }
+
     if (vram_kv_cache > 0) {
         LLAMA_LOG_INFO("%s: VRAM kv self = %.2f MB\n", __func__, vram_kv_cache / 1024.0 / 1024.0);
     }
@@ -1613,6 +2334,8 @@ static bool llama_kv_cache_init(
 // updates the cache head
 // Note: On success, it's important that cache.head points
 // to the first cell of the slot.
+// If the free cells are fragmented so that no slot is large enough, the tokens are
+// scattered over the first free cells after the head, and cache.runs lists their cells.
 static bool llama_kv_cache_find_slot(
            struct llama_kv_cache & cache,
         const struct llama_batch & batch) {
@@ -1624,53 +2347,114 @@ static bool llama_kv_cache_find_slot(
         return false;
     }
 
-    uint32_t n_tested = 0;
+    if (cache.size - cache.used < n_tokens) {
+        //LLAMA_LOG_ERROR("%s: failed to find a slot for %d tokens\n", __func__, n_tokens);
+        return false;
+    }
 
-    while (true) {
-        if (cache.head + n_tokens > n_ctx) {
-            n_tested += n_ctx - cache.head;
-            cache.head = 0;
-            continue;
-        }
+    if (cache.head >= n_ctx) {
+        cache.head = 0;
+    }
 
-        bool found = true;
-        for (uint32_t i = 0; i < n_tokens; i++) {
-            if (cache.cells[cache.head + i].pos >= 0) {
-                found = false;
-                cache.head += i + 1;
-                n_tested   += i + 1;
+    cache.runs.clear();
+
+    // first run of n_tokens free cells from the head, then from the start of the cache
+    for (uint32_t start : { cache.head, 0u }) {
+        uint32_t i = llama_kv_cache_next_free(cache, start);
+        while (i + n_tokens <= n_ctx) {
+            const uint32_t end = llama_kv_cache_next_used(cache, i);
+            if (end - i >= n_tokens) {
+                cache.runs.push_back({ 0, i, n_tokens });
                 break;
             }
+            i = llama_kv_cache_next_free(cache, end);
         }
-
-        if (found) {
+        if (!cache.runs.empty()) {
             break;
         }
+    }
 
-        if (n_tested >= n_ctx) {
-            //LLAMA_LOG_ERROR("%s: failed to find a slot for %d tokens\n", __func__, n_tokens);
-            return false;
+    if (cache.runs.empty()) {
+        // the free cells are fragmented: take the first ones after the head, wrapping around
+        uint32_t i_token = 0;
+        uint32_t i       = llama_kv_cache_next_free(cache, cache.head);
+        while (i_token < n_tokens) {
+            if (i == n_ctx) {
+                i = llama_kv_cache_next_free(cache, 0);
+            }
+            const uint32_t end = std::min(llama_kv_cache_next_used(cache, i), i + (n_tokens - i_token));
+            cache.runs.push_back({ i_token, i, end - i });
+            i_token += end - i;
+            i = llama_kv_cache_next_free(cache, end);
+        }
+    }
+
+    cache.head = cache.runs[0].cell;
+
+    for (const llama_kv_run & run : cache.runs) {
+        for (uint32_t i = 0; i < run.n_tokens; i++) {
+            const uint32_t i_token = run.i_token + i;
+
+            llama_kv_cache_cell_use(cache, run.cell + i, batch.pos[i_token]);
+
+            for (int32_t j = 0; j < batch.n_seq_id[i_token]; j++) {
+                llama_kv_cache_cell_add_seq(cache, run.cell + i, batch.seq_id[i_token][j]);
+            }
         }
     }
 
-    for (uint32_t i = 0; i < n_tokens; i++) {
-        cache.cells[cache.head + i].pos = batch.pos[i];
+    return true;
+}
+
+// find the cells attended by the batch: the smallest window, aligned to 32 cells,
+// that holds all the cells of the sequences of the batch
+static void llama_kv_cache_find_window(
+           struct llama_kv_cache & cache,
+        const struct llama_batch & batch) {
+    uint32_t cell_min = cache.size;
+    uint32_t cell_max = 0;
+
+    llama_seq_id seq_id_last = -1;
 
+    for (int32_t i = 0; i < batch.n_tokens; i++) {
         for (int32_t j = 0; j < batch.n_seq_id[i]; j++) {
-            cache.cells[cache.head + i].seq_id.insert(batch.seq_id[i][j]);
+            const llama_seq_id seq_id = batch.seq_id[i][j];
+            if (seq_id == seq_id_last) {
+                continue;
+            }
+            seq_id_last = seq_id;
+
+            const auto it = cache.seq_cells.find(seq_id);
+            if (it != cache.seq_cells.end()) {
+                cell_min = std::min(cell_min, *it->second.begin());
+                cell_max = std::max(cell_max, *it->second.rbegin() + 1);
+            }
         }
     }
 
-    cache.used += n_tokens;
+    if (cell_max == 0) {
+        cell_min = 0;
+    }
+
+    const uint32_t base = cell_min - cell_min % 32;
 
-    return true;
+    cache.n    = std::min(cache.size, std::max(32u, (uint32_t) GGML_PAD(cell_max - base, 32)));
+    cache.base = std::min(base, cache.size - cache.n);
 }
 
 // find how many cells are currently in use
 static int32_t llama_kv_cache_cell_max(const struct llama_kv_cache & cache) {
-    for (uint32_t i = cache.size - 1; i > 0; --i) {
-        if (cache.cells[i].pos >= 0 && !cache.cells[i].seq_id.empty()) {
-            return i + 1;
+    for (size_t iw = cache.free_mask.size(); iw-- > 0; ) {
+        uint64_t w = ~cache.free_mask[iw];
+        if (iw == cache.free_mask.size() - 1 && cache.size % 64 != 0) {
+            w &= (1ull << (cache.size % 64)) - 1;
+        }
+        if (w != 0) {
+            int n = 63;
+            while ((w >> n) == 0) {
+                n--;
+            }
+            return iw*64 + n + 1;
         }
     }
 
@@ -1683,7 +2467,35 @@ static void llama_kv_cache_clear(struct llama_kv_cache & cache) {
         cache.cells[i].seq_id.clear();
     }
     cache.head = 0;
-    cache.used = 0;
+
+    llama_kv_cache_reindex(cache);
+}
+
+// the cells of seq_id (all cells if seq_id < 0) with p0 <= pos < p1, in increasing order
+static std::vector<uint32_t> llama_kv_cache_seq_find(
+        const struct llama_kv_cache & cache,
+                       llama_seq_id   seq_id,
+                          llama_pos   p0,
+                          llama_pos   p1) {
+    std::vector<uint32_t> result;
+
+    for (const auto & it : cache.seq_cells) {
+        if (seq_id >= 0 && it.first != seq_id) {
+            continue;
+        }
+        for (const uint32_t i : it.second) {
+            if (cache.cells[i].pos >= p0 && cache.cells[i].pos < p1) {
+                result.push_back(i);
+            }
+        }
+    }
+
+    if (seq_id < 0) {
+        std::sort(result.begin(), result.end());
+        result.erase(std::unique(result.begin(), result.end()), result.end());
+    }
+
+    return result;
 }
 
 static void llama_kv_cache_seq_rm(
@@ -1696,22 +2508,13 @@ static void llama_kv_cache_seq_rm(
     if (p0 < 0) p0 = 0;
     if (p1 < 0) p1 = std::numeric_limits<llama_pos>::max();
 
-    for (uint32_t i = 0; i < cache.size; ++i) {
-        if (cache.cells[i].pos >= p0 && cache.cells[i].pos < p1) {
-            if (seq_id < 0) {
-                cache.cells[i].seq_id.clear();
-            } else if (cache.cells[i].has_seq_id(seq_id)) {
-                cache.cells[i].seq_id.erase(seq_id);
-            } else {
-                continue;
-            }
-            if (cache.cells[i].seq_id.empty()) {
-                // keep count of the number of used cells
-                if (cache.cells[i].pos >= 0) cache.used--;
-
-                cache.cells[i].pos = -1;
-                if (new_head == cache.size) new_head = i;
-            }
+    for (const uint32_t i : llama_kv_cache_seq_find(cache, seq_id, p0, p1)) {
+        if (seq_id >= 0) {
+            llama_kv_cache_cell_rm_seq(cache, i, seq_id);
+        }
+        if (seq_id < 0 || cache.cells[i].seq_id.empty()) {
+            llama_kv_cache_cell_free(cache, i);
+            if (new_head == cache.size) new_head = i;
         }
     }
 
@@ -1730,25 +2533,25 @@ static void llama_kv_cache_seq_cp(
 
     cache.head = 0;
 
-    for (uint32_t i = 0; i < cache.size; ++i) {
-        if (cache.cells[i].has_seq_id(seq_id_src) && cache.cells[i].pos >= p0 && cache.cells[i].pos < p1) {
-            cache.cells[i].seq_id.insert(seq_id_dst);
-        }
+    for (const uint32_t i : llama_kv_cache_seq_find(cache, seq_id_src, p0, p1)) {
+        llama_kv_cache_cell_add_seq(cache, i, seq_id_dst);
     }
 }
 
 static void llama_kv_cache_seq_keep(struct llama_kv_cache & cache, llama_seq_id seq_id) {
     uint32_t new_head = cache.size;
 
-    for (uint32_t i = 0; i < cache.size; ++i) {
+    for (const uint32_t i : llama_kv_cache_seq_find(cache, -1, 0, std::numeric_limits<llama_pos>::max())) {
         if (!cache.cells[i].has_seq_id(seq_id)) {
-            if (cache.cells[i].pos >= 0) cache.used--;
-            cache.cells[i].pos = -1;
-            cache.cells[i].seq_id.clear();
+            llama_kv_cache_cell_free(cache, i);
             if (new_head == cache.size) new_head = i;
         } else {
-            cache.cells[i].seq_id.clear();
-            cache.cells[i].seq_id.insert(seq_id);
+            const std::set<llama_seq_id> seq_ids = cache.cells[i].seq_id;
+            for (const llama_seq_id other : seq_ids) {
+                if (other != seq_id) {
+                    llama_kv_cache_cell_rm_seq(cache, i, other);
+                }
+            }
         }
     }
 
@@ -1767,18 +2570,14 @@ static void llama_kv_cache_seq_shift(
     if (p0 < 0) p0 = 0;
     if (p1 < 0) p1 = std::numeric_limits<llama_pos>::max();
 
-    for (uint32_t i = 0; i < cache.size; ++i) {
-        if (cache.cells[i].has_seq_id(seq_id) && cache.cells[i].pos >= p0 && cache.cells[i].pos < p1) {
-            cache.has_shift = true;
-            cache.cells[i].pos   += delta;
-            cache.cells[i].delta += delta;
+    for (const uint32_t i : llama_kv_cache_seq_find(cache, seq_id, p0, p1)) {
+        llama_kv_cache_cell_shift(cache, i, delta);
 
-            if (cache.cells[i].pos < 0) {
-                if (!cache.cells[i].seq_id.empty()) cache.used--;
-                cache.cells[i].pos = -1;
-                cache.cells[i].seq_id.clear();
-                if (new_head == cache.size) new_head = i;
-            }
+        if (cache.cells[i].pos + delta < 0) {
+            llama_kv_cache_cell_free(cache, i);
+            if (new_head == cache.size) new_head = i;
+        } else {
+            cache.cells[i].pos += delta;
         }
     }
 
@@ -1997,6 +2796,11 @@ struct llama_model_loader {
     size_t  n_bytes    = 0;
 
     bool use_mmap = false;
+    bool repack   = false; // repack the CPU weights of the matrix multiplications, see ggml_repack
+
+    bool use_hugepages = false; // advise huge pages for the mapping
+
+    int n_read_threads = std::max(1, std::min(8, (int) std::thread::hardware_concurrency())); // without mmap
 
     llama_file  file;
     llama_ftype ftype;
@@ -2288,14 +3092,47 @@ struct llama_model_loader {
         return gguf_get_data_offset(ctx_gguf) + gguf_get_tensor_offset(ctx_gguf, idx);
     }
 
+    // reads a range of the file with up to n_read_threads threads, so that fast drives get enough requests in flight
+    void read_data_parallel(void * dst, size_t offs, size_t size) const {
+        const size_t min_chunk = 4*1024*1024;
+        const size_t n_chunks  = std::min((size_t) n_read_threads, (size + min_chunk - 1)/min_chunk);
+
+        if (n_chunks <= 1) {
+            file.read_raw_at(dst, size, offs);
+            return;
+        }
+
+        const size_t chunk = (size + n_chunks - 1)/n_chunks;
+
+        std::vector<std::future<void>> reads;
+        for (size_t i = 1; i < n_chunks; ++i) {
+            const size_t beg = i*chunk;
+            const size_t len = std::min(chunk, size - beg);
+            reads.push_back(std::async(std::launch::async, [this, dst, offs, beg, len]() {
+                file.read_raw_at((uint8_t *) dst + beg, len, offs + beg);
+            }));
+        }
+        file.read_raw_at(dst, chunk, offs);
+
+        for (auto & read : reads) {
+            read.get();
+        }
+    }
+
     void load_data_for(struct ggml_tensor * cur) const {
         const size_t offs = file_offset(ggml_get_name(cur));
 
         if (use_mmap) {
             cur->data = (uint8_t *) mapping->addr + offs;
         } else {
-            file.seek(offs, SEEK_SET);
-            file.read_raw(cur->data, ggml_nbytes(cur));
+            read_data_parallel(cur->data, offs, ggml_nbytes(cur));
+        }
+    }
+
+    // the mapped pages of a tensor that was uploaded to the device are not needed in host memory anymore
+    void release_data_for(struct ggml_tensor * cur, llama_mlock * lmlock) const {
+        if (use_mmap && !lmlock) {
+            mapping->release(file_offset(ggml_get_name(cur)), ggml_nbytes(cur));
         }
     }
 
@@ -2303,42 +3140,74 @@ struct llama_model_loader {
         size_t size_data = 0;
         size_t size_lock = 0;
         size_t size_pref = 0; // prefetch
+        size_t size_stag = 0; // largest tensor that is staged in host memory before the upload
 
         for (int i = 0; i < gguf_get_n_tensors(ctx_gguf); i++) {
             struct ggml_tensor * cur = ggml_get_tensor(ctx, gguf_get_tensor_name(ctx_gguf, i));
             size_data += ggml_nbytes(cur);
             if (cur->backend == GGML_BACKEND_CPU) {
                 size_pref += ggml_nbytes(cur);
+            } else if (!use_mmap && cur->data == NULL) {
+                size_stag = std::max(size_stag, ggml_nbytes(cur));
             }
         }
 
         if (use_mmap) {
-            mapping.reset(new llama_mmap(&file, size_pref, ggml_is_numa()));
+            mapping.reset(new llama_mmap(&file, size_pref, ggml_is_numa(), use_hugepages));
             if (lmlock) {
                 lmlock->init(mapping->addr);
             }
         }
 
-        size_t done_size = 0;
-        for (int i = 0; i < gguf_get_n_tensors(ctx_gguf); i++) {
+        // without mmap, the tensors that are uploaded go through two staging buffers (pinned when possible):
+        // the next tensor is read into one while the current one is uploaded from the other
+        std::unique_ptr<void, void (*)(void *)> staging_host(nullptr, llama_host_free);
+        std::vector<uint8_t> staging_heap;
+        uint8_t * staging[2] = { NULL, NULL };
+        if (size_stag > 0) {
+            staging_host.reset(llama_host_malloc(2*size_stag));
+            if (staging_host == nullptr) {
+                staging_heap.resize(2*size_stag);
+            }
+            staging[0] = staging_host ? (uint8_t *) staging_host.get() : staging_heap.data();
+            staging[1] = staging[0] + size_stag;
+        }
+
+        int n_staged = 0;
+        auto start_load = [&](int i) {
             struct ggml_tensor * cur = ggml_get_tensor(ctx, gguf_get_tensor_name(ctx_gguf, i));
             GGML_ASSERT(cur); // unused tensors should have been caught by load_data already
 
+            if (use_mmap) {
+                load_data_for(cur);
+                return std::future<void>();
+            }
+            if (cur->data == NULL) {
+                GGML_ASSERT(cur->backend != GGML_BACKEND_CPU);
+                cur->data = staging[n_staged++ % 2];
+            }
+            return std::async(std::launch::async, [this, cur]() { load_data_for(cur); });
+        };
+
+        const int n_tensors_data = gguf_get_n_tensors(ctx_gguf);
+
+        std::future<void> next_load = n_tensors_data > 0 ? start_load(0) : std::future<void>();
+
+        size_t done_size = 0;
+        int n_repacked = 0;
+        for (int i = 0; i < n_tensors_data; i++) {
+            struct ggml_tensor * cur = ggml_get_tensor(ctx, gguf_get_tensor_name(ctx_gguf, i));
+
             if (progress_callback) {
                 progress_callback((float) done_size / size_data, progress_callback_user_data);
             }
 
-            // allocate temp buffer if not using mmap
-            if (!use_mmap && cur->data == NULL) {
-                GGML_ASSERT(cur->backend != GGML_BACKEND_CPU);
-                #ifdef GGML_USE_CPU_HBM
-                cur->data = (uint8_t*)hbw_malloc(ggml_nbytes(cur));
-                #else
-                cur->data = (uint8_t*)malloc(ggml_nbytes(cur));
-                #endif
+            if (next_load.valid()) {
+                next_load.get();
+            }
+            if (i + 1 < n_tensors_data) {
+                next_load = start_load(i + 1);
             }
-
-            load_data_for(cur);
 
             switch (cur->backend) {
                 case GGML_BACKEND_CPU:
@@ -2346,6 +3215,12 @@ struct llama_model_loader {
                         size_lock += ggml_nbytes(cur);
                         lmlock->grow_to(size_lock);
                     }
+                    // the repacked tensors can only be multiplied, so token_embd (used by get_rows) is left as it is
+                    if (repack && (strncmp(cur->name, "blk.", 4) == 0 || strcmp(cur->name, "output.weight") == 0)) {
+                        n_repacked += ggml_repack(cur);
+                    }
+                    // the mapped pages that are not resident yet are faulted in by the threads of their node
+                    ggml_numa_place(cur);
                     break;
 #ifdef GGML_USE_CUBLAS
                 case GGML_BACKEND_GPU:
@@ -2355,16 +3230,12 @@ struct llama_model_loader {
 
                     // TODO: test if this works !!
                     ggml_cuda_transform_tensor(cur->data, cur);
-                    if (!use_mmap) {
-                        free(cur->data);
-                    }
+                    release_data_for(cur, lmlock);
                     break;
 #elif defined(GGML_USE_CLBLAST)
                 case GGML_BACKEND_GPU:
                     ggml_cl_transform_tensor(cur->data, cur);
-                    if (!use_mmap) {
-                        free(cur->data);
-                    }
+                    release_data_for(cur, lmlock);
                     break;
 #endif
                 default:
@@ -2373,6 +3244,10 @@ struct llama_model_loader {
 
             done_size += ggml_nbytes(cur);
         }
+
+        if (repack) {
+            LLAMA_LOG_INFO("%s: repacked %d tensors\n", __func__, n_repacked);
+        }
     }
 };
 
@@ -2642,10 +3517,265 @@ static void llm_load_hparams(
 // TODO: This should probably be in llama.h
 static std::vector<llama_vocab::id> llama_tokenize_internal(const llama_vocab & vocab, std::string raw_text, bool bos, bool special = false);
 static llama_token llama_byte_to_token(const llama_vocab & vocab, uint8_t ch);
+static std::string llama_decode_piece(const llama_vocab & vocab, llama_vocab::id id);
+
+//
+// tokenizer index cache
+//
+
+// the indices that llm_load_vocab builds from the texts of the tokens and merges, stored as the flat arrays they are
+// made of: on the next loads, the file is mapped and the arrays are copied from it instead of being built again
+// the key of the file is the hash of everything the indices are built from, a file of another vocab is not used
+// and is replaced; a file written on a platform of another byte order has another magic
+
+#define LLAMA_VOCAB_CACHE_MAGIC   0x43564c4cu // 'LLVC'
+#define LLAMA_VOCAB_CACHE_VERSION 1
+
+struct llama_vocab_cache_header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t key;
+    uint32_t n_vocab;
+    uint32_t n_merges;
+    uint32_t size_trie_node;
+    uint32_t n_special;
+};
+
+static uint64_t llama_vocab_cache_key(const llama_vocab & vocab) {
+    const uint32_t header[3] = { (uint32_t) vocab.type, (uint32_t) vocab.id_to_token.size(), (uint32_t) vocab.n_merges() };
+
+    uint64_t key = llama_hash_bytes(header, sizeof(header));
+    for (const auto & token_data : vocab.id_to_token) {
+        const uint32_t len = token_data.text.size();
+        key = llama_hash_bytes(&len, sizeof(len), key);
+        key = llama_hash_bytes(token_data.text.data(), len, key);
+        key = llama_hash_bytes(&token_data.type, sizeof(token_data.type), key);
+    }
+    key = llama_hash_bytes(vocab.merge_data.data(), vocab.merge_data.size(), key);
+
+    return key;
+}
+
+// arrays are stored as their size in bytes followed by their data, padded to 8 bytes
+struct llama_vocab_cache_reader {
+    const uint8_t * data;
+    size_t          size;
+    size_t          offs;
+
+    template <typename T>
+    bool read(std::vector<T> & out) {
+        uint64_t n_bytes;
+        if (offs + sizeof(n_bytes) > size) {
+            return false;
+        }
+        memcpy(&n_bytes, data + offs, sizeof(n_bytes));
+        offs += sizeof(n_bytes);
+        if (n_bytes % sizeof(T) != 0 || n_bytes > size - offs) {
+            return false;
+        }
+        out.resize(n_bytes / sizeof(T));
+        if (n_bytes > 0) {
+            memcpy(out.data(), data + offs, n_bytes);
+        }
+        offs += GGML_PAD(n_bytes, 8);
+        return true;
+    }
+};
+
+template <typename T>
+static void llama_vocab_cache_write(llama_file & file, const std::vector<T> & v) {
+    static const uint8_t zeros[8] = {};
 
+    const uint64_t n_bytes = v.size()*sizeof(T);
+    file.write_raw(&n_bytes, sizeof(n_bytes));
+    file.write_raw(v.data(), n_bytes);
+    file.write_raw(zeros, GGML_PAD(n_bytes, 8) - n_bytes);
+}
+
+// the arrays are checked to be consistent with each other, so that a damaged file is not used
+static bool llama_vocab_cache_read(llama_vocab & vocab, const uint8_t * data, size_t size, uint64_t key) {
+    llama_vocab_cache_header header;
+    if (size < sizeof(header)) {
+        return false;
+    }
+    memcpy(&header, data, sizeof(header));
+
+    const uint32_t n_vocab  = vocab.id_to_token.size();
+    const uint32_t n_merges = vocab.n_merges();
+
+    if (header.magic != LLAMA_VOCAB_CACHE_MAGIC || header.version != LLAMA_VOCAB_CACHE_VERSION || header.key != key ||
+        header.n_vocab != n_vocab || header.n_merges != n_merges || header.size_trie_node != sizeof(llama_token_trie::node)) {
+        return false;
+    }
+
+    llama_vocab_cache_reader reader = { data, size, GGML_PAD(sizeof(header), 8) };
+
+    std::vector<int32_t> special;
+    auto & trie = vocab.trie;
+
+    if (!reader.read(vocab.token_to_id.slots) ||
+        !reader.read(vocab.merge_ranks.slots) ||
+        !reader.read(vocab.bpe_merges)        ||
+        !reader.read(special)                 ||
+        !reader.read(vocab.piece_data)        ||
+        !reader.read(vocab.piece_offs)        ||
+        !reader.read(trie.nodes)              ||
+        !reader.read(trie.tokens)             ||
+        !reader.read(trie.token_node)) {
+        return false;
+    }
+
+    auto is_pow2 = [](size_t n) { return n > 0 && (n & (n - 1)) == 0; };
+
+    bool ok = is_pow2(vocab.token_to_id.slots.size()) && vocab.token_to_id.slots.size() >= 2*(size_t) n_vocab &&
+              is_pow2(vocab.merge_ranks.slots.size()) && vocab.merge_ranks.slots.size() >= 2*(size_t) n_merges &&
+              (vocab.bpe_merges.empty() || is_pow2(vocab.bpe_merges.size())) &&
+              special.size() == header.n_special &&
+              vocab.piece_offs.size() == (size_t) n_vocab + 1 && vocab.piece_offs[0] == 0 && vocab.piece_offs.back() == vocab.piece_data.size() &&
+              !trie.nodes.empty() && trie.token_node.size() == n_vocab && trie.tokens.size() <= n_vocab;
+
+    // the lookups probe until an empty slot, so the tables must keep the empty slots they were built with
+    size_t n_used = 0;
+    for (size_t i = 0; ok && i < vocab.token_to_id.slots.size(); ++i) {
+        ok = vocab.token_to_id.slots[i] <= n_vocab;
+        n_used += vocab.token_to_id.slots[i] != 0;
+    }
+    ok = ok && n_used <= n_vocab;
+    n_used = 0;
+    for (size_t i = 0; ok && i < vocab.merge_ranks.slots.size(); ++i) {
+        ok = vocab.merge_ranks.slots[i] <= n_merges;
+        n_used += vocab.merge_ranks.slots[i] != 0;
+    }
+    ok = ok && n_used <= n_merges;
+    n_used = 0;
+    for (size_t i = 0; ok && i < vocab.bpe_merges.size(); ++i) {
+        const auto & merge = vocab.bpe_merges[i];
+        ok = merge.pair == llama_vocab::BPE_PAIR_NONE ||
+             (merge.pair >> 32 < n_vocab && (merge.pair & 0xFFFFFFFF) < n_vocab && merge.rank >= 0 && (uint32_t) merge.rank < n_merges &&
+              merge.merged >= -1 && merge.merged < (int32_t) n_vocab);
+        n_used += merge.pair != llama_vocab::BPE_PAIR_NONE;
+    }
+    ok = ok && n_used <= vocab.bpe_merges.size()/2;
+    for (size_t i = 0; ok && i < special.size(); ++i) {
+        ok = special[i] >= 0 && special[i] < (int32_t) n_vocab;
+    }
+    for (size_t i = 0; ok && i < n_vocab; ++i) {
+        ok = vocab.piece_offs[i] < vocab.piece_offs[i + 1] && vocab.piece_data[vocab.piece_offs[i + 1] - 1] == 0 &&
+             trie.token_node[i] < trie.nodes.size();
+    }
+    // the parents come before their children, so that the walks up and down the trie end
+    for (size_t i = 0; ok && i < trie.nodes.size(); ++i) {
+        const auto & node = trie.nodes[i];
+        ok = (i == 0 ? node.parent == 0 : node.parent < i) &&
+             node.child_begin <= node.child_end && node.child_end <= trie.nodes.size() && (node.child_begin > i || node.child_begin == node.child_end) &&
+             node.tok_begin <= node.tok_end && node.tok_end <= node.sub_end && node.sub_end <= trie.tokens.size();
+    }
+    for (size_t i = 0; ok && i < trie.tokens.size(); ++i) {
+        ok = trie.tokens[i] >= 0 && trie.tokens[i] < (int32_t) n_vocab;
+    }
+
+    if (!ok) {
+        return false;
+    }
+
+    vocab.special_tokens_cache.clear();
+    for (int32_t id : special) {
+        vocab.special_tokens_cache[vocab.id_to_token[id].text] = id;
+    }
+
+    return true;
+}
+
+static bool llama_vocab_cache_load(llama_vocab & vocab, const std::string & fname, uint64_t key) {
+    bool ok = false;
+    try {
+        llama_file file(fname.c_str(), "rb");
+        if (llama_mmap::SUPPORTED) {
+            llama_mmap mapping(&file);
+            ok = llama_vocab_cache_read(vocab, (const uint8_t *) mapping.addr, mapping.size, key);
+        } else {
+            std::vector<uint8_t> buf(file.size);
+            file.read_raw(buf.data(), buf.size());
+            ok = llama_vocab_cache_read(vocab, buf.data(), buf.size(), key);
+        }
+    } catch (const std::exception &) {
+        LLAMA_LOG_INFO("%s: no tokenizer index in '%s', building it\n", __func__, fname.c_str());
+        return false;
+    }
+
+    if (!ok) {
+        LLAMA_LOG_WARN("%s: the tokenizer index in '%s' is not the one of this vocab, building it again\n", __func__, fname.c_str());
+        vocab.token_to_id.slots.clear();
+        vocab.merge_ranks.slots.clear();
+        vocab.bpe_merges.clear();
+        vocab.piece_data.clear();
+        vocab.piece_offs.clear();
+        vocab.trie = llama_token_trie();
+        return false;
+    }
+
+    LLAMA_LOG_INFO("%s: loaded the tokenizer index from '%s'\n", __func__, fname.c_str());
+
+    return true;
+}
+
+// written to a temporary file that is renamed, so that another process never reads a partial file
+static void llama_vocab_cache_save(const llama_vocab & vocab, const std::string & fname, uint64_t key) {
+    std::vector<int32_t> special;
+    for (const auto & t : vocab.special_tokens_cache) {
+        special.push_back(t.second);
+    }
+    std::sort(special.begin(), special.end());
+
+    llama_vocab_cache_header header = {
+        LLAMA_VOCAB_CACHE_MAGIC, LLAMA_VOCAB_CACHE_VERSION, key,
+        (uint32_t) vocab.id_to_token.size(), (uint32_t) vocab.n_merges(),
+        (uint32_t) sizeof(llama_token_trie::node), (uint32_t) special.size(),
+    };
+
+    const std::string fname_tmp = fname + ".tmp" + std::to_string(ggml_time_us());
+    try {
+        {
+            llama_file file(fname_tmp.c_str(), "wb");
+
+            static const uint8_t zeros[8] = {};
+            file.write_raw(&header, sizeof(header));
+            file.write_raw(zeros, GGML_PAD(sizeof(header), 8) - sizeof(header));
+
+            llama_vocab_cache_write(file, vocab.token_to_id.slots);
+            llama_vocab_cache_write(file, vocab.merge_ranks.slots);
+            llama_vocab_cache_write(file, vocab.bpe_merges);
+            llama_vocab_cache_write(file, special);
+            llama_vocab_cache_write(file, vocab.piece_data);
+            llama_vocab_cache_write(file, vocab.piece_offs);
+            llama_vocab_cache_write(file, vocab.trie.nodes);
+            llama_vocab_cache_write(file, vocab.trie.tokens);
+            llama_vocab_cache_write(file, vocab.trie.token_node);
+
+            if (std::fflush(file.fp) != 0) {
+                throw std::runtime_error(format("write error: %s", strerror(errno)));
+            }
+        }
+#ifdef _WIN32
+        std::remove(fname.c_str());
+#endif
+        if (std::rename(fname_tmp.c_str(), fname.c_str()) != 0) {
+            throw std::runtime_error(format("failed to rename '%s': %s", fname_tmp.c_str(), strerror(errno)));
+        }
+    } catch (const std::exception & err) {
+        LLAMA_LOG_WARN("%s: failed to write the tokenizer index to '%s': %s\n", __func__, fname.c_str(), err.what());
+        std::remove(fname_tmp.c_str());
+        return;
+    }
+
+    LLAMA_LOG_INFO("%s: wrote the tokenizer index to '%s'\n", __func__, fname.c_str());
+}
+
+// with a file name, the tokenizer index is taken from this file or written to it, see llama_vocab_cache_load
 static void llm_load_vocab(
         llama_model_loader & ml,
-        llama_model & model) {
+        llama_model & model,
+        const std::string & fname_cache) {
     auto & vocab = model.vocab;
 
     struct gguf_context * ctx = ml.ctx_gguf;
@@ -2695,22 +3825,18 @@ static void llm_load_vocab(
 
             const int n_merges = gguf_get_arr_n(ctx, merges_keyidx);
 
+            // the merges are looked up by their text, so they do not need to be split
+            vocab.merge_offs.resize(n_merges + 1);
             for (int i = 0; i < n_merges; i++) {
-                const std::string word = gguf_get_arr_str(ctx, merges_keyidx, i);
-                GGML_ASSERT(codepoints_from_utf8(word).size() > 0);
-
-                std::string first;
-                std::string second;
-
-                const size_t pos = word.find(' ', 1);
-
-                if (pos != std::string::npos) {
-                    first  = word.substr(0, pos);
-                    second = word.substr(pos + 1);
-                }
+                size_t n;
+                const char * str = gguf_get_arr_str_view(ctx, merges_keyidx, i, &n);
+                GGML_ASSERT(n > 0);
 
-                vocab.bpe_ranks.emplace(std::make_pair(first, second), i);
+                vocab.merge_offs[i] = vocab.merge_data.size();
+                vocab.merge_data.insert(vocab.merge_data.end(), str, str + n);
+                vocab.merge_data.push_back(0);
             }
+            vocab.merge_offs[n_merges] = vocab.merge_data.size();
 
             // default special tokens
             vocab.special_bos_id = 11;
@@ -2731,17 +3857,78 @@ static void llm_load_vocab(
     vocab.id_to_token.resize(n_vocab);
 
     for (uint32_t i = 0; i < n_vocab; i++) {
-        std::string word = gguf_get_arr_str(ctx, token_idx, i);
-        GGML_ASSERT(codepoints_from_utf8(word).size() > 0);
-
-        vocab.token_to_id[word] = i;
+        size_t n;
+        const char * str = gguf_get_arr_str_view(ctx, token_idx, i, &n);
 
         auto & token_data = vocab.id_to_token[i];
-        token_data.text  = std::move(word);
+        token_data.text.assign(str, n);
         token_data.score = scores ? scores[i] : 0.0f;
         token_data.type  = toktypes ? (llama_token_type) toktypes[i] : LLAMA_TOKEN_TYPE_NORMAL;
     }
-    GGML_ASSERT(vocab.id_to_token.size() == vocab.token_to_id.size());
+
+    // the indices built from the texts of the tokens and merges are taken from the cache when it was built from the
+    // same ones, otherwise they are built and the cache is written
+    uint64_t cache_key = 0;
+    bool     cached    = false;
+    if (!fname_cache.empty()) {
+        cache_key = llama_vocab_cache_key(vocab);
+        cached    = llama_vocab_cache_load(vocab, fname_cache, cache_key);
+    }
+
+    if (!cached) {
+        vocab.token_to_id.init(n_vocab);
+        for (uint32_t i = 0; i < n_vocab; i++) {
+            const std::string & word = vocab.id_to_token[i].text;
+            GGML_ASSERT(codepoints_from_utf8(word).size() > 0);
+            GGML_ASSERT(vocab.find_token(word) < 0 && "duplicate token in vocab");
+            vocab.token_to_id.insert(llama_hash_bytes(word.data(), word.size()), i);
+        }
+
+        // the first of the merges of the same text has the rank
+        const size_t n_merges = vocab.n_merges();
+        vocab.merge_ranks.init(n_merges);
+        for (size_t i = 0; i < n_merges; i++) {
+            const char * text = vocab.merge_data.data() + vocab.merge_offs[i];
+            const size_t len  = vocab.merge_offs[i + 1] - vocab.merge_offs[i] - 1;
+            if (vocab.find_merge(text, len) < 0) {
+                vocab.merge_ranks.insert(llama_hash_bytes(text, len), i);
+            }
+        }
+
+        // the merges of two tokens, for the tokenizer to merge by ids
+        if (vocab.type == LLAMA_VOCAB_TYPE_BPE) {
+            size_t size = 16;
+            while (size < 2*n_merges) {
+                size *= 2;
+            }
+            vocab.bpe_merges.assign(size, { llama_vocab::BPE_PAIR_NONE, -1, -1 });
+
+            std::string merged;
+            for (size_t i = 0; i < n_merges; i++) {
+                const char * text = vocab.merge_data.data() + vocab.merge_offs[i];
+                const size_t len  = vocab.merge_offs[i + 1] - vocab.merge_offs[i] - 1;
+                const char * sep  = (const char *) memchr(text + 1, ' ', len - 1);
+                if (sep == nullptr) {
+                    continue;
+                }
+                const llama_vocab::id left  = vocab.find_token(text, sep - text);
+                const llama_vocab::id right = vocab.find_token(sep + 1, text + len - sep - 1);
+                if (left < 0 || right < 0 || vocab.find_bpe_merge(left, right) != nullptr) {
+                    continue;
+                }
+                merged.assign(text, sep - text);
+                merged.append(sep + 1, text + len - sep - 1);
+
+                const uint64_t pair = llama_vocab::bpe_pair(left, right);
+                const size_t   mask = size - 1;
+                size_t j = llama_vocab::bpe_pair_hash(pair) & mask;
+                while (vocab.bpe_merges[j].pair != llama_vocab::BPE_PAIR_NONE) {
+                    j = (j + 1) & mask;
+                }
+                vocab.bpe_merges[j] = { pair, (int32_t) i, vocab.find_token(merged) };
+            }
+        }
+    }
 
     // determine the newline token: LLaMA "<0x0A>" == 10 == '\n', Falcon 193 == '\n'
     if (vocab.type == LLAMA_VOCAB_TYPE_SPM) {
@@ -2804,71 +3991,76 @@ static void llm_load_vocab(
         // Counting special tokens and verifying in only one direction
         //  is sufficient to detect difference in those two sets.
         //
-        uint32_t special_tokens_count_by_type = 0;
-        uint32_t special_tokens_count_from_verification = 0;
-
-        bool special_tokens_definition_mismatch = false;
-
-        for (const auto & t : vocab.token_to_id) {
-            const auto & token = t.first;
-            const auto & id    = t.second;
-
-            // Count all non-normal tokens in the vocab while iterating
-            if (vocab.id_to_token[id].type != LLAMA_TOKEN_TYPE_NORMAL) {
-                special_tokens_count_by_type++;
-            }
-
-            // Skip single character tokens
-            if (token.length() > 1) {
-                bool is_tokenizable = false;
+        if (!cached) {
+            // reused for the halves of the tokens, to not allocate them for every split
+            std::string left;
+            std::string right;
+
+            for (llama_vocab::id id = 0; id < (llama_vocab::id) vocab.id_to_token.size(); ++id) {
+                const auto & token = vocab.id_to_token[id].text;
+
+                // Skip single character tokens
+                if (token.length() > 1) {
+                    bool is_tokenizable = false;
+
+                    // Split token string representation in two, in all possible ways
+                    //  and check if both halves can be matched to a valid token
+                    for (unsigned i = 1; i < token.length();) {
+                        // check if we didnt partition in the middle of a utf sequence
+                        auto utf = utf8_len(token[i - 1]);
+
+                        if (utf == 1) {
+                            left.assign(token, 0, i);
+                            right.assign(token, i, std::string::npos);
+                            if (vocab.find_token(left)  >= 0 &&
+                                vocab.find_token(right) >= 0) {
+                                is_tokenizable = true;
+                                break;
+                            }
+                            i++;
+                        } else {
+                            // skip over the rest of multibyte utf sequence
+                            i += utf - 1;
+                        }
+                    }
 
-                // Split token string representation in two, in all possible ways
-                //  and check if both halves can be matched to a valid token
-                for (unsigned i = 1; i < token.length();) {
-                    const auto left  = token.substr(0, i);
-                    const auto right = token.substr(i);
+                    if (!is_tokenizable) {
+                        // Some tokens are multibyte, but they are utf sequences with equivalent text length of 1
+                        //  it's faster to re-filter them here, since there are way less candidates now
 
-                    // check if we didnt partition in the middle of a utf sequence
-                    auto utf = utf8_len(left.at(left.length() - 1));
+                        // Calculate a total "utf" length of a token string representation
+                        size_t utf8_str_len = 0;
+                        for (unsigned i = 0; i < token.length();) {
+                            utf8_str_len++;
+                            i += utf8_len(token.at(i));
+                        }
 
-                    if (utf == 1) {
-                        if (vocab.token_to_id.find(left)  != vocab.token_to_id.end() &&
-                            vocab.token_to_id.find(right) != vocab.token_to_id.end() ) {
-                            is_tokenizable = true;
-                            break;
+                        // And skip the ones which are one character
+                        if (utf8_str_len > 1) {
+                            // At this point what we have left are special tokens only
+                            vocab.special_tokens_cache[token] = id;
                         }
-                        i++;
-                    } else {
-                        // skip over the rest of multibyte utf sequence
-                        i += utf - 1;
                     }
                 }
+            }
+        }
 
-                if (!is_tokenizable) {
-                    // Some tokens are multibyte, but they are utf sequences with equivalent text length of 1
-                    //  it's faster to re-filter them here, since there are way less candidates now
-
-                    // Calculate a total "utf" length of a token string representation
-                    size_t utf8_str_len = 0;
-                    for (unsigned i = 0; i < token.length();) {
-                        utf8_str_len++;
-                        i += utf8_len(token.at(i));
-                    }
-
-                    // And skip the ones which are one character
-                    if (utf8_str_len > 1) {
-                        // At this point what we have left are special tokens only
-                        vocab.special_tokens_cache[token] = id;
+        // Count all non-normal tokens in the vocab
+        uint32_t special_tokens_count_by_type = 0;
+        for (const auto & token_data : vocab.id_to_token) {
+            if (token_data.type != LLAMA_TOKEN_TYPE_NORMAL) {
+                special_tokens_count_by_type++;
+            }
+        }
 
-                        // Count manually found special tokens
-                        special_tokens_count_from_verification++;
+        // Count manually found special tokens
+        const uint32_t special_tokens_count_from_verification = vocab.special_tokens_cache.size();
 
-                        // If this manually found special token is not marked as such, flag a mismatch
-                        if (vocab.id_to_token[id].type == LLAMA_TOKEN_TYPE_NORMAL) {
-                            special_tokens_definition_mismatch = true;
-                        }
-                    }
-                }
+        // If a manually found special token is not marked as such, flag a mismatch
+        bool special_tokens_definition_mismatch = false;
+        for (const auto & t : vocab.special_tokens_cache) {
+            if (vocab.id_to_token[t.second].type == LLAMA_TOKEN_TYPE_NORMAL) {
+                special_tokens_definition_mismatch = true;
             }
         }
 
@@ -2884,6 +4076,34 @@ static void llm_load_vocab(
                 special_tokens_count_from_verification, vocab.id_to_token.size()
             );
         }
+
+        vocab.special_tokens_matcher.build(vocab.special_tokens_cache);
+    }
+
+    // decode the pieces of the tokens once, and build their prefix trie used to apply grammars
+    if (!cached) {
+        std::vector<std::string> pieces(vocab.id_to_token.size());
+        size_t n_bytes = 0;
+        for (llama_vocab::id id = 0; id < (llama_vocab::id) pieces.size(); ++id) {
+            pieces[id] = llama_decode_piece(vocab, id);
+            n_bytes += pieces[id].size() + 1;
+        }
+
+        vocab.piece_data.clear();
+        vocab.piece_data.reserve(n_bytes);
+        vocab.piece_offs.resize(pieces.size() + 1);
+        for (size_t id = 0; id < pieces.size(); ++id) {
+            vocab.piece_offs[id] = vocab.piece_data.size();
+            vocab.piece_data.insert(vocab.piece_data.end(), pieces[id].begin(), pieces[id].end());
+            vocab.piece_data.push_back(0);
+        }
+        vocab.piece_offs[pieces.size()] = vocab.piece_data.size();
+
+        vocab.trie.build(pieces);
+    }
+
+    if (!fname_cache.empty() && !cached) {
+        llama_vocab_cache_save(vocab, fname_cache, cache_key);
     }
 }
 
@@ -2898,7 +4118,7 @@ static void llm_load_print_meta(llama_model_loader & ml, llama_model & model) {
     LLAMA_LOG_INFO("%s: arch             = %s\n",     __func__, LLM_ARCH_NAMES.at(model.arch).c_str());
     LLAMA_LOG_INFO("%s: vocab type       = %s\n",     __func__, vocab.type == LLAMA_VOCAB_TYPE_SPM ? "SPM" : "BPE"); // TODO: fix
     LLAMA_LOG_INFO("%s: n_vocab          = %u\n",     __func__, hparams.n_vocab);
-    LLAMA_LOG_INFO("%s: n_merges         = %u\n",     __func__, (int) vocab.bpe_ranks.size());
+    LLAMA_LOG_INFO("%s: n_merges         = %u\n",     __func__, (int) vocab.n_merges());
     LLAMA_LOG_INFO("%s: n_ctx_train      = %u\n",     __func__, hparams.n_ctx_train);
     LLAMA_LOG_INFO("%s: n_embd           = %u\n",     __func__, hparams.n_embd);
     LLAMA_LOG_INFO("%s: n_head           = %u\n",     __func__, hparams.n_head);
@@ -3673,6 +4893,11 @@ static void llm_load_tensors(
         model.tensors_by_name.emplace_back(ggml_get_name(cur), cur);
     }
 
+    if (model.dry_run) {
+        llama_plan_set_data(ctx);
+        return;
+    }
+
     (void) tensor_split;
 #ifdef GGML_USE_CUBLAS
     {
@@ -3695,13 +4920,26 @@ static void llm_load_tensors(
 
 static bool llama_model_load(const std::string & fname, llama_model & model, const llama_model_params & params) {
     try {
-        llama_model_loader ml(fname, params.use_mmap, params.kv_overrides);
+        bool repack = params.repack;
+#if defined(GGML_USE_CUBLAS) || defined(GGML_USE_CLBLAST) || defined(GGML_USE_METAL)
+        if (repack) {
+            LLAMA_LOG_WARN("%s: the repacked weights are only supported by the CPU backend, not repacking\n", __func__);
+            repack = false;
+        }
+#endif
+        if (repack && params.use_mmap) {
+            LLAMA_LOG_INFO("%s: repacking the weights in place, disabling mmap\n", __func__);
+        }
+
+        llama_model_loader ml(fname, params.use_mmap && !repack, params.kv_overrides);
+        ml.repack        = repack;
+        ml.use_hugepages = params.use_hugepages;
 
         model.hparams.vocab_only = params.vocab_only;
 
         llm_load_arch   (ml, model);
         llm_load_hparams(ml, model);
-        llm_load_vocab  (ml, model);
+        llm_load_vocab  (ml, model, params.vocab_cache ? fname + ".vocab-cache" : std::string());
 
         llm_load_print_meta(ml, model);
 
@@ -3732,6 +4970,16 @@ static bool llama_model_load(const std::string & fname, llama_model & model, con
 
 using llm_build_cb = std::function<void(struct ggml_tensor * cur, const char * name, int nl)>;
 
+// rms_norm*weight, silu(gate)*up and the attention are computed by fused ops, and the sin/cos of rope by a cache shared
+// by the layers, these ops have kernels for the CPU and CUDA only
+#if defined(GGML_USE_METAL) || defined(GGML_USE_CLBLAST)
+static const bool llm_fused_ops  = false;
+static const bool llm_rope_cache = false;
+#else
+static const bool llm_fused_ops  = true;
+static const bool llm_rope_cache = true;
+#endif
+
 enum llm_rope_type {
     LLM_ROPE,
     LLM_ROPE_NEOX,
@@ -3781,7 +5029,30 @@ static struct ggml_tensor * llm_build_inp_embd(
     return inpL;
 }
 
-// Persimmon: n_rot = n_embd_head/2
+// sin and cos of the rope angles of pos, computed once per graph instead of by every rope node that uses them
+// returns NULL when the backend has no kernel for it, the rope nodes then compute the angles
+static struct ggml_tensor * llm_build_rope_cache(
+      struct ggml_context * ctx,
+      const llama_cparams & cparams,
+       struct ggml_tensor * pos,
+                      int   n_dims,
+                      int   mode,
+                    float   freq_base,
+                    float   freq_scale,
+       const llm_build_cb & cb,
+               const char * name) {
+    if (!llm_rope_cache) {
+        return nullptr;
+    }
+
+    struct ggml_tensor * cache = ggml_rope_cache(ctx, pos, n_dims, mode, cparams.n_yarn_orig_ctx, freq_base, freq_scale,
+            cparams.yarn_ext_factor, cparams.yarn_attn_factor, cparams.yarn_beta_fast, cparams.yarn_beta_slow);
+    cb(cache, name, -1);
+
+    return cache;
+}
+
+// Persimmon: n_rot = n_embd_head/2
 // Other:     n_rot = n_embd_head
 static void llm_build_k_shift(
       struct ggml_context * ctx,
@@ -3790,7 +5061,8 @@ static void llm_build_k_shift(
      const llama_kv_cache & kv,
        struct ggml_cgraph * graph,
             llm_rope_type   type,
-                  int64_t   n_ctx,
+                  int32_t   shift_base,
+                  int64_t   n_shift,
                   int       n_rot,
                   float     freq_base,
                   float     freq_scale,
@@ -3807,7 +5079,8 @@ static void llm_build_k_shift(
 
     GGML_ASSERT(n_embd_head % n_rot == 0);
 
-    struct ggml_tensor * K_shift = ggml_new_tensor_1d(ctx, GGML_TYPE_I32, n_ctx);
+    // only the cells [shift_base, shift_base + n_shift) are rotated, K_shift holds their deltas
+    struct ggml_tensor * K_shift = ggml_new_tensor_1d(ctx, GGML_TYPE_I32, n_shift);
     cb(K_shift, "K_shift", -1);
 
     int rope_type = 0;
@@ -3818,16 +5091,41 @@ static void llm_build_k_shift(
         case LLM_ROPE_GLM:  rope_type = 4; break;
     }
 
+    // the cache covers the heads that are rotated entirely
+    struct ggml_tensor * K_shift_cache = n_rot == n_embd_head ?
+        llm_build_rope_cache(ctx, cparams, K_shift, n_rot, rope_type, freq_base, freq_scale, cb, "K_shift_cache") : nullptr;
+
     for (int il = 0; il < n_layer; ++il) {
+        const size_t k_row_size = ggml_row_size(kv.k_l[il]->type, n_embd_gqa);
+
+        if (ggml_is_quantized(kv.k_l[il]->type)) {
+            // rope does not support quantized types: dequantize, rotate and quantize the cells again
+            struct ggml_tensor * k =
+                ggml_get_rows(ctx,
+                        ggml_view_2d(ctx, kv.k_l[il], n_embd_gqa, n_shift, k_row_size, k_row_size*shift_base),
+                        ggml_view_1d(ctx, kv.cell_ids, n_shift, 0));
+            cb(k, "K_shift_rows", il);
+
+            struct ggml_tensor * tmp =
+                ggml_rope_custom_cached(ctx,
+                        ggml_reshape_3d(ctx, k, n_embd_head, n_head_kv, n_shift),
+                        K_shift, K_shift_cache, n_rot, rope_type, 0, n_orig_ctx, freq_base, freq_scale,
+                        ext_factor, attn_factor, beta_fast, beta_slow);
+            cb(tmp, "K_shifted", il);
+            ggml_build_forward_expand(graph, ggml_cpy(ctx, tmp,
+                        ggml_view_1d(ctx, kv.k_l[il], n_embd_gqa*n_shift, k_row_size*shift_base)));
+            continue;
+        }
+
         struct ggml_tensor * tmp =
             // we rotate only the first n_rot dimensions
-            ggml_rope_custom_inplace(ctx,
+            ggml_rope_custom_cached_inplace(ctx,
                     ggml_view_3d(ctx, kv.k_l[il],
-                        n_embd_head, n_head_kv, n_ctx,
+                        n_embd_head, n_head_kv, n_shift,
                         ggml_row_size(kv.k_l[il]->type, n_embd_head),
-                        ggml_row_size(kv.k_l[il]->type, n_embd_gqa),
-                        0),
-                    K_shift, n_rot, rope_type, 0, n_orig_ctx, freq_base, freq_scale,
+                        k_row_size,
+                        k_row_size*shift_base),
+                    K_shift, K_shift_cache, n_rot, rope_type, 0, n_orig_ctx, freq_base, freq_scale,
                     ext_factor, attn_factor, beta_fast, beta_slow);
         cb(tmp, "K_shifted", il);
         ggml_build_forward_expand(graph, tmp);
@@ -3843,28 +5141,60 @@ static void llm_build_kv_store(
          struct ggml_tensor * v_cur,
                     int64_t   n_ctx,
                     int32_t   n_tokens,
-                    int32_t   kv_head,
+    const std::vector<llama_kv_run> & kv_runs,
          const llm_build_cb & cb,
                     int64_t   il) {
     const int64_t n_embd_gqa = hparams.n_embd_gqa();
 
     // compute the transposed [n_tokens, n_embd] V matrix
-    struct ggml_tensor * v_cur_t = ggml_transpose(ctx, ggml_reshape_2d(ctx, v_cur, n_embd_gqa, n_tokens));
-    //struct ggml_tensor * v_cur_t = ggml_transpose(ctx, v_cur); // TODO: reshape above is likely not needed
-    cb(v_cur_t, "v_cur_t", il);
+    struct ggml_tensor * v_cur_t = nullptr;
+    if (kv.v_trans) {
+        v_cur_t = ggml_transpose(ctx, ggml_reshape_2d(ctx, v_cur, n_embd_gqa, n_tokens));
+        //struct ggml_tensor * v_cur_t = ggml_transpose(ctx, v_cur); // TODO: reshape above is likely not needed
+        cb(v_cur_t, "v_cur_t", il);
+    }
+
+    // one copy per run of consecutive cells, a single one unless the cache is fragmented
+    if (kv_runs.size() > 1) {
+        k_cur = ggml_is_contiguous(k_cur) ? k_cur : ggml_cont(ctx, k_cur);
+        v_cur = ggml_is_contiguous(v_cur) ? v_cur : ggml_cont(ctx, v_cur);
+    }
 
-    struct ggml_tensor * k_cache_view = ggml_view_1d(ctx, kv.k_l[il], n_tokens*n_embd_gqa,
-            (ggml_row_size(kv.k_l[il]->type, n_embd_gqa))*kv_head);
-    cb(k_cache_view, "k_cache_view", il);
+    for (const llama_kv_run & run : kv_runs) {
+        struct ggml_tensor * k_run = k_cur;
+        struct ggml_tensor * v_run = kv.v_trans ? v_cur_t : v_cur;
 
-    struct ggml_tensor * v_cache_view = ggml_view_2d(ctx, kv.v_l[il], n_tokens, n_embd_gqa,
-            (  n_ctx)*ggml_element_size(kv.v_l[il]),
-            (kv_head)*ggml_element_size(kv.v_l[il]));
-    cb(v_cache_view, "v_cache_view", il);
+        if ((int32_t) run.n_tokens != n_tokens) {
+            k_run = ggml_view_2d(ctx, k_cur, n_embd_gqa, run.n_tokens,
+                    ggml_row_size(k_cur->type, n_embd_gqa),
+                    ggml_row_size(k_cur->type, n_embd_gqa)*run.i_token);
+            v_run = ggml_view_2d(ctx, v_cur, n_embd_gqa, run.n_tokens,
+                    ggml_row_size(v_cur->type, n_embd_gqa),
+                    ggml_row_size(v_cur->type, n_embd_gqa)*run.i_token);
+            if (kv.v_trans) {
+                v_run = ggml_transpose(ctx, v_run);
+            }
+        }
+
+        struct ggml_tensor * k_cache_view = ggml_view_1d(ctx, kv.k_l[il], run.n_tokens*n_embd_gqa,
+                (ggml_row_size(kv.k_l[il]->type, n_embd_gqa))*run.cell);
+        cb(k_cache_view, "k_cache_view", il);
+
+        struct ggml_tensor * v_cache_view = nullptr;
+        if (kv.v_trans) {
+            v_cache_view = ggml_view_2d(ctx, kv.v_l[il], run.n_tokens, n_embd_gqa,
+                    (   n_ctx)*ggml_element_size(kv.v_l[il]),
+                    (run.cell)*ggml_element_size(kv.v_l[il]));
+        } else {
+            v_cache_view = ggml_view_1d(ctx, kv.v_l[il], run.n_tokens*n_embd_gqa,
+                    (ggml_row_size(kv.v_l[il]->type, n_embd_gqa))*run.cell);
+        }
+        cb(v_cache_view, "v_cache_view", il);
 
-    // important: storing RoPE-ed version of K in the KV cache!
-    ggml_build_forward_expand(graph, ggml_cpy(ctx, k_cur,   k_cache_view));
-    ggml_build_forward_expand(graph, ggml_cpy(ctx, v_cur_t, v_cache_view));
+        // important: storing RoPE-ed version of K in the KV cache!
+        ggml_build_forward_expand(graph, ggml_cpy(ctx, k_run, k_cache_view));
+        ggml_build_forward_expand(graph, ggml_cpy(ctx, v_run, v_cache_view));
+    }
 }
 
 static struct ggml_tensor * llm_build_norm(
@@ -3876,20 +5206,27 @@ static struct ggml_tensor * llm_build_norm(
               llm_norm_type   type,
          const llm_build_cb & cb,
                         int   il) {
-    switch (type) {
-        case LLM_NORM:     cur = ggml_norm    (ctx, cur, hparams.f_norm_eps);     break;
-        case LLM_NORM_RMS: cur = ggml_rms_norm(ctx, cur, hparams.f_norm_rms_eps); break;
-    }
-
-    if (mw || mb) {
-        cb(cur, "norm", il);
-    }
-
-    if (mw) {
-        cur = ggml_mul(ctx, cur, mw);
+    if (llm_fused_ops && type == LLM_NORM_RMS && mw && mw->ne[0] == cur->ne[0]) {
+        cur = ggml_rms_norm_mul(ctx, cur, mw, hparams.f_norm_rms_eps);
         if (mb) {
             cb(cur, "norm_w", il);
         }
+    } else {
+        switch (type) {
+            case LLM_NORM:     cur = ggml_norm    (ctx, cur, hparams.f_norm_eps);     break;
+            case LLM_NORM_RMS: cur = ggml_rms_norm(ctx, cur, hparams.f_norm_rms_eps); break;
+        }
+
+        if (mw || mb) {
+            cb(cur, "norm", il);
+        }
+
+        if (mw) {
+            cur = ggml_mul(ctx, cur, mw);
+            if (mb) {
+                cb(cur, "norm_w", il);
+            }
+        }
     }
 
     if (mb) {
@@ -3942,11 +5279,16 @@ static struct ggml_tensor * llm_build_ffn(
         cur = tmp;
     }
 
+    const bool fused = llm_fused_ops && gate && type_op == LLM_FFN_SILU && type_gate == LLM_FFN_PAR;
+
     switch (type_op) {
         case LLM_FFN_SILU:
             {
-                cur = ggml_silu(ctx, cur);
-                cb(cur, "ffn_silu", il);
+                // else applied by ggml_swiglu with the gate
+                if (!fused) {
+                    cur = ggml_silu(ctx, cur);
+                    cb(cur, "ffn_silu", il);
+                }
             } break;
         case LLM_FFN_GELU:
             {
@@ -3969,7 +5311,7 @@ static struct ggml_tensor * llm_build_ffn(
     }
 
     if (type_gate == LLM_FFN_PAR) {
-        cur = ggml_mul(ctx, cur, tmp);
+        cur = fused ? ggml_swiglu(ctx, cur, tmp) : ggml_mul(ctx, cur, tmp);
         cb(cur, "ffn_gate_par", il);
     }
 
@@ -3986,6 +5328,23 @@ static struct ggml_tensor * llm_build_ffn(
 }
 
 // if max_alibi_bias > 0 then apply ALiBi
+// softmax(kq)*v is computed by ggml_flash_attn_ext, without storing kq, unless ALiBi is applied to kq
+// the CUDA kernel reads F16 and F32 caches only
+static bool llm_use_flash_attn(const llama_kv_cache & kv, int il, float max_alibi_bias) {
+    if (!llm_fused_ops || max_alibi_bias > 0.0f) {
+        return false;
+    }
+#ifdef GGML_USE_CUBLAS
+    if (ggml_is_quantized(kv.k_l[il]->type) || kv.v_l[il]->type != kv.k_l[il]->type) {
+        return false;
+    }
+#else
+    GGML_UNUSED(kv);
+    GGML_UNUSED(il);
+#endif
+    return true;
+}
+
 static struct ggml_tensor * llm_build_kqv(
         struct ggml_context * ctx,
         const llama_hparams & hparams,
@@ -3997,6 +5356,7 @@ static struct ggml_tensor * llm_build_kqv(
          struct ggml_tensor * kq_mask,
                     int64_t   n_ctx,
                     int32_t   n_tokens,
+                    int32_t   kv_base,
                     int32_t   n_kv,
                     float     max_alibi_bias,
          const llm_build_cb & cb,
@@ -4015,9 +5375,44 @@ static struct ggml_tensor * llm_build_kqv(
                 n_embd_head, n_kv, n_head_kv,
                 ggml_row_size(kv.k_l[il]->type, n_embd_gqa),
                 ggml_row_size(kv.k_l[il]->type, n_embd_head),
-                0);
+                ggml_row_size(kv.k_l[il]->type, n_embd_gqa)*kv_base);
     cb(k, "k", il);
 
+    if (llm_use_flash_attn(kv, il, max_alibi_bias)) {
+        // the cached v as [n_embd_head, n_kv, n_head_kv], the fused op reads it through the strides
+        struct ggml_tensor * v = nullptr;
+        if (kv.v_trans) {
+            v = ggml_transpose(ctx,
+                    ggml_view_3d(ctx, kv.v_l[il],
+                        n_kv, n_embd_head, n_head_kv,
+                        ggml_element_size(kv.v_l[il])*n_ctx,
+                        ggml_element_size(kv.v_l[il])*n_ctx*n_embd_head,
+                        ggml_element_size(kv.v_l[il])*kv_base));
+        } else {
+            v = ggml_view_3d(ctx, kv.v_l[il],
+                    n_embd_head, n_kv, n_head_kv,
+                    ggml_row_size(kv.v_l[il]->type, n_embd_gqa),
+                    ggml_row_size(kv.v_l[il]->type, n_embd_head),
+                    ggml_row_size(kv.v_l[il]->type, n_embd_gqa)*kv_base);
+        }
+        cb(v, "v", il);
+
+        struct ggml_tensor * kqv = ggml_flash_attn_ext(ctx, q, k, v, kq_mask, 1.0f/sqrtf(float(n_embd_head)));
+        cb(kqv, "kqv_flash_attn", il);
+
+        // the result is already [n_embd_head, n_head, n_tokens]
+        struct ggml_tensor * cur = ggml_reshape_2d(ctx, kqv, n_embd, n_tokens);
+        cb(cur, "kqv_merged", il);
+
+        cur = ggml_mul_mat(ctx, wo, cur);
+        if (wo_b) {
+            cb(cur, "kqv_wo", il);
+            cur = ggml_add(ctx, cur, wo_b);
+        }
+
+        return cur;
+    }
+
     struct ggml_tensor * kq = ggml_mul_mat(ctx, k, q);
     cb(kq, "kq", il);
 
@@ -4045,12 +5440,26 @@ static struct ggml_tensor * llm_build_kqv(
     }
 
     // split cached v into n_head heads
-    struct ggml_tensor * v =
-        ggml_view_3d(ctx, kv.v_l[il],
+    struct ggml_tensor * v = nullptr;
+    if (kv.v_trans) {
+        v = ggml_view_3d(ctx, kv.v_l[il],
                 n_kv, n_embd_head, n_head_kv,
                 ggml_element_size(kv.v_l[il])*n_ctx,
                 ggml_element_size(kv.v_l[il])*n_ctx*n_embd_head,
-                0);
+                ggml_element_size(kv.v_l[il])*kv_base);
+    } else {
+        // dequantize the rows of the attended cells and transpose them
+        struct ggml_tensor * v_cell_ids = ggml_view_1d(ctx, kv.cell_ids, n_kv, ggml_element_size(kv.cell_ids)*kv_base);
+        cb(v_cell_ids, "v_cell_ids", il);
+
+        struct ggml_tensor * v_rows =
+            ggml_get_rows(ctx,
+                    ggml_view_2d(ctx, kv.v_l[il], n_embd_gqa, n_ctx, ggml_row_size(kv.v_l[il]->type, n_embd_gqa), 0),
+                    v_cell_ids);
+        cb(v_rows, "v_rows", il);
+
+        v = ggml_cont_3d(ctx, ggml_transpose(ctx, v_rows), n_kv, n_embd_head, n_head_kv);
+    }
     cb(v, "v", il);
 
     struct ggml_tensor * kqv = ggml_mul_mat(ctx, v, kq);
@@ -4101,11 +5510,17 @@ struct llm_build_context {
     const float norm_rms_eps;
 
     const int32_t n_tokens;
+    const int32_t n_outputs; // number of rows of the output, the tokens of lctx.out_ids
     const int32_t n_kv;     // size of KV cache to consider (n_kv <= n_ctx)
-    const int32_t kv_head;  // index of where we store new KV data in the cache
+    const int32_t kv_base;  // first cell of the KV cache to consider
+    const std::vector<llama_kv_run> kv_runs; // where we store new KV data in the cache
     const int32_t n_orig_ctx;
 
-    const bool do_rope_shift;
+    const bool    do_rope_shift;
+    const int32_t shift_base; // first cell with a pending shift
+    const int32_t n_shift;    // number of cells from shift_base that are shifted
+
+    const bool out_rows; // the rows of the outputs are selected before lm_head, not in embedding mode
 
     const llm_build_cb & cb;
 
@@ -4118,6 +5533,7 @@ struct llm_build_context {
         llama_context  & lctx,
     const llama_batch  & batch,
     const llm_build_cb & cb,
+          llama_buffer & buf_compute,
                   bool   worst_case) :
         model         (lctx.model),
         hparams       (model.hparams),
@@ -4142,12 +5558,17 @@ struct llm_build_context {
         norm_eps      (hparams.f_norm_eps),
         norm_rms_eps  (hparams.f_norm_rms_eps),
         n_tokens      (batch.n_tokens),
-        n_kv          (worst_case ? n_ctx            : kv_self.n),
-        kv_head       (worst_case ? n_ctx - n_tokens : kv_self.head),
+        n_outputs     (worst_case ? batch.n_tokens : (int32_t) lctx.out_ids.size()),
+        n_kv          (worst_case ? batch.all_pos_0 + n_tokens : kv_self.n),
+        kv_base       (worst_case ? 0                          : kv_self.base),
+        kv_runs       (worst_case ? std::vector<llama_kv_run>{{ 0, uint32_t(batch.all_pos_0), uint32_t(n_tokens) }} : kv_self.runs),
         n_orig_ctx    (cparams.n_yarn_orig_ctx),
         do_rope_shift (worst_case || kv_self.has_shift),
+        shift_base    (worst_case ? 0    : (do_rope_shift ? kv_self.shift_min : 0)),
+        n_shift       (worst_case ? n_kv : (do_rope_shift ? kv_self.shift_max - kv_self.shift_min : 0)),
+        out_rows      (lctx.embedding.empty()),
         cb            (cb),
-        buf_compute   (lctx.buf_compute) {
+        buf_compute   (buf_compute) {
             GGML_ASSERT(!!kv_self.ctx);
 
             // all initializations should be done in init()
@@ -4170,6 +5591,50 @@ struct llm_build_context {
         }
     }
 
+    // the rows of the final hidden state of the tokens that have an output, so that lm_head is computed for these
+    // only. The rows are selected even when all the tokens have an output: the graphs of a shape must have the same
+    // nodes as the worst case they are allocated with. In embedding mode, result_norm is read back and must not be
+    // freed before the end of the graph
+    struct ggml_tensor * build_out_rows(struct ggml_tensor * cur) {
+        if (!out_rows) {
+            return cur;
+        }
+
+        struct ggml_tensor * ids = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_outputs);
+        cb(ids, "inp_out_ids", -1);
+
+        cur = ggml_get_rows(ctx0, cur, ids);
+        cb(cur, "result_norm_out", -1);
+
+        return cur;
+    }
+
+    // appends to gf the probabilities of the n_top_k most probable tokens of each output, from the logits scaled by
+    // the temperature and biased, so that only result_top_k_ids and result_top_k_probs are read back
+    void build_top_k(struct ggml_cgraph * gf, float temp) {
+        struct ggml_tensor * logits = ggml_graph_get_tensor(gf, "result_output");
+        GGML_ASSERT(logits != nullptr);
+
+        const int64_t n_vocab = logits->ne[0];
+
+        struct ggml_tensor * bias = ggml_new_tensor_1d(ctx0, GGML_TYPE_F32, n_vocab);
+        cb(bias, "top_k_bias", -1);
+
+        struct ggml_tensor * probs = ggml_soft_max_ext(ctx0, logits, bias, temp > 0.0f ? 1.0f/temp : 1.0f);
+        cb(probs, "top_k_probs", -1);
+
+        struct ggml_tensor * ids = ggml_top_k(ctx0, probs, cparams.n_top_k);
+        cb(ids->view_src, "top_k_argsort", -1);
+
+        ids = ggml_cont(ctx0, ids);
+        cb(ids, "result_top_k_ids", -1);
+
+        struct ggml_tensor * top_probs = ggml_get_rows(ctx0, ggml_reshape_3d(ctx0, probs, 1, n_vocab, n_outputs), ids);
+        cb(top_probs, "result_top_k_probs", -1);
+
+        ggml_build_forward_expand(gf, top_probs);
+    }
+
     struct ggml_cgraph * build_llama() {
         struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, LLAMA_MAX_NODES, false);
 
@@ -4185,6 +5650,9 @@ struct llm_build_context {
         struct ggml_tensor * inp_pos = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_tokens);
         cb(inp_pos, "inp_pos", -1);
 
+        // sin and cos of the positions, shared by the rope of Q and K in all layers
+        struct ggml_tensor * rope_cache = llm_build_rope_cache(ctx0, cparams, inp_pos, n_embd_head, 0, freq_base, freq_scale, cb, "rope_cache");
+
         // KQ_scale
         struct ggml_tensor * KQ_scale = ggml_new_tensor_1d(ctx0, GGML_TYPE_F32, 1);
         cb(KQ_scale, "KQ_scale", -1);
@@ -4193,9 +5661,9 @@ struct llm_build_context {
         struct ggml_tensor * KQ_mask = ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, n_kv, n_tokens, 1);
         cb(KQ_mask, "KQ_mask", -1);
 
-        // shift the entire K-cache if needed
+        // shift the cells of the K-cache that moved
         if (do_rope_shift) {
-            llm_build_k_shift(ctx0, hparams, cparams, kv_self, gf, LLM_ROPE, n_ctx, n_embd_head, freq_base, freq_scale, cb);
+            llm_build_k_shift(ctx0, hparams, cparams, kv_self, gf, LLM_ROPE, shift_base, n_shift, n_embd_head, freq_base, freq_scale, cb);
         }
 
         for (int il = 0; il < n_layer; ++il) {
@@ -4231,25 +5699,25 @@ struct llm_build_context {
                     cb(Vcur, "Vcur", il);
                 }
 
-                Qcur = ggml_rope_custom(
-                    ctx0, ggml_reshape_3d(ctx0, Qcur, n_embd_head, n_head,    n_tokens), inp_pos,
+                Qcur = ggml_rope_custom_cached(
+                    ctx0, ggml_reshape_3d(ctx0, Qcur, n_embd_head, n_head,    n_tokens), inp_pos, rope_cache,
                     n_embd_head, 0, 0, n_orig_ctx, freq_base, freq_scale,
                     ext_factor, attn_factor, beta_fast, beta_slow
                 );
                 cb(Qcur, "Qcur", il);
 
-                Kcur = ggml_rope_custom(
-                    ctx0, ggml_reshape_3d(ctx0, Kcur, n_embd_head, n_head_kv, n_tokens), inp_pos,
+                Kcur = ggml_rope_custom_cached(
+                    ctx0, ggml_reshape_3d(ctx0, Kcur, n_embd_head, n_head_kv, n_tokens), inp_pos, rope_cache,
                     n_embd_head, 0, 0, n_orig_ctx, freq_base, freq_scale,
                     ext_factor, attn_factor, beta_fast, beta_slow
                 );
                 cb(Kcur, "Kcur", il);
 
-                llm_build_kv_store(ctx0, hparams, kv_self, gf, Kcur, Vcur, n_ctx, n_tokens, kv_head, cb, il);
+                llm_build_kv_store(ctx0, hparams, kv_self, gf, Kcur, Vcur, n_ctx, n_tokens, kv_runs, cb, il);
 
                 cur = llm_build_kqv(ctx0, hparams, kv_self,
                         model.layers[il].wo, model.layers[il].bo,
-                        Qcur, KQ_scale, KQ_mask, n_ctx, n_tokens, n_kv, -1.0f, cb, il);
+                        Qcur, KQ_scale, KQ_mask, n_ctx, n_tokens, kv_base, n_kv, -1.0f, cb, il);
                 cb(cur, "kqv_out", il);
             }
 
@@ -4348,6 +5816,8 @@ struct llm_build_context {
                 LLM_NORM_RMS, cb, -1);
         cb(cur, "result_norm", -1);
 
+        cur = build_out_rows(cur);
+
         // lm_head
         cur = ggml_mul_mat(ctx0, model.output, cur);
         cb(cur, "result_output", -1);
@@ -4370,6 +5840,9 @@ struct llm_build_context {
         struct ggml_tensor * inp_pos = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_tokens);
         cb(inp_pos, "inp_pos", -1);
 
+        // sin and cos of the positions, shared by the rope of Q and K in all layers
+        struct ggml_tensor * rope_cache = llm_build_rope_cache(ctx0, cparams, inp_pos, n_embd_head, 0, freq_base, freq_scale, cb, "rope_cache");
+
         // KQ_scale
         struct ggml_tensor * KQ_scale = ggml_new_tensor_1d(ctx0, GGML_TYPE_F32, 1);
         cb(KQ_scale, "KQ_scale", -1);
@@ -4378,9 +5851,9 @@ struct llm_build_context {
         struct ggml_tensor * KQ_mask = ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, n_kv, n_tokens, 1);
         cb(KQ_mask, "KQ_mask", -1);
 
-        // shift the entire K-cache if needed
+        // shift the cells of the K-cache that moved
         if (do_rope_shift) {
-            llm_build_k_shift(ctx0, hparams, cparams, kv_self, gf, LLM_ROPE, n_ctx, n_embd_head, freq_base, freq_scale, cb);
+            llm_build_k_shift(ctx0, hparams, cparams, kv_self, gf, LLM_ROPE, shift_base, n_shift, n_embd_head, freq_base, freq_scale, cb);
         }
 
         for (int il = 0; il < n_layer; ++il) {
@@ -4404,13 +5877,13 @@ struct llm_build_context {
 
                 switch (model.type) {
                     case MODEL_7B:
-                        Qcur = ggml_rope_custom(
-                            ctx0, ggml_reshape_3d(ctx0, Qcur, n_embd_head, n_head, n_tokens), inp_pos,
+                        Qcur = ggml_rope_custom_cached(
+                            ctx0, ggml_reshape_3d(ctx0, Qcur, n_embd_head, n_head, n_tokens), inp_pos, rope_cache,
                             n_embd_head, 0, 0, n_orig_ctx, freq_base, freq_scale,
                             ext_factor, attn_factor, beta_fast, beta_slow
                         );
-                        Kcur = ggml_rope_custom(
-                            ctx0, ggml_reshape_3d(ctx0, Kcur, n_embd_head, n_head_kv, n_tokens), inp_pos,
+                        Kcur = ggml_rope_custom_cached(
+                            ctx0, ggml_reshape_3d(ctx0, Kcur, n_embd_head, n_head_kv, n_tokens), inp_pos, rope_cache,
                             n_embd_head, 0, 0, n_orig_ctx, freq_base, freq_scale,
                             ext_factor, attn_factor, beta_fast, beta_slow
                         );
@@ -4425,14 +5898,14 @@ struct llm_build_context {
                 cb(Qcur, "Qcur", il);
                 cb(Kcur, "Kcur", il);
 
-                llm_build_kv_store(ctx0, hparams, kv_self, gf, Kcur, Vcur, n_ctx, n_tokens, kv_head, cb, il);
+                llm_build_kv_store(ctx0, hparams, kv_self, gf, Kcur, Vcur, n_ctx, n_tokens, kv_runs, cb, il);
 
                 // apply ALiBi for 13B model
                 const float max_alibi_bias = model.type == MODEL_13B ? 8.0f : -1.0f;
 
                 cur = llm_build_kqv(ctx0, hparams, kv_self,
                         model.layers[il].wo, NULL,
-                        Qcur, KQ_scale, KQ_mask, n_ctx, n_tokens, n_kv, max_alibi_bias, cb, il);
+                        Qcur, KQ_scale, KQ_mask, n_ctx, n_tokens, kv_base, n_kv, max_alibi_bias, cb, il);
                 cb(cur, "kqv_out", il);
             }
 
@@ -4468,6 +5941,8 @@ struct llm_build_context {
                 LLM_NORM_RMS, cb, -1);
         cb(cur, "result_norm", -1);
 
+        cur = build_out_rows(cur);
+
         // lm_head
         cur = ggml_mul_mat(ctx0, model.output, cur);
         cb(cur, "result_output", -1);
@@ -4490,6 +5965,9 @@ struct llm_build_context {
         struct ggml_tensor * inp_pos = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_tokens);
         cb(inp_pos, "inp_pos", -1);
 
+        // sin and cos of the positions, shared by the rope of Q and K in all layers
+        struct ggml_tensor * rope_cache = llm_build_rope_cache(ctx0, cparams, inp_pos, n_embd_head, 2, freq_base, freq_scale, cb, "rope_cache");
+
         // KQ_scale
         struct ggml_tensor * KQ_scale = ggml_new_tensor_1d(ctx0, GGML_TYPE_F32, 1);
         cb(KQ_scale, "KQ_scale", -1);
@@ -4498,9 +5976,9 @@ struct llm_build_context {
         struct ggml_tensor * KQ_mask = ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, n_kv, n_tokens, 1);
         cb(KQ_mask, "KQ_mask", -1);
 
-        // shift the entire K-cache if needed
+        // shift the cells of the K-cache that moved
         if (do_rope_shift) {
-            llm_build_k_shift(ctx0, hparams, cparams, kv_self, gf, LLM_ROPE_NEOX, n_ctx, n_embd_head, freq_base, freq_scale, cb);
+            llm_build_k_shift(ctx0, hparams, cparams, kv_self, gf, LLM_ROPE_NEOX, shift_base, n_shift, n_embd_head, freq_base, freq_scale, cb);
         }
 
         for (int il = 0; il < n_layer; ++il) {
@@ -4540,23 +6018,23 @@ struct llm_build_context {
                 Kcur = ggml_reshape_3d(ctx0, Kcur, n_embd_head, n_head_kv, n_tokens);
 
                 // using mode = 2 for neox mode
-                Qcur = ggml_rope_custom(
-                    ctx0, Qcur, inp_pos, n_embd_head, 2, 0, n_orig_ctx,
+                Qcur = ggml_rope_custom_cached(
+                    ctx0, Qcur, inp_pos, rope_cache, n_embd_head, 2, 0, n_orig_ctx,
                     freq_base, freq_scale, ext_factor, attn_factor, beta_fast, beta_slow
                 );
                 cb(Qcur, "Qcur", il);
 
-                Kcur = ggml_rope_custom(
-                    ctx0, Kcur, inp_pos, n_embd_head, 2, 0, n_orig_ctx,
+                Kcur = ggml_rope_custom_cached(
+                    ctx0, Kcur, inp_pos, rope_cache, n_embd_head, 2, 0, n_orig_ctx,
                     freq_base, freq_scale, ext_factor, attn_factor, beta_fast, beta_slow
                 );
                 cb(Kcur, "Kcur", il);
 
-                llm_build_kv_store(ctx0, hparams, kv_self, gf, Kcur, Vcur, n_ctx, n_tokens, kv_head, cb, il);
+                llm_build_kv_store(ctx0, hparams, kv_self, gf, Kcur, Vcur, n_ctx, n_tokens, kv_runs, cb, il);
 
                 cur = llm_build_kqv(ctx0, hparams, kv_self,
                         model.layers[il].wo, NULL,
-                        Qcur, KQ_scale, KQ_mask, n_ctx, n_tokens, n_kv, -1.0f, cb, il);
+                        Qcur, KQ_scale, KQ_mask, n_ctx, n_tokens, kv_base, n_kv, -1.0f, cb, il);
                 cb(cur, "kqv_out", il);
             }
 
@@ -4591,6 +6069,8 @@ struct llm_build_context {
                 LLM_NORM, cb, -1);
         cb(cur, "result_norm", -1);
 
+        cur = build_out_rows(cur);
+
         cur = ggml_mul_mat(ctx0, model.output, cur);
         cb(cur, "result_output", -1);
 
@@ -4652,11 +6132,11 @@ struct llm_build_context {
 
                 Qcur = ggml_reshape_3d(ctx0, Qcur, n_embd_head, n_head, n_tokens);
 
-                llm_build_kv_store(ctx0, hparams, kv_self, gf, Kcur, Vcur, n_ctx, n_tokens, kv_head, cb, il);
+                llm_build_kv_store(ctx0, hparams, kv_self, gf, Kcur, Vcur, n_ctx, n_tokens, kv_runs, cb, il);
 
                 cur = llm_build_kqv(ctx0, hparams, kv_self,
                         model.layers[il].wo, model.layers[il].bo,
-                        Qcur, KQ_scale, KQ_mask, n_ctx, n_tokens, n_kv, -1.0f, cb, il);
+                        Qcur, KQ_scale, KQ_mask, n_ctx, n_tokens, kv_base, n_kv, -1.0f, cb, il);
                 cb(cur, "kqv_out", il);
             }
 
@@ -4690,6 +6170,8 @@ struct llm_build_context {
                 LLM_NORM, cb, -1);
         cb(cur, "result_norm", -1);
 
+        cur = build_out_rows(cur);
+
         cur = ggml_mul_mat(ctx0, model.output, cur);
         cb(cur, "result_output", -1);
 
@@ -4713,6 +6195,9 @@ struct llm_build_context {
         struct ggml_tensor * inp_pos = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_tokens);
         cb(inp_pos, "inp_pos", -1);
 
+        // sin and cos of the positions, shared by the rope of Q and K in all layers
+        struct ggml_tensor * rope_cache = llm_build_rope_cache(ctx0, cparams, inp_pos, n_rot, 2, freq_base, freq_scale, cb, "rope_cache");
+
         // KQ_scale
         struct ggml_tensor * KQ_scale = ggml_new_tensor_1d(ctx0, GGML_TYPE_F32, 1);
         cb(KQ_scale, "KQ_scale", -1);
@@ -4722,7 +6207,7 @@ struct llm_build_context {
         cb(KQ_mask, "KQ_mask", -1);
 
         if (do_rope_shift) {
-            llm_build_k_shift(ctx0, hparams, cparams, kv_self, gf, LLM_ROPE_NEOX, n_ctx, n_embd_head, freq_base, freq_scale, cb);
+            llm_build_k_shift(ctx0, hparams, cparams, kv_self, gf, LLM_ROPE_NEOX, shift_base, n_shift, n_embd_head, freq_base, freq_scale, cb);
         }
 
         for (int il = 0; il < n_layer; ++il) {
@@ -4814,14 +6299,14 @@ struct llm_build_context {
                         );
                 cb(kpass, "kpass", il);
 
-                struct ggml_tensor * qrotated = ggml_rope_custom(
-                    ctx0, qrot, inp_pos, n_rot, 2, 0, n_orig_ctx,
+                struct ggml_tensor * qrotated = ggml_rope_custom_cached(
+                    ctx0, qrot, inp_pos, rope_cache, n_rot, 2, 0, n_orig_ctx,
                     freq_base, freq_scale, ext_factor, attn_factor, beta_fast, beta_slow
                 );
                 cb(qrotated, "qrotated", il);
 
-                struct ggml_tensor * krotated = ggml_rope_custom(
-                    ctx0, krot, inp_pos, n_rot, 2, 0, n_orig_ctx,
+                struct ggml_tensor * krotated = ggml_rope_custom_cached(
+                    ctx0, krot, inp_pos, rope_cache, n_rot, 2, 0, n_orig_ctx,
                     freq_base, freq_scale, ext_factor, attn_factor, beta_fast, beta_slow
                 );
                 cb(krotated, "krotated", il);
@@ -4860,12 +6345,12 @@ struct llm_build_context {
                         );
                 cb(Vcur, "Vcur", il);
 
-                llm_build_kv_store(ctx0, hparams, kv_self, gf, Kcur, Vcur, n_ctx, n_tokens, kv_head, cb, il);
+                llm_build_kv_store(ctx0, hparams, kv_self, gf, Kcur, Vcur, n_ctx, n_tokens, kv_runs, cb, il);
 
                 // TODO: not tested, could be broken
                 cur = llm_build_kqv(ctx0, hparams, kv_self,
                         model.layers[il].wo, model.layers[il].bo,
-                        Q, KQ_scale, KQ_mask, n_ctx, n_tokens, n_kv, -1.0f, cb, il);
+                        Q, KQ_scale, KQ_mask, n_ctx, n_tokens, kv_base, n_kv, -1.0f, cb, il);
                 cb(cur, "kqv_out", il);
             }
 
@@ -4902,6 +6387,8 @@ struct llm_build_context {
                 LLM_NORM, cb, -1);
         cb(cur, "result_norm", -1);
 
+        cur = build_out_rows(cur);
+
         cur = ggml_mul_mat(ctx0, model.output, cur);
         cb(cur, "result_output", -1);
 
@@ -4952,11 +6439,11 @@ struct llm_build_context {
                 Qcur = ggml_reshape_3d(ctx0, Qcur, n_embd_head, n_head,    n_tokens);
                 cb(Qcur, "Qcur", il);
 
-                llm_build_kv_store(ctx0, hparams, kv_self, gf, Kcur, Vcur, n_ctx, n_tokens, kv_head, cb, il);
+                llm_build_kv_store(ctx0, hparams, kv_self, gf, Kcur, Vcur, n_ctx, n_tokens, kv_runs, cb, il);
 
                 cur = llm_build_kqv(ctx0, hparams, kv_self,
                         model.layers[il].wo, NULL,
-                        Qcur, KQ_scale, KQ_mask, n_ctx, n_tokens, n_kv, 8.0f, cb, il);
+                        Qcur, KQ_scale, KQ_mask, n_ctx, n_tokens, kv_base, n_kv, 8.0f, cb, il);
                 cb(cur, "kqv_out", il);
             }
 
@@ -4992,6 +6479,8 @@ struct llm_build_context {
                 LLM_NORM_RMS, cb, -1);
         cb(cur, "result_norm", -1);
 
+        cur = build_out_rows(cur);
+
         // lm_head
         cur = ggml_mul_mat(ctx0, model.output, cur);
         cb(cur, "result_output", -1);
@@ -5049,11 +6538,11 @@ struct llm_build_context {
 
                 Qcur = ggml_reshape_3d(ctx0, Qcur, n_embd_head, n_head, n_tokens);
 
-                llm_build_kv_store(ctx0, hparams, kv_self, gf, Kcur, Vcur, n_ctx, n_tokens, kv_head, cb, il);
+                llm_build_kv_store(ctx0, hparams, kv_self, gf, Kcur, Vcur, n_ctx, n_tokens, kv_runs, cb, il);
 
                 cur = llm_build_kqv(ctx0, hparams, kv_self,
                         model.layers[il].wo, model.layers[il].bo,
-                        Qcur, KQ_scale, KQ_mask, n_ctx, n_tokens, n_kv, 8.0f, cb, il);
+                        Qcur, KQ_scale, KQ_mask, n_ctx, n_tokens, kv_base, n_kv, 8.0f, cb, il);
                 cb(cur, "kqv_out", il);
             }
 
@@ -5087,6 +6576,8 @@ struct llm_build_context {
                 LLM_NORM, cb, -1);
         cb(cur, "result_norm", -1);
 
+        cur = build_out_rows(cur);
+
         cur = ggml_mul_mat(ctx0, model.output, cur);
         cb(cur, "result_output", -1);
 
@@ -5143,11 +6634,11 @@ struct llm_build_context {
 
                 Qcur = ggml_reshape_3d(ctx0, Qcur, n_embd_head, n_head, n_tokens);
 
-                llm_build_kv_store(ctx0, hparams, kv_self, gf, Kcur, Vcur, n_ctx, n_tokens, kv_head, cb, il);
+                llm_build_kv_store(ctx0, hparams, kv_self, gf, Kcur, Vcur, n_ctx, n_tokens, kv_runs, cb, il);
 
                 cur = llm_build_kqv(ctx0, hparams, kv_self,
                         model.layers[il].wo, NULL,
-                        Qcur, KQ_scale, KQ_mask, n_ctx, n_tokens, n_kv, hparams.f_max_alibi_bias, cb, il);
+                        Qcur, KQ_scale, KQ_mask, n_ctx, n_tokens, kv_base, n_kv, hparams.f_max_alibi_bias, cb, il);
                 cb(cur, "kqv_out", il);
             }
 
@@ -5186,6 +6677,8 @@ struct llm_build_context {
                 LLM_NORM, cb, -1);
         cb(cur, "result_norm", -1);
 
+        cur = build_out_rows(cur);
+
         cur = ggml_mul_mat(ctx0, model.output, cur);
         cb(cur, "result_output", -1);
 
@@ -5215,9 +6708,9 @@ struct llm_build_context {
         struct ggml_tensor * KQ_mask = ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, n_kv, n_tokens, 1);
         cb(KQ_mask, "KQ_mask", -1);
 
-        // shift the entire K-cache if needed
+        // shift the cells of the K-cache that moved
         if (do_rope_shift) {
-            llm_build_k_shift(ctx0, hparams, cparams, kv_self, gf, LLM_ROPE_NEOX, n_ctx, hparams.n_rot, freq_base, freq_scale, cb);
+            llm_build_k_shift(ctx0, hparams, cparams, kv_self, gf, LLM_ROPE_NEOX, shift_base, n_shift, hparams.n_rot, freq_base, freq_scale, cb);
         }
 
         for (int il = 0; il < n_layer; ++il) {
@@ -5256,11 +6749,11 @@ struct llm_build_context {
                 );
                 cb(Kcur, "Kcur", il);
 
-                llm_build_kv_store(ctx0, hparams, kv_self, gf, Kcur, Vcur, n_ctx, n_tokens, kv_head, cb, il);
+                llm_build_kv_store(ctx0, hparams, kv_self, gf, Kcur, Vcur, n_ctx, n_tokens, kv_runs, cb, il);
 
                 cur = llm_build_kqv(ctx0, hparams, kv_self,
                         model.layers[il].wo, NULL,
-                        Qcur, KQ_scale, KQ_mask, n_ctx, n_tokens, n_kv, -1.0f, cb, il);
+                        Qcur, KQ_scale, KQ_mask, n_ctx, n_tokens, kv_base, n_kv, -1.0f, cb, il);
                 cb(cur, "kqv_out", il);
             }
 
@@ -5298,6 +6791,8 @@ struct llm_build_context {
                 LLM_NORM, cb, -1);
         cb(cur, "result_norm", -1);
 
+        cur = build_out_rows(cur);
+
         // lm_head
         cur = ggml_mul_mat(ctx0, model.output, cur);
         cb(cur, "result_output", -1);
@@ -5320,6 +6815,9 @@ struct llm_build_context {
         struct ggml_tensor * inp_pos= ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_tokens);
         cb(inp_pos, "inp_pos", -1);
 
+        // sin and cos of the positions, shared by the rope of Q and K in all layers
+        struct ggml_tensor * rope_cache = llm_build_rope_cache(ctx0, cparams, inp_pos, n_embd_head, 2, freq_base, freq_scale, cb, "rope_cache");
+
         // KQ_scale
         struct ggml_tensor * KQ_scale= ggml_new_tensor_1d(ctx0, GGML_TYPE_F32, 1);
         cb(KQ_scale, "KQ_scale", -1);
@@ -5328,9 +6826,9 @@ struct llm_build_context {
         struct ggml_tensor * KQ_mask= ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, n_kv, n_tokens, 1);
         cb(KQ_mask, "KQ_mask", -1);
 
-        // shift the entire K-cache if needed
+        // shift the cells of the K-cache that moved
         if (do_rope_shift) {
-            llm_build_k_shift(ctx0, hparams, cparams, kv_self, gf, LLM_ROPE_NEOX, n_ctx, n_embd_head, freq_base, freq_scale, cb);
+            llm_build_k_shift(ctx0, hparams, cparams, kv_self, gf, LLM_ROPE_NEOX, shift_base, n_shift, n_embd_head, freq_base, freq_scale, cb);
         }
 
         for (int il = 0; il < n_layer; ++il) {
@@ -5361,23 +6859,23 @@ struct llm_build_context {
                 Kcur = ggml_reshape_3d(ctx0, Kcur, n_embd_head, n_head_kv, n_tokens);
 
                 // using mode = 2 for neox mode
-                Qcur = ggml_rope_custom(
-                    ctx0, Qcur, inp_pos, n_embd_head, 2, 0, n_orig_ctx,
+                Qcur = ggml_rope_custom_cached(
+                    ctx0, Qcur, inp_pos, rope_cache, n_embd_head, 2, 0, n_orig_ctx,
                     freq_base, freq_scale, ext_factor, attn_factor, beta_fast, beta_slow
                 );
                 cb(Qcur, "Qcur", il);
 
-                Kcur = ggml_rope_custom(
-                    ctx0, Kcur, inp_pos, n_embd_head, 2, 0, n_orig_ctx,
+                Kcur = ggml_rope_custom_cached(
+                    ctx0, Kcur, inp_pos, rope_cache, n_embd_head, 2, 0, n_orig_ctx,
                     freq_base, freq_scale, ext_factor, attn_factor, beta_fast, beta_slow
                 );
                 cb(Kcur, "Kcur", il);
 
-                llm_build_kv_store(ctx0, hparams, kv_self, gf, Kcur, Vcur, n_ctx, n_tokens, kv_head, cb, il);
+                llm_build_kv_store(ctx0, hparams, kv_self, gf, Kcur, Vcur, n_ctx, n_tokens, kv_runs, cb, il);
 
                 cur = llm_build_kqv(ctx0, hparams, kv_self,
                         model.layers[il].wo, NULL,
-                        Qcur, KQ_scale, KQ_mask, n_ctx, n_tokens, n_kv, -1.0f, cb, il);
+                        Qcur, KQ_scale, KQ_mask, n_ctx, n_tokens, kv_base, n_kv, -1.0f, cb, il);
                 cb(cur, "kqv_out", il);
             }
 
@@ -5413,6 +6911,8 @@ struct llm_build_context {
                 LLM_NORM_RMS, cb, -1);
         cb(cur, "result_norm", -1);
 
+        cur = build_out_rows(cur);
+
         // lm_head
         cur = ggml_mul_mat(ctx0, model.output, cur);
         cb(cur, "result_output", -1);
@@ -5522,7 +7022,10 @@ static const std::unordered_map<const char *, llm_offload_func_e> k_offload_map
     { "KQ_scale",                   OFFLOAD_FUNC_FRC },
     { "KQ_mask",                    OFFLOAD_FUNC_FRC },
     { "K_shift",                    OFFLOAD_FUNC_FRC },
+    { "K_shift_cache",              OFFLOAD_FUNC_FRC },
+    { "rope_cache",                 OFFLOAD_FUNC_FRC },
 
+    { "K_shift_rows",               OFFLOAD_FUNC     },
     { "K_shifted",                  OFFLOAD_FUNC     },
 
     { "inp_norm",                   OFFLOAD_FUNC_NR  },
@@ -5562,8 +7065,10 @@ static const std::unordered_map<const char *, llm_offload_func_e> k_offload_map
     { "kq_masked",                  OFFLOAD_FUNC_KQV },
     { "kq_soft_max",                OFFLOAD_FUNC_KQV },
     { "kq_soft_max_ext",            OFFLOAD_FUNC_KQV },
+    { "v_rows",                     OFFLOAD_FUNC_KQV },
     { "v",                          OFFLOAD_FUNC_KQV },
     { "kqv",                        OFFLOAD_FUNC_KQV },
+    { "kqv_flash_attn",             OFFLOAD_FUNC_KQV },
     { "kqv_merged",                 OFFLOAD_FUNC_KQV },
     { "kqv_merged_cont",            OFFLOAD_FUNC_KQV },
     { "kqv_wo",                     OFFLOAD_FUNC_KQV },
@@ -5603,26 +7108,66 @@ static const std::unordered_map<const char *, llm_offload_func_e> k_offload_map
     { "l_out",                      OFFLOAD_FUNC     },
 
     { "result_norm",                OFFLOAD_FUNC_EMB },
+    { "result_norm_out",            OFFLOAD_FUNC_EMB },
     { "result_output",              OFFLOAD_FUNC_OUT },
 };
 
 static llm_offload_trie k_offload_func_trie(k_offload_map);
 
+// records the views of the KV cache at the cells of the batch, they are moved when the graph is reused
+static void llama_graph_add_kv_view(
+         const llama_context & lctx,
+                 llama_graph & graph,
+          struct ggml_tensor * view,
+                  const char * name,
+                           int il) {
+    const auto & kv = lctx.kv_self;
+
+    const int64_t n_embd_gqa = lctx.model.hparams.n_embd_gqa();
+
+    size_t stride = 0;
+    if (view->view_src == kv.cell_ids) {
+        stride = ggml_element_size(kv.cell_ids);
+    } else if (il >= 0 && view->view_src == kv.k_l[il]) {
+        stride = ggml_row_size(kv.k_l[il]->type, n_embd_gqa);
+    } else if (il >= 0 && view->view_src == kv.v_l[il]) {
+        stride = kv.v_trans ? ggml_element_size(kv.v_l[il]) : ggml_row_size(kv.v_l[il]->type, n_embd_gqa);
+    } else {
+        return;
+    }
+
+    int32_t run = -1;
+
+    // the views where the KV of the batch is stored are at the cells of the runs, the others at the first attended cell
+    if (strcmp(name, "k_cache_view") == 0 || strcmp(name, "v_cache_view") == 0) {
+        for (size_t i = 0; i < kv.runs.size(); ++i) {
+            if (view->view_offs == stride*kv.runs[i].cell) {
+                run = i;
+                break;
+            }
+        }
+        GGML_ASSERT(run >= 0);
+    } else {
+        GGML_ASSERT(view->view_offs == stride*kv.base);
+    }
+
+    graph.kv_views.push_back({ view, stride, run });
+}
+
 static struct ggml_cgraph * llama_build_graph(
          llama_context & lctx,
-     const llama_batch & batch) {
+     const llama_batch & batch,
+          llama_buffer & buf_compute,
+           llama_graph & graph) {
     const auto & model = lctx.model;
 
     // check if we should build the worst-case graph (for memory measurement)
     const bool worst_case = ggml_allocr_is_measure(lctx.alloc);
 
-    // keep track of the input that has already been allocated
-    bool alloc_inp_tokens   = false;
-    bool alloc_inp_embd     = false;
-    bool alloc_inp_pos      = false;
-    bool alloc_inp_KQ_scale = false;
-    bool alloc_inp_KQ_mask  = false;
-    bool alloc_inp_K_shift  = false;
+    // the graphs that shift the K cache are not reused
+    const bool add_kv_views = !worst_case && !lctx.kv_self.has_shift;
+
+    graph = llama_graph();
 
 #ifdef GGML_USE_CUBLAS
     const bool do_offload = true;
@@ -5642,103 +7187,28 @@ static struct ggml_cgraph * llama_build_graph(
         }
 
         //
-        // allocate input tensors and set input data
+        // allocate input tensors, their data is set by llama_set_inputs
         //
         // TODO: will be removed with backend v2
 
-        if (!alloc_inp_tokens && strcmp(name, "inp_tokens") == 0) {
-            ggml_allocr_alloc(lctx.alloc, cur);
-
-            if (!ggml_allocr_is_measure(lctx.alloc) && batch.token) {
-                const int64_t n_tokens = cur->ne[0];
-
-                memcpy(cur->data, batch.token, n_tokens*ggml_element_size(cur));
-            }
-
-            alloc_inp_tokens = true;
-        }
-
-        if (!alloc_inp_embd && strcmp(name, "inp_embd") == 0) {
-            ggml_allocr_alloc(lctx.alloc, cur);
-
-            if (!ggml_allocr_is_measure(lctx.alloc) && batch.embd) {
-                const int64_t n_embd   = cur->ne[0];
-                const int64_t n_tokens = cur->ne[1];
-
-                memcpy(cur->data, batch.embd, n_tokens*n_embd*ggml_element_size(cur));
-            }
-
-            alloc_inp_embd = true;
-        }
-
-        if (!alloc_inp_pos && strcmp(name, "inp_pos") == 0) {
-            ggml_allocr_alloc(lctx.alloc, cur);
-
-            if (!ggml_allocr_is_measure(lctx.alloc) && batch.pos) {
-                const int64_t n_tokens = cur->ne[0];
-
-                int32_t * data = (int32_t *) cur->data;
-
-                for (int i = 0; i < n_tokens; ++i) {
-                    data[i] = batch.pos[i];
-                }
-            }
-
-            alloc_inp_pos = true;
-        }
-
-        if (!alloc_inp_KQ_scale && strcmp(name, "KQ_scale") == 0) {
-            ggml_allocr_alloc(lctx.alloc, cur);
-
-            if (!ggml_allocr_is_measure(lctx.alloc)) {
-                const int64_t n_embd_head = model.hparams.n_embd_head();
-                ggml_set_f32(cur, 1.0f/sqrtf(float(n_embd_head)));
-            }
+        struct ggml_tensor ** inp = nullptr;
 
-            alloc_inp_KQ_scale = true;
-        }
+        if      (strcmp(name, "inp_tokens") == 0) { inp = &graph.inp.tokens;     }
+        else if (strcmp(name, "inp_embd")   == 0) { inp = &graph.inp.embd;       }
+        else if (strcmp(name, "inp_pos")    == 0) { inp = &graph.inp.pos;        }
+        else if (strcmp(name, "KQ_scale")   == 0) { inp = &graph.inp.KQ_scale;   }
+        else if (strcmp(name, "KQ_mask")    == 0) { inp = &graph.inp.KQ_mask;    }
+        else if (strcmp(name, "K_shift")    == 0) { inp = &graph.inp.K_shift;    }
+        else if (strcmp(name, "top_k_bias") == 0) { inp = &graph.inp.top_k_bias; }
+        else if (strcmp(name, "inp_out_ids") == 0) { inp = &graph.inp.out_ids;   }
 
-        if (!alloc_inp_KQ_mask && strcmp(name, "KQ_mask") == 0) {
+        if (inp && *inp == nullptr) {
             ggml_allocr_alloc(lctx.alloc, cur);
-
-            if (!ggml_allocr_is_measure(lctx.alloc)) {
-                const int64_t n_kv     = cur->ne[0];
-                const int64_t n_tokens = cur->ne[1];
-
-                float * data = (float *) cur->data;
-                memset(data, 0, ggml_nbytes(cur));
-
-                for (int h = 0; h < 1; ++h) {
-                    for (int j = 0; j < n_tokens; ++j) {
-                        const llama_pos    pos    = batch.pos[j];
-                        const llama_seq_id seq_id = batch.seq_id[j][0];
-
-                        for (int i = 0; i < n_kv; ++i) {
-                            if (!lctx.kv_self.cells[i].has_seq_id(seq_id) || lctx.kv_self.cells[i].pos > pos) {
-                                data[h*(n_kv*n_tokens) + j*n_kv + i] = -INFINITY;
-                            }
-                        }
-                    }
-                }
-            }
-
-            alloc_inp_KQ_mask = true;
+            *inp = cur;
         }
 
-        if (!alloc_inp_K_shift && strcmp(name, "K_shift") == 0) {
-            ggml_allocr_alloc(lctx.alloc, cur);
-
-            if (!ggml_allocr_is_measure(lctx.alloc)) {
-                const int64_t n_ctx = cur->ne[0];
-
-                int32_t * data = (int32_t *) cur->data;
-
-                for (int i = 0; i < n_ctx; ++i) {
-                    data[i] = lctx.kv_self.cells[i].delta;
-                }
-            }
-
-            alloc_inp_K_shift = true;
+        if (add_kv_views && cur->view_src != nullptr) {
+            llama_graph_add_kv_view(lctx, graph, cur, name, il);
         }
 
         // view tensors are not processed further
@@ -5874,7 +7344,7 @@ static struct ggml_cgraph * llama_build_graph(
 
     struct ggml_cgraph * result = NULL;
 
-    struct llm_build_context llm(lctx, batch, cb, worst_case);
+    struct llm_build_context llm(lctx, batch, cb, buf_compute, worst_case);
 
     llm.init();
 
@@ -5923,8 +7393,40 @@ static struct ggml_cgraph * llama_build_graph(
             GGML_ASSERT(false);
     }
 
+    if (lctx.cparams.top_k_graph) {
+        llm.build_top_k(result, lctx.top_k_temp);
+    }
+
+#ifdef GGML_USE_MPI
+    if (lctx.cparams.mpi_split == LLAMA_MPI_SPLIT_ROW) {
+        ggml_mpi_graph_split_rows(lctx.ctx_mpi, llm.ctx0, result);
+    }
+#endif
+
     llm.free();
 
+    // the copies into the KV cache are views of their destination
+    if (!graph.kv_views.empty()) {
+        const size_t n_views = graph.kv_views.size();
+
+        for (int i = 0; i < result->n_nodes; ++i) {
+            struct ggml_tensor * node = result->nodes[i];
+            if (node->op != GGML_OP_CPY) {
+                continue;
+            }
+
+            for (size_t j = 0; j < n_views; ++j) {
+                if (graph.kv_views[j].tensor == node->src[1]) {
+                    const llama_kv_view view = { node, graph.kv_views[j].stride, graph.kv_views[j].run };
+                    graph.kv_views.push_back(view);
+                    break;
+                }
+            }
+        }
+    }
+
+    graph.gf = result;
+
     if (worst_case) {
         int n_non_view_total = 0;
 
@@ -5949,114 +7451,485 @@ static struct ggml_cgraph * llama_build_graph(
     return result;
 }
 
-// decode a batch of tokens by evaluating the transformer
-//
-//   - lctx:      llama context
-//   - batch:     batch to evaluate
-//
-// return 0 on success
-// return positive int on warning
-// return negative int on error
-//
-static int llama_decode_internal(
+static void llama_set_inputs(
          llama_context & lctx,
-           llama_batch   batch) {
-    const uint32_t n_tokens = batch.n_tokens;
+     const llama_batch & batch,
+    const llama_graph_inputs & inp) {
+    const auto & hparams = lctx.model.hparams;
+    const auto & kv_self = lctx.kv_self;
 
-    if (n_tokens == 0) {
-        LLAMA_LOG_ERROR("%s: n_tokens == 0", __func__);
-        return -1;
+    if (inp.tokens && batch.token) {
+        const int64_t n_tokens = inp.tokens->ne[0];
+
+        memcpy(inp.tokens->data, batch.token, n_tokens*ggml_element_size(inp.tokens));
     }
 
-    const auto & model   = lctx.model;
-    const auto & hparams = model.hparams;
-    const auto & cparams = lctx.cparams;
+    if (inp.embd && batch.embd) {
+        const int64_t n_embd   = inp.embd->ne[0];
+        const int64_t n_tokens = inp.embd->ne[1];
 
-    const auto n_batch = cparams.n_batch;
+        memcpy(inp.embd->data, batch.embd, n_tokens*n_embd*ggml_element_size(inp.embd));
+    }
 
-    GGML_ASSERT(n_tokens <= n_batch);
+    if (inp.pos && batch.pos) {
+        const int64_t n_tokens = inp.pos->ne[0];
 
-    int n_threads = n_tokens == 1 ? cparams.n_threads : cparams.n_threads_batch;
-    GGML_ASSERT((!batch.token && batch.embd) || (batch.token && !batch.embd)); // NOLINT
+        int32_t * data = (int32_t *) inp.pos->data;
 
-    const int64_t t_start_us = ggml_time_us();
+        for (int i = 0; i < n_tokens; ++i) {
+            data[i] = batch.pos[i];
+        }
+    }
 
-#ifdef GGML_USE_MPI
-    // TODO: needs fix after #3228
-    GGML_ASSERT(false && "not implemented");
-    //ggml_mpi_eval_init(lctx.ctx_mpi, &n_tokens, &n_past, &n_threads);
-#endif
+    if (inp.KQ_scale) {
+        const int64_t n_embd_head = hparams.n_embd_head();
+        ggml_set_f32(inp.KQ_scale, 1.0f/sqrtf(float(n_embd_head)));
+    }
 
-    GGML_ASSERT(n_threads > 0);
+    if (inp.KQ_mask) {
+        const int64_t n_kv     = inp.KQ_mask->ne[0];
+        const int64_t n_tokens = inp.KQ_mask->ne[1];
 
-    auto & kv_self = lctx.kv_self;
+        float * data = (float *) inp.KQ_mask->data;
+        memset(data, 0, ggml_nbytes(inp.KQ_mask));
 
-    GGML_ASSERT(!!kv_self.ctx);
+        const int64_t kv_base  = kv_self.base;
 
-    const int64_t n_embd  = hparams.n_embd;
-    const int64_t n_vocab = hparams.n_vocab;
+        for (int h = 0; h < 1; ++h) {
+            for (int j = 0; j < n_tokens; ++j) {
+                const llama_pos    pos    = batch.pos[j];
+                const llama_seq_id seq_id = batch.seq_id[j][0];
 
-    // helpers for smoother batch API transition
-    // after deprecating the llama_eval calls, these will be removed
-    std::vector<llama_pos> pos;
+                for (int i = 0; i < n_kv; ++i) {
+                    const llama_kv_cell & cell = kv_self.cells[kv_base + i];
+                    if (!cell.has_seq_id(seq_id) || cell.pos > pos) {
+                        data[h*(n_kv*n_tokens) + j*n_kv + i] = -INFINITY;
+                    }
+                }
+            }
+        }
+    }
 
-    std::vector<int32_t>                   n_seq_id;
-    std::vector<llama_seq_id *>            seq_id_arr;
-    std::vector<std::vector<llama_seq_id>> seq_id;
+    if (inp.K_shift) {
+        const int64_t n_shift = inp.K_shift->ne[0];
 
-    if (batch.pos == nullptr) {
-        pos.resize(n_tokens);
-        for (uint32_t i = 0; i < n_tokens; i++) {
-            pos[i] = batch.all_pos_0 + i*batch.all_pos_1;
-        }
+        int32_t * data = (int32_t *) inp.K_shift->data;
 
-        batch.pos = pos.data();
+        for (int i = 0; i < n_shift; ++i) {
+            data[i] = kv_self.cells[kv_self.shift_min + i].delta;
+        }
     }
 
-    if (batch.seq_id == nullptr) {
-        n_seq_id.resize(n_tokens);
-        seq_id.resize(n_tokens);
-        seq_id_arr.resize(n_tokens);
-        for (uint32_t i = 0; i < n_tokens; i++) {
-            n_seq_id[i] = 1;
-            seq_id[i].resize(1);
-            seq_id[i][0] = batch.all_seq_id;
-            seq_id_arr[i] = seq_id[i].data();
+    if (inp.top_k_bias) {
+        if (lctx.top_k_bias.empty()) {
+            memset(inp.top_k_bias->data, 0, ggml_nbytes(inp.top_k_bias));
+        } else {
+            memcpy(inp.top_k_bias->data, lctx.top_k_bias.data(), ggml_nbytes(inp.top_k_bias));
         }
-
-        batch.n_seq_id = n_seq_id.data();
-        batch.seq_id = seq_id_arr.data();
     }
 
-    // if we have enough unused cells before the current head ->
-    //   better to start searching from the beginning of the cache, hoping to fill it
-    if (kv_self.head > kv_self.used + 2*n_tokens) {
-        kv_self.head = 0;
-    }
+    if (inp.out_ids) {
+        GGML_ASSERT(inp.out_ids->ne[0] == (int64_t) lctx.out_ids.size());
 
-    if (!llama_kv_cache_find_slot(kv_self, batch)) {
-        return 1;
+        memcpy(inp.out_ids->data, lctx.out_ids.data(), ggml_nbytes(inp.out_ids));
     }
+}
 
-    // a heuristic, to avoid attending the full cache if it is not yet utilized
-    // after enough generations, the benefit from this heuristic disappears
-    // if we start defragmenting the cache, the benefit from this will be more important
-    kv_self.n = std::min((int32_t) cparams.n_ctx, std::max(32, GGML_PAD(llama_kv_cache_cell_max(kv_self), 32)));
-    //kv_self.n = llama_kv_cache_cell_max(kv_self);
+// the tokens of the batch that have an output: the ones marked in batch.logits, all of them with logits_all, or the
+// last one. The graph computes the logits of these tokens only, except in embedding mode where the final hidden state
+// of all the tokens is kept
+static void llama_set_out_ids(llama_context & lctx, const llama_batch & batch) {
+    const int32_t n_tokens = batch.n_tokens;
 
-    //printf("kv_self.n = %5d, kv_self.used = %5d, kv_self.head = %5d\n", kv_self.n, kv_self.used, kv_self.head);
+    auto & out_ids = lctx.out_ids;
+    out_ids.clear();
 
-    ggml_allocr_reset(lctx.alloc);
+    if (!lctx.embedding.empty() || (!batch.logits && lctx.logits_all)) {
+        for (int32_t i = 0; i < n_tokens; ++i) {
+            out_ids.push_back(i);
+        }
+    } else if (batch.logits) {
+        for (int32_t i = 0; i < n_tokens; ++i) {
+            if (batch.logits[i] != 0) {
+                out_ids.push_back(i);
+            }
+        }
+    }
 
-    ggml_cgraph * gf = llama_build_graph(lctx, batch);
+    // a batch without outputs still has one row, which is not read back
+    if (out_ids.empty()) {
+        out_ids.push_back(n_tokens - 1);
+    }
+}
+
+// moves the views of the KV cache of a reused graph to the cells of the batch
+static void llama_set_kv_views(const llama_kv_cache & kv, const llama_graph & graph) {
+    for (const llama_kv_view & view : graph.kv_views) {
+        struct ggml_tensor * t = view.tensor;
+
+        const uint32_t cell = view.run < 0 ? kv.base : kv.runs[view.run].cell;
+
+        t->view_offs = view.stride*cell;
+        t->data      = (char *) t->view_src->data + t->view_offs;
+
+        if (t->op == GGML_OP_VIEW && t->src[0] == t->view_src) {
+            memcpy(t->op_params, &t->view_offs, sizeof(t->view_offs));
+        }
+    }
+}
+
+// the cached graph built for a batch of the same shape, nullptr if there is none
+static llama_cached_graph * llama_graph_cache_find(llama_context & lctx, const llama_batch & batch) {
+    const auto & kv_self = lctx.kv_self;
+
+    for (auto & cached : lctx.graph_cache) {
+        if (cached.t_used < 0 ||
+            cached.n_tokens   != (uint32_t) batch.n_tokens ||
+            cached.n_kv       != kv_self.n ||
+            cached.embd       != (batch.embd != nullptr) ||
+            cached.top_k_temp != lctx.top_k_temp ||
+            cached.n_outputs  != lctx.out_ids.size() ||
+            cached.runs.size() != kv_self.runs.size()) {
+            continue;
+        }
+
+        bool same_runs = true;
+        for (size_t i = 0; i < kv_self.runs.size(); ++i) {
+            if (cached.runs[i].i_token  != kv_self.runs[i].i_token ||
+                cached.runs[i].n_tokens != kv_self.runs[i].n_tokens) {
+                same_runs = false;
+                break;
+            }
+        }
+
+        if (same_runs) {
+            return &cached;
+        }
+    }
+
+    return nullptr;
+}
+
+// the cached graph to replace with the graph of a batch: one never built, or the least recently used
+static llama_cached_graph & llama_graph_cache_new(llama_context & lctx, const llama_batch & batch) {
+    llama_cached_graph * res = &lctx.graph_cache[0];
+    for (auto & cached : lctx.graph_cache) {
+        if (cached.t_used < res->t_used) {
+            res = &cached;
+        }
+    }
+
+    if (res->buf.data == nullptr) {
+        res->buf.resize(lctx.buf_compute.size);
+    }
+
+    res->n_tokens   = batch.n_tokens;
+    res->n_kv       = lctx.kv_self.n;
+    res->embd       = batch.embd != nullptr;
+    res->top_k_temp = lctx.top_k_temp;
+    res->n_outputs  = lctx.out_ids.size();
+    res->runs       = lctx.kv_self.runs;
+
+    return *res;
+}
+
+// the size of the smallest bucket of the compute buffer for a batch of n_tokens tokens that attends n_kv cells
+static size_t llama_alloc_bucket_size(const llama_context & lctx, uint32_t n_tokens, uint32_t n_kv) {
+    size_t res = SIZE_MAX;
+    for (const auto & bucket : lctx.alloc_buckets) {
+        if (bucket.n_tokens >= n_tokens && bucket.n_kv >= n_kv) {
+            res = std::min(res, bucket.size);
+        }
+    }
+
+    GGML_ASSERT(res != SIZE_MAX && "batch larger than the measured worst case");
+
+    return res;
+}
+
+// replace the allocator buffer with a buffer of size bytes, the cached graphs that had their tensors in the previous
+// one are built again
+static void llama_alloc_resize(llama_context & lctx, size_t size) {
+    ggml_allocr_free(lctx.alloc);
+
+    lctx.buf_alloc.resize(size);
+    lctx.alloc = ggml_allocr_new(lctx.buf_alloc.data, lctx.buf_alloc.size, LLAMA_TENSOR_ALIGNMENT);
+
+    LLAMA_LOG_INFO("%s: compute buffer resized to %.2f MiB\n", __func__, (lctx.buf_compute.size + size) / 1024.0 / 1024.0);
+
+    for (auto & cached : lctx.graph_cache) {
+        cached.t_used = -1;
+    }
+
+#ifdef GGML_USE_CUBLAS
+    // the scratch buffer only grows, it is shared by all the contexts
+    ggml_cuda_set_scratch_size(size);
+#endif
+}
+
+// keep the compute times of the graph just computed, the nodes that only change the view of their source are
+// skipped
+static void llama_profile_record(llama_context & lctx, const ggml_cgraph * gf, uint32_t n_tokens, int64_t t_start_us) {
+    lctx.prof_graphs.push_back({ n_tokens, lctx.kv_self.n, t_start_us, ggml_time_us() });
+
+    for (int i = 0; i < gf->n_nodes; ++i) {
+        const ggml_tensor * node = gf->nodes[i];
+        const int64_t * t = &lctx.prof_times[2*i];
+
+        if (t[1] == 0) {
+            continue; // not timed, e.g. computed with Metal
+        }
+
+        switch (node->op) {
+            case GGML_OP_NONE:
+            case GGML_OP_VIEW:
+            case GGML_OP_RESHAPE:
+            case GGML_OP_PERMUTE:
+            case GGML_OP_TRANSPOSE:
+                continue;
+            default:
+                break;
+        }
+
+        llama_profile_node prof;
+        memcpy(prof.name, node->name, sizeof(prof.name));
+        prof.op         = ggml_op_desc(node);
+        prof.type       = node->src[0] ? node->src[0]->type : node->type;
+        prof.backend    = node->backend;
+        memcpy(prof.ne, node->ne, sizeof(prof.ne));
+        prof.t_start_us = t[0];
+        prof.t_end_us   = t[1];
+
+        lctx.prof_nodes.push_back(prof);
+    }
+}
+
+// top-k tokens of a row of logits, for the backends that cannot compute them in the graph
+static void llama_top_k_from_logits(const llama_context & lctx, const float * logits, llama_token_data * out) {
+    const int32_t  n_vocab = lctx.model.hparams.n_vocab;
+    const uint32_t n_top_k = lctx.cparams.n_top_k;
+
+    const float scale = lctx.top_k_temp > 0.0f ? 1.0f/lctx.top_k_temp : 1.0f;
+
+    std::vector<llama_token_data> cur(n_vocab);
+
+    float max_l = -INFINITY;
+    for (llama_token id = 0; id < n_vocab; ++id) {
+        const float l = logits[id]*scale + (lctx.top_k_bias.empty() ? 0.0f : lctx.top_k_bias[id]);
+        cur[id] = { id, l, 0.0f };
+        max_l = std::max(max_l, l);
+    }
+
+    double sum = 0.0;
+    for (const auto & c : cur) {
+        sum += expf(c.logit - max_l);
+    }
+
+    std::partial_sort(cur.begin(), cur.begin() + n_top_k, cur.end(), [](const llama_token_data & a, const llama_token_data & b) {
+        return a.logit > b.logit;
+    });
+
+    for (uint32_t k = 0; k < n_top_k; ++k) {
+        const float p = expf(cur[k].logit - max_l) / sum;
+        out[k] = { cur[k].id, logf(p), p };
+    }
+}
+
+// the threads computing the graphs of the context, the pool owned by the context is grown to the number of threads
+static ggml_threadpool * llama_get_threadpool(llama_context & lctx) {
+    const int n_threads = std::max(lctx.cparams.n_threads, lctx.cparams.n_threads_batch);
+
+    if (lctx.threadpool_owned && ggml_threadpool_n_threads(lctx.threadpool) < n_threads) {
+        ggml_threadpool_free(lctx.threadpool);
+        lctx.threadpool       = nullptr;
+        lctx.threadpool_owned = false;
+    }
+
+    if (lctx.threadpool == nullptr) {
+        lctx.threadpool       = ggml_threadpool_new(ggml_threadpool_default_params(n_threads));
+        lctx.threadpool_owned = true;
+    }
+
+    return lctx.threadpool;
+}
+
+// decode a batch of tokens by evaluating the transformer
+//
+//   - lctx:      llama context
+//   - batch:     batch to evaluate
+//
+// return 0 on success
+// return positive int on warning
+// return negative int on error
+//
+static int llama_decode_internal(
+         llama_context & lctx,
+           llama_batch   batch) {
+    const uint32_t n_tokens = batch.n_tokens;
+
+    if (n_tokens == 0) {
+        LLAMA_LOG_ERROR("%s: n_tokens == 0", __func__);
+        return -1;
+    }
+
+    const auto & model   = lctx.model;
+    const auto & hparams = model.hparams;
+    const auto & cparams = lctx.cparams;
+
+    const auto n_batch = cparams.n_batch;
+
+    GGML_ASSERT(n_tokens <= n_batch);
+
+    int n_threads = n_tokens == 1 ? cparams.n_threads : cparams.n_threads_batch;
+    GGML_ASSERT((!batch.token && batch.embd) || (batch.token && !batch.embd)); // NOLINT
+
+    const int64_t t_start_us = ggml_time_us();
+
+    GGML_ASSERT(n_threads > 0);
+
+    auto & kv_self = lctx.kv_self;
+
+    GGML_ASSERT(!!kv_self.ctx);
+
+    const int64_t n_embd  = hparams.n_embd;
+    const int64_t n_vocab = hparams.n_vocab;
+
+    // helpers for smoother batch API transition
+    // after deprecating the llama_eval calls, these will be removed
+    std::vector<llama_pos> pos;
+
+    std::vector<int32_t>                   n_seq_id;
+    std::vector<llama_seq_id *>            seq_id_arr;
+    std::vector<std::vector<llama_seq_id>> seq_id;
+
+    if (batch.pos == nullptr) {
+        pos.resize(n_tokens);
+        for (uint32_t i = 0; i < n_tokens; i++) {
+            pos[i] = batch.all_pos_0 + i*batch.all_pos_1;
+        }
+
+        batch.pos = pos.data();
+    }
+
+    if (batch.seq_id == nullptr) {
+        n_seq_id.resize(n_tokens);
+        seq_id.resize(n_tokens);
+        seq_id_arr.resize(n_tokens);
+        for (uint32_t i = 0; i < n_tokens; i++) {
+            n_seq_id[i] = 1;
+            seq_id[i].resize(1);
+            seq_id[i][0] = batch.all_seq_id;
+            seq_id_arr[i] = seq_id[i].data();
+        }
+
+        batch.n_seq_id = n_seq_id.data();
+        batch.seq_id = seq_id_arr.data();
+    }
+
+    // if we have enough unused cells before the current head ->
+    //   better to start searching from the beginning of the cache, hoping to fill it
+    if (kv_self.head > kv_self.used + 2*n_tokens) {
+        kv_self.head = 0;
+    }
+
+    if (!llama_kv_cache_find_slot(kv_self, batch)) {
+        return 1;
+    }
+
+    // a heuristic, to avoid attending the full cache if it is not yet utilized
+    // after enough generations, the benefit from this heuristic disappears
+    // if we start defragmenting the cache, the benefit from this will be more important
+    // the cells of the other sequences are not attended either, so the cost of attention
+    // tracks the span of the cells of the sequences of the batch
+    llama_kv_cache_find_window(kv_self, batch);
+
+    //printf("kv_self.base = %5d, kv_self.n = %5d, kv_self.used = %5d, kv_self.head = %5d\n", kv_self.base, kv_self.n, kv_self.used, kv_self.head);
+
+    llama_set_out_ids(lctx, batch);
+
+    // the graphs of the batches of the same shape differ only by their inputs and the cells of the KV cache they
+    // use, a cached graph is reused without building nor allocating it again
+    const bool use_graph_cache = !lctx.graph_cache.empty() && !kv_self.has_shift;
+
+    llama_cached_graph * cached = use_graph_cache ? llama_graph_cache_find(lctx, batch) : nullptr;
+    llama_graph        * graph  = nullptr;
+
+    if (cached) {
+        graph = &cached->graph;
+
+        llama_set_kv_views(kv_self, *graph);
+    } else {
+        llama_buffer * buf = &lctx.buf_compute;
+        graph = &lctx.graph;
+
+        if (use_graph_cache) {
+            cached = &llama_graph_cache_new(lctx, batch);
+            buf    = &cached->buf;
+            graph  = &cached->graph;
+        }
+
+        // the K shift may span the whole cache
+        const size_t alloc_size = llama_alloc_bucket_size(lctx, n_tokens, kv_self.has_shift ? cparams.n_ctx : kv_self.n);
+        if (alloc_size > lctx.buf_alloc.size) {
+            llama_alloc_resize(lctx, alloc_size);
+        }
+
+        ggml_allocr_reset(lctx.alloc);
+
+        llama_build_graph(lctx, batch, *buf, *graph);
+
+#ifdef GGML_USE_MPI
+        // only the layers of this node are allocated and computed
+        if (cparams.mpi_split == LLAMA_MPI_SPLIT_LAYER) {
+            ggml_mpi_graph_split(lctx.ctx_mpi, graph->gf, hparams.n_layer);
+        }
+#endif
+
+        ggml_allocr_alloc_graph(lctx.alloc, graph->gf);
+    }
+
+    if (cached) {
+        cached->t_used = t_start_us;
+    }
+
+    llama_set_inputs(lctx, batch, graph->inp);
+
+    ggml_cgraph * gf = graph->gf;
+
+#ifdef GGML_USE_MPI
+    // the output is computed by the main node, the worker nodes compute their layers only
+    const bool has_output = ggml_mpi_rank(lctx.ctx_mpi) == 0;
+#else
+    const bool has_output = true;
+#endif
+
+    struct ggml_tensor * res         = nullptr;
+    struct ggml_tensor * embeddings  = nullptr;
+    struct ggml_tensor * top_k_ids   = nullptr;
+    struct ggml_tensor * top_k_probs = nullptr;
 
-    ggml_allocr_alloc_graph(lctx.alloc, gf);
+    if (has_output) {
+        res        = gf->nodes[gf->n_nodes - 1];
+        embeddings = gf->nodes[gf->n_nodes - 2];
 
-    struct ggml_tensor * res        = gf->nodes[gf->n_nodes - 1];
-    struct ggml_tensor * embeddings = gf->nodes[gf->n_nodes - 2];
+        if (cparams.top_k_graph) {
+            // the top-k tokens are computed after the output
+            top_k_probs = gf->nodes[gf->n_nodes - 1];
+            top_k_ids   = ggml_graph_get_tensor(gf, "result_top_k_ids");
+            res         = ggml_graph_get_tensor(gf, "result_output");
+            embeddings  = ggml_graph_get_tensor(gf, "result_norm");
 
-    GGML_ASSERT(strcmp(res->name,        "result_output") == 0);
-    GGML_ASSERT(strcmp(embeddings->name, "result_norm")   == 0);
+            GGML_ASSERT(strcmp(top_k_probs->name, "result_top_k_probs") == 0);
+            GGML_ASSERT(top_k_ids && res && embeddings);
+        } else if (strcmp(embeddings->name, "result_norm") != 0) {
+            // the nodes of the split of the rows of the output are before it
+            embeddings = ggml_graph_get_tensor(gf, "result_norm");
+            GGML_ASSERT(embeddings);
+        }
+
+        GGML_ASSERT(strcmp(res->name,        "result_output") == 0);
+        GGML_ASSERT(strcmp(embeddings->name, "result_norm")   == 0);
+    }
 
 
 #ifdef GGML_USE_CUBLAS
@@ -6080,6 +7953,10 @@ static int llama_decode_internal(
         embeddings->backend = GGML_BACKEND_CPU;
     }
     res->backend = GGML_BACKEND_CPU;
+    if (top_k_probs) {
+        top_k_ids->backend   = GGML_BACKEND_CPU;
+        top_k_probs->backend = GGML_BACKEND_CPU;
+    }
 #endif
 
     // LLAMA_LOG_INFO("graph build time: %.3f ms (%d nodes, %d leafs)\n", (ggml_time_us() - t_start_us)/1000.0, gf->n_nodes, gf->n_leafs);
@@ -6098,36 +7975,49 @@ static int llama_decode_internal(
         n_threads = 1;
     }
 
-#if GGML_USE_MPI
-    const int64_t n_layer = hparams.n_layer;
-    ggml_mpi_graph_compute_pre(lctx.ctx_mpi, gf, n_layer);
+#ifdef GGML_USE_MPI
+    ggml_mpi_graph_compute_pre(lctx.ctx_mpi, gf);
 #endif
 
+    int64_t * node_times = nullptr;
+    if (cparams.profile) {
+        lctx.prof_times.assign(2*gf->n_nodes, 0);
+        node_times = lctx.prof_times.data();
+    }
+
+    const int64_t t_compute_us = ggml_time_us();
+
 #ifdef GGML_USE_METAL
     if (lctx.ctx_metal) {
         ggml_metal_set_n_cb     (lctx.ctx_metal, n_threads);
         ggml_metal_graph_compute(lctx.ctx_metal, gf);
     } else {
-        ggml_graph_compute_helper(lctx.work_buffer, gf, n_threads);
+        ggml_graph_compute_helper(lctx.work_buffer, gf, n_threads, llama_get_threadpool(lctx), node_times);
     }
 #else
-    ggml_graph_compute_helper(lctx.work_buffer, gf, n_threads);
+    ggml_graph_compute_helper(lctx.work_buffer, gf, n_threads, llama_get_threadpool(lctx), node_times);
 #endif
 
-#if GGML_USE_MPI
-    ggml_mpi_graph_compute_post(lctx.ctx_mpi, gf, n_layer);
+    if (cparams.profile) {
+        llama_profile_record(lctx, gf, n_tokens, t_compute_us);
+    }
+
+#ifdef GGML_USE_MPI
+    ggml_mpi_graph_compute_post(lctx.ctx_mpi, gf);
 #endif
 
     // update the kv ring buffer
     {
         if (kv_self.has_shift) {
             kv_self.has_shift = false;
-            for (uint32_t i = 0; i < kv_self.size; ++i) {
+            for (uint32_t i = kv_self.shift_min; i < kv_self.shift_max; ++i) {
                 kv_self.cells[i].delta = 0;
             }
+            kv_self.shift_min = kv_self.size;
+            kv_self.shift_max = 0;
         }
 
-        kv_self.head += n_tokens;
+        kv_self.head = kv_self.runs.back().cell + kv_self.runs.back().n_tokens;
 
         // Ensure kv cache head points to a valid index.
         if (kv_self.head >= kv_self.size) {
@@ -6146,35 +8036,81 @@ static int llama_decode_internal(
     //    ggml_graph_dump_dot(gf, NULL, "llama.dot");
     //}
 
+    if (!has_output) {
+        return 0;
+    }
+
     // extract logits
     // TODO: do not compute and extract logits if only embeddings are needed
     //       need to update the graphs to skip "result_output"
-    {
-        auto & logits_out = lctx.logits;
+    //
+    // the rows of the output are the tokens of lctx.out_ids, the outputs are stored in the rows of their tokens when
+    // the batch selects them, else there is only the one of the last token
+    const auto & out_ids = lctx.out_ids;
+
+    const bool all_rows = batch.logits || lctx.logits_all;
 
+    auto is_output = [&](uint32_t i) {
         if (batch.logits) {
-            logits_out.resize(n_vocab * n_tokens);
-            for (uint32_t i = 0; i < n_tokens; i++) {
-                if (batch.logits[i] == 0) {
-                    continue;
+            return batch.logits[i] != 0;
+        }
+        return lctx.logits_all || i == n_tokens - 1;
+    };
+
+    // the logits are not read back when the graph computes the top-k tokens, their buffer may have been reused
+    if (!cparams.top_k_graph) {
+        auto & logits_out = lctx.logits;
+
+        logits_out.resize(all_rows ? n_vocab*n_tokens : n_vocab);
+
+        for (size_t k = 0; k < out_ids.size(); ++k) {
+            const uint32_t i = out_ids[k];
+            if (!is_output(i)) {
+                continue;
+            }
+            memcpy(logits_out.data() + (all_rows ? n_vocab*i : 0), (float *) ggml_get_data(res) + n_vocab*k, sizeof(float)*n_vocab);
+        }
+    }
+
+    // extract the top-k tokens, in the same rows as the logits
+    if (cparams.n_top_k > 0) {
+        const uint32_t n_top_k = cparams.n_top_k;
+
+        auto & top_k_out = lctx.top_k;
+
+        top_k_out.resize(all_rows ? n_top_k*n_tokens : n_top_k);
+
+        for (size_t k = 0; k < out_ids.size(); ++k) {
+            const uint32_t i = out_ids[k];
+            if (!is_output(i)) {
+                continue;
+            }
+
+            const uint32_t i_out = all_rows ? i : 0;
+
+            llama_token_data * out = top_k_out.data() + n_top_k*i_out;
+            if (top_k_probs) {
+                const int32_t * ids   = (const int32_t *) ggml_get_data(top_k_ids)   + n_top_k*k;
+                const float   * probs = (const float   *) ggml_get_data(top_k_probs) + n_top_k*k;
+                for (uint32_t j = 0; j < n_top_k; ++j) {
+                    out[j] = { ids[j], logf(probs[j]), probs[j] };
                 }
-                memcpy(logits_out.data() + (n_vocab*i), (float *) ggml_get_data(res) + (n_vocab*i), sizeof(float)*n_vocab);
+            } else {
+                llama_top_k_from_logits(lctx, lctx.logits.data() + n_vocab*i_out, out);
             }
-        } else if (lctx.logits_all) {
-            logits_out.resize(n_vocab * n_tokens);
-            memcpy(logits_out.data(), (float *) ggml_get_data(res), sizeof(float)*n_vocab*n_tokens);
-        } else {
-            logits_out.resize(n_vocab);
-            memcpy(logits_out.data(), (float *) ggml_get_data(res) + (n_vocab*(n_tokens - 1)), sizeof(float)*n_vocab);
         }
     }
 
     // extract embeddings
     if (!lctx.embedding.empty()) {
         auto & embedding_out = lctx.embedding;
+        auto & embedding_all = lctx.embedding_all;
+
+        embedding_all.resize(n_embd*n_tokens);
+        memcpy(embedding_all.data(), (float *) ggml_get_data(embeddings), sizeof(float)*n_embd*n_tokens);
 
         embedding_out.resize(n_embd);
-        memcpy(embedding_out.data(), (float *) ggml_get_data(embeddings) + (n_embd*(n_tokens - 1)), sizeof(float)*n_embd);
+        memcpy(embedding_out.data(), embedding_all.data() + (n_embd*(n_tokens - 1)), sizeof(float)*n_embd);
     }
 
     // measure the performance only for the single-token evals
@@ -6197,28 +8133,264 @@ static int llama_decode_internal(
     return 0;
 }
 
-//
-// tokenizer
-//
+#ifdef GGML_USE_MPI
 
-static enum llama_vocab_type llama_vocab_get_type(const llama_vocab & vocab) {
-    return vocab.type;
-}
+// the worker nodes keep a copy of the KV cache of the main node for their layers: the main node broadcasts the batches
+// it evaluates and the changes of its KV cache as commands, which the worker nodes apply in the same order
+enum llama_mpi_cmd_type {
+    LLAMA_MPI_CMD_QUIT,
+    LLAMA_MPI_CMD_DECODE,
+    LLAMA_MPI_CMD_KV_CLEAR,
+    LLAMA_MPI_CMD_SEQ_RM,
+    LLAMA_MPI_CMD_SEQ_CP,
+    LLAMA_MPI_CMD_SEQ_KEEP,
+    LLAMA_MPI_CMD_SEQ_SHIFT,
+};
 
-static bool llama_is_normal_token(const llama_vocab & vocab, llama_token id) {
-    return vocab.id_to_token[id].type == LLAMA_TOKEN_TYPE_NORMAL;
-}
+struct llama_mpi_cmd {
+    int32_t type;
+    int32_t args[4];
+};
 
-static bool llama_is_unknown_token(const llama_vocab & vocab, llama_token id) {
-    return vocab.id_to_token[id].type == LLAMA_TOKEN_TYPE_UNKNOWN;
-}
+// the micro-batches of a batch have at least this many tokens: the weights are read once per micro-batch, so the
+// smaller batches, e.g. of the generation, are evaluated at once
+#define LLAMA_MPI_MIN_UBATCH 16
 
-static bool llama_is_control_token(const llama_vocab & vocab, llama_token id) {
-    return vocab.id_to_token[id].type == LLAMA_TOKEN_TYPE_CONTROL;
+static void llama_mpi_bcast_cmd(llama_context & lctx, int32_t type, int32_t a0 = 0, int32_t a1 = 0, int32_t a2 = 0, int32_t a3 = 0) {
+    if (ggml_mpi_size(lctx.ctx_mpi) == 1 || ggml_mpi_rank(lctx.ctx_mpi) != 0) {
+        return;
+    }
+
+    llama_mpi_cmd cmd = { type, { a0, a1, a2, a3 } };
+    ggml_mpi_bcast(lctx.ctx_mpi, &cmd, sizeof(cmd));
 }
 
-static bool llama_is_byte_token(const llama_vocab & vocab, llama_token id) {
-    return vocab.id_to_token[id].type == LLAMA_TOKEN_TYPE_BYTE;
+template <typename T>
+static void llama_mpi_bcast_vec(llama_context & lctx, std::vector<T> & vec) {
+    if (!vec.empty()) {
+        ggml_mpi_bcast(lctx.ctx_mpi, vec.data(), vec.size()*sizeof(T));
+    }
+}
+
+// evaluate a batch of the main node, or the one it broadcasts on the worker nodes if batch is NULL
+//
+// the batch is split into micro-batches that go through the nodes one after the other: while a node evaluates its
+// layers for a micro-batch, the next node evaluates its layers for the previous one, so that all the nodes work at
+// the same time once the pipeline is full
+static int llama_decode_mpi(llama_context & lctx, const llama_batch * batch) {
+    ggml_mpi_context * ctx_mpi = lctx.ctx_mpi;
+
+    const bool is_main = ggml_mpi_rank(ctx_mpi) == 0;
+
+    if (is_main) {
+        if (batch->n_tokens == 0) {
+            return llama_decode_internal(lctx, *batch);
+        }
+
+        GGML_ASSERT(batch->token && "the batches of embeddings are not supported with MPI");
+
+        llama_mpi_bcast_cmd(lctx, LLAMA_MPI_CMD_DECODE);
+    }
+
+    // the batch with all its arrays, the sequence ids of the tokens one after the other
+    std::vector<llama_token>  token;
+    std::vector<llama_pos>    pos;
+    std::vector<int32_t>      n_seq_id;
+    std::vector<llama_seq_id> seq_id;
+    std::vector<int8_t>       logits;
+
+    int32_t shape[2] = { 0, 0 }; // number of tokens, of sequence ids
+
+    if (is_main) {
+        const int32_t n = batch->n_tokens;
+
+        token.assign(batch->token, batch->token + n);
+
+        for (int32_t i = 0; i < n; ++i) {
+            pos.push_back(batch->pos ? batch->pos[i] : batch->all_pos_0 + i*batch->all_pos_1);
+
+            if (batch->seq_id) {
+                n_seq_id.push_back(batch->n_seq_id[i]);
+                seq_id.insert(seq_id.end(), batch->seq_id[i], batch->seq_id[i] + batch->n_seq_id[i]);
+            } else {
+                n_seq_id.push_back(1);
+                seq_id.push_back(batch->all_seq_id);
+            }
+        }
+
+        // the micro-batches output the rows of the logits of the whole batch
+        if (batch->logits) {
+            logits.assign(batch->logits, batch->logits + n);
+        } else {
+            logits.assign(n, lctx.logits_all);
+            logits[n - 1] = 1;
+        }
+
+        shape[0] = n;
+        shape[1] = seq_id.size();
+    }
+
+    ggml_mpi_bcast(ctx_mpi, shape, sizeof(shape));
+
+    const uint32_t n_tokens = shape[0];
+
+    token   .resize(n_tokens);
+    pos     .resize(n_tokens);
+    n_seq_id.resize(n_tokens);
+    seq_id  .resize(shape[1]);
+    logits  .resize(n_tokens);
+
+    llama_mpi_bcast_vec(lctx, token);
+    llama_mpi_bcast_vec(lctx, pos);
+    llama_mpi_bcast_vec(lctx, n_seq_id);
+    llama_mpi_bcast_vec(lctx, seq_id);
+    llama_mpi_bcast_vec(lctx, logits);
+
+    std::vector<llama_seq_id *> seq_id_ptr(n_tokens);
+    for (uint32_t i = 0, j = 0; i < n_tokens; j += n_seq_id[i], ++i) {
+        seq_id_ptr[i] = seq_id.data() + j;
+    }
+
+    const uint32_t n_vocab = lctx.model.hparams.n_vocab;
+    const uint32_t n_embd  = lctx.model.hparams.n_embd;
+    const uint32_t n_top_k = lctx.cparams.n_top_k;
+
+    const bool has_logits = is_main && !lctx.cparams.top_k_graph;
+    const bool has_top_k  = is_main && n_top_k > 0;
+    const bool has_embd   = is_main && !lctx.embedding.empty();
+
+    std::vector<float>            logits_out   (has_logits ? n_vocab*n_tokens : 0);
+    std::vector<llama_token_data> top_k_out    (has_top_k  ? n_top_k*n_tokens : 0);
+    std::vector<float>            embedding_out(has_embd   ? n_embd*n_tokens  : 0);
+
+    // two micro-batches per node keep the pipeline busy, the nodes evaluate all the layers together with the split
+    // of the rows
+    const uint32_t n_nodes  = ggml_mpi_size(ctx_mpi);
+    const uint32_t n_ubatch = lctx.cparams.mpi_split == LLAMA_MPI_SPLIT_ROW ? n_tokens :
+        std::max(std::min<uint32_t>(n_tokens, LLAMA_MPI_MIN_UBATCH), (n_tokens + 2*n_nodes - 1)/(2*n_nodes));
+
+    int ret = 0;
+
+    for (uint32_t i0 = 0; i0 < n_tokens; i0 += n_ubatch) {
+        const uint32_t n = std::min(n_ubatch, n_tokens - i0);
+
+        llama_batch ubatch = {
+            /*n_tokens   =*/ (int32_t) n,
+            /*token      =*/ token.data()      + i0,
+            /*embd       =*/ nullptr,
+            /*pos        =*/ pos.data()        + i0,
+            /*n_seq_id   =*/ n_seq_id.data()   + i0,
+            /*seq_id     =*/ seq_id_ptr.data() + i0,
+            /*logits     =*/ logits.data()     + i0,
+            /*all_pos_0  =*/ 0,
+            /*all_pos_1  =*/ 0,
+            /*all_seq_id =*/ 0,
+        };
+
+        // the nodes fail on the same micro-batch, as their KV caches are the same
+        ret = llama_decode_internal(lctx, ubatch);
+        if (ret != 0) {
+            // the micro-batches before are removed from the KV cache, the failed batch is not evaluated at all, as
+            // without MPI
+            for (uint32_t i = 0; i < i0; ++i) {
+                for (int32_t s = 0; s < n_seq_id[i]; ++s) {
+                    llama_kv_cache_seq_rm(lctx.kv_self, seq_id_ptr[i][s], pos[i], pos[i] + 1);
+                }
+            }
+            break;
+        }
+
+        for (uint32_t i = 0; i < n; ++i) {
+            if (has_logits && logits[i0 + i]) {
+                std::copy_n(lctx.logits.data() + n_vocab*i, n_vocab, logits_out.data() + n_vocab*(i0 + i));
+            }
+            if (has_top_k && logits[i0 + i]) {
+                std::copy_n(lctx.top_k.data() + n_top_k*i, n_top_k, top_k_out.data() + n_top_k*(i0 + i));
+            }
+        }
+        if (has_embd) {
+            std::copy_n(lctx.embedding_all.data(), n_embd*n, embedding_out.data() + n_embd*i0);
+        }
+    }
+
+    ggml_mpi_flush(ctx_mpi);
+
+    if (ret != 0 || !is_main) {
+        return ret;
+    }
+
+    // the outputs of the whole batch, in the layout of llama_decode_internal
+    const bool all_rows = batch->logits || lctx.logits_all;
+
+    if (has_logits) {
+        if (all_rows) {
+            lctx.logits = std::move(logits_out);
+        } else {
+            lctx.logits.assign(logits_out.end() - n_vocab, logits_out.end());
+        }
+    }
+    if (has_top_k) {
+        if (all_rows) {
+            lctx.top_k = std::move(top_k_out);
+        } else {
+            lctx.top_k.assign(top_k_out.end() - n_top_k, top_k_out.end());
+        }
+    }
+    if (has_embd) {
+        lctx.embedding.assign(embedding_out.end() - n_embd, embedding_out.end());
+        lctx.embedding_all = std::move(embedding_out);
+    }
+
+    return 0;
+}
+
+// the loop of the worker nodes, until the main node frees its context
+static void llama_mpi_worker_loop(llama_context & lctx) {
+    auto & kv_self = lctx.kv_self;
+
+    while (true) {
+        llama_mpi_cmd cmd;
+        ggml_mpi_bcast(lctx.ctx_mpi, &cmd, sizeof(cmd));
+
+        const int32_t * args = cmd.args;
+
+        switch (cmd.type) {
+            case LLAMA_MPI_CMD_QUIT:      return;
+            case LLAMA_MPI_CMD_DECODE:    llama_decode_mpi(lctx, nullptr);                                    break;
+            case LLAMA_MPI_CMD_KV_CLEAR:  llama_kv_cache_clear    (kv_self);                                  break;
+            case LLAMA_MPI_CMD_SEQ_RM:    llama_kv_cache_seq_rm   (kv_self, args[0], args[1], args[2]);          break;
+            case LLAMA_MPI_CMD_SEQ_CP:    llama_kv_cache_seq_cp   (kv_self, args[0], args[1], args[2], args[3]); break;
+            case LLAMA_MPI_CMD_SEQ_KEEP:  llama_kv_cache_seq_keep (kv_self, args[0]);                         break;
+            case LLAMA_MPI_CMD_SEQ_SHIFT: llama_kv_cache_seq_shift(kv_self, args[0], args[1], args[2], args[3]); break;
+            default: GGML_ASSERT(false && "unknown MPI command");
+        }
+    }
+}
+
+#endif // GGML_USE_MPI
+
+//
+// tokenizer
+//
+
+static enum llama_vocab_type llama_vocab_get_type(const llama_vocab & vocab) {
+    return vocab.type;
+}
+
+static bool llama_is_normal_token(const llama_vocab & vocab, llama_token id) {
+    return vocab.id_to_token[id].type == LLAMA_TOKEN_TYPE_NORMAL;
+}
+
+static bool llama_is_unknown_token(const llama_vocab & vocab, llama_token id) {
+    return vocab.id_to_token[id].type == LLAMA_TOKEN_TYPE_UNKNOWN;
+}
+
+static bool llama_is_control_token(const llama_vocab & vocab, llama_token id) {
+    return vocab.id_to_token[id].type == LLAMA_TOKEN_TYPE_CONTROL;
+}
+
+static bool llama_is_byte_token(const llama_vocab & vocab, llama_token id) {
+    return vocab.id_to_token[id].type == LLAMA_TOKEN_TYPE_BYTE;
 }
 
 static bool llama_is_user_defined_token(const llama_vocab& vocab, llama_token id) {
@@ -6244,17 +8416,24 @@ static uint8_t llama_token_to_byte(const llama_vocab& vocab, llama_token id) {
 
 static llama_token llama_byte_to_token(const llama_vocab & vocab, uint8_t ch) {
     static const char * hex = "0123456789ABCDEF";
+    llama_token id = -1;
     switch (llama_vocab_get_type(vocab)) {
     case LLAMA_VOCAB_TYPE_SPM: {
         const char buf[7] = { '<', '0', 'x', hex[ch >> 4], hex[ch & 15], '>', 0 };
-        return vocab.token_to_id.at(buf);
+        id = vocab.find_token(buf, 6);
+        break;
     }
     case LLAMA_VOCAB_TYPE_BPE: {
-        return vocab.token_to_id.at(bytes_to_unicode_bpe(ch));
+        id = vocab.find_token(bytes_to_unicode_bpe(ch));
+        break;
     }
     default:
         GGML_ASSERT(false);
     }
+    if (id < 0) {
+        throw std::out_of_range("llama_byte_to_token: byte not found in vocab");
+    }
+    return id;
 }
 
 static void llama_escape_whitespace(std::string & text) {
@@ -6357,11 +8536,11 @@ struct llm_tokenizer_spm {
 private:
     void resegment(llm_symbol & symbol, std::vector<llama_vocab::id> & output) {
         auto text = std::string(symbol.text, symbol.n);
-        auto token = vocab.token_to_id.find(text);
+        auto token = vocab.find_token(text);
 
         // Do we need to support is_unused?
-        if (token != vocab.token_to_id.end()) {
-            output.push_back((*token).second);
+        if (token >= 0) {
+            output.push_back(token);
             return;
         }
 
@@ -6385,18 +8564,14 @@ private:
             return;
         }
 
-        const std::string text = std::string(symbols[left].text, symbols[left].n + symbols[right].n);
-        auto token = vocab.token_to_id.find(text);
-
-        if (token == vocab.token_to_id.end()) {
-            return;
-        }
+        const auto token = vocab.find_token(symbols[left].text, symbols[left].n + symbols[right].n);
 
-        if (static_cast<size_t>((*token).second) >= vocab.id_to_token.size()) {
+        if (token < 0) {
             return;
         }
 
-        const auto & tok_data = vocab.id_to_token[(*token).second];
+        const auto & tok_data = vocab.id_to_token[token];
+        const std::string & text = tok_data.text;
 
         llm_bigram_spm bigram;
         bigram.left  = left;
@@ -6435,23 +8610,21 @@ struct llm_bigram_bpe {
     using queue = std::priority_queue<llm_bigram_bpe, queue_storage, comparator>;
     llm_symbol::index left;
     llm_symbol::index right;
-    std::string text;
     int rank;
     size_t size;
+    llama_vocab::id id; // token of the merged symbols, -1 if it is not known
 };
 
 struct llm_tokenizer_bpe {
     llm_tokenizer_bpe(const llama_vocab & vocab): vocab(vocab) {}
 
     void tokenize(const std::string & text, std::vector<llama_vocab::id> & output) {
-        int final_prev_index = -1;
-        auto word_collection = bpe_gpt2_preprocess(text);
+        const std::vector<std::string> word_collection = bpe_gpt2_preprocess(text);
 
-        symbols_final.clear();
-
-        for (auto & word : word_collection) {
+        for (const auto & word : word_collection) {
             work_queue = llm_bigram_bpe::queue();
             symbols.clear();
+            ids.clear();
 
             int index = 0;
             size_t offset = 0;
@@ -6466,6 +8639,7 @@ struct llm_tokenizer_bpe {
                 sym.next = offset == word.size() ? -1 : index + 1;
                 index++;
                 symbols.emplace_back(sym);
+                ids.push_back(token_id(sym));
             }
             for (size_t i = 1; i < symbols.size(); ++i) {
                 add_new_bigram(i - 1, i);
@@ -6479,18 +8653,15 @@ struct llm_tokenizer_bpe {
                 auto & left_symbol = symbols[bigram.left];
                 auto & right_symbol = symbols[bigram.right];
 
-                if (left_symbol.n == 0 || right_symbol.n == 0) {
+                // the symbols only grow by merging to the right, so a bigram is outdated iff the size changed
+                if (left_symbol.n == 0 || right_symbol.n == 0 || left_symbol.n + right_symbol.n != bigram.size) {
                     continue;
                 }
-                std::string left_token = std::string(left_symbol.text, left_symbol.n);
-                std::string right_token = std::string(right_symbol.text, right_symbol.n);
-                if (left_token + right_token != bigram.text) {
-                    continue;  // Skip this bigram if it's outdated
-                }
 
                 // merge the right sym into the left one
                 left_symbol.n += right_symbol.n;
                 right_symbol.n = 0;
+                ids[bigram.left] = bigram.id >= 0 ? bigram.id : token_id(left_symbol);
 
                 // remove the right sym from the chain
                 left_symbol.next = right_symbol.next;
@@ -6502,60 +8673,52 @@ struct llm_tokenizer_bpe {
                 add_new_bigram(bigram.left, left_symbol.next);  // right side of current symbol
             }
 
-            // add the fnished tokens to the final list keeping correct order for next and prev
-            for (auto & sym : symbols) {
-                if (sym.n > 0) {
-                    sym.prev = final_prev_index;
-                    sym.next = -1;
-                    if (final_prev_index != -1) {
-                        symbols_final[final_prev_index].next = symbols_final.size();
-                    }
-                    symbols_final.emplace_back(sym);
-                    final_prev_index = symbols_final.size() - 1;
-                }
-            }
-        }
-
-        symbols = symbols_final;
-
-        if (!symbols.empty()) {
-            for (int i = 0; i != -1; i = symbols[i].next) {
-                auto & symbol = symbols[i];
+            // add the finished tokens to the output, in order
+            for (size_t i = 0; i < symbols.size(); ++i) {
+                const auto & symbol = symbols[i];
                 if (symbol.n == 0) {
                     continue;
                 }
 
-                const std::string str = std::string(symbol.text, symbol.n);
-                const auto token = vocab.token_to_id.find(str);
-
-                if (token == vocab.token_to_id.end()) {
-                    for (auto j = str.begin(); j != str.end(); ++j) {
-                        std::string byte_str(1, *j);
-                        auto token_multibyte = vocab.token_to_id.find(byte_str);
-                        if (token_multibyte == vocab.token_to_id.end()) {
+                if (ids[i] >= 0) {
+                    output.push_back(ids[i]);
+                } else {
+                    for (size_t j = 0; j < symbol.n; ++j) {
+                        const auto token_multibyte = vocab.find_token(symbol.text + j, 1);
+                        if (token_multibyte < 0) {
                             throw std::runtime_error("ERROR: byte not found in vocab");
                         }
-                        output.push_back((*token_multibyte).second);
+                        output.push_back(token_multibyte);
                     }
-                } else {
-                    output.push_back((*token).second);
                 }
             }
         }
     }
 
 private:
+    llama_vocab::id token_id(const llm_symbol & symbol) const {
+        return vocab.find_token(symbol.text, symbol.n);
+    }
+
     void add_new_bigram(int left, int right) {
         if (left == -1 || right == -1) {
             return;
         }
 
-        std::string left_token  = std::string(symbols[left].text,  symbols[left].n);
-        std::string right_token = std::string(symbols[right].text, symbols[right].n);
-
         int rank_found = -1;
+        llama_vocab::id id = -1;
 
-        rank_found = vocab.find_bpe_rank(left_token, right_token);
+        if (ids[left] >= 0 && ids[right] >= 0) {
+            const auto * merge = vocab.find_bpe_merge(ids[left], ids[right]);
+            if (merge != nullptr) {
+                rank_found = merge->rank;
+                id         = merge->merged;
+            }
+        } else {
+            // the symbols that are not tokens can only be merged by text
+            rank_found = vocab.find_bpe_rank(std::string(symbols[left].text,  symbols[left].n),
+                                             std::string(symbols[right].text, symbols[right].n));
+        }
 
         if (rank_found < 0) {
             return;
@@ -6565,18 +8728,34 @@ private:
 
         bigram.left  = left;
         bigram.right = right;
-        bigram.text  = left_token + right_token;
-        bigram.size  = left_token.size() + right_token.size();
+        bigram.size  = symbols[left].n + symbols[right].n;
         bigram.rank  = rank_found;
+        bigram.id    = id;
 
         work_queue.push(bigram);
     }
 
+    // splits the text into words with the GPT2 regex and encodes them with the byte-level BPE alphabet
+    // the text is handled as codepoints, each classified once; the words are ranges of codepoints until encoded
     std::vector<std::string> bpe_gpt2_preprocess(const std::string & text) {
-        std::vector<std::string> bpe_words;
-        std::vector<std::string> bpe_encoded_words;
+        const std::vector<uint32_t> cps = codepoints_from_utf8(text);
+        const int n_cps = cps.size();
+
+        std::vector<int> types(n_cps);
+        for (int i = 0; i < n_cps; ++i) {
+            types[i] = codepoint_type(cps[i]);
+        }
+        auto type = [&](int i) {
+            return i < n_cps ? types[i] : CODEPOINT_TYPE_UNIDENTIFIED;
+        };
+        auto is_cp = [&](int i, uint32_t cp) {
+            return i < n_cps && cps[i] == cp;
+        };
+
+        // [begin, end) codepoints of the words
+        std::vector<std::pair<int, int>> bpe_words;
+        bpe_words.reserve(n_cps);
 
-        std::string token = "";
         // GPT2 system regex:  's|'t|'re|'ve|'m|'ll|'d| ?\p{L}+| ?\p{N}+| ?[^\s\p{L}\p{N}]+|\s+(?!\S)|\s+
         bool collecting_numeric = false;
         bool collecting_letter = false;
@@ -6584,128 +8763,112 @@ private:
         bool collecting_whitespace_lookahead = false;
         bool collecting = false;
 
-        std::vector<std::string> text_utf;
-        text_utf.reserve(text.size());
-        bpe_words.reserve(text.size());
-        bpe_encoded_words.reserve(text.size());
-
-        auto cps = codepoints_from_utf8(text);
-        for (size_t i = 0; i < cps.size(); ++i)
-            text_utf.emplace_back(codepoint_to_utf8(cps[i]));
+        int token = 0; // the current token is [token, i)
 
-        for (int i = 0; i < (int)text_utf.size(); i++) {
-            const std::string & utf_char = text_utf[i];
+        for (int i = 0; i < n_cps; i++) {
             bool split_condition = false;
-            int bytes_remain = text_utf.size() - i;
-            // forward backward lookups
-            const std::string & utf_char_next = (i + 1 < (int)text_utf.size()) ? text_utf[i + 1] : "";
-            const std::string & utf_char_next_next = (i + 2 < (int)text_utf.size()) ? text_utf[i + 2] : "";
 
             // handling contractions
-            if (!split_condition && bytes_remain >= 2) {
+            if (is_cp(i, '\'') && (is_cp(i + 1, 's') || is_cp(i + 1, 't') || is_cp(i + 1, 'm') || is_cp(i + 1, 'd'))) {
                 // 's|'t|'m|'d
-                if (utf_char == "\'" && (utf_char_next == "s" || utf_char_next == "t" || utf_char_next == "m" || utf_char_next == "d")) {
-                    split_condition = true;
-                }
-                if (split_condition) {
-                    if (token.size()) {
-                        bpe_words.emplace_back(token); // push previous content as token
-                    }
-                    token = utf_char + utf_char_next;
-                    bpe_words.emplace_back(token);
-                    token = "";
-                    i++;
-                    continue;
+                if (token < i) {
+                    bpe_words.emplace_back(token, i); // push previous content as token
                 }
+                bpe_words.emplace_back(i, i + 2);
+                i += 1;
+                token = i + 1;
+                continue;
             }
-            if (!split_condition && bytes_remain >= 3) {
+            if (is_cp(i, '\'') && i + 2 < n_cps && (
+                (cps[i + 1] == 'r' && cps[i + 2] == 'e') ||
+                (cps[i + 1] == 'v' && cps[i + 2] == 'e') ||
+                (cps[i + 1] == 'l' && cps[i + 2] == 'l'))
+                ) {
                 // 're|'ve|'ll
-                if (utf_char == "\'" && (
-                    (utf_char_next == "r" && utf_char_next_next == "e") ||
-                    (utf_char_next == "v" && utf_char_next_next == "e") ||
-                    (utf_char_next == "l" && utf_char_next_next == "l"))
-                    ) {
-                    split_condition = true;
-                }
-                if (split_condition) {
-                    // current token + next token can be defined
-                    if (token.size()) {
-                        bpe_words.emplace_back(token); // push previous content as token
-                    }
-                    token = utf_char + utf_char_next + utf_char_next_next;
-                    bpe_words.emplace_back(token); // the contraction
-                    token = "";
-                    i += 2;
-                    continue;
+                if (token < i) {
+                    bpe_words.emplace_back(token, i); // push previous content as token
                 }
+                bpe_words.emplace_back(i, i + 3); // the contraction
+                i += 2;
+                token = i + 1;
+                continue;
             }
 
-            if (!split_condition && !collecting) {
-                if (codepoint_type(utf_char) == CODEPOINT_TYPE_LETTER || (!token.size() && utf_char == " " && codepoint_type(utf_char_next) == CODEPOINT_TYPE_LETTER)) {
+            const int  type_cur   = type(i);
+            const int  type_next  = type(i + 1);
+            const bool space_lead = token == i && cps[i] == ' ';
+
+            if (!collecting) {
+                if (type_cur == CODEPOINT_TYPE_LETTER || (space_lead && type_next == CODEPOINT_TYPE_LETTER)) {
                     collecting_letter = true;
                     collecting = true;
                 }
-                else if (codepoint_type(utf_char) == CODEPOINT_TYPE_DIGIT || (!token.size() && utf_char == " " && codepoint_type(utf_char_next) == CODEPOINT_TYPE_DIGIT)) {
+                else if (type_cur == CODEPOINT_TYPE_DIGIT || (space_lead && type_next == CODEPOINT_TYPE_DIGIT)) {
                     collecting_numeric = true;
                     collecting = true;
                 }
                 else if (
-                    ((codepoint_type(utf_char) != CODEPOINT_TYPE_LETTER && codepoint_type(utf_char) != CODEPOINT_TYPE_DIGIT) && (codepoint_type(utf_char) != CODEPOINT_TYPE_WHITESPACE)) ||
-                    (!token.size() && utf_char == " " && codepoint_type(utf_char_next) != CODEPOINT_TYPE_LETTER && codepoint_type(utf_char_next) != CODEPOINT_TYPE_DIGIT && codepoint_type(utf_char_next) != CODEPOINT_TYPE_WHITESPACE)
+                    ((type_cur != CODEPOINT_TYPE_LETTER && type_cur != CODEPOINT_TYPE_DIGIT) && (type_cur != CODEPOINT_TYPE_WHITESPACE)) ||
+                    (space_lead && type_next != CODEPOINT_TYPE_LETTER && type_next != CODEPOINT_TYPE_DIGIT && type_next != CODEPOINT_TYPE_WHITESPACE)
                     ) {
                     collecting_special = true;
                     collecting = true;
                 }
-                else if (codepoint_type(utf_char) == CODEPOINT_TYPE_WHITESPACE && codepoint_type(utf_char_next) == CODEPOINT_TYPE_WHITESPACE) {
+                else if (type_cur == CODEPOINT_TYPE_WHITESPACE && type_next == CODEPOINT_TYPE_WHITESPACE) {
                     collecting_whitespace_lookahead = true;
                     collecting = true;
                 }
-                else if (codepoint_type(utf_char) == CODEPOINT_TYPE_WHITESPACE) {
+                else if (type_cur == CODEPOINT_TYPE_WHITESPACE) {
                     split_condition = true;
                 }
             }
-            else if (!split_condition && collecting) {
-                if (collecting_letter && codepoint_type(utf_char) != CODEPOINT_TYPE_LETTER) {
+            else {
+                if (collecting_letter && type_cur != CODEPOINT_TYPE_LETTER) {
                     split_condition = true;
                 }
-                else if (collecting_numeric && codepoint_type(utf_char) != CODEPOINT_TYPE_DIGIT) {
+                else if (collecting_numeric && type_cur != CODEPOINT_TYPE_DIGIT) {
                     split_condition = true;
                 }
-                else if (collecting_special && (codepoint_type(utf_char) == CODEPOINT_TYPE_LETTER || codepoint_type(utf_char) == CODEPOINT_TYPE_DIGIT || codepoint_type(utf_char) == CODEPOINT_TYPE_WHITESPACE)) {
+                else if (collecting_special && (type_cur == CODEPOINT_TYPE_LETTER || type_cur == CODEPOINT_TYPE_DIGIT || type_cur == CODEPOINT_TYPE_WHITESPACE)) {
                     split_condition = true;
                 }
-                else if (collecting_whitespace_lookahead && (codepoint_type(utf_char_next) == CODEPOINT_TYPE_LETTER || codepoint_type(utf_char_next) == CODEPOINT_TYPE_DIGIT)) {
+                else if (collecting_whitespace_lookahead && (type_next == CODEPOINT_TYPE_LETTER || type_next == CODEPOINT_TYPE_DIGIT)) {
                     split_condition = true;
                 }
             }
 
-            if (utf_char_next == "") {
-                split_condition = true; // final
-                token += utf_char;
+            if (i + 1 == n_cps) {
+                // final: the last codepoint ends the current token
+                if (token < i + 1) {
+                    bpe_words.emplace_back(token, i + 1);
+                }
+                break;
             }
 
             if (split_condition) {
-                if (token.size()) {
-                    bpe_words.emplace_back(token);
+                if (token < i) {
+                    bpe_words.emplace_back(token, i);
                 }
-                token = utf_char;
+                token = i;
                 collecting = false;
                 collecting_letter = false;
                 collecting_numeric = false;
                 collecting_special = false;
                 collecting_whitespace_lookahead = false;
             }
-            else {
-                token += utf_char;
-            }
         }
 
-        for (std::string & word : bpe_words) {
-            std::string encoded_token = "";
-            for (char & c : word) {
-                encoded_token += bytes_to_unicode_bpe(c);
+        std::vector<std::string> bpe_encoded_words;
+        bpe_encoded_words.reserve(bpe_words.size());
+
+        for (const auto & word : bpe_words) {
+            std::string encoded_token;
+            for (int i = word.first; i < word.second; ++i) {
+                for (char c : codepoint_to_utf8(cps[i])) {
+                    encoded_token += bytes_to_unicode_bpe(c);
+                }
             }
-            bpe_encoded_words.emplace_back(encoded_token);
+            bpe_encoded_words.emplace_back(std::move(encoded_token));
         }
 
         return bpe_encoded_words;
@@ -6713,8 +8876,8 @@ private:
 
     const llama_vocab & vocab;
 
-    std::vector<llm_symbol> symbols;
-    std::vector<llm_symbol> symbols_final;
+    std::vector<llm_symbol>      symbols;
+    std::vector<llama_vocab::id> ids; // token of each symbol, -1 if its text is not a token
 
     llm_bigram_bpe::queue work_queue;
 };
@@ -6756,96 +8919,51 @@ struct fragment_buffer_variant{
 
 static void tokenizer_st_partition(const llama_vocab & vocab, std::forward_list<fragment_buffer_variant> & buffer)
 {
-    // for each special token
-    for (const auto & st: vocab.special_tokens_cache) {
-        const auto & special_token = st.first;
-        const auto & special_id    = st.second;
-
-        // for each text fragment
-        std::forward_list<fragment_buffer_variant>::iterator it = buffer.begin();
-        while (it != buffer.end()) {
-            auto & fragment = (*it);
-
-            // if a fragment is text ( not yet processed )
-            if (fragment.type == FRAGMENT_BUFFER_VARIANT_TYPE_RAW_TEXT) {
-                auto * raw_text = &(fragment.raw_text);
-
-                auto raw_text_base_offset = fragment.offset;
-                auto raw_text_base_length = fragment.length;
-
-                // loop over the text
-                while (true) {
-                    // find the first occurrence of a given special token in this fragment
-                    //  passing offset argument only limit the "search area" but match coordinates
-                    //  are still relative to the source full raw_text
-                    auto match = raw_text->find(special_token, raw_text_base_offset);
-
-                    // no occurrences found, stop processing this fragment for a given special token
-                    if (match == std::string::npos) break;
+    std::vector<llama_special_token_matcher::match> matches;
 
-                    // check if match is within bounds of offset <-> length
-                    if (match + special_token.length() > raw_text_base_offset + raw_text_base_length) break;
+    // for each text fragment
+    auto prev = buffer.before_begin();
+    for (auto it = buffer.begin(); it != buffer.end(); prev = it, ++it) {
+        const auto & fragment = (*it);
 
-#ifdef PRETOKENIZERDEBUG
-                    fprintf(stderr, "FF: (%ld %ld %ld) '%s'\n", raw_text->length(), raw_text_base_offset, raw_text_base_length, raw_text->substr(raw_text_base_offset, raw_text_base_length).c_str());
-#endif
-                    auto source = std::distance(buffer.begin(), it);
-
-                    // if match is further than base offset
-                    //  then we have some text to the left of it
-                    if (match > raw_text_base_offset) {
-                        // left
-                        const int64_t left_reminder_offset = raw_text_base_offset + 0;
-                        const int64_t left_reminder_length = match - raw_text_base_offset;
-                        buffer.emplace_after(it, (*raw_text), left_reminder_offset, left_reminder_length);
+        // if a fragment is text ( not yet processed )
+        if (fragment.type != FRAGMENT_BUFFER_VARIANT_TYPE_RAW_TEXT) {
+            continue;
+        }
 
-#ifdef PRETOKENIZERDEBUG
-                        fprintf(stderr, "FL: (%ld %ld) '%s'\n", left_reminder_offset, left_reminder_length, raw_text->substr(left_reminder_offset, left_reminder_length).c_str());
-#endif
-                        it++;
-                    }
+        // all the special tokens are matched in one pass over the fragment
+        matches.clear();
+        vocab.special_tokens_matcher.find(fragment.raw_text, fragment.offset, fragment.length, matches);
+        if (matches.empty()) {
+            continue;
+        }
 
-                    // special token
-                    buffer.emplace_after(it, special_id);
-                    it++;
+        const std::string & raw_text = fragment.raw_text;
 
-                    // right
-                    if (match + special_token.length() < raw_text_base_offset + raw_text_base_length) {
-                        const int64_t right_reminder_offset = match + special_token.length();
-                        const int64_t right_reminder_length = raw_text_base_length - ((match - raw_text_base_offset) + special_token.length());
-                        buffer.emplace_after(it, (*raw_text), right_reminder_offset, right_reminder_length);
+        uint64_t pos = fragment.offset;
+        const uint64_t end = fragment.offset + fragment.length;
 
+        // replace the fragment by the text between the matches and their tokens
+        auto last = it;
+        for (const auto & match : matches) {
+            if (match.start > pos) {
+                last = buffer.emplace_after(last, raw_text, pos, match.start - pos);
 #ifdef PRETOKENIZERDEBUG
-                        fprintf(stderr, "FR: (%ld %ld) '%s'\n", right_reminder_offset, right_reminder_length, raw_text->substr(right_reminder_offset, right_reminder_length).c_str());
+                fprintf(stderr, "FL: (%ld %ld) '%s'\n", pos, match.start - pos, raw_text.substr(pos, match.start - pos).c_str());
 #endif
-
-                        it++;
-
-                        if (source == 0) {
-                            buffer.erase_after(buffer.before_begin());
-                        } else {
-                            buffer.erase_after(std::next(buffer.begin(), (source-1)));
-                        }
-
-                        // repeat for the right side
-                        raw_text_base_offset = right_reminder_offset;
-                        raw_text_base_length = right_reminder_length;
-
+            }
+            last = buffer.emplace_after(last, match.token);
+            pos = match.start + match.length;
+        }
+        if (pos < end) {
+            last = buffer.emplace_after(last, raw_text, pos, end - pos);
 #ifdef PRETOKENIZERDEBUG
-                        fprintf(stderr, "RR: (%ld %ld) '%s'\n", raw_text_base_offset, raw_text_base_length, raw_text->substr(raw_text_base_offset, raw_text_base_length).c_str());
+            fprintf(stderr, "FR: (%ld %ld) '%s'\n", pos, end - pos, raw_text.substr(pos, end - pos).c_str());
 #endif
-                    } else {
-                        if (source == 0) {
-                            buffer.erase_after(buffer.before_begin());
-                        } else {
-                            buffer.erase_after(std::next(buffer.begin(), (source-1)));
-                        }
-                        break;
-                    }
-                }
-            }
-            it++;
         }
+
+        buffer.erase_after(prev);
+        it = last;
     }
 }
 
@@ -6935,12 +9053,119 @@ struct llama_partial_utf8 {
     int      n_remain; // num bytes remaining; -1 indicates invalid sequence
 };
 
+// tokens allowed by llama_sample_grammar for the states of the grammar seen so far, one bit per
+// token of the vocabulary, least recently used masks are evicted first
+struct llama_grammar_mask_cache {
+    // canonical state of the grammar, see llama_grammar_mask_key
+    using key_t = std::vector<uint32_t>;
+
+    struct key_hash {
+        size_t operator()(const key_t & key) const {
+            // FNV-1a
+            uint64_t hash = 14695981039346656037ull;
+            for (uint32_t v : key) {
+                hash = (hash ^ v) * 1099511628211ull;
+            }
+            return hash;
+        }
+    };
+
+    using entry_t = std::pair<key_t, std::vector<uint64_t>>;
+
+    size_t n_max;
+
+    // trie of the vocabulary the masks were computed for
+    const llama_token_trie * trie = nullptr;
+
+    std::list<entry_t>                                                       entries; // most recently used first
+    std::unordered_map<key_t, std::list<entry_t>::iterator, key_hash>        index;
+
+    uint64_t n_hit  = 0;
+    uint64_t n_miss = 0;
+
+    std::mutex mutex;
+
+    explicit llama_grammar_mask_cache(size_t n_max) : n_max(n_max) {}
+};
+
+// the pushdown stacks of a grammar, hash-consed into a tree: a stack is the id of its top node,
+// which points to the node below it, so that stacks sharing a tail share its nodes and identical
+// stacks have the same id. The transitions of a stack only depend on the rules, and are memoized
+struct llama_grammar_stack_pool {
+    struct node {
+        const llama_grammar_element * elem;
+        uint32_t                      below;
+        uint32_t                      depth;
+    };
+
+    struct key_hash {
+        size_t operator()(const std::pair<const llama_grammar_element *, uint32_t> & key) const {
+            return std::hash<const llama_grammar_element *>()(key.first) ^ (size_t(key.second) * 0x9e3779b97f4a7c15ull);
+        }
+    };
+
+    // nodes[0] is the empty stack
+    std::vector<node> nodes = { { nullptr, 0, 0 } };
+
+    std::unordered_map<std::pair<const llama_grammar_element *, uint32_t>, uint32_t, key_hash> index;
+
+    // stacks positioned at a char range obtained from a stack, see llama_grammar_advance_stack
+    std::unordered_map<uint32_t, std::vector<uint32_t>> advanced;
+    // stacks obtained once the char range at the top of a stack is matched
+    std::unordered_map<uint32_t, std::vector<uint32_t>> matched;
+    // by char range element, the bytes that can start a UTF-8 sequence it accepts
+    std::unordered_map<const llama_grammar_element *, std::bitset<256>> first_bytes;
+
+    uint32_t push(uint32_t below, const llama_grammar_element * elem) {
+        auto it = index.find(std::make_pair(elem, below));
+        if (it != index.end()) {
+            return it->second;
+        }
+        const uint32_t id = nodes.size();
+        nodes.push_back({ elem, below, nodes[below].depth + 1 });
+        index.emplace(std::make_pair(elem, below), id);
+        return id;
+    }
+
+    uint32_t push(uint32_t below, const std::vector<const llama_grammar_element *> & stack) {
+        for (const auto * elem : stack) {
+            below = push(below, elem);
+        }
+        return below;
+    }
+
+    // elements of a stack, bottom first
+    std::vector<const llama_grammar_element *> get(uint32_t id) const {
+        std::vector<const llama_grammar_element *> stack(nodes[id].depth);
+        for (; id != 0; id = nodes[id].below) {
+            stack[nodes[id].depth - 1] = nodes[id].elem;
+        }
+        return stack;
+    }
+
+    void clear() {
+        nodes.resize(1);
+        index.clear();
+        advanced.clear();
+        matched.clear();
+        first_bytes.clear();
+    }
+};
+
 struct llama_grammar {
-    const std::vector<std::vector<llama_grammar_element>>   rules;
-    std::vector<std::vector<const llama_grammar_element *>> stacks;
+    std::vector<std::vector<llama_grammar_element>>         rules;
+
+    // the transitions are memoized while sampling, which does not otherwise modify the grammar
+    mutable llama_grammar_stack_pool                        pool;
+
+    // ids of the distinct stacks in pool
+    std::vector<uint32_t>                                   stacks;
 
     // buffer for partially generated UTF-8 sequence from accepted tokens
     llama_partial_utf8                                      partial_utf8;
+
+    // optional, shared with the copies of the grammar as long as their rules are the same
+    std::shared_ptr<llama_grammar_mask_cache>               mask_cache;
 };
 
 struct llama_grammar_candidate {
@@ -6949,16 +9174,17 @@ struct llama_grammar_candidate {
     llama_partial_utf8   partial_utf8;
 };
 
-// Decodes a UTF-8 string which may end in an incomplete sequence. Adds a terminating 0 for use as
-// pointer. If an invalid sequence is encountered, returns `llama_partial_utf8.n_remain == -1`.
+// Decodes a 0-terminated UTF-8 string of len bytes which may end in an incomplete sequence. Adds a
+// terminating 0 for use as pointer. If an invalid sequence is encountered, returns `llama_partial_utf8.n_remain == -1`.
 static std::pair<std::vector<uint32_t>, llama_partial_utf8> decode_utf8(
-        const std::string & src,
+        const char         * src,
+        size_t               len,
         llama_partial_utf8   partial_start) {
     static const int      lookup[] = { 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 2, 2, 3, 4 };
-    const char          * pos      = src.c_str();
+    const char          * pos      = src;
     std::vector<uint32_t> code_points;
     // common english strings have the same number of codepoints and bytes. `+ 1` for the terminating 0.
-    code_points.reserve(src.size() + 1);
+    code_points.reserve(len + 1);
     uint32_t              value    = partial_start.value;
     int                   n_remain = partial_start.n_remain;
 
@@ -7093,53 +9319,141 @@ static bool llama_grammar_match_partial_char(
     return !is_positive_char;
 }
 
+// returns true iff some code point in [low, high] satisfies the char range at pos (regular or
+// inverse range)
+// asserts that pos is pointing to a char range element
+static bool llama_grammar_match_char_range(
+        const llama_grammar_element * pos,
+        const uint32_t                low,
+        const uint32_t                high) {
 
-// transforms a grammar pushdown stack into N possible stacks, all ending
-// at a character range (terminal element)
-static void llama_grammar_advance_stack(
-        const std::vector<std::vector<llama_grammar_element>>   & rules,
-        const std::vector<const llama_grammar_element *>        & stack,
-        std::vector<std::vector<const llama_grammar_element *>> & new_stacks) {
-
-    if (stack.empty()) {
-        new_stacks.emplace_back(stack);
-        return;
-    }
-
-    const llama_grammar_element * pos = stack.back();
+    bool is_positive_char = pos->type == LLAMA_GRETYPE_CHAR;
+    GGML_ASSERT(is_positive_char || pos->type == LLAMA_GRETYPE_CHAR_NOT);
 
-    switch (pos->type) {
-        case LLAMA_GRETYPE_RULE_REF: {
-            const size_t                  rule_id = static_cast<size_t>(pos->value);
-            const llama_grammar_element * subpos  = rules[rule_id].data();
-            do {
-                // init new stack without the top (pos)
-                std::vector<const llama_grammar_element *> new_stack(stack.begin(), stack.end() - 1);
-                if (!llama_grammar_is_end_of_sequence(pos + 1)) {
-                    // if this rule ref is followed by another element, add that to stack
-                    new_stack.push_back(pos + 1);
-                }
-                if (!llama_grammar_is_end_of_sequence(subpos)) {
-                    // if alternate is nonempty, add to stack
-                    new_stack.push_back(subpos);
-                }
-                llama_grammar_advance_stack(rules, new_stack, new_stacks);
-                while (!llama_grammar_is_end_of_sequence(subpos)) {
-                    // scan to end of alternate def
-                    subpos++;
+    std::vector<std::pair<uint32_t, uint32_t>> ranges;
+    do {
+        if (pos[1].type == LLAMA_GRETYPE_CHAR_RNG_UPPER) {
+            // inclusive range, e.g. [a-z]
+            if (pos->value <= high && low <= pos[1].value) {
+                if (is_positive_char) {
+                    return true;
                 }
-                if (subpos->type == LLAMA_GRETYPE_ALT) {
-                    // there's another alternate def of this rule to process
-                    subpos++;
-                } else {
-                    break;
+                ranges.emplace_back(pos->value, pos[1].value);
+            }
+            pos += 2;
+        } else {
+            // exact char match, e.g. [a] or "a"
+            if (low <= pos->value && pos->value <= high) {
+                if (is_positive_char) {
+                    return true;
                 }
-            } while (true);
-            break;
+                ranges.emplace_back(pos->value, pos->value);
+            }
+            pos += 1;
+        }
+    } while (pos->type == LLAMA_GRETYPE_CHAR_ALT);
+
+    if (is_positive_char) {
+        return false;
+    }
+
+    // inverse range, some code point is left uncovered by the excluded ranges
+    std::sort(ranges.begin(), ranges.end());
+    uint64_t next = low;
+    for (const auto & range : ranges) {
+        if (range.first > next) {
+            return true;
+        }
+        next = std::max<uint64_t>(next, uint64_t(range.second) + 1);
+    }
+    return next <= high;
+}
+
+// the first bytes of the UTF-8 sequences that can satisfy the char range at pos, decoded like
+// decode_utf8; a byte that is not set rejects every piece starting with it. Memoized in the pool
+static const std::bitset<256> & llama_grammar_first_bytes(
+        llama_grammar_stack_pool      & pool,
+        const llama_grammar_element   * pos) {
+    static const int lookup[] = { 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 2, 2, 3, 4 };
+
+    auto it = pool.first_bytes.find(pos);
+    if (it != pool.first_bytes.end()) {
+        return it->second;
+    }
+
+    std::bitset<256> first;
+    for (uint32_t byte = 1; byte < 256; ++byte) {
+        const int n_remain = lookup[byte >> 4] - 1;
+        if (n_remain < 0) {
+            // continuation byte, invalid at the start of a sequence
+            continue;
+        }
+        // range of the code points the sequences starting with this byte decode to
+        const uint32_t low  = (byte & ((1 << (7 - n_remain)) - 1)) << (n_remain * 6);
+        const uint32_t high = low | ((1 << (n_remain * 6)) - 1);
+        first[byte] = llama_grammar_match_char_range(pos, low, high);
+    }
+
+    return pool.first_bytes.emplace(pos, first).first->second;
+}
+
+// transforms a grammar pushdown stack into N possible stacks, all ending
+// at a character range (terminal element); the distinct stacks are memoized in the pool
+static const std::vector<uint32_t> & llama_grammar_advance_stack(
+        const std::vector<std::vector<llama_grammar_element>> & rules,
+        llama_grammar_stack_pool                              & pool,
+        const uint32_t                                          stack) {
+
+    auto it = pool.advanced.find(stack);
+    if (it != pool.advanced.end()) {
+        return it->second;
+    }
+
+    std::vector<uint32_t> new_stacks;
+
+    if (stack == 0) {
+        new_stacks.push_back(stack);
+        return pool.advanced.emplace(stack, std::move(new_stacks)).first->second;
+    }
+
+    const llama_grammar_element * pos = pool.nodes[stack].elem;
+
+    switch (pos->type) {
+        case LLAMA_GRETYPE_RULE_REF: {
+            const size_t                  rule_id = static_cast<size_t>(pos->value);
+            const llama_grammar_element * subpos  = rules[rule_id].data();
+            do {
+                // init new stack without the top (pos)
+                uint32_t new_stack = pool.nodes[stack].below;
+                if (!llama_grammar_is_end_of_sequence(pos + 1)) {
+                    // if this rule ref is followed by another element, add that to stack
+                    new_stack = pool.push(new_stack, pos + 1);
+                }
+                if (!llama_grammar_is_end_of_sequence(subpos)) {
+                    // if alternate is nonempty, add to stack
+                    new_stack = pool.push(new_stack, subpos);
+                }
+                for (uint32_t advanced : llama_grammar_advance_stack(rules, pool, new_stack)) {
+                    if (std::find(new_stacks.begin(), new_stacks.end(), advanced) == new_stacks.end()) {
+                        new_stacks.push_back(advanced);
+                    }
+                }
+                while (!llama_grammar_is_end_of_sequence(subpos)) {
+                    // scan to end of alternate def
+                    subpos++;
+                }
+                if (subpos->type == LLAMA_GRETYPE_ALT) {
+                    // there's another alternate def of this rule to process
+                    subpos++;
+                } else {
+                    break;
+                }
+            } while (true);
+            break;
         }
         case LLAMA_GRETYPE_CHAR:
         case LLAMA_GRETYPE_CHAR_NOT:
-            new_stacks.emplace_back(stack);
+            new_stacks.push_back(stack);
             break;
         default:
             // end of alternate (LLAMA_GRETYPE_END, LLAMA_GRETYPE_ALT) or middle of char range
@@ -7147,34 +9461,58 @@ static void llama_grammar_advance_stack(
             // those
             GGML_ASSERT(false);
     }
+
+    return pool.advanced.emplace(stack, std::move(new_stacks)).first->second;
+}
+
+// the N possible stacks once the char range at the top of a non-empty stack is matched,
+// whatever the char; memoized in the pool
+static const std::vector<uint32_t> & llama_grammar_match_stack(
+        const std::vector<std::vector<llama_grammar_element>> & rules,
+        llama_grammar_stack_pool                              & pool,
+        const uint32_t                                          stack) {
+
+    auto it = pool.matched.find(stack);
+    if (it != pool.matched.end()) {
+        return it->second;
+    }
+
+    const auto * pos = llama_grammar_match_char(pool.nodes[stack].elem, 0).second;
+
+    // update top of stack to next element, if any
+    uint32_t new_stack = pool.nodes[stack].below;
+    if (!llama_grammar_is_end_of_sequence(pos)) {
+        new_stack = pool.push(new_stack, pos);
+    }
+
+    std::vector<uint32_t> new_stacks = llama_grammar_advance_stack(rules, pool, new_stack);
+    return pool.matched.emplace(stack, std::move(new_stacks)).first->second;
 }
 
 // takes a set of possible pushdown stacks on a grammar, which are required to
 // be positioned at a character range (see `llama_grammar_advance_stack`), and
-// produces the N possible stacks if the given char is accepted at those
+// produces the N distinct stacks if the given char is accepted at those
 // positions
-static std::vector<std::vector<const llama_grammar_element *>> llama_grammar_accept(
-        const std::vector<std::vector<llama_grammar_element>>         & rules,
-        const std::vector<std::vector<const llama_grammar_element *>> & stacks,
-        const uint32_t                                                  chr) {
+static std::vector<uint32_t> llama_grammar_accept(
+        const std::vector<std::vector<llama_grammar_element>> & rules,
+        llama_grammar_stack_pool                              & pool,
+        const std::vector<uint32_t>                           & stacks,
+        const uint32_t                                          chr) {
 
-    std::vector<std::vector<const llama_grammar_element *>> new_stacks;
+    std::vector<uint32_t>        new_stacks;
+    std::unordered_set<uint32_t> seen;
 
-    for (const auto & stack : stacks) {
-        if (stack.empty()) {
+    for (const uint32_t stack : stacks) {
+        if (stack == 0) {
             continue;
         }
 
-        auto match = llama_grammar_match_char(stack.back(), chr);
-        if (match.first) {
-            const llama_grammar_element * pos = match.second;
-
-            // update top of stack to next element, if any
-            std::vector<const llama_grammar_element *> new_stack(stack.begin(), stack.end() - 1);
-            if (!llama_grammar_is_end_of_sequence(pos)) {
-                new_stack.push_back(pos);
+        if (llama_grammar_match_char(pool.nodes[stack].elem, chr).first) {
+            for (uint32_t new_stack : llama_grammar_match_stack(rules, pool, stack)) {
+                if (seen.insert(new_stack).second) {
+                    new_stacks.push_back(new_stack);
+                }
             }
-            llama_grammar_advance_stack(rules, new_stack, new_stacks);
         }
     }
 
@@ -7182,18 +9520,20 @@ static std::vector<std::vector<const llama_grammar_element *>> llama_grammar_acc
 }
 
 static std::vector<llama_grammar_candidate> llama_grammar_reject_candidates(
-        const std::vector<std::vector<llama_grammar_element>>         & rules,
-        const std::vector<std::vector<const llama_grammar_element *>> & stacks,
-        const std::vector<llama_grammar_candidate>                    & candidates);
+        const std::vector<std::vector<llama_grammar_element>> & rules,
+        llama_grammar_stack_pool                              & pool,
+        const std::vector<uint32_t>                           & stacks,
+        const std::vector<llama_grammar_candidate>            & candidates);
 
 static std::vector<llama_grammar_candidate> llama_grammar_reject_candidates_for_stack(
         const std::vector<std::vector<llama_grammar_element>> & rules,
-        const std::vector<const llama_grammar_element *>      & stack,
+        llama_grammar_stack_pool                              & pool,
+        const uint32_t                                          stack,
         const std::vector<llama_grammar_candidate>            & candidates) {
 
     std::vector<llama_grammar_candidate> rejects;
 
-    if (stack.empty()) {
+    if (stack == 0) {
         for (const auto & tok : candidates) {
             if (*tok.code_points != 0 || tok.partial_utf8.n_remain != 0) {
                 rejects.push_back(tok);
@@ -7202,7 +9542,7 @@ static std::vector<llama_grammar_candidate> llama_grammar_reject_candidates_for_
         return rejects;
     }
 
-    const llama_grammar_element * stack_pos = stack.back();
+    const llama_grammar_element * stack_pos = pool.nodes[stack].elem;
 
     std::vector<llama_grammar_candidate> next_candidates;
     for (const auto & tok : candidates) {
@@ -7220,17 +9560,13 @@ static std::vector<llama_grammar_candidate> llama_grammar_reject_candidates_for_
         }
     }
 
-    const auto * stack_pos_after = llama_grammar_match_char(stack_pos, 0).second;
-
-    // update top of stack to next element, if any
-    std::vector<const llama_grammar_element *> stack_after(stack.begin(), stack.end() - 1);
-    if (!llama_grammar_is_end_of_sequence(stack_pos_after)) {
-        stack_after.push_back(stack_pos_after);
+    if (next_candidates.empty()) {
+        return rejects;
     }
-    std::vector<std::vector<const llama_grammar_element *>> next_stacks;
-    llama_grammar_advance_stack(rules, stack_after, next_stacks);
 
-    auto next_rejects = llama_grammar_reject_candidates(rules, next_stacks, next_candidates);
+    const auto & next_stacks = llama_grammar_match_stack(rules, pool, stack);
+
+    auto next_rejects = llama_grammar_reject_candidates(rules, pool, next_stacks, next_candidates);
     for (const auto & tok : next_rejects) {
         rejects.push_back({ tok.index, tok.code_points - 1, tok.partial_utf8 });
     }
@@ -7239,23 +9575,302 @@ static std::vector<llama_grammar_candidate> llama_grammar_reject_candidates_for_
 }
 
 static std::vector<llama_grammar_candidate> llama_grammar_reject_candidates(
-        const std::vector<std::vector<llama_grammar_element>>         & rules,
-        const std::vector<std::vector<const llama_grammar_element *>> & stacks,
-        const std::vector<llama_grammar_candidate>                    & candidates) {
+        const std::vector<std::vector<llama_grammar_element>> & rules,
+        llama_grammar_stack_pool                              & pool,
+        const std::vector<uint32_t>                           & stacks,
+        const std::vector<llama_grammar_candidate>            & candidates) {
     GGML_ASSERT(!stacks.empty()); // REVIEW
 
     if (candidates.empty()) {
         return std::vector<llama_grammar_candidate>();
     }
 
-    auto rejects = llama_grammar_reject_candidates_for_stack(rules, stacks.front(), candidates);
+    auto rejects = llama_grammar_reject_candidates_for_stack(rules, pool, stacks.front(), candidates);
 
     for (size_t i = 1, size = stacks.size(); i < size; ++i) {
-        rejects = llama_grammar_reject_candidates_for_stack(rules, stacks[i], rejects);
+        rejects = llama_grammar_reject_candidates_for_stack(rules, pool, stacks[i], rejects);
     }
     return rejects;
 }
 
+// state of a match of the token trie against the grammar, a subtree is matched only once per
+// distinct stack however many paths lead to it
+struct llama_grammar_trie_walk {
+    const std::vector<std::vector<llama_grammar_element>> & rules;
+    llama_grammar_stack_pool                              & pool;
+    const llama_token_trie                                & trie;
+    std::vector<uint64_t>                                 & allowed;
+
+    // by stack id, index of the stack in the vectors below
+    std::vector<uint32_t> slots;
+
+    std::vector<std::vector<bool>>              visited; // trie nodes matched from the stack
+    std::vector<const std::vector<uint32_t> *>  next;    // see llama_grammar_match_stack, resolved when needed
+    std::vector<const std::bitset<256> *>       first;   // see llama_grammar_first_bytes, null for the empty stack
+
+    // returns the slot of the stack, or UINT32_MAX if the node was already matched from it
+    uint32_t visit(uint32_t stack, uint32_t node) {
+        if (stack >= slots.size()) {
+            slots.resize(pool.nodes.size(), UINT32_MAX);
+        }
+        if (slots[stack] == UINT32_MAX) {
+            slots[stack] = visited.size();
+            visited.emplace_back(trie.nodes.size(), false);
+            next.push_back(nullptr);
+            first.push_back(stack != 0 ? &llama_grammar_first_bytes(pool, pool.nodes[stack].elem) : nullptr);
+        }
+        const uint32_t slot = slots[stack];
+        if (visited[slot][node]) {
+            return UINT32_MAX;
+        }
+        visited[slot][node] = true;
+        return slot;
+    }
+
+    void allow(uint32_t tok_begin, uint32_t tok_end) {
+        for (uint32_t t = tok_begin; t < tok_end; ++t) {
+            const int32_t id = trie.tokens[t];
+            allowed[id >> 6] |= uint64_t(1) << (id & 63);
+        }
+    }
+};
+
+// marks the tokens below the given trie node that can follow the bytes leading to it, given the
+// grammar stack after matching them and the incomplete UTF-8 sequence at their end, if any;
+// matches like llama_grammar_reject_candidates_for_stack, but every piece sharing a prefix is
+// matched only once. `continuing` is set while completing the sequence pending in the grammar,
+// whose continuation bytes are validated as in decode_utf8
+static void llama_grammar_accept_trie_for_stack(
+        llama_grammar_trie_walk  & walk,
+        const uint32_t             node,
+        const uint32_t             stack,
+        const llama_partial_utf8   partial_utf8,
+        const bool                 continuing) {
+    static const int lookup[] = { 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 2, 2, 3, 4 };
+
+    // the partial sequence only depends on the node, as all the pieces are decoded from the same state
+    const uint32_t slot = walk.visit(stack, node);
+    if (slot == UINT32_MAX) {
+        return;
+    }
+
+    const auto & trie      = walk.trie;
+    const auto & cur       = trie.nodes[node];
+    const auto * stack_pos = walk.pool.nodes[stack].elem;
+
+    for (uint32_t c = cur.child_begin; c < cur.child_end; ++c) {
+        const auto & child = trie.nodes[c];
+
+        if (child.byte == 0) {
+            // decoding stops at a 0 byte, so these pieces match like the one ending at this node
+            const bool allowed_here = node != 0 && (partial_utf8.n_remain == 0 ||
+                    (stack != 0 && llama_grammar_match_partial_char(stack_pos, partial_utf8)));
+            if (allowed_here) {
+                walk.allow(child.tok_begin, child.sub_end);
+            }
+            continue;
+        }
+
+        if (stack == 0) {
+            // nothing can follow the end of the grammar
+            continue;
+        }
+
+        if (partial_utf8.n_remain == 0 && !walk.first[slot]->test(child.byte)) {
+            // no sequence starting with this byte satisfies this position, prunes the whole subtree
+            continue;
+        }
+
+        // same decoding as decode_utf8
+        uint32_t value;
+        int      n_remain;
+        if (continuing && (child.byte >> 6) != 2) {
+            // invalid continuation of the pending sequence, rejects the whole subtree
+            continue;
+        }
+        if (partial_utf8.n_remain > 0) {
+            value    = (partial_utf8.value << 6) + (child.byte & 0x3F);
+            n_remain = partial_utf8.n_remain - 1;
+        } else {
+            n_remain = lookup[child.byte >> 4] - 1;
+            if (n_remain < 0) {
+                // invalid sequence, rejects the whole subtree
+                continue;
+            }
+            value = child.byte & ((1 << (7 - n_remain)) - 1);
+        }
+
+        if (n_remain > 0) {
+            // pieces ending in an incomplete sequence are accepted iff it can satisfy this position,
+            // longer pieces are matched once their code point is complete
+            if (llama_grammar_match_partial_char(stack_pos, { value, n_remain })) {
+                walk.allow(child.tok_begin, child.tok_end);
+            }
+            llama_grammar_accept_trie_for_stack(walk, c, stack, { value, n_remain }, continuing);
+            continue;
+        }
+
+        // single bytes are fully checked by the first bytes of the position
+        if (partial_utf8.n_remain > 0 && !llama_grammar_match_char(stack_pos, value).first) {
+            // prunes every piece starting with this prefix
+            continue;
+        }
+
+        walk.allow(child.tok_begin, child.tok_end);
+
+        // references to the memoized stacks stay valid while the pool grows
+        if (walk.next[slot] == nullptr) {
+            walk.next[slot] = &llama_grammar_match_stack(walk.rules, walk.pool, stack);
+        }
+        const std::vector<uint32_t> & next_stacks = *walk.next[slot];
+        for (size_t i = 0; i < next_stacks.size(); ++i) {
+            llama_grammar_accept_trie_for_stack(walk, c, next_stacks[i], { 0, 0 }, false);
+        }
+    }
+}
+
+// sets the bits of the tokens of the trie accepted by any of the stacks after the pending partial
+// sequence, one bit per token; the complement of llama_grammar_reject_candidates over the vocabulary
+static void llama_grammar_accept_trie(
+        const std::vector<std::vector<llama_grammar_element>> & rules,
+        llama_grammar_stack_pool                              & pool,
+        const std::vector<uint32_t>                           & stacks,
+        const llama_partial_utf8                                partial_utf8,
+        const llama_token_trie                                & trie,
+        std::vector<uint64_t>                                 & allowed) {
+    allowed.assign((trie.token_node.size() + 63) / 64, 0);
+
+    // like decode_utf8, start from a code point boundary unless a sequence is pending
+    const llama_partial_utf8 partial_start = partial_utf8.n_remain > 0 ? partial_utf8 : llama_partial_utf8{ 0, 0 };
+
+    llama_grammar_trie_walk walk = { rules, pool, trie, allowed, {}, {}, {}, {} };
+    for (const uint32_t stack : stacks) {
+        llama_grammar_accept_trie_for_stack(walk, 0, stack, partial_start, partial_start.n_remain > 0);
+    }
+}
+
+// rule buffers sorted by address, to find the rule a stack element points into
+static std::vector<std::pair<const llama_grammar_element *, size_t>> llama_grammar_rule_starts(
+        const std::vector<std::vector<llama_grammar_element>> & rules) {
+    std::vector<std::pair<const llama_grammar_element *, size_t>> rule_starts;
+    rule_starts.reserve(rules.size());
+    for (size_t ir = 0; ir < rules.size(); ir++) {
+        if (!rules[ir].empty()) {
+            rule_starts.emplace_back(rules[ir].data(), ir);
+        }
+    }
+    std::sort(rule_starts.begin(), rule_starts.end());
+    return rule_starts;
+}
+
+// finds the rule and the offset in it of a stack element, returns false if it is not in the rules
+static bool llama_grammar_find_element(
+        const std::vector<std::vector<llama_grammar_element>>             & rules,
+        const std::vector<std::pair<const llama_grammar_element *, size_t>> & rule_starts,
+        const llama_grammar_element                                       * elem,
+        size_t                                                            & rule_index,
+        size_t                                                            & offset) {
+    auto it = std::upper_bound(rule_starts.begin(), rule_starts.end(), std::make_pair(elem, SIZE_MAX));
+    if (it == rule_starts.begin()) {
+        return false;
+    }
+    --it;
+    const auto & rule = rules[it->second];
+    if (elem >= rule.data() + rule.size()) {
+        return false;
+    }
+    rule_index = it->second;
+    offset     = elem - rule.data();
+    return true;
+}
+
+// canonical state of the grammar for the mask cache: the sorted set of stacks, with their elements
+// as (rule, offset) pairs so that it does not depend on where the rules are stored, and the
+// pending partial UTF-8 sequence
+static llama_grammar_mask_cache::key_t llama_grammar_mask_key(const struct llama_grammar * grammar) {
+    const auto rule_starts = llama_grammar_rule_starts(grammar->rules);
+
+    std::vector<std::vector<uint32_t>> stacks;
+    stacks.reserve(grammar->stacks.size());
+    for (const uint32_t id : grammar->stacks) {
+        const auto stack = grammar->pool.get(id);
+        std::vector<uint32_t> encoded;
+        encoded.reserve(2*stack.size());
+        for (const auto * elem : stack) {
+            size_t rule_index = 0;
+            size_t offset     = 0;
+            if (!llama_grammar_find_element(grammar->rules, rule_starts, elem, rule_index, offset)) {
+                GGML_ASSERT(false && "grammar stack points outside of its rules");
+            }
+            encoded.push_back(rule_index);
+            encoded.push_back(offset);
+        }
+        stacks.push_back(std::move(encoded));
+    }
+    std::sort(stacks.begin(), stacks.end());
+    stacks.erase(std::unique(stacks.begin(), stacks.end()), stacks.end());
+
+    llama_grammar_mask_cache::key_t key;
+    if (grammar->partial_utf8.n_remain > 0) {
+        key.push_back(grammar->partial_utf8.value);
+        key.push_back(grammar->partial_utf8.n_remain);
+    } else {
+        key.push_back(0);
+        key.push_back(0);
+    }
+    for (const auto & stack : stacks) {
+        key.push_back(stack.size());
+        key.insert(key.end(), stack.begin(), stack.end());
+    }
+    return key;
+}
+
+// builds the initial stacks from the alternates of the start rule
+static void llama_grammar_init_stacks(
+        const std::vector<std::vector<llama_grammar_element>> & rules,
+        const size_t                                            start_rule_index,
+        llama_grammar_stack_pool                              & pool,
+        std::vector<uint32_t>                                 & stacks) {
+    const llama_grammar_element * pos = rules[start_rule_index].data();
+    do {
+        uint32_t stack = 0;
+        if (!llama_grammar_is_end_of_sequence(pos)) {
+            // if alternate is nonempty, add to stack
+            stack = pool.push(stack, pos);
+        }
+        for (uint32_t advanced : llama_grammar_advance_stack(rules, pool, stack)) {
+            if (std::find(stacks.begin(), stacks.end(), advanced) == stacks.end()) {
+                stacks.push_back(advanced);
+            }
+        }
+        while (!llama_grammar_is_end_of_sequence(pos)) {
+            // scan to end of alternate def
+            pos++;
+        }
+        if (pos->type == LLAMA_GRETYPE_ALT) {
+            // there's another alternate def of this rule to process
+            pos++;
+        } else {
+            break;
+        }
+    } while (true);
+}
+
+// rebuilds the pool with only the given stacks, after the rules changed or once it grew too large
+static void llama_grammar_rebuild_stacks(struct llama_grammar * grammar) {
+    std::vector<std::vector<const llama_grammar_element *>> stacks;
+    stacks.reserve(grammar->stacks.size());
+    for (const uint32_t id : grammar->stacks) {
+        stacks.push_back(grammar->pool.get(id));
+    }
+
+    grammar->pool.clear();
+    grammar->stacks.clear();
+    for (const auto & stack : stacks) {
+        grammar->stacks.push_back(grammar->pool.push(0, stack));
+    }
+}
+
 //
 // grammar - external
 //
@@ -7275,29 +9890,80 @@ struct llama_grammar * llama_grammar_init(
         vec_rules[i].push_back({LLAMA_GRETYPE_END, 0});
     }
 
+    llama_grammar * grammar = new llama_grammar{ std::move(vec_rules), {}, {}, {}, nullptr };
+
     // loop over alternates of start rule to build initial stacks
-    std::vector<std::vector<const llama_grammar_element *>> stacks;
-    pos = rules[start_rule_index];
-    do {
-        std::vector<const llama_grammar_element *> stack;
-        if (!llama_grammar_is_end_of_sequence(pos)) {
-            // if alternate is nonempty, add to stack
-            stack.push_back(pos);
+    llama_grammar_init_stacks(grammar->rules, start_rule_index, grammar->pool, grammar->stacks);
+
+    return grammar;
+}
+
+void llama_grammar_update_rules(
+            struct llama_grammar * grammar,
+     const llama_grammar_element ** rules,
+                          size_t    n_rules,
+                  const uint32_t  * changed_rules,
+                          size_t    n_changed_rules,
+                         int64_t    start_rule_index) {
+    auto & vec_rules = grammar->rules;
+
+    std::vector<bool> changed(n_rules, false);
+    for (size_t i = 0; i < n_changed_rules; i++) {
+        GGML_ASSERT(changed_rules[i] < n_rules);
+        changed[changed_rules[i]] = true;
+    }
+    for (size_t i = vec_rules.size(); i < n_rules; i++) {
+        changed[i] = true;
+    }
+
+    // element ranges of the definitions that are about to be replaced
+    std::vector<std::pair<const llama_grammar_element *, const llama_grammar_element *>> replaced;
+    for (size_t i = 0; i < vec_rules.size(); i++) {
+        if (i >= n_rules || changed[i]) {
+            replaced.emplace_back(vec_rules[i].data(), vec_rules[i].data() + vec_rules[i].size());
         }
-        llama_grammar_advance_stack(vec_rules, stack, stacks);
-        while (!llama_grammar_is_end_of_sequence(pos)) {
-            // scan to end of alternate def
-            pos++;
+    }
+
+    // moving the outer vector keeps the element buffers of the unchanged rules in place
+    vec_rules.resize(n_rules);
+    for (size_t i = 0; i < n_rules; i++) {
+        if (!changed[i]) {
+            continue;
         }
-        if (pos->type == LLAMA_GRETYPE_ALT) {
-            // there's another alternate def of this rule to process
-            pos++;
-        } else {
-            break;
+        vec_rules[i].clear();
+        for (const llama_grammar_element * pos = rules[i]; pos->type != LLAMA_GRETYPE_END; pos++) {
+            vec_rules[i].push_back(*pos);
         }
-    } while (true);
+        vec_rules[i].push_back({LLAMA_GRETYPE_END, 0});
+    }
 
-    return new llama_grammar{ std::move(vec_rules), std::move(stacks), {} };
+    // the masks may depend on any of the changed rules
+    if (grammar->mask_cache) {
+        grammar->mask_cache = std::make_shared<llama_grammar_mask_cache>(grammar->mask_cache->n_max);
+    }
+
+    if (start_rule_index >= 0) {
+        grammar->pool.clear();
+        grammar->stacks.clear();
+        llama_grammar_init_stacks(vec_rules, start_rule_index, grammar->pool, grammar->stacks);
+        return;
+    }
+
+    const auto & pool   = grammar->pool;
+    auto       & stacks = grammar->stacks;
+    stacks.erase(std::remove_if(stacks.begin(), stacks.end(), [&](uint32_t stack) {
+        for (uint32_t id = stack; id != 0; id = pool.nodes[id].below) {
+            for (const auto & range : replaced) {
+                if (range.first <= pool.nodes[id].elem && pool.nodes[id].elem < range.second) {
+                    return true;
+                }
+            }
+        }
+        return false;
+    }), stacks.end());
+
+    // the memoized transitions may go through the changed rules
+    llama_grammar_rebuild_stacks(grammar);
 }
 
 void llama_grammar_free(struct llama_grammar * grammar) {
@@ -7305,28 +9971,61 @@ void llama_grammar_free(struct llama_grammar * grammar) {
 }
 
 struct llama_grammar * llama_grammar_copy(const struct llama_grammar * grammar) {
-    llama_grammar * result = new llama_grammar{ grammar->rules, grammar->stacks, grammar->partial_utf8 };
-
-    // redirect elements in stacks to point to new rules
-    for (size_t is = 0; is < result->stacks.size(); is++) {
-        for (size_t ie = 0; ie < result->stacks[is].size(); ie++) {
-            for (size_t ir0 = 0; ir0 < grammar->rules.size(); ir0++) {
-                for (size_t ir1 = 0; ir1 < grammar->rules[ir0].size(); ir1++) {
-                    if (grammar->stacks[is][ie] == &grammar->rules[ir0][ir1]) {
-                         result->stacks[is][ie]  =  &result->rules[ir0][ir1];
-                    }
-                }
-            }
+    llama_grammar * result = new llama_grammar{ grammar->rules, grammar->pool, grammar->stacks, grammar->partial_utf8, grammar->mask_cache };
+
+    const auto rule_starts = llama_grammar_rule_starts(grammar->rules);
+
+    // redirect elements in stacks to point to new rules, the ids and memoized transitions stay the same
+    auto & pool = result->pool;
+    pool.index.clear();
+    pool.first_bytes.clear();
+    for (uint32_t id = 1; id < pool.nodes.size(); id++) {
+        auto & node = pool.nodes[id];
+        size_t rule_index = 0;
+        size_t offset     = 0;
+        if (llama_grammar_find_element(grammar->rules, rule_starts, node.elem, rule_index, offset)) {
+            node.elem = result->rules[rule_index].data() + offset;
         }
+        pool.index.emplace(std::make_pair(node.elem, node.below), id);
     }
 
     return result;
 }
 
+void llama_grammar_copy_partial_utf8(struct llama_grammar * dst, const struct llama_grammar * src) {
+    dst->partial_utf8 = src != nullptr ? src->partial_utf8 : llama_partial_utf8{ 0, 0 };
+}
+
 size_t llama_grammar_get_stack_size(const struct llama_grammar * grammar) {
     return grammar->stacks.size();
 }
 
+void llama_grammar_set_mask_cache(struct llama_grammar * grammar, size_t n_max) {
+    if (n_max == 0) {
+        grammar->mask_cache.reset();
+    } else if (!grammar->mask_cache || grammar->mask_cache->n_max != n_max) {
+        grammar->mask_cache = std::make_shared<llama_grammar_mask_cache>(n_max);
+    }
+}
+
+struct llama_grammar_mask_cache_stats llama_grammar_get_mask_cache_stats(const struct llama_grammar * grammar) {
+    struct llama_grammar_mask_cache_stats result = { 0, 0, 0, 0 };
+
+    if (grammar->mask_cache) {
+        auto & cache = *grammar->mask_cache;
+        std::lock_guard<std::mutex> lock(cache.mutex);
+
+        result.n_hit   = cache.n_hit;
+        result.n_miss  = cache.n_miss;
+        result.n_masks = cache.entries.size();
+        for (const auto & entry : cache.entries) {
+            result.n_bytes += entry.second.size()*sizeof(uint64_t);
+        }
+    }
+
+    return result;
+}
+
 //
 // sampling
 //
@@ -7338,27 +10037,91 @@ void llama_set_rng_seed(struct llama_context * ctx, uint32_t seed) {
     ctx->rng.seed(seed);
 }
 
-void llama_sample_softmax(struct llama_context * ctx, llama_token_data_array * candidates) {
-    GGML_ASSERT(candidates->size > 0);
+// the samplers that keep a few of the candidates select them instead of sorting all of them when there are at least
+// this many candidates
+#define LLAMA_SAMPLE_SELECT_MIN 1024
 
-    const int64_t t_start_sample_us = ggml_time_us();
+// an unsigned key with the order of the logit
+static inline uint32_t llama_sample_logit_key(float logit) {
+    uint32_t u;
+    memcpy(&u, &logit, sizeof(u));
+    return (u & 0x80000000) ? ~u : (u | 0x80000000);
+}
 
-    // Sort the logits in descending order
-    if (!candidates->sorted) {
-        std::sort(candidates->data, candidates->data + candidates->size, [](const llama_token_data & a, const llama_token_data & b) {
-            return a.logit > b.logit;
-        });
-        candidates->sorted = true;
-    }
+// moves the k candidates with the largest logits to the front, sorted by decreasing logit: the histogram of the high
+// bits of the keys of the logits gives the bucket of the k-th largest logit, and only the candidates of this bucket
+// and of the buckets above it are sorted
+static void llama_sample_select_top(llama_token_data * data, size_t n, size_t k) {
+    auto comp = [](const llama_token_data & a, const llama_token_data & b) {
+        return a.logit > b.logit;
+    };
 
-    float max_l = candidates->data[0].logit;
-    float cum_sum = 0.0f;
-    for (size_t i = 0; i < candidates->size; ++i) {
-        float p = expf(candidates->data[i].logit - max_l);
-        candidates->data[i].p = p;
-        cum_sum += p;
+    if (k >= n) {
+        std::sort(data, data + n, comp);
+        return;
     }
-    for (size_t i = 0; i < candidates->size; ++i) {
+
+    const int n_bits = 11;
+
+    uint32_t hist[1 << n_bits] = {0};
+    for (size_t i = 0; i < n; ++i) {
+        hist[llama_sample_logit_key(data[i].logit) >> (32 - n_bits)]++;
+    }
+
+    size_t n_above = 0;
+    uint32_t bucket = (1 << n_bits) - 1;
+    for (; bucket > 0; --bucket) {
+        if (n_above + hist[bucket] >= k) {
+            break;
+        }
+        n_above += hist[bucket];
+    }
+
+    const uint32_t key_min = bucket << (32 - n_bits);
+
+    llama_token_data * end = std::partition(data, data + n, [key_min](const llama_token_data & c) {
+        return llama_sample_logit_key(c.logit) >= key_min;
+    });
+
+    std::partial_sort(data, data + k, end, comp);
+}
+
+// the sum of the exponentials of the logits minus the largest logit, returned in max_l
+static float llama_sample_exp_sum(const llama_token_data_array * candidates, float & max_l) {
+    max_l = -INFINITY;
+    for (size_t i = 0; i < candidates->size; ++i) {
+        max_l = std::max(max_l, candidates->data[i].logit);
+    }
+
+    float sum = 0.0f;
+    for (size_t i = 0; i < candidates->size; ++i) {
+        sum += expf(candidates->data[i].logit - max_l);
+    }
+
+    return sum;
+}
+
+void llama_sample_softmax(struct llama_context * ctx, llama_token_data_array * candidates) {
+    GGML_ASSERT(candidates->size > 0);
+
+    const int64_t t_start_sample_us = ggml_time_us();
+
+    // Sort the logits in descending order
+    if (!candidates->sorted) {
+        std::sort(candidates->data, candidates->data + candidates->size, [](const llama_token_data & a, const llama_token_data & b) {
+            return a.logit > b.logit;
+        });
+        candidates->sorted = true;
+    }
+
+    float max_l = candidates->data[0].logit;
+    float cum_sum = 0.0f;
+    for (size_t i = 0; i < candidates->size; ++i) {
+        float p = expf(candidates->data[i].logit - max_l);
+        candidates->data[i].p = p;
+        cum_sum += p;
+    }
+    for (size_t i = 0; i < candidates->size; ++i) {
         candidates->data[i].p /= cum_sum;
     }
 
@@ -7380,6 +10143,9 @@ void llama_sample_top_k(struct llama_context * ctx, llama_token_data_array * can
         };
         if (k == (int) candidates->size) {
             std::sort(candidates->data, candidates->data + candidates->size, comp);
+        } else if (candidates->size >= LLAMA_SAMPLE_SELECT_MIN && (size_t) k >= candidates->size/64) {
+            // the heap of partial_sort rejects most of the candidates with a single comparison when k is small
+            llama_sample_select_top(candidates->data, candidates->size, k);
         } else {
             std::partial_sort(candidates->data, candidates->data + k, candidates->data + candidates->size, comp);
         }
@@ -7397,6 +10163,39 @@ void llama_sample_top_p(struct llama_context * ctx, llama_token_data_array * can
         return;
     }
 
+    if (!candidates->sorted && candidates->size >= LLAMA_SAMPLE_SELECT_MIN) {
+        const int64_t t_start_sample_us = ggml_time_us();
+
+        // the candidates with the largest logits are selected until their cumulative probability reaches p, instead
+        // of sorting all of them, with the probabilities over all the candidates
+        float max_l;
+        const float sum = llama_sample_exp_sum(candidates, max_l);
+
+        for (size_t n_top = std::max(min_keep, (size_t) 64); 4*n_top < candidates->size; n_top *= 8) {
+            llama_sample_select_top(candidates->data, candidates->size, n_top);
+
+            float cum_sum = 0.0f;
+            for (size_t i = 0; i < n_top; ++i) {
+                candidates->data[i].p = expf(candidates->data[i].logit - max_l) / sum;
+                cum_sum += candidates->data[i].p;
+
+                if (cum_sum >= p && i + 1 >= min_keep) {
+                    candidates->size   = i + 1;
+                    candidates->sorted = true;
+
+                    if (ctx) {
+                        ctx->t_sample_us += ggml_time_us() - t_start_sample_us;
+                    }
+                    return;
+                }
+            }
+        }
+
+        if (ctx) {
+            ctx->t_sample_us += ggml_time_us() - t_start_sample_us;
+        }
+    }
+
     llama_sample_softmax(ctx, candidates);
 
     const int64_t t_start_sample_us = ggml_time_us();
@@ -7429,6 +10228,37 @@ void llama_sample_min_p(struct llama_context * ctx, llama_token_data_array * can
         return;
     }
 
+    if (!candidates->sorted && candidates->size >= LLAMA_SAMPLE_SELECT_MIN) {
+        const int64_t t_start_sample_us = ggml_time_us();
+
+        // the probability of a token is at least p times the largest one if its logit is at least the largest logit
+        // plus log(p): the matching tokens are counted and selected instead of sorting all the candidates
+        float max_l;
+        const float sum = llama_sample_exp_sum(candidates, max_l);
+
+        const float min_l = max_l + logf(p);
+
+        size_t n_keep = 0;
+        for (size_t i = 0; i < candidates->size; ++i) {
+            n_keep += candidates->data[i].logit >= min_l;
+        }
+        n_keep = std::min(std::max(n_keep, std::max(min_keep, (size_t) 1)), candidates->size);
+
+        llama_sample_select_top(candidates->data, candidates->size, n_keep);
+
+        for (size_t i = 0; i < n_keep; ++i) {
+            candidates->data[i].p = expf(candidates->data[i].logit - max_l) / sum;
+        }
+
+        candidates->size   = n_keep;
+        candidates->sorted = true;
+
+        if (ctx) {
+            ctx->t_sample_us += ggml_time_us() - t_start_sample_us;
+        }
+        return;
+    }
+
     llama_sample_softmax(ctx, candidates);
 
     const int64_t t_start_sample_us = ggml_time_us();
@@ -7636,13 +10466,72 @@ void llama_sample_repetition_penalties(
     }
 }
 
+void llama_sample_repetition_penalties_counted(
+            struct llama_context * ctx,
+          llama_token_data_array * candidates,
+               const llama_token * tokens,
+                   const int32_t * counts,
+                          size_t   n_tokens,
+                           float   penalty_repeat,
+                           float   penalty_freq,
+                           float   penalty_present) {
+    if (n_tokens == 0 || (penalty_repeat == 1.0f && penalty_freq == 0.0f && penalty_present == 0.0f)) {
+        return;
+    }
+
+    const int64_t t_start_sample_us = ggml_time_us();
+
+    const auto by_id = [](const llama_token_data & a, llama_token id) { return a.id < id; };
+
+    llama_token_data * begin = candidates->data;
+    llama_token_data * end   = candidates->data + candidates->size;
+
+    // a token is found at the index of its id in the full candidates, otherwise the candidates are searched
+    // by id if they are sorted by id, and scanned if not; -1 until checked
+    int sorted_by_id = -1;
+
+    for (size_t i = 0; i < n_tokens; ++i) {
+        const llama_token id = tokens[i];
+
+        llama_token_data * cur = end;
+        if ((size_t) id < candidates->size && begin[id].id == id) {
+            cur = begin + id;
+        } else {
+            if (sorted_by_id < 0) {
+                sorted_by_id = std::is_sorted(begin, end, [](const llama_token_data & a, const llama_token_data & b) { return a.id < b.id; });
+            }
+            cur = sorted_by_id ? std::lower_bound(begin, end, id, by_id)
+                               : std::find_if(begin, end, [id](const llama_token_data & a) { return a.id == id; });
+        }
+        if (cur == end || cur->id != id) {
+            continue;
+        }
+
+        const int count = counts[i];
+
+        if (cur->logit <= 0) {
+            cur->logit *= penalty_repeat;
+        } else {
+            cur->logit /= penalty_repeat;
+        }
+
+        cur->logit -= float(count) * penalty_freq + float(count > 0) * penalty_present;
+    }
+
+    candidates->sorted = false;
+
+    if (ctx) {
+        ctx->t_sample_us += ggml_time_us() - t_start_sample_us;
+    }
+}
+
 void llama_sample_grammar(struct llama_context * ctx, llama_token_data_array * candidates, const struct llama_grammar * grammar) {
     GGML_ASSERT(ctx);
     const int64_t t_start_sample_us = ggml_time_us();
 
     bool allow_eos = false;
-    for (const auto & stack : grammar->stacks) {
-        if (stack.empty()) {
+    for (const uint32_t stack : grammar->stacks) {
+        if (stack == 0) {
             allow_eos = true;
             break;
         }
@@ -7650,131 +10539,105 @@ void llama_sample_grammar(struct llama_context * ctx, llama_token_data_array * c
 
     const llama_token eos = llama_token_eos(&ctx->model);
 
-    std::vector<std::pair<std::vector<uint32_t>, llama_partial_utf8>> candidates_decoded;
-    candidates_decoded.reserve(candidates->size);
-    std::vector<llama_grammar_candidate>                              candidates_grammar;
-    candidates_grammar.reserve(candidates->size);
+    const auto & trie = ctx->model.vocab.trie;
 
-    std::ofstream log_file;
-    // Open the log file in append mode
-    log_file.open("log.txt", std::ios::app);
-    log_file << "Top 20 Logits:" << std::endl;
 
-    float highest_whitespace_logit = -1;
-    uint32_t space_codepoint = 0x0020;
-    size_t whitespace_candidate_index;
-    for (size_t i = 0; i < candidates->size; ++i) {
-        const llama_token id    = candidates->data[i].id;
-        const std::string piece = llama_token_to_piece(ctx, id);
-        if (piece == " ") {
-            whitespace_candidate_index = i;
+    // tokens allowed by the grammar, one bit per token of the vocabulary
+    std::vector<uint64_t> allowed;
+
+    llama_grammar_mask_cache * cache = grammar->mask_cache.get();
+    if (cache != nullptr) {
+        const auto key = llama_grammar_mask_key(grammar);
+
+        bool hit = false;
+        {
+            std::lock_guard<std::mutex> lock(cache->mutex);
+            if (cache->trie != &trie) {
+                // the grammar is used with another model
+                cache->entries.clear();
+                cache->index.clear();
+                cache->trie = &trie;
+            }
+            auto it = cache->index.find(key);
+            if (it != cache->index.end()) {
+                cache->entries.splice(cache->entries.begin(), cache->entries, it->second);
+                allowed = it->second->second;
+                cache->n_hit++;
+                hit = true;
+            } else {
+                cache->n_miss++;
+            }
+        }
+
+        if (!hit) {
+            llama_grammar_accept_trie(grammar->rules, grammar->pool, grammar->stacks, grammar->partial_utf8, trie, allowed);
+
+            std::lock_guard<std::mutex> lock(cache->mutex);
+            if (cache->trie == &trie && cache->index.find(key) == cache->index.end()) {
+                cache->entries.emplace_front(key, allowed);
+                cache->index[key] = cache->entries.begin();
+                while (cache->entries.size() > cache->n_max) {
+                    cache->index.erase(cache->entries.back().first);
+                    cache->entries.pop_back();
+                }
+            }
         }
+    } else {
+        llama_grammar_accept_trie(grammar->rules, grammar->pool, grammar->stacks, grammar->partial_utf8, trie, allowed);
+    }
+
+    // rejected[i] is set for the candidates matched against the grammar and rejected by it
+    std::vector<bool> rejected(candidates->size, false);
+
+    for (size_t i = 0; i < candidates->size; ++i) {
+        const llama_token id = candidates->data[i].id;
         if (id == eos) {
             if (!allow_eos) {
                 candidates->data[i].logit = -INFINITY;
             }
-        } else if (piece.empty() || piece[0] == 0) {
+        } else if (trie.token_node[id] == 0) {
+            // empty piece or starting with a 0 byte
             candidates->data[i].logit = -INFINITY;
         } else {
-            candidates_decoded.push_back(decode_utf8(piece, grammar->partial_utf8));
-            candidates_grammar.push_back({ i, candidates_decoded.back().first.data(), candidates_decoded.back().second });
-            auto const &codepoints = candidates_decoded.back().first;
-            float const logit = candidates->data[i].logit;
-            if (logit > highest_whitespace_logit && !codepoints.empty() && codepoints[0] == space_codepoint) {
-                highest_whitespace_logit = logit;
-            }
+            rejected[i] = !((allowed[id >> 6] >> (id & 63)) & 1);
         }
     }
-    // candidates->data[whitespace_candidate_index].logit = highest_whitespace_logit;
-    // log_file << "whitespace_candidate_index = " << whitespace_candidate_index << std::endl;
-    // log_file << "highest_whitespace_logit = " << highest_whitespace_logit << std::endl << std::endl;
-
-    std::vector<size_t> all_vector;
-    for (size_t i = 0; i < candidates->size; ++i) {
-        all_vector.push_back(i);
-    }
-    std::sort(all_vector.begin(), all_vector.end(), [&candidates](size_t a, size_t b) {
-        return candidates->data[a].logit > candidates->data[b].logit;
-    });
 
-    const auto rejects = llama_grammar_reject_candidates(grammar->rules, grammar->stacks, candidates_grammar);
-    std::unordered_set<size_t> rejected_indices;
-    for (const auto & reject : rejects) {
-        rejected_indices.insert(reject.index);
+    // candidate index of each token, to look up the accepted candidates along the trie
+    std::vector<int32_t> candidate_index(trie.token_node.size(), -1);
+    for (size_t i = 0; i < candidates->size; i++) {
+        candidate_index[candidates->data[i].id] = i;
     }
 
-    std::unordered_map<std::string, size_t> accepted_tokens;
-    for (size_t i = 0; i < candidates->size; i++) {
-        if (rejected_indices.find(i) == rejected_indices.end()) {
-            accepted_tokens[llama_token_to_piece(ctx, candidates->data[i].id)] = i;
-        }
-    }
-
-    int num_logits_logged = 0;
-    for (const auto & i : all_vector) {
-        if (log_file.is_open()) {
-            bool rejected = false;
-            bool prefix_found = false;
-            size_t prefix_index = 0;
-            for (const auto & reject : rejects) {
-                if (reject.index == i) {
-                    std::string rejected_token = llama_token_to_piece(ctx, candidates->data[reject.index].id);
-                    for (int i = rejected_token.size() - 1; i > 0; i--) {
-                        auto found = accepted_tokens.find(rejected_token.substr(0, i));
-                        if (found != accepted_tokens.end()) {
-                            prefix_index = found->second;
-                            prefix_found = true;
-                            break;
-                        }
-                    }
-                    if (prefix_found) {
-                        candidates->data[prefix_index].logit = fmax(candidates->data[i].logit, candidates->data[prefix_index].logit);
-                    }
-                    rejected = true;
-                    break;
+    // finds the accepted candidate with the longest piece that is a proper prefix of the piece of candidate i
+    auto find_accepted_prefix = [&](size_t i, size_t & prefix_index) {
+        for (uint32_t n = trie.nodes[trie.token_node[candidates->data[i].id]].parent; n != 0; n = trie.nodes[n].parent) {
+            int32_t found = -1;
+            for (uint32_t t = trie.nodes[n].tok_begin; t < trie.nodes[n].tok_end; ++t) {
+                const int32_t j = candidate_index[trie.tokens[t]];
+                if (j > found && !rejected[j]) {
+                    found = j;
                 }
             }
-            // Log the top 20 logits
-            if (num_logits_logged <= 20) {
-                log_file << llama_token_to_piece(ctx, candidates->data[i].id) << ":" << candidates->data[i].logit <<
-                    (rejected ? (prefix_found ? "\tprefix accepted:" + llama_token_to_piece(ctx, candidates->data[prefix_index].id) : "\trejected") : "") << std::endl;
+            if (found >= 0) {
+                prefix_index = found;
+                return true;
             }
+        }
+        return false;
+    };
 
-            if (rejected) {
-                candidates->data[i].logit = -INFINITY;
-            }
-        } else {
-            // Handle the error if the file couldn't be opened
-            std::cerr << "Unable to open the log file." << std::endl;
-        }
-        num_logits_logged++;
-    }
-
-    auto it = std::find_if(rejects.begin(), rejects.end(), [&](const llama_grammar_candidate& reject) { return reject.index == all_vector[0]; });
-    if (it != rejects.end()) {
-        log_file << "Rejected the highest logit candidate " <<
-            llama_token_to_piece(ctx, candidates->data[all_vector[0]].id) << " with logit " << candidates->data[all_vector[0]].logit << std::endl;
-    }
-
-    // Print accepted candidates
-    // std::vector<size_t> accepted_vector;
-    // for (const auto & i : accepted_indices) {
-    //     accepted_vector.push_back(i);
-    // }
-    // std::sort(accepted_vector.begin(), accepted_vector.end(), [&candidates](size_t a, size_t b) {
-    //     return candidates->data[a].logit > candidates->data[b].logit;
-    // });
-
-    // for (const auto & i : accepted_vector) {
-    //     if (log_file.is_open()) {
-    //         log_file << llama_token_to_piece(ctx, candidates->data[i].id) << ":" << candidates->data[i].logit << std::endl;
-    //     } else {
-    //         // Handle the error if the file couldn't be opened
-    //         std::cerr << "Unable to open the log file." << std::endl;
-    //     }
-    // }
-    // Close the file
-    log_file.close();
+    // a rejected candidate gives its logit to the accepted candidate with the longest prefix of its piece
+    for (size_t i = 0; i < candidates->size; ++i) {
+        if (!rejected[i]) {
+            continue;
+        }
+        size_t prefix_index = 0;
+        if (find_accepted_prefix(i, prefix_index)) {
+            candidates->data[prefix_index].logit = fmax(candidates->data[i].logit, candidates->data[prefix_index].logit);
+        }
+        candidates->data[i].logit = -INFINITY;
+    }
 
     ctx->t_sample_us += ggml_time_us() - t_start_sample_us;
 }
@@ -7798,6 +10661,14 @@ void llama_sample_classifier_free_guidance(
         llama_token_data_array * candidates,
           struct llama_context * guidance_ctx,
                          float   scale) {
+    llama_sample_classifier_free_guidance_logits(ctx, candidates, llama_get_logits(guidance_ctx), scale);
+}
+
+void llama_sample_classifier_free_guidance_logits(
+          struct llama_context * ctx,
+        llama_token_data_array * candidates,
+                         float * logits_guidance,
+                         float   scale) {
     int64_t t_start_sample_us = ggml_time_us();
 
     GGML_ASSERT(ctx);
@@ -7814,7 +10685,6 @@ void llama_sample_classifier_free_guidance(
     }
     llama_log_softmax(logits_base.data(), candidates->size);
 
-    float* logits_guidance = llama_get_logits(guidance_ctx);
     llama_log_softmax(logits_guidance, n_vocab);
 
     for (int i = 0; i < n_vocab; ++i) {
@@ -7962,26 +10832,121 @@ void llama_grammar_accept_token(struct llama_context * ctx, struct llama_grammar
     const int64_t t_start_sample_us = ggml_time_us();
 
     if (token == llama_token_eos(&ctx->model)) {
-        for (const auto & stack : grammar->stacks) {
-            if (stack.empty()) {
+        for (const uint32_t stack : grammar->stacks) {
+            if (stack == 0) {
                 return;
             }
         }
         GGML_ASSERT(false);
     }
 
-    const std::string piece = llama_token_to_piece(ctx, token);
+    int32_t n_piece;
+    const char * piece = llama_token_get_piece_view(&ctx->model, token, &n_piece);
 
     // Note terminating 0 in decoded string
-    const auto   decoded     = decode_utf8(piece, grammar->partial_utf8);
+    const auto   decoded     = decode_utf8(piece, n_piece, grammar->partial_utf8);
     const auto & code_points = decoded.first;
     for (auto it = code_points.begin(), end = code_points.end() - 1; it != end; ++it) {
-        grammar->stacks = llama_grammar_accept(grammar->rules, grammar->stacks, *it);
+        grammar->stacks = llama_grammar_accept(grammar->rules, grammar->pool, grammar->stacks, *it);
     }
     grammar->partial_utf8 = decoded.second;
     GGML_ASSERT(!grammar->stacks.empty());
 
+    if (grammar->pool.nodes.size() > LLAMA_GRAMMAR_MAX_POOL_NODES) {
+        llama_grammar_rebuild_stacks(grammar);
+    }
+
+    ctx->t_sample_us += ggml_time_us() - t_start_sample_us;
+}
+
+// the text every sequence accepted by the grammar from its current state starts with, up to n_max
+// bytes; stops at a choice between chars, where the grammar may end or on a pending partial UTF-8
+// sequence
+static std::string llama_grammar_forced_text(const struct llama_grammar * grammar, size_t n_max) {
+    std::string text;
+
+    if (grammar->partial_utf8.n_remain != 0) {
+        return text;
+    }
+
+    std::vector<uint32_t> stacks = grammar->stacks;
+    while (text.size() < n_max && !stacks.empty()) {
+        uint32_t chr = 0;
+        for (const uint32_t stack : stacks) {
+            if (stack == 0) {
+                return text;
+            }
+            // a single char, e.g. "a" or [a], the same on every stack
+            const auto * pos = grammar->pool.nodes[stack].elem;
+            if (pos->type != LLAMA_GRETYPE_CHAR || pos[1].type == LLAMA_GRETYPE_CHAR_RNG_UPPER ||
+                pos[1].type == LLAMA_GRETYPE_CHAR_ALT || (chr != 0 && pos->value != chr)) {
+                return text;
+            }
+            chr = pos->value;
+        }
+        if (chr == 0) {
+            break;
+        }
+        text += codepoint_to_utf8(chr);
+        stacks = llama_grammar_accept(grammar->rules, grammar->pool, stacks, chr);
+    }
+
+    return text;
+}
+
+int32_t llama_grammar_forced_tokens(
+        struct llama_context * ctx,
+  const struct llama_grammar * grammar,
+                 llama_token * tokens,
+                     int32_t   n_max_tokens) {
+    const int64_t t_start_sample_us = ggml_time_us();
+
+    const auto & vocab = ctx->model.vocab;
+    const auto & trie  = vocab.trie;
+
+    const std::string text = llama_grammar_forced_text(grammar, 8*std::max(n_max_tokens, 0));
+
+    int32_t n_tokens = 0;
+    for (size_t begin = 0; begin < text.size() && n_tokens < n_max_tokens;) {
+        // longest piece of the vocabulary the remaining text starts with
+        uint32_t node    = 0;
+        uint32_t best    = 0;
+        size_t   n_bytes = 0;
+        for (size_t i = begin; i < text.size(); ++i) {
+            const auto child_begin = trie.nodes.begin() + trie.nodes[node].child_begin;
+            const auto child_end   = trie.nodes.begin() + trie.nodes[node].child_end;
+            const auto child = std::lower_bound(child_begin, child_end, (uint8_t) text[i],
+                    [](const llama_token_trie::node & n, uint8_t byte) { return n.byte < byte; });
+            if (child == child_end || child->byte != (uint8_t) text[i]) {
+                break;
+            }
+            node = child - trie.nodes.begin();
+            if (trie.nodes[node].tok_begin < trie.nodes[node].tok_end) {
+                best    = node;
+                n_bytes = i + 1 - begin;
+            }
+        }
+        // the last piece is left to the sampler, the text that follows may merge with it into a longer token
+        if (best == 0 || begin + n_bytes == text.size()) {
+            break;
+        }
+
+        // pieces may be shared by several tokens, e.g. with byte tokens, prefer normal ones
+        llama_token id = trie.tokens[trie.nodes[best].tok_begin];
+        for (uint32_t t = trie.nodes[best].tok_begin; t < trie.nodes[best].tok_end; ++t) {
+            if (vocab.id_to_token[trie.tokens[t]].type == LLAMA_TOKEN_TYPE_NORMAL) {
+                id = trie.tokens[t];
+                break;
+            }
+        }
+
+        tokens[n_tokens++] = id;
+        begin += n_bytes;
+    }
+
     ctx->t_sample_us += ggml_time_us() - t_start_sample_us;
+
+    return n_tokens;
 }
 
 //
@@ -7992,6 +10957,8 @@ struct llama_beam {
     std::vector<llama_token> tokens;
     float p;  // Cumulative beam probability (renormalized relative to all beams)
     bool eob; // Initialize end-of-beam to false. Callback sets this to true.
+    llama_seq_id seq_id; // Sequence of the KV cache with the tokens of the beam, but the last one.
+    int32_t i_batch;     // Index of the logits of the beam in the last batch, -1 for the ones of the prompt.
     // Sort beams by probability. In case of ties, prefer beams at eob.
     bool operator<(const llama_beam & rhs) const {
         return std::make_pair(p, eob) < std::make_pair(rhs.p, rhs.eob);
@@ -8016,8 +10983,8 @@ struct llama_logit_info {
         float max_l;
         float operator()(float sum, float l) const { return sum + std::exp(l - max_l); }
     };
-    llama_logit_info(llama_context * ctx)
-      : logits(llama_get_logits(ctx))
+    llama_logit_info(llama_context * ctx, const float * logits)
+      : logits(logits)
       , n_vocab(llama_n_vocab(llama_get_model(ctx)))
       , max_l(*std::max_element(logits, logits + n_vocab))
       , normalizer(1.0f / std::accumulate(logits, logits + n_vocab, 0.0f, sum_exp{max_l}))
@@ -8065,22 +11032,86 @@ struct llama_beam_search_data {
     // Used to communicate to/from callback on beams state.
     std::vector<llama_beam_view> beam_views;
 
+    // The last tokens of all the beams, evaluated together in their own sequences.
+    llama_batch batch;
+
     llama_beam_search_data(llama_context * ctx, size_t n_beams, int n_past, int n_predict)
       : ctx(ctx)
       , n_beams(n_beams)
       , n_past(n_past)
       , n_predict(n_predict)
-      , beam_views(n_beams) {
+      , beam_views(n_beams)
+      , batch(llama_batch_init(n_beams, 0, 1)) {
         beams.reserve(n_beams);
         next_beams.reserve(n_beams);
     }
 
-    // Collapse beams to a single beam given by index.
+    ~llama_beam_search_data() {
+        llama_batch_free(batch);
+    }
+
+    // Collapse beams to a single beam given by index, whose tokens are moved to the sequence 0.
     void collapse_beams(const size_t beam_idx) {
         if (0u < beam_idx) {
             std::swap(beams[0], beams[beam_idx]);
         }
         beams.resize(1);
+
+        const llama_seq_id seq_id = beams[0].seq_id;
+        llama_kv_cache_seq_keep(ctx, seq_id);
+        if (seq_id != 0) {
+            llama_kv_cache_seq_cp(ctx, seq_id, 0, -1, -1);
+            llama_kv_cache_seq_rm(ctx, seq_id, -1, -1);
+            beams[0].seq_id = 0;
+        }
+    }
+
+    // Evaluate the last token of each beam that is not at end-of-beam, all in one batch.
+    // Returns false if the batch could not be decoded.
+    bool eval_beams() {
+        batch.n_tokens = 0;
+        for (llama_beam & beam : beams) {
+            beam.i_batch = -1;
+            if (!beam.eob && !beam.tokens.empty()) {
+                const int32_t i = batch.n_tokens++;
+                batch.token   [i]    = beam.tokens.back();
+                batch.pos     [i]    = n_past + beam.tokens.size() - 1;
+                batch.n_seq_id[i]    = 1;
+                batch.seq_id  [i][0] = beam.seq_id;
+                batch.logits  [i]    = true;
+                beam.i_batch = i;
+            }
+        }
+        return batch.n_tokens == 0 || llama_decode(ctx, batch) == 0;
+    }
+
+    // Give each of next_beams its own sequence. The first beam that branched from a beam keeps its sequence,
+    // the other ones fork it into the sequences left by the beams that did not branch.
+    void fork_beams() {
+        std::vector<bool> used(n_beams, false);
+        std::vector<llama_beam *> forks;
+        for (llama_beam & beam : next_beams) {
+            if (used[beam.seq_id]) {
+                forks.push_back(&beam);
+            } else {
+                used[beam.seq_id] = true;
+            }
+        }
+        llama_seq_id seq_id = 0;
+        for (llama_beam * beam : forks) {
+            while (used[seq_id]) {
+                ++seq_id;
+            }
+            used[seq_id] = true;
+            llama_kv_cache_seq_rm(ctx, seq_id, -1, -1);
+            llama_kv_cache_seq_cp(ctx, beam->seq_id, seq_id, -1, -1);
+            beam->seq_id = seq_id;
+        }
+        for (seq_id = 0; seq_id < (llama_seq_id) n_beams; ++seq_id) {
+            if (!used[seq_id]) {
+                llama_kv_cache_seq_rm(ctx, seq_id, -1, -1);
+            }
+        }
     }
 
     // Min-heaps are used to efficiently collect the top-k elements (k=n_beams).
@@ -8105,10 +11136,7 @@ struct llama_beam_search_data {
             }
         } else {
             // beam is not at end-of-sentence, so branch with next top_k tokens.
-            if (!beam.tokens.empty()) {
-                llama_decode(ctx, llama_batch_get_one(beam.tokens.data(), beam.tokens.size(), n_past, 0));
-            }
-            llama_logit_info logit_info(ctx);
+            llama_logit_info logit_info(ctx, beam.i_batch < 0 ? llama_get_logits(ctx) : llama_get_logits_ith(ctx, beam.i_batch));
             std::vector<llama_token_data> next_tokens = logit_info.top_k(n_beams);
             size_t i=0;
             if (next_beams.size() < n_beams) {
@@ -8172,17 +11200,20 @@ struct llama_beam_search_data {
     //  * any of the beams have not yet reached end-of-beam (eob), AND
     //  * the highest probability beam(s) (plural in case of ties) are not at end-of-sentence
     //    (since all other beam probabilities can only decrease)
+    //  * the prompt is in the sequence 0, each beam has a sequence in [0, n_beams)
     void loop(const llama_beam_search_callback_fn_t callback, void * const callback_data) {
-        beams.push_back({{}, 1.0f, false});  // Start with one empty beam w/ probability = 1.0 and !eob.
+        beams.push_back({{}, 1.0f, false, 0, -1});  // Start with one empty beam w/ probability = 1.0 and !eob.
         const auto not_eob = [](const llama_beam & beam) { return !beam.eob; };
         for (int i = 0 ; i < n_predict && std::any_of(beams.begin(),beams.end(),not_eob) &&
                        !beams[top_beam_index()].eob ; ++i) {
             callback(callback_data, get_beams_state(false));  // Sets common_prefix_length
             update_beams_from_beam_views();   // Update values (p,eob) that callback may have changed.
-            if (common_prefix_length) {
-                llama_decode(ctx, llama_batch_get_one(beams[0].tokens.data(), common_prefix_length, n_past, 0));
-                n_past += common_prefix_length;
+            if (!eval_beams()) {
+                LLAMA_LOG_ERROR("%s: failed to decode the beams\n", __func__);
+                break;
             }
+            // The common prefix is already in the sequences of all the beams.
+            n_past += common_prefix_length;
             // Zero-out next_beam probabilities to place them last in following min-heap.
             std::for_each(next_beams.begin(), next_beams.end(), [](llama_beam & beam) { beam.p = 0.0f; });
             for (llama_beam & beam : beams) {
@@ -8190,6 +11221,7 @@ struct llama_beam_search_data {
                 fill_next_beams_by_top_probabilities(beam);
             }
             // next_beams become the beams of next/final iteration. Swap them to re-use memory.
+            fork_beams();
             beams.swap(next_beams);
             renormalize_beam_probabilities(beams);
         }
@@ -8262,7 +11294,7 @@ struct quantize_state_internal {
 };
 
 static void llama_convert_tensor_internal(
-    struct ggml_tensor * tensor, std::vector<no_init<float>> & output, std::vector<std::thread> & workers,
+    ggml_type type, const void * data, std::vector<no_init<float>> & output, std::vector<std::thread> & workers,
     const size_t nelements, const int nthread
 ) {
     if (output.size() < nelements) {
@@ -8271,28 +11303,28 @@ static void llama_convert_tensor_internal(
     float * f32_output = (float *) output.data();
 
     ggml_type_traits_t qtype;
-    if (ggml_is_quantized(tensor->type)) {
-        qtype = ggml_internal_get_type_traits(tensor->type);
+    if (ggml_is_quantized(type)) {
+        qtype = ggml_internal_get_type_traits(type);
         if (qtype.to_float == NULL) {
-            throw std::runtime_error(format("type %s unsupported for integer quantization: no dequantization available", ggml_type_name(tensor->type)));
+            throw std::runtime_error(format("type %s unsupported for integer quantization: no dequantization available", ggml_type_name(type)));
         }
-    } else if (tensor->type != GGML_TYPE_F16) {
-        throw std::runtime_error(format("cannot dequantize/convert tensor type %s", ggml_type_name(tensor->type)));
+    } else if (type != GGML_TYPE_F16) {
+        throw std::runtime_error(format("cannot dequantize/convert tensor type %s", ggml_type_name(type)));
     }
 
     if (nthread < 2) {
-        if (tensor->type == GGML_TYPE_F16) {
-            ggml_fp16_to_fp32_row((ggml_fp16_t *)tensor->data, f32_output, nelements);
-        } else if (ggml_is_quantized(tensor->type)) {
-            qtype.to_float(tensor->data, f32_output, nelements);
+        if (type == GGML_TYPE_F16) {
+            ggml_fp16_to_fp32_row((const ggml_fp16_t *) data, f32_output, nelements);
+        } else if (ggml_is_quantized(type)) {
+            qtype.to_float(data, f32_output, nelements);
         } else {
             GGML_ASSERT(false); // unreachable
         }
         return;
     }
 
-    size_t block_size = tensor->type == GGML_TYPE_F16 ? 1 : (size_t)ggml_blck_size(tensor->type);
-    size_t block_size_bytes = ggml_type_size(tensor->type);
+    size_t block_size = type == GGML_TYPE_F16 ? 1 : (size_t)ggml_blck_size(type);
+    size_t block_size_bytes = ggml_type_size(type);
 
     GGML_ASSERT(nelements % block_size == 0);
     size_t nblocks = nelements / block_size;
@@ -8307,14 +11339,14 @@ static void llama_convert_tensor_internal(
         size_t thr_elems = thr_blocks * block_size; // number of elements for this thread
         size_t thr_block_bytes = thr_blocks * block_size_bytes; // number of input bytes for this thread
 
-        auto compute = [qtype] (ggml_type typ, uint8_t * inbuf, float * outbuf, int nels) {
+        auto compute = [qtype] (ggml_type typ, const uint8_t * inbuf, float * outbuf, int nels) {
             if (typ == GGML_TYPE_F16) {
-                ggml_fp16_to_fp32_row((ggml_fp16_t *)inbuf, outbuf, nels);
+                ggml_fp16_to_fp32_row((const ggml_fp16_t *) inbuf, outbuf, nels);
             } else {
                 qtype.to_float(inbuf, outbuf, nels);
             }
         };
-        workers.emplace_back(compute, tensor->type, (uint8_t *) tensor->data + in_buff_offs, f32_output + out_buff_offs, thr_elems);
+        workers.emplace_back(compute, type, (const uint8_t *) data + in_buff_offs, f32_output + out_buff_offs, thr_elems);
         in_buff_offs += thr_block_bytes;
         out_buff_offs += thr_elems;
     }
@@ -8533,11 +11565,18 @@ static void llama_model_quantize_internal(const std::string & fname_inp, const s
     workers.reserve(nthread);
     std::mutex mutex;
 
-    int idx = 0;
+    // the type of each tensor is decided first, so that the layout of the output is known before any data is read:
+    // the meta data is written first and the tensors at their offsets, and an interrupted run can be resumed
+    struct quantize_tensor {
+        ggml_tensor * tensor;
+        ggml_type     new_type;
+        bool          quantize;
+        size_t        new_size;
+        size_t        offs_out; // offset of the data in the output file
+    };
 
-    std::vector<no_init<uint8_t>> read_data;
-    std::vector<no_init<uint8_t>> work;
-    std::vector<no_init<float>> f32_conv_buf;
+    std::vector<quantize_tensor> qtensors;
+    qtensors.reserve(ml.n_tensors);
 
     // populate the original tensors so we get an initial meta data
     for (int i = 0; i < ml.n_tensors; ++i) {
@@ -8545,35 +11584,11 @@ static void llama_model_quantize_internal(const std::string & fname_inp, const s
         gguf_add_tensor(ctx_out, meta);
     }
 
-    std::ofstream fout(fname_out, std::ios::binary);
-    fout.exceptions(std::ofstream::failbit); // fail fast on write errors
-
-    const size_t meta_size = gguf_get_meta_size(ctx_out);
-
-    LLAMA_LOG_INFO("%s: meta size = %zu bytes\n", __func__, meta_size);
-
-    // placeholder for the meta data
-    ::zeros(fout, meta_size);
-
     for (int i = 0; i < ml.n_tensors; ++i) {
         struct ggml_tensor * tensor = ml.get_tensor_meta(i);
 
         const std::string name = ggml_get_name(tensor);
 
-        if (!ml.use_mmap) {
-            if (read_data.size() < ggml_nbytes(tensor)) {
-                read_data.resize(ggml_nbytes(tensor));
-            }
-            tensor->data = read_data.data();
-        }
-        ml.load_data_for(tensor);
-
-        LLAMA_LOG_INFO("[%4d/%4d] %36s - [%s], type = %6s, ",
-               ++idx, ml.n_tensors,
-               ggml_get_name(tensor),
-               llama_format_tensor_shape(tensor).c_str(),
-               ggml_type_name(tensor->type));
-
         // This used to be a regex, but <regex> has an extreme cost to compile times.
         bool quantize = name.rfind("weight") == name.size() - 6; // ends with 'weight'?
 
@@ -8585,9 +11600,7 @@ static void llama_model_quantize_internal(const std::string & fname_inp, const s
         // do not quantize expert gating tensors
         quantize &= name.find("ffn_gate_inp.weight") == std::string::npos;
 
-        enum ggml_type new_type;
-        void * new_data;
-        size_t new_size;
+        enum ggml_type new_type = tensor->type;
 
         if (quantize) {
             new_type = quantized_type;
@@ -8601,103 +11614,300 @@ static void llama_model_quantize_internal(const std::string & fname_inp, const s
         }
         if (!quantize) {
             new_type = tensor->type;
-            new_data = tensor->data;
-            new_size = ggml_nbytes(tensor);
-            LLAMA_LOG_INFO("size = %8.3f MB\n", ggml_nbytes(tensor)/1024.0/1024.0);
-        } else {
-            const size_t nelements = ggml_nelements(tensor);
+        } else if (ggml_is_quantized(tensor->type) && !params->allow_requantize) {
+            throw std::runtime_error(format("requantizing from type %s is disabled", ggml_type_name(tensor->type)));
+        }
 
-            float * f32_data;
+        const size_t new_size = ggml_row_size(new_type, tensor->ne[0])*ggml_nrows(tensor);
 
-            if (tensor->type == GGML_TYPE_F32) {
-                f32_data = (float *) tensor->data;
-            } else if (ggml_is_quantized(tensor->type) && !params->allow_requantize) {
-                throw std::runtime_error(format("requantizing from type %s is disabled", ggml_type_name(tensor->type)));
-            } else {
-                llama_convert_tensor_internal(tensor, f32_conv_buf, workers, nelements, nthread);
-                f32_data = (float *) f32_conv_buf.data();
-            }
+        // update the gguf meta data
+        gguf_set_tensor_type(ctx_out, name.c_str(), new_type);
+        gguf_set_tensor_data(ctx_out, name.c_str(), NULL, new_size);
 
-            LLAMA_LOG_INFO("quantizing to %s .. ", ggml_type_name(new_type));
-            fflush(stdout);
+        qtensors.push_back({ tensor, new_type, quantize, new_size, 0 });
+    }
 
-            if (work.size() < nelements * 4) {
-                work.resize(nelements * 4); // upper bound on size
-            }
-            new_data = work.data();
-            std::array<int64_t, 1 << 4> hist_cur = {};
+    const size_t meta_size = gguf_get_meta_size(ctx_out);
 
-            static const int chunk_size = 32 * 512;
-            const int nchunk = (nelements + chunk_size - 1)/chunk_size;
-            const int nthread_use = nthread > 1 ? std::max(1, std::min(nthread, nchunk)) : 1;
-            if (nthread_use < 2) {
-                new_size = ggml_quantize_chunk(new_type, f32_data, new_data, 0, nelements, hist_cur.data());
-            } else {
-                size_t counter = 0;
-                new_size = 0;
-                auto compute = [&mutex, &counter, &hist_cur, &new_size, new_type, f32_data, new_data, nelements]() {
-                    std::array<int64_t, 1 << 4> local_hist = {};
-                    size_t local_size = 0;
-                    while (true) {
-                        std::unique_lock<std::mutex> lock(mutex);
-                        size_t first = counter; counter += chunk_size;
-                        if (first >= nelements) {
-                            if (local_size > 0) {
-                                for (int j=0; j<int(local_hist.size()); ++j) {
-                                    hist_cur[j] += local_hist[j];
-                                }
-                                new_size += local_size;
-                            }
-                            break;
-                        }
-                        lock.unlock();
-                        size_t last = std::min(nelements, first + chunk_size);
-                        local_size += ggml_quantize_chunk(new_type, f32_data, new_data, first, last - first, local_hist.data());
-                    }
-                };
-                for (int it = 0; it < nthread_use - 1; ++it) {
-                    workers.emplace_back(compute);
-                }
-                compute();
-                for (auto & w : workers) { w.join(); }
-                workers.clear();
-            }
+    LLAMA_LOG_INFO("%s: meta size = %zu bytes\n", __func__, meta_size);
 
-            LLAMA_LOG_INFO("size = %8.2f MiB -> %8.2f MiB | hist: ", ggml_nbytes(tensor)/1024.0/1024.0, new_size/1024.0/1024.0);
-            int64_t tot_count = 0;
-            for (size_t i = 0; i < hist_cur.size(); i++) {
-                hist_all[i] += hist_cur[i];
-                tot_count += hist_cur[i];
-            }
+    for (int i = 0; i < ml.n_tensors; ++i) {
+        qtensors[i].offs_out = meta_size + gguf_get_tensor_offset(ctx_out, i);
+    }
 
-            if (tot_count > 0) {
-                for (size_t i = 0; i < hist_cur.size(); i++) {
-                    LLAMA_LOG_INFO("%5.3f ", hist_cur[i] / float(nelements));
+    // the progress of the run is kept next to the output: the number of tensors that are written, after the inputs
+    // and the parameters, that have to match for the run to be resumed
+    const std::string fname_progress = fname_out + ".progress";
+    const std::string progress_key   = format("%s %zu %d %d %d %d %d", fname_inp.c_str(), ml.file.size, (int) params->ftype,
+            params->allow_requantize, params->quantize_output_tensor, params->only_copy, params->pure);
+
+    int n_done = 0;
+    {
+        std::ifstream fprogress(fname_progress);
+        std::string key;
+        if (!std::getline(fprogress, key) || key != progress_key || !(fprogress >> n_done) || n_done < 0 || n_done > ml.n_tensors) {
+            n_done = 0;
+        }
+    }
+
+    std::unique_ptr<llama_file> fout;
+    if (n_done > 0) {
+        const quantize_tensor & last = qtensors[n_done - 1];
+        try {
+            fout.reset(new llama_file(fname_out.c_str(), "r+b"));
+        } catch (const std::exception &) {
+            fout.reset();
+        }
+        if (!fout || fout->size < last.offs_out + last.new_size) {
+            fout.reset();
+            n_done = 0;
+        }
+    }
+    if (n_done > 0) {
+        LLAMA_LOG_INFO("%s: resuming after %d of %d tensors written to %s\n", __func__, n_done, ml.n_tensors, fname_out.c_str());
+    } else {
+        std::remove(fname_progress.c_str());
+        fout.reset(new llama_file(fname_out.c_str(), "wb"));
+    }
+
+    // the meta data, the same when resuming
+    {
+        std::vector<uint8_t> data(meta_size);
+        gguf_get_meta_data(ctx_out, data.data());
+        fout->seek(0, SEEK_SET);
+        fout->write_raw(data.data(), data.size());
+    }
+
+    for (int i = 0; i < n_done; ++i) {
+        total_size_org += ggml_nbytes(qtensors[i].tensor);
+        total_size_new += qtensors[i].new_size;
+    }
+
+    // the tensors are processed in chunks of rows, of a bounded size whatever the size of the tensors: the chunk k is
+    // quantized while the chunk k + 1 is read and the chunk k - 1 is written
+    const int64_t chunk_elements = 16*1024*1024; // 64 MiB in F32
+
+    struct quantize_chunk {
+        int     itensor;
+        int64_t row0;
+        int64_t nrows;
+    };
+
+    std::vector<quantize_chunk> chunks;
+    for (int i = n_done; i < ml.n_tensors; ++i) {
+        const ggml_tensor * tensor = qtensors[i].tensor;
+
+        const int64_t nrows      = ggml_nrows(tensor);
+        const int64_t chunk_rows = std::max<int64_t>(1, chunk_elements/std::max<int64_t>(1, tensor->ne[0]));
+
+        for (int64_t row0 = 0; row0 < nrows; row0 += chunk_rows) {
+            chunks.push_back({ i, row0, std::min(chunk_rows, nrows - row0) });
+        }
+    }
+
+    const auto chunk_offs_inp = [&](const quantize_chunk & chunk) {
+        const ggml_tensor * tensor = qtensors[chunk.itensor].tensor;
+        return ml.file_offset(ggml_get_name(tensor)) + chunk.row0*ggml_row_size(tensor->type, tensor->ne[0]);
+    };
+
+    // three buffers for the inputs, the read of the chunk k + 1 does not overwrite the chunk k - 1 that is being
+    // written when it is copied, and two for the outputs
+    std::vector<no_init<uint8_t>> read_buf[3];
+    std::vector<no_init<uint8_t>> work[2];
+    std::vector<no_init<float>> f32_conv_buf;
+
+    const auto read_chunk = [&](size_t k) -> const uint8_t * {
+        const quantize_chunk & chunk = chunks[k];
+        const ggml_tensor * tensor = qtensors[chunk.itensor].tensor;
+
+        const size_t offs = chunk_offs_inp(chunk);
+        const size_t size = chunk.nrows*ggml_row_size(tensor->type, tensor->ne[0]);
+
+        if (ml.use_mmap) {
+            // fault in the pages ahead of the quantization
+            const volatile uint8_t * data = (const uint8_t *) ml.mapping->addr + offs;
+            for (size_t j = 0; j < size; j += 4096) {
+                (void) data[j];
+            }
+            return (const uint8_t *) ml.mapping->addr + offs;
+        }
+
+        auto & buf = read_buf[k % 3];
+        if (buf.size() < size) {
+            buf.resize(size);
+        }
+        ml.read_data_parallel(buf.data(), offs, size);
+
+        return (const uint8_t *) buf.data();
+    };
+
+    const auto write_chunk = [&](size_t k, const uint8_t * data) {
+        const quantize_chunk  & chunk = chunks[k];
+        const quantize_tensor & qt    = qtensors[chunk.itensor];
+        const ggml_tensor * tensor = qt.tensor;
+
+        const size_t row_size = ggml_row_size(qt.new_type, tensor->ne[0]);
+
+        fout->seek(qt.offs_out + chunk.row0*row_size, SEEK_SET);
+        fout->write_raw(data, chunk.nrows*row_size);
+
+        if (ml.use_mmap) {
+            // the input is read once, its pages are not kept in memory
+            ml.mapping->release(chunk_offs_inp(chunk), chunk.nrows*ggml_row_size(tensor->type, tensor->ne[0]));
+        }
+
+        if (chunk.row0 + chunk.nrows == ggml_nrows(tensor)) {
+            // padding, then the progress once the tensor is in the file
+            static const char pad[GGUF_DEFAULT_ALIGNMENT] = {};
+            fout->write_raw(pad, GGML_PAD(qt.new_size, align) - qt.new_size);
+            fflush(fout->fp);
+
+            std::ofstream fprogress(fname_progress, std::ios::trunc);
+            fprogress << progress_key << "\n" << chunk.itensor + 1 << "\n";
+        }
+    };
+
+    std::array<int64_t, 1 << 4> hist_cur = {};
+
+    std::future<const uint8_t *> read_next;
+    std::future<void> write_prev;
+
+    if (!chunks.empty()) {
+        read_next = std::async(std::launch::async, read_chunk, 0);
+    }
+
+    for (size_t k = 0; k < chunks.size(); ++k) {
+        const quantize_chunk  & chunk = chunks[k];
+        const quantize_tensor & qt    = qtensors[chunk.itensor];
+        ggml_tensor * tensor = qt.tensor;
+
+        const ggml_type new_type = qt.new_type;
+
+        const uint8_t * inp = read_next.get();
+        if (k + 1 < chunks.size()) {
+            read_next = std::async(std::launch::async, read_chunk, k + 1);
+        }
+
+        const bool first = chunk.row0 == 0;
+        const bool last  = chunk.row0 + chunk.nrows == ggml_nrows(tensor);
+
+        if (first) {
+            LLAMA_LOG_INFO("[%4d/%4d] %36s - [%s], type = %6s, ",
+                   chunk.itensor + 1, ml.n_tensors,
+                   ggml_get_name(tensor),
+                   llama_format_tensor_shape(tensor).c_str(),
+                   ggml_type_name(tensor->type));
+
+            if (qt.quantize) {
+                LLAMA_LOG_INFO("quantizing to %s .. ", ggml_type_name(new_type));
+                fflush(stdout);
+            }
+
+            hist_cur = {};
+        }
+
+        const uint8_t * new_data;
+
+        if (!qt.quantize) {
+            new_data = inp;
+        } else {
+            const size_t nelements = chunk.nrows*tensor->ne[0];
+
+            const float * f32_data;
+
+            if (tensor->type == GGML_TYPE_F32) {
+                f32_data = (const float *) inp;
+            } else {
+                llama_convert_tensor_internal(tensor->type, inp, f32_conv_buf, workers, nelements, nthread);
+                f32_data = (const float *) f32_conv_buf.data();
+            }
+
+            auto & out = work[k % 2];
+            if (out.size() < chunk.nrows*ggml_row_size(new_type, tensor->ne[0])) {
+                out.resize(chunk.nrows*ggml_row_size(new_type, tensor->ne[0]));
+            }
+            void * out_data = out.data();
+
+            size_t new_size;
+
+            static const int chunk_size = 32 * 512;
+            const int nchunk = (nelements + chunk_size - 1)/chunk_size;
+            const int nthread_use = nthread > 1 ? std::max(1, std::min(nthread, nchunk)) : 1;
+            if (nthread_use < 2) {
+                new_size = ggml_quantize_chunk(new_type, f32_data, out_data, 0, nelements, hist_cur.data());
+            } else {
+                size_t counter = 0;
+                new_size = 0;
+                auto compute = [&mutex, &counter, &hist_cur, &new_size, new_type, f32_data, out_data, nelements]() {
+                    std::array<int64_t, 1 << 4> local_hist = {};
+                    size_t local_size = 0;
+                    while (true) {
+                        std::unique_lock<std::mutex> lock(mutex);
+                        size_t first = counter; counter += chunk_size;
+                        if (first >= nelements) {
+                            if (local_size > 0) {
+                                for (int j=0; j<int(local_hist.size()); ++j) {
+                                    hist_cur[j] += local_hist[j];
+                                }
+                                new_size += local_size;
+                            }
+                            break;
+                        }
+                        lock.unlock();
+                        size_t last = std::min(nelements, first + chunk_size);
+                        local_size += ggml_quantize_chunk(new_type, f32_data, out_data, first, last - first, local_hist.data());
+                    }
+                };
+                for (int it = 0; it < nthread_use - 1; ++it) {
+                    workers.emplace_back(compute);
                 }
+                compute();
+                for (auto & w : workers) { w.join(); }
+                workers.clear();
             }
-            LLAMA_LOG_INFO("\n");
+            GGML_ASSERT(new_size == chunk.nrows*ggml_row_size(new_type, tensor->ne[0]));
+
+            new_data = (const uint8_t *) out_data;
         }
-        total_size_org += ggml_nbytes(tensor);
-        total_size_new += new_size;
 
-        // update the gguf meta data as we go
-        gguf_set_tensor_type(ctx_out, name.c_str(), new_type);
-        gguf_set_tensor_data(ctx_out, name.c_str(), new_data, new_size);
+        // the output buffer of this chunk was written at k - 2, before the write of k - 1
+        if (write_prev.valid()) {
+            write_prev.get();
+        }
+        write_prev = std::async(std::launch::async, write_chunk, k, new_data);
+
+        if (last) {
+            if (!qt.quantize) {
+                LLAMA_LOG_INFO("size = %8.3f MB\n", ggml_nbytes(tensor)/1024.0/1024.0);
+            } else {
+                LLAMA_LOG_INFO("size = %8.2f MiB -> %8.2f MiB | hist: ", ggml_nbytes(tensor)/1024.0/1024.0, qt.new_size/1024.0/1024.0);
+                int64_t tot_count = 0;
+                for (size_t i = 0; i < hist_cur.size(); i++) {
+                    hist_all[i] += hist_cur[i];
+                    tot_count += hist_cur[i];
+                }
+
+                if (tot_count > 0) {
+                    for (size_t i = 0; i < hist_cur.size(); i++) {
+                        LLAMA_LOG_INFO("%5.3f ", hist_cur[i] / float(ggml_nelements(tensor)));
+                    }
+                }
+                LLAMA_LOG_INFO("\n");
+            }
 
-        // write tensor data + padding
-        fout.write((const char *) new_data, new_size);
-        zeros(fout, GGML_PAD(new_size, align) - new_size);
+            total_size_org += ggml_nbytes(tensor);
+            total_size_new += qt.new_size;
+        }
     }
 
-    // go back to beginning of file and write the updated meta data
-    {
-        fout.seekp(0);
-        std::vector<uint8_t> data(gguf_get_meta_size(ctx_out));
-        gguf_get_meta_data(ctx_out, data.data());
-        fout.write((const char *) data.data(), data.size());
+    if (write_prev.valid()) {
+        write_prev.get();
     }
 
-    fout.close();
+    fout.reset();
+
+    // the output is complete
+    std::remove(fname_progress.c_str());
 
     gguf_free(ctx_out);
 
@@ -8888,6 +12098,11 @@ static int llama_apply_lora_from_file_internal(
 
             ggml_tensor * dest_t = model_tensors[base_name];
 
+            if (ggml_internal_get_type_traits(dest_t->type).nrows > 0) {
+                throw std::runtime_error(format(
+                    "%s: error: LoRAs cannot be applied to repacked weights, load the model without repacking", __func__));
+            }
+
             offload_func_t offload_func               = ggml_offload_nop;
             offload_func_t offload_func_force_inplace = ggml_offload_nop;
 
@@ -9015,6 +12230,9 @@ struct llama_model_params llama_model_default_params() {
         /*.vocab_only                  =*/ false,
         /*.use_mmap                    =*/ true,
         /*.use_mlock                   =*/ false,
+        /*.repack                      =*/ false,
+        /*.use_hugepages               =*/ false,
+        /*.vocab_cache                 =*/ false,
     };
 
 #ifdef GGML_USE_METAL
@@ -9039,12 +12257,16 @@ struct llama_context_params llama_context_default_params() {
         /*.yarn_beta_fast              =*/ 32.0f,
         /*.yarn_beta_slow              =*/ 1.0f,
         /*.yarn_orig_ctx               =*/ 0,
+        /*.n_top_k                     =*/ 0,
+        /*.n_graph_cache               =*/ 4,
+        /*.mpi_split                   =*/ LLAMA_MPI_SPLIT_LAYER,
         /*.type_k                      =*/ GGML_TYPE_F16,
         /*.type_v                      =*/ GGML_TYPE_F16,
         /*.mul_mat_q                   =*/ true,
         /*.logits_all                  =*/ false,
         /*.embedding                   =*/ false,
         /*.offload_kqv                 =*/ true,
+        /*.profile                     =*/ false,
     };
 
     return result;
@@ -9140,9 +12362,12 @@ void llama_free_model(struct llama_model * model) {
     delete model;
 }
 
-struct llama_context * llama_new_context_with_model(
+// with plan, the KV cache and the buffers are not allocated, their sizes are added to plan after the measure of the
+// compute buffer, and the context is only good to be deleted
+static struct llama_context * llama_new_context_internal(
                  struct llama_model * model,
-        struct llama_context_params   params) {
+        struct llama_context_params   params,
+          struct llama_memory_plan  * plan) {
 
     if (!model) {
         return nullptr;
@@ -9162,6 +12387,21 @@ struct llama_context * llama_new_context_with_model(
     cparams.yarn_beta_slow   = params.yarn_beta_slow;
     cparams.mul_mat_q        = params.mul_mat_q;
     cparams.offload_kqv      = params.offload_kqv;
+    cparams.profile          = params.profile;
+    cparams.mpi_split        = params.mpi_split;
+    cparams.n_top_k          = std::min(params.n_top_k, (uint32_t) hparams.n_vocab);
+    cparams.top_k_graph      = cparams.n_top_k > 0;
+    cparams.n_graph_cache    = params.n_graph_cache;
+#if defined(GGML_USE_CUBLAS) || defined(GGML_USE_METAL) || defined(GGML_USE_MPI)
+    // the offloaded tensors are assigned their device memory while the graph is built
+    cparams.n_graph_cache    = 0;
+#endif
+#ifdef GGML_USE_METAL
+    // the argsort kernel sorts a row within a threadgroup, which is too small for the vocabulary
+    if (model->n_gpu_layers > 0) {
+        cparams.top_k_graph = false;
+    }
+#endif
 
     cparams.n_ctx            = params.n_ctx           == 0    ? hparams.n_ctx_train           : params.n_ctx;
     cparams.rope_freq_base   = params.rope_freq_base  == 0.0f ? hparams.rope_freq_base_train  : params.rope_freq_base;
@@ -9195,6 +12435,11 @@ struct llama_context * llama_new_context_with_model(
     ctx->rng = std::mt19937(params.seed);
     ctx->logits_all = params.logits_all;
 
+#ifdef GGML_USE_MPI
+    // before the measure of the compute buffer, the graphs split by rows have more nodes
+    ctx->ctx_mpi = ggml_mpi_init();
+#endif
+
     const ggml_type type_k = params.type_k;
     const ggml_type type_v = params.type_v;
 
@@ -9203,7 +12448,7 @@ struct llama_context * llama_new_context_with_model(
 
     // reserve memory for context buffers
     if (!hparams.vocab_only) {
-        if (!llama_kv_cache_init(ctx->model.hparams, ctx->kv_self, type_k, type_v, cparams.n_ctx, model->n_gpu_layers, cparams.offload_kqv)) {
+        if (!llama_kv_cache_init(ctx->model.hparams, ctx->kv_self, type_k, type_v, cparams.n_ctx, model->n_gpu_layers, cparams.offload_kqv, !plan)) {
             LLAMA_LOG_ERROR("%s: llama_kv_cache_init() failed for self-attention cache\n", __func__);
             llama_free(ctx);
             return nullptr;
@@ -9228,7 +12473,9 @@ struct llama_context * llama_new_context_with_model(
         }
 
         // resized during inference
-        if (params.logits_all) {
+        if (plan) {
+            // not allocated
+        } else if (params.logits_all) {
             ctx->logits.reserve(cparams.n_ctx*hparams.n_vocab);
         } else {
             ctx->logits.reserve(hparams.n_vocab);
@@ -9239,21 +12486,11 @@ struct llama_context * llama_new_context_with_model(
         }
 
         {
-            static const size_t tensor_alignment = 32;
             // the compute buffer is used to store the tensor and graph structs, while the allocator buffer is used for the tensor data
             ctx->buf_compute.resize(ggml_tensor_overhead()*LLAMA_MAX_NODES + ggml_graph_overhead());
 
-            // create measure allocator
-            ctx->alloc = ggml_allocr_new_measure(tensor_alignment);
-
-            // build worst-case graph
-            int n_tokens = (int)std::min(cparams.n_ctx, cparams.n_batch);
-            int n_past = cparams.n_ctx - n_tokens;
-            llama_token token = llama_token_bos(&ctx->model); // not actually used by llama_build_graph, but required to choose between token and embedding inputs graph
-            ggml_cgraph * gf = llama_build_graph(*ctx, llama_batch_get_one(&token, n_tokens, n_past, 0));
-
 #ifdef GGML_USE_METAL
-            if (model->n_gpu_layers > 0) {
+            if (model->n_gpu_layers > 0 && !plan) {
                 ctx->ctx_metal = ggml_metal_init(1);
                 if (!ctx->ctx_metal) {
                     LLAMA_LOG_ERROR("%s: ggml_metal_init() failed\n", __func__);
@@ -9264,24 +12501,104 @@ struct llama_context * llama_new_context_with_model(
                 //ggml_allocr_set_parse_seq(ctx->alloc, ggml_metal_get_concur_list(ctx->ctx_metal), ggml_metal_if_optimized(ctx->ctx_metal));
             }
 #endif
-            // measure memory requirements for the graph
-            size_t alloc_size = ggml_allocr_alloc_graph(ctx->alloc, gf) + tensor_alignment;
+            // measure the memory requirements of the graphs of a few shapes of batches: the worst case, n_batch tokens
+            // that attend the whole cache, and the smaller batches, down to the single tokens, that attend a fraction
+            // of it, so that the contexts that do not evaluate large batches at the end of the cache do not reserve
+            // the memory of the worst case
+            const uint32_t n_tokens_max = std::min(cparams.n_ctx, cparams.n_batch);
+
+            std::vector<uint32_t> n_tokens_buckets;
+            for (uint32_t n = 1; n < n_tokens_max; n *= 4) {
+                n_tokens_buckets.push_back(n);
+            }
+            n_tokens_buckets.push_back(n_tokens_max);
+
+            std::vector<uint32_t> n_kv_buckets;
+            for (uint32_t n = cparams.n_ctx/8; n < cparams.n_ctx; n *= 2) {
+                if (n >= 256) {
+                    n_kv_buckets.push_back(GGML_PAD(n, 32));
+                }
+            }
+            n_kv_buckets.push_back(cparams.n_ctx);
+
+            llama_token token = llama_token_bos(&ctx->model); // not actually used by llama_build_graph, but required to choose between token and embedding inputs graph
+
+            size_t alloc_size = 0; // worst case
+
+            for (uint32_t n_tokens : n_tokens_buckets) {
+                for (uint32_t n_kv : n_kv_buckets) {
+                    n_kv = std::min(cparams.n_ctx, std::max(n_kv, n_tokens));
+
+                    ctx->alloc = ggml_allocr_new_measure(LLAMA_TENSOR_ALIGNMENT);
+
+                    ggml_cgraph * gf = llama_build_graph(*ctx, llama_batch_get_one(&token, n_tokens, n_kv - n_tokens, 0), ctx->buf_compute, ctx->graph);
+
+                    const size_t size = ggml_allocr_alloc_graph(ctx->alloc, gf) + LLAMA_TENSOR_ALIGNMENT;
+
+                    ggml_allocr_free(ctx->alloc);
+                    ctx->alloc = NULL;
+
+                    ctx->alloc_buckets.push_back({ n_tokens, n_kv, size });
+
+                    alloc_size = std::max(alloc_size, size);
+                }
+            }
+
+            // the Metal buffers cannot be replaced after their creation
+#ifdef GGML_USE_METAL
+            const size_t alloc_size_init = alloc_size;
+#else
+            const size_t alloc_size_init = llama_alloc_bucket_size(*ctx, 1, 0);
+#endif
+
+            LLAMA_LOG_INFO("%s: compute buffer total size = %.2f MiB (%.2f MiB reserved, %zu buckets)\n", __func__,
+                    (ctx->buf_compute.size + alloc_size) / 1024.0 / 1024.0,
+                    (ctx->buf_compute.size + alloc_size_init) / 1024.0 / 1024.0, ctx->alloc_buckets.size());
+
+            if (plan) {
+                // the buffers grow up to the worst case
+                for (int i = 0; i < (int) hparams.n_layer; i++) {
+                    const size_t size = ggml_nbytes(ctx->kv_self.k_l[i]) + ggml_nbytes(ctx->kv_self.v_l[i]);
+
+                    plan->kv_host += size;
+#ifdef GGML_USE_CUBLAS
+                    if (i >= (int) hparams.n_layer - model->n_gpu_layers && cparams.offload_kqv) {
+                        plan->kv_device += size;
+                    }
+#endif
+                }
+                plan->kv_host += ggml_nbytes(ctx->kv_self.cell_ids);
 
-            LLAMA_LOG_INFO("%s: compute buffer total size = %.2f MiB\n", __func__, (ctx->buf_compute.size + alloc_size) / 1024.0 / 1024.0);
+                plan->compute_host = ctx->buf_compute.size + alloc_size;
+#ifdef GGML_USE_CUBLAS
+                if (model->n_gpu_layers > 0) {
+                    plan->compute_device = alloc_size;
+                }
+#endif
+#ifdef GGML_USE_METAL
+                // the buffers are shared with the GPU
+                if (model->n_gpu_layers > 0) {
+                    plan->kv_device      = plan->kv_host;
+                    plan->compute_device = alloc_size;
+                }
+#endif
+                return ctx;
+            }
 
-            // recreate allocator with exact memory requirements
-            ggml_allocr_free(ctx->alloc);
+            ctx->buf_alloc.resize(alloc_size_init);
+            ctx->alloc = ggml_allocr_new(ctx->buf_alloc.data, ctx->buf_alloc.size, LLAMA_TENSOR_ALIGNMENT);
 
-            ctx->buf_alloc.resize(alloc_size);
-            ctx->alloc = ggml_allocr_new(ctx->buf_alloc.data, ctx->buf_alloc.size, tensor_alignment);
+            // the buffers of the cached graphs are allocated when they are first built
+            ctx->graph_cache.resize(cparams.n_graph_cache);
 #ifdef GGML_USE_METAL
             if (ctx->ctx_metal) {
                 //ggml_allocr_set_parse_seq(ctx->alloc, ggml_metal_get_concur_list(ctx->ctx_metal), ggml_metal_if_optimized(ctx->ctx_metal));
             }
 #endif
 #ifdef GGML_USE_CUBLAS
-            ggml_cuda_set_scratch_size(alloc_size);
-            LLAMA_LOG_INFO("%s: VRAM scratch buffer: %.2f MiB\n", __func__, alloc_size / 1024.0 / 1024.0);
+            ggml_cuda_set_scratch_size(alloc_size_init);
+            LLAMA_LOG_INFO("%s: VRAM scratch buffer: %.2f MiB (up to %.2f MiB)\n", __func__,
+                    alloc_size_init / 1024.0 / 1024.0, alloc_size / 1024.0 / 1024.0);
 
             // calculate total VRAM usage
             auto add_tensor = [](const ggml_tensor * t, size_t & size) {
@@ -9347,23 +12664,190 @@ struct llama_context * llama_new_context_with_model(
     }
 
 #ifdef GGML_USE_MPI
-    ctx->ctx_mpi = ggml_mpi_init();
-
     if (ggml_mpi_rank(ctx->ctx_mpi) > 0) {
-        // Enter a blocking eval loop with dummy input, letting rank=0 drive the process
-        // TODO: needs fix after #3228
-        GGML_ASSERT(false && "not implemented");
-        //const std::vector<llama_token> tmp(ctx->model.hparams.n_ctx, llama_token_bos(ctx));
-        //while (!llama_eval(ctx, tmp.data(), tmp.size(), 0, 0)) {};
+        // the worker nodes evaluate their layers of the batches of the main node, it drives the process
+        llama_mpi_worker_loop(*ctx);
+        llama_free(ctx);
         llama_backend_free();
-        exit(1);
+        exit(0);
     }
 #endif
 
     return ctx;
 }
 
+struct llama_context * llama_new_context_with_model(
+                 struct llama_model * model,
+        struct llama_context_params   params) {
+    return llama_new_context_internal(model, params, nullptr);
+}
+
+size_t llama_memory_plan_host(const struct llama_memory_plan * plan) {
+    return plan->weights_host + plan->kv_host + plan->compute_host;
+}
+
+size_t llama_memory_plan_device(const struct llama_memory_plan * plan) {
+    return plan->weights_device + plan->kv_device + plan->compute_device;
+}
+
+bool llama_plan_memory(
+                         const char * path_model,
+          struct llama_model_params   mparams,
+        struct llama_context_params   cparams,
+           struct llama_memory_plan * plan) {
+    ggml_time_init();
+
+    *plan = {};
+
+    // the metadata of the tensors is read from the file, the mapping of the weights is not read nor locked
+    mparams.vocab_only        = false;
+    mparams.use_mmap          = true;
+    mparams.use_mlock         = false;
+    mparams.repack            = false;
+    mparams.progress_callback = NULL;
+
+    llama_model * model = new llama_model;
+    model->dry_run = true;
+
+    if (!llama_model_load(path_model, *model, mparams)) {
+        LLAMA_LOG_ERROR("%s: failed to load model\n", __func__);
+        delete model;
+        return false;
+    }
+
+    for (const auto & it : model->tensors_by_name) {
+        const ggml_tensor * t = it.second;
+        if (t->backend == GGML_BACKEND_GPU || t->backend == GGML_BACKEND_GPU_SPLIT) {
+            plan->weights_device += ggml_nbytes(t);
+        } else {
+            plan->weights_host += ggml_nbytes(t);
+        }
+    }
+#ifdef GGML_USE_METAL
+    // the whole mapping of the model is shared with the GPU
+    if (model->n_gpu_layers > 0) {
+        plan->weights_device = plan->weights_host;
+    }
+#endif
+
+    llama_context * ctx = llama_new_context_internal(model, cparams, plan);
+
+    const bool ok = ctx != nullptr;
+
+    delete ctx;
+    delete model;
+
+    return ok;
+}
+
+static void llama_log_callback_null(ggml_log_level level, const char * text, void * user_data) {
+    (void) level;
+    (void) text;
+    (void) user_data;
+}
+
+bool llama_plan_fit(
+                         const char * path_model,
+                             size_t   vram_budget,
+                            int32_t   n_parallel_max,
+         struct llama_model_params  * mparams,
+       struct llama_context_params  * cparams,
+                            int32_t * n_parallel) {
+    // the hyperparameters of the model, for the range of the layers and the context
+    llama_model_params mparams_vocab = *mparams;
+    mparams_vocab.vocab_only = true;
+    mparams_vocab.progress_callback = NULL;
+
+    llama_model * model = llama_load_model_from_file(path_model, mparams_vocab);
+    if (!model) {
+        return false;
+    }
+
+    const int32_t  n_layer   = model->hparams.n_layer;
+    const uint32_t n_ctx_seq = cparams->n_ctx == 0 ? model->hparams.n_ctx_train : cparams->n_ctx;
+
+    llama_free_model(model);
+
+    // the loads of the trials are not logged
+    const auto log_callback           = g_state.log_callback;
+    void *     log_callback_user_data = g_state.log_callback_user_data;
+    llama_log_set(llama_log_callback_null, NULL);
+
+    bool ok = true;
+
+    const auto fits = [&](int32_t n_gpu_layers, int32_t n_seq) {
+        llama_model_params   mp = *mparams;
+        llama_context_params cp = *cparams;
+
+        mp.n_gpu_layers = n_gpu_layers;
+        cp.n_ctx        = n_ctx_seq*n_seq;
+
+        llama_memory_plan plan;
+        if (!llama_plan_memory(path_model, mp, cp, &plan)) {
+            ok = false;
+            return false;
+        }
+
+        return llama_memory_plan_device(&plan) <= vram_budget;
+    };
+
+    // the device memory grows with each of them, the largest values that fit are searched by bisection: first the
+    // layers, n_layer + 1 with the output, with a single sequence
+    int32_t n_gpu_layers = 0;
+    {
+        int32_t lo = 0;
+        int32_t hi = n_layer + 1;
+        while (ok && lo < hi) {
+            const int32_t mid = (lo + hi + 1)/2;
+            if (fits(mid, 1)) {
+                lo = mid;
+            } else {
+                hi = mid - 1;
+            }
+        }
+        n_gpu_layers = lo;
+    }
+
+    // then the sequences, once all the layers fit
+    int32_t n_seq = 1;
+    if (n_gpu_layers == n_layer + 1) {
+        int32_t lo = 1;
+        int32_t hi = std::max(1, n_parallel_max);
+        while (ok && lo < hi) {
+            const int32_t mid = (lo + hi + 1)/2;
+            if (fits(n_gpu_layers, mid)) {
+                lo = mid;
+            } else {
+                hi = mid - 1;
+            }
+        }
+        n_seq = lo;
+    }
+
+    llama_log_set(log_callback, log_callback_user_data);
+
+    if (!ok) {
+        return false;
+    }
+
+    mparams->n_gpu_layers = n_gpu_layers;
+    cparams->n_ctx        = n_ctx_seq*n_seq;
+    if (n_parallel) {
+        *n_parallel = n_seq;
+    }
+
+    LLAMA_LOG_INFO("%s: %.2f MiB of device memory: n_gpu_layers = %d, n_ctx = %u, %d sequences\n", __func__,
+            vram_budget/1024.0/1024.0, n_gpu_layers, cparams->n_ctx, n_seq);
+
+    return true;
+}
+
 void llama_free(struct llama_context * ctx) {
+    llama_synchronize(ctx);
+
+#ifdef GGML_USE_MPI
+    llama_mpi_bcast_cmd(*ctx, LLAMA_MPI_CMD_QUIT);
+#endif
     delete ctx;
 }
 
@@ -9596,10 +13080,16 @@ int llama_get_kv_cache_used_cells(const struct llama_context * ctx) {
 }
 
 void llama_kv_cache_clear(struct llama_context * ctx) {
+#ifdef GGML_USE_MPI
+    llama_mpi_bcast_cmd(*ctx, LLAMA_MPI_CMD_KV_CLEAR);
+#endif
     llama_kv_cache_clear(ctx->kv_self);
 }
 
 void llama_kv_cache_seq_rm(struct llama_context * ctx, llama_seq_id seq_id, llama_pos p0, llama_pos p1) {
+#ifdef GGML_USE_MPI
+    llama_mpi_bcast_cmd(*ctx, LLAMA_MPI_CMD_SEQ_RM, seq_id, p0, p1);
+#endif
     llama_kv_cache_seq_rm(ctx->kv_self, seq_id, p0, p1);
 }
 
@@ -9607,14 +13097,23 @@ void llama_kv_cache_seq_cp(struct llama_context * ctx, llama_seq_id seq_id_src,
     if (seq_id_src == seq_id_dst) {
         return;
     }
+#ifdef GGML_USE_MPI
+    llama_mpi_bcast_cmd(*ctx, LLAMA_MPI_CMD_SEQ_CP, seq_id_src, seq_id_dst, p0, p1);
+#endif
     llama_kv_cache_seq_cp(ctx->kv_self, seq_id_src, seq_id_dst, p0, p1);
 }
 
 void llama_kv_cache_seq_keep(struct llama_context * ctx, llama_seq_id seq_id) {
+#ifdef GGML_USE_MPI
+    llama_mpi_bcast_cmd(*ctx, LLAMA_MPI_CMD_SEQ_KEEP, seq_id);
+#endif
     llama_kv_cache_seq_keep(ctx->kv_self, seq_id);
 }
 
 void llama_kv_cache_seq_shift(struct llama_context * ctx, llama_seq_id seq_id, llama_pos p0, llama_pos p1, llama_pos delta) {
+#ifdef GGML_USE_MPI
+    llama_mpi_bcast_cmd(*ctx, LLAMA_MPI_CMD_SEQ_SHIFT, seq_id, p0, p1, delta);
+#endif
     llama_kv_cache_seq_shift(ctx->kv_self, seq_id, p0, p1, delta);
 }
 
@@ -9654,6 +13153,15 @@ struct llama_data_context {
     virtual void write(const void * src, size_t size) = 0;
     virtual size_t get_size_written() = 0;
     virtual ~llama_data_context() = default;
+
+    void write_zeros(size_t size) {
+        static const uint8_t zeros[4096] = { 0 };
+        while (size > 0) {
+            const size_t n = std::min(size, sizeof(zeros));
+            write(zeros, n);
+            size -= n;
+        }
+    }
 };
 
 struct llama_data_buffer_context : llama_data_context {
@@ -9689,7 +13197,106 @@ struct llama_data_file_context : llama_data_context {
     }
 };
 
-/** copy state data into either a buffer or file depending on the passed in context
+struct llama_data_callback_context : llama_data_context {
+    llama_state_write_callback callback;
+    void * user_data;
+    size_t size_written = 0;
+
+    llama_data_callback_context(llama_state_write_callback callback, void * user_data) : callback(callback), user_data(user_data) {}
+
+    void write(const void * src, size_t size) override {
+        if (size > 0 && !callback(src, size, user_data)) {
+            throw std::runtime_error(format("failed to write %zu bytes of state", size));
+        }
+        size_written += size;
+    }
+
+    size_t get_size_written() override {
+        return size_written;
+    }
+};
+
+// the reverse of llama_data_context
+struct llama_data_read_context {
+    virtual void read(void * dst, size_t size) = 0;
+    virtual size_t get_size_read() = 0;
+    virtual ~llama_data_read_context() = default;
+
+    virtual void skip(size_t size) {
+        uint8_t buf[4096];
+        while (size > 0) {
+            const size_t n = std::min(size, sizeof(buf));
+            read(buf, n);
+            size -= n;
+        }
+    }
+};
+
+struct llama_data_buffer_read_context : llama_data_read_context {
+    const uint8_t * ptr;
+    size_t size_read = 0;
+
+    llama_data_buffer_read_context(const uint8_t * p) : ptr(p) {}
+
+    void read(void * dst, size_t size) override {
+        memcpy(dst, ptr, size);
+        ptr += size;
+        size_read += size;
+    }
+
+    void skip(size_t size) override {
+        ptr += size;
+        size_read += size;
+    }
+
+    size_t get_size_read() override {
+        return size_read;
+    }
+};
+
+struct llama_data_file_read_context : llama_data_read_context {
+    llama_file * file;
+    size_t size_read = 0;
+
+    llama_data_file_read_context(llama_file * f) : file(f) {}
+
+    void read(void * dst, size_t size) override {
+        file->read_raw(dst, size);
+        size_read += size;
+    }
+
+    void skip(size_t size) override {
+        file->seek(size, SEEK_CUR);
+        size_read += size;
+    }
+
+    size_t get_size_read() override {
+        return size_read;
+    }
+};
+
+struct llama_data_callback_read_context : llama_data_read_context {
+    llama_state_read_callback callback;
+    void * user_data;
+    size_t size_read = 0;
+
+    llama_data_callback_read_context(llama_state_read_callback callback, void * user_data) : callback(callback), user_data(user_data) {}
+
+    void read(void * dst, size_t size) override {
+        if (size > 0 && !callback(dst, size, user_data)) {
+            throw std::runtime_error(format("failed to read %zu bytes of state", size));
+        }
+        size_read += size;
+    }
+
+    size_t get_size_read() override {
+        return size_read;
+    }
+};
+
+/** copy state data into either a buffer, a file or a callback depending on the passed in context
+ *
+ * the KV rows are written straight from the cache tensors, so writing to a file or a callback takes no extra memory
  *
  * file context:
  * llama_file file("/path", "wb");
@@ -9731,11 +13338,7 @@ static void llama_copy_state_data_internal(struct llama_context * ctx, llama_dat
         }
 
         // If there is a gap between the size and the capacity, write padding
-        size_t padding_size = (logits_cap - logits_size) * sizeof(float);
-        if (padding_size > 0) {
-            std::vector<uint8_t> padding(padding_size, 0); // Create a buffer filled with zeros
-            data_ctx->write(padding.data(), padding_size);
-        }
+        data_ctx->write_zeros((logits_cap - logits_size) * sizeof(float));
     }
 
     // copy embeddings
@@ -9760,7 +13363,7 @@ static void llama_copy_state_data_internal(struct llama_context * ctx, llama_dat
         const auto   n_ctx   = cparams.n_ctx;
 
         const size_t   kv_buf_size = kv_self.buf.size;
-        const uint32_t kv_head     = kv_self.head;
+        const uint32_t kv_head     = std::max(kv_self.head, (uint32_t) llama_kv_cache_cell_max(kv_self));
         const uint32_t kv_size     = kv_self.size;
         const uint32_t kv_used     = kv_self.used;
 
@@ -9770,44 +13373,22 @@ static void llama_copy_state_data_internal(struct llama_context * ctx, llama_dat
         data_ctx->write(&kv_used,     sizeof(kv_used));
 
         if (kv_buf_size) {
-            const size_t elt_size = ggml_element_size(kv_self.k_l[0]);
-
-            ggml_context * cpy_ctx = ggml_init({ 6*n_layer*ggml_tensor_overhead() + ggml_graph_overhead(), NULL, /* no_alloc */ true });
-            ggml_cgraph * gf = ggml_new_graph(cpy_ctx);
-
-            std::vector<std::vector<uint8_t>> kout2d_data(n_layer);
-            std::vector<std::vector<uint8_t>> vout2d_data(n_layer);
-
-            for (int il = 0; il < (int) n_layer; ++il) {
-                ggml_tensor * kout2d = ggml_new_tensor_2d(cpy_ctx, kv_self.k_l[il]->type, n_embd, kv_head);
-                kout2d_data[il].resize(ggml_nbytes(kout2d));
-                kout2d->data = kout2d_data[il].data();
-
-                ggml_tensor * vout2d = ggml_new_tensor_2d(cpy_ctx, kv_self.v_l[il]->type, kv_head, n_embd);
-                vout2d_data[il].resize(ggml_nbytes(vout2d));
-                vout2d->data = vout2d_data[il].data();
-
-                ggml_tensor * k2d = ggml_view_2d(cpy_ctx, kv_self.k_l[il],
-                        n_embd, kv_head,
-                        elt_size*n_embd, 0);
-
-                ggml_tensor * v2d = ggml_view_2d(cpy_ctx, kv_self.v_l[il],
-                        kv_head, n_embd,
-                        elt_size*n_ctx, 0);
-
-                ggml_build_forward_expand(gf, ggml_cpy(cpy_ctx, k2d, kout2d));
-                ggml_build_forward_expand(gf, ggml_cpy(cpy_ctx, v2d, vout2d));
-            }
-
-            ggml_graph_compute_helper(ctx->work_buffer, gf, /*n_threads*/ 1);
+            // the rows of the first kv_head cells are written straight from the cache, without a copy:
+            // per layer, the K rows, then the V rows, or kv_head elements of each of the n_embd rows if V is transposed
+            for (uint32_t il = 0; il < n_layer; ++il) {
+                const ggml_tensor * k = kv_self.k_l[il];
+                const ggml_tensor * v = kv_self.v_l[il];
 
-            ggml_free(cpy_ctx);
+                data_ctx->write(k->data, ggml_row_size(k->type, n_embd)*kv_head);
 
-            // our data is now in the kout2d_data and vout2d_data buffers
-            // write them to file
-            for (uint32_t il = 0; il < n_layer; ++il) {
-                data_ctx->write(kout2d_data[il].data(), kout2d_data[il].size());
-                data_ctx->write(vout2d_data[il].data(), vout2d_data[il].size());
+                if (kv_self.v_trans) {
+                    const size_t v_size = ggml_element_size(v);
+                    for (uint32_t j = 0; j < n_embd; ++j) {
+                        data_ctx->write((const uint8_t *) v->data + (size_t) j*n_ctx*v_size, kv_head*v_size);
+                    }
+                } else {
+                    data_ctx->write(v->data, ggml_row_size(v->type, n_embd)*kv_head);
+                }
             }
         }
 
@@ -9834,17 +13415,15 @@ size_t llama_copy_state_data(struct llama_context * ctx, uint8_t * dst) {
     return data_ctx.get_size_written();
 }
 
-// Sets the state reading from the specified source address
-size_t llama_set_state_data(struct llama_context * ctx, uint8_t * src) {
-    uint8_t * inp = src;
-
+// Sets the state reading from the specified source
+static void llama_set_state_data_internal(struct llama_context * ctx, llama_data_read_context * data_ctx) {
     // set rng
     {
         size_t rng_size;
         char   rng_buf[LLAMA_MAX_RNG_STATE];
 
-        memcpy(&rng_size,   inp, sizeof(rng_size));    inp += sizeof(rng_size);
-        memcpy(&rng_buf[0], inp, LLAMA_MAX_RNG_STATE); inp += LLAMA_MAX_RNG_STATE;
+        data_ctx->read(&rng_size,   sizeof(rng_size));
+        data_ctx->read(&rng_buf[0], LLAMA_MAX_RNG_STATE);
 
         std::stringstream rng_ss;
         rng_ss.str(std::string(&rng_buf[0], rng_size));
@@ -9858,30 +13437,29 @@ size_t llama_set_state_data(struct llama_context * ctx, uint8_t * src) {
         size_t logits_cap;
         size_t logits_size;
 
-        memcpy(&logits_cap,  inp, sizeof(logits_cap));  inp += sizeof(logits_cap);
-        memcpy(&logits_size, inp, sizeof(logits_size)); inp += sizeof(logits_size);
+        data_ctx->read(&logits_cap,  sizeof(logits_cap));
+        data_ctx->read(&logits_size, sizeof(logits_size));
 
         GGML_ASSERT(ctx->logits.capacity() == logits_cap);
 
         if (logits_size) {
             ctx->logits.resize(logits_size);
-            memcpy(ctx->logits.data(), inp, logits_size * sizeof(float));
+            data_ctx->read(ctx->logits.data(), logits_size * sizeof(float));
         }
 
-        inp += logits_cap * sizeof(float);
+        data_ctx->skip((logits_cap - logits_size) * sizeof(float));
     }
 
     // set embeddings
     {
         size_t embedding_size;
 
-        memcpy(&embedding_size, inp, sizeof(embedding_size)); inp += sizeof(embedding_size);
+        data_ctx->read(&embedding_size, sizeof(embedding_size));
 
         GGML_ASSERT(ctx->embedding.capacity() == embedding_size);
 
         if (embedding_size) {
-            memcpy(ctx->embedding.data(), inp, embedding_size * sizeof(float));
-            inp += embedding_size * sizeof(float);
+            data_ctx->read(ctx->embedding.data(), embedding_size * sizeof(float));
         }
     }
 
@@ -9900,48 +13478,34 @@ size_t llama_set_state_data(struct llama_context * ctx, uint8_t * src) {
         uint32_t kv_size;
         uint32_t kv_used;
 
-        memcpy(&kv_buf_size, inp, sizeof(kv_buf_size)); inp += sizeof(kv_buf_size);
-        memcpy(&kv_head,     inp, sizeof(kv_head));     inp += sizeof(kv_head);
-        memcpy(&kv_size,     inp, sizeof(kv_size));     inp += sizeof(kv_size);
-        memcpy(&kv_used,     inp, sizeof(kv_used));     inp += sizeof(kv_used);
+        data_ctx->read(&kv_buf_size, sizeof(kv_buf_size));
+        data_ctx->read(&kv_head,     sizeof(kv_head));
+        data_ctx->read(&kv_size,     sizeof(kv_size));
+        data_ctx->read(&kv_used,     sizeof(kv_used));
 
         if (kv_buf_size) {
             GGML_ASSERT(kv_self.buf.size == kv_buf_size);
 
-            const size_t elt_size = ggml_element_size(kv_self.k_l[0]);
-
-            ggml_context * cpy_ctx = ggml_init({ 6*n_layer*ggml_tensor_overhead() + ggml_graph_overhead(), NULL, /* no_alloc */ true });
-            ggml_cgraph * gf = ggml_new_graph(cpy_ctx);
-
+            // the rows are read straight into the cache, in the layout written by llama_copy_state_data_internal
             for (int il = 0; il < n_layer; ++il) {
-                ggml_tensor * kin2d = ggml_new_tensor_2d(cpy_ctx, kv_self.k_l[il]->type, n_embd, kv_head);
-                kin2d->data = (void *) inp;
-                inp += ggml_nbytes(kin2d);
+                ggml_tensor * k = kv_self.k_l[il];
+                ggml_tensor * v = kv_self.v_l[il];
 
-                ggml_tensor * vin2d = ggml_new_tensor_2d(cpy_ctx, kv_self.v_l[il]->type, kv_head, n_embd);
-                vin2d->data = (void *) inp;
-                inp += ggml_nbytes(vin2d);
+                data_ctx->read(k->data, ggml_row_size(k->type, n_embd)*kv_head);
 
-                ggml_tensor * k2d = ggml_view_2d(cpy_ctx, kv_self.k_l[il],
-                    n_embd, kv_head,
-                    elt_size*n_embd, 0);
-
-                ggml_tensor * v2d = ggml_view_2d(cpy_ctx, kv_self.v_l[il],
-                    kv_head, n_embd,
-                    elt_size*n_ctx, 0);
-
-                ggml_build_forward_expand(gf, ggml_cpy(cpy_ctx, kin2d, k2d));
-                ggml_build_forward_expand(gf, ggml_cpy(cpy_ctx, vin2d, v2d));
+                if (kv_self.v_trans) {
+                    const size_t v_size = ggml_element_size(v);
+                    for (int j = 0; j < n_embd; ++j) {
+                        data_ctx->read((uint8_t *) v->data + (size_t) j*n_ctx*v_size, kv_head*v_size);
+                    }
+                } else {
+                    data_ctx->read(v->data, ggml_row_size(v->type, n_embd)*kv_head);
+                }
             }
-
-            ggml_graph_compute_helper(ctx->work_buffer, gf, /*n_threads*/ 1);
-
-            ggml_free(cpy_ctx);
         }
 
         ctx->kv_self.head = kv_head;
         ctx->kv_self.size = kv_size;
-        ctx->kv_self.used = kv_used;
 
         ctx->kv_self.cells.resize(kv_size);
 
@@ -9949,108 +13513,604 @@ size_t llama_set_state_data(struct llama_context * ctx, uint8_t * src) {
             llama_pos pos;
             size_t    seq_id_size;
 
-            memcpy(&pos,         inp, sizeof(pos));         inp += sizeof(pos);
-            memcpy(&seq_id_size, inp, sizeof(seq_id_size)); inp += sizeof(seq_id_size);
+            data_ctx->read(&pos,         sizeof(pos));
+            data_ctx->read(&seq_id_size, sizeof(seq_id_size));
+
+            ctx->kv_self.cells[i].pos = pos;
+            ctx->kv_self.cells[i].seq_id.clear();
+
+            llama_seq_id seq_id;
+
+            for (size_t j = 0; j < seq_id_size; ++j) {
+                data_ctx->read(&seq_id, sizeof(seq_id));
+                ctx->kv_self.cells[i].seq_id.insert(seq_id);
+            }
+        }
+
+        // the count of used cells is recomputed with the indices
+        llama_kv_cache_reindex(ctx->kv_self);
+        GGML_UNUSED(kv_used);
+    }
+
+    const size_t nread    = data_ctx->get_size_read();
+    const size_t max_size = llama_get_state_size(ctx);
+
+    GGML_ASSERT(nread <= max_size);
+}
+
+size_t llama_set_state_data(struct llama_context * ctx, uint8_t * src) {
+    llama_data_buffer_read_context data_ctx(src);
+    llama_set_state_data_internal(ctx, &data_ctx);
+
+    return data_ctx.get_size_read();
+}
+
+size_t llama_state_write(struct llama_context * ctx, llama_state_write_callback write, void * user_data) {
+    llama_data_callback_context data_ctx(write, user_data);
+    try {
+        llama_copy_state_data_internal(ctx, &data_ctx);
+    } catch (const std::exception & err) {
+        LLAMA_LOG_ERROR("%s: %s\n", __func__, err.what());
+        return 0;
+    }
+
+    return data_ctx.get_size_written();
+}
+
+size_t llama_state_read(struct llama_context * ctx, llama_state_read_callback read, void * user_data) {
+    llama_data_callback_read_context data_ctx(read, user_data);
+    try {
+        llama_set_state_data_internal(ctx, &data_ctx);
+    } catch (const std::exception & err) {
+        LLAMA_LOG_ERROR("%s: %s\n", __func__, err.what());
+        return 0;
+    }
+
+    return data_ctx.get_size_read();
+}
+
+static bool llama_fd_write(const void * src, size_t size, void * user_data) {
+    const int fd = *(const int *) user_data;
+    const char * ptr = (const char *) src;
+    while (size > 0) {
+#if defined(_WIN32)
+        const int n = _write(fd, ptr, (unsigned int) std::min<size_t>(size, INT_MAX));
+#else
+        const ssize_t n = write(fd, ptr, size);
+#endif
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        ptr  += n;
+        size -= n;
+    }
+    return true;
+}
+
+static bool llama_fd_read(void * dst, size_t size, void * user_data) {
+    const int fd = *(const int *) user_data;
+    char * ptr = (char *) dst;
+    while (size > 0) {
+#if defined(_WIN32)
+        const int n = _read(fd, ptr, (unsigned int) std::min<size_t>(size, INT_MAX));
+#else
+        const ssize_t n = read(fd, ptr, size);
+#endif
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        ptr  += n;
+        size -= n;
+    }
+    return true;
+}
+
+size_t llama_state_write_to_fd(struct llama_context * ctx, int fd) {
+    return llama_state_write(ctx, llama_fd_write, &fd);
+}
+
+size_t llama_state_read_from_fd(struct llama_context * ctx, int fd) {
+    return llama_state_read(ctx, llama_fd_read, &fd);
+}
+
+// the KV of a single sequence, independent of the cells that hold it:
+//
+//   uint32_t                             n_cells
+//   { llama_pos pos, delta }             x n_cells
+//   per layer:
+//     K rows                             x n_cells
+//     V rows                             x n_cells, or n_embd rows of n_cells elements if V is transposed
+//
+// pos and delta are those of the cells, so that a pending shift is applied after the restore
+static size_t llama_kv_cache_seq_size(const struct llama_context * ctx, uint32_t n_cells) {
+    const auto & kv_self = ctx->kv_self;
+    const auto & hparams = ctx->model.hparams;
+
+    const uint32_t n_layer = hparams.n_layer;
+    const uint32_t n_embd  = hparams.n_embd_gqa();
+
+    size_t s_total = sizeof(uint32_t) + n_cells*2*sizeof(llama_pos);
+    for (uint32_t il = 0; il < n_layer; ++il) {
+        s_total += n_cells*ggml_row_size(kv_self.k_l[il]->type, n_embd);
+        s_total += n_cells*ggml_row_size(kv_self.v_l[il]->type, n_embd);
+    }
+
+    return s_total;
+}
+
+static bool llama_kv_cache_seq_on_host(const struct llama_kv_cache & kv_self) {
+    for (size_t il = 0; il < kv_self.k_l.size(); ++il) {
+        if (kv_self.k_l[il]->backend != GGML_BACKEND_CPU || kv_self.v_l[il]->backend != GGML_BACKEND_CPU) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void llama_kv_cache_seq_write(
+             struct llama_context * ctx,
+        struct llama_data_context * data_ctx,
+      const std::vector<uint32_t> & cells) {
+    const auto & kv_self = ctx->kv_self;
+    const auto & hparams = ctx->model.hparams;
+
+    const uint32_t n_layer = hparams.n_layer;
+    const uint32_t n_embd  = hparams.n_embd_gqa();
+    const uint32_t n_ctx   = kv_self.size;
+    const uint32_t n_cells = cells.size();
+
+    data_ctx->write(&n_cells, sizeof(n_cells));
+
+    for (const uint32_t i : cells) {
+        data_ctx->write(&kv_self.cells[i].pos,   sizeof(llama_pos));
+        data_ctx->write(&kv_self.cells[i].delta, sizeof(llama_pos));
+    }
+
+    std::vector<uint8_t> column;
+
+    for (uint32_t il = 0; il < n_layer; ++il) {
+        const ggml_tensor * k = kv_self.k_l[il];
+        const ggml_tensor * v = kv_self.v_l[il];
+
+        const size_t k_row_size = ggml_row_size(k->type, n_embd);
+        for (const uint32_t i : cells) {
+            data_ctx->write((const uint8_t *) k->data + i*k_row_size, k_row_size);
+        }
+
+        if (kv_self.v_trans) {
+            const size_t v_size = ggml_element_size(v);
+            column.resize(n_cells*v_size);
+            for (uint32_t j = 0; j < n_embd; ++j) {
+                const uint8_t * row = (const uint8_t *) v->data + (size_t) j*n_ctx*v_size;
+                for (uint32_t ic = 0; ic < n_cells; ++ic) {
+                    memcpy(column.data() + ic*v_size, row + cells[ic]*v_size, v_size);
+                }
+                data_ctx->write(column.data(), column.size());
+            }
+        } else {
+            const size_t v_row_size = ggml_row_size(v->type, n_embd);
+            for (const uint32_t i : cells) {
+                data_ctx->write((const uint8_t *) v->data + i*v_row_size, v_row_size);
+            }
+        }
+    }
+}
+
+size_t llama_kv_cache_seq_get_size(struct llama_context * ctx, llama_seq_id seq_id, llama_pos p0, llama_pos p1) {
+    if (p0 < 0) p0 = 0;
+    if (p1 < 0) p1 = std::numeric_limits<llama_pos>::max();
+
+    return llama_kv_cache_seq_size(ctx, llama_kv_cache_seq_find(ctx->kv_self, seq_id, p0, p1).size());
+}
+
+size_t llama_kv_cache_seq_get_data(struct llama_context * ctx, llama_seq_id seq_id, llama_pos p0, llama_pos p1, uint8_t * dst) {
+    if (!llama_kv_cache_seq_on_host(ctx->kv_self)) {
+        LLAMA_LOG_ERROR("%s: the KV cache is not in host memory\n", __func__);
+        return 0;
+    }
+
+    if (p0 < 0) p0 = 0;
+    if (p1 < 0) p1 = std::numeric_limits<llama_pos>::max();
+
+    llama_data_buffer_context data_ctx(dst);
+    llama_kv_cache_seq_write(ctx, &data_ctx, llama_kv_cache_seq_find(ctx->kv_self, seq_id, p0, p1));
+
+    return data_ctx.get_size_written();
+}
+
+size_t llama_kv_cache_seq_set_data(struct llama_context * ctx, llama_seq_id seq_id, const uint8_t * src) {
+    auto & kv_self = ctx->kv_self;
+    const auto & hparams = ctx->model.hparams;
+
+    if (!llama_kv_cache_seq_on_host(kv_self)) {
+        LLAMA_LOG_ERROR("%s: the KV cache is not in host memory\n", __func__);
+        return 0;
+    }
+
+    const uint32_t n_layer = hparams.n_layer;
+    const uint32_t n_embd  = hparams.n_embd_gqa();
+    const uint32_t n_ctx   = kv_self.size;
+
+    const uint8_t * inp = src;
+
+    uint32_t n_cells;
+    memcpy(&n_cells, inp, sizeof(n_cells)); inp += sizeof(n_cells);
+
+    if (n_cells > kv_self.size - kv_self.used) {
+        return 0;
+    }
+
+    // the lowest free cells, in increasing order
+    std::vector<uint32_t> cells(n_cells);
+    for (uint32_t ic = 0, i = 0; ic < n_cells; ++ic, ++i) {
+        i = llama_kv_cache_next_free(kv_self, i);
+        cells[ic] = i;
+    }
+
+    for (const uint32_t i : cells) {
+        llama_pos pos;
+        llama_pos delta;
+        memcpy(&pos,   inp, sizeof(pos));   inp += sizeof(pos);
+        memcpy(&delta, inp, sizeof(delta)); inp += sizeof(delta);
+
+        llama_kv_cache_cell_use(kv_self, i, pos);
+        llama_kv_cache_cell_add_seq(kv_self, i, seq_id);
+        kv_self.cells[i].delta = 0;
+        if (delta != 0) {
+            llama_kv_cache_cell_shift(kv_self, i, delta);
+        }
+    }
+
+    for (uint32_t il = 0; il < n_layer; ++il) {
+        ggml_tensor * k = kv_self.k_l[il];
+        ggml_tensor * v = kv_self.v_l[il];
+
+        const size_t k_row_size = ggml_row_size(k->type, n_embd);
+        for (const uint32_t i : cells) {
+            memcpy((uint8_t *) k->data + i*k_row_size, inp, k_row_size);
+            inp += k_row_size;
+        }
+
+        if (kv_self.v_trans) {
+            const size_t v_size = ggml_element_size(v);
+            for (uint32_t j = 0; j < n_embd; ++j) {
+                uint8_t * row = (uint8_t *) v->data + (size_t) j*n_ctx*v_size;
+                for (const uint32_t i : cells) {
+                    memcpy(row + i*v_size, inp, v_size);
+                    inp += v_size;
+                }
+            }
+        } else {
+            const size_t v_row_size = ggml_row_size(v->type, n_embd);
+            for (const uint32_t i : cells) {
+                memcpy((uint8_t *) v->data + i*v_row_size, inp, v_row_size);
+                inp += v_row_size;
+            }
+        }
+    }
+
+    const size_t nread = inp - src;
+
+    GGML_ASSERT(nread == llama_kv_cache_seq_size(ctx, n_cells));
+
+    return nread;
+}
+
+static bool llama_load_session_file_internal(struct llama_context * ctx, const char * path_session, llama_token * tokens_out, size_t n_token_capacity, size_t * n_token_count_out) {
+    llama_file file(path_session, "rb");
+
+    // sanity checks
+    {
+        const uint32_t magic   = file.read_u32();
+        const uint32_t version = file.read_u32();
+
+        if (magic != LLAMA_SESSION_MAGIC || version != LLAMA_SESSION_VERSION) {
+            LLAMA_LOG_ERROR("%s : unknown (magic, version) for session file: %08x, %08x\n", __func__, magic, version);
+            return false;
+        }
+
+        llama_hparams session_hparams;
+        file.read_raw(&session_hparams, sizeof(llama_hparams));
+
+        if (session_hparams != ctx->model.hparams) {
+            LLAMA_LOG_INFO("%s : model hparams didn't match from session file!\n", __func__);
+            return false;
+        }
+    }
+
+    // load the prompt
+    {
+        const uint32_t n_token_count = file.read_u32();
+
+        if (n_token_count > n_token_capacity) {
+            LLAMA_LOG_ERROR("%s : token count in session file exceeded capacity! %u > %zu\n", __func__, n_token_count, n_token_capacity);
+            return false;
+        }
+
+        file.read_raw(tokens_out, sizeof(llama_token) * n_token_count);
+        *n_token_count_out = n_token_count;
+    }
+
+    // restore the context state
+    {
+        const size_t n_state_size_cur = file.size - file.tell();
+        const size_t n_state_size_max = llama_get_state_size(ctx);
+
+        if (n_state_size_cur > n_state_size_max) {
+            LLAMA_LOG_ERROR("%s : the state size in session file is too big! max %zu, got %zu\n", __func__, n_state_size_max, n_state_size_cur);
+            return false;
+        }
+
+        // read straight from the file, without a buffer of the size of the state
+        llama_data_file_read_context data_ctx(&file);
+        llama_set_state_data_internal(ctx, &data_ctx);
+    }
+
+    return true;
+}
+
+bool llama_load_session_file(struct llama_context * ctx, const char * path_session, llama_token * tokens_out, size_t n_token_capacity, size_t * n_token_count_out) {
+    try {
+        return llama_load_session_file_internal(ctx, path_session, tokens_out, n_token_capacity, n_token_count_out);
+    } catch (const std::exception & err) {
+        LLAMA_LOG_ERROR("error loading session file: %s\n", err.what());
+        return false;
+    }
+}
+
+bool llama_save_session_file(struct llama_context * ctx, const char * path_session, const llama_token * tokens, size_t n_token_count) {
+    llama_file file(path_session, "wb");
+
+    file.write_u32(LLAMA_SESSION_MAGIC);
+    file.write_u32(LLAMA_SESSION_VERSION);
+
+    file.write_raw(&ctx->model.hparams, sizeof(llama_hparams));
+
+    // save the prompt
+    file.write_u32((uint32_t) n_token_count);
+    file.write_raw(tokens, sizeof(llama_token) * n_token_count);
+
+    // save the context state using stream saving
+    llama_data_file_context data_ctx(&file);
+    llama_copy_state_data_internal(ctx, &data_ctx);
+
+    return true;
+}
+
+// session files of a single sequence
+//
+//   uint32_t magic, version
+//   llama_hparams
+//   uint32_t type_k, type_v, alignment
+//   padding to alignment
+//   chunks, appended as the sequence grows:
+//     uint32_t    n_tokens
+//     uint64_t    kv_size
+//     llama_token tokens[n_tokens]
+//     padding to alignment
+//     KV of the tokens, in the format of llama_kv_cache_seq_get_data (kv_size bytes)
+//     padding to alignment
+//
+// the tokens of a chunk have the positions that follow those of the previous chunks, and its KV is
+// page-aligned so that it is copied from the mapped file straight into the KV cache
+
+static const uint32_t LLAMA_SEQ_SESSION_ALIGNMENT = 4096;
+
+static void llama_seq_session_pad(llama_file & file) {
+    static const char zeros[LLAMA_SEQ_SESSION_ALIGNMENT] = { 0 };
+    const size_t offset = file.tell();
+    file.write_raw(zeros, GGML_PAD(offset, LLAMA_SEQ_SESSION_ALIGNMENT) - offset);
+}
+
+// checks the header and seeks to the first chunk
+static bool llama_seq_session_read_header(llama_file & file, const struct llama_context * ctx) {
+    if (file.size < sizeof(uint32_t)*2 + sizeof(llama_hparams) + sizeof(uint32_t)*3) {
+        return false;
+    }
+
+    const uint32_t magic   = file.read_u32();
+    const uint32_t version = file.read_u32();
+    if (magic != LLAMA_SEQ_SESSION_MAGIC || version != LLAMA_SEQ_SESSION_VERSION) {
+        LLAMA_LOG_ERROR("%s : unknown (magic, version) for session file: %08x, %08x\n", __func__, magic, version);
+        return false;
+    }
+
+    llama_hparams session_hparams;
+    file.read_raw(&session_hparams, sizeof(llama_hparams));
+
+    const uint32_t type_k    = file.read_u32();
+    const uint32_t type_v    = file.read_u32();
+    const uint32_t alignment = file.read_u32();
+
+    if (session_hparams != ctx->model.hparams ||
+        type_k != (uint32_t) ctx->kv_self.k_l[0]->type ||
+        type_v != (uint32_t) ctx->kv_self.v_l[0]->type ||
+        alignment != LLAMA_SEQ_SESSION_ALIGNMENT) {
+        LLAMA_LOG_INFO("%s : model hparams or KV cache types didn't match from session file!\n", __func__);
+        return false;
+    }
+
+    file.seek(GGML_PAD(file.tell(), LLAMA_SEQ_SESSION_ALIGNMENT), SEEK_SET);
+
+    return true;
+}
+
+// reads the header of the next chunk and its tokens, returns false at the end of the file or if the chunk is truncated
+static bool llama_seq_session_read_chunk(llama_file & file, std::vector<llama_token> & tokens, size_t & kv_offset, uint64_t & kv_size) {
+    if (file.tell() + sizeof(uint32_t) + sizeof(uint64_t) > file.size) {
+        return false;
+    }
+
+    const uint32_t n_tokens = file.read_u32();
+    file.read_raw(&kv_size, sizeof(kv_size));
+
+    if (file.tell() + n_tokens*sizeof(llama_token) > file.size) {
+        return false;
+    }
+    tokens.resize(n_tokens);
+    file.read_raw(tokens.data(), n_tokens*sizeof(llama_token));
+
+    kv_offset = GGML_PAD(file.tell(), LLAMA_SEQ_SESSION_ALIGNMENT);
+    if (kv_offset + kv_size > file.size) {
+        return false;
+    }
+
+    file.seek(std::min(file.size, GGML_PAD(kv_offset + kv_size, LLAMA_SEQ_SESSION_ALIGNMENT)), SEEK_SET);
+
+    return true;
+}
+
+static bool llama_save_seq_session_file_internal(struct llama_context * ctx, const char * path_session, llama_seq_id seq_id, const llama_token * tokens, size_t n_token_count) {
+    if (!llama_kv_cache_seq_on_host(ctx->kv_self)) {
+        LLAMA_LOG_ERROR("%s : the KV cache is not in host memory\n", __func__);
+        return false;
+    }
+
+    // the tokens saved already, if they are a prefix of tokens
+    size_t n_saved = 0;
+    size_t n_valid = 0; // size of the file up to its last complete chunk
+
+    if (FILE * fp = std::fopen(path_session, "rb")) {
+        std::fclose(fp);
+
+        llama_file file(path_session, "rb");
+        if (llama_seq_session_read_header(file, ctx)) {
+            n_valid = file.tell();
+
+            std::vector<llama_token> chunk_tokens;
+            size_t   kv_offset;
+            uint64_t kv_size;
+            while (llama_seq_session_read_chunk(file, chunk_tokens, kv_offset, kv_size)) {
+                if (n_saved + chunk_tokens.size() > n_token_count ||
+                    !std::equal(chunk_tokens.begin(), chunk_tokens.end(), tokens + n_saved)) {
+                    n_saved = 0;
+                    n_valid = 0;
+                    break;
+                }
+                n_saved += chunk_tokens.size();
+                n_valid  = file.tell();
+            }
+        }
+
+        // a truncated chunk at the end of the file, left by an interrupted save: the file is written again
+        if (n_valid != file.size) {
+            n_saved = 0;
+            n_valid = 0;
+        }
+    }
+
+    if (n_valid > 0 && n_saved == n_token_count) {
+        return true;
+    }
 
-            ctx->kv_self.cells[i].pos = pos;
+    const std::vector<uint32_t> cells = llama_kv_cache_seq_find(ctx->kv_self, seq_id, n_saved, n_token_count);
+    if (cells.size() != n_token_count - n_saved) {
+        LLAMA_LOG_ERROR("%s : the positions of sequence %d are not the indices of its %zu tokens\n", __func__, seq_id, n_token_count);
+        return false;
+    }
 
-            llama_seq_id seq_id;
+    llama_file file(path_session, n_valid > 0 ? "ab" : "wb");
 
-            for (size_t j = 0; j < seq_id_size; ++j) {
-                memcpy(&seq_id, inp, sizeof(seq_id)); inp += sizeof(seq_id);
-                ctx->kv_self.cells[i].seq_id.insert(seq_id);
-            }
-        }
+    if (n_valid == 0) {
+        file.write_u32(LLAMA_SEQ_SESSION_MAGIC);
+        file.write_u32(LLAMA_SEQ_SESSION_VERSION);
+        file.write_raw(&ctx->model.hparams, sizeof(llama_hparams));
+        file.write_u32((uint32_t) ctx->kv_self.k_l[0]->type);
+        file.write_u32((uint32_t) ctx->kv_self.v_l[0]->type);
+        file.write_u32(LLAMA_SEQ_SESSION_ALIGNMENT);
+        llama_seq_session_pad(file);
     }
 
-    const size_t nread    = inp - src;
-    const size_t max_size = llama_get_state_size(ctx);
+    const uint64_t kv_size = llama_kv_cache_seq_size(ctx, cells.size());
 
-    GGML_ASSERT(nread <= max_size);
+    file.write_u32((uint32_t) (n_token_count - n_saved));
+    file.write_raw(&kv_size, sizeof(kv_size));
+    file.write_raw(tokens + n_saved, sizeof(llama_token)*(n_token_count - n_saved));
+    llama_seq_session_pad(file);
 
-    return nread;
-}
+    llama_data_file_context data_ctx(&file);
+    llama_kv_cache_seq_write(ctx, &data_ctx, cells);
+    GGML_ASSERT(data_ctx.get_size_written() == kv_size);
 
-static bool llama_load_session_file_internal(struct llama_context * ctx, const char * path_session, llama_token * tokens_out, size_t n_token_capacity, size_t * n_token_count_out) {
-    llama_file file(path_session, "rb");
+    llama_seq_session_pad(file);
 
-    // sanity checks
-    {
-        const uint32_t magic   = file.read_u32();
-        const uint32_t version = file.read_u32();
+    return true;
+}
 
-        if (magic != LLAMA_SESSION_MAGIC || version != LLAMA_SESSION_VERSION) {
-            LLAMA_LOG_ERROR("%s : unknown (magic, version) for session file: %08x, %08x\n", __func__, magic, version);
-            return false;
-        }
+static bool llama_load_seq_session_file_internal(struct llama_context * ctx, const char * path_session, llama_seq_id seq_id, llama_token * tokens_out, size_t n_token_capacity, size_t * n_token_count_out) {
+    llama_file file(path_session, "rb");
 
-        llama_hparams session_hparams;
-        file.read_raw(&session_hparams, sizeof(llama_hparams));
+    if (!llama_seq_session_read_header(file, ctx)) {
+        return false;
+    }
 
-        if (session_hparams != ctx->model.hparams) {
-            LLAMA_LOG_INFO("%s : model hparams didn't match from session file!\n", __func__);
-            return false;
-        }
+    std::unique_ptr<llama_mmap> mapping;
+    if (llama_mmap::SUPPORTED) {
+        mapping.reset(new llama_mmap(&file));
     }
+    std::vector<uint8_t> buf;
 
-    // load the prompt
-    {
-        const uint32_t n_token_count = file.read_u32();
+    size_t n_token_count = 0;
 
-        if (n_token_count > n_token_capacity) {
-            LLAMA_LOG_ERROR("%s : token count in session file exceeded capacity! %u > %zu\n", __func__, n_token_count, n_token_capacity);
+    std::vector<llama_token> chunk_tokens;
+    size_t   kv_offset;
+    uint64_t kv_size;
+    while (llama_seq_session_read_chunk(file, chunk_tokens, kv_offset, kv_size)) {
+        if (n_token_count + chunk_tokens.size() > n_token_capacity) {
+            LLAMA_LOG_ERROR("%s : token count in session file exceeded capacity! %zu > %zu\n", __func__, n_token_count + chunk_tokens.size(), n_token_capacity);
+            llama_kv_cache_seq_rm(ctx->kv_self, seq_id, -1, -1);
             return false;
         }
 
-        file.read_raw(tokens_out, sizeof(llama_token) * n_token_count);
-        *n_token_count_out = n_token_count;
-    }
-
-    // restore the context state
-    {
-        const size_t n_state_size_cur = file.size - file.tell();
-        const size_t n_state_size_max = llama_get_state_size(ctx);
+        const uint8_t * kv = nullptr;
+        if (mapping) {
+            kv = (const uint8_t *) mapping->addr + kv_offset;
+        } else {
+            const size_t offset = file.tell();
+            buf.resize(kv_size);
+            file.seek(kv_offset, SEEK_SET);
+            file.read_raw(buf.data(), kv_size);
+            file.seek(offset, SEEK_SET);
+            kv = buf.data();
+        }
 
-        if (n_state_size_cur > n_state_size_max) {
-            LLAMA_LOG_ERROR("%s : the state size in session file is too big! max %zu, got %zu\n", __func__, n_state_size_max, n_state_size_cur);
+        if (llama_kv_cache_seq_set_data(ctx, seq_id, kv) != kv_size) {
+            LLAMA_LOG_ERROR("%s : not enough free cells in the KV cache for %zu tokens\n", __func__, chunk_tokens.size());
+            llama_kv_cache_seq_rm(ctx->kv_self, seq_id, -1, -1);
             return false;
         }
 
-        std::vector<uint8_t> state_data(n_state_size_max);
-        file.read_raw(state_data.data(), n_state_size_cur);
-
-        llama_set_state_data(ctx, state_data.data());
+        std::copy(chunk_tokens.begin(), chunk_tokens.end(), tokens_out + n_token_count);
+        n_token_count += chunk_tokens.size();
     }
 
+    *n_token_count_out = n_token_count;
+
     return true;
 }
 
-bool llama_load_session_file(struct llama_context * ctx, const char * path_session, llama_token * tokens_out, size_t n_token_capacity, size_t * n_token_count_out) {
+bool llama_save_seq_session_file(struct llama_context * ctx, const char * path_session, llama_seq_id seq_id, const llama_token * tokens, size_t n_token_count) {
     try {
-        return llama_load_session_file_internal(ctx, path_session, tokens_out, n_token_capacity, n_token_count_out);
+        return llama_save_seq_session_file_internal(ctx, path_session, seq_id, tokens, n_token_count);
     } catch (const std::exception & err) {
-        LLAMA_LOG_ERROR("error loading session file: %s\n", err.what());
+        LLAMA_LOG_ERROR("error saving session file: %s\n", err.what());
         return false;
     }
 }
 
-bool llama_save_session_file(struct llama_context * ctx, const char * path_session, const llama_token * tokens, size_t n_token_count) {
-    llama_file file(path_session, "wb");
-
-    file.write_u32(LLAMA_SESSION_MAGIC);
-    file.write_u32(LLAMA_SESSION_VERSION);
-
-    file.write_raw(&ctx->model.hparams, sizeof(llama_hparams));
-
-    // save the prompt
-    file.write_u32((uint32_t) n_token_count);
-    file.write_raw(tokens, sizeof(llama_token) * n_token_count);
-
-    // save the context state using stream saving
-    llama_data_file_context data_ctx(&file);
-    llama_copy_state_data_internal(ctx, &data_ctx);
-
-    return true;
+bool llama_load_seq_session_file(struct llama_context * ctx, const char * path_session, llama_seq_id seq_id, llama_token * tokens_out, size_t n_token_capacity, size_t * n_token_count_out) {
+    try {
+        return llama_load_seq_session_file_internal(ctx, path_session, seq_id, tokens_out, n_token_capacity, n_token_count_out);
+    } catch (const std::exception & err) {
+        LLAMA_LOG_ERROR("error loading session file: %s\n", err.what());
+        return false;
+    }
 }
 
 int llama_eval(
@@ -10090,6 +14150,26 @@ void llama_set_n_threads(struct llama_context * ctx, uint32_t n_threads, uint32_
     ctx->cparams.n_threads_batch = n_threads_batch;
 }
 
+void llama_set_threadpool(struct llama_context * ctx, struct ggml_threadpool * threadpool) {
+    if (ctx->threadpool_owned) {
+        ggml_threadpool_free(ctx->threadpool);
+    }
+
+    ctx->threadpool       = threadpool;
+    ctx->threadpool_owned = false;
+}
+
+size_t llama_compute_buffer_trim(struct llama_context * ctx) {
+#ifndef GGML_USE_METAL
+    const size_t size = llama_alloc_bucket_size(*ctx, 1, 0);
+    if (ctx->buf_alloc.size > size) {
+        llama_alloc_resize(*ctx, size);
+    }
+#endif
+
+    return ctx->buf_alloc.size;
+}
+
 struct llama_batch llama_batch_get_one(
              llama_token * tokens,
                  int32_t   n_tokens,
@@ -10120,10 +14200,11 @@ struct llama_batch llama_batch_init(int32_t n_tokens, int32_t embd, int32_t n_se
 
     batch.pos      = (llama_pos *)     malloc(sizeof(llama_pos)      * n_tokens);
     batch.n_seq_id = (int32_t *)       malloc(sizeof(int32_t)        * n_tokens);
-    batch.seq_id   = (llama_seq_id **) malloc(sizeof(llama_seq_id *) * n_tokens);
+    batch.seq_id   = (llama_seq_id **) malloc(sizeof(llama_seq_id *) * (n_tokens + 1));
     for (int i = 0; i < n_tokens; ++i) {
         batch.seq_id[i] = (llama_seq_id *) malloc(sizeof(llama_seq_id) * n_seq_max);
     }
+    batch.seq_id[n_tokens] = nullptr; // llama_batch_free frees up to this, whatever the n_tokens of the batch
     batch.logits   = (int8_t *)        malloc(sizeof(int8_t)         * n_tokens);
 
     return batch;
@@ -10135,7 +14216,7 @@ void llama_batch_free(struct llama_batch batch) {
     if (batch.pos)      free(batch.pos);
     if (batch.n_seq_id) free(batch.n_seq_id);
     if (batch.seq_id) {
-        for (int i = 0; i < batch.n_tokens; ++i) {
+        for (int i = 0; batch.seq_id[i] != nullptr; ++i) {
             free(batch.seq_id[i]);
         }
         free(batch.seq_id);
@@ -10143,10 +14224,21 @@ void llama_batch_free(struct llama_batch batch) {
     if (batch.logits)   free(batch.logits);
 }
 
+static int llama_decode_impl(llama_context & ctx, llama_batch & batch) {
+#ifdef GGML_USE_MPI
+    return ggml_mpi_size(ctx.ctx_mpi) > 1 ? llama_decode_mpi(ctx, &batch) : llama_decode_internal(ctx, batch);
+#else
+    return llama_decode_internal(ctx, batch);
+#endif
+}
+
 int llama_decode(
         struct llama_context * ctx,
           struct llama_batch   batch) {
-    const int ret = llama_decode_internal(*ctx, batch);
+    // the batches are evaluated in order
+    llama_synchronize(ctx);
+
+    const int ret = llama_decode_impl(*ctx, batch);
     if (ret < 0) {
         LLAMA_LOG_ERROR("%s: failed to decode, ret = %d\n", __func__, ret);
     }
@@ -10154,16 +14246,160 @@ int llama_decode(
     return ret;
 }
 
+static void llama_decode_worker_loop(llama_context * ctx) {
+    llama_decode_worker & w = *ctx->decode_worker;
+
+    std::unique_lock<std::mutex> lock(w.mutex);
+
+    while (true) {
+        w.cv.wait(lock, [&w] { return w.quit || w.running; });
+
+        if (!w.running) {
+            return;
+        }
+
+        lock.unlock();
+        const int ret = llama_decode_impl(*ctx, w.batch);
+        lock.lock();
+
+        w.result  = ret;
+        w.running = false;
+        w.cv.notify_all();
+    }
+}
+
+int llama_decode_async(
+        struct llama_context * ctx,
+          struct llama_batch   batch) {
+    if (!ctx->decode_worker) {
+        ctx->decode_worker.reset(new llama_decode_worker());
+
+        llama_decode_worker & w = *ctx->decode_worker;
+
+        // the same capacity as the buffers of the context, which llama_set_state_data checks
+        w.out_logits.reserve(ctx->logits.capacity());
+        w.out_embedding.resize(ctx->embedding.size());
+
+        w.thread = std::thread(llama_decode_worker_loop, ctx);
+    }
+
+    llama_decode_worker & w = *ctx->decode_worker;
+
+    if (w.busy) {
+        LLAMA_LOG_ERROR("%s: a batch is being evaluated, call llama_synchronize first\n", __func__);
+        return -1;
+    }
+
+    const int32_t n_tokens = batch.n_tokens;
+
+    w.batch = batch;
+
+    if (batch.token) {
+        w.token.assign(batch.token, batch.token + n_tokens);
+        w.batch.token = w.token.data();
+    }
+    if (batch.embd) {
+        w.embd.assign(batch.embd, batch.embd + (size_t) n_tokens*ctx->model.hparams.n_embd);
+        w.batch.embd = w.embd.data();
+    }
+    if (batch.pos) {
+        w.pos.assign(batch.pos, batch.pos + n_tokens);
+        w.batch.pos = w.pos.data();
+    }
+    if (batch.seq_id) {
+        w.n_seq_id.assign(batch.n_seq_id, batch.n_seq_id + n_tokens);
+        w.seq_id.clear();
+        for (int32_t i = 0; i < n_tokens; ++i) {
+            w.seq_id.insert(w.seq_id.end(), batch.seq_id[i], batch.seq_id[i] + batch.n_seq_id[i]);
+        }
+        w.seq_id_ptr.resize(n_tokens);
+        for (int32_t i = 0, j = 0; i < n_tokens; j += w.n_seq_id[i], ++i) {
+            w.seq_id_ptr[i] = w.seq_id.data() + j;
+        }
+        w.batch.n_seq_id = w.n_seq_id.data();
+        w.batch.seq_id   = w.seq_id_ptr.data();
+    }
+    if (batch.logits) {
+        w.logits.assign(batch.logits, batch.logits + n_tokens);
+        w.batch.logits = w.logits.data();
+    }
+
+    // the outputs of the previous batch stay readable while this one is evaluated
+    std::swap(w.out_logits,        ctx->logits);
+    std::swap(w.out_top_k,         ctx->top_k);
+    std::swap(w.out_embedding,     ctx->embedding);
+    std::swap(w.out_embedding_all, ctx->embedding_all);
+
+    w.busy = true;
+
+    {
+        std::lock_guard<std::mutex> lock(w.mutex);
+        w.running = true;
+    }
+    w.cv.notify_all();
+
+    return 0;
+}
+
+int llama_synchronize(struct llama_context * ctx) {
+    if (!ctx->decode_worker || !ctx->decode_worker->busy) {
+        return 0;
+    }
+
+    llama_decode_worker & w = *ctx->decode_worker;
+
+    {
+        std::unique_lock<std::mutex> lock(w.mutex);
+        w.cv.wait(lock, [&w] { return !w.running; });
+    }
+
+    w.busy = false;
+
+    if (w.result < 0) {
+        LLAMA_LOG_ERROR("%s: failed to decode, ret = %d\n", __func__, w.result);
+    }
+
+    return w.result;
+}
+
+// the outputs read by the getters: the ones of the batch before while a batch of llama_decode_async is evaluated
+static llama_decode_worker * llama_decode_front(struct llama_context * ctx) {
+    return ctx->decode_worker && ctx->decode_worker->busy ? ctx->decode_worker.get() : nullptr;
+}
+
 float * llama_get_logits(struct llama_context * ctx) {
-    return ctx->logits.data();
+    llama_decode_worker * front = llama_decode_front(ctx);
+    return front ? front->out_logits.data() : ctx->logits.data();
 }
 
 float * llama_get_logits_ith(struct llama_context * ctx, int32_t i) {
-    return ctx->logits.data() + i*ctx->model.hparams.n_vocab;
+    return llama_get_logits(ctx) + i*ctx->model.hparams.n_vocab;
+}
+
+void llama_set_top_k_params(struct llama_context * ctx, float temp, const float * logit_bias) {
+    ctx->top_k_temp = temp;
+    if (logit_bias) {
+        ctx->top_k_bias.assign(logit_bias, logit_bias + ctx->model.hparams.n_vocab);
+    } else {
+        ctx->top_k_bias.clear();
+    }
+}
+
+const llama_token_data * llama_get_top_k_ith(struct llama_context * ctx, int32_t i) {
+    GGML_ASSERT(ctx->cparams.n_top_k > 0);
+    llama_decode_worker * front = llama_decode_front(ctx);
+    return (front ? front->out_top_k : ctx->top_k).data() + i*ctx->cparams.n_top_k;
 }
 
 float * llama_get_embeddings(struct llama_context * ctx) {
-    return ctx->embedding.data();
+    llama_decode_worker * front = llama_decode_front(ctx);
+    return front ? front->out_embedding.data() : ctx->embedding.data();
+}
+
+float * llama_get_embeddings_ith(struct llama_context * ctx, int32_t i) {
+    llama_decode_worker * front = llama_decode_front(ctx);
+    GGML_ASSERT(!(front ? front->out_embedding : ctx->embedding).empty() && "the context is not in embedding mode");
+    return (front ? front->out_embedding_all : ctx->embedding_all).data() + i*ctx->model.hparams.n_embd;
 }
 
 const char * llama_token_get_text(const struct llama_model * model, llama_token token) {
@@ -10236,73 +14472,144 @@ int llama_tokenize(
     return res.size();
 }
 
+void llama_tokenize_batch(
+    const struct llama_model * model,
+                         int   n_texts,
+                const char ** texts,
+                   const int * text_lens,
+                llama_token ** tokens,
+                   const int * n_max_tokens,
+                         int * n_tokens,
+                        bool   add_bos,
+                        bool   special,
+                         int   n_threads) {
+    n_threads = std::max(1, std::min(n_threads, n_texts));
+
+    // the texts are handed out one at a time, so a few long ones do not leave the other threads idle
+    std::atomic<int> next(0);
+    std::exception_ptr error;
+    std::mutex error_mutex;
+
+    auto worker = [&]() {
+        try {
+            for (int i = next++; i < n_texts; i = next++) {
+                n_tokens[i] = llama_tokenize(model, texts[i], text_lens[i], tokens[i], n_max_tokens[i], add_bos, special);
+            }
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(error_mutex);
+            if (!error) {
+                error = std::current_exception();
+            }
+            next = n_texts;
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (int t = 1; t < n_threads; ++t) {
+        workers.emplace_back(worker);
+    }
+    worker();
+    for (auto & w : workers) {
+        w.join();
+    }
+
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
 static std::string llama_decode_text(const std::string & text) {
     std::string decoded_text;
     auto unicode_sequences = codepoints_from_utf8(text);
+    decoded_text.reserve(unicode_sequences.size());
     for (auto& unicode_sequence : unicode_sequences) {
-        decoded_text += unicode_to_bytes_bpe(codepoint_to_utf8(unicode_sequence));
+        decoded_text += unicode_cpt_to_byte_bpe(unicode_sequence);
     }
 
     return decoded_text;
 }
 
+// the piece of a token, as llama_token_to_piece returns it; computed once per token when the vocab is loaded
+static std::string llama_decode_piece(const llama_vocab & vocab, llama_vocab::id token) {
+    switch (llama_vocab_get_type(vocab)) {
+    case LLAMA_VOCAB_TYPE_SPM: {
+        if (llama_is_normal_token(vocab, token)) {
+            std::string result = vocab.id_to_token[token].text;
+            llama_unescape_whitespace(result);
+            return result;
+        } else if (llama_is_unknown_token(vocab, token)) { // NOLINT
+            return "\xe2\x96\x85";
+        } else if (llama_is_control_token(vocab, token)) {
+            ;
+        } else if (llama_is_byte_token(vocab, token)) {
+            return std::string(1, (char) llama_token_to_byte(vocab, token));
+        } else {
+            // TODO: for now we accept all unsupported token types,
+            // suppressing them like CONTROL tokens.
+            // GGML_ASSERT(false);
+        }
+        break;
+    }
+    case LLAMA_VOCAB_TYPE_BPE: {
+        if (llama_is_normal_token(vocab, token)) {
+            return llama_decode_text(vocab.id_to_token[token].text);
+        } else if (llama_is_control_token(vocab, token)) {
+            ;
+        } else {
+            // TODO: for now we accept all unsupported token types,
+            // suppressing them like CONTROL tokens.
+            // GGML_ASSERT(false);
+        }
+        break;
+    }
+    default:
+        GGML_ASSERT(false);
+    }
+    return "";
+}
+
+const char * llama_token_get_piece_view(const struct llama_model * model, llama_token token, int32_t * length) {
+    const auto & vocab = model->vocab;
+    if (token < 0 || (size_t) token + 1 >= vocab.piece_offs.size()) {
+        *length = 0;
+        return "";
+    }
+    *length = vocab.piece_offs[token + 1] - vocab.piece_offs[token] - 1;
+    return vocab.piece_data.data() + vocab.piece_offs[token];
+}
+
 // does not write null-terminator to buf
 int llama_token_to_piece(const struct llama_model * model, llama_token token, char * buf, int length) {
     if (0 <= token && token < llama_n_vocab(model)) {
-        switch (llama_vocab_get_type(model->vocab)) {
-        case LLAMA_VOCAB_TYPE_SPM: {
-            if (llama_is_normal_token(model->vocab, token)) {
-                std::string result = model->vocab.id_to_token[token].text;
-                llama_unescape_whitespace(result);
-                if (length < (int) result.length()) {
-                    return -result.length();
-                }
-                memcpy(buf, result.c_str(), result.length());
-                return result.length();
-            } else if (llama_is_unknown_token(model->vocab, token)) { // NOLINT
-                if (length < 3) {
-                    return -3;
-                }
-                memcpy(buf, "\xe2\x96\x85", 3);
-                return 3;
-            } else if (llama_is_control_token(model->vocab, token)) {
-                ;
-            } else if (llama_is_byte_token(model->vocab, token)) {
-                if (length < 1) {
-                    return -1;
-                }
-                buf[0] = llama_token_to_byte(model->vocab, token);
-                return 1;
-            } else {
-                // TODO: for now we accept all unsupported token types,
-                // suppressing them like CONTROL tokens.
-                // GGML_ASSERT(false);
-            }
-            break;
+        int32_t n;
+        const char * piece = llama_token_get_piece_view(model, token, &n);
+        if (length < n) {
+            return -n;
         }
-        case LLAMA_VOCAB_TYPE_BPE: {
-            if (llama_is_normal_token(model->vocab, token)) {
-                std::string result = model->vocab.id_to_token[token].text;
-                result = llama_decode_text(result);
-                if (length < (int) result.length()) {
-                    return -result.length();
-                }
-                memcpy(buf, result.c_str(), result.length());
-                return result.length();
-            } else if (llama_is_control_token(model->vocab, token)) {
-                ;
-            } else {
-                // TODO: for now we accept all unsupported token types,
-                // suppressing them like CONTROL tokens.
-                // GGML_ASSERT(false);
+        memcpy(buf, piece, n);
+        return n;
+    }
+    return 0;
+}
+
+int32_t llama_token_prefixes(const struct llama_model * model, llama_token token, llama_token * prefixes, int32_t n_max) {
+    const auto & trie = model->vocab.trie;
+
+    if (token < 0 || (size_t) token >= trie.token_node.size()) {
+        return 0;
+    }
+
+    int32_t n = 0;
+    for (uint32_t node = trie.nodes[trie.token_node[token]].parent; node != 0; node = trie.nodes[node].parent) {
+        for (uint32_t t = trie.nodes[node].tok_begin; t < trie.nodes[node].tok_end; ++t) {
+            if (n < n_max) {
+                prefixes[n] = trie.tokens[t];
             }
-            break;
-        }
-        default:
-            GGML_ASSERT(false);
+            n++;
         }
     }
-    return 0;
+
+    return n <= n_max ? n : -n;
 }
 
 struct llama_timings llama_get_timings(struct llama_context * ctx) {
@@ -10314,7 +14621,7 @@ struct llama_timings llama_get_timings(struct llama_context * ctx) {
         /*.t_p_eval_ms =*/ 1e-3 * ctx->t_p_eval_us,
         /*.t_eval_ms   =*/ 1e-3 * ctx->t_eval_us,
 
-        /*.n_sample =*/ std::max(1, ctx->n_sample),
+        /*.n_sample =*/ std::max(1, ctx->n_sample.load()),
         /*.n_p_eval =*/ std::max(1, ctx->n_p_eval),
         /*.n_eval   =*/ std::max(1, ctx->n_eval),
     };
@@ -10338,9 +14645,128 @@ void llama_print_timings(struct llama_context * ctx) {
 
 void llama_reset_timings(struct llama_context * ctx) {
     ctx->t_start_us = ggml_time_us();
-    ctx->t_sample_us = ctx->n_sample = 0;
+    ctx->t_sample_us = 0;
+    ctx->n_sample    = 0;
     ctx->t_eval_us   = ctx->n_eval   = 0;
     ctx->t_p_eval_us = ctx->n_p_eval = 0;
+
+    ctx->prof_nodes.clear();
+    ctx->prof_graphs.clear();
+}
+
+static const char * llama_backend_type_name(ggml_backend_type backend) {
+    switch (backend) {
+        case GGML_BACKEND_CPU:       return "CPU";
+        case GGML_BACKEND_GPU:       return "GPU";
+        case GGML_BACKEND_GPU_SPLIT: return "GPU_SPLIT";
+        default:                     return "?";
+    }
+}
+
+// s as the contents of a JSON string
+static std::string llama_json_escape(const char * s) {
+    std::string res;
+    for (; *s; ++s) {
+        const unsigned char c = *s;
+        if (c == '"' || c == '\\') {
+            res += '\\';
+            res += c;
+        } else if (c < 0x20) {
+            char buf[8];
+            snprintf(buf, sizeof(buf), "\\u%04x", c);
+            res += buf;
+        } else {
+            res += c;
+        }
+    }
+    return res;
+}
+
+bool llama_profile_write_trace(struct llama_context * ctx, const char * path) {
+    FILE * f = fopen(path, "w");
+    if (!f) {
+        LLAMA_LOG_ERROR("%s: failed to open %s\n", __func__, path);
+        return false;
+    }
+
+    const int64_t t0 = ctx->t_start_us;
+
+    // the graphs and the nodes are on two tracks of the same process
+    fprintf(f, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+    fprintf(f, "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 0, \"tid\": 0, \"args\": {\"name\": \"graphs\"}},\n");
+    fprintf(f, "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 0, \"tid\": 1, \"args\": {\"name\": \"nodes\"}}");
+
+    for (const auto & graph : ctx->prof_graphs) {
+        fprintf(f, ",\n{\"name\": \"decode\", \"cat\": \"graph\", \"ph\": \"X\", \"ts\": %" PRId64 ", \"dur\": %" PRId64 ", \"pid\": 0, \"tid\": 0, "
+                "\"args\": {\"n_tokens\": %u, \"n_kv\": %u}}",
+                graph.t_start_us - t0, graph.t_end_us - graph.t_start_us, graph.n_tokens, graph.n_kv);
+    }
+
+    for (const auto & node : ctx->prof_nodes) {
+        fprintf(f, ",\n{\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"X\", \"ts\": %" PRId64 ", \"dur\": %" PRId64 ", \"pid\": 0, \"tid\": 1, "
+                "\"args\": {\"op\": \"%s\", \"type\": \"%s\", \"ne\": [%" PRId64 ", %" PRId64 ", %" PRId64 ", %" PRId64 "], \"backend\": \"%s\"}}",
+                llama_json_escape(node.name).c_str(), node.op, node.t_start_us - t0, node.t_end_us - node.t_start_us,
+                node.op, ggml_type_name(node.type), node.ne[0], node.ne[1], node.ne[2], node.ne[3],
+                llama_backend_type_name(node.backend));
+    }
+
+    fprintf(f, "\n]}\n");
+
+    const bool ok = !ferror(f);
+    fclose(f);
+
+    return ok;
+}
+
+bool llama_profile_write_ops(struct llama_context * ctx, const char * path) {
+    struct op_stats {
+        std::string op;
+        ggml_type   type;
+        ggml_backend_type backend;
+        int64_t     n;
+        int64_t     t_us;
+    };
+
+    std::vector<op_stats> stats;
+    std::map<std::tuple<std::string, int, int>, size_t> index;
+
+    int64_t t_total_us = 0;
+
+    for (const auto & node : ctx->prof_nodes) {
+        const auto key = std::make_tuple(std::string(node.op), (int) node.type, (int) node.backend);
+
+        auto it = index.find(key);
+        if (it == index.end()) {
+            it = index.emplace(key, stats.size()).first;
+            stats.push_back({ node.op, node.type, node.backend, 0, 0 });
+        }
+
+        op_stats & s = stats[it->second];
+        s.n    += 1;
+        s.t_us += node.t_end_us - node.t_start_us;
+
+        t_total_us += node.t_end_us - node.t_start_us;
+    }
+
+    std::sort(stats.begin(), stats.end(), [](const op_stats & a, const op_stats & b) { return a.t_us > b.t_us; });
+
+    FILE * f = fopen(path, "w");
+    if (!f) {
+        LLAMA_LOG_ERROR("%s: failed to open %s\n", __func__, path);
+        return false;
+    }
+
+    fprintf(f, "op,type,backend,count,total_us,avg_us,percent\n");
+    for (const auto & s : stats) {
+        fprintf(f, "%s,%s,%s,%" PRId64 ",%" PRId64 ",%.3f,%.2f\n",
+                s.op.c_str(), ggml_type_name(s.type), llama_backend_type_name(s.backend), s.n, s.t_us,
+                (double) s.t_us/s.n, t_total_us > 0 ? 100.0*s.t_us/t_total_us : 0.0);
+    }
+
+    const bool ok = !ferror(f);
+    fclose(f);
+
+    return ok;
 }
 
 const char * llama_print_system_info(void) {
@@ -10381,11 +14807,11 @@ void llama_dump_timing_info_yaml(FILE * stream, const llama_context * ctx) {
             1.0e-3 * ctx->t_sample_us / ctx->n_sample);
     fprintf(stream, "n_eval: %d  # number of tokens generated (excluding the first one)\n", ctx->n_eval);
     fprintf(stream, "n_p_eval: %d  # number of tokens processed in batches at the beginning\n", ctx->n_p_eval);
-    fprintf(stream, "n_sample: %d  # number of sampled tokens\n", ctx->n_sample);
+    fprintf(stream, "n_sample: %d  # number of sampled tokens\n", ctx->n_sample.load());
     fprintf(stream, "t_eval_us: %" PRId64 "  # total microseconds spent generating tokens\n", ctx->t_eval_us);
     fprintf(stream, "t_load_us: %" PRId64 "  # total microseconds spent loading the model\n", ctx->t_load_us);
     fprintf(stream, "t_p_eval_us: %" PRId64 "  # total microseconds spent prompt processing\n", ctx->t_p_eval_us);
-    fprintf(stream, "t_sample_us: %" PRId64 "  # total microseconds spent sampling\n", ctx->t_sample_us);
+    fprintf(stream, "t_sample_us: %" PRId64 "  # total microseconds spent sampling\n", ctx->t_sample_us.load());
     fprintf(stream, "ts_eval: %.2f  # tokens / second during generation\n",
             1.0e6 * ctx->n_eval / ctx->t_eval_us);
     fprintf(stream, "ts_p_eval: %.2f  # tokens / second during prompt processing\n",
@@ -40,10 +40,14 @@
 #define LLAMA_MAX_RNG_STATE (64*1024)
 
 #define LLAMA_FILE_MAGIC_GGSN 0x6767736eu // 'ggsn'
+#define LLAMA_FILE_MAGIC_GGSQ 0x67677371u // 'ggsq'
 
 #define LLAMA_SESSION_MAGIC   LLAMA_FILE_MAGIC_GGSN
 #define LLAMA_SESSION_VERSION 3
 
+#define LLAMA_SEQ_SESSION_MAGIC   LLAMA_FILE_MAGIC_GGSQ
+#define LLAMA_SEQ_SESSION_VERSION 1
+
 #if defined(GGML_USE_CUBLAS) || defined(GGML_USE_CLBLAST) || defined(GGML_USE_METAL)
 // Defined when llama.cpp is compiled with support for offloading model layers to GPU.
 #define LLAMA_SUPPORTS_GPU_OFFLOAD
@@ -114,6 +118,12 @@ extern "C" {
         LLAMA_ROPE_SCALING_MAX_VALUE   = LLAMA_ROPE_SCALING_YARN,
     };
 
+    // how the evaluation is divided between the processes, in the builds with MPI
+    enum llama_mpi_split {
+        LLAMA_MPI_SPLIT_LAYER = 0, // each process evaluates a slice of the layers, the batches go through them as a pipeline
+        LLAMA_MPI_SPLIT_ROW   = 1, // each process multiplies a slice of the rows of each weight matrix, for a lower latency
+    };
+
     typedef struct llama_token_data {
         llama_token id; // token id
         float logit;    // log-odds of the token
@@ -192,6 +202,9 @@ extern "C" {
         bool vocab_only; // only load the vocabulary, no weights
         bool use_mmap;   // use mmap if possible
         bool use_mlock;  // force system to keep model in RAM
+        bool repack;     // repack the CPU weights into interleaved layouts for faster matrix multiplications (disables mmap)
+        bool use_hugepages; // advise huge pages for the mapping of the model to reduce the TLB misses (Linux)
+        bool vocab_cache;   // keep the tokenizer index in <model file>.vocab-cache, written on the first load and mapped on the next ones
     };
 
     struct llama_context_params {
@@ -211,6 +224,10 @@ extern "C" {
         float    yarn_beta_slow;   // YaRN high correction dim
         uint32_t yarn_orig_ctx;    // YaRN original context size
 
+        uint32_t n_top_k;          // if > 0, compute the n_top_k most probable tokens of each output, see llama_get_top_k_ith
+        uint32_t n_graph_cache;    // number of compute graphs kept for reuse by the batches of the same shape, 0 = disabled
+        int32_t  mpi_split;        // how the evaluation is divided between the MPI processes, from `enum llama_mpi_split`
+
         enum ggml_type type_k; // data type for K cache
         enum ggml_type type_v; // data type for V cache
 
@@ -219,6 +236,17 @@ extern "C" {
         bool logits_all;  // the llama_eval() call computes all logits, not just the last one (DEPRECATED - set llama_batch.logits instead)
         bool embedding;   // embedding mode only
         bool offload_kqv; // whether to offload the KQV ops (including the KV cache) to GPU
+        bool profile;     // record the compute time of each node of the graphs, see llama_profile_write_trace
+    };
+
+    // memory that a model and a context would take, in bytes, see llama_plan_memory
+    struct llama_memory_plan {
+        size_t weights_host;   // the weights kept in RAM, or mapped from the file
+        size_t weights_device; // the weights offloaded to the GPU
+        size_t kv_host;        // the KV cache, allocated in RAM in any case
+        size_t kv_device;      // the KV cache offloaded to the GPU
+        size_t compute_host;   // the compute buffers at their largest, with the largest batch
+        size_t compute_device; // the compute buffers offloaded to the GPU
     };
 
     // model quantization parameters
@@ -265,6 +293,14 @@ extern "C" {
         uint32_t           value; // Unicode code point or rule ID
     } llama_grammar_element;
 
+    // statistics of the token mask cache of a grammar
+    struct llama_grammar_mask_cache_stats {
+        uint64_t n_hit;
+        uint64_t n_miss;
+        size_t   n_masks; // number of masks currently stored
+        size_t   n_bytes; // memory used by the stored masks
+    };
+
     // performance timing information
     struct llama_timings {
         double t_start_ms;
@@ -305,6 +341,31 @@ extern "C" {
     // Frees all allocated memory
     LLAMA_API void llama_free(struct llama_context * ctx);
 
+    // Plan the memory of the model at path_model and of a context with these parameters, without loading the weights
+    // nor allocating the buffers: only the metadata of the tensors is read and the compute graph is measured
+    // Returns false if the model can't be loaded or the context created
+    LLAMA_API bool llama_plan_memory(
+                             const char * path_model,
+              struct llama_model_params   mparams,
+            struct llama_context_params   cparams,
+               struct llama_memory_plan * plan);
+
+    // Total of the host and of the device memory of a plan
+    LLAMA_API size_t llama_memory_plan_host  (const struct llama_memory_plan * plan);
+    LLAMA_API size_t llama_memory_plan_device(const struct llama_memory_plan * plan);
+
+    // Choose the largest mparams->n_gpu_layers whose plan fits in vram_budget bytes of device memory, then if all the
+    // layers fit, the largest number of sequences up to n_parallel_max, each with the context cparams->n_ctx
+    // (0 = from model): cparams->n_ctx is set to their total and *n_parallel, if not NULL, to their number
+    // Returns false if the model can't be planned
+    LLAMA_API bool llama_plan_fit(
+                             const char * path_model,
+                                 size_t   vram_budget,
+                                int32_t   n_parallel_max,
+             struct llama_model_params  * mparams,
+           struct llama_context_params  * cparams,
+                                int32_t * n_parallel);
+
     LLAMA_API int64_t llama_time_us(void);
 
     LLAMA_API int  llama_max_devices    (void);
@@ -501,6 +562,59 @@ extern "C" {
             struct llama_context * ctx,
                          uint8_t * src);
 
+    // Returns the size in bytes of the KV of the tokens that belong to the specified sequence
+    // and have positions in [p0, p1), as written by llama_kv_cache_seq_get_data
+    // p0 < 0 : [0,  p1]
+    // p1 < 0 : [p0, inf)
+    LLAMA_API size_t llama_kv_cache_seq_get_size(
+            struct llama_context * ctx,
+                    llama_seq_id   seq_id,
+                       llama_pos   p0,
+                       llama_pos   p1);
+
+    // Copies the KV of the tokens that belong to the specified sequence and have positions in [p0, p1)
+    // to the specified destination address, e.g. host memory or a mapped file, to be restored later
+    // with llama_kv_cache_seq_set_data. The cells are not freed: use llama_kv_cache_seq_rm for that
+    // Returns the number of bytes copied, 0 if the KV cache is not in host memory
+    LLAMA_API size_t llama_kv_cache_seq_get_data(
+            struct llama_context * ctx,
+                    llama_seq_id   seq_id,
+                       llama_pos   p0,
+                       llama_pos   p1,
+                         uint8_t * dst);
+
+    // Restores the tokens copied by llama_kv_cache_seq_get_data in free cells, as tokens of the specified sequence
+    // Returns the number of bytes read, 0 if there are not enough free cells
+    LLAMA_API size_t llama_kv_cache_seq_set_data(
+            struct llama_context * ctx,
+                    llama_seq_id   seq_id,
+                 const uint8_t * src);
+
+    // Streams the state, in the format of llama_copy_state_data, through a callback: the KV rows are given straight
+    // from the cache, so no buffer of the size of the state is needed. The callbacks return false on failure.
+    // Returns the number of bytes written/read, 0 on failure (the state is then partially set when reading)
+    typedef bool (*llama_state_write_callback)(const void * src, size_t size, void * user_data);
+    typedef bool (*llama_state_read_callback)(void * dst, size_t size, void * user_data);
+
+    LLAMA_API size_t llama_state_write(
+            struct llama_context * ctx,
+      llama_state_write_callback   write,
+                            void * user_data);
+
+    LLAMA_API size_t llama_state_read(
+            struct llama_context * ctx,
+       llama_state_read_callback   read,
+                            void * user_data);
+
+    // Streams the state to/from a file descriptor, e.g. a file, a pipe or a socket
+    LLAMA_API size_t llama_state_write_to_fd(
+            struct llama_context * ctx,
+                             int   fd);
+
+    LLAMA_API size_t llama_state_read_from_fd(
+            struct llama_context * ctx,
+                             int   fd);
+
     // Save/load session file
     LLAMA_API bool llama_load_session_file(
             struct llama_context * ctx,
@@ -515,6 +629,28 @@ extern "C" {
                const llama_token * tokens,
                           size_t   n_token_count);
 
+    // Save/load the tokens and the KV of a single sequence: only the cells of the sequence are saved, in page-aligned
+    // chunks that are copied from the mapped file straight into the KV cache when loaded.
+    // If the file already holds a prefix of the tokens, only the KV of the new tokens is appended to it, so
+    // saving after each turn of a conversation costs O(new tokens). The position of each token must be its index,
+    // and the KV of the saved prefix must not have changed since (e.g. by a context shift).
+    // The logits are not saved: the last token has to be evaluated again after loading.
+    LLAMA_API bool llama_save_seq_session_file(
+            struct llama_context * ctx,
+                      const char * path_session,
+                    llama_seq_id   seq_id,
+               const llama_token * tokens,
+                          size_t   n_token_count);
+
+    // The tokens are restored in free cells of the KV cache, in a sequence that should be empty
+    LLAMA_API bool llama_load_seq_session_file(
+            struct llama_context * ctx,
+                      const char * path_session,
+                    llama_seq_id   seq_id,
+                     llama_token * tokens_out,
+                          size_t   n_token_capacity,
+                          size_t * n_token_count_out);
+
     //
     // Decoding
     //
@@ -573,11 +709,35 @@ extern "C" {
             struct llama_context * ctx,
               struct llama_batch   batch);
 
+    // Start the evaluation of the batch in a thread of the context and return without waiting for it, so that the
+    // caller can prepare the next batch meanwhile. The batch is copied and can be reused at once.
+    // Until llama_synchronize, the getters of the outputs (llama_get_logits, llama_get_top_k_ith, llama_get_embeddings
+    // and their _ith variants) return the outputs of the batch evaluated before, and no other function may be called
+    // on the context. llama_decode waits for the batch in progress first.
+    // Returns 0 if the evaluation started, < 0 if a batch is still in progress
+    LLAMA_API int llama_decode_async(
+            struct llama_context * ctx,
+              struct llama_batch   batch);
+
+    // Wait for the batch started with llama_decode_async, its outputs then replace the ones of the batch before.
+    // Returns the result of the evaluation as with llama_decode, or 0 if there is no batch in progress
+    LLAMA_API int llama_synchronize(struct llama_context * ctx);
+
     // Set the number of threads used for decoding
     // n_threads is the number of threads used for generation (single token)
     // n_threads_batch is the number of threads used for prompt and batch processing (multiple tokens)
     LLAMA_API void llama_set_n_threads(struct llama_context * ctx, uint32_t n_threads, uint32_t n_threads_batch);
 
+    // Compute the graphs with the threads of a pool, which can be shared by several contexts and must outlive them
+    // By default, a context computes its graphs with a pool of max(n_threads, n_threads_batch) threads it owns
+    // The graphs use at most the threads of the pool, NULL reverts to a pool owned by the context
+    LLAMA_API void llama_set_threadpool(struct llama_context * ctx, struct ggml_threadpool * threadpool);
+
+    // The compute buffer grows with the shapes of the batches evaluated, up to the worst case of n_batch tokens that
+    // attend the whole context. Shrink it back to the size needed by single tokens, e.g. after a long prompt, and return
+    // its new size in bytes. The next larger batch grows it again. No-op with Metal, whose buffer is of the worst case
+    LLAMA_API size_t llama_compute_buffer_trim(struct llama_context * ctx);
+
     // Token logits obtained from the last call to llama_eval()
     // The logits for the last token are stored in the last row
     // Logits for which llama_batch.logits[i] == 0 are undefined
@@ -589,10 +749,25 @@ extern "C" {
     // llama_get_logits(ctx) + i*n_vocab
     LLAMA_API float * llama_get_logits_ith(struct llama_context * ctx, int32_t i);
 
+    // Temperature and logit biases of the top-k tokens computed with llama_context_params.n_top_k > 0,
+    // used by the next calls to llama_decode. temp <= 0 leaves the logits unscaled.
+    // logit_bias has n_vocab values added to the scaled logits, or is NULL for none; the values are copied.
+    LLAMA_API void llama_set_top_k_params(struct llama_context * ctx, float temp, const float * logit_bias);
+
+    // The n_top_k most probable tokens of the ith token, by decreasing probability, with llama_context_params.n_top_k > 0.
+    // p is the probability over the whole vocabulary and logit its log. Undefined for llama_batch.logits[i] == 0.
+    // The softmax and the selection are part of the graph when the backend supports it, and the logits are then
+    // NOT copied out of the graph: llama_get_logits must not be used with n_top_k > 0.
+    LLAMA_API const llama_token_data * llama_get_top_k_ith(struct llama_context * ctx, int32_t i);
+
     // Get the embeddings for the input
     // shape: [n_embd] (1-dimensional)
     LLAMA_API float * llama_get_embeddings(struct llama_context * ctx);
 
+    // Embeddings of the ith token of the last batch, with llama_context_params.embedding
+    // shape: [n_embd] (1-dimensional)
+    LLAMA_API float * llama_get_embeddings_ith(struct llama_context * ctx, int32_t i);
+
     //
     // Vocab
     //
@@ -639,6 +814,21 @@ extern "C" {
                             bool   add_bos,
                             bool   special);
 
+    /// @details Tokenizes n_texts texts on n_threads threads, each one like llama_tokenize.
+    /// @param tokens The buffer of each text, large enough for n_max_tokens[i] tokens.
+    /// @param n_tokens Set to the result of llama_tokenize for each text: the number of tokens, or its negation if they did not fit.
+    LLAMA_API void llama_tokenize_batch(
+        const struct llama_model * model,
+                             int   n_texts,
+                    const char ** texts,
+                       const int * text_lens,
+                    llama_token ** tokens,
+                       const int * n_max_tokens,
+                             int * n_tokens,
+                            bool   add_bos,
+                            bool   special,
+                             int   n_threads);
+
     // Token Id -> Piece.
     // Uses the vocabulary in the provided context.
     // Does not write null terminator to the buffer.
@@ -649,6 +839,23 @@ extern "C" {
                                   char * buf,
                                   int    length);
 
+    /// @details The piece of token, like llama_token_to_piece, without copying it: the pieces of all the tokens are decoded once when the model is loaded.
+    /// @param length Set to the length of the piece. The piece is followed by a 0, but it can also contain 0 bytes.
+    /// @return Returns a pointer to the piece, valid as long as the model, or an empty string for an invalid token.
+    LLAMA_API const char * llama_token_get_piece_view(
+              const struct llama_model * model,
+                           llama_token   token,
+                               int32_t * length);
+
+    /// @details Tokens whose piece is a proper prefix of the piece of token, the longest first.
+    /// These are the tokens llama_sample_grammar gives the logit of token to when the grammar rejects it.
+    /// @return Returns the number of tokens written to prefixes, or the negative of the number of prefixes if n_max is too small.
+    LLAMA_API int32_t llama_token_prefixes(
+              const struct llama_model * model,
+                           llama_token   token,
+                           llama_token * prefixes,
+                               int32_t   n_max);
+
     //
     // Grammar
     //
@@ -662,8 +869,32 @@ extern "C" {
 
     LLAMA_API struct llama_grammar * llama_grammar_copy(const struct llama_grammar * grammar);
 
+    /// @details Set the partial UTF-8 sequence accumulated by the tokens accepted by dst to the one of src, or to none if src is NULL.
+    /// A grammar positioned at its start by another text keeps the sequence that the next token completes.
+    LLAMA_API void llama_grammar_copy_partial_utf8(struct llama_grammar * dst, const struct llama_grammar * src);
+
+    /// @details Replace the definitions of the rules listed in changed_rules, keeping the other rules as they are.
+    /// This is cheaper than creating a new grammar when it is recomputed at every step but only a few rules change.
+    /// Rules past the current number of rules are always copied. The accumulated partial UTF-8 sequence is kept.
+    /// @param start_rule_index If >= 0, the stacks are re-derived from this rule. Otherwise the current stacks are kept,
+    ///                         except for the ones positioned inside a changed rule, which are dropped.
+    LLAMA_API void llama_grammar_update_rules(
+            struct llama_grammar * grammar,
+     const llama_grammar_element ** rules,
+                          size_t    n_rules,
+                  const uint32_t  * changed_rules,
+                          size_t    n_changed_rules,
+                         int64_t    start_rule_index);
+
     LLAMA_API size_t llama_grammar_get_stack_size(const struct llama_grammar * grammar);
 
+    /// @details Cache the tokens allowed by llama_sample_grammar, keyed by the state of the grammar stacks and of the
+    /// pending partial UTF-8 sequence. Up to n_max masks of n_vocab bits are kept, 0 disables the cache.
+    /// Copies of the grammar share its cache, llama_grammar_update_rules starts a new one.
+    LLAMA_API void llama_grammar_set_mask_cache(struct llama_grammar * grammar, size_t n_max);
+
+    LLAMA_API struct llama_grammar_mask_cache_stats llama_grammar_get_mask_cache_stats(const struct llama_grammar * grammar);
+
     //
     // Sampling functions
     //
@@ -682,6 +913,19 @@ extern "C" {
                            float   penalty_freq,
                            float   penalty_present);
 
+    /// @details Same penalties as llama_sample_repetition_penalties, with the occurrences of the tokens in the penalty window
+    /// already counted: tokens are distinct and counts[i] > 0 is the number of occurrences of tokens[i].
+    /// The cost is in the number of tokens when the candidates are sorted by id, as the candidates built from the logits.
+    LLAMA_API void llama_sample_repetition_penalties_counted(
+            struct llama_context * ctx,
+          llama_token_data_array * candidates,
+               const llama_token * tokens,
+                   const int32_t * counts,
+                          size_t   n_tokens,
+                           float   penalty_repeat,
+                           float   penalty_freq,
+                           float   penalty_present);
+
     /// @details Apply classifier-free guidance to the logits as described in academic paper "Stay on topic with Classifier-Free Guidance" https://arxiv.org/abs/2306.17806
     /// @param candidates A vector of `llama_token_data` containing the candidate tokens, the logits must be directly extracted from the original generation context without being sorted.
     /// @params guidance_ctx A separate context from the same model. Other than a negative prompt at the beginning, it should have all generated and user input tokens copied from the main context.
@@ -692,6 +936,15 @@ extern "C" {
               struct llama_context * guidance_ctx,
                              float   scale);
 
+    /// @details Same as llama_sample_classifier_free_guidance with the logits of the negative prompt given directly, e.g. the
+    /// row of a second sequence of ctx evaluated in the same batch as the main one, from llama_get_logits_ith(ctx, i).
+    /// @params logits_guidance The n_vocab logits of the negative prompt, they are overwritten with their log-softmax.
+    LLAMA_API void llama_sample_classifier_free_guidance_logits(
+              struct llama_context * ctx,
+            llama_token_data_array * candidates,
+                             float * logits_guidance,
+                             float   scale);
+
     /// @details Sorts candidate tokens by their logits in descending order and calculate probabilities based on logits.
     LLAMA_API void llama_sample_softmax(
             struct llama_context * ctx,
@@ -792,6 +1045,17 @@ extern "C" {
             struct llama_grammar * grammar,
                      llama_token   token);
 
+    /// @details Tokens spelling the text forced by the grammar, the longest string that every sequence it accepts from its
+    /// current state starts with, e.g. a keyword or a closing delimiter. The text is split greedily into the longest
+    /// pieces of the vocabulary, so that each token is accepted by the grammar in turn. The last piece is not returned, as
+    /// the text that follows may merge with it into a longer token. The tokens are not accepted.
+    /// @return The number of tokens written to tokens, at most n_max_tokens.
+    LLAMA_API int32_t llama_grammar_forced_tokens(
+            struct llama_context * ctx,
+      const struct llama_grammar * grammar,
+                     llama_token * tokens,
+                         int32_t   n_max_tokens);
+
     //
     // Beam search
     //
@@ -822,6 +1086,9 @@ extern "C" {
     typedef void (*llama_beam_search_callback_fn_t)(void * callback_data, struct llama_beams_state);
 
     /// @details Deterministically returns entire sentence constructed by a beam search.
+    /// The prompt must be in the sequence 0 of the KV cache. Each beam is a sequence in [0, n_beams), which forks the
+    /// sequence of the beam it branched from, and the last tokens of all the beams are evaluated in one batch. At the
+    /// end, the sequence 0 holds the evaluated tokens of the best beam, and the other sequences are removed.
     /// @param ctx Pointer to the llama_context.
     /// @param callback Invoked for each iteration of the beam_search loop, passing in beams_state.
     /// @param callback_data A pointer that is simply passed back to callback.
@@ -842,6 +1109,17 @@ extern "C" {
     LLAMA_API void llama_print_timings(struct llama_context * ctx);
     LLAMA_API void llama_reset_timings(struct llama_context * ctx);
 
+    // Write the compute times of the graph nodes recorded with llama_context_params.profile since the creation of the
+    // context or the last llama_reset_timings, as a Chrome trace (chrome://tracing, https://ui.perfetto.dev) of each
+    // node and each graph, tagged with its op, shape, type and backend. Returns false if path cannot be written
+    // The times are the wall times of the CPU threads: the nodes offloaded with CUDA are timed only if the kernels are
+    // synchronous (CUDA_LAUNCH_BLOCKING=1), and the graphs computed with Metal are timed as a whole
+    LLAMA_API bool llama_profile_write_trace(struct llama_context * ctx, const char * path);
+
+    // Same as llama_profile_write_trace, as CSV totals per op, type of the first source (e.g. the weights of a
+    // mul_mat) and backend, from the largest one
+    LLAMA_API bool llama_profile_write_ops(struct llama_context * ctx, const char * path);
+
     // Print system information
     LLAMA_API const char * llama_print_system_info(void);
 
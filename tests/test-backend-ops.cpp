@@ -5,6 +5,7 @@
 #include <algorithm>
 #include <array>
 #include <cfloat>
+#include <cinttypes>
 #include <cstring>
 #include <functional>
 #include <memory>
@@ -238,6 +239,33 @@ static bool ggml_is_view_op(enum ggml_op op) {
 enum test_mode {
     MODE_TEST,
     MODE_PERF,
+    MODE_PERF_MODEL,
+};
+
+// measurement of an op by eval_perf
+struct perf_result {
+    bool        evaluated = false; // false if the op was skipped or is not supported
+    std::string op;
+    std::string vars;
+    int         n_runs    = 0;
+    double      time_us   = 0.0;   // per run
+    size_t      bytes     = 0;     // per run, see test_case::op_bytes
+    double      flops     = 0.0;   // per run
+};
+
+// roofline of a backend: an op cannot run faster than it takes to move its bytes at the peak bandwidth, or
+// to do its FLOPs at the peak FLOP/s
+struct perf_roofline {
+    double bw    = 0.0; // GB/s
+    double flops = 0.0; // GFLOP/s
+
+    double min_time_us(const perf_result & res) const {
+        return std::max(res.bytes / (bw * 1e3), res.flops / (flops * 1e3));
+    }
+
+    bool memory_bound(const perf_result & res) const {
+        return res.bytes / bw >= res.flops / flops;
+    }
 };
 
 struct test_case {
@@ -274,6 +302,25 @@ struct test_case {
         return size;
     }
 
+    // floating point operations of the op, 0 if they are not significant
+    virtual double op_flops(ggml_tensor * t) {
+        return 0.0;
+
+        GGML_UNUSED(t);
+    }
+
+    // bytes the op reads and writes at least: the sources and the destination, once each
+    // unlike op_size, this does not depend on how the op is implemented and is used for the roofline
+    size_t op_bytes(ggml_tensor * t) {
+        size_t size = ggml_nbytes(t);
+        for (int i = 0; i < GGML_MAX_SRC; i++) {
+            if (t->src[i] != NULL && t->src[i] != t->view_src) {
+                size += ggml_nbytes(t->src[i]);
+            }
+        }
+        return size;
+    }
+
     ggml_cgraph * gf = nullptr;
 
     static const int sentinel_size = 1024;
@@ -459,7 +506,9 @@ struct test_case {
         return ud.ok;
     }
 
-    bool eval_perf(ggml_backend_t backend, const char * op_name) {
+    // roofline: if not null, print the fraction of the roofline reached by the op
+    // result: if not null, the measurement is stored there
+    bool eval_perf(ggml_backend_t backend, const char * op_name, const perf_roofline * roofline = nullptr, perf_result * result = nullptr) {
         mode = MODE_PERF;
 
         static const size_t graph_nodes = 8192;
@@ -511,9 +560,17 @@ struct test_case {
         // warmup run
         ggml_backend_graph_compute(backend, gf);
 
+        // second warmup run, timed to limit the number of runs of slow ops
+        ggml_backend_synchronize(backend);
+        int64_t warmup_start_time = ggml_time_us();
+        ggml_backend_graph_compute(backend, gf);
+        ggml_backend_synchronize(backend);
+        int64_t warmup_time_us = std::max<int64_t>(ggml_time_us() - warmup_start_time, 1);
+
         // duplicate the op
         size_t target_size = ggml_backend_is_cpu(backend) ? 1ULL << 33 : 1ULL << 35; // 8 GB CPU, 32 GB GPU
-        int n_runs = std::min((size_t)gf->size - gf->n_nodes, target_size / op_size(out)) + 1;
+        size_t target_runs = 1000000 / warmup_time_us; // about 1 s
+        int n_runs = std::min({(size_t)gf->size - gf->n_nodes, target_size / op_size(out), target_runs}) + 1;
         for (int i = 1; i < n_runs; i++) {
             gf->nodes[gf->n_nodes++] = out;
         }
@@ -546,12 +603,37 @@ struct test_case {
         int64_t end_time = ggml_time_us();
         double time_us = end_time - start_time;
 
-        printf("    %5d runs - %8.2f us/run - %8zu kB/run - \033[1;34m%7.2f GB/s\033[0m\n",
+        perf_result res;
+        res.evaluated = true;
+        res.op        = op_desc(out);
+        res.vars      = vars();
+        res.n_runs    = n_runs;
+        res.time_us   = time_us / n_runs;
+        res.bytes     = op_bytes(out);
+        res.flops     = op_flops(out);
+
+        printf("    %5d runs - %8.2f us/run - %8zu kB/run - \033[1;34m%7.2f GB/s\033[0m",
             n_runs,
             time_us / n_runs,
             op_size(out) / 1024,
             mem / (time_us/1e6) / 1024.0 / 1024.0 / 1024.0);
 
+        if (res.flops > 0.0) {
+            printf(" - %8.2f GFLOP/s", res.flops / res.time_us / 1e3);
+        }
+
+        if (roofline != nullptr) {
+            printf(" - %5.1f%% of roofline (%s bound)",
+                100.0 * roofline->min_time_us(res) / res.time_us,
+                roofline->memory_bound(res) ? "memory" : "compute");
+        }
+
+        printf("\n");
+
+        if (result != nullptr) {
+            *result = res;
+        }
+
         ggml_backend_buffer_free(buf);
 
         ggml_free(ctx);
@@ -827,6 +909,50 @@ struct test_rms_norm : public test_case {
     }
 };
 
+// GGML_OP_RMS_NORM_MUL
+struct test_rms_norm_mul : public test_case {
+    const ggml_type type;
+    const std::array<int64_t, 4> ne;
+    float eps;
+
+    std::string vars() override {
+        return VARS_TO_STR3(type, ne, eps);
+    }
+
+    test_rms_norm_mul(ggml_type type = GGML_TYPE_F32,
+            std::array<int64_t, 4> ne = {64, 10, 10, 10},
+            float eps = 1e-6f)
+        : type(type), ne(ne), eps(eps) {}
+
+    ggml_tensor * build_graph(ggml_context * ctx) override {
+        ggml_tensor * a = ggml_new_tensor(ctx, type, 4, ne.data());
+        ggml_tensor * w = ggml_new_tensor_1d(ctx, type, ne[0]);
+        ggml_tensor * out = ggml_rms_norm_mul(ctx, a, w, eps);
+        return out;
+    }
+};
+
+// GGML_OP_SWIGLU
+struct test_swiglu : public test_case {
+    const ggml_type type;
+    const std::array<int64_t, 4> ne;
+
+    std::string vars() override {
+        return VARS_TO_STR2(type, ne);
+    }
+
+    test_swiglu(ggml_type type = GGML_TYPE_F32,
+            std::array<int64_t, 4> ne = {128, 10, 10, 10})
+        : type(type), ne(ne) {}
+
+    ggml_tensor * build_graph(ggml_context * ctx) override {
+        ggml_tensor * a = ggml_new_tensor(ctx, type, 4, ne.data());
+        ggml_tensor * b = ggml_new_tensor(ctx, type, 4, ne.data());
+        ggml_tensor * out = ggml_swiglu(ctx, a, b);
+        return out;
+    }
+};
+
 // GGML_OP_MUL_MAT
 struct test_mul_mat : public test_case {
     const ggml_type type_a;
@@ -854,6 +980,12 @@ struct test_mul_mat : public test_case {
         GGML_UNUSED(t);
     }
 
+    double op_flops(ggml_tensor * t) override {
+        return 2.0 * m * n * k * bs[0] * nr[0] * bs[1] * nr[1];
+
+        GGML_UNUSED(t);
+    }
+
     test_mul_mat(ggml_type type_a = GGML_TYPE_F32, ggml_type type_b = GGML_TYPE_F32,
             int64_t m = 32, int64_t n = 32, int64_t k = 32,
             std::array<int64_t, 2> bs = {10, 10},
@@ -897,6 +1029,12 @@ struct test_mul_mat_id : public test_case {
         GGML_UNUSED(t);
     }
 
+    double op_flops(ggml_tensor * t) override {
+        return 2.0 * m * n * k;
+
+        GGML_UNUSED(t);
+    }
+
     test_mul_mat_id(ggml_type type_a = GGML_TYPE_F32, ggml_type type_b = GGML_TYPE_F32,
             int n_mats = 2, int id = 0,
             int64_t m = 32, int64_t n = 32, int64_t k = 32, bool v = false)
@@ -1026,6 +1164,44 @@ struct test_soft_max : public test_case {
     }
 };
 
+// GGML_OP_FLASH_ATTN_EXT
+struct test_flash_attn_ext : public test_case {
+    const ggml_type type_kv;
+    const int64_t hs;    // head size
+    const int64_t nh;    // num heads of q
+    const int64_t nh_kv; // num heads of k and v
+    const int64_t kv;    // kv size
+    const int64_t nb;    // batch size
+
+    std::string vars() override {
+        return VARS_TO_STR6(type_kv, hs, nh, nh_kv, kv, nb);
+    }
+
+    double max_nmse_err() override {
+        return 5e-4;
+    }
+
+    double op_flops(ggml_tensor * t) override {
+        // Q*K^T and softmax(Q*K^T)*V
+        return 4.0 * hs * kv * nb * nh;
+
+        GGML_UNUSED(t);
+    }
+
+    test_flash_attn_ext(ggml_type type_kv = GGML_TYPE_F16,
+            int64_t hs = 128, int64_t nh = 32, int64_t nh_kv = 32, int64_t kv = 96, int64_t nb = 8)
+        : type_kv(type_kv), hs(hs), nh(nh), nh_kv(nh_kv), kv(kv), nb(nb) {}
+
+    ggml_tensor * build_graph(ggml_context * ctx) override {
+        ggml_tensor * q = ggml_new_tensor_4d(ctx, GGML_TYPE_F32, hs, nb, nh, 1);
+        ggml_tensor * k = ggml_new_tensor_4d(ctx, type_kv, hs, kv, nh_kv, 1);
+        ggml_tensor * v = ggml_new_tensor_4d(ctx, type_kv, hs, kv, nh_kv, 1);
+        ggml_tensor * m = ggml_new_tensor_4d(ctx, GGML_TYPE_F32, kv, nb, 1, 1);
+        ggml_tensor * out = ggml_flash_attn_ext(ctx, q, k, v, m, 1.0f/sqrtf(hs));
+        return out;
+    }
+};
+
 // GGML_OP_ROPE
 struct test_rope : public test_case {
     const ggml_type type;
@@ -1033,19 +1209,25 @@ struct test_rope : public test_case {
     int n_dims;
     int mode;
     int n_ctx;
+    bool cached;
 
     std::string vars() override {
-        return VARS_TO_STR5(type, ne, n_dims, mode, n_ctx);
+        return VARS_TO_STR6(type, ne, n_dims, mode, n_ctx, cached);
     }
 
     test_rope(ggml_type type = GGML_TYPE_F32,
             std::array<int64_t, 4> ne = {10, 10, 10, 1},
-            int n_dims = 10, int mode = 0, int n_ctx = 512)
-        : type(type), ne(ne), n_dims(n_dims), mode(mode), n_ctx(n_ctx) {}
+            int n_dims = 10, int mode = 0, int n_ctx = 512, bool cached = false)
+        : type(type), ne(ne), n_dims(n_dims), mode(mode), n_ctx(n_ctx), cached(cached) {}
 
     ggml_tensor * build_graph(ggml_context * ctx) override {
         ggml_tensor * a = ggml_new_tensor(ctx, type, 4, ne.data());
         ggml_tensor * pos = ggml_new_tensor_1d(ctx, GGML_TYPE_I32, ne[2]);
+        if (cached) {
+            // same parameters as ggml_rope
+            ggml_tensor * cache = ggml_rope_cache(ctx, pos, n_dims, mode, 0, 10000.0f, 1.0f, 0.0f, 1.0f, 0.0f, 0.0f);
+            return ggml_rope_custom_cached(ctx, a, pos, cache, n_dims, mode, n_ctx, 0, 10000.0f, 1.0f, 0.0f, 1.0f, 0.0f, 0.0f);
+        }
         ggml_tensor * out = ggml_rope(ctx, a, pos, n_dims, mode, n_ctx);
         return out;
     }
@@ -1418,19 +1600,220 @@ struct test_moe : public test_case {
     }
 };
 
-static bool test_backend(ggml_backend_t backend, test_mode mode, const char * op_name) {
-    std::vector<std::unique_ptr<test_case>> test_cases;
+static const ggml_type all_types[] = {
+    GGML_TYPE_F32, GGML_TYPE_F16,
+    GGML_TYPE_Q4_0, GGML_TYPE_Q4_1,
+    GGML_TYPE_Q5_0, GGML_TYPE_Q5_1,
+    GGML_TYPE_Q8_0,
+    GGML_TYPE_Q2_K, GGML_TYPE_Q3_K,
+    GGML_TYPE_Q4_K, GGML_TYPE_Q5_K,
+    GGML_TYPE_Q6_K
+};
+
+// options of the perf modes
+struct perf_params {
+    std::vector<std::string> models;                  // perf-model: names of perf_models, empty for all
+    std::vector<ggml_type>   types;                   // perf-model: types of the weights, empty for all_types
+    std::vector<int64_t>     n_tokens = {1, 8, 32, 128, 512};
+    int64_t                  n_kv     = 512;
+    double                   peak_bw    = 0.0;        // GB/s, 0 to measure
+    double                   peak_flops = 0.0;        // GFLOP/s, 0 to measure
+    FILE *                   jsonl      = nullptr;    // one JSON object per measurement
+};
+
+static void perf_write_jsonl(const perf_params & params, ggml_backend_t backend, const std::string & fields,
+        const perf_result & res, const perf_roofline * roofline) {
+    if (params.jsonl == nullptr || !res.evaluated) {
+        return;
+    }
+
+    fprintf(params.jsonl, "{\"backend\": \"%s\", %s\"op\": \"%s\", \"vars\": \"%s\", \"runs\": %d, \"us_per_run\": %.3f, "
+            "\"bytes\": %zu, \"flops\": %.0f, \"gb_per_s\": %.3f, \"gflop_per_s\": %.3f",
+            ggml_backend_name(backend), fields.c_str(), res.op.c_str(), res.vars.c_str(), res.n_runs, res.time_us,
+            res.bytes, res.flops, res.bytes / res.time_us / 1e3, res.flops / res.time_us / 1e3);
+    if (roofline != nullptr) {
+        fprintf(params.jsonl, ", \"roofline\": %.4f, \"bound\": \"%s\"",
+                roofline->min_time_us(res) / res.time_us, roofline->memory_bound(res) ? "memory" : "compute");
+    }
+    fprintf(params.jsonl, "}\n");
+}
+
+// llama models of the perf-model mode, the ops are those built by llm_build_llama
+struct perf_model {
+    const char * name;
+    int64_t n_layer;
+    int64_t n_embd;
+    int64_t n_head;
+    int64_t n_head_kv;
+    int64_t n_ff;
+    int64_t n_vocab;
+};
 
-    const ggml_type all_types[] = {
-        GGML_TYPE_F32, GGML_TYPE_F16,
-        GGML_TYPE_Q4_0, GGML_TYPE_Q4_1,
-        GGML_TYPE_Q5_0, GGML_TYPE_Q5_1,
-        GGML_TYPE_Q8_0,
-        GGML_TYPE_Q2_K, GGML_TYPE_Q3_K,
-        GGML_TYPE_Q4_K, GGML_TYPE_Q5_K,
-        GGML_TYPE_Q6_K
+static const perf_model perf_models[] = {
+    { "7B",  32, 4096, 32, 32, 11008, 32000 },
+    { "13B", 40, 5120, 40, 40, 13824, 32000 },
+    { "70B", 80, 8192, 64,  8, 28672, 32000 },
+};
+
+// an op of a model and the number of times it is evaluated per forward pass
+struct perf_model_op {
+    std::unique_ptr<test_case> test;
+    int64_t count;
+};
+
+// ops of a forward pass of n_tokens tokens with n_kv cells of KV cache, the weights are of the given type
+static std::vector<perf_model_op> perf_model_ops(const perf_model & model, ggml_type type, int64_t n_tokens, int64_t n_kv) {
+    const int64_t n_layer   = model.n_layer;
+    const int64_t n_embd    = model.n_embd;
+    const int64_t n_ff      = model.n_ff;
+    const int64_t n_head    = model.n_head;
+    const int64_t n_head_kv = model.n_head_kv;
+    const int64_t head_dim  = n_embd / n_head;
+    const int64_t n_gqa     = n_head / n_head_kv;
+
+    std::vector<perf_model_op> ops;
+
+    auto add = [&](test_case * test, int64_t count) {
+        ops.push_back({ std::unique_ptr<test_case>(test), count });
     };
 
+    // attn_norm and ffn_norm of every layer, output_norm
+    add(new test_rms_norm_mul(GGML_TYPE_F32, {n_embd, n_tokens, 1, 1}, 1e-5f), 2*n_layer + 1);
+
+    // self-attention
+    if (n_gqa == 1) {
+        // wq, wk, wv, wo
+        add(new test_mul_mat(type, GGML_TYPE_F32, n_embd, n_tokens, n_embd, {1, 1}, {1, 1}), 4*n_layer);
+        // Qcur, Kcur
+        add(new test_rope(GGML_TYPE_F32, {head_dim, n_head, n_tokens, 1}, head_dim, 0, n_kv), 2*n_layer);
+    } else {
+        // wq, wo
+        add(new test_mul_mat(type, GGML_TYPE_F32, n_embd, n_tokens, n_embd, {1, 1}, {1, 1}), 2*n_layer);
+        // wk, wv
+        add(new test_mul_mat(type, GGML_TYPE_F32, head_dim*n_head_kv, n_tokens, n_embd, {1, 1}, {1, 1}), 2*n_layer);
+        add(new test_rope(GGML_TYPE_F32, {head_dim, n_head,    n_tokens, 1}, head_dim, 0, n_kv), n_layer);
+        add(new test_rope(GGML_TYPE_F32, {head_dim, n_head_kv, n_tokens, 1}, head_dim, 0, n_kv), n_layer);
+    }
+    // kq = K*Q
+    add(new test_mul_mat(GGML_TYPE_F16, GGML_TYPE_F32, n_kv, n_tokens, head_dim, {n_head_kv, 1}, {n_gqa, 1}), n_layer);
+    add(new test_soft_max(GGML_TYPE_F32, {n_kv, n_tokens, n_head, 1}), n_layer);
+    // kqv = V*kq
+    add(new test_mul_mat(GGML_TYPE_F16, GGML_TYPE_F32, head_dim, n_tokens, n_kv, {n_head_kv, 1}, {n_gqa, 1}), n_layer);
+
+    // residual connections
+    add(new test_bin_bcast(ggml_add, GGML_TYPE_F32, {n_embd, n_tokens, 1, 1}, {1, 1, 1, 1}), 2*n_layer);
+
+    // feed-forward: ffn_up and ffn_gate, silu(gate)*up, ffn_down
+    add(new test_mul_mat(type, GGML_TYPE_F32, n_ff, n_tokens, n_embd, {1, 1}, {1, 1}), 2*n_layer);
+    add(new test_swiglu(GGML_TYPE_F32, {n_ff, n_tokens, 1, 1}), n_layer);
+    add(new test_mul_mat(type, GGML_TYPE_F32, n_embd, n_tokens, n_ff, {1, 1}, {1, 1}), n_layer);
+
+    // output
+    add(new test_mul_mat(type, GGML_TYPE_F32, model.n_vocab, n_tokens, n_embd, {1, 1}, {1, 1}), 1);
+
+    return ops;
+}
+
+// the peak bandwidth is that of a large copy, the peak FLOP/s that of the fastest of a few large matrix multiplications
+static perf_roofline perf_roofline_measure(ggml_backend_t backend, const perf_params & params) {
+    perf_roofline roofline;
+    roofline.bw    = params.peak_bw;
+    roofline.flops = params.peak_flops;
+
+    if (roofline.bw <= 0.0) {
+        perf_result res;
+        test_cpy(GGML_TYPE_F32, GGML_TYPE_F32, {4096, 4096, 2, 1}).eval_perf(backend, nullptr, nullptr, &res);
+        if (res.evaluated) {
+            roofline.bw = res.bytes / res.time_us / 1e3;
+        }
+    }
+
+    if (roofline.flops <= 0.0) {
+        for (ggml_type type : {GGML_TYPE_F16, GGML_TYPE_Q8_0, GGML_TYPE_Q4_0}) {
+            perf_result res;
+            test_mul_mat(type, GGML_TYPE_F32, 4096, 512, 4096, {1, 1}, {1, 1}).eval_perf(backend, nullptr, nullptr, &res);
+            if (res.evaluated) {
+                roofline.flops = std::max(roofline.flops, res.flops / res.time_us / 1e3);
+            }
+        }
+    }
+
+    return roofline;
+}
+
+static bool test_backend_perf_model(ggml_backend_t backend, const char * op_name, const perf_params & params) {
+    printf("  Measuring the roofline\n");
+    const perf_roofline roofline = perf_roofline_measure(backend, params);
+    if (roofline.bw <= 0.0 || roofline.flops <= 0.0) {
+        printf("  Failed to measure the roofline, use --peak-bw and --peak-flops\n");
+        return false;
+    }
+    printf("  Roofline: %.2f GB/s, %.2f GFLOP/s, ridge point %.2f FLOP/byte\n\n",
+        roofline.bw, roofline.flops, roofline.flops / roofline.bw);
+
+    for (const perf_model & model : perf_models) {
+        if (!params.models.empty() &&
+            std::find(params.models.begin(), params.models.end(), model.name) == params.models.end()) {
+            continue;
+        }
+
+        std::vector<ggml_type> types = params.types;
+        if (types.empty()) {
+            types.assign(std::begin(all_types), std::end(all_types));
+        }
+
+        for (ggml_type type : types) {
+            for (int64_t n_tokens : params.n_tokens) {
+                const int64_t n_kv = std::max(n_tokens, params.n_kv);
+
+                printf("  %s %s, n_tokens = %" PRId64 ", n_kv = %" PRId64 "\n", model.name, ggml_type_name(type), n_tokens, n_kv);
+
+                char fields[256];
+                snprintf(fields, sizeof(fields), "\"model\": \"%s\", \"type\": \"%s\", \"n_tokens\": %" PRId64 ", \"n_kv\": %" PRId64 ", ",
+                    model.name, ggml_type_name(type), n_tokens, n_kv);
+
+                // estimate of a forward pass from the ops evaluated
+                double time_us     = 0.0;
+                double min_time_us = 0.0;
+                bool   complete    = true;
+
+                for (perf_model_op & op : perf_model_ops(model, type, n_tokens, n_kv)) {
+                    perf_result res;
+                    op.test->eval_perf(backend, op_name, &roofline, &res);
+                    if (!res.evaluated) {
+                        complete = false;
+                        continue;
+                    }
+                    time_us     += op.count * res.time_us;
+                    min_time_us += op.count * roofline.min_time_us(res);
+
+                    perf_write_jsonl(params, backend, fields + std::string("\"count\": ") + std::to_string(op.count) + ", ", res, &roofline);
+                }
+
+                if (time_us > 0.0) {
+                    printf("  %s %s, n_tokens = %" PRId64 ": %.2f ms per forward pass, %.2f tokens/s, \033[1;34m%.1f%% of roofline\033[0m%s\n\n",
+                        model.name, ggml_type_name(type), n_tokens, time_us / 1e3, n_tokens / (time_us / 1e6),
+                        100.0 * min_time_us / time_us, complete ? "" : " (ops missing)");
+
+                    if (params.jsonl != nullptr) {
+                        fprintf(params.jsonl, "{\"backend\": \"%s\", %s\"op\": \"forward\", \"complete\": %s, \"us\": %.3f, \"roofline\": %.4f}\n",
+                            ggml_backend_name(backend), fields, complete ? "true" : "false", time_us, min_time_us / time_us);
+                    }
+                }
+            }
+        }
+    }
+
+    return true;
+}
+
+static bool test_backend(ggml_backend_t backend, test_mode mode, const char * op_name, const perf_params & params) {
+    if (mode == MODE_PERF_MODEL) {
+        return test_backend_perf_model(backend, op_name, params);
+    }
+
+    std::vector<std::unique_ptr<test_case>> test_cases;
+
     // unary ops
     for (int op = 0; op < GGML_UNARY_OP_COUNT; op++) {
         test_cases.emplace_back(new test_unary((ggml_unary_op) op));
@@ -1501,8 +1884,11 @@ static bool test_backend(ggml_backend_t backend, test_mode mode, const char * op
     for (float eps : {1e-6f, 1e-5f, 1e-3f, 1e-1f}) {
         test_cases.emplace_back(new test_norm(GGML_TYPE_F32, {64, 10, 10, 10}, eps));
         test_cases.emplace_back(new test_rms_norm(GGML_TYPE_F32, {64, 10, 10, 10}, eps));
+        test_cases.emplace_back(new test_rms_norm_mul(GGML_TYPE_F32, {64, 10, 10, 10}, eps));
     }
 
+    test_cases.emplace_back(new test_swiglu());
+
     for (ggml_type type_a : all_types) {
         for (ggml_type type_b : {GGML_TYPE_F32 /*, GGML_TYPE_F16 */}) {
             // FIXME: CPU crashes on f16xf16
@@ -1545,6 +1931,13 @@ static bool test_backend(ggml_backend_t backend, test_mode mode, const char * op
 
     test_cases.emplace_back(new test_soft_max());
 
+    for (ggml_type type_kv : {GGML_TYPE_F32, GGML_TYPE_F16}) {
+        test_cases.emplace_back(new test_flash_attn_ext(type_kv, 128, 32, 32,  96, 1));
+        test_cases.emplace_back(new test_flash_attn_ext(type_kv, 128, 32, 32,  96, 8));
+        test_cases.emplace_back(new test_flash_attn_ext(type_kv, 128, 32,  8,  96, 8)); // GQA
+        test_cases.emplace_back(new test_flash_attn_ext(type_kv,  64,  8,  8, 300, 4));
+    }
+
     for (ggml_type type : {GGML_TYPE_F32, GGML_TYPE_F16}) {
         test_cases.emplace_back(new test_rope(type, {128,  32, 10, 1}, 128, 0, 512)); // llama 7B
         test_cases.emplace_back(new test_rope(type, {128,  40, 10, 1}, 128, 0, 512)); // llama 13B
@@ -1555,6 +1948,8 @@ static bool test_backend(ggml_backend_t backend, test_mode mode, const char * op
         test_cases.emplace_back(new test_rope(type, { 64,   8, 10, 1},  64, 2, 512)); // neox (falcon 40B)
         test_cases.emplace_back(new test_rope(type, { 64, 128, 10, 1},  64, 2, 512)); // neox (falcon 40B)
         test_cases.emplace_back(new test_rope(type, { 80,  32, 10, 1},  20, 2, 512)); // neox (stablelm)
+        test_cases.emplace_back(new test_rope(type, {128,  32, 10, 1}, 128, 0, 512, true)); // llama 7B, cached
+        test_cases.emplace_back(new test_rope(type, { 64,  71, 10, 1},  64, 2, 512, true)); // neox (falcon 7B), cached
     }
 
     test_cases.emplace_back(new test_alibi());
@@ -1598,7 +1993,9 @@ static bool test_backend(ggml_backend_t backend, test_mode mode, const char * op
 
     if (mode == MODE_PERF) {
         for (auto & test : test_cases) {
-            test->eval_perf(backend, op_name);
+            perf_result res;
+            test->eval_perf(backend, op_name, nullptr, &res);
+            perf_write_jsonl(params, backend, "", res, nullptr);
         }
         return true;
     }
@@ -1608,21 +2005,54 @@ static bool test_backend(ggml_backend_t backend, test_mode mode, const char * op
 }
 
 static void usage(char ** argv) {
-    printf("Usage: %s [mode] [-o op] [-b backend]\n", argv[0]);
-    printf("  valid modes are: test (compare with CPU backend for correctness) or perf (performance evaluation)\n");
+    printf("Usage: %s [mode] [-o op] [-b backend] [perf options]\n", argv[0]);
+    printf("  valid modes are: test (compare with CPU backend for correctness), perf (performance evaluation)\n");
+    printf("  or perf-model (performance of the ops of llama models, compared with the roofline of the backend)\n");
     printf("  op names are as given by ggml_op_desc()\n");
+    printf("perf options:\n");
+    printf("  --jsonl FNAME         write the measurements to FNAME, one JSON object per line\n");
+    printf("perf-model options:\n");
+    printf("  -m MODELS             comma separated models (default: all of");
+    for (const perf_model & model : perf_models) {
+        printf(" %s", model.name);
+    }
+    printf(")\n");
+    printf("  -t TYPES              comma separated types of the weights (default: all)\n");
+    printf("  -n N_TOKENS           comma separated batch sizes (default: 1,8,32,128,512)\n");
+    printf("  --kv N                size of the KV cache, at least the batch size (default: 512)\n");
+    printf("  --peak-bw GB/s        peak memory bandwidth of the backend (default: measured)\n");
+    printf("  --peak-flops GFLOP/s  peak FLOP/s of the backend (default: measured)\n");
+}
+
+static std::vector<std::string> split_list(const char * str) {
+    std::vector<std::string> values;
+    std::string s = str;
+    size_t pos = 0;
+    while (true) {
+        size_t end = s.find(',', pos);
+        values.push_back(s.substr(pos, end == std::string::npos ? std::string::npos : end - pos));
+        if (end == std::string::npos) {
+            break;
+        }
+        pos = end + 1;
+    }
+    return values;
 }
 
 int main(int argc, char ** argv) {
     test_mode mode = MODE_TEST;
     const char * op_name = NULL;
     const char * backend = NULL;
+    const char * jsonl = NULL;
+    perf_params params;
 
     for (int i = 1; i < argc; i++) {
         if (strcmp(argv[i], "test") == 0) {
             mode = MODE_TEST;
         } else if (strcmp(argv[i], "perf") == 0) {
             mode = MODE_PERF;
+        } else if (strcmp(argv[i], "perf-model") == 0) {
+            mode = MODE_PERF_MODEL;
         } else if (strcmp(argv[i], "-o") == 0) {
             if (i + 1 < argc) {
                 op_name = argv[++i];
@@ -1637,12 +2067,80 @@ int main(int argc, char ** argv) {
                 usage(argv);
                 return 1;
             }
+        } else if (strcmp(argv[i], "--jsonl") == 0) {
+            if (i + 1 < argc) {
+                jsonl = argv[++i];
+            } else {
+                usage(argv);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "-m") == 0) {
+            if (i + 1 < argc) {
+                params.models = split_list(argv[++i]);
+            } else {
+                usage(argv);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "-t") == 0) {
+            if (i + 1 < argc) {
+                for (const std::string & name : split_list(argv[++i])) {
+                    const ggml_type * type = std::find_if(std::begin(all_types), std::end(all_types),
+                        [&](ggml_type t) { return name == ggml_type_name(t); });
+                    if (type == std::end(all_types)) {
+                        fprintf(stderr, "error: unknown type: %s\n", name.c_str());
+                        return 1;
+                    }
+                    params.types.push_back(*type);
+                }
+            } else {
+                usage(argv);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "-n") == 0) {
+            if (i + 1 < argc) {
+                params.n_tokens.clear();
+                for (const std::string & n : split_list(argv[++i])) {
+                    params.n_tokens.push_back(std::max(1LL, std::atoll(n.c_str())));
+                }
+            } else {
+                usage(argv);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--kv") == 0) {
+            if (i + 1 < argc) {
+                params.n_kv = std::max(1LL, std::atoll(argv[++i]));
+            } else {
+                usage(argv);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--peak-bw") == 0) {
+            if (i + 1 < argc) {
+                params.peak_bw = std::atof(argv[++i]);
+            } else {
+                usage(argv);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--peak-flops") == 0) {
+            if (i + 1 < argc) {
+                params.peak_flops = std::atof(argv[++i]);
+            } else {
+                usage(argv);
+                return 1;
+            }
         } else {
             usage(argv);
             return 1;
         }
     }
 
+    if (jsonl != NULL) {
+        params.jsonl = fopen(jsonl, "w");
+        if (params.jsonl == NULL) {
+            fprintf(stderr, "error: failed to open %s\n", jsonl);
+            return 1;
+        }
+    }
+
     // enumerate backends
     printf("Testing %zu backends\n\n", ggml_backend_reg_get_count());
 
@@ -1661,7 +2159,7 @@ int main(int argc, char ** argv) {
         GGML_ASSERT(backend != NULL);
         printf("  Backend name: %s\n", ggml_backend_name(backend));
 
-        bool ok = test_backend(backend, mode, op_name);
+        bool ok = test_backend(backend, mode, op_name, params);
 
         printf("  Backend %s: ", ggml_backend_name(backend));
         if (ok) {
@@ -1676,6 +2174,10 @@ int main(int argc, char ** argv) {
         ggml_backend_free(backend);
     }
 
+    if (params.jsonl != NULL) {
+        fclose(params.jsonl);
+    }
+
     printf("%zu/%zu backends passed\n", n_ok, ggml_backend_reg_get_count());
 
     if (n_ok != ggml_backend_reg_get_count()) {
@@ -5,7 +5,64 @@
 #include "llama.h"
 #include "grammar-parser.h"
 
+#include <algorithm>
 #include <cassert>
+#include <map>
+
+static bool rules_equal(const std::vector<llama_grammar_element> & a, const std::vector<llama_grammar_element> & b) {
+    if (a.size() != b.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < a.size(); i++) {
+        if (a[i].type != b[i].type || a[i].value != b[i].value) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool rules_equal(const std::vector<std::vector<llama_grammar_element>> & a, const std::vector<std::vector<llama_grammar_element>> & b) {
+    if (a.size() != b.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < a.size(); i++) {
+        if (!rules_equal(a[i], b[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// the rules reachable from rule id_a of a and from rule id_b of b are the same up to their ids
+static bool rules_equivalent(
+        const grammar_parser::parse_state & a, uint32_t id_a,
+        const grammar_parser::parse_state & b, uint32_t id_b,
+        std::map<uint32_t, uint32_t> & ids) {
+    auto it = ids.find(id_a);
+    if (it != ids.end()) {
+        return it->second == id_b;
+    }
+    ids[id_a] = id_b;
+
+    const auto & rule_a = a.rules[id_a];
+    const auto & rule_b = b.rules[id_b];
+    if (rule_a.size() != rule_b.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < rule_a.size(); i++) {
+        if (rule_a[i].type != rule_b[i].type) {
+            return false;
+        }
+        if (rule_a[i].type == LLAMA_GRETYPE_RULE_REF) {
+            if (!rules_equivalent(a, rule_a[i].value, b, rule_b[i].value, ids)) {
+                return false;
+            }
+        } else if (rule_a[i].value != rule_b[i].value) {
+            return false;
+        }
+    }
+    return true;
+}
 
 int main()
 {
@@ -246,5 +303,150 @@ term  ::= [0-9]+)""";
         }
     }
 
+    // incremental update: only the changed rule and the rules generated from it are re-parsed
+    const char * grammar_v1 = R"""(root ::= expr [\n] ws
+expr ::= [0-9]+
+ws   ::= [ ]*)""";
+
+    const char * grammar_v2 = R"""(root ::= expr [\n] ws
+expr ::= ([a-z] | "_")+
+ws   ::= [ ]*)""";
+
+    parsed_grammar = grammar_parser::parse(grammar_v1);
+    const auto rules_v1 = parsed_grammar.rules;
+    const uint32_t root_id = parsed_grammar.symbol_ids.at("root");
+    const uint32_t expr_id = parsed_grammar.symbol_ids.at("expr");
+    const uint32_t ws_id   = parsed_grammar.symbol_ids.at("ws");
+
+    std::vector<uint32_t> changed_rules;
+
+    // identical grammar: nothing changes
+    assert(grammar_parser::parse_update(parsed_grammar, grammar_v1, changed_rules));
+    assert(changed_rules.empty());
+    assert(rules_equal(parsed_grammar.rules, rules_v1));
+
+    assert(grammar_parser::parse_update(parsed_grammar, grammar_v2, changed_rules));
+    assert(std::find(changed_rules.begin(), changed_rules.end(), expr_id) != changed_rules.end());
+    assert(std::find(changed_rules.begin(), changed_rules.end(), root_id) == changed_rules.end());
+    assert(std::find(changed_rules.begin(), changed_rules.end(), ws_id)   == changed_rules.end());
+    assert(rules_equal(parsed_grammar.rules[root_id], rules_v1[root_id]));
+    assert(rules_equal(parsed_grammar.rules[ws_id],   rules_v1[ws_id]));
+
+    // expr ::= expr_+ , expr_+ ::= expr_group expr_+ | expr_group, expr_group ::= [a-z] | "_"
+    const auto & expr_rule = parsed_grammar.rules[expr_id];
+    assert(expr_rule.size() == 2 && expr_rule[0].type == LLAMA_GRETYPE_RULE_REF);
+    const uint32_t plus_id = expr_rule[0].value;
+    const auto & plus_rule = parsed_grammar.rules[plus_id];
+    assert(plus_rule.size() == 5 && plus_rule[0].type == LLAMA_GRETYPE_RULE_REF && plus_rule[1].value == plus_id);
+    const auto & group_rule = parsed_grammar.rules[plus_rule[0].value];
+    assert(rules_equal(group_rule, {
+        {LLAMA_GRETYPE_CHAR, 'a'},
+        {LLAMA_GRETYPE_CHAR_RNG_UPPER, 'z'},
+        {LLAMA_GRETYPE_ALT, 0},
+        {LLAMA_GRETYPE_CHAR, '_'},
+        {LLAMA_GRETYPE_END, 0},
+    }));
+    for (uint32_t id : { plus_id, plus_rule[0].value }) {
+        assert(std::find(changed_rules.begin(), changed_rules.end(), id) != changed_rules.end());
+    }
+
+    // alternates continued on the next lines after a trailing |, as in grammars/c.gbnf
+    const char * grammar_ml_v1 = R"""(root ::= stmt+
+stmt ::=
+    ( ident ws "=" ws num ";" ) |
+    ( "return" ws num ";" ) |
+    ( ident ws "(" ")" ";" )
+ident ::= [a-z]+
+num ::= [0-9]+
+ws ::= [ ]*)""";
+
+    const char * grammar_ml_v2 = R"""(root ::= stmt+
+stmt ::=
+    ( ident ws "=" ws num ";" ) |
+    ( "return" ws ident ";" ) |
+    ( ident ws "(" ")" ";" )
+ident ::= [a-z]+
+num ::= [0-9]+
+ws ::= [ ]*)""";
+
+    parsed_grammar = grammar_parser::parse(grammar_ml_v1);
+    const auto rules_ml_v1 = parsed_grammar.rules;
+    const uint32_t stmt_id  = parsed_grammar.symbol_ids.at("stmt");
+    const uint32_t ident_id = parsed_grammar.symbol_ids.at("ident");
+    const uint32_t num_id   = parsed_grammar.symbol_ids.at("num");
+
+    for (int i = 0; i < 2; i++) {
+        assert(grammar_parser::parse_update(parsed_grammar, grammar_ml_v1, changed_rules));
+        assert(changed_rules.empty());
+        assert(rules_equal(parsed_grammar.rules, rules_ml_v1));
+    }
+
+    // an edit on a continuation line changes the rule
+    assert(grammar_parser::parse_update(parsed_grammar, grammar_ml_v2, changed_rules));
+    assert(std::find(changed_rules.begin(), changed_rules.end(), stmt_id)  != changed_rules.end());
+    assert(std::find(changed_rules.begin(), changed_rules.end(), ident_id) == changed_rules.end());
+    assert(std::find(changed_rules.begin(), changed_rules.end(), num_id)   == changed_rules.end());
+    // stmt ::= group_1 | group_2 | group_3, group_2 is the "return" alternate, which now ends with an ident
+    const auto & stmt_rule = parsed_grammar.rules[stmt_id];
+    assert(stmt_rule.size() == 6 && stmt_rule[2].type == LLAMA_GRETYPE_RULE_REF);
+    const auto & return_rule = parsed_grammar.rules[stmt_rule[2].value];
+    assert(return_rule.size() >= 3 && return_rule[0].type == LLAMA_GRETYPE_CHAR && return_rule[0].value == 'r');
+    assert(return_rule[return_rule.size() - 3].type == LLAMA_GRETYPE_RULE_REF && return_rule[return_rule.size() - 3].value == ident_id);
+
+    assert(grammar_parser::parse_update(parsed_grammar, grammar_ml_v2, changed_rules));
+    assert(changed_rules.empty());
+
+    // a rule that is no longer defined is dropped along with its generated rules, as if the grammar was parsed again
+    const char * grammar_rm_v1 = R"""(root ::= expr ws
+expr ::= [0-9]+
+old  ::= ("a" | "b")* ws
+ws   ::= [ ]*)""";
+
+    const char * grammar_rm_v2 = R"""(root ::= expr ws
+expr ::= [0-9]+
+ws   ::= [ ]*)""";
+
+    parsed_grammar = grammar_parser::parse(grammar_rm_v1);
+    const uint32_t old_id = parsed_grammar.symbol_ids.at("old");
+    const size_t n_rules_rm_v1 = parsed_grammar.rules.size();
+
+    assert(grammar_parser::parse_update(parsed_grammar, grammar_rm_v2, changed_rules));
+    assert(parsed_grammar.symbol_ids.count("old") == 0);
+    assert(std::find(changed_rules.begin(), changed_rules.end(), old_id) != changed_rules.end());
+    assert(rules_equal(parsed_grammar.rules[old_id], { {LLAMA_GRETYPE_END, 0} }));
+    {
+        const auto parsed_rm_v2 = grammar_parser::parse(grammar_rm_v2);
+        std::map<uint32_t, uint32_t> ids;
+        assert(rules_equivalent(parsed_grammar, parsed_grammar.symbol_ids.at("root"), parsed_rm_v2, parsed_rm_v2.symbol_ids.at("root"), ids));
+        for (const auto & kv : parsed_rm_v2.symbol_ids) {
+            assert(parsed_grammar.symbol_ids.count(kv.first) == 1 || kv.first.find('_') != std::string::npos);
+        }
+        assert(parsed_grammar.symbol_ids.size() == parsed_rm_v2.symbol_ids.size());
+    }
+
+    // a referenced rule that is no longer defined does not keep its previous definition
+    assert(grammar_parser::parse_update(parsed_grammar, "root ::= expr ws\nws ::= [ ]*", changed_rules));
+    {
+        const auto parsed_undef = grammar_parser::parse("root ::= expr ws\nws ::= [ ]*");
+        const uint32_t expr_undef_id = parsed_grammar.symbol_ids.at("expr");
+        assert(parsed_undef.symbol_ids.count("expr") == 1);
+        assert(rules_equal(parsed_grammar.rules[expr_undef_id], { {LLAMA_GRETYPE_END, 0} }));
+        assert(std::find(changed_rules.begin(), changed_rules.end(), expr_undef_id) != changed_rules.end());
+    }
+
+    // the rules of names that keep changing reuse the ids of the dropped ones
+    for (int i = 0; i < 16; i++) {
+        const std::string text = "root ::= r" + std::to_string(i) + " ws\nr" + std::to_string(i) + " ::= [0-9]+\nws ::= [ ]*";
+        assert(grammar_parser::parse_update(parsed_grammar, text.c_str(), changed_rules));
+        const auto parsed_text = grammar_parser::parse(text.c_str());
+        std::map<uint32_t, uint32_t> ids;
+        assert(rules_equivalent(parsed_grammar, parsed_grammar.symbol_ids.at("root"), parsed_text, parsed_text.symbol_ids.at("root"), ids));
+        assert(parsed_grammar.rules.size() <= n_rules_rm_v1);
+    }
+
+    // parse errors clear the state
+    assert(!grammar_parser::parse_update(parsed_grammar, "root ::= (", changed_rules));
+    assert(parsed_grammar.rules.empty());
+
     return 0;
 }
@@ -0,0 +1,172 @@
+#include "ggml.h"
+#include "llama.h"
+#include "common.h"
+
+#include "tiny-model.h"
+
+#ifdef NDEBUG
+#undef NDEBUG
+#endif
+
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+// the same batches are decoded by a context that reuses its graphs and by one that builds them each time, the logits
+// must be the same to the bit: a reused graph only moves its views of the KV cache to the cells of the batch
+struct test_contexts {
+    llama_context * ctx_cached;
+    llama_context * ctx_built;
+    int             n_vocab;
+    int             n_batches;
+
+    void decode(const llama_batch & batch) {
+        GGML_ASSERT(llama_decode(ctx_cached, batch) == 0);
+        GGML_ASSERT(llama_decode(ctx_built,  batch) == 0);
+
+        for (int32_t i = 0; i < batch.n_tokens; ++i) {
+            if (!batch.logits[i]) {
+                continue;
+            }
+            const float * a = llama_get_logits_ith(ctx_cached, i);
+            const float * b = llama_get_logits_ith(ctx_built,  i);
+            if (memcmp(a, b, n_vocab*sizeof(float)) != 0) {
+                fprintf(stderr, "%s: batch %d, token %d: the logits differ\n", __func__, n_batches, i);
+                GGML_ASSERT(false);
+            }
+        }
+        n_batches++;
+    }
+
+    void seq_rm(llama_seq_id seq_id, llama_pos p0, llama_pos p1) {
+        llama_kv_cache_seq_rm(ctx_cached, seq_id, p0, p1);
+        llama_kv_cache_seq_rm(ctx_built,  seq_id, p0, p1);
+    }
+
+    void clear() {
+        llama_kv_cache_clear(ctx_cached);
+        llama_kv_cache_clear(ctx_built);
+    }
+};
+
+static llama_token test_token(llama_pos pos, llama_seq_id seq_id, int n_vocab) {
+    return (pos*7919 + seq_id*104729 + 3) % n_vocab;
+}
+
+// sequences in blocks of 32 cells that drop their last tokens and decode others in their place, as with rejected
+// drafts: the batches of the same shape attend a window of the cache at the base of each block
+static void test_moving_base(test_contexts & tc, llama_batch & batch) {
+    tc.clear();
+
+    const int n_seq = 3;
+
+    for (llama_seq_id s = 0; s < n_seq; ++s) {
+        llama_batch_clear(batch);
+        for (llama_pos pos = 0; pos < 32; ++pos) {
+            llama_batch_add(batch, test_token(pos, s, tc.n_vocab), pos, { s }, pos == 31);
+        }
+        tc.decode(batch);
+    }
+
+    for (int r = 0; r < 8; ++r) {
+        const int n_tokens = r % 2 == 0 ? 8 : 1;
+
+        for (llama_seq_id s = 0; s < n_seq; ++s) {
+            tc.seq_rm(s, 32 - n_tokens, -1);
+
+            llama_batch_clear(batch);
+            for (llama_pos pos = 32 - n_tokens; pos < 32; ++pos) {
+                llama_batch_add(batch, test_token(pos + r, s, tc.n_vocab), pos, { s }, r % 4 == 0 || pos % 2 == 1);
+            }
+            tc.decode(batch);
+        }
+    }
+
+    printf("%s: %d batches OK\n", __func__, tc.n_batches);
+}
+
+// batches stored over the single free cells left between the cells of other sequences: the batches of the same
+// shape store their KV in several runs, at other cells each time
+static void test_fragmented(test_contexts & tc, llama_batch & batch, int n_ctx) {
+    tc.clear();
+
+    // sequences 1 and 2 interleaved in the first half of the cache, 3 and 4 in the second half
+    for (llama_seq_id s : { 1, 3 }) {
+        llama_batch_clear(batch);
+        for (int i = 0; i < n_ctx/2; ++i) {
+            const llama_seq_id seq_id = s + i % 2;
+            llama_batch_add(batch, test_token(i/2, seq_id, tc.n_vocab), i/2, { seq_id }, i >= n_ctx/2 - 2);
+        }
+        tc.decode(batch);
+    }
+
+    tc.seq_rm(2, -1, -1);
+    tc.seq_rm(4, -1, -1);
+
+    // 4 tokens of each sequence at a time, with the outputs of some of them
+    llama_pos pos[2] = { n_ctx/4, n_ctx/4 };
+    for (int i = 0; i < 2*n_ctx/4/4; ++i) {
+        const llama_seq_id seq_id = i % 4 < 2 ? 1 : 3;
+        llama_pos & p = pos[seq_id == 1 ? 0 : 1];
+
+        llama_batch_clear(batch);
+        for (int j = 0; j < 4; ++j) {
+            llama_batch_add(batch, test_token(p, seq_id, tc.n_vocab), p, { seq_id }, j % 2 == 1);
+            p++;
+        }
+        tc.decode(batch);
+    }
+
+    printf("%s: %d batches OK\n", __func__, tc.n_batches);
+}
+
+int main(int argc, char ** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <vocab-file>\n", argv[0]);
+        return 1;
+    }
+
+    const char * fname_model = "test-graph-cache-model.gguf";
+    if (!tiny_model_write(argv[1], fname_model, 2)) {
+        return 1;
+    }
+
+    llama_backend_init(false);
+
+    llama_model * model = llama_load_model_from_file(fname_model, llama_model_default_params());
+    GGML_ASSERT(model != nullptr);
+
+    const int n_ctx = 128;
+
+    llama_context_params cparams = llama_context_default_params();
+    cparams.n_ctx           = n_ctx;
+    cparams.n_batch         = 64;
+    cparams.n_threads       = 1;
+    cparams.n_threads_batch = 1;
+
+    cparams.n_graph_cache = 4;
+    llama_context * ctx_cached = llama_new_context_with_model(model, cparams);
+    cparams.n_graph_cache = 0;
+    llama_context * ctx_built  = llama_new_context_with_model(model, cparams);
+    GGML_ASSERT(ctx_cached != nullptr && ctx_built != nullptr);
+
+    test_contexts tc = { ctx_cached, ctx_built, llama_n_vocab(model), 0 };
+
+    llama_batch batch = llama_batch_init(64, 0, 1);
+
+    test_moving_base(tc, batch);
+    test_fragmented(tc, batch, n_ctx);
+
+    llama_batch_free(batch);
+    llama_free(ctx_built);
+    llama_free(ctx_cached);
+    llama_free_model(model);
+
+    llama_backend_free();
+
+    remove(fname_model);
+
+    printf("OK\n");
+
+    return 0;
+}
@@ -168,8 +168,9 @@ int main()
         }};
 
     auto index = 0;
-    for (auto stack : grammar->stacks)
+    for (auto stack_id : grammar->stacks)
     {
+        auto stack = grammar->pool.get(stack_id);
         // compare stack to expected_stack
         for (uint32_t i = 0; i < stack.size(); i++)
         {
@@ -190,7 +191,6 @@ int main()
         index++;
     }
 
-    std::vector<std::vector<const llama_grammar_element *>> next_stacks;
     std::vector<llama_grammar_candidate> next_candidates;
     next_candidates.resize(24);
 
@@ -371,13 +371,13 @@ int main()
         },
     };
 
-    std::vector<llama_grammar_candidate> rejects = llama_grammar_reject_candidates_for_stack(grammar->rules, grammar->stacks[0], next_candidates);
+    std::vector<llama_grammar_candidate> rejects = llama_grammar_reject_candidates_for_stack(grammar->rules, grammar->pool, grammar->stacks[0], next_candidates);
 
     std::vector<std::vector<llama_grammar_candidate>> all_rejects;
 
     for (std::size_t count = 0; count < grammar->stacks.size(); ++count)
     {
-        rejects = llama_grammar_reject_candidates_for_stack(grammar->rules, grammar->stacks[count], next_candidates);
+        rejects = llama_grammar_reject_candidates_for_stack(grammar->rules, grammar->pool, grammar->stacks[count], next_candidates);
         all_rejects.push_back(rejects);
     }
 
@@ -398,6 +398,179 @@ int main()
         delete[] candidate.code_points;
         candidate.code_points = nullptr;
     }
+    // the trie walk accepts exactly the pieces not rejected by any stack
+    std::vector<std::string> pieces = {
+        "a", "ab", "abc", "a1", "a=", "a = 1\n", "1", "12", "1+", "=", " ", "\n", "+", "+x", "(", "((a", ")", "-",
+        "", std::string("\0x", 2), std::string("a\0b", 3), "\xc3\xa9", "\xc3", "\xe2\x82", "\x80", "a\xc3",
+    };
+    llama_token_trie trie;
+    trie.build(pieces);
+
+    // with and without a partial sequence pending from the previous token
+    const llama_partial_utf8 partial_starts[] = { { 0, 0 }, { 3, 1 }, { 2, 2 }, { 0, -1 } };
+    for (const auto & partial_start : partial_starts) {
+        std::vector<uint64_t> allowed;
+        llama_grammar_accept_trie(grammar->rules, grammar->pool, grammar->stacks, partial_start, trie, allowed);
+        auto accepted = [&](size_t i) { return ((allowed[i >> 6] >> (i & 63)) & 1) != 0; };
+
+        std::vector<std::pair<std::vector<uint32_t>, llama_partial_utf8>> pieces_decoded;
+        std::vector<llama_grammar_candidate> pieces_grammar;
+        pieces_decoded.reserve(pieces.size());
+        for (size_t i = 0; i < pieces.size(); i++) {
+            if (!pieces[i].empty() && pieces[i][0] != 0) {
+                assert(trie.token_node[i] != 0);
+                pieces_decoded.push_back(decode_utf8(pieces[i].c_str(), pieces[i].size(), partial_start));
+                pieces_grammar.push_back({ i, pieces_decoded.back().first.data(), pieces_decoded.back().second });
+            } else {
+                assert(trie.token_node[i] == 0 && !accepted(i));
+            }
+        }
+        std::vector<bool> expected_accepted(pieces.size(), false);
+        for (const auto & tok : pieces_grammar) {
+            expected_accepted[tok.index] = true;
+        }
+        for (const auto & tok : llama_grammar_reject_candidates(grammar->rules, grammar->pool, grammar->stacks, pieces_grammar)) {
+            expected_accepted[tok.index] = false;
+        }
+        for (size_t i = 0; i < pieces.size(); i++) {
+            if (accepted(i) != expected_accepted[i]) {
+                fprintf(stderr, "partial %d, piece %zu: trie accepted %d, expected %d\n",
+                        partial_start.n_remain, i, (int) accepted(i), (int) expected_accepted[i]);
+            }
+            assert(accepted(i) == expected_accepted[i]);
+        }
+        if (partial_start.n_remain <= 0) {
+            assert(accepted(0) && accepted(20) && !accepted(24));
+        }
+    }
+
+    // copies point into their own rules
+    llama_grammar * grammar_copy = llama_grammar_copy(grammar);
+    assert(grammar_copy->stacks.size() == grammar->stacks.size());
+    for (size_t is = 0; is < grammar->stacks.size(); is++) {
+        const auto stack      = grammar->pool.get(grammar->stacks[is]);
+        const auto stack_copy = grammar_copy->pool.get(grammar_copy->stacks[is]);
+        assert(stack_copy.size() == stack.size());
+        for (size_t ie = 0; ie < stack.size(); ie++) {
+            const llama_grammar_element * elem = stack_copy[ie];
+            assert(elem != stack[ie]);
+            assert(elem->type == stack[ie]->type && elem->value == stack[ie]->value);
+            bool found = false;
+            for (const auto & rule : grammar_copy->rules) {
+                found = found || (rule.data() <= elem && elem < rule.data() + rule.size());
+            }
+            assert(found);
+        }
+    }
+
+    // the mask cache is keyed by the positions in the rules, so copies share it along with their keys
+    llama_grammar_set_mask_cache(grammar, 4);
+    grammar_copy->mask_cache = grammar->mask_cache;
+    assert(llama_grammar_mask_key(grammar_copy) == llama_grammar_mask_key(grammar));
+    llama_grammar * grammar_copy2 = llama_grammar_copy(grammar);
+    assert(grammar_copy2->mask_cache == grammar->mask_cache);
+    grammar_copy2->stacks.pop_back();
+    assert(llama_grammar_mask_key(grammar_copy2) != llama_grammar_mask_key(grammar));
+    llama_grammar_free(grammar_copy2);
+
+    // the partial UTF-8 sequence is copied on its own, or reset
+    grammar->partial_utf8 = { 3, 1 };
+    llama_grammar_copy_partial_utf8(grammar_copy, grammar);
+    assert(grammar_copy->partial_utf8.value == 3 && grammar_copy->partial_utf8.n_remain == 1);
+    llama_grammar_copy_partial_utf8(grammar_copy, NULL);
+    assert(grammar_copy->partial_utf8.value == 0 && grammar_copy->partial_utf8.n_remain == 0);
+    grammar->partial_utf8 = { 0, 0 };
+    llama_grammar_free(grammar_copy);
+
+    // update ident ::= [a-z] ident_10 ws to [x-y] ident_10 ws and re-derive the stacks from root
+    parsed_grammar.rules[8][0].value = 'x';
+    parsed_grammar.rules[8][1].value = 'y';
+    grammar_rules = parsed_grammar.c_rules();
+    const uint32_t changed_ident[] = { 8 };
+    llama_grammar_update_rules(grammar, grammar_rules.data(), grammar_rules.size(), changed_ident, 1, parsed_grammar.symbol_ids.at("root"));
+
+    assert(grammar->stacks.size() == expected_stacks.size());
+    for (size_t is = 0; is < grammar->stacks.size(); is++) {
+        const auto stack = grammar->pool.get(grammar->stacks[is]);
+        assert(stack.size() == expected_stacks[is].size());
+        for (size_t ie = 0; ie < stack.size(); ie++) {
+            uint32_t expected_value = expected_stacks[is][ie].value;
+            if (ie == stack.size() - 1 && expected_value == 97) {
+                expected_value = 'x';
+            }
+            assert(stack[ie]->type == expected_stacks[is][ie].type && stack[ie]->value == expected_value);
+        }
+    }
+    // changing the rules starts a new mask cache
+    assert(grammar->mask_cache && grammar->mask_cache->n_max == 4 && grammar->mask_cache->entries.empty());
+    // unchanged rules are not copied
+    assert(grammar->rules[11].data() != nullptr && grammar->rules[8][0].value == 'x');
+
+    // keep the stacks, dropping the ones positioned inside the changed num_11 rule
+    const uint32_t changed_num[] = { 11 };
+    llama_grammar_update_rules(grammar, grammar_rules.data(), grammar_rules.size(), changed_num, 1, -1);
+    assert(grammar->stacks.size() == 4);
+    for (const auto stack : grammar->stacks) {
+        assert(grammar->pool.nodes[stack].elem->value != 48);
+    }
+
     delete grammar;
+
+    // identical stacks are merged and stacks share their common tails
+    {
+        grammar_parser::parse_state parsed = grammar_parser::parse("root ::= x | x | x y\nx ::= \"a\" | \"a\"\ny ::= \"b\"\n");
+        std::vector<const llama_grammar_element *> rules = parsed.c_rules();
+        llama_grammar * g = llama_grammar_init(rules.data(), rules.size(), parsed.symbol_ids.at("root"));
+
+        // the second x adds no stacks, the x of x y shares the node of y
+        assert(g->stacks.size() == 4);
+        assert(g->pool.nodes[g->stacks[0]].below == 0 && g->pool.nodes[g->stacks[1]].below == 0);
+        assert(g->pool.nodes[g->stacks[2]].below != 0 && g->pool.nodes[g->stacks[2]].below == g->pool.nodes[g->stacks[3]].below);
+
+        // both definitions of x end in the same stacks
+        const auto stacks = llama_grammar_accept(g->rules, g->pool, g->stacks, 'a');
+        assert(stacks.size() == 2 && stacks[0] == 0);
+        assert(g->pool.nodes[stacks[1]].depth == 1 && g->pool.nodes[stacks[1]].elem->value == 'b');
+
+        llama_grammar_free(g);
+    }
+
+    // first bytes of the UTF-8 sequences accepted by a char range
+    {
+        grammar_parser::parse_state parsed = grammar_parser::parse("root ::= [a-c\\u00e9] [^\\u0000-\\u007f\\u0080-\\u07ff]\n");
+        std::vector<const llama_grammar_element *> rules = parsed.c_rules();
+        llama_grammar * g = llama_grammar_init(rules.data(), rules.size(), parsed.symbol_ids.at("root"));
+
+        const auto & first = llama_grammar_first_bytes(g->pool, g->pool.nodes[g->stacks[0]].elem);
+        // decode_utf8 accepts overlong sequences, so 0xc1, 0xe0 and 0xf0 can start 'a' as well
+        assert(first.count() == 7 && first['a'] && first['c'] && first[0xc1] && first[0xc3] && first[0xe0] && first[0xf0]);
+
+        const auto & next = llama_grammar_first_bytes(g->pool, g->pool.nodes[llama_grammar_accept(g->rules, g->pool, g->stacks, 'a')[0]].elem);
+        assert(!next['a'] && !next[0xc3] && !next[0xdf] && !next[0x80] && next[0xe0] && next[0xf4]);
+
+        llama_grammar_free(g);
+    }
+
+    // text forced by the grammar, up to a choice or a possible end
+    {
+        grammar_parser::parse_state parsed = grammar_parser::parse("root ::= \"let\" ws [a-z]+ ws \"in\" (\"\\u00e9\" | \"\\u00e9\") ws? \"end\"\nws ::= \" \"\n");
+        std::vector<const llama_grammar_element *> rules = parsed.c_rules();
+        llama_grammar * g = llama_grammar_init(rules.data(), rules.size(), parsed.symbol_ids.at("root"));
+
+        assert(llama_grammar_forced_text(g, 64) == "let ");
+        assert(llama_grammar_forced_text(g, 2) == "le");
+
+        for (const char * s = "let x "; *s; s++) {
+            g->stacks = llama_grammar_accept(g->rules, g->pool, g->stacks, *s);
+        }
+        // the same char on every stack is forced, the optional ws is a choice
+        assert(llama_grammar_forced_text(g, 64) == "in\xc3\xa9");
+
+        g->partial_utf8 = { 3, 1 };
+        assert(llama_grammar_forced_text(g, 64).empty());
+
+        llama_grammar_free(g);
+    }
+
     return 0;
 }
@@ -214,6 +214,47 @@ int main(int /*argc*/, const char ** /*argv*/) {
         }
     }
 
+    // rope with the sin/cos cache must give the same results as rope
+    for (int m = 0; m < 2; ++m) {
+        const int ndims = 4;
+
+        const int64_t n_rot = 128;
+        const int64_t ne[4] = { n_rot, 32, 73, 1 };
+
+        struct ggml_tensor * p = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, ne[2]);
+
+        for (int i = 0; i < ne[2]; ++i) {
+            ((int32_t *) p->data)[i] = 100 + 7*i;
+        }
+
+        // test mode 0, 2 (standard, GPT-NeoX) with YaRN
+        const int mode = m == 0 ? 0 : 2;
+
+        x = get_random_tensor_f32(ctx0, ndims, ne, -1.0f, 1.0f);
+
+        struct ggml_tensor * c  = ggml_rope_cache(ctx0, p, n_rot, mode, 4096, 10000.0f, 0.25f, 1.0f, 1.0f, 32.0f, 1.0f);
+        struct ggml_tensor * r0 = ggml_rope_custom(ctx0, x, p, n_rot, mode, 0, 4096, 10000.0f, 0.25f, 1.0f, 1.0f, 32.0f, 1.0f);
+        struct ggml_tensor * r1 = ggml_rope_custom_cached(ctx0, x, p, c, n_rot, mode, 0, 4096, 10000.0f, 0.25f, 1.0f, 1.0f, 32.0f, 1.0f);
+
+        ggml_cgraph * gf = ggml_new_graph(ctx0);
+
+        ggml_build_forward_expand(gf, r0);
+        ggml_build_forward_expand(gf, r1);
+
+        ggml_graph_compute_helper(work_buffer, gf, 4);
+
+        const int n_elements = ggml_nelements(r0);
+
+        int n_diff = 0;
+        for (int i = 0; i < n_elements; ++i) {
+            n_diff += ((float *) r0->data)[i] != ((float *) r1->data)[i];
+        }
+
+        printf("mode: %d, cached: %d elements differ\n", mode, n_diff);
+
+        GGML_ASSERT(n_diff == 0);
+    }
+
     ggml_free(ctx0);
 
     return 0;
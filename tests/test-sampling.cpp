@@ -1,11 +1,15 @@
 #include "ggml.h"
 #include "llama.h"
+#include "common.h"
+
+#include "tiny-model.h"
 
 #ifdef NDEBUG
 #undef NDEBUG
 #endif
 
 #include <cmath>
+#include <cstdio>
 #include <numeric>
 #include <cassert>
 #include <vector>
@@ -126,9 +130,205 @@ static void test_repetition_penalties(
     for (size_t i = 0; i < candidates_p.size; i++) {
         GGML_ASSERT(fabs(candidates_p.data[i].p - expected_probs[i]) < 1e-3);
     }
+
+    // same penalties with the tokens counted beforehand, on candidates in the order of their ids and sorted by probability
+    std::vector<llama_token> tokens;
+    std::vector<int32_t>     counts;
+    for (const llama_token id : last_tokens) {
+        const auto it = std::find(tokens.begin(), tokens.end(), id);
+        if (it == tokens.end()) {
+            tokens.push_back(id);
+            counts.push_back(1);
+        } else {
+            counts[it - tokens.begin()]++;
+        }
+    }
+
+    for (int sorted = 0; sorted < 2; sorted++) {
+        candidates.clear();
+        for (llama_token token_id = 0; token_id < (llama_token)n_vocab; token_id++) {
+            float logit = log(probs[token_id]);
+            candidates.emplace_back(llama_token_data{token_id, logit, 0.0f});
+        }
+
+        candidates_p = { candidates.data(), candidates.size(), false };
+        if (sorted) {
+            llama_sample_softmax(nullptr, &candidates_p);
+        }
+        llama_sample_repetition_penalties_counted(nullptr, &candidates_p, tokens.data(), counts.data(), tokens.size(), repeat_penalty, alpha_frequency, alpha_presence);
+        llama_sample_softmax(nullptr, &candidates_p);
+        DUMP(&candidates_p);
+
+        GGML_ASSERT(candidates_p.size == expected_probs.size());
+        for (size_t i = 0; i < candidates_p.size; i++) {
+            GGML_ASSERT(fabs(candidates_p.data[i].p - expected_probs[i]) < 1e-3);
+        }
+    }
 }
 
-int main(void) {
+// the samplers on many unsorted candidates select the ones they keep instead of sorting all of them, the result must
+// be the same as on the sorted candidates
+static void test_select(size_t n_vocab, int k, float top_p, float min_p) {
+    std::vector<llama_token_data> candidates;
+    std::vector<llama_token_data> candidates_sorted;
+
+    // distinct logits in a shuffled order, as the order of the candidates with the same logit is not specified
+    std::vector<float> logits(n_vocab);
+    for (size_t i = 0; i < n_vocab; i++) {
+        logits[i] = 8.0f*i/n_vocab - 4.0f;
+    }
+    uint32_t seed = 1234;
+    for (size_t i = n_vocab - 1; i > 0; i--) {
+        seed = seed*1664525u + 1013904223u;
+        std::swap(logits[i], logits[seed % (i + 1)]);
+    }
+
+    for (llama_token token_id = 0; token_id < (llama_token)n_vocab; token_id++) {
+        candidates.emplace_back(llama_token_data{token_id, logits[token_id], 0.0f});
+    }
+    candidates_sorted = candidates;
+
+    llama_token_data_array candidates_p        = { candidates.data(),        candidates.size(),        false };
+    llama_token_data_array candidates_sorted_p = { candidates_sorted.data(), candidates_sorted.size(), false };
+    llama_sample_softmax(nullptr, &candidates_sorted_p);
+
+    if (k > 0) {
+        llama_sample_top_k(nullptr, &candidates_p,        k, 1);
+        llama_sample_top_k(nullptr, &candidates_sorted_p, k, 1);
+        llama_sample_softmax(nullptr, &candidates_p);
+        llama_sample_softmax(nullptr, &candidates_sorted_p);
+    }
+    if (top_p > 0.0f) {
+        llama_sample_top_p(nullptr, &candidates_p,        top_p, 1);
+        llama_sample_top_p(nullptr, &candidates_sorted_p, top_p, 1);
+    }
+    if (min_p > 0.0f) {
+        llama_sample_min_p(nullptr, &candidates_p,        min_p, 1);
+        llama_sample_min_p(nullptr, &candidates_sorted_p, min_p, 1);
+    }
+    printf("%s: n_vocab = %zu, k = %d, top_p = %.2f, min_p = %.2f: %zu candidates\n", __func__, n_vocab, k, top_p, min_p, candidates_p.size);
+
+    GGML_ASSERT(candidates_p.sorted);
+    GGML_ASSERT(candidates_p.size == candidates_sorted_p.size);
+    for (size_t i = 0; i < candidates_p.size; i++) {
+        GGML_ASSERT(candidates_p.data[i].id == candidates_sorted_p.data[i].id);
+        GGML_ASSERT(fabs(candidates_p.data[i].p - candidates_sorted_p.data[i].p) < 1e-6);
+    }
+}
+
+// the top-k tokens of a row of logits as llama_top_k_from_logits computes them when the backend cannot in the graph
+static std::vector<llama_token_data> top_k_ref(const float * logits, int n_vocab, int n_top_k, float temp, const std::vector<float> & bias) {
+    const float scale = temp > 0.0f ? 1.0f/temp : 1.0f;
+
+    std::vector<llama_token_data> cur(n_vocab);
+
+    float max_l = -INFINITY;
+    for (llama_token id = 0; id < n_vocab; ++id) {
+        const float l = logits[id]*scale + (bias.empty() ? 0.0f : bias[id]);
+        cur[id] = { id, l, 0.0f };
+        max_l = std::max(max_l, l);
+    }
+
+    double sum = 0.0;
+    for (const auto & c : cur) {
+        sum += expf(c.logit - max_l);
+    }
+
+    std::partial_sort(cur.begin(), cur.begin() + n_top_k, cur.end(), [](const llama_token_data & a, const llama_token_data & b) {
+        return a.logit > b.logit;
+    });
+
+    cur.resize(n_top_k);
+    for (auto & c : cur) {
+        c.p     = expf(c.logit - max_l) / sum;
+        c.logit = logf(c.p);
+    }
+
+    return cur;
+}
+
+// the top-k tokens computed in the graph (build_top_k) must be those of the logits of the same batch, also when only
+// some tokens of the batch have outputs
+static void test_top_k_graph(const char * fname_vocab) {
+    const char * fname_model = "test-sampling-model.gguf";
+    if (!tiny_model_write(fname_vocab, fname_model, 2)) {
+        GGML_ASSERT(false);
+    }
+
+    llama_model * model = llama_load_model_from_file(fname_model, llama_model_default_params());
+    GGML_ASSERT(model != nullptr);
+
+    const int n_vocab = llama_n_vocab(model);
+    const int n_top_k = 40;
+
+    llama_context_params cparams = llama_context_default_params();
+    cparams.n_ctx           = 64;
+    cparams.n_batch         = 64;
+    cparams.n_threads       = 1;
+    cparams.n_threads_batch = 1;
+
+    llama_context * ctx_logits = llama_new_context_with_model(model, cparams);
+    cparams.n_top_k = n_top_k;
+    llama_context * ctx_top_k  = llama_new_context_with_model(model, cparams);
+    GGML_ASSERT(ctx_logits != nullptr && ctx_top_k != nullptr);
+
+    // a few tokens biased into the top-k
+    const float temp = 0.7f;
+    std::vector<float> bias(n_vocab, 0.0f);
+    for (int i = 0; i < 8; ++i) {
+        bias[(i*3571 + 17) % n_vocab] = i % 2 ? 20.0f : -1.0f;
+    }
+    llama_set_top_k_params(ctx_top_k, temp, bias.data());
+
+    // the outputs of each batch: some tokens, a single token, all of them
+    const std::vector<std::vector<bool>> batches = {
+        { false, false, true, false, false, true, false, true },
+        { true },
+        { true, true, true, true },
+    };
+
+    llama_batch batch = llama_batch_init(64, 0, 1);
+
+    llama_pos pos = 0;
+    for (const auto & outputs : batches) {
+        llama_batch_clear(batch);
+        for (size_t i = 0; i < outputs.size(); ++i) {
+            llama_batch_add(batch, (pos*7919 + 3) % n_vocab, pos, { 0 }, outputs[i]);
+            pos++;
+        }
+
+        GGML_ASSERT(llama_decode(ctx_logits, batch) == 0);
+        GGML_ASSERT(llama_decode(ctx_top_k,  batch) == 0);
+
+        for (size_t i = 0; i < outputs.size(); ++i) {
+            if (!outputs[i]) {
+                continue;
+            }
+
+            const auto ref = top_k_ref(llama_get_logits_ith(ctx_logits, i), n_vocab, n_top_k, temp, bias);
+            const llama_token_data * cur = llama_get_top_k_ith(ctx_top_k, i);
+
+            for (int k = 0; k < n_top_k; ++k) {
+                // the softmax of the graph takes the exponentials from a table of half precision, and tokens of
+                // nearly the same probability may be in either order
+                const float eps = 2e-3f*ref[k].p + 1e-6f;
+                GGML_ASSERT(cur[k].id == ref[k].id || fabs(cur[k].p - ref[k].p) < eps);
+                GGML_ASSERT(fabs(cur[k].p - ref[k].p) < eps);
+                GGML_ASSERT(k == 0 || cur[k].p <= cur[k - 1].p);
+            }
+        }
+        printf("%s: %zu tokens, %zu outputs: OK\n", __func__, outputs.size(), (size_t) std::count(outputs.begin(), outputs.end(), true));
+    }
+
+    llama_batch_free(batch);
+    llama_free(ctx_top_k);
+    llama_free(ctx_logits);
+    llama_free_model(model);
+
+    remove(fname_model);
+}
+
+int main(int argc, char ** argv) {
     ggml_time_init();
 
     test_top_k({0.1f, 0.2f, 0.3f, 0.4f}, {0.4f}, 1);
@@ -154,6 +354,22 @@ int main(void) {
     test_repetition_penalties({0.2f, 0.2f, 0.2f, 0.2f, 0.2f}, {0, 1, 2},       {0.499966f, 0.499966f, 0.000023f, 0.000023f, 0.000023f}, 1.0f, 5.0f, 5.0f);
     test_repetition_penalties({0.2f, 0.2f, 0.2f, 0.2f, 0.2f}, {0, 1, 2, 0, 0}, {0.499977f, 0.499977f, 0.000023f, 0.000023f, 0.000000f}, 1.0f, 5.0f, 5.0f);
 
+    test_select(32000, 40, 0.0f,  0.0f);
+    test_select(32000, 2000, 0.0f, 0.0f);
+    test_select(32000, 2000, 0.5f, 0.1f);
+    test_select(32000, 0,  0.95f, 0.0f);
+    test_select(32000, 0,  0.05f, 0.0f);
+    test_select(32000, 0,  0.0f,  0.05f);
+    test_select(32000, 0,  0.0f,  0.95f);
+    test_select(5000,  0,  0.99f, 0.0f);
+
+    // the graph top-k needs a model, of the vocabulary given
+    if (argc > 1) {
+        llama_backend_init(false);
+        test_top_k_graph(argv[1]);
+        llama_backend_free();
+    }
+
     printf("OK\n");
 
     return 0;
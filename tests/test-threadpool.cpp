@@ -0,0 +1,122 @@
+#include "ggml.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#if defined(_MSC_VER)
+#pragma warning(disable: 4244 4267) // possible loss of data
+#endif
+
+static float frand(void) {
+    return (float)rand()/(float)RAND_MAX*2.0f - 1.0f;
+}
+
+static void set_random(struct ggml_tensor * t) {
+    for (int64_t i = 0; i < ggml_nelements(t); ++i) {
+        ggml_set_f32_1d(t, i, frand());
+    }
+}
+
+// a small graph of a few nodes of the shapes of the graph i, some with fewer rows than threads
+static struct ggml_tensor * build_graph(struct ggml_context * ctx, struct ggml_cgraph * gf, int i) {
+    const int k = 32 + 16*(i % 5);
+    const int m = 1  + i % 7;
+    const int n = 1  + i % 3;
+
+    struct ggml_tensor * a = ggml_new_tensor_2d(ctx, i % 2 ? GGML_TYPE_F16 : GGML_TYPE_F32, k, m);
+    struct ggml_tensor * b = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, k, n);
+    struct ggml_tensor * c = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, m, n);
+    set_random(a);
+    set_random(b);
+    set_random(c);
+
+    struct ggml_tensor * cur = ggml_mul_mat(ctx, a, b);
+    cur = ggml_add(ctx, cur, c);
+    cur = ggml_soft_max(ctx, cur);
+    cur = ggml_scale(ctx, cur, ggml_new_f32(ctx, 2.0f));
+
+    ggml_build_forward_expand(gf, cur);
+
+    return cur;
+}
+
+static void graph_compute(std::vector<uint8_t> & buf, struct ggml_cgraph * gf, int n_threads, struct ggml_threadpool * threadpool) {
+    struct ggml_cplan plan = ggml_graph_plan(gf, n_threads);
+    plan.threadpool = threadpool;
+
+    if (plan.work_size > 0) {
+        buf.resize(plan.work_size);
+        plan.work_data = buf.data();
+    }
+
+    GGML_ASSERT(ggml_graph_compute(gf, &plan) == GGML_EXIT_SUCCESS);
+}
+
+// n_graphs graphs computed by the threads of the pool, with a number of threads that changes from a graph to the next,
+// up to more than the pool has: the results must be those computed by a single thread
+static void test_graphs(struct ggml_threadpool * threadpool, int n_graphs, int seed) {
+    srand(seed);
+
+    struct ggml_init_params params = {
+        /* .mem_size   = */ 1024*1024,
+        /* .mem_buffer = */ NULL,
+        /* .no_alloc   = */ false,
+    };
+
+    std::vector<uint8_t> buf;
+    std::vector<float> expected;
+
+    const int n_pool = ggml_threadpool_n_threads(threadpool);
+
+    for (int i = 0; i < n_graphs; ++i) {
+        struct ggml_context * ctx = ggml_init(params);
+        struct ggml_cgraph  * gf  = ggml_new_graph(ctx);
+
+        struct ggml_tensor * out = build_graph(ctx, gf, i);
+
+        graph_compute(buf, gf, 1, NULL);
+        expected.assign((float *) out->data, (float *) out->data + ggml_nelements(out));
+        memset(out->data, 0, ggml_nbytes(out));
+
+        const int n_threads = 1 + (i*7 + seed) % (n_pool + 2);
+        graph_compute(buf, gf, n_threads, threadpool);
+
+        if (memcmp(out->data, expected.data(), ggml_nbytes(out)) != 0) {
+            fprintf(stderr, "%s: graph %d, n_threads = %d: the result differs\n", __func__, i, n_threads);
+            GGML_ASSERT(false);
+        }
+
+        ggml_free(ctx);
+    }
+}
+
+int main(int /*argc*/, const char ** /*argv*/) {
+    const int n_graphs = 1000;
+
+    for (int n_spin : { 4096, 0 }) {
+        struct ggml_threadpool_params tparams = ggml_threadpool_default_params(4);
+        tparams.n_spin = n_spin;
+
+        struct ggml_threadpool * threadpool = ggml_threadpool_new(tparams);
+
+        test_graphs(threadpool, n_graphs, 0);
+        printf("n_spin = %4d: %d graphs OK\n", n_spin, n_graphs);
+
+        // a pool computes the graphs of its users one at a time
+        std::vector<std::thread> users;
+        for (int j = 0; j < 3; ++j) {
+            users.emplace_back(test_graphs, threadpool, n_graphs/4, j + 1);
+        }
+        for (auto & t : users) {
+            t.join();
+        }
+        printf("n_spin = %4d: %zu users of %d graphs OK\n", n_spin, users.size(), n_graphs/4);
+
+        ggml_threadpool_free(threadpool);
+    }
+
+    return 0;
+}
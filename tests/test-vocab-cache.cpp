@@ -0,0 +1,170 @@
+#include "llama.h"
+
+#ifdef NDEBUG
+#undef NDEBUG
+#endif
+
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// a model loaded with the tokenizer index taken from MODEL.vocab-cache must tokenize like one that builds the index:
+// when the file is written, when it is mapped, and when it is damaged and has to be built and written again
+
+static const char * test_texts[] = {
+    "",
+    " ",
+    "Hello world",
+    " Hello world",
+    "Hello World!",
+    "   this is 🦙.cpp",
+    "w048 7tuijk dsdfhu",
+    "нещо на Български",
+    "កាន់តែពិសេសអាចខលចេញ",
+    "🚀 (normal) 😶‍🌫️ (multiple emojis concatenated) ✅ (only emoji that has its own token)",
+    "\n\n\t  \n 3333333 <s></s><|endoftext|>",
+};
+
+static std::vector<std::vector<llama_token>> tokenize_all(const llama_model * model) {
+    std::vector<std::vector<llama_token>> result;
+
+    std::vector<std::string> texts(std::begin(test_texts), std::end(test_texts));
+
+    const int n_vocab = llama_n_vocab(model);
+    for (llama_token id = 0; id < n_vocab; ++id) {
+        int32_t len = 0;
+        const char * piece = llama_token_get_piece_view(model, id, &len);
+        texts.push_back(std::string(piece, len));
+
+        std::vector<llama_token> prefixes(64);
+        int32_t n_prefixes = llama_token_prefixes(model, id, prefixes.data(), prefixes.size());
+        if (n_prefixes < 0) {
+            prefixes.resize(-n_prefixes);
+            n_prefixes = llama_token_prefixes(model, id, prefixes.data(), prefixes.size());
+        }
+        prefixes.resize(n_prefixes);
+        result.push_back(prefixes);
+    }
+
+    for (const std::string & text : texts) {
+        for (int special = 0; special < 2; ++special) {
+            std::vector<llama_token> tokens(text.size() + 2);
+            try {
+                const int n_tokens = llama_tokenize(model, text.c_str(), text.size(), tokens.data(), tokens.size(), true, special);
+                assert(n_tokens >= 0);
+                tokens.resize(n_tokens);
+            } catch (const std::invalid_argument &) {
+                // the BPE tokenizer rejects the pieces that are not valid UTF-8
+                tokens.clear();
+            }
+            result.push_back(tokens);
+        }
+    }
+
+    return result;
+}
+
+static llama_model * load_model(const std::string & fname, bool vocab_cache) {
+    llama_model_params mparams = llama_model_default_params();
+    mparams.vocab_only  = true;
+    mparams.vocab_cache = vocab_cache;
+
+    llama_model * model = llama_load_model_from_file(fname.c_str(), mparams);
+    assert(model != NULL);
+    return model;
+}
+
+static size_t file_size(const std::string & fname) {
+    std::ifstream file(fname, std::ios::binary | std::ios::ate);
+    return file ? (size_t) file.tellg() : 0;
+}
+
+static void check_load(const std::string & fname, const std::vector<std::vector<llama_token>> & expected, const char * what) {
+    llama_model * model = load_model(fname, true);
+    const bool same = tokenize_all(model) == expected;
+    llama_free_model(model);
+
+    fprintf(stderr, "%s: %s: %s\n", __func__, what, same ? "ok" : "different tokens");
+    assert(same);
+    assert(file_size(fname + ".vocab-cache") > 0);
+}
+
+int main(int argc, char ** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <vocab-file>\n", argv[0]);
+        return 1;
+    }
+
+    // the cache is written next to the model, so the test works on a copy in the current directory
+    std::string fname = argv[1];
+    fname = "test-vocab-cache-" + fname.substr(fname.find_last_of("/\\") + 1);
+    const std::string fname_cache = fname + ".vocab-cache";
+    {
+        std::ifstream src(argv[1], std::ios::binary);
+        std::ofstream dst(fname, std::ios::binary);
+        assert(src && dst);
+        dst << src.rdbuf();
+    }
+    std::remove(fname_cache.c_str());
+
+    llama_backend_init(false);
+
+    std::vector<std::vector<llama_token>> expected;
+    {
+        llama_model * model = load_model(fname, false);
+        expected = tokenize_all(model);
+        llama_free_model(model);
+    }
+    assert(file_size(fname_cache) == 0);
+
+    check_load(fname, expected, "cache written");
+    check_load(fname, expected, "cache mapped");
+
+    // a truncated file
+    {
+        const size_t size = file_size(fname_cache);
+        std::vector<char> data(size);
+        std::ifstream(fname_cache, std::ios::binary).read(data.data(), size);
+        std::ofstream(fname_cache, std::ios::binary | std::ios::trunc).write(data.data(), size/2);
+    }
+    check_load(fname, expected, "truncated cache rebuilt");
+
+    // a file with damaged sections, every 4096th byte is flipped past the header
+    {
+        const size_t size = file_size(fname_cache);
+        std::vector<char> data(size);
+        std::ifstream(fname_cache, std::ios::binary).read(data.data(), size);
+        for (size_t i = 64; i < size; i += 4096) {
+            data[i] = ~data[i];
+        }
+        std::ofstream(fname_cache, std::ios::binary | std::ios::trunc).write(data.data(), size);
+    }
+    {
+        // a damaged section may still look consistent, only the loads after a rebuild are checked against the reference
+        llama_model * model = load_model(fname, true);
+        tokenize_all(model);
+        llama_free_model(model);
+    }
+
+    // a file of another vocab: the key in the header does not match
+    {
+        const size_t size = file_size(fname_cache);
+        std::vector<char> data(size);
+        std::ifstream(fname_cache, std::ios::binary).read(data.data(), size);
+        data[8] = ~data[8];
+        std::ofstream(fname_cache, std::ios::binary | std::ios::trunc).write(data.data(), size);
+    }
+    check_load(fname, expected, "mismatched cache rebuilt");
+    check_load(fname, expected, "cache mapped again");
+
+    llama_backend_free();
+
+    std::remove(fname_cache.c_str());
+    std::remove(fname.c_str());
+
+    return 0;
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+#include "ggml.h"
+
+#include <cstdio>
+#include <random>
+#include <string>
+
+// writes a llama model of random weights small enough to be evaluated in a test, with the vocabulary of a
+// models/ggml-vocab-*.gguf file, returns false if the vocabulary cannot be read
+static bool tiny_model_write(const char * fname_vocab, const char * fname_out, int n_layer) {
+    const int n_embd    = 64;
+    const int n_head    = 4;
+    const int n_head_kv = 2;
+    const int n_ff      = 128;
+
+    struct gguf_init_params vparams = { /*.no_alloc =*/ true, /*.ctx =*/ NULL };
+    struct gguf_context * vocab = gguf_init_from_file(fname_vocab, vparams);
+    if (vocab == NULL) {
+        fprintf(stderr, "%s: failed to read the vocabulary from '%s'\n", __func__, fname_vocab);
+        return false;
+    }
+
+    const int kid = gguf_find_key(vocab, "tokenizer.ggml.tokens");
+    const int n_vocab = kid >= 0 ? gguf_get_arr_n(vocab, kid) : 0;
+
+    struct gguf_context * gctx = gguf_init_empty();
+    gguf_set_kv(gctx, vocab);
+    gguf_free(vocab);
+
+    gguf_set_val_str(gctx, "general.architecture", "llama");
+    gguf_set_val_str(gctx, "general.name", "tiny");
+    gguf_set_val_u32(gctx, "llama.context_length", 512);
+    gguf_set_val_u32(gctx, "llama.embedding_length", n_embd);
+    gguf_set_val_u32(gctx, "llama.block_count", n_layer);
+    gguf_set_val_u32(gctx, "llama.feed_forward_length", n_ff);
+    gguf_set_val_u32(gctx, "llama.rope.dimension_count", n_embd/n_head);
+    gguf_set_val_u32(gctx, "llama.attention.head_count", n_head);
+    gguf_set_val_u32(gctx, "llama.attention.head_count_kv", n_head_kv);
+    gguf_set_val_f32(gctx, "llama.attention.layer_norm_rms_epsilon", 1e-5f);
+
+    const size_t n_params = (size_t) 2*n_vocab*n_embd + n_embd +
+        (size_t) n_layer*(2*n_embd + 2*n_embd*n_embd + 2*n_embd*(n_embd/n_head*n_head_kv) + 3*n_embd*n_ff);
+
+    struct ggml_init_params params = {
+        /*.mem_size   =*/ n_params*sizeof(float) + (4 + 9*n_layer)*ggml_tensor_overhead(),
+        /*.mem_buffer =*/ NULL,
+        /*.no_alloc   =*/ false,
+    };
+    struct ggml_context * ctx = ggml_init(params);
+
+    std::mt19937 rng(42);
+    std::uniform_real_distribution<float> dist(-0.3f, 0.3f);
+
+    auto add = [&](const std::string & name, int ne0, int ne1, bool ones) {
+        struct ggml_tensor * t = ne1 > 0 ? ggml_new_tensor_2d(ctx, GGML_TYPE_F32, ne0, ne1) : ggml_new_tensor_1d(ctx, GGML_TYPE_F32, ne0);
+        ggml_set_name(t, name.c_str());
+        float * data = (float *) t->data;
+        for (int64_t i = 0; i < ggml_nelements(t); ++i) {
+            data[i] = ones ? 1.0f : dist(rng);
+        }
+        gguf_add_tensor(gctx, t);
+    };
+
+    const int n_embd_gqa = n_embd/n_head*n_head_kv;
+
+    add("token_embd.weight",  n_embd, n_vocab, false);
+    add("output_norm.weight", n_embd, 0,       true);
+    add("output.weight",      n_embd, n_vocab, false);
+
+    for (int il = 0; il < n_layer; ++il) {
+        const std::string blk = "blk." + std::to_string(il) + ".";
+
+        add(blk + "attn_norm.weight",   n_embd, 0,          true);
+        add(blk + "attn_q.weight",      n_embd, n_embd,     false);
+        add(blk + "attn_k.weight",      n_embd, n_embd_gqa, false);
+        add(blk + "attn_v.weight",      n_embd, n_embd_gqa, false);
+        add(blk + "attn_output.weight", n_embd, n_embd,     false);
+        add(blk + "ffn_norm.weight",    n_embd, 0,          true);
+        add(blk + "ffn_gate.weight",    n_embd, n_ff,       false);
+        add(blk + "ffn_down.weight",    n_ff,   n_embd,     false);
+        add(blk + "ffn_up.weight",      n_embd, n_ff,       false);
+    }
+
+    gguf_write_to_file(gctx, fname_out, false);
+
+    gguf_free(gctx);
+    ggml_free(ctx);
+
+    return true;
+}
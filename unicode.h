@@ -357,42 +357,31 @@ static std::vector<uint32_t> codepoints_from_utf16(const std::vector<uint16_t> &
 #define CODEPOINT_TYPE_SYMBOL 6
 #define CODEPOINT_TYPE_CONTROL 7
 
-static std::unordered_map<uint32_t, int> codepoint_type_map() {
-    std::unordered_map<uint32_t, int> codepoint_types;
-    for (auto p : digit_ranges) {
-        for(auto i = p.first; i <= p.second; ++ i)
-            codepoint_types[i] = CODEPOINT_TYPE_DIGIT;
-    }
-    for(auto p : letter_ranges) {
-        for(auto i = p.first; i <= p.second; ++ i)
-            codepoint_types[i] = CODEPOINT_TYPE_LETTER;
-    }
-    for(auto p : whitespace_ranges) {
-        for(auto i = p.first; i <= p.second; ++ i)
-            codepoint_types[i] = CODEPOINT_TYPE_WHITESPACE;
-    }
-    for(auto p : accent_mark_ranges) {
-        for(auto i = p.first; i <= p.second; ++ i)
-            codepoint_types[i] = CODEPOINT_TYPE_ACCENT_MARK;
-    }
-    for(auto p : punctuation_ranges) {
-        for(auto i = p.first; i <= p.second; ++ i)
-            codepoint_types[i] = CODEPOINT_TYPE_PUNCTUATION;
-    }
-    for (auto p : symbol_ranges) {
-        for (auto i = p.first; i <= p.second; ++i)
-            codepoint_types[i] = CODEPOINT_TYPE_SYMBOL;
-    }
-    for(auto p : control_ranges) {
-        for(auto i = p.first; i <= p.second; ++ i)
-            codepoint_types[i] = CODEPOINT_TYPE_CONTROL;
-    }
+#define MAX_CODEPOINTS 0x110000
+
+// the type of every codepoint, indexed by the codepoint: one lookup per codepoint and thread-safe
+static std::vector<uint8_t> codepoint_type_table() {
+    std::vector<uint8_t> codepoint_types(MAX_CODEPOINTS, CODEPOINT_TYPE_UNIDENTIFIED);
+    auto set_ranges = [&codepoint_types](const std::vector<std::pair<uint32_t, uint32_t>> & ranges, uint8_t type) {
+        for (auto p : ranges) {
+            for (auto i = p.first; i <= p.second && i < MAX_CODEPOINTS; ++i) {
+                codepoint_types[i] = type;
+            }
+        }
+    };
+    set_ranges(digit_ranges,       CODEPOINT_TYPE_DIGIT);
+    set_ranges(letter_ranges,      CODEPOINT_TYPE_LETTER);
+    set_ranges(whitespace_ranges,  CODEPOINT_TYPE_WHITESPACE);
+    set_ranges(accent_mark_ranges, CODEPOINT_TYPE_ACCENT_MARK);
+    set_ranges(punctuation_ranges, CODEPOINT_TYPE_PUNCTUATION);
+    set_ranges(symbol_ranges,      CODEPOINT_TYPE_SYMBOL);
+    set_ranges(control_ranges,     CODEPOINT_TYPE_CONTROL);
     return codepoint_types;
 }
 
 static int codepoint_type(uint32_t cp) {
-    static std::unordered_map<uint32_t, int> codepoint_types = codepoint_type_map();
-    return codepoint_types[cp];
+    static const std::vector<uint8_t> codepoint_types = codepoint_type_table();
+    return cp < codepoint_types.size() ? codepoint_types[cp] : CODEPOINT_TYPE_UNIDENTIFIED;
 }
 
 static int codepoint_type(const std::string & utf8) {
@@ -426,9 +415,15 @@ static std::unordered_map<uint8_t, std::string> bytes_to_unicode_map_bpe() {
     return map;
 }
 
-static std::string bytes_to_unicode_bpe(uint8_t byte) {
-    static std::unordered_map<uint8_t, std::string> map = bytes_to_unicode_map_bpe();
-    return map.at(byte);
+static const std::string & bytes_to_unicode_bpe(uint8_t byte) {
+    static const std::vector<std::string> table = [] {
+        std::vector<std::string> table(256);
+        for (const auto & it : bytes_to_unicode_map_bpe()) {
+            table[it.first] = it.second;
+        }
+        return table;
+    }();
+    return table[byte];
 }
 
 static std::unordered_map<std::string, uint8_t> unicode_to_bytes_map_bpe() {
@@ -460,3 +455,19 @@ static uint8_t unicode_to_bytes_bpe(const std::string & utf8) {
     return map.at(utf8);
 }
 
+// same as unicode_to_bytes_bpe, from the codepoint: the byte-level BPE alphabet is in [0, 324)
+static uint8_t unicode_cpt_to_byte_bpe(uint32_t cp) {
+    static const std::vector<int> table = [] {
+        std::vector<int> table(324, -1);
+        for (const auto & it : unicode_to_bytes_map_bpe()) {
+            size_t offset = 0;
+            table.at(codepoint_from_utf8(it.first, offset)) = it.second;
+        }
+        return table;
+    }();
+    if (cp >= table.size() || table[cp] < 0) {
+        throw std::out_of_range("unicode_cpt_to_byte_bpe: codepoint outside of the byte-level BPE alphabet");
+    }
+    return table[cp];
+}
+